@@ -0,0 +1,244 @@
+#include "BlockScan.hpp"
+#include <string.h>
+
+int BlockIsZeroScalar(const unsigned char* data, size_t length) {
+    for (; length >= 8; data += 8, length -= 8) {
+        unsigned long long word;
+        memcpy(&word, data, sizeof(word));
+        if (word)
+            return 0;
+    }
+    for (; length; data++, length--) {
+        if (*data)
+            return 0;
+    }
+    return 1;
+}
+
+#if SIMD_X64
+
+// Both vector versions OR four vectors together before testing, which keeps the loop load-bound on zero blocks.
+
+SIMD_TARGET("sse2")
+int BlockIsZeroSse2(const unsigned char* data, size_t length) {
+    const __m128i zero = _mm_setzero_si128();
+    for (; length >= 64; data += 64, length -= 64) {
+        __m128i acc = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((const __m128i*)data), _mm_loadu_si128((const __m128i*)(data + 16))),
+            _mm_or_si128(_mm_loadu_si128((const __m128i*)(data + 32)), _mm_loadu_si128((const __m128i*)(data + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF)
+            return 0;
+    }
+    return BlockIsZeroScalar(data, length);
+}
+
+SIMD_TARGET("avx2")
+int BlockIsZeroAvx2(const unsigned char* data, size_t length) {
+    for (; length >= 128; data += 128, length -= 128) {
+        __m256i acc = _mm256_or_si256(
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i*)data), _mm256_loadu_si256((const __m256i*)(data + 32))),
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(data + 64)), _mm256_loadu_si256((const __m256i*)(data + 96))));
+        if (!_mm256_testz_si256(acc, acc))
+            return 0;
+    }
+    return BlockIsZeroSse2(data, length);
+}
+
+#endif
+
+int BlockIsZero(const unsigned char* data, size_t length, unsigned int features) {
+#if SIMD_X64
+    if (features & SIMD_FEATURE_AVX2)
+        return BlockIsZeroAvx2(data, length);
+    if (features & SIMD_FEATURE_SSE2)
+        return BlockIsZeroSse2(data, length);
+#else
+    (void)features;
+#endif
+    return BlockIsZeroScalar(data, length);
+}
+
+size_t BlockFirstDifferenceScalar(const unsigned char* first, const unsigned char* second, size_t length) {
+    size_t offset = 0;
+    for (; length - offset >= 8; offset += 8) {
+        unsigned long long a, b;
+        memcpy(&a, first + offset, sizeof(a));
+        memcpy(&b, second + offset, sizeof(b));
+        if (a != b) {
+            // Little endian, so the lowest set bit of the difference is in the first differing byte.
+            unsigned long long difference = a ^ b;
+            unsigned int low = (unsigned int)difference;
+            return offset + (low ? SimdCountTrailingZeros(low) : 32 + SimdCountTrailingZeros((unsigned int)(difference >> 32))) / 8;
+        }
+    }
+    for (; offset < length; offset++) {
+        if (first[offset] != second[offset])
+            break;
+    }
+    return offset;
+}
+
+#if SIMD_X64
+
+SIMD_TARGET("sse2")
+size_t BlockFirstDifferenceSse2(const unsigned char* first, const unsigned char* second, size_t length) {
+    size_t offset = 0;
+    for (; length - offset >= 16; offset += 16) {
+        __m128i equal = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(first + offset)), _mm_loadu_si128((const __m128i*)(second + offset)));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(equal);
+        if (mask != 0xFFFF)
+            return offset + SimdCountTrailingZeros(~mask);
+    }
+    return offset + BlockFirstDifferenceScalar(first + offset, second + offset, length - offset);
+}
+
+SIMD_TARGET("avx2")
+size_t BlockFirstDifferenceAvx2(const unsigned char* first, const unsigned char* second, size_t length) {
+    size_t offset = 0;
+    for (; length - offset >= 32; offset += 32) {
+        __m256i equal = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(first + offset)), _mm256_loadu_si256((const __m256i*)(second + offset)));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(equal);
+        if (mask != 0xFFFFFFFFu)
+            return offset + SimdCountTrailingZeros(~mask);
+    }
+    return offset + BlockFirstDifferenceSse2(first + offset, second + offset, length - offset);
+}
+
+#endif
+
+size_t BlockFirstDifference(const unsigned char* first, const unsigned char* second, size_t length, unsigned int features) {
+#if SIMD_X64
+    if (features & SIMD_FEATURE_AVX2)
+        return BlockFirstDifferenceAvx2(first, second, length);
+    if (features & SIMD_FEATURE_SSE2)
+        return BlockFirstDifferenceSse2(first, second, length);
+#else
+    (void)features;
+#endif
+    return BlockFirstDifferenceScalar(first, second, length);
+}
+
+void BlockHistogramClear(PBLOCK_HISTOGRAM histogram) {
+    memset(histogram, 0, sizeof(*histogram));
+}
+
+void BlockHistogramAddScalar(PBLOCK_HISTOGRAM histogram, const unsigned char* data, size_t length) {
+    unsigned int* counts = histogram->lanes[0];
+    for (; length; data++, length--)
+        counts[*data]++;
+}
+
+// Each 8-byte word is split into bytes in registers, and consecutive bytes go to different lanes.
+static inline void HistogramAddWord(PBLOCK_HISTOGRAM histogram, unsigned long long word) {
+    histogram->lanes[0][word & 0xFF]++;
+    histogram->lanes[1][(word >> 8) & 0xFF]++;
+    histogram->lanes[2][(word >> 16) & 0xFF]++;
+    histogram->lanes[3][(word >> 24) & 0xFF]++;
+    histogram->lanes[0][(word >> 32) & 0xFF]++;
+    histogram->lanes[1][(word >> 40) & 0xFF]++;
+    histogram->lanes[2][(word >> 48) & 0xFF]++;
+    histogram->lanes[3][word >> 56]++;
+}
+
+void BlockHistogramAddLanes(PBLOCK_HISTOGRAM histogram, const unsigned char* data, size_t length) {
+    for (; length >= 16; data += 16, length -= 16) {
+        unsigned long long low, high;
+        memcpy(&low, data, sizeof(low));
+        memcpy(&high, data + 8, sizeof(high));
+        HistogramAddWord(histogram, low);
+        HistogramAddWord(histogram, high);
+    }
+    BlockHistogramAddScalar(histogram, data, length);
+}
+
+// There is no scatter-increment below AVX-512 conflict detection, so counting stays in general registers on every
+// feature level; only the merge is vectorized.
+void BlockHistogramAdd(PBLOCK_HISTOGRAM histogram, const unsigned char* data, size_t length) {
+    BlockHistogramAddLanes(histogram, data, length);
+}
+
+void BlockHistogramMerge(const BLOCK_HISTOGRAM* histogram, unsigned int counts[256], unsigned int features) {
+#if SIMD_X64
+    if (features & SIMD_FEATURE_SSE2) {
+        for (int i = 0; i < 256; i += 4) {
+            __m128i sum = _mm_loadu_si128((const __m128i*)&histogram->lanes[0][i]);
+            for (int lane = 1; lane < BLOCK_HISTOGRAM_LANES; lane++)
+                sum = _mm_add_epi32(sum, _mm_loadu_si128((const __m128i*)&histogram->lanes[lane][i]));
+            _mm_storeu_si128((__m128i*)&counts[i], sum);
+        }
+        return;
+    }
+#else
+    (void)features;
+#endif
+    for (int i = 0; i < 256; i++) {
+        unsigned int sum = 0;
+        for (int lane = 0; lane < BLOCK_HISTOGRAM_LANES; lane++)
+            sum += histogram->lanes[lane][i];
+        counts[i] = sum;
+    }
+}
+
+// log2(1 + i / 256) as 16.16 fixed point
+static const unsigned int g_log2Mantissa[257] = {
+    0, 369, 736, 1102, 1466, 1829, 2190, 2551, 2909, 3267, 3623, 3978,
+    4331, 4683, 5034, 5384, 5732, 6079, 6425, 6769, 7112, 7454, 7795, 8134,
+    8473, 8810, 9146, 9480, 9814, 10146, 10477, 10807, 11136, 11464, 11791, 12116,
+    12440, 12764, 13086, 13407, 13727, 14046, 14363, 14680, 14996, 15310, 15624, 15937,
+    16248, 16559, 16868, 17177, 17484, 17791, 18096, 18401, 18704, 19007, 19308, 19609,
+    19909, 20207, 20505, 20802, 21098, 21393, 21687, 21980, 22272, 22564, 22854, 23144,
+    23433, 23720, 24007, 24293, 24579, 24863, 25146, 25429, 25711, 25992, 26272, 26551,
+    26830, 27108, 27384, 27660, 27936, 28210, 28484, 28757, 29029, 29300, 29571, 29840,
+    30109, 30378, 30645, 30912, 31178, 31443, 31707, 31971, 32234, 32496, 32758, 33019,
+    33279, 33538, 33797, 34055, 34312, 34569, 34825, 35080, 35334, 35588, 35841, 36094,
+    36346, 36597, 36847, 37097, 37346, 37595, 37842, 38090, 38336, 38582, 38827, 39072,
+    39316, 39559, 39802, 40044, 40286, 40527, 40767, 41006, 41246, 41484, 41722, 41959,
+    42196, 42432, 42667, 42902, 43137, 43370, 43603, 43836, 44068, 44300, 44530, 44761,
+    44990, 45220, 45448, 45676, 45904, 46131, 46357, 46583, 46809, 47034, 47258, 47482,
+    47705, 47928, 48150, 48372, 48593, 48813, 49034, 49253, 49472, 49691, 49909, 50127,
+    50344, 50560, 50776, 50992, 51207, 51422, 51636, 51850, 52063, 52276, 52488, 52700,
+    52911, 53122, 53332, 53542, 53751, 53960, 54169, 54377, 54584, 54791, 54998, 55204,
+    55410, 55615, 55820, 56025, 56229, 56432, 56635, 56838, 57040, 57242, 57443, 57644,
+    57845, 58045, 58245, 58444, 58643, 58841, 59039, 59237, 59434, 59631, 59827, 60023,
+    60219, 60414, 60609, 60803, 60997, 61190, 61384, 61576, 61769, 61961, 62152, 62343,
+    62534, 62725, 62915, 63104, 63294, 63483, 63671, 63859, 64047, 64234, 64421, 64608,
+    64794, 64980, 65166, 65351, 65536,
+};
+
+// The integer part is the position of the top bit; the fraction is interpolated between table entries from the 16
+// bits below it, which keeps the error under 2^-16.
+unsigned int FixedLog2(unsigned long long value) {
+    unsigned int leadingZeros = SimdCountLeadingZeros64(value);
+    unsigned int integer = 63 - leadingZeros;
+    value <<= leadingZeros;
+
+    unsigned int index = (unsigned int)(value >> 55) & 0xFF;
+    unsigned int step = (unsigned int)(value >> 47) & 0xFF;
+    unsigned int low = g_log2Mantissa[index];
+    unsigned int fraction = low + (((g_log2Mantissa[index + 1] - low) * step + 128) >> 8);
+    return (integer << 16) + fraction;
+}
+
+// H = log2(N) - sum(c * log2(c)) / N, which needs one logarithm per distinct byte value. Counts are scaled down until
+// N * log2(N) fits 64 bits; that only drops rounding noise from the proportions.
+unsigned int HistogramEntropy(const unsigned long long counts[256]) {
+    unsigned long long total = 0;
+    for (int i = 0; i < 256; i++)
+        total += counts[i];
+    unsigned int shift = 0;
+    while ((total >> shift) >= (1ull << 40))
+        shift++;
+
+    total = 0;
+    unsigned long long weighted = 0;
+    for (int i = 0; i < 256; i++) {
+        unsigned long long count = counts[i] >> shift;
+        if (!count)
+            continue;
+        total += count;
+        weighted += count * FixedLog2(count);
+    }
+    if (!total)
+        return 0;
+    return (unsigned int)((total * FixedLog2(total) - weighted) / total);
+}
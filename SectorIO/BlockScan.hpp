@@ -0,0 +1,44 @@
+#pragma once
+// Per-block classification kernels used by the range IOCTLs. Kept free of WDK dependencies so they build on the host.
+#include "SimdCommon.hpp"
+
+// Nonzero when all length bytes are zero. Bails out at the first nonzero vector, so data blocks cost next to nothing.
+int BlockIsZeroScalar(const unsigned char* data, size_t length);
+#if SIMD_X64
+int BlockIsZeroSse2(const unsigned char* data, size_t length);
+int BlockIsZeroAvx2(const unsigned char* data, size_t length);
+#endif
+
+// Picks the widest implementation allowed by the SIMD_FEATURE_* mask.
+int BlockIsZero(const unsigned char* data, size_t length, unsigned int features);
+
+// Offset of the first byte at which the two buffers differ, or length if they are equal.
+size_t BlockFirstDifferenceScalar(const unsigned char* first, const unsigned char* second, size_t length);
+#if SIMD_X64
+size_t BlockFirstDifferenceSse2(const unsigned char* first, const unsigned char* second, size_t length);
+size_t BlockFirstDifferenceAvx2(const unsigned char* first, const unsigned char* second, size_t length);
+#endif
+size_t BlockFirstDifference(const unsigned char* first, const unsigned char* second, size_t length, unsigned int features);
+
+// Byte histograms. Incrementing one table stalls on store forwarding whenever neighbouring bytes are equal, which is
+// the common case in anything but random data, so counts are spread over several tables and merged at the end.
+#define BLOCK_HISTOGRAM_LANES 4
+
+typedef struct _BLOCK_HISTOGRAM {
+    unsigned int lanes[BLOCK_HISTOGRAM_LANES][256];
+} BLOCK_HISTOGRAM, *PBLOCK_HISTOGRAM;
+
+void BlockHistogramClear(PBLOCK_HISTOGRAM histogram);
+// Adds the bytes to the histogram. The scalar version counts into one table and is the reference for the lanes one,
+// which BlockHistogramAdd uses.
+void BlockHistogramAddScalar(PBLOCK_HISTOGRAM histogram, const unsigned char* data, size_t length);
+void BlockHistogramAddLanes(PBLOCK_HISTOGRAM histogram, const unsigned char* data, size_t length);
+void BlockHistogramAdd(PBLOCK_HISTOGRAM histogram, const unsigned char* data, size_t length);
+// Sums the lanes into counts. Uses SSE2 at most, so it needs no SIMD scope.
+void BlockHistogramMerge(const BLOCK_HISTOGRAM* histogram, unsigned int counts[256], unsigned int features);
+
+// Shannon entropy of the counted bytes in bits per byte, as 16.16 fixed point: 0 for a single repeated value up to
+// 8 << 16 for uniformly distributed bytes. Integer only, so it needs no floating point state in the kernel.
+unsigned int HistogramEntropy(const unsigned long long counts[256]);
+// log2(value) as 16.16 fixed point; value has to be nonzero.
+unsigned int FixedLog2(unsigned long long value);
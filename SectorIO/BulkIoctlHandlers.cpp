@@ -0,0 +1,672 @@
+#include "BulkIoctlHandlers.hpp"
+#include "VolumeBitmap.hpp"
+
+typedef struct _COPY_SLOT {
+    PUCHAR pBuffer;
+    PMDL pMdl;
+    STORAGE_IO io;          // the read of the chunk, then its write when the destination is a storage object
+    BOOLEAN pending;
+    ULONGLONG byteOffset;   // source offset
+    ULONG length;
+} COPY_SLOT, *PCOPY_SLOT;
+
+typedef struct _COPY_ENGINE {
+    PSTORAGE_OBJECT pSource;
+    ULONGLONG startOffset;
+    ULONGLONG endOffset;
+    ULONGLONG nextOffset;
+    PVOLUME_RANGE pRanges;  // OPTIONAL, only these parts of the range are copied
+    ULONG rangeCount;
+    ULONG rangeIndex;
+
+    // Exactly one destination; its offset is the source offset plus destinationDelta.
+    PSTORAGE_OBJECT pDestination;
+    HANDLE fileHandle;
+    LONGLONG destinationDelta;
+
+    ULONG chunkBytes;
+    ULONG depth;
+    COPY_SLOT slots[SECTOR_BULK_MAX_DEPTH];
+    PSECTOR_JOB pJob;
+} COPY_ENGINE, *PCOPY_ENGINE;
+
+static NTSTATUS CopyStartRead(IN PCOPY_ENGINE pEngine, IN PCOPY_SLOT pSlot) {
+    ULONGLONG pieceEnd = pEngine->endOffset;
+    if (pEngine->pRanges) {
+        while (pEngine->rangeIndex < pEngine->rangeCount && pEngine->pRanges[pEngine->rangeIndex].endOffset <= pEngine->nextOffset)
+            pEngine->rangeIndex++;
+        if (pEngine->rangeIndex == pEngine->rangeCount)
+            pEngine->nextOffset = pEngine->endOffset;
+        else {
+            pEngine->nextOffset = max(pEngine->nextOffset, pEngine->pRanges[pEngine->rangeIndex].startOffset);
+            pieceEnd = pEngine->pRanges[pEngine->rangeIndex].endOffset;
+        }
+    }
+    if (pEngine->nextOffset >= pEngine->endOffset)
+        return STATUS_SUCCESS;
+    if (JobShouldStop(pEngine->pJob))
+        return STATUS_CANCELLED;
+
+    pSlot->byteOffset = pEngine->nextOffset;
+    pSlot->length = (ULONG)min((ULONGLONG)pEngine->chunkBytes, pieceEnd - pEngine->nextOffset);
+    StorageIoInitialize(&pSlot->io, pEngine->pSource, FALSE, pSlot->pMdl, pSlot->byteOffset, pSlot->length, pEngine->pJob->pIrp);
+
+    NTSTATUS status = StorageIoStart(&pSlot->io);
+    if (status != STATUS_PENDING)
+        return status;
+    pSlot->pending = TRUE;
+    pEngine->nextOffset += pSlot->length;
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS CopyFinish(IN PCOPY_SLOT pSlot) {
+    ULONG_PTR transferred = 0;
+    NTSTATUS status = StorageIoWait(&pSlot->io, &transferred);
+    pSlot->pending = FALSE;
+    if (NT_SUCCESS(status) && transferred < pSlot->length)
+        status = STATUS_DEVICE_DATA_ERROR;
+    if (!NT_SUCCESS(status))
+        LOG("  copy %s at %llu failed: 0x%08X\n", pSlot->io.isWrite ? "write" : "read", pSlot->io.byteOffset, status);
+    return status;
+}
+
+NTSTATUS WriteCopyDestinationFile(IN HANDLE fileHandle, IN LONGLONG offset, IN PVOID pBuffer, IN ULONG length) {
+    IO_STATUS_BLOCK ioStatusBlock;
+    LARGE_INTEGER fileOffset;
+    fileOffset.QuadPart = offset;
+
+    NTSTATUS status = ZwWriteFile(fileHandle, NULL, NULL, NULL, &ioStatusBlock, pBuffer, length, &fileOffset, NULL);
+    if (status == STATUS_PENDING) {
+        // Handle opened for asynchronous I/O; the file object is signaled when the write completes.
+        ZwWaitForSingleObject(fileHandle, FALSE, NULL);
+        status = ioStatusBlock.Status;
+    }
+    if (NT_SUCCESS(status) && ioStatusBlock.Information < length)
+        status = STATUS_DISK_FULL;
+    if (!NT_SUCCESS(status))
+        LOG("  copy file write at %lld failed: 0x%08X\n", offset, status);
+    return status;
+}
+
+// Chunk n always lives in slot n % depth. While one chunk is written, the reads of the following chunks are in flight,
+// and a slot is refilled as soon as its write has finished.
+static NTSTATUS RunCopyEngine(IN PCOPY_ENGINE pEngine) {
+    NTSTATUS status = STATUS_SUCCESS;
+    for (ULONG i = 0; i < pEngine->depth && NT_SUCCESS(status); i++)
+        status = CopyStartRead(pEngine, &pEngine->slots[i]);
+
+    for (ULONG i = 0; NT_SUCCESS(status); i++) {
+        PCOPY_SLOT pSlot = &pEngine->slots[i % pEngine->depth];
+        if (!pSlot->pending)
+            break;
+
+        status = CopyFinish(pSlot);
+        if (!NT_SUCCESS(status))
+            break;
+
+        if (pEngine->fileHandle) {
+            status = WriteCopyDestinationFile(pEngine->fileHandle, (LONGLONG)pSlot->byteOffset + pEngine->destinationDelta, pSlot->pBuffer, pSlot->length);
+            if (!NT_SUCCESS(status))
+                break;
+            JobAddProgress(pEngine->pJob, pSlot->length);
+            status = CopyStartRead(pEngine, pSlot);
+            continue;
+        }
+
+        StorageIoInitialize(&pSlot->io, pEngine->pDestination, TRUE, pSlot->pMdl, pSlot->byteOffset + pEngine->destinationDelta, pSlot->length, pEngine->pJob->pIrp);
+        status = StorageIoStart(&pSlot->io);
+        if (status != STATUS_PENDING)
+            break;
+        pSlot->pending = TRUE;
+        status = STATUS_SUCCESS;
+
+        // The previous chunk's write has had a whole read wait to finish; recycle its slot.
+        PCOPY_SLOT pPrevious = &pEngine->slots[(i + pEngine->depth - 1) % pEngine->depth];
+        if (pPrevious != pSlot && pPrevious->pending && pPrevious->io.isWrite) {
+            status = CopyFinish(pPrevious);
+            if (!NT_SUCCESS(status))
+                break;
+            JobAddProgress(pEngine->pJob, pPrevious->length);
+            status = CopyStartRead(pEngine, pPrevious);
+        }
+    }
+
+    for (ULONG i = 0; i < pEngine->depth; i++) {
+        PCOPY_SLOT pSlot = &pEngine->slots[i];
+        if (!pSlot->pending)
+            continue;
+        BOOLEAN isWrite = pSlot->io.isWrite;
+        NTSTATUS drainStatus = CopyFinish(pSlot);
+        if (isWrite && NT_SUCCESS(drainStatus))
+            JobAddProgress(pEngine->pJob, pSlot->length);
+        else if (isWrite && NT_SUCCESS(status))
+            status = drainStatus;
+    }
+    return status;
+}
+
+static NTSTATUS OpenCopyDestinationFile(IN ULONGLONG userHandle, OUT PHANDLE pKernelHandle) {
+    PFILE_OBJECT pFileObject = NULL;
+    // Validated against the caller's handle table and access rights, then reopened as a kernel handle so the writes
+    // do not depend on the caller keeping its handle open.
+    NTSTATUS status = ObReferenceObjectByHandle((HANDLE)(ULONG_PTR)userHandle, FILE_WRITE_DATA, *IoFileObjectType, UserMode, (PVOID*)&pFileObject, NULL);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    status = ObOpenObjectByPointer(pFileObject, OBJ_KERNEL_HANDLE, NULL, FILE_WRITE_DATA, *IoFileObjectType, KernelMode, pKernelHandle);
+    ObDereferenceObject(pFileObject);
+    return status;
+}
+
+NTSTATUS OpenCopyDestination(IN PSTORAGE_OBJECT pSource, IN ULONGLONG startOffset, IN ULONGLONG totalBytes, IN ULONG chunkBytes,
+    IN ULONG destinationType, IN PSTORAGE_LOCATION pLocation, IN ULONGLONG userFileHandle, IN ULONGLONG fileOffset,
+    OUT PSTORAGE_OBJECT* ppDestination, OUT PHANDLE pFileHandle, OUT PLONGLONG pDestinationDelta) {
+    *ppDestination = NULL;
+    *pFileHandle = NULL;
+    *pDestinationDelta = 0;
+
+    if (destinationType == SECTOR_COPY_TO_STORAGE) {
+        PSTORAGE_OBJECT pDestination = FindStorageObject(pLocation);
+        if (!pDestination)
+            return STATUS_DEVICE_NOT_CONNECTED;
+
+        ULONG destinationSectorSize = pDestination->info.sectorSize;
+        if (destinationSectorSize == 0 || totalBytes % destinationSectorSize || chunkBytes % destinationSectorSize)
+            return STATUS_INVALID_PARAMETER;
+        NTSTATUS status = ValidateSectorRange(pDestination, pLocation->sectorNumber, totalBytes / destinationSectorSize);
+        if (!NT_SUCCESS(status))
+            return status;
+
+        // A partition and the raw disk it is on, or two partitions of one disk, overlap wherever their disk offsets do.
+        ULONGLONG destinationOffset = pLocation->sectorNumber * destinationSectorSize;
+        if (pDestination == pSource ||
+            (pSource->info.diskIndex != (ULONG)-1 && pDestination->info.diskIndex == pSource->info.diskIndex)) {
+            ULONGLONG sourceDiskOffset = (pSource->info.isRawDiskObject ? 0 : pSource->info.partitionStartingOffset) + startOffset;
+            ULONGLONG destinationDiskOffset = (pDestination->info.isRawDiskObject ? 0 : pDestination->info.partitionStartingOffset) + destinationOffset;
+            if (destinationDiskOffset < sourceDiskOffset + totalBytes && sourceDiskOffset < destinationDiskOffset + totalBytes) {
+                LOG("  source and destination ranges overlap\n");
+                return STATUS_INVALID_PARAMETER;
+            }
+        }
+        *ppDestination = pDestination;
+        *pDestinationDelta = (LONGLONG)(destinationOffset - startOffset);
+        return STATUS_SUCCESS;
+    }
+
+    if (destinationType == SECTOR_COPY_TO_FILE) {
+        if (fileOffset > MAXLONGLONG - totalBytes)
+            return STATUS_INVALID_PARAMETER;
+        NTSTATUS status = OpenCopyDestinationFile(userFileHandle, pFileHandle);
+        if (!NT_SUCCESS(status)) {
+            LOG("  destination file handle rejected: 0x%08X\n", status);
+            return status;
+        }
+        *pDestinationDelta = (LONGLONG)(fileOffset - startOffset);
+        return STATUS_SUCCESS;
+    }
+    return STATUS_INVALID_PARAMETER;
+}
+
+// Lets the skipped ranges of an allocation-only copy stay holes, and extends the file over them so the image has the
+// size of the source range even when it ends in free space. File systems without sparse files keep a dense image.
+static void PrepareSparseDestinationFile(IN HANDLE fileHandle, IN ULONGLONG endOffset) {
+    IO_STATUS_BLOCK ioStatusBlock;
+    NTSTATUS status = ZwFsControlFile(fileHandle, NULL, NULL, NULL, &ioStatusBlock, FSCTL_SET_SPARSE, NULL, 0, NULL, 0);
+    if (status == STATUS_PENDING) {
+        ZwWaitForSingleObject(fileHandle, FALSE, NULL);
+        status = ioStatusBlock.Status;
+    }
+    if (!NT_SUCCESS(status)) {
+        LOG("  destination file cannot be made sparse: 0x%08X\n", status);
+        return;
+    }
+
+    FILE_STANDARD_INFORMATION standardInformation;
+    status = ZwQueryInformationFile(fileHandle, &ioStatusBlock, &standardInformation, sizeof(standardInformation), FileStandardInformation);
+    if (NT_SUCCESS(status) && (ULONGLONG)standardInformation.EndOfFile.QuadPart < endOffset) {
+        FILE_END_OF_FILE_INFORMATION endOfFile;
+        endOfFile.EndOfFile.QuadPart = (LONGLONG)endOffset;
+        ZwSetInformationFile(fileHandle, &ioStatusBlock, &endOfFile, sizeof(endOfFile), FileEndOfFileInformation);
+    }
+}
+
+// Number of SECTOR_RUN entries needed to describe the whole range: every copied range, plus the gaps around them.
+static ULONG CountCopyRuns(IN PCOPY_ENGINE pEngine) {
+    ULONG runs = 0;
+    ULONGLONG position = pEngine->startOffset;
+    for (ULONG i = 0; i < pEngine->rangeCount; i++) {
+        runs += pEngine->pRanges[i].startOffset > position ? 2 : 1;
+        position = pEngine->pRanges[i].endOffset;
+    }
+    return runs + (position < pEngine->endOffset ? 1 : 0);
+}
+
+static void WriteCopyRuns(IN PCOPY_ENGINE pEngine, IN ULONG sectorSize, OUT PSECTOR_RUN pRuns) {
+    ULONGLONG position = pEngine->startOffset;
+    for (ULONG i = 0; i <= pEngine->rangeCount; i++) {
+        ULONGLONG gapEnd = i < pEngine->rangeCount ? pEngine->pRanges[i].startOffset : pEngine->endOffset;
+        if (gapEnd > position) {
+            pRuns->startSector = position / sectorSize;
+            pRuns->sectorCount = (gapEnd - position) / sectorSize;
+            pRuns->type = SECTOR_RUN_UNALLOCATED;
+            pRuns++;
+        }
+        if (i == pEngine->rangeCount)
+            break;
+        pRuns->startSector = pEngine->pRanges[i].startOffset / sectorSize;
+        pRuns->sectorCount = (pEngine->pRanges[i].endOffset - pEngine->pRanges[i].startOffset) / sectorSize;
+        pRuns->type = SECTOR_RUN_DATA;
+        pRuns++;
+        position = pEngine->pRanges[i].endOffset;
+    }
+}
+
+NTSTATUS CopySectorsIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject) {
+    LOG("CopySectorsIoctlHandler called\n");
+    if (!pStorageObject)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    SECTOR_COPY_REQUEST request;
+    PVOID userInput = pIrpStack->Parameters.DeviceIoControl.Type3InputBuffer;
+    if (!userInput || pIrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(request))
+        return STATUS_INFO_LENGTH_MISMATCH;
+
+    __try {
+        ProbeForRead(userInput, sizeof(request), 1);
+        RtlCopyMemory(&request, userInput, sizeof(request));
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return GetExceptionCode();
+    }
+
+    ULONG outLength = pIrpStack->Parameters.DeviceIoControl.OutputBufferLength;
+    PVOID outBuffer = pIrp->UserBuffer;
+    if (outBuffer && outLength < sizeof(SECTOR_COPY_RESULT))
+        return STATUS_INFO_LENGTH_MISMATCH;
+
+    NTSTATUS status = ValidateSectorRange(pStorageObject, request.location.sectorNumber, request.sectorCount);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    ULONG sectorSize = pStorageObject->info.sectorSize;
+    ULONG depth = request.depth ? request.depth : SECTOR_BULK_DEFAULT_DEPTH;
+    ULONGLONG chunkBytes = request.chunkSectors ? (ULONGLONG)request.chunkSectors * sectorSize : STORAGE_IO_DEFAULT_CHUNK_BYTES;
+    if (depth < 2 || depth > SECTOR_BULK_MAX_DEPTH || chunkBytes > SECTOR_BULK_MAX_CHUNK_BYTES || chunkBytes % sectorSize ||
+        depth * chunkBytes > SECTOR_BULK_MAX_BUFFER_BYTES || (request.flags & ~SECTOR_COPY_ALLOCATED_ONLY))
+        return STATUS_INVALID_PARAMETER;
+
+    PCOPY_ENGINE pEngine = new (NON_PAGED) COPY_ENGINE;
+    if (!pEngine)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    RtlZeroMemory(pEngine, sizeof(*pEngine));
+    pEngine->pSource = pStorageObject;
+    pEngine->startOffset = request.location.sectorNumber * sectorSize;
+    pEngine->endOffset = pEngine->startOffset + request.sectorCount * sectorSize;
+    pEngine->nextOffset = pEngine->startOffset;
+    pEngine->chunkBytes = (ULONG)chunkBytes;
+    pEngine->depth = depth;
+
+    SECTOR_JOB job;
+    BOOLEAN jobStarted = FALSE;
+    ULONGLONG totalBytes = pEngine->endOffset - pEngine->startOffset;
+    ULONGLONG copyBytes = totalBytes;
+    ULONG runCount = 0;
+
+    status = OpenCopyDestination(pStorageObject, pEngine->startOffset, totalBytes, pEngine->chunkBytes, request.destinationType,
+        &request.destination, request.fileHandle, request.fileOffset, &pEngine->pDestination, &pEngine->fileHandle, &pEngine->destinationDelta);
+    if (!NT_SUCCESS(status))
+        goto Done;
+
+    if (request.flags & SECTOR_COPY_ALLOCATED_ONLY) {
+        status = VolumeAllocatedRanges(pStorageObject, pEngine->startOffset, pEngine->endOffset, &pEngine->pRanges, &pEngine->rangeCount);
+        if (!NT_SUCCESS(status)) {
+            LOG("  volume bitmap unavailable: 0x%08X\n", status);
+            goto Done;
+        }
+        // Nothing allocated in the range leaves no list at all, which the engine would take as copying everything.
+        if (!pEngine->pRanges)
+            pEngine->nextOffset = pEngine->endOffset;
+
+        copyBytes = 0;
+        for (ULONG i = 0; i < pEngine->rangeCount; i++)
+            copyBytes += pEngine->pRanges[i].endOffset - pEngine->pRanges[i].startOffset;
+        runCount = CountCopyRuns(pEngine);
+
+        if (outBuffer && outLength - sizeof(SECTOR_COPY_RESULT) < (ULONGLONG)runCount * sizeof(SECTOR_RUN)) {
+            __try {
+                ProbeForWrite(outBuffer, sizeof(SECTOR_COPY_RESULT), 1);
+                RtlZeroMemory(outBuffer, sizeof(SECTOR_COPY_RESULT));
+                ((PSECTOR_COPY_RESULT)outBuffer)->bytesSkipped = totalBytes - copyBytes;
+                ((PSECTOR_COPY_RESULT)outBuffer)->runCount = runCount;
+                pIrp->IoStatus.Information = sizeof(SECTOR_COPY_RESULT);
+                status = STATUS_BUFFER_TOO_SMALL;
+            }
+            __except (EXCEPTION_EXECUTE_HANDLER) {
+                status = GetExceptionCode();
+            }
+            goto Done;
+        }
+        if (pEngine->fileHandle)
+            PrepareSparseDestinationFile(pEngine->fileHandle, request.fileOffset + totalBytes);
+    }
+
+    for (ULONG i = 0; i < depth; i++) {
+        status = StorageIoAllocateBuffer(pEngine->chunkBytes, &pEngine->slots[i].pBuffer, &pEngine->slots[i].pMdl);
+        if (!NT_SUCCESS(status))
+            goto Done;
+    }
+
+    status = JobStart(&job, request.jobId, SECTOR_JOB_COPY, copyBytes, pIrp);
+    if (!NT_SUCCESS(status))
+        goto Done;
+    jobStarted = TRUE;
+    pEngine->pJob = &job;
+
+    LOG("  copying %llu of %llu bytes from %llu, %u x %u byte buffers\n", copyBytes, totalBytes, pEngine->startOffset, depth, pEngine->chunkBytes);
+    status = RunCopyEngine(pEngine);
+    LOG("  copy finished: 0x%08X, %llu bytes\n", status, (ULONGLONG)job.bytesDone);
+
+    if (outBuffer) {
+        ULONG resultLength = sizeof(SECTOR_COPY_RESULT) + runCount * sizeof(SECTOR_RUN);
+        __try {
+            ProbeForWrite(outBuffer, resultLength, 1);
+            ((PSECTOR_COPY_RESULT)outBuffer)->bytesCopied = (ULONGLONG)job.bytesDone;
+            ((PSECTOR_COPY_RESULT)outBuffer)->elapsed100ns = JobElapsed100ns(&job);
+            ((PSECTOR_COPY_RESULT)outBuffer)->bytesSkipped = totalBytes - copyBytes;
+            ((PSECTOR_COPY_RESULT)outBuffer)->runCount = runCount;
+            if (runCount)
+                WriteCopyRuns(pEngine, sectorSize, (PSECTOR_RUN)((PUCHAR)outBuffer + sizeof(SECTOR_COPY_RESULT)));
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER) {
+            if (NT_SUCCESS(status))
+                status = GetExceptionCode();
+        }
+        if (NT_SUCCESS(status))
+            pIrp->IoStatus.Information = resultLength;
+    }
+
+Done:
+    if (jobStarted) JobFinish(&job);
+    if (pEngine->fileHandle) ZwClose(pEngine->fileHandle);
+    for (ULONG i = 0; i < SECTOR_BULK_MAX_DEPTH; i++)
+        StorageIoFreeBuffer(pEngine->slots[i].pBuffer, pEngine->slots[i].pMdl);
+    delete[] pEngine->pRanges;
+    delete pEngine;
+    return status;
+}
+
+// Unmapped in pieces so cancellation and progress stay responsive on very large ranges.
+#define WIPE_TRIM_PIECE_BYTES (256ULL * 1024 * 1024)
+
+typedef struct _WIPE_SLOT {
+    PUCHAR pBuffer;         // shared by all slots unless every write needs fresh random data
+    PMDL pMdl;
+    STORAGE_IO io;
+    BOOLEAN pending;
+} WIPE_SLOT, *PWIPE_SLOT;
+
+typedef struct _WIPE_ENGINE {
+    PSTORAGE_OBJECT pStorageObject;
+    ULONGLONG nextOffset;
+    ULONGLONG endOffset;
+    ULONG chunkBytes;
+    ULONG depth;
+    ULONG mode;
+    ULONGLONG random[4];    // xoshiro256** state
+    PUCHAR pSharedBuffer;
+    WIPE_SLOT slots[SECTOR_WIPE_MAX_DEPTH];
+
+    PSECTOR_JOB pJob;
+    ULONGLONG bytesWritten;
+    ULONGLONG bytesTrimmed;
+} WIPE_ENGINE, *PWIPE_ENGINE;
+
+static inline ULONGLONG RotateLeft64(ULONGLONG value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static void WipeSeedRandom(IN PWIPE_ENGINE pEngine) {
+    ULONG seed = (ULONG)KeQueryPerformanceCounter(NULL).QuadPart;
+    // splitmix64 expansion of the seed so no state word starts out zero
+    ULONGLONG x = ((ULONGLONG)RtlRandomEx(&seed) << 32) ^ RtlRandomEx(&seed) ^ KeQueryInterruptTime();
+    for (int i = 0; i < 4; i++) {
+        x += 0x9E3779B97F4A7C15ULL;
+        ULONGLONG z = x;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        pEngine->random[i] = z ^ (z >> 31);
+    }
+}
+
+static void WipeFillRandom(IN PWIPE_ENGINE pEngine, OUT PUCHAR pBuffer, IN ULONG length) {
+    ULONGLONG* s = pEngine->random;
+    for (ULONG i = 0; i + sizeof(ULONGLONG) <= length; i += sizeof(ULONGLONG)) {
+        ULONGLONG value = RotateLeft64(s[1] * 5, 7) * 9;
+        ULONGLONG t = s[1] << 17;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = RotateLeft64(s[3], 45);
+        *(ULONGLONG*)(pBuffer + i) = value;
+    }
+}
+
+static NTSTATUS WipeStartWrite(IN PWIPE_ENGINE pEngine, IN PWIPE_SLOT pSlot) {
+    if (pEngine->nextOffset >= pEngine->endOffset)
+        return STATUS_SUCCESS;
+    if (JobShouldStop(pEngine->pJob))
+        return STATUS_CANCELLED;
+
+    ULONG length = (ULONG)min((ULONGLONG)pEngine->chunkBytes, pEngine->endOffset - pEngine->nextOffset);
+    if (pEngine->mode == SECTOR_WIPE_RANDOM)
+        WipeFillRandom(pEngine, pSlot->pBuffer, length);
+
+    // The MDL covers the whole buffer; the lower driver only transfers the first length bytes.
+    StorageIoInitialize(&pSlot->io, pEngine->pStorageObject, TRUE, pSlot->pMdl, pEngine->nextOffset, length, pEngine->pJob->pIrp);
+    NTSTATUS status = StorageIoStart(&pSlot->io);
+    if (status != STATUS_PENDING)
+        return status;
+    pSlot->pending = TRUE;
+    pEngine->nextOffset += length;
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS WipeFinishWrite(IN PWIPE_ENGINE pEngine, IN PWIPE_SLOT pSlot) {
+    ULONG_PTR transferred = 0;
+    NTSTATUS status = StorageIoWait(&pSlot->io, &transferred);
+    pSlot->pending = FALSE;
+    if (NT_SUCCESS(status) && transferred < pSlot->io.length)
+        status = STATUS_DEVICE_DATA_ERROR;
+    if (!NT_SUCCESS(status)) {
+        LOG("  wipe write at %llu failed: 0x%08X\n", pSlot->io.byteOffset, status);
+        return status;
+    }
+
+    pEngine->bytesWritten += pSlot->io.length;
+    JobAddProgress(pEngine->pJob, pSlot->io.length);
+    return STATUS_SUCCESS;
+}
+
+static void WipeTrim(IN PWIPE_ENGINE pEngine) {
+    if (!StorageSupportsTrim(pEngine->pStorageObject)) {
+        LOG("  device does not report TRIM support, writing zeros instead\n");
+        return;
+    }
+
+    while (pEngine->nextOffset < pEngine->endOffset && !JobShouldStop(pEngine->pJob)) {
+        ULONGLONG length = min(WIPE_TRIM_PIECE_BYTES, pEngine->endOffset - pEngine->nextOffset);
+        NTSTATUS status = StorageTrim(pEngine->pStorageObject, pEngine->nextOffset, length);
+        if (!NT_SUCCESS(status)) {
+            // Whatever is left gets written instead
+            LOG("  trim at %llu failed: 0x%08X, writing zeros from here\n", pEngine->nextOffset, status);
+            return;
+        }
+        pEngine->nextOffset += length;
+        pEngine->bytesTrimmed += length;
+        JobAddProgress(pEngine->pJob, length);
+    }
+}
+
+static NTSTATUS RunWipeEngine(IN PWIPE_ENGINE pEngine) {
+    NTSTATUS status = STATUS_SUCCESS;
+    for (ULONG i = 0; i < pEngine->depth && NT_SUCCESS(status); i++)
+        status = WipeStartWrite(pEngine, &pEngine->slots[i]);
+
+    for (ULONG i = 0; NT_SUCCESS(status); i++) {
+        PWIPE_SLOT pSlot = &pEngine->slots[i % pEngine->depth];
+        if (!pSlot->pending)
+            break;
+        status = WipeFinishWrite(pEngine, pSlot);
+        if (NT_SUCCESS(status))
+            status = WipeStartWrite(pEngine, pSlot);
+    }
+
+    for (ULONG i = 0; i < pEngine->depth; i++) {
+        if (!pEngine->slots[i].pending)
+            continue;
+        NTSTATUS drainStatus = WipeFinishWrite(pEngine, &pEngine->slots[i]);
+        if (NT_SUCCESS(status))
+            status = drainStatus;
+    }
+    return status;
+}
+
+NTSTATUS WipeSectorsIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject) {
+    LOG("WipeSectorsIoctlHandler called\n");
+    if (!pStorageObject)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    ULONG outLength = pIrpStack->Parameters.DeviceIoControl.OutputBufferLength;
+    PVOID outBuffer = pIrp->UserBuffer;
+    if (outBuffer && outLength < sizeof(SECTOR_WIPE_RESULT))
+        return STATUS_INFO_LENGTH_MISMATCH;
+
+    PUCHAR pInput = NULL;
+    ULONG inputLength = 0;
+    NTSTATUS status = CaptureIoctlInput(pIrpStack, sizeof(SECTOR_WIPE_REQUEST), sizeof(SECTOR_WIPE_REQUEST) + PAGE_SIZE, &pInput, &inputLength);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    PSECTOR_WIPE_REQUEST pRequest = (PSECTOR_WIPE_REQUEST)pInput;
+    ULONG sectorSize = pStorageObject->info.sectorSize;
+    ULONG depth = pRequest->depth ? pRequest->depth : SECTOR_WIPE_DEFAULT_DEPTH;
+    ULONGLONG chunkBytes = pRequest->chunkSectors ? (ULONGLONG)pRequest->chunkSectors * sectorSize : STORAGE_IO_DEFAULT_CHUNK_BYTES;
+    PWIPE_ENGINE pEngine = NULL;
+    SECTOR_JOB job;
+    BOOLEAN jobStarted = FALSE;
+
+    status = ValidateSectorRange(pStorageObject, pRequest->location.sectorNumber, pRequest->sectorCount);
+    if (!NT_SUCCESS(status))
+        goto Done;
+
+    if (depth > SECTOR_WIPE_MAX_DEPTH || chunkBytes > SECTOR_BULK_MAX_CHUNK_BYTES || chunkBytes % sectorSize ||
+        (pRequest->mode == SECTOR_WIPE_RANDOM && depth * chunkBytes > SECTOR_BULK_MAX_BUFFER_BYTES) ||
+        pRequest->mode > SECTOR_WIPE_RANDOM || (pRequest->flags & ~SECTOR_WIPE_ALLOW_TRIM) ||
+        ((pRequest->flags & SECTOR_WIPE_ALLOW_TRIM) && pRequest->mode != SECTOR_WIPE_ZERO)) {
+        status = STATUS_INVALID_PARAMETER;
+        goto Done;
+    }
+    if (pRequest->mode == SECTOR_WIPE_PATTERN &&
+        (pRequest->patternLength == 0 || pRequest->patternLength > sectorSize ||
+         pRequest->patternLength > inputLength - sizeof(SECTOR_WIPE_REQUEST))) {
+        status = STATUS_INVALID_PARAMETER;
+        goto Done;
+    }
+
+    pEngine = new (NON_PAGED) WIPE_ENGINE;
+    if (!pEngine) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Done;
+    }
+
+    RtlZeroMemory(pEngine, sizeof(*pEngine));
+    pEngine->pStorageObject = pStorageObject;
+    pEngine->nextOffset = pRequest->location.sectorNumber * sectorSize;
+    pEngine->endOffset = pEngine->nextOffset + pRequest->sectorCount * sectorSize;
+    pEngine->chunkBytes = (ULONG)chunkBytes;
+    pEngine->depth = depth;
+    pEngine->mode = pRequest->mode;
+
+    // Zero and pattern wipes write the same bytes every time, so all slots share one pre-filled buffer and only
+    // get their own MDL. Random wipes regenerate each slot's buffer before it is written again.
+    if (pEngine->mode != SECTOR_WIPE_RANDOM) {
+        pEngine->pSharedBuffer = new (NON_PAGED) UCHAR[pEngine->chunkBytes];
+        if (!pEngine->pSharedBuffer) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Done;
+        }
+        if (pEngine->mode == SECTOR_WIPE_ZERO) {
+            RtlZeroMemory(pEngine->pSharedBuffer, pEngine->chunkBytes);
+        }
+        else {
+            PUCHAR pattern = pInput + sizeof(SECTOR_WIPE_REQUEST);
+            for (ULONG i = 0; i < pEngine->chunkBytes; i++)
+                pEngine->pSharedBuffer[i] = pattern[(i % sectorSize) % pRequest->patternLength];
+        }
+    }
+    else {
+        WipeSeedRandom(pEngine);
+    }
+
+    for (ULONG i = 0; i < depth; i++) {
+        PWIPE_SLOT pSlot = &pEngine->slots[i];
+        if (pEngine->pSharedBuffer) {
+            pSlot->pMdl = IoAllocateMdl(pEngine->pSharedBuffer, pEngine->chunkBytes, FALSE, FALSE, NULL);
+            if (!pSlot->pMdl) {
+                status = STATUS_INSUFFICIENT_RESOURCES;
+                goto Done;
+            }
+            MmBuildMdlForNonPagedPool(pSlot->pMdl);
+            pSlot->pBuffer = pEngine->pSharedBuffer;
+        }
+        else {
+            status = StorageIoAllocateBuffer(pEngine->chunkBytes, &pSlot->pBuffer, &pSlot->pMdl);
+            if (!NT_SUCCESS(status))
+                goto Done;
+        }
+    }
+
+    status = JobStart(&job, pRequest->jobId, SECTOR_JOB_WIPE, pEngine->endOffset - pEngine->nextOffset, pIrp);
+    if (!NT_SUCCESS(status))
+        goto Done;
+    jobStarted = TRUE;
+    pEngine->pJob = &job;
+
+    LOG("  wiping sectors %llu+%llu, mode %u, %u x %u byte writes\n", pRequest->location.sectorNumber, pRequest->sectorCount, pEngine->mode, depth, pEngine->chunkBytes);
+    if (pRequest->flags & SECTOR_WIPE_ALLOW_TRIM)
+        WipeTrim(pEngine);
+    status = JobShouldStop(&job) ? STATUS_CANCELLED : RunWipeEngine(pEngine);
+    LOG("  wipe finished: 0x%08X, %llu bytes written, %llu trimmed\n", status, pEngine->bytesWritten, pEngine->bytesTrimmed);
+
+    if (outBuffer) {
+        __try {
+            ProbeForWrite(outBuffer, sizeof(SECTOR_WIPE_RESULT), 1);
+            ((PSECTOR_WIPE_RESULT)outBuffer)->bytesWritten = pEngine->bytesWritten;
+            ((PSECTOR_WIPE_RESULT)outBuffer)->bytesTrimmed = pEngine->bytesTrimmed;
+            ((PSECTOR_WIPE_RESULT)outBuffer)->elapsed100ns = JobElapsed100ns(&job);
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER) {
+            if (NT_SUCCESS(status))
+                status = GetExceptionCode();
+        }
+        if (NT_SUCCESS(status))
+            pIrp->IoStatus.Information = sizeof(SECTOR_WIPE_RESULT);
+    }
+
+Done:
+    if (jobStarted) JobFinish(&job);
+    if (pEngine) {
+        for (ULONG i = 0; i < SECTOR_WIPE_MAX_DEPTH; i++) {
+            if (pEngine->slots[i].pMdl) IoFreeMdl(pEngine->slots[i].pMdl);
+            if (pEngine->slots[i].pBuffer && pEngine->slots[i].pBuffer != pEngine->pSharedBuffer)
+                delete[] pEngine->slots[i].pBuffer;
+        }
+        if (pEngine->pSharedBuffer) delete[] pEngine->pSharedBuffer;
+        delete pEngine;
+    }
+    delete[] pInput;
+    return status;
+}
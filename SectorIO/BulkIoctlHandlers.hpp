@@ -0,0 +1,87 @@
+#pragma once
+#include "StorageIo.hpp"
+#include "Job.hpp"
+#include "RangeIoctlHandlers.hpp"
+
+#pragma pack (push, 1)
+
+#define SECTOR_BULK_MAX_CHUNK_BYTES         (8 * 1024 * 1024)
+// Nonpaged buffer space one request may hold, depth times chunk size; deep queues need smaller chunks.
+#define SECTOR_BULK_MAX_BUFFER_BYTES        (16 * 1024 * 1024)
+#define SECTOR_BULK_MAX_DEPTH               16
+#define SECTOR_BULK_DEFAULT_DEPTH           3
+
+#define SECTOR_COPY_TO_STORAGE              0
+#define SECTOR_COPY_TO_FILE                 1
+
+// Non-raw sources with an NTFS or ReFS file system mounted: copy only the clusters the volume bitmap marks as allocated.
+// Skipped ranges are left untouched at the destination; a destination file is made sparse so they cost no space.
+#define SECTOR_COPY_ALLOCATED_ONLY          0x00000001
+
+typedef struct _SECTOR_COPY_REQUEST {
+    STORAGE_LOCATION location;      // source; location.sectorNumber is the first sector copied
+    ULONGLONG sectorCount;          // in source sectors
+    ULONGLONG jobId;                // nonzero makes the copy visible to IOCTL_JOB_QUERY / IOCTL_JOB_CANCEL
+    ULONG destinationType;          // SECTOR_COPY_TO_*
+    STORAGE_LOCATION destination;   // SECTOR_COPY_TO_STORAGE: destination.sectorNumber is the first sector written
+    ULONGLONG fileHandle;           // SECTOR_COPY_TO_FILE: handle opened with write access by the caller
+    ULONGLONG fileOffset;           // SECTOR_COPY_TO_FILE: byte offset of the first sector in the file
+    ULONG chunkSectors;             // 0 selects 1 MiB transfers
+    ULONG depth;                    // buffers in flight, 2 to SECTOR_BULK_MAX_DEPTH within SECTOR_BULK_MAX_BUFFER_BYTES; 0 selects SECTOR_BULK_DEFAULT_DEPTH
+    ULONG flags;                    // SECTOR_COPY_*
+} SECTOR_COPY_REQUEST, *PSECTOR_COPY_REQUEST;
+
+// Also filled in when the copy fails or is cancelled, so the caller knows how far it got.
+typedef struct _SECTOR_COPY_RESULT {
+    ULONGLONG bytesCopied;
+    ULONGLONG elapsed100ns;
+    ULONGLONG bytesSkipped;         // SECTOR_COPY_ALLOCATED_ONLY: free space that was not read
+    ULONG runCount;                 // SECTOR_COPY_ALLOCATED_ONLY: number of runs in the map
+    // SECTOR_RUN runs[runCount] in source sectors, SECTOR_RUN_DATA for copied and SECTOR_RUN_UNALLOCATED for skipped
+    // ranges, covering the whole request. If they do not fit, nothing is copied and the call fails with
+    // STATUS_BUFFER_TOO_SMALL after filling in runCount.
+} SECTOR_COPY_RESULT, *PSECTOR_COPY_RESULT;
+
+#define SECTOR_WIPE_MAX_DEPTH               16
+#define SECTOR_WIPE_DEFAULT_DEPTH           8
+
+#define SECTOR_WIPE_ZERO                    0
+#define SECTOR_WIPE_PATTERN                 1
+#define SECTOR_WIPE_RANDOM                  2
+
+// SECTOR_WIPE_ZERO only: unmap the range instead of writing it when the device supports TRIM/UNMAP.
+// Whether unmapped sectors read back as zeros is up to the device.
+#define SECTOR_WIPE_ALLOW_TRIM              0x00000001
+
+typedef struct _SECTOR_WIPE_REQUEST {
+    STORAGE_LOCATION location;      // location.sectorNumber is the first sector wiped
+    ULONGLONG sectorCount;
+    ULONGLONG jobId;                // nonzero makes the wipe visible to IOCTL_JOB_QUERY / IOCTL_JOB_CANCEL
+    ULONG mode;                     // SECTOR_WIPE_ZERO / PATTERN / RANDOM
+    ULONG flags;                    // SECTOR_WIPE_ALLOW_TRIM
+    ULONG chunkSectors;             // 0 selects 1 MiB writes
+    ULONG depth;                    // writes in flight, 1 to SECTOR_WIPE_MAX_DEPTH; 0 selects SECTOR_WIPE_DEFAULT_DEPTH
+                                    // SECTOR_WIPE_RANDOM: depth * chunk bytes may not exceed SECTOR_BULK_MAX_BUFFER_BYTES
+    ULONG patternLength;            // SECTOR_WIPE_PATTERN: 1 to sector size; the pattern restarts at every sector
+    // UCHAR pattern[patternLength]
+} SECTOR_WIPE_REQUEST, *PSECTOR_WIPE_REQUEST;
+
+// Also filled in when the wipe fails or is cancelled.
+typedef struct _SECTOR_WIPE_RESULT {
+    ULONGLONG bytesWritten;
+    ULONGLONG bytesTrimmed;
+    ULONGLONG elapsed100ns;
+} SECTOR_WIPE_RESULT, *PSECTOR_WIPE_RESULT;
+
+#pragma pack (pop)
+
+// Resolves and checks the destination of a copy-style request over totalBytes of the source from startOffset. Exactly
+// one of *ppDestination and *pFileHandle is set; the kernel file handle has to be closed by the caller. The destination
+// offset of a source byte is its offset plus *pDestinationDelta.
+NTSTATUS OpenCopyDestination(IN PSTORAGE_OBJECT pSource, IN ULONGLONG startOffset, IN ULONGLONG totalBytes, IN ULONG chunkBytes,
+    IN ULONG destinationType, IN PSTORAGE_LOCATION pLocation, IN ULONGLONG userFileHandle, IN ULONGLONG fileOffset,
+    OUT PSTORAGE_OBJECT* ppDestination, OUT PHANDLE pFileHandle, OUT PLONGLONG pDestinationDelta);
+NTSTATUS WriteCopyDestinationFile(IN HANDLE fileHandle, IN LONGLONG offset, IN PVOID pBuffer, IN ULONG length);
+
+NTSTATUS CopySectorsIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject);
+NTSTATUS WipeSectorsIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject);
@@ -0,0 +1,156 @@
+#include "ChangeBitmap.hpp"
+#include "SimdCommon.hpp"
+
+// Leaves are published with a compare-exchange and read back without a barrier: the marker only dereferences the
+// pointer it read, and dependent loads are ordered on every target.
+static inline unsigned int* ChangeAtomicLoadLeaf(unsigned int** slot) {
+#if defined(_MSC_VER)
+    return *(unsigned int* volatile*)slot;
+#else
+    return __atomic_load_n(slot, __ATOMIC_CONSUME);
+#endif
+}
+
+static inline unsigned int* ChangeAtomicPublishLeaf(unsigned int** slot, unsigned int* leaf) {
+#if defined(_MSC_VER)
+    return (unsigned int*)_InterlockedCompareExchangePointer((void* volatile*)slot, leaf, 0);
+#else
+    unsigned int* expected = 0;
+    __atomic_compare_exchange_n(slot, &expected, leaf, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    return expected;
+#endif
+}
+
+static inline unsigned int ChangeAtomicLoadWord(const unsigned int* word) {
+#if defined(_MSC_VER)
+    return *(const volatile unsigned int*)word;
+#else
+    return __atomic_load_n(word, __ATOMIC_RELAXED);
+#endif
+}
+
+static inline void ChangeAtomicOr(unsigned int* word, unsigned int bits) {
+#if defined(_MSC_VER)
+    _InterlockedOr((volatile long*)word, (long)bits);
+#else
+    __atomic_fetch_or(word, bits, __ATOMIC_RELAXED);
+#endif
+}
+
+static inline unsigned int ChangeAtomicTake(unsigned int* word) {
+#if defined(_MSC_VER)
+    return (unsigned int)_InterlockedExchange((volatile long*)word, 0);
+#else
+    return __atomic_exchange_n(word, 0u, __ATOMIC_ACQ_REL);
+#endif
+}
+
+static unsigned int CountSetBits(unsigned int value) {
+    unsigned int count = 0;
+    for (; value; value &= value - 1)
+        count++;
+    return count;
+}
+
+unsigned long long ChangeBitmapLeafCount(unsigned long long blockCount) {
+    return (blockCount + CHANGE_LEAF_BITS - 1) / CHANGE_LEAF_BITS;
+}
+
+void ChangeBitmapInit(PCHANGE_BITMAP bitmap, unsigned int** leaves, unsigned long long blockCount, CHANGE_LEAF_ALLOCATE allocateLeaf, CHANGE_LEAF_FREE freeLeaf, void* context) {
+    bitmap->leaves = leaves;
+    bitmap->leafCount = (unsigned int)ChangeBitmapLeafCount(blockCount);
+    bitmap->blockCount = blockCount;
+    bitmap->allocateLeaf = allocateLeaf;
+    bitmap->freeLeaf = freeLeaf;
+    bitmap->context = context;
+}
+
+int ChangeBitmapMark(PCHANGE_BITMAP bitmap, unsigned long long block, unsigned long long endBlock) {
+    if (endBlock > bitmap->blockCount)
+        endBlock = bitmap->blockCount;
+    while (block < endBlock) {
+        unsigned int** slot = &bitmap->leaves[block / CHANGE_LEAF_BITS];
+        unsigned int* leaf = ChangeAtomicLoadLeaf(slot);
+        if (!leaf) {
+            leaf = bitmap->allocateLeaf(bitmap->context);
+            if (!leaf)
+                return 0;
+            unsigned int* existing = ChangeAtomicPublishLeaf(slot, leaf);
+            if (existing) {
+                bitmap->freeLeaf(bitmap->context, leaf);
+                leaf = existing;
+            }
+        }
+
+        // Words never straddle leaves, since a leaf is a whole number of them.
+        unsigned int bit = (unsigned int)(block % CHANGE_LEAF_BITS);
+        unsigned int shift = bit % 32;
+        unsigned int count = endBlock - block < 32 - shift ? (unsigned int)(endBlock - block) : 32 - shift;
+        unsigned int mask = (count == 32 ? 0xFFFFFFFFu : (1u << count) - 1) << shift;
+        // Writes mostly land in blocks that are dirty already; looking first keeps the line shared between writers.
+        if ((ChangeAtomicLoadWord(&leaf[bit / 32]) & mask) != mask)
+            ChangeAtomicOr(&leaf[bit / 32], mask);
+        block += count;
+    }
+    return 1;
+}
+
+int ChangeBitmapTake(PCHANGE_BITMAP target, PCHANGE_BITMAP source) {
+    for (unsigned int i = 0; i < source->leafCount; i++) {
+        unsigned int* sourceLeaf = ChangeAtomicLoadLeaf(&source->leaves[i]);
+        unsigned int* targetLeaf = target->leaves[i];
+        for (unsigned int word = 0; sourceLeaf && word < CHANGE_LEAF_WORDS; word++) {
+            if (!ChangeAtomicLoadWord(&sourceLeaf[word]))
+                continue;
+            if (!targetLeaf) {
+                targetLeaf = target->leaves[i] = target->allocateLeaf(target->context);
+                if (!targetLeaf)
+                    return 0;
+            }
+            targetLeaf[word] |= ChangeAtomicTake(&sourceLeaf[word]);
+        }
+    }
+    return 1;
+}
+
+unsigned long long ChangeBitmapCount(const CHANGE_BITMAP* bitmap) {
+    unsigned long long count = 0;
+    for (unsigned int i = 0; i < bitmap->leafCount; i++) {
+        const unsigned int* leaf = bitmap->leaves[i];
+        for (unsigned int word = 0; leaf && word < CHANGE_LEAF_WORDS; word++)
+            count += CountSetBits(leaf[word]);
+    }
+    return count;
+}
+
+void ChangeBitmapClear(PCHANGE_BITMAP bitmap) {
+    for (unsigned int i = 0; i < bitmap->leafCount; i++) {
+        if (bitmap->leaves[i]) {
+            bitmap->freeLeaf(bitmap->context, bitmap->leaves[i]);
+            bitmap->leaves[i] = 0;
+        }
+    }
+}
+
+unsigned long long ChangeBitmapFind(const CHANGE_BITMAP* bitmap, unsigned long long block, int dirty) {
+    while (block < bitmap->blockCount) {
+        const unsigned int* leaf = bitmap->leaves[block / CHANGE_LEAF_BITS];
+        unsigned int bit = (unsigned int)(block % CHANGE_LEAF_BITS);
+        if (!leaf) {
+            if (!dirty)
+                return block;
+            block += CHANGE_LEAF_BITS - bit;
+            continue;
+        }
+        unsigned int word = leaf[bit / 32];
+        if (!dirty)
+            word = ~word;
+        word &= 0xFFFFFFFFu << (bit % 32);
+        if (word) {
+            unsigned long long found = block - bit % 32 + SimdCountTrailingZeros(word);
+            return found < bitmap->blockCount ? found : bitmap->blockCount;
+        }
+        block += 32 - bit % 32;
+    }
+    return bitmap->blockCount;
+}
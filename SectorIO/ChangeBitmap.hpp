@@ -0,0 +1,36 @@
+#pragma once
+// Dirty-block bitmaps for change tracking. Kept free of WDK dependencies so it builds on the host as well. A bitmap is a
+// directory of leaves of one page of bits each, allocated through the caller's hooks on the first write into their
+// span, so a mostly idle disk costs little more than its directory. Marking takes no lock and may run concurrently
+// with itself and with ChangeBitmapTake from the same bitmap; everything else is serialized by the caller.
+
+#define CHANGE_LEAF_BITS    (32 * 1024)
+#define CHANGE_LEAF_WORDS   (CHANGE_LEAF_BITS / 32)
+
+// Returns a zeroed leaf of CHANGE_LEAF_WORDS words, or 0. Called while marking, so at the marker's IRQL.
+typedef unsigned int* (*CHANGE_LEAF_ALLOCATE)(void* context);
+typedef void (*CHANGE_LEAF_FREE)(void* context, unsigned int* leaf);
+
+typedef struct _CHANGE_BITMAP {
+    unsigned int** leaves;          // directory, 0 for leaves nothing was marked in
+    unsigned int leafCount;
+    unsigned long long blockCount;
+    CHANGE_LEAF_ALLOCATE allocateLeaf;
+    CHANGE_LEAF_FREE freeLeaf;
+    void* context;
+} CHANGE_BITMAP, *PCHANGE_BITMAP;
+
+unsigned long long ChangeBitmapLeafCount(unsigned long long blockCount);
+// The directory holds ChangeBitmapLeafCount(blockCount) zeroed entries and stays the caller's to free.
+void ChangeBitmapInit(PCHANGE_BITMAP bitmap, unsigned int** leaves, unsigned long long blockCount, CHANGE_LEAF_ALLOCATE allocateLeaf, CHANGE_LEAF_FREE freeLeaf, void* context);
+// Sets the bits of blocks [block, endBlock). Returns 0 if a leaf could not be allocated, with some of them left unset.
+int ChangeBitmapMark(PCHANGE_BITMAP bitmap, unsigned long long block, unsigned long long endBlock);
+// Moves every bit of source into target, which has the same size. Each word is taken from source in one exchange, so
+// a concurrent mark ends up either in target or still in source, never lost. Returns 0 if a target leaf could not be
+// allocated, in which case the bits not moved are still in source.
+int ChangeBitmapTake(PCHANGE_BITMAP target, PCHANGE_BITMAP source);
+unsigned long long ChangeBitmapCount(const CHANGE_BITMAP* bitmap);
+// Frees every leaf, leaving the bitmap clear.
+void ChangeBitmapClear(PCHANGE_BITMAP bitmap);
+// First block from block on whose bit is set, or clear when dirty is 0; blockCount if there is none.
+unsigned long long ChangeBitmapFind(const CHANGE_BITMAP* bitmap, unsigned long long block, int dirty);
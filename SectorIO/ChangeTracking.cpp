@@ -0,0 +1,373 @@
+#include "ChangeTracking.hpp"
+#include "ChangeBitmap.hpp"
+#include "SimdCommon.hpp"
+
+// A directory of 8MB; finer tracking of larger objects has to pick larger blocks.
+#define CHANGE_MAX_LEAVES   (1024 * 1024)
+
+typedef struct _CHANGE_TRACKER {
+    EX_RUNDOWN_REF rundown;     // held by writers while they mark the active bitmap; run down while not tracking
+    FAST_MUTEX mutex;           // serializes starting, stopping, snapshots and range reads
+    BOOLEAN tracking;
+    ULONG blockShift;
+    CHANGE_BITMAP active;       // marked by writers without locks
+    CHANGE_BITMAP snapshot;     // the last snapshot, only used under the mutex
+    volatile LONG overflowed;   // a leaf could not be allocated, so the next snapshot has to cover everything
+    BOOLEAN snapshotAll;
+    ULONG snapshotSequence;
+    ULONGLONG snapshotDirtyBlocks;
+    volatile LONG64 markedWrites;
+} CHANGE_TRACKER, *PCHANGE_TRACKER;
+
+// Storage objects being tracked; writes skip the walk while it is zero.
+static volatile LONG g_changeTrackers = 0;
+
+static PCHANGE_TRACKER ChangeTrackerGet(IN PSTORAGE_OBJECT pStorageObject) {
+    PCHANGE_TRACKER pTracker = (PCHANGE_TRACKER)pStorageObject->pChangeTracker;
+    if (pTracker)
+        return pTracker;
+
+    pTracker = new (NON_PAGED) CHANGE_TRACKER;
+    if (!pTracker)
+        return NULL;
+    RtlZeroMemory(pTracker, sizeof(*pTracker));
+    ExInitializeFastMutex(&pTracker->mutex);
+    // Nothing is marked until tracking starts.
+    ExInitializeRundownProtection(&pTracker->rundown);
+    ExWaitForRundownProtectionRelease(&pTracker->rundown);
+
+    PVOID pExisting = InterlockedCompareExchangePointer((PVOID*)&pStorageObject->pChangeTracker, pTracker, NULL);
+    if (pExisting) {
+        delete pTracker;
+        return (PCHANGE_TRACKER)pExisting;
+    }
+    return pTracker;
+}
+
+static unsigned int* ChangeLeafAllocate(IN PVOID context) {
+    UNREFERENCED_PARAMETER(context);
+    unsigned int* pLeaf = new (NON_PAGED) unsigned int[CHANGE_LEAF_WORDS];
+    if (pLeaf)
+        RtlZeroMemory(pLeaf, CHANGE_LEAF_WORDS * sizeof(unsigned int));
+    return pLeaf;
+}
+
+static void ChangeLeafFree(IN PVOID context, IN unsigned int* pLeaf) {
+    UNREFERENCED_PARAMETER(context);
+    delete[] pLeaf;
+}
+
+static unsigned int** ChangeDirectoryAllocate(IN ULONG leafCount) {
+    unsigned int** pLeaves = new (NON_PAGED) unsigned int*[leafCount];
+    if (pLeaves)
+        RtlZeroMemory(pLeaves, leafCount * sizeof(unsigned int*));
+    return pLeaves;
+}
+
+static void ChangeTrackerFreeBitmap(IN PCHANGE_BITMAP pBitmap) {
+    if (!pBitmap->leaves)
+        return;
+    ChangeBitmapClear(pBitmap);
+    delete[] pBitmap->leaves;
+    pBitmap->leaves = NULL;
+}
+
+static void ChangeTrackerMark(IN PSTORAGE_OBJECT pObject, IN ULONGLONG diskOffset, IN ULONGLONG length) {
+    PCHANGE_TRACKER pTracker = (PCHANGE_TRACKER)pObject->pChangeTracker;
+    if (!pTracker || !ExAcquireRundownProtection(&pTracker->rundown))
+        return;
+
+    ULONGLONG objectStart = pObject->info.isRawDiskObject ? 0 : pObject->info.partitionStartingOffset;
+    ULONGLONG start = max(diskOffset, objectStart);
+    ULONGLONG end = min(diskOffset + length, objectStart + GetStorageObjectLength(pObject));
+    if (start < end) {
+        ULONGLONG firstBlock = (start - objectStart) >> pTracker->blockShift;
+        ULONGLONG endBlock = ((end - objectStart - 1) >> pTracker->blockShift) + 1;
+        InterlockedIncrement64(&pTracker->markedWrites);
+        if (!ChangeBitmapMark(&pTracker->active, firstBlock, endBlock))
+            InterlockedExchange(&pTracker->overflowed, TRUE);
+    }
+    ExReleaseRundownProtection(&pTracker->rundown);
+}
+
+void ChangeTrackingMarkWrite(IN PSTORAGE_OBJECT pStorageObject, IN ULONGLONG byteOffset, IN ULONGLONG length) {
+    if (!g_changeTrackers || !g_pStorageObjects || !length)
+        return;
+
+    ULONGLONG diskOffset = (pStorageObject->info.isRawDiskObject ? 0 : pStorageObject->info.partitionStartingOffset) + byteOffset;
+    for (auto pObject : g_pStorageObjects->locked()) {
+        if (!pObject || pObject->removedGeneration || pObject->info.diskIndex != pStorageObject->info.diskIndex)
+            continue;
+        ChangeTrackerMark(pObject, diskOffset, length);
+    }
+}
+
+// Called with the tracker mutex held.
+static NTSTATUS ChangeTrackerStart(IN PSTORAGE_OBJECT pStorageObject, IN PCHANGE_TRACKER pTracker, IN ULONG blockBytes) {
+    ULONG sectorSize = pStorageObject->info.sectorSize;
+    if (!blockBytes)
+        blockBytes = SECTOR_TRACKING_DEFAULT_BLOCK_BYTES;
+    if (!sectorSize || (blockBytes & (blockBytes - 1)) || blockBytes < sectorSize || blockBytes > SECTOR_TRACKING_MAX_BLOCK_BYTES)
+        return STATUS_INVALID_PARAMETER;
+
+    ULONG blockShift = SimdCountTrailingZeros(blockBytes);
+    if (pTracker->tracking)
+        return blockShift == pTracker->blockShift ? STATUS_SUCCESS : STATUS_INVALID_DEVICE_STATE;
+
+    ULONGLONG blockCount = (GetStorageObjectLength(pStorageObject) + blockBytes - 1) >> blockShift;
+    ULONGLONG leafCount = ChangeBitmapLeafCount(blockCount);
+    if (!blockCount || leafCount > CHANGE_MAX_LEAVES)
+        return STATUS_INVALID_PARAMETER;
+
+    unsigned int** pActive = ChangeDirectoryAllocate((ULONG)leafCount);
+    unsigned int** pSnapshot = ChangeDirectoryAllocate((ULONG)leafCount);
+    if (!pActive || !pSnapshot) {
+        delete[] pActive;
+        delete[] pSnapshot;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    pTracker->blockShift = blockShift;
+    ChangeBitmapInit(&pTracker->active, pActive, blockCount, ChangeLeafAllocate, ChangeLeafFree, NULL);
+    ChangeBitmapInit(&pTracker->snapshot, pSnapshot, blockCount, ChangeLeafAllocate, ChangeLeafFree, NULL);
+    pTracker->overflowed = FALSE;
+    pTracker->snapshotAll = FALSE;
+    pTracker->snapshotSequence = 0;
+    pTracker->snapshotDirtyBlocks = 0;
+    pTracker->markedWrites = 0;
+    pTracker->tracking = TRUE;
+    InterlockedIncrement(&g_changeTrackers);
+    // Writers may only see the bitmap once it is complete.
+    KeMemoryBarrier();
+    ExReInitializeRundownProtection(&pTracker->rundown);
+    LOG("  tracking changes in %llu blocks of %lu bytes\n", blockCount, blockBytes);
+    return STATUS_SUCCESS;
+}
+
+// Waits for writers marking the bitmap, so it runs below DISPATCH_LEVEL: with the tracker mutex held, or on unload
+// once the storage object is off the list.
+static void ChangeTrackerStop(IN PCHANGE_TRACKER pTracker) {
+    if (!pTracker->tracking)
+        return;
+    ExWaitForRundownProtectionRelease(&pTracker->rundown);
+    pTracker->tracking = FALSE;
+    InterlockedDecrement(&g_changeTrackers);
+    ChangeTrackerFreeBitmap(&pTracker->active);
+    ChangeTrackerFreeBitmap(&pTracker->snapshot);
+}
+
+// Each word is taken from the active bitmap in one exchange, so a write is recorded either in this snapshot or in
+// the next one. Writes are marked once they are back from the device, so one still in flight is in the next.
+// Called with the tracker mutex held.
+static void ChangeTrackerSnapshot(IN PCHANGE_TRACKER pTracker, IN BOOLEAN merge) {
+    if (!merge) {
+        ChangeBitmapClear(&pTracker->snapshot);
+        pTracker->snapshotAll = FALSE;
+    }
+    if (InterlockedExchange(&pTracker->overflowed, FALSE))
+        pTracker->snapshotAll = TRUE;
+    // What is left in the active bitmap goes into the next snapshot, which covers everything anyway.
+    if (!ChangeBitmapTake(&pTracker->snapshot, &pTracker->active))
+        pTracker->snapshotAll = TRUE;
+
+    pTracker->snapshotDirtyBlocks = pTracker->snapshotAll ? pTracker->snapshot.blockCount : ChangeBitmapCount(&pTracker->snapshot);
+    pTracker->snapshotSequence++;
+}
+
+// First block from block on whose snapshot bit is set, or clear; blockCount if there is none.
+static ULONGLONG ChangeTrackerFindBlock(IN PCHANGE_TRACKER pTracker, IN ULONGLONG block, IN BOOLEAN dirty) {
+    if (pTracker->snapshotAll)
+        return dirty ? block : pTracker->snapshot.blockCount;
+    return ChangeBitmapFind(&pTracker->snapshot, block, dirty);
+}
+
+static PCHANGE_TRACKER ChangeTrackerAcquire(IN PSTORAGE_OBJECT pStorageObject) {
+    PCHANGE_TRACKER pTracker = (PCHANGE_TRACKER)pStorageObject->pChangeTracker;
+    if (!pTracker)
+        return NULL;
+    ExAcquireFastMutex(&pTracker->mutex);
+    if (!pTracker->tracking) {
+        ExReleaseFastMutex(&pTracker->mutex);
+        return NULL;
+    }
+    return pTracker;
+}
+
+void ChangeTrackingFree(IN PSTORAGE_OBJECT pStorageObject) {
+    PCHANGE_TRACKER pTracker = (PCHANGE_TRACKER)pStorageObject->pChangeTracker;
+    if (pTracker) {
+        ChangeTrackerStop(pTracker);
+        delete pTracker;
+        pStorageObject->pChangeTracker = NULL;
+    }
+}
+
+NTSTATUS TrackChangesIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject) {
+    LOG("TrackChangesIoctlHandler called\n");
+    if (!pStorageObject)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    SECTOR_TRACKING_REQUEST request;
+    PVOID userInput = pIrpStack->Parameters.DeviceIoControl.Type3InputBuffer;
+    if (!userInput || pIrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(request))
+        return STATUS_INFO_LENGTH_MISMATCH;
+
+    __try {
+        ProbeForRead(userInput, sizeof(request), 1);
+        RtlCopyMemory(&request, userInput, sizeof(request));
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return GetExceptionCode();
+    }
+    if ((request.flags & ~(SECTOR_TRACKING_START | SECTOR_TRACKING_STOP)) ||
+        request.flags == (SECTOR_TRACKING_START | SECTOR_TRACKING_STOP))
+        return STATUS_INVALID_PARAMETER;
+
+    PCHANGE_TRACKER pTracker = ChangeTrackerGet(pStorageObject);
+    if (!pTracker)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    NTSTATUS status = STATUS_SUCCESS;
+    SECTOR_TRACKING_STATUS trackingStatus;
+    ExAcquireFastMutex(&pTracker->mutex);
+    if (request.flags & SECTOR_TRACKING_START)
+        status = ChangeTrackerStart(pStorageObject, pTracker, request.blockBytes);
+    else if (request.flags & SECTOR_TRACKING_STOP)
+        ChangeTrackerStop(pTracker);
+    trackingStatus.tracking = pTracker->tracking;
+    trackingStatus.blockBytes = pTracker->tracking ? 1u << pTracker->blockShift : 0;
+    trackingStatus.blockCount = pTracker->tracking ? pTracker->snapshot.blockCount : 0;
+    trackingStatus.markedWrites = (ULONGLONG)pTracker->markedWrites;
+    trackingStatus.snapshotSequence = pTracker->snapshotSequence;
+    ExReleaseFastMutex(&pTracker->mutex);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    PVOID outBuffer = pIrp->UserBuffer;
+    if (!outBuffer || pIrpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(trackingStatus))
+        return STATUS_SUCCESS;
+
+    __try {
+        ProbeForWrite(outBuffer, sizeof(trackingStatus), 1);
+        RtlCopyMemory(outBuffer, &trackingStatus, sizeof(trackingStatus));
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return GetExceptionCode();
+    }
+    pIrp->IoStatus.Information = sizeof(trackingStatus);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS SnapshotChangesIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject) {
+    LOG("SnapshotChangesIoctlHandler called\n");
+    if (!pStorageObject)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    SECTOR_CHANGES_SNAPSHOT_REQUEST request;
+    PVOID userInput = pIrpStack->Parameters.DeviceIoControl.Type3InputBuffer;
+    if (!userInput || pIrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(request))
+        return STATUS_INFO_LENGTH_MISMATCH;
+
+    __try {
+        ProbeForRead(userInput, sizeof(request), 1);
+        RtlCopyMemory(&request, userInput, sizeof(request));
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return GetExceptionCode();
+    }
+    if (request.flags & ~SECTOR_CHANGES_MERGE)
+        return STATUS_INVALID_PARAMETER;
+
+    PVOID outBuffer = pIrp->UserBuffer;
+    if (!outBuffer || pIrpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(SECTOR_CHANGES_SNAPSHOT))
+        return STATUS_INFO_LENGTH_MISMATCH;
+
+    PCHANGE_TRACKER pTracker = ChangeTrackerAcquire(pStorageObject);
+    if (!pTracker)
+        return STATUS_INVALID_DEVICE_STATE;
+
+    SECTOR_CHANGES_SNAPSHOT snapshot;
+    ChangeTrackerSnapshot(pTracker, (request.flags & SECTOR_CHANGES_MERGE) != 0);
+    snapshot.flags = pTracker->snapshotAll ? SECTOR_CHANGES_ALL : 0;
+    snapshot.blockBytes = 1u << pTracker->blockShift;
+    snapshot.sequence = pTracker->snapshotSequence;
+    snapshot.dirtyBlocks = pTracker->snapshotDirtyBlocks;
+    ExReleaseFastMutex(&pTracker->mutex);
+    LOG("  snapshot %lu: %llu dirty blocks\n", snapshot.sequence, snapshot.dirtyBlocks);
+
+    __try {
+        ProbeForWrite(outBuffer, sizeof(snapshot), 1);
+        RtlCopyMemory(outBuffer, &snapshot, sizeof(snapshot));
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return GetExceptionCode();
+    }
+    pIrp->IoStatus.Information = sizeof(snapshot);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS ChangedRangesIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject) {
+    LOG("ChangedRangesIoctlHandler called\n");
+    if (!pStorageObject)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    SECTOR_CHANGED_RANGES_REQUEST request;
+    PVOID userInput = pIrpStack->Parameters.DeviceIoControl.Type3InputBuffer;
+    if (!userInput || pIrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(request))
+        return STATUS_INFO_LENGTH_MISMATCH;
+
+    __try {
+        ProbeForRead(userInput, sizeof(request), 1);
+        RtlCopyMemory(&request, userInput, sizeof(request));
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return GetExceptionCode();
+    }
+
+    PVOID outBuffer = pIrp->UserBuffer;
+    ULONG outLength = pIrpStack->Parameters.DeviceIoControl.OutputBufferLength;
+    if (!outBuffer || outLength < sizeof(SECTOR_CHANGED_RANGES_RESULT))
+        return STATUS_INFO_LENGTH_MISMATCH;
+
+    // The ranges are gathered under the tracker mutex and copied out after it, so the walk does not take page faults.
+    ULONG capacity = min((outLength - (ULONG)sizeof(SECTOR_CHANGED_RANGES_RESULT)) / (ULONG)sizeof(SECTOR_CHANGED_RANGE), (ULONG)SECTOR_CHANGED_RANGES_MAX);
+    PSECTOR_CHANGED_RANGE pRanges = new (PAGED_POOL) SECTOR_CHANGED_RANGE[capacity ? capacity : 1];
+    if (!pRanges)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    PCHANGE_TRACKER pTracker = ChangeTrackerAcquire(pStorageObject);
+    if (!pTracker) {
+        delete[] pRanges;
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    ULONGLONG objectLength = GetStorageObjectLength(pStorageObject);
+    ULONG blockShift = pTracker->blockShift;
+    SECTOR_CHANGED_RANGES_RESULT result = { 0, pTracker->snapshotSequence, 0 };
+    ULONGLONG block = ChangeTrackerFindBlock(pTracker, min(request.startOffset >> blockShift, pTracker->snapshot.blockCount), TRUE);
+    while (block < pTracker->snapshot.blockCount && result.rangeCount < capacity) {
+        ULONGLONG endBlock = ChangeTrackerFindBlock(pTracker, block, FALSE);
+        pRanges[result.rangeCount].byteOffset = block << blockShift;
+        pRanges[result.rangeCount].length = min(endBlock << blockShift, objectLength) - (block << blockShift);
+        result.rangeCount++;
+        block = ChangeTrackerFindBlock(pTracker, endBlock, TRUE);
+    }
+    BOOLEAN complete = block >= pTracker->snapshot.blockCount;
+    result.nextOffset = complete ? objectLength : block << blockShift;
+    ExReleaseFastMutex(&pTracker->mutex);
+
+    ULONG length = sizeof(result) + result.rangeCount * sizeof(SECTOR_CHANGED_RANGE);
+    __try {
+        ProbeForWrite(outBuffer, length, 1);
+        RtlCopyMemory(outBuffer, &result, sizeof(result));
+        RtlCopyMemory((PUCHAR)outBuffer + sizeof(result), pRanges, result.rangeCount * sizeof(SECTOR_CHANGED_RANGE));
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        delete[] pRanges;
+        return GetExceptionCode();
+    }
+    delete[] pRanges;
+    pIrp->IoStatus.Information = length;
+    LOG("  %lu changed ranges returned, next offset %llu\n", result.rangeCount, result.nextOffset);
+    return complete ? STATUS_SUCCESS : STATUS_BUFFER_OVERFLOW;
+}
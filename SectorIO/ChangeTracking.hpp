@@ -0,0 +1,80 @@
+#pragma once
+#include "StorageIo.hpp"
+
+#pragma pack (push, 1)
+
+// Start tracking at blockBytes. A no-op if already tracking at that size; fails with STATUS_INVALID_DEVICE_STATE at
+// another, which takes a stop first.
+#define SECTOR_TRACKING_START               0x00000001
+#define SECTOR_TRACKING_STOP                0x00000002  // stop and drop the bitmaps, including an unread snapshot
+
+#define SECTOR_TRACKING_DEFAULT_BLOCK_BYTES (64 * 1024)
+#define SECTOR_TRACKING_MAX_BLOCK_BYTES     (64 * 1024 * 1024)
+
+// Input of IOCTL_SECTOR_TRACK_CHANGES; without flags it only returns the status.
+typedef struct _SECTOR_TRACKING_REQUEST {
+    STORAGE_LOCATION location;
+    ULONG flags;                    // SECTOR_TRACKING_*
+    ULONG blockBytes;               // power of two, at least the sector size; 0 selects the default
+} SECTOR_TRACKING_REQUEST, *PSECTOR_TRACKING_REQUEST;
+
+typedef struct _SECTOR_TRACKING_STATUS {
+    BOOLEAN tracking;
+    ULONG blockBytes;
+    ULONGLONG blockCount;
+    ULONGLONG markedWrites;         // writes recorded since tracking started
+    ULONG snapshotSequence;         // snapshots taken since tracking started
+} SECTOR_TRACKING_STATUS, *PSECTOR_TRACKING_STATUS;
+
+#define SECTOR_CHANGES_MERGE                0x00000001  // add to the previous snapshot instead of replacing it
+
+// Input of IOCTL_SECTOR_SNAPSHOT_CHANGES. Moves the blocks written since the last snapshot into the snapshot that
+// IOCTL_SECTOR_CHANGED_RANGES reads, and starts recording afresh. Merge after an incremental image failed, so the
+// blocks it missed are not lost.
+typedef struct _SECTOR_CHANGES_SNAPSHOT_REQUEST {
+    STORAGE_LOCATION location;
+    ULONG flags;                    // SECTOR_CHANGES_*
+} SECTOR_CHANGES_SNAPSHOT_REQUEST, *PSECTOR_CHANGES_SNAPSHOT_REQUEST;
+
+#define SECTOR_CHANGES_ALL                  0x00000001  // changes were lost to a lack of memory; everything is dirty
+
+typedef struct _SECTOR_CHANGES_SNAPSHOT {
+    ULONG flags;                    // SECTOR_CHANGES_ALL
+    ULONG blockBytes;
+    ULONG sequence;
+    ULONGLONG dirtyBlocks;
+} SECTOR_CHANGES_SNAPSHOT, *PSECTOR_CHANGES_SNAPSHOT;
+
+// Input of IOCTL_SECTOR_CHANGED_RANGES. Returns a SECTOR_CHANGED_RANGES_RESULT followed by the dirty ranges of the
+// snapshot from startOffset on, merged where adjacent and clipped to the storage object.
+typedef struct _SECTOR_CHANGED_RANGES_REQUEST {
+    STORAGE_LOCATION location;
+    ULONGLONG startOffset;          // byte offset; rounded down to the block it is in
+} SECTOR_CHANGED_RANGES_REQUEST, *PSECTOR_CHANGED_RANGES_REQUEST;
+
+#define SECTOR_CHANGED_RANGES_MAX           4096
+
+// When the ranges do not all fit, or there are more than SECTOR_CHANGED_RANGES_MAX, the call returns
+// STATUS_BUFFER_OVERFLOW with the ones that do; call again with startOffset set to nextOffset.
+typedef struct _SECTOR_CHANGED_RANGES_RESULT {
+    ULONGLONG nextOffset;           // where the next call continues; the object length once all ranges are returned
+    ULONG sequence;                 // of the snapshot the ranges come from
+    ULONG rangeCount;
+} SECTOR_CHANGED_RANGES_RESULT, *PSECTOR_CHANGED_RANGES_RESULT;
+
+typedef struct _SECTOR_CHANGED_RANGE {
+    ULONGLONG byteOffset;
+    ULONGLONG length;
+} SECTOR_CHANGED_RANGE, *PSECTOR_CHANGED_RANGE;
+
+#pragma pack (pop)
+
+// Records a write handed to the device in every tracking storage object it lands in: the object it was issued on,
+// the raw disk under a partition, and the partitions on a raw disk. Callable at DISPATCH_LEVEL or below.
+void ChangeTrackingMarkWrite(IN PSTORAGE_OBJECT pStorageObject, IN ULONGLONG byteOffset, IN ULONGLONG length);
+// Waits for writes still marking the bitmap; runs at PASSIVE_LEVEL and never under a spin lock.
+void ChangeTrackingFree(IN PSTORAGE_OBJECT pStorageObject);
+
+NTSTATUS TrackChangesIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject);
+NTSTATUS SnapshotChangesIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject);
+NTSTATUS ChangedRangesIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject);
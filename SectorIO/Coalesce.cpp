@@ -0,0 +1,324 @@
+#include "Coalesce.hpp"
+#include "RequestControl.hpp"
+
+// One lower read and everyone waiting for a piece of it
+typedef struct _READ_FLIGHT {
+    LIST_ENTRY entry;
+    ULONGLONG byteOffset;
+    ULONG length;
+    BOOLEAN dispatched;         // the range is final
+    BOOLEAN closed;             // a write overlapped it; no new readers may attach
+    volatile LONG references;   // the leader plus every attached reader
+
+    KEVENT gathered;            // ends the leader's gather: a read attached or another lower read completed
+    KEVENT done;
+    NTSTATUS status;
+    ULONG_PTR information;
+    PUCHAR pBuffer;
+    PMDL pMdl;
+} READ_FLIGHT, *PREAD_FLIGHT;
+
+typedef struct _COALESCER {
+    KSPIN_LOCK lock;
+    SECTOR_COALESCE_SETTINGS settings;
+    LIST_ENTRY flights;
+    ULONG flightCount;
+
+    ULONGLONG reads;
+    ULONGLONG lowerReads;
+    ULONGLONG dedupedReads;
+    ULONGLONG mergedReads;
+    ULONGLONG lowerBytes;
+    ULONGLONG deliveredBytes;
+} COALESCER, *PCOALESCER;
+
+// Coalescers in existence; writes skip the storage object walk while there are none.
+static volatile LONG g_coalescers = 0;
+
+static PCOALESCER CoalescerGet(IN PSTORAGE_OBJECT pStorageObject) {
+    PCOALESCER pCoalescer = (PCOALESCER)pStorageObject->pCoalescer;
+    if (pCoalescer)
+        return pCoalescer;
+
+    pCoalescer = new (NON_PAGED) COALESCER;
+    if (!pCoalescer)
+        return NULL;
+    RtlZeroMemory(pCoalescer, sizeof(*pCoalescer));
+    KeInitializeSpinLock(&pCoalescer->lock);
+    InitializeListHead(&pCoalescer->flights);
+    pCoalescer->settings.disabled = TRUE;
+    pCoalescer->settings.windowMicroseconds = SECTOR_COALESCE_DEFAULT_WINDOW_US;
+    pCoalescer->settings.maxBytes = SECTOR_COALESCE_DEFAULT_MAX_BYTES;
+
+    PVOID pExisting = InterlockedCompareExchangePointer((PVOID*)&pStorageObject->pCoalescer, pCoalescer, NULL);
+    if (pExisting) {
+        delete pCoalescer;
+        return (PCOALESCER)pExisting;
+    }
+    InterlockedIncrement(&g_coalescers);
+    return pCoalescer;
+}
+
+static void ReleaseFlight(IN PREAD_FLIGHT pFlight) {
+    if (InterlockedDecrement(&pFlight->references) == 0) {
+        StorageIoFreeBuffer(pFlight->pBuffer, pFlight->pMdl);
+        delete pFlight;
+    }
+}
+
+BOOLEAN CoalesceAccepts(IN PSTORAGE_OBJECT pStorageObject, IN ULONGLONG byteOffset, IN ULONG length) {
+    ULONG sectorSize = pStorageObject->info.sectorSize;
+    if (!sectorSize || !length || length % sectorSize || byteOffset % sectorSize)
+        return FALSE;
+
+    // Only IOCTL_SET_COALESCE creates the table, so plain reads never pay for a flight and a bounce buffer.
+    PCOALESCER pCoalescer = (PCOALESCER)pStorageObject->pCoalescer;
+    return pCoalescer && !pCoalescer->settings.disabled && length <= pCoalescer->settings.maxBytes;
+}
+
+// Called with the lock held. Prefers a flight that already covers the read; otherwise a gathering flight the read
+// is adjacent to or overlaps, as long as the merged range stays within maxBytes.
+static PREAD_FLIGHT FindFlight(IN PCOALESCER pCoalescer, IN ULONGLONG byteOffset, IN ULONG length, OUT PBOOLEAN pCovered) {
+    ULONGLONG end = byteOffset + length;
+    PREAD_FLIGHT pMergeable = NULL;
+
+    for (PLIST_ENTRY pEntry = pCoalescer->flights.Flink; pEntry != &pCoalescer->flights; pEntry = pEntry->Flink) {
+        PREAD_FLIGHT pFlight = CONTAINING_RECORD(pEntry, READ_FLIGHT, entry);
+        if (pFlight->closed)
+            continue;
+
+        ULONGLONG flightEnd = pFlight->byteOffset + pFlight->length;
+        if (byteOffset >= pFlight->byteOffset && end <= flightEnd) {
+            *pCovered = TRUE;
+            return pFlight;
+        }
+        if (!pMergeable && !pFlight->dispatched && byteOffset <= flightEnd && end >= pFlight->byteOffset &&
+            max(end, flightEnd) - min(byteOffset, pFlight->byteOffset) <= pCoalescer->settings.maxBytes)
+            pMergeable = pFlight;
+    }
+    *pCovered = FALSE;
+    return pMergeable;
+}
+
+static NTSTATUS WaitForFlight(IN PREAD_FLIGHT pFlight, IN PIRP pOriginIrp OPTIONAL) {
+    NTSTATUS status = RequestWait(pOriginIrp, &pFlight->done);
+    return NT_SUCCESS(status) ? pFlight->status : status;
+}
+
+static void IssueFlight(IN PSTORAGE_OBJECT pStorageObject, IN PREAD_FLIGHT pFlight, IN PIRP pOriginIrp OPTIONAL) {
+    NTSTATUS status = StorageIoAllocateBuffer(pFlight->length, &pFlight->pBuffer, &pFlight->pMdl);
+    if (NT_SUCCESS(status)) {
+        STORAGE_IO io;
+        StorageIoInitialize(&io, pStorageObject, FALSE, pFlight->pMdl, pFlight->byteOffset, pFlight->length, pOriginIrp);
+        status = StorageIoTransfer(&io, &pFlight->information);
+    }
+    pFlight->status = status;
+}
+
+NTSTATUS CoalescedRead(IN PSTORAGE_OBJECT pStorageObject, IN PIRP pOriginIrp OPTIONAL, IN ULONGLONG byteOffset, IN ULONG length, OUT PVOID pDestination, OUT PULONG_PTR information) {
+    PCOALESCER pCoalescer = (PCOALESCER)pStorageObject->pCoalescer;
+    *information = 0;
+
+    // Allocated up front so the table lock is never held across an allocation
+    PREAD_FLIGHT pNewFlight = new (NON_PAGED) READ_FLIGHT;
+    if (!pNewFlight)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    KIRQL oldIrql;
+    KeAcquireSpinLock(&pCoalescer->lock, &oldIrql);
+    pCoalescer->reads++;
+
+    BOOLEAN covered;
+    PREAD_FLIGHT pFlight = FindFlight(pCoalescer, byteOffset, length, &covered);
+    BOOLEAN leader = !pFlight;
+    if (pFlight) {
+        if (covered) {
+            pCoalescer->dedupedReads++;
+        }
+        else {
+            ULONGLONG end = max(byteOffset + length, pFlight->byteOffset + pFlight->length);
+            pFlight->byteOffset = min(byteOffset, pFlight->byteOffset);
+            pFlight->length = (ULONG)(end - pFlight->byteOffset);
+            pCoalescer->mergedReads++;
+            KeSetEvent(&pFlight->gathered, IO_NO_INCREMENT, FALSE);
+        }
+        InterlockedIncrement(&pFlight->references);
+    }
+    else {
+        pFlight = pNewFlight;
+        pNewFlight = NULL;
+        RtlZeroMemory(pFlight, sizeof(*pFlight));
+        pFlight->byteOffset = byteOffset;
+        pFlight->length = length;
+        pFlight->references = 1;
+        KeInitializeEvent(&pFlight->gathered, NotificationEvent, FALSE);
+        KeInitializeEvent(&pFlight->done, NotificationEvent, FALSE);
+        InsertTailList(&pCoalescer->flights, &pFlight->entry);
+        pCoalescer->flightCount++;
+    }
+    // Only gather when other reads are in flight; an idle device gets the read straight away.
+    BOOLEAN gather = leader && pCoalescer->flightCount > 1 && pCoalescer->settings.windowMicroseconds != 0;
+    ULONG windowMicroseconds = pCoalescer->settings.windowMicroseconds;
+    KeReleaseSpinLock(&pCoalescer->lock, oldIrql);
+
+    if (pNewFlight)
+        delete pNewFlight;
+
+    NTSTATUS status;
+    if (leader) {
+        // The window only bounds the gather. Timed waits end on a clock tick, which is far longer than a typical
+        // window, so the leader goes as soon as a read attaches or the device finishes one of the others.
+        if (gather) {
+            LARGE_INTEGER timeout;
+            timeout.QuadPart = -(LONGLONG)windowMicroseconds * 10LL;
+            KeWaitForSingleObject(&pFlight->gathered, Executive, KernelMode, FALSE, &timeout);
+        }
+
+        KeAcquireSpinLock(&pCoalescer->lock, &oldIrql);
+        pFlight->dispatched = TRUE;
+        pCoalescer->lowerReads++;
+        pCoalescer->lowerBytes += pFlight->length;
+        KeReleaseSpinLock(&pCoalescer->lock, oldIrql);
+
+        IssueFlight(pStorageObject, pFlight, pOriginIrp);
+
+        KeAcquireSpinLock(&pCoalescer->lock, &oldIrql);
+        RemoveEntryList(&pFlight->entry);
+        pCoalescer->flightCount--;
+        for (PLIST_ENTRY pEntry = pCoalescer->flights.Flink; pEntry != &pCoalescer->flights; pEntry = pEntry->Flink) {
+            PREAD_FLIGHT pGathering = CONTAINING_RECORD(pEntry, READ_FLIGHT, entry);
+            if (!pGathering->dispatched)
+                KeSetEvent(&pGathering->gathered, IO_NO_INCREMENT, FALSE);
+        }
+        KeReleaseSpinLock(&pCoalescer->lock, oldIrql);
+        KeSetEvent(&pFlight->done, IO_NO_INCREMENT, FALSE);
+        status = pFlight->status;
+    }
+    else {
+        // The lower read was admitted for the leader's request; this one still owes its own handle for its bytes.
+        status = WaitForFlight(pFlight, pOriginIrp);
+        if (NT_SUCCESS(status))
+            status = StorageIoAdmitShared(pStorageObject, pOriginIrp, length);
+    }
+
+    if (NT_SUCCESS(status)) {
+        // The lower read may have come back short; hand out whatever part of it belongs to this read.
+        ULONGLONG skip = byteOffset - pFlight->byteOffset;
+        ULONG available = pFlight->information > skip ? (ULONG)min((ULONGLONG)length, pFlight->information - skip) : 0;
+        RtlCopyMemory(pDestination, pFlight->pBuffer + skip, available);
+        *information = available;
+
+        KeAcquireSpinLock(&pCoalescer->lock, &oldIrql);
+        pCoalescer->deliveredBytes += available;
+        KeReleaseSpinLock(&pCoalescer->lock, oldIrql);
+    }
+
+    ReleaseFlight(pFlight);
+
+    // A leader whose own request was cancelled or timed out takes its lower read down with it; readers that were
+    // merely attached start over.
+    if (!leader && (status == STATUS_CANCELLED || status == STATUS_IO_TIMEOUT) && NT_SUCCESS(RequestAbortStatus(pOriginIrp)))
+        return CoalescedRead(pStorageObject, pOriginIrp, byteOffset, length, pDestination, information);
+    return status;
+}
+
+// Called with the storage object list locked; the range is in disk offsets.
+static void CoalescerCloseFlights(IN PSTORAGE_OBJECT pObject, IN ULONGLONG diskOffset, IN ULONGLONG length) {
+    PCOALESCER pCoalescer = (PCOALESCER)pObject->pCoalescer;
+    if (!pCoalescer)
+        return;
+
+    ULONGLONG objectStart = pObject->info.isRawDiskObject ? 0 : pObject->info.partitionStartingOffset;
+    KIRQL oldIrql;
+    KeAcquireSpinLock(&pCoalescer->lock, &oldIrql);
+    for (PLIST_ENTRY pEntry = pCoalescer->flights.Flink; pEntry != &pCoalescer->flights; pEntry = pEntry->Flink) {
+        PREAD_FLIGHT pFlight = CONTAINING_RECORD(pEntry, READ_FLIGHT, entry);
+        ULONGLONG flightStart = objectStart + pFlight->byteOffset;
+        if (diskOffset < flightStart + pFlight->length && flightStart < diskOffset + length)
+            pFlight->closed = TRUE;
+    }
+    KeReleaseSpinLock(&pCoalescer->lock, oldIrql);
+}
+
+void CoalesceWriteStarted(IN PSTORAGE_OBJECT pStorageObject, IN ULONGLONG byteOffset, IN ULONGLONG length) {
+    if (!g_coalescers || !g_pStorageObjects || !length)
+        return;
+
+    // A partition and its raw disk have separate tables over the same sectors.
+    ULONGLONG diskOffset = (pStorageObject->info.isRawDiskObject ? 0 : pStorageObject->info.partitionStartingOffset) + byteOffset;
+    for (auto pObject : g_pStorageObjects->locked()) {
+        if (!pObject || pObject->info.diskIndex != pStorageObject->info.diskIndex)
+            continue;
+        CoalescerCloseFlights(pObject, diskOffset, length);
+    }
+}
+
+void CoalesceFree(IN PSTORAGE_OBJECT pStorageObject) {
+    if (pStorageObject->pCoalescer) {
+        delete (PCOALESCER)pStorageObject->pCoalescer;
+        pStorageObject->pCoalescer = NULL;
+        InterlockedDecrement(&g_coalescers);
+    }
+}
+
+NTSTATUS SetCoalesceIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject) {
+    LOG("SetCoalesceIoctlHandler called\n");
+    if (!pStorageObject)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    SECTOR_COALESCE_REQUEST request;
+    PVOID userInput = pIrpStack->Parameters.DeviceIoControl.Type3InputBuffer;
+    if (!userInput || pIrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(request))
+        return STATUS_INFO_LENGTH_MISMATCH;
+
+    __try {
+        ProbeForRead(userInput, sizeof(request), 1);
+        RtlCopyMemory(&request, userInput, sizeof(request));
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return GetExceptionCode();
+    }
+
+    PCOALESCER pCoalescer = CoalescerGet(pStorageObject);
+    if (!pCoalescer)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    KIRQL oldIrql;
+    if (!(request.settings.flags & SECTOR_COALESCE_QUERY_ONLY)) {
+        if (request.settings.maxBytes > SECTOR_COALESCE_MAX_BYTES)
+            return STATUS_INVALID_PARAMETER;
+
+        KeAcquireSpinLock(&pCoalescer->lock, &oldIrql);
+        pCoalescer->settings.disabled = request.settings.disabled;
+        pCoalescer->settings.windowMicroseconds = request.settings.windowMicroseconds;
+        pCoalescer->settings.maxBytes = request.settings.maxBytes ? request.settings.maxBytes : SECTOR_COALESCE_DEFAULT_MAX_BYTES;
+        KeReleaseSpinLock(&pCoalescer->lock, oldIrql);
+    }
+
+    PVOID outBuffer = pIrp->UserBuffer;
+    if (!outBuffer || pIrpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(SECTOR_COALESCE_STATUS))
+        return STATUS_SUCCESS;
+
+    SECTOR_COALESCE_STATUS coalesceStatus;
+    KeAcquireSpinLock(&pCoalescer->lock, &oldIrql);
+    coalesceStatus.settings = pCoalescer->settings;
+    coalesceStatus.reads = pCoalescer->reads;
+    coalesceStatus.lowerReads = pCoalescer->lowerReads;
+    coalesceStatus.dedupedReads = pCoalescer->dedupedReads;
+    coalesceStatus.mergedReads = pCoalescer->mergedReads;
+    coalesceStatus.savedIrps = pCoalescer->dedupedReads + pCoalescer->mergedReads;
+    coalesceStatus.lowerBytes = pCoalescer->lowerBytes;
+    coalesceStatus.deliveredBytes = pCoalescer->deliveredBytes;
+    coalesceStatus.inFlight = pCoalescer->flightCount;
+    KeReleaseSpinLock(&pCoalescer->lock, oldIrql);
+
+    __try {
+        ProbeForWrite(outBuffer, sizeof(coalesceStatus), 1);
+        RtlCopyMemory(outBuffer, &coalesceStatus, sizeof(coalesceStatus));
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return GetExceptionCode();
+    }
+    pIrp->IoStatus.Information = sizeof(coalesceStatus);
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include "StorageIo.hpp"
+
+#pragma pack (push, 1)
+
+#define SECTOR_COALESCE_QUERY_ONLY              0x00000001  // leave the settings alone, only return the status
+
+#define SECTOR_COALESCE_DEFAULT_WINDOW_US       200
+#define SECTOR_COALESCE_DEFAULT_MAX_BYTES       (1024 * 1024)
+#define SECTOR_COALESCE_MAX_BYTES               (8 * 1024 * 1024)
+
+typedef struct _SECTOR_COALESCE_SETTINGS {
+    ULONG flags;                    // SECTOR_COALESCE_QUERY_ONLY
+    BOOLEAN disabled;               // coalescing is off until IOCTL_SET_COALESCE clears this
+    ULONG windowMicroseconds;       // longest a new lower read waits for adjacent reads while others are in flight; it
+                                    // goes down as soon as one attaches or another lower read completes. The wait
+                                    // cannot end earlier than the system clock allows
+    ULONG maxBytes;                 // largest merged lower read; larger reads bypass the table. 0 selects the default
+} SECTOR_COALESCE_SETTINGS, *PSECTOR_COALESCE_SETTINGS;
+
+typedef struct _SECTOR_COALESCE_REQUEST {
+    STORAGE_LOCATION location;
+    SECTOR_COALESCE_SETTINGS settings;
+} SECTOR_COALESCE_REQUEST, *PSECTOR_COALESCE_REQUEST;
+
+typedef struct _SECTOR_COALESCE_STATUS {
+    SECTOR_COALESCE_SETTINGS settings;
+    ULONGLONG reads;                // reads that went through the table
+    ULONGLONG lowerReads;           // lower IRPs actually issued for them
+    ULONGLONG dedupedReads;         // served by a lower read already in flight
+    ULONGLONG mergedReads;          // widened a lower read that had not been sent yet
+    ULONGLONG savedIrps;            // dedupedReads + mergedReads
+    ULONGLONG lowerBytes;
+    ULONGLONG deliveredBytes;
+    ULONG inFlight;
+} SECTOR_COALESCE_STATUS, *PSECTOR_COALESCE_STATUS;
+
+#pragma pack (pop)
+
+// Reads of at most maxBytes that are whole sectors go through the storage object's in-flight read table, once
+// IOCTL_SET_COALESCE has turned it on. Until then reads go straight into the caller's buffer.
+BOOLEAN CoalesceAccepts(IN PSTORAGE_OBJECT pStorageObject, IN ULONGLONG byteOffset, IN ULONG length);
+// Reads into pDestination, attaching to an overlapping lower read already in flight or widening one that is still
+// gathering adjacent reads; otherwise starts a new lower read. A read served by a lower read issued for another
+// request still waits for its own handle's QoS budget. Must be called at PASSIVE_LEVEL.
+NTSTATUS CoalescedRead(IN PSTORAGE_OBJECT pStorageObject, IN PIRP pOriginIrp OPTIONAL, IN ULONGLONG byteOffset, IN ULONG length, OUT PVOID pDestination, OUT PULONG_PTR information);
+// Stops reads issued from now on from attaching to lower reads that overlap a write or trim, both on this storage
+// object and on the raw disk or partitions that address the same sectors.
+void CoalesceWriteStarted(IN PSTORAGE_OBJECT pStorageObject, IN ULONGLONG byteOffset, IN ULONGLONG length);
+void CoalesceFree(IN PSTORAGE_OBJECT pStorageObject);
+
+NTSTATUS SetCoalesceIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject);
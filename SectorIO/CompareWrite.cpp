@@ -0,0 +1,356 @@
+#include "CompareWrite.hpp"
+#include "Coalesce.hpp"
+#include "PartitionMap.hpp"
+#include "RequestControl.hpp"
+#include "BlockScan.hpp"
+#include "ChangeTracking.hpp"
+#include "Rescue.hpp"
+#include "Digest.hpp"
+#include "Simd.hpp"
+#include <ntddscsi.h>
+
+#define SCSI_COMPARE_AND_WRITE          0x89
+#define SCSI_COMPARE_AND_WRITE_TIMEOUT  30      // seconds
+#define SCSI_STATUS_CHECK_CONDITION     0x02
+#define SCSI_SENSE_ILLEGAL_REQUEST      0x05
+#define SCSI_SENSE_MISCOMPARE           0x0E
+#define SCSI_ASC_INVALID_OPCODE         0x20
+
+#define COMPARE_WRITE_SUPPORT_UNKNOWN   0
+#define COMPARE_WRITE_SUPPORTED         1
+#define COMPARE_WRITE_UNSUPPORTED       2
+
+// Read-modify-writes done by the driver, emulated compare-and-writes and padded writes, hold this from the read to the
+// write, and device compare-and-writes hold it so they do not land in between. Plain writes are not held off, so these
+// are only atomic against each other.
+static FAST_MUTEX g_emulationMutex;
+
+typedef struct _SCSI_PASS_THROUGH_DIRECT_WITH_SENSE {
+    SCSI_PASS_THROUGH_DIRECT sptd;
+    ULONG filler;
+    UCHAR sense[32];
+} SCSI_PASS_THROUGH_DIRECT_WITH_SENSE, *PSCSI_PASS_THROUGH_DIRECT_WITH_SENSE;
+
+void CompareWriteInitialize() {
+    ExInitializeFastMutex(&g_emulationMutex);
+}
+
+static NTSTATUS TransferKernelBuffer(IN PSTORAGE_OBJECT pStorageObject, IN PIRP pOriginIrp, IN BOOLEAN isWrite, IN PMDL pMdl, IN ULONGLONG byteOffset, IN ULONG length) {
+    STORAGE_IO io;
+    StorageIoInitialize(&io, pStorageObject, isWrite, pMdl, byteOffset, length, pOriginIrp);
+    return StorageIoTransfer(&io, NULL);
+}
+
+NTSTATUS VerifyWrittenRange(IN PSTORAGE_OBJECT pStorageObject, IN PIRP pOriginIrp OPTIONAL, IN ULONGLONG byteOffset, IN const UCHAR* data, IN ULONG length, OUT PULONG pMismatchOffset) {
+    PUCHAR pBuffer;
+    PMDL pMdl;
+    NTSTATUS status = StorageIoAllocateBuffer(length, &pBuffer, &pMdl);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    status = TransferKernelBuffer(pStorageObject, pOriginIrp, FALSE, pMdl, byteOffset, length);
+    if (NT_SUCCESS(status)) {
+        SIMD_SCOPE scope;
+        SimdEnterScope(&scope);
+        *pMismatchOffset = (ULONG)BlockFirstDifference(pBuffer, data, length, scope.features);
+        SimdLeaveScope(&scope);
+        if (*pMismatchOffset < length)
+            LOG("  write verification failed at offset %lu\n", *pMismatchOffset);
+    }
+    StorageIoFreeBuffer(pBuffer, pMdl);
+    return status;
+}
+
+NTSTATUS PaddedWrite(IN PSTORAGE_OBJECT pStorageObject, IN PIRP pOriginIrp OPTIONAL, IN ULONGLONG byteOffset, IN const UCHAR* data, IN ULONG length, IN BOOLEAN writeThrough) {
+    ULONG physicalSectorSize = pStorageObject->info.physicalSectorSize;
+    PHYSICAL_SECTOR_SPAN span;
+    if (StorageIsPhysicallyAligned(pStorageObject, byteOffset, length) || length > SECTOR_PADDED_WRITE_MAX_BYTES ||
+        !PhysicalSectorSpan(physicalSectorSize, pStorageObject->info.physicalSectorOffset, byteOffset, length, &span) ||
+        span.end > GetStorageObjectLength(pStorageObject))
+        return STATUS_NOT_SUPPORTED;
+
+    ULONGLONG start = span.start;
+    ULONG paddedLength = (ULONG)(span.end - span.start);
+    ULONG headLength = span.headLength;
+    PUCHAR pBuffer;
+    PMDL pMdl;
+    NTSTATUS status = StorageIoAllocateBuffer(paddedLength, &pBuffer, &pMdl);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    PMDL pEdgeMdl = IoAllocateMdl(pBuffer, paddedLength, FALSE, FALSE, NULL);
+    if (!pEdgeMdl) {
+        StorageIoFreeBuffer(pBuffer, pMdl);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    ExAcquireFastMutex(&g_emulationMutex);
+    if (span.readHead) {
+        IoBuildPartialMdl(pMdl, pEdgeMdl, pBuffer, physicalSectorSize);
+        status = TransferKernelBuffer(pStorageObject, pOriginIrp, FALSE, pEdgeMdl, start, physicalSectorSize);
+        MmPrepareMdlForReuse(pEdgeMdl);
+    }
+    if (NT_SUCCESS(status) && span.readTail) {
+        ULONG tailSector = paddedLength - physicalSectorSize;
+        IoBuildPartialMdl(pMdl, pEdgeMdl, pBuffer + tailSector, physicalSectorSize);
+        status = TransferKernelBuffer(pStorageObject, pOriginIrp, FALSE, pEdgeMdl, start + tailSector, physicalSectorSize);
+        MmPrepareMdlForReuse(pEdgeMdl);
+    }
+    if (NT_SUCCESS(status)) {
+        RtlCopyMemory(pBuffer + headLength, data, length);
+        STORAGE_IO io;
+        StorageIoInitialize(&io, pStorageObject, TRUE, pMdl, start, paddedLength, pOriginIrp);
+        io.writeThrough = writeThrough;
+        status = StorageIoTransfer(&io, NULL);
+    }
+    ExReleaseFastMutex(&g_emulationMutex);
+
+    if (NT_SUCCESS(status)) {
+        InterlockedIncrement64(&pStorageObject->paddedWrites);
+        LOG("  write at %llu+%lu padded to %llu+%lu\n", byteOffset, length, start, paddedLength);
+    }
+    IoFreeMdl(pEdgeMdl);
+    StorageIoFreeBuffer(pBuffer, pMdl);
+    return status;
+}
+
+// Hands the compare to the device. Returns STATUS_NOT_SUPPORTED when the driver should emulate it instead. The
+// pass-through is admitted like a transfer, but once sent only its own timeout bounds it, not the request's deadline.
+static NTSTATUS DeviceCompareAndWrite(IN PSTORAGE_OBJECT pStorageObject, IN PIRP pIrp, IN ULONGLONG byteOffset, IN const UCHAR* expected, IN const UCHAR* data, IN ULONG length, OUT PSECTOR_COMPARE_WRITE_RESULT pResult) {
+    ULONG sectorSize = pStorageObject->info.sectorSize;
+    ULONG blocks = length / sectorSize;
+    if (blocks > 0xFF || pStorageObject->compareWriteSupport == COMPARE_WRITE_UNSUPPORTED)
+        return STATUS_NOT_SUPPORTED;
+
+    NTSTATUS status = StorageIoAdmitCommand(pStorageObject, pIrp, 2 * length);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    // The data-out buffer holds the verify instance followed by the write instance.
+    PUCHAR pBuffer;
+    PMDL pMdl;
+    status = StorageIoAllocateBuffer(2 * length, &pBuffer, &pMdl);
+    if (!NT_SUCCESS(status))
+        return status;
+    RtlCopyMemory(pBuffer, expected, length);
+    RtlCopyMemory(pBuffer + length, data, length);
+
+    // The command addresses the disk, not the partition.
+    ULONGLONG lba = (pStorageObject->info.partitionStartingOffset + byteOffset) / sectorSize;
+    SCSI_PASS_THROUGH_DIRECT_WITH_SENSE spt;
+    RtlZeroMemory(&spt, sizeof(spt));
+    spt.sptd.Length = sizeof(spt.sptd);
+    spt.sptd.CdbLength = 16;
+    spt.sptd.SenseInfoLength = sizeof(spt.sense);
+    spt.sptd.SenseInfoOffset = FIELD_OFFSET(SCSI_PASS_THROUGH_DIRECT_WITH_SENSE, sense);
+    spt.sptd.DataIn = SCSI_IOCTL_DATA_OUT;
+    spt.sptd.DataTransferLength = 2 * length;
+    spt.sptd.DataBuffer = pBuffer;
+    spt.sptd.TimeOutValue = SCSI_COMPARE_AND_WRITE_TIMEOUT;
+    spt.sptd.Cdb[0] = SCSI_COMPARE_AND_WRITE;
+    for (int i = 0; i < 8; i++)
+        spt.sptd.Cdb[2 + i] = (UCHAR)(lba >> (56 - 8 * i));
+    spt.sptd.Cdb[13] = (UCHAR)blocks;
+
+    // Held against the driver's own read-modify-writes of the range. The pass-through IRP is completed through a
+    // special kernel APC, so the mutex is taken in a critical region rather than at APC_LEVEL.
+    KeEnterCriticalRegion();
+    ExAcquireFastMutexUnsafe(&g_emulationMutex);
+    CoalesceWriteStarted(pStorageObject, byteOffset, length);
+    PartitionCacheInvalidate(pStorageObject, byteOffset, length);
+    status = IoDeviceControl(pStorageObject->pStorageDeviceObject, IOCTL_SCSI_PASS_THROUGH_DIRECT, &spt, sizeof(spt), &spt, sizeof(spt), NULL);
+    PartitionCacheInvalidate(pStorageObject, byteOffset, length);
+    ChangeTrackingMarkWrite(pStorageObject, byteOffset, length);
+    ExReleaseFastMutexUnsafe(&g_emulationMutex);
+    KeLeaveCriticalRegion();
+    StorageIoFreeBuffer(pBuffer, pMdl);
+
+    if (!NT_SUCCESS(status)) {
+        // Not a SCSI stack, or pass-through is filtered out somewhere below.
+        LOG("  COMPARE AND WRITE pass-through failed: 0x%08X, emulating\n", status);
+        InterlockedExchange(&pStorageObject->compareWriteSupport, COMPARE_WRITE_UNSUPPORTED);
+        return STATUS_NOT_SUPPORTED;
+    }
+    if (spt.sptd.ScsiStatus == 0) {
+        InterlockedExchange(&pStorageObject->compareWriteSupport, COMPARE_WRITE_SUPPORTED);
+        BadSectorsTransferDone(pStorageObject, TRUE, byteOffset, length, STATUS_SUCCESS);
+        pResult->outcome = SECTOR_COMPARE_WRITTEN;
+        pResult->deviceCompared = TRUE;
+        return STATUS_SUCCESS;
+    }
+    if (spt.sptd.ScsiStatus != SCSI_STATUS_CHECK_CONDITION)
+        return STATUS_IO_DEVICE_ERROR;
+
+    // Only fixed format sense data is decoded; anything else falls back to emulation or fails below.
+    UCHAR senseKey = spt.sense[2] & 0x0F;
+    UCHAR asc = spt.sense[12];
+    BOOLEAN fixedFormat = (spt.sense[0] & 0x7E) == 0x70;
+    if (fixedFormat && senseKey == SCSI_SENSE_MISCOMPARE) {
+        pResult->outcome = SECTOR_COMPARE_MISMATCH;
+        pResult->deviceCompared = TRUE;
+        // The INFORMATION field holds the offset of the first miscompare when it is marked valid.
+        if (spt.sense[0] & 0x80)
+            pResult->mismatchOffset = ((ULONG)spt.sense[3] << 24) | ((ULONG)spt.sense[4] << 16) | ((ULONG)spt.sense[5] << 8) | spt.sense[6];
+        else
+            pResult->mismatchOffset = (ULONG)-1;
+        return STATUS_SUCCESS;
+    }
+    if (fixedFormat && senseKey == SCSI_SENSE_ILLEGAL_REQUEST) {
+        // An invalid opcode rules the command out for good; other illegal requests, such as a length above the
+        // device's maximum compare and write length, only for this request.
+        if (asc == SCSI_ASC_INVALID_OPCODE)
+            InterlockedExchange(&pStorageObject->compareWriteSupport, COMPARE_WRITE_UNSUPPORTED);
+        LOG("  COMPARE AND WRITE rejected (ASC 0x%02X), emulating\n", asc);
+        return STATUS_NOT_SUPPORTED;
+    }
+    LOG("  COMPARE AND WRITE failed: sense key 0x%X ASC 0x%02X\n", senseKey, asc);
+    return STATUS_IO_DEVICE_ERROR;
+}
+
+static NTSTATUS EmulatedCompareAndWrite(IN PSTORAGE_OBJECT pStorageObject, IN PIRP pIrp, IN ULONG flags, IN ULONGLONG byteOffset, IN const UCHAR* expected, IN PMDL pDataMdl, IN ULONG length, OUT PSECTOR_COMPARE_WRITE_RESULT pResult) {
+    PUCHAR pCurrent = NULL;
+    PMDL pCurrentMdl = NULL;
+    NTSTATUS status = STATUS_SUCCESS;
+    BOOLEAN compare = (flags & (SECTOR_COMPARE_BYTES | SECTOR_COMPARE_SHA256)) != 0;
+
+    if (compare)
+        ExAcquireFastMutex(&g_emulationMutex);
+
+    if (compare) {
+        status = StorageIoAllocateBuffer(length, &pCurrent, &pCurrentMdl);
+        if (!NT_SUCCESS(status))
+            goto Done;
+        status = TransferKernelBuffer(pStorageObject, pIrp, FALSE, pCurrentMdl, byteOffset, length);
+        if (!NT_SUCCESS(status))
+            goto Done;
+
+        SIMD_SCOPE scope;
+        SimdEnterScope(&scope);
+        if (flags & SECTOR_COMPARE_BYTES) {
+            ULONG offset = (ULONG)BlockFirstDifference(pCurrent, expected, length, scope.features);
+            if (offset < length) {
+                pResult->outcome = SECTOR_COMPARE_MISMATCH;
+                pResult->mismatchOffset = offset;
+            }
+        }
+        else {
+            SHA256_STATE sha256;
+            UCHAR digest[SHA256_DIGEST_LENGTH];
+            Sha256Init(&sha256);
+            Sha256Update(&sha256, pCurrent, length, scope.features);
+            Sha256Final(&sha256, digest, scope.features);
+            if (RtlCompareMemory(digest, expected, sizeof(digest)) != sizeof(digest)) {
+                pResult->outcome = SECTOR_COMPARE_MISMATCH;
+                pResult->mismatchOffset = (ULONG)-1;
+            }
+        }
+        SimdLeaveScope(&scope);
+        if (pResult->outcome == SECTOR_COMPARE_MISMATCH)
+            goto Done;
+    }
+
+    status = TransferKernelBuffer(pStorageObject, pIrp, TRUE, pDataMdl, byteOffset, length);
+    if (NT_SUCCESS(status))
+        pResult->outcome = SECTOR_COMPARE_WRITTEN;
+
+Done:
+    if (compare)
+        ExReleaseFastMutex(&g_emulationMutex);
+    StorageIoFreeBuffer(pCurrent, pCurrentMdl);
+    return status;
+}
+
+NTSTATUS CompareWriteIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject) {
+    LOG("CompareWriteIoctlHandler called\n");
+    if (!pStorageObject)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    PUCHAR pInput = NULL;
+    ULONG inputLength = 0;
+    PUCHAR pData = NULL;
+    PMDL pDataMdl = NULL;
+    SECTOR_COMPARE_WRITE_RESULT result = { SECTOR_COMPARE_WRITTEN, 0, FALSE };
+    PVOID outBuffer = pIrp->UserBuffer;
+    if (!outBuffer || pIrpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(result))
+        return STATUS_INFO_LENGTH_MISMATCH;
+
+    NTSTATUS status = CaptureIoctlInput(pIrpStack, sizeof(SECTOR_COMPARE_WRITE_REQUEST),
+        sizeof(SECTOR_COMPARE_WRITE_REQUEST) + 2 * SECTOR_COMPARE_WRITE_MAX_BYTES, &pInput, &inputLength);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    PSECTOR_COMPARE_WRITE_REQUEST pRequest = (PSECTOR_COMPARE_WRITE_REQUEST)pInput;
+    ULONG flags = pRequest->flags;
+    ULONG length = pRequest->length;
+    ULONG sectorSize = pStorageObject->info.sectorSize;
+    ULONG expectedLength = (flags & SECTOR_COMPARE_BYTES) ? length : (flags & SECTOR_COMPARE_SHA256) ? SHA256_DIGEST_LENGTH : 0;
+    if ((flags & ~SECTOR_COMPARE_ALL) || (flags & SECTOR_COMPARE_BYTES && flags & SECTOR_COMPARE_SHA256) ||
+        sectorSize == 0 || length == 0 || length > SECTOR_COMPARE_WRITE_MAX_BYTES || length % sectorSize) {
+        status = STATUS_INVALID_PARAMETER;
+        goto Done;
+    }
+    if (inputLength < sizeof(SECTOR_COMPARE_WRITE_REQUEST) + expectedLength + length) {
+        status = STATUS_INFO_LENGTH_MISMATCH;
+        goto Done;
+    }
+    status = ValidateSectorRange(pStorageObject, pRequest->location.sectorNumber, length / sectorSize);
+    if (!NT_SUCCESS(status))
+        goto Done;
+
+    {
+        const UCHAR* expected = pInput + sizeof(SECTOR_COMPARE_WRITE_REQUEST);
+        ULONGLONG byteOffset = pRequest->location.sectorNumber * sectorSize;
+        RequestSetDeadline(pIrp, pRequest->timeoutMs);
+
+        // Lower transfers need nonpaged memory; the captured input is paged.
+        status = StorageIoAllocateBuffer(length, &pData, &pDataMdl);
+        if (!NT_SUCCESS(status))
+            goto Done;
+        RtlCopyMemory(pData, expected + expectedLength, length);
+
+        status = STATUS_NOT_SUPPORTED;
+        if (flags & SECTOR_COMPARE_BYTES)
+            status = DeviceCompareAndWrite(pStorageObject, pIrp, byteOffset, expected, pData, length, &result);
+        if (status == STATUS_NOT_SUPPORTED)
+            status = EmulatedCompareAndWrite(pStorageObject, pIrp, flags, byteOffset, expected, pDataMdl, length, &result);
+        if (!NT_SUCCESS(status))
+            goto Done;
+
+        // A miscompare the device did not locate is found by reading the range once more.
+        if (result.outcome == SECTOR_COMPARE_MISMATCH && result.mismatchOffset == (ULONG)-1 && (flags & SECTOR_COMPARE_BYTES)) {
+            ULONG offset;
+            status = VerifyWrittenRange(pStorageObject, pIrp, byteOffset, expected, length, &offset);
+            if (!NT_SUCCESS(status))
+                goto Done;
+            result.mismatchOffset = offset < length ? offset : (ULONG)-1;
+        }
+
+        if (result.outcome == SECTOR_COMPARE_WRITTEN && (flags & SECTOR_COMPARE_VERIFY)) {
+            ULONG offset;
+            status = VerifyWrittenRange(pStorageObject, pIrp, byteOffset, pData, length, &offset);
+            if (!NT_SUCCESS(status))
+                goto Done;
+            if (offset < length) {
+                result.outcome = SECTOR_COMPARE_VERIFY_FAILED;
+                result.mismatchOffset = offset;
+            }
+        }
+    }
+
+    LOG("  compare-and-write at sector %llu: outcome %lu, mismatch offset %ld, device compared %u\n",
+        pRequest->location.sectorNumber, result.outcome, (LONG)result.mismatchOffset, result.deviceCompared);
+    __try {
+        ProbeForWrite(outBuffer, sizeof(result), 1);
+        RtlCopyMemory(outBuffer, &result, sizeof(result));
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        status = GetExceptionCode();
+        goto Done;
+    }
+    pIrp->IoStatus.Information = sizeof(result);
+
+Done:
+    StorageIoFreeBuffer(pData, pDataMdl);
+    delete[] pInput;
+    return status;
+}
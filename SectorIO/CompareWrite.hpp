@@ -0,0 +1,50 @@
+#pragma once
+#include "StorageIo.hpp"
+
+#pragma pack (push, 1)
+
+#define SECTOR_COMPARE_WRITE_MAX_BYTES  (1024 * 1024)
+// Longer unaligned writes are passed on as they are; the device only has to read their first and last physical
+// sector, which costs little next to the rest of the transfer.
+#define SECTOR_PADDED_WRITE_MAX_BYTES   (1024 * 1024)
+
+#define SECTOR_COMPARE_BYTES            0x00000001  // UCHAR expected[length] precedes the data
+#define SECTOR_COMPARE_SHA256           0x00000002  // the SHA-256 of the expected contents precedes the data
+#define SECTOR_COMPARE_VERIFY           0x00000004  // read the range back after writing and compare it with the data
+#define SECTOR_COMPARE_ALL              0x00000007
+
+// Input of IOCTL_SECTOR_COMPARE_WRITE. Writes the data only if the range currently holds the expected contents,
+// without a round trip to user mode in between. With SECTOR_COMPARE_BYTES the device does the compare and the write
+// in one SCSI COMPARE AND WRITE if it supports the command; otherwise the driver reads, compares and writes while
+// holding off other compare-and-writes. Without a compare flag the data is written unconditionally.
+typedef struct _SECTOR_COMPARE_WRITE_REQUEST {
+    STORAGE_LOCATION location;      // location.sectorNumber is the first sector written
+    ULONG flags;                    // SECTOR_COMPARE_*
+    ULONG timeoutMs;                // as in SECTOR_IO_REQUEST
+    ULONG length;                   // bytes to write, a whole number of sectors
+    // expected contents or their SHA-256, then UCHAR data[length]
+} SECTOR_COMPARE_WRITE_REQUEST, *PSECTOR_COMPARE_WRITE_REQUEST;
+
+#define SECTOR_COMPARE_WRITTEN          0
+#define SECTOR_COMPARE_MISMATCH         1   // the range did not hold the expected contents; nothing was written
+#define SECTOR_COMPARE_VERIFY_FAILED    2   // written, but the range reads back differently
+
+// Mismatches are outcomes rather than errors, so the result always reaches the caller.
+typedef struct _SECTOR_COMPARE_WRITE_RESULT {
+    ULONG outcome;                  // SECTOR_COMPARE_*
+    ULONG mismatchOffset;           // first differing byte from the start of the range; (ULONG)-1 if only a
+                                    // digest was compared
+    BOOLEAN deviceCompared;         // done by the device in one COMPARE AND WRITE
+} SECTOR_COMPARE_WRITE_RESULT, *PSECTOR_COMPARE_WRITE_RESULT;
+
+#pragma pack (pop)
+
+void CompareWriteInitialize();
+// Reads the range back and compares it with data. *pMismatchOffset is length if it reads back the same.
+NTSTATUS VerifyWrittenRange(IN PSTORAGE_OBJECT pStorageObject, IN PIRP pOriginIrp OPTIONAL, IN ULONGLONG byteOffset, IN const UCHAR* data, IN ULONG length, OUT PULONG pMismatchOffset);
+// Widens a write that does not cover whole physical sectors by reading the partial ones first, so the device gets
+// an aligned write instead of doing its own read-modify-write. Returns STATUS_NOT_SUPPORTED when the write is aligned
+// already or cannot be widened; the caller then writes it as it is. Only atomic against other writes padded or
+// compared by this driver. writeThrough applies to the widened write.
+NTSTATUS PaddedWrite(IN PSTORAGE_OBJECT pStorageObject, IN PIRP pOriginIrp OPTIONAL, IN ULONGLONG byteOffset, IN const UCHAR* data, IN ULONG length, IN BOOLEAN writeThrough);
+NTSTATUS CompareWriteIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject);
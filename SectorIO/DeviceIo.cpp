@@ -1,4 +1,5 @@
 #include "DeviceIo.hpp"
+#include "new.hpp"
 
 void KSleep(ULONG seconds) {
 	LARGE_INTEGER time;
@@ -23,3 +24,33 @@ NTSTATUS IoDeviceControl(IN PDEVICE_OBJECT pDeviceObject, IN ULONG ioControlCode
 	if (information) *information = (ULONG_PTR)ioStatusBlock.Information;
 	return status;
 }
+
+
+NTSTATUS CaptureIoctlInput(IN PIO_STACK_LOCATION pIrpStack, IN ULONG minLength, IN ULONG maxLength, OUT PUCHAR* ppCopy, OUT PULONG pLength) {
+	*ppCopy = NULL;
+	*pLength = 0;
+
+	PVOID userInput = pIrpStack->Parameters.DeviceIoControl.Type3InputBuffer;
+	ULONG inputLength = pIrpStack->Parameters.DeviceIoControl.InputBufferLength;
+	if (!userInput || inputLength < minLength)
+		return STATUS_INFO_LENGTH_MISMATCH;
+	if (inputLength > maxLength)
+		return STATUS_INVALID_BUFFER_SIZE;
+
+	PUCHAR pCopy = new (PAGED_POOL) UCHAR[inputLength];
+	if (!pCopy)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	__try {
+		ProbeForRead(userInput, inputLength, 1);
+		RtlCopyMemory(pCopy, userInput, inputLength);
+	}
+	__except (EXCEPTION_EXECUTE_HANDLER) {
+		delete[] pCopy;
+		return GetExceptionCode();
+	}
+
+	*ppCopy = pCopy;
+	*pLength = inputLength;
+	return STATUS_SUCCESS;
+}
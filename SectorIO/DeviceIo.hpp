@@ -1,5 +1,13 @@
 #pragma once
 #include "Driver.hpp"
 
+typedef struct _IOCTL_COMPLETION_CONTEXT {
+    KEVENT event;
+    IO_STATUS_BLOCK ioStatusBlock;
+} IOCTL_COMPLETION_CONTEXT, * PIOCTL_COMPLETION_CONTEXT;
+
 void KSleep(ULONG seconds);
 NTSTATUS IoDeviceControl(IN PDEVICE_OBJECT pDeviceObject, IN ULONG ioControlCode, IN PVOID inputBuffer OPTIONAL, IN ULONG inputBufferLength, OUT PVOID outputBuffer OPTIONAL, IN ULONG outputBufferLength, OUT PULONG_PTR information OPTIONAL);
+
+// Copies a METHOD_NEITHER input buffer into paged pool. The caller frees *ppCopy with delete[].
+NTSTATUS CaptureIoctlInput(IN PIO_STACK_LOCATION pIrpStack, IN ULONG minLength, IN ULONG maxLength, OUT PUCHAR* ppCopy, OUT PULONG pLength);
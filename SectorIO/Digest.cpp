@@ -0,0 +1,364 @@
+#include "Digest.hpp"
+#include <string.h>
+
+static inline unsigned long long LoadLe64(const unsigned char* p) {
+    unsigned long long value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline unsigned int LoadLe32(const unsigned char* p) {
+    unsigned int value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline unsigned int LoadBe32(const unsigned char* p) {
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+}
+
+static inline unsigned int RotateRight32(unsigned int value, unsigned int bits) {
+    return (value >> bits) | (value << (32 - bits));
+}
+
+static inline unsigned long long RotateLeft64(unsigned long long value, unsigned int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+//
+// CRC32 / CRC32C
+//
+
+// Slice-by-8 tables, generated at compile time for both reflected polynomials.
+typedef struct _CRC32_TABLES {
+    unsigned int t[8][256];
+} CRC32_TABLES;
+
+static constexpr CRC32_TABLES MakeCrc32Tables(unsigned int polynomial) {
+    CRC32_TABLES tables = {};
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 1) ? (crc >> 1) ^ polynomial : crc >> 1;
+        tables.t[0][i] = crc;
+    }
+    for (int slice = 1; slice < 8; slice++) {
+        for (unsigned int i = 0; i < 256; i++)
+            tables.t[slice][i] = (tables.t[slice - 1][i] >> 8) ^ tables.t[0][tables.t[slice - 1][i] & 0xFF];
+    }
+    return tables;
+}
+
+static constexpr CRC32_TABLES g_crc32cTables = MakeCrc32Tables(0x82F63B78);
+static constexpr CRC32_TABLES g_crc32Tables = MakeCrc32Tables(0xEDB88320);
+
+static unsigned int Crc32Slice8(const CRC32_TABLES* tables, unsigned int crc, const unsigned char* p, size_t length) {
+    crc = ~crc;
+    for (; length >= 8; p += 8, length -= 8) {
+        unsigned int low = LoadLe32(p) ^ crc;
+        unsigned int high = LoadLe32(p + 4);
+        crc = tables->t[7][low & 0xFF] ^ tables->t[6][(low >> 8) & 0xFF] ^
+              tables->t[5][(low >> 16) & 0xFF] ^ tables->t[4][low >> 24] ^
+              tables->t[3][high & 0xFF] ^ tables->t[2][(high >> 8) & 0xFF] ^
+              tables->t[1][(high >> 16) & 0xFF] ^ tables->t[0][high >> 24];
+    }
+    for (; length; p++, length--)
+        crc = (crc >> 8) ^ tables->t[0][(crc ^ *p) & 0xFF];
+    return ~crc;
+}
+
+#if SIMD_X64
+
+SIMD_TARGET("sse4.2")
+static unsigned int Crc32cSse42(unsigned int crc, const unsigned char* p, size_t length) {
+    unsigned long long crc64 = (unsigned int)~crc;
+    for (; length >= 8; p += 8, length -= 8)
+        crc64 = _mm_crc32_u64(crc64, LoadLe64(p));
+
+    unsigned int crc32 = (unsigned int)crc64;
+    for (; length; p++, length--)
+        crc32 = _mm_crc32_u8(crc32, *p);
+    return ~crc32;
+}
+
+#endif
+
+unsigned int Crc32cUpdate(unsigned int crc, const void* data, size_t length, unsigned int features) {
+#if SIMD_X64
+    if (features & SIMD_FEATURE_SSE42)
+        return Crc32cSse42(crc, (const unsigned char*)data, length);
+#else
+    (void)features;
+#endif
+    return Crc32Slice8(&g_crc32cTables, crc, (const unsigned char*)data, length);
+}
+
+unsigned int Crc32Update(unsigned int crc, const void* data, size_t length) {
+    return Crc32Slice8(&g_crc32Tables, crc, (const unsigned char*)data, length);
+}
+
+//
+// XXH64
+//
+
+static const unsigned long long XXH_PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const unsigned long long XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const unsigned long long XXH_PRIME64_3 = 0x165667B19E3779F9ULL;
+static const unsigned long long XXH_PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const unsigned long long XXH_PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+static inline unsigned long long Xxh64Round(unsigned long long accumulator, unsigned long long input) {
+    accumulator += input * XXH_PRIME64_2;
+    accumulator = RotateLeft64(accumulator, 31);
+    return accumulator * XXH_PRIME64_1;
+}
+
+static inline unsigned long long Xxh64MergeRound(unsigned long long hash, unsigned long long accumulator) {
+    hash ^= Xxh64Round(0, accumulator);
+    return hash * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static const unsigned char* Xxh64Stripes(unsigned long long accumulators[4], const unsigned char* p, size_t stripes) {
+    unsigned long long v1 = accumulators[0], v2 = accumulators[1], v3 = accumulators[2], v4 = accumulators[3];
+    for (; stripes; stripes--, p += 32) {
+        v1 = Xxh64Round(v1, LoadLe64(p));
+        v2 = Xxh64Round(v2, LoadLe64(p + 8));
+        v3 = Xxh64Round(v3, LoadLe64(p + 16));
+        v4 = Xxh64Round(v4, LoadLe64(p + 24));
+    }
+    accumulators[0] = v1; accumulators[1] = v2; accumulators[2] = v3; accumulators[3] = v4;
+    return p;
+}
+
+void Xxh64Init(PXXH64_STATE state, unsigned long long seed) {
+    memset(state, 0, sizeof(*state));
+    state->seed = seed;
+    state->accumulators[0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    state->accumulators[1] = seed + XXH_PRIME64_2;
+    state->accumulators[2] = seed;
+    state->accumulators[3] = seed - XXH_PRIME64_1;
+}
+
+void Xxh64Update(PXXH64_STATE state, const void* data, size_t length) {
+    const unsigned char* p = (const unsigned char*)data;
+    state->totalLength += length;
+
+    if (state->bufferLength) {
+        size_t take = sizeof(state->buffer) - state->bufferLength;
+        if (take > length) take = length;
+        memcpy(state->buffer + state->bufferLength, p, take);
+        state->bufferLength += (unsigned int)take;
+        p += take;
+        length -= take;
+        if (state->bufferLength < sizeof(state->buffer))
+            return;
+        Xxh64Stripes(state->accumulators, state->buffer, 1);
+        state->bufferLength = 0;
+    }
+
+    p = Xxh64Stripes(state->accumulators, p, length / 32);
+    length %= 32;
+    if (length) {
+        memcpy(state->buffer, p, length);
+        state->bufferLength = (unsigned int)length;
+    }
+}
+
+unsigned long long Xxh64Final(const XXH64_STATE* state) {
+    unsigned long long hash;
+    if (state->totalLength >= 32) {
+        const unsigned long long* v = state->accumulators;
+        hash = RotateLeft64(v[0], 1) + RotateLeft64(v[1], 7) + RotateLeft64(v[2], 12) + RotateLeft64(v[3], 18);
+        hash = Xxh64MergeRound(hash, v[0]);
+        hash = Xxh64MergeRound(hash, v[1]);
+        hash = Xxh64MergeRound(hash, v[2]);
+        hash = Xxh64MergeRound(hash, v[3]);
+    }
+    else {
+        hash = state->seed + XXH_PRIME64_5;
+    }
+    hash += state->totalLength;
+
+    const unsigned char* p = state->buffer;
+    size_t length = state->bufferLength;
+    for (; length >= 8; p += 8, length -= 8) {
+        hash ^= Xxh64Round(0, LoadLe64(p));
+        hash = RotateLeft64(hash, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (length >= 4) {
+        hash ^= (unsigned long long)LoadLe32(p) * XXH_PRIME64_1;
+        hash = RotateLeft64(hash, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+        length -= 4;
+    }
+    for (; length; p++, length--) {
+        hash ^= *p * XXH_PRIME64_5;
+        hash = RotateLeft64(hash, 11) * XXH_PRIME64_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+//
+// SHA-256
+//
+
+static const unsigned int g_sha256K[64] = {
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+    0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+    0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+    0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+    0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+    0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2,
+};
+
+static void Sha256BlocksScalar(unsigned int hash[8], const unsigned char* p, size_t blocks) {
+    for (; blocks; blocks--, p += SHA256_BLOCK_LENGTH) {
+        unsigned int w[64];
+        for (int i = 0; i < 16; i++)
+            w[i] = LoadBe32(p + i * 4);
+        for (int i = 16; i < 64; i++) {
+            unsigned int s0 = RotateRight32(w[i - 15], 7) ^ RotateRight32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            unsigned int s1 = RotateRight32(w[i - 2], 17) ^ RotateRight32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        unsigned int a = hash[0], b = hash[1], c = hash[2], d = hash[3];
+        unsigned int e = hash[4], f = hash[5], g = hash[6], h = hash[7];
+        for (int i = 0; i < 64; i++) {
+            unsigned int t1 = h + (RotateRight32(e, 6) ^ RotateRight32(e, 11) ^ RotateRight32(e, 25)) +
+                              ((e & f) ^ (~e & g)) + g_sha256K[i] + w[i];
+            unsigned int t2 = (RotateRight32(a, 2) ^ RotateRight32(a, 13) ^ RotateRight32(a, 22)) +
+                              ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+
+        hash[0] += a; hash[1] += b; hash[2] += c; hash[3] += d;
+        hash[4] += e; hash[5] += f; hash[6] += g; hash[7] += h;
+    }
+}
+
+#if SIMD_X64
+
+// SHA-NI keeps the state as ABEF/CDGH register pairs and does two rounds per sha256rnds2; each group of four rounds
+// below also advances the message schedule for the group three steps ahead.
+SIMD_TARGET("sha,sse4.1")
+static void Sha256BlocksShaNi(unsigned int hash[8], const unsigned char* p, size_t blocks) {
+    const __m128i byteSwap = _mm_set_epi64x(0x0C0D0E0F08090A0BULL, 0x0405060700010203ULL);
+
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&hash[0]), 0xB1);      // CDAB
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&hash[4]), 0x1B);   // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);                                      // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);                                            // CDGH
+
+    for (; blocks; blocks--, p += SHA256_BLOCK_LENGTH) {
+        __m128i savedState0 = state0;
+        __m128i savedState1 = state1;
+        __m128i msg[4];
+
+        for (int group = 0; group < 16; group++) {
+            __m128i& current = msg[group & 3];
+            if (group < 4)
+                current = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + group * 16)), byteSwap);
+
+            __m128i rounds = _mm_add_epi32(current, _mm_loadu_si128((const __m128i*)&g_sha256K[group * 4]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, rounds);
+            if (group >= 3 && group < 15) {
+                __m128i& next = msg[(group + 1) & 3];
+                next = _mm_add_epi32(next, _mm_alignr_epi8(current, msg[(group + 3) & 3], 4));
+                next = _mm_sha256msg2_epu32(next, current);
+            }
+            rounds = _mm_shuffle_epi32(rounds, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, rounds);
+            if (group >= 1 && group < 13) {
+                __m128i& previous = msg[(group + 3) & 3];
+                previous = _mm_sha256msg1_epu32(previous, current);
+            }
+        }
+
+        state0 = _mm_add_epi32(state0, savedState0);
+        state1 = _mm_add_epi32(state1, savedState1);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);          // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1);       // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);    // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);       // HGFE
+    _mm_storeu_si128((__m128i*)&hash[0], state0);
+    _mm_storeu_si128((__m128i*)&hash[4], state1);
+}
+
+#endif
+
+static void Sha256Blocks(unsigned int hash[8], const unsigned char* p, size_t blocks, unsigned int features) {
+#if SIMD_X64
+    if (features & SIMD_FEATURE_SHA) {
+        Sha256BlocksShaNi(hash, p, blocks);
+        return;
+    }
+#else
+    (void)features;
+#endif
+    Sha256BlocksScalar(hash, p, blocks);
+}
+
+void Sha256Init(PSHA256_STATE state) {
+    static const unsigned int initial[8] = {
+        0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+    };
+    memset(state, 0, sizeof(*state));
+    memcpy(state->hash, initial, sizeof(initial));
+}
+
+void Sha256Update(PSHA256_STATE state, const void* data, size_t length, unsigned int features) {
+    const unsigned char* p = (const unsigned char*)data;
+    state->totalLength += length;
+
+    if (state->bufferLength) {
+        size_t take = SHA256_BLOCK_LENGTH - state->bufferLength;
+        if (take > length) take = length;
+        memcpy(state->buffer + state->bufferLength, p, take);
+        state->bufferLength += (unsigned int)take;
+        p += take;
+        length -= take;
+        if (state->bufferLength < SHA256_BLOCK_LENGTH)
+            return;
+        Sha256Blocks(state->hash, state->buffer, 1, features);
+        state->bufferLength = 0;
+    }
+
+    size_t blocks = length / SHA256_BLOCK_LENGTH;
+    if (blocks) {
+        Sha256Blocks(state->hash, p, blocks, features);
+        p += blocks * SHA256_BLOCK_LENGTH;
+        length -= blocks * SHA256_BLOCK_LENGTH;
+    }
+    if (length) {
+        memcpy(state->buffer, p, length);
+        state->bufferLength = (unsigned int)length;
+    }
+}
+
+void Sha256Final(PSHA256_STATE state, unsigned char digest[SHA256_DIGEST_LENGTH], unsigned int features) {
+    unsigned long long bitLength = state->totalLength * 8;
+    unsigned char padding[SHA256_BLOCK_LENGTH * 2] = { 0x80 };
+    size_t paddingLength = (state->bufferLength < 56 ? 56 : 120) - state->bufferLength;
+    for (int i = 0; i < 8; i++)
+        padding[paddingLength + i] = (unsigned char)(bitLength >> (56 - i * 8));
+    Sha256Update(state, padding, paddingLength + 8, features);
+
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4 + 0] = (unsigned char)(state->hash[i] >> 24);
+        digest[i * 4 + 1] = (unsigned char)(state->hash[i] >> 16);
+        digest[i * 4 + 2] = (unsigned char)(state->hash[i] >> 8);
+        digest[i * 4 + 3] = (unsigned char)state->hash[i];
+    }
+}
@@ -0,0 +1,35 @@
+#pragma once
+// Hash kernels used by IOCTL_SECTOR_DIGEST. Kept free of WDK dependencies so they build on the host as well.
+#include "SimdCommon.hpp"
+
+#define SHA256_DIGEST_LENGTH    32
+#define SHA256_BLOCK_LENGTH     64
+
+// CRC32C (Castagnoli) and CRC32 (IEEE 802.3, as used by GPT and zip). Pass 0 as the initial crc; chaining the
+// result of a previous call continues the same checksum.
+unsigned int Crc32cUpdate(unsigned int crc, const void* data, size_t length, unsigned int features);
+unsigned int Crc32Update(unsigned int crc, const void* data, size_t length);
+
+typedef struct _XXH64_STATE {
+    unsigned long long totalLength;
+    unsigned long long accumulators[4];
+    unsigned char buffer[32];
+    unsigned int bufferLength;
+    unsigned long long seed;
+} XXH64_STATE, *PXXH64_STATE;
+
+void Xxh64Init(PXXH64_STATE state, unsigned long long seed);
+void Xxh64Update(PXXH64_STATE state, const void* data, size_t length);
+unsigned long long Xxh64Final(const XXH64_STATE* state);
+
+typedef struct _SHA256_STATE {
+    unsigned int hash[8];
+    unsigned long long totalLength;
+    unsigned char buffer[SHA256_BLOCK_LENGTH];
+    unsigned int bufferLength;
+} SHA256_STATE, *PSHA256_STATE;
+
+void Sha256Init(PSHA256_STATE state);
+// SIMD_FEATURE_SHA selects the SHA-NI compression function.
+void Sha256Update(PSHA256_STATE state, const void* data, size_t length, unsigned int features);
+void Sha256Final(PSHA256_STATE state, unsigned char digest[SHA256_DIGEST_LENGTH], unsigned int features);
@@ -6,6 +6,9 @@
 
 #define DRIVER_TAG 'oIeS'
 
+// The control device user mode talks to
+extern PDEVICE_OBJECT g_pDeviceObject;
+
 
 // requires windows 10 2004 or above
 //#define NO_DEPRECATED_FUNCTIONS
@@ -0,0 +1,241 @@
+#include "Elevator.hpp"
+
+typedef struct _ELEVATOR {
+    KSPIN_LOCK lock;
+    SECTOR_ELEVATOR_SETTINGS settings;
+    BOOLEAN seekPenaltyKnown;
+    BOOLEAN seekPenalty;
+    BOOLEAN active;
+    BOOLEAN stopping;
+
+    ELEVATOR_QUEUE queue;
+    ULONGLONG position;         // end of the last transfer sent down
+    volatile LONG inFlight;
+
+    // Dispatcher thread, started the first time the elevator becomes active
+    FAST_MUTEX threadMutex;
+    PKTHREAD pThread;
+    KEVENT work;
+
+    ULONG maxQueued;
+    ULONGLONG dispatchedIos;
+    ULONGLONG sweeps;
+} ELEVATOR, *PELEVATOR;
+
+static BOOLEAN ElevatorShouldBeActive(IN PELEVATOR pElevator) {
+    switch (pElevator->settings.mode) {
+    case SECTOR_ELEVATOR_ENABLED: return TRUE;
+    case SECTOR_ELEVATOR_DISABLED: return FALSE;
+    default: return pElevator->seekPenaltyKnown && pElevator->seekPenalty;
+    }
+}
+
+static PELEVATOR ElevatorGet(IN PSTORAGE_OBJECT pStorageObject) {
+    PELEVATOR pElevator = (PELEVATOR)pStorageObject->pElevator;
+    if (pElevator)
+        return pElevator;
+
+    pElevator = new (NON_PAGED) ELEVATOR;
+    if (!pElevator)
+        return NULL;
+    RtlZeroMemory(pElevator, sizeof(*pElevator));
+    KeInitializeSpinLock(&pElevator->lock);
+    ExInitializeFastMutex(&pElevator->threadMutex);
+    KeInitializeEvent(&pElevator->work, SynchronizationEvent, FALSE);
+    ElevatorQueueInit(&pElevator->queue);
+    pElevator->settings.mode = SECTOR_ELEVATOR_AUTO;
+    pElevator->settings.depth = SECTOR_ELEVATOR_DEFAULT_DEPTH;
+
+    DEVICE_SEEK_PENALTY_DESCRIPTOR seekPenalty;
+    if (NT_SUCCESS(StorageQueryProperty(pStorageObject, StorageDeviceSeekPenaltyProperty, &seekPenalty, sizeof(seekPenalty)))) {
+        pElevator->seekPenaltyKnown = TRUE;
+        pElevator->seekPenalty = seekPenalty.IncursSeekPenalty;
+    }
+    pElevator->active = ElevatorShouldBeActive(pElevator);
+
+    PVOID pExisting = InterlockedCompareExchangePointer((PVOID*)&pStorageObject->pElevator, pElevator, NULL);
+    if (pExisting) {
+        delete pElevator;
+        return (PELEVATOR)pExisting;
+    }
+    return pElevator;
+}
+
+static VOID ElevatorDispatchThread(IN PVOID context) {
+    PELEVATOR pElevator = (PELEVATOR)context;
+    KIRQL oldIrql;
+
+    for (;;) {
+        KeWaitForSingleObject(&pElevator->work, Executive, KernelMode, FALSE, NULL);
+
+        KeAcquireSpinLock(&pElevator->lock, &oldIrql);
+        while (pElevator->queue.count && (ULONG)pElevator->inFlight < pElevator->settings.depth) {
+            int wrapped;
+            PSTORAGE_IO pIo = CONTAINING_RECORD(ElevatorQueuePopNext(&pElevator->queue, pElevator->position, &wrapped), STORAGE_IO, elevatorNode);
+            pElevator->position = pIo->byteOffset + pIo->length;
+            pElevator->dispatchedIos++;
+            if (wrapped)
+                pElevator->sweeps++;
+            InterlockedIncrement(&pElevator->inFlight);
+            KeReleaseSpinLock(&pElevator->lock, oldIrql);
+
+            IoCallDriver(pIo->pStorageObject->pStorageDeviceObject, pIo->pLowerIrp);
+
+            KeAcquireSpinLock(&pElevator->lock, &oldIrql);
+        }
+        BOOLEAN exit = pElevator->stopping && !pElevator->queue.count;
+        KeReleaseSpinLock(&pElevator->lock, oldIrql);
+
+        if (exit)
+            break;
+    }
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+static NTSTATUS ElevatorStartThread(IN PELEVATOR pElevator) {
+    NTSTATUS status = STATUS_SUCCESS;
+    ExAcquireFastMutex(&pElevator->threadMutex);
+    if (!pElevator->pThread) {
+        HANDLE hThread = NULL;
+        OBJECT_ATTRIBUTES attributes;
+        InitializeObjectAttributes(&attributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+        status = PsCreateSystemThread(&hThread, THREAD_ALL_ACCESS, &attributes, NULL, NULL, ElevatorDispatchThread, pElevator);
+        if (NT_SUCCESS(status)) {
+            PVOID pThread = NULL;
+            // Cannot fail for a handle we just created with full access
+            ObReferenceObjectByHandle(hThread, THREAD_ALL_ACCESS, *PsThreadType, KernelMode, &pThread, NULL);
+            ZwClose(hThread);
+            pElevator->pThread = (PKTHREAD)pThread;
+        }
+        else {
+            LOG("PsCreateSystemThread for elevator failed: 0x%08X\n", status);
+        }
+    }
+    ExReleaseFastMutex(&pElevator->threadMutex);
+    return status;
+}
+
+BOOLEAN ElevatorSubmit(IN PSTORAGE_IO pIo) {
+    PELEVATOR pElevator = ElevatorGet(pIo->pStorageObject);
+    if (!pElevator || !pElevator->active)
+        return FALSE;
+    if (!pElevator->pThread && !NT_SUCCESS(ElevatorStartThread(pElevator)))
+        return FALSE;
+
+    pIo->elevatorNode.key = pIo->byteOffset;
+    KIRQL oldIrql;
+    KeAcquireSpinLock(&pElevator->lock, &oldIrql);
+    if (!pElevator->active || pElevator->stopping) {
+        KeReleaseSpinLock(&pElevator->lock, oldIrql);
+        return FALSE;
+    }
+    pIo->elevated = TRUE;
+    ElevatorQueueInsert(&pElevator->queue, &pIo->elevatorNode);
+    if (pElevator->queue.count > pElevator->maxQueued)
+        pElevator->maxQueued = pElevator->queue.count;
+    KeReleaseSpinLock(&pElevator->lock, oldIrql);
+
+    KeSetEvent(&pElevator->work, IO_NO_INCREMENT, FALSE);
+    return TRUE;
+}
+
+void ElevatorIoCompleted(IN PSTORAGE_IO pIo) {
+    PELEVATOR pElevator = (PELEVATOR)pIo->pStorageObject->pElevator;
+    InterlockedDecrement(&pElevator->inFlight);
+    KeSetEvent(&pElevator->work, IO_NO_INCREMENT, FALSE);
+}
+
+BOOLEAN ElevatorWithdraw(IN PSTORAGE_IO pIo) {
+    PELEVATOR pElevator = (PELEVATOR)pIo->pStorageObject->pElevator;
+    KIRQL oldIrql;
+    KeAcquireSpinLock(&pElevator->lock, &oldIrql);
+    BOOLEAN withdrawn = ElevatorQueueRemove(&pElevator->queue, &pIo->elevatorNode) != 0;
+    KeReleaseSpinLock(&pElevator->lock, oldIrql);
+    return withdrawn;
+}
+
+void ElevatorFree(IN PSTORAGE_OBJECT pStorageObject) {
+    PELEVATOR pElevator = (PELEVATOR)pStorageObject->pElevator;
+    if (!pElevator)
+        return;
+
+    if (pElevator->pThread) {
+        KIRQL oldIrql;
+        KeAcquireSpinLock(&pElevator->lock, &oldIrql);
+        pElevator->stopping = TRUE;
+        KeReleaseSpinLock(&pElevator->lock, oldIrql);
+        KeSetEvent(&pElevator->work, IO_NO_INCREMENT, FALSE);
+        KeWaitForSingleObject(pElevator->pThread, Executive, KernelMode, FALSE, NULL);
+        ObDereferenceObject(pElevator->pThread);
+    }
+    delete pElevator;
+    pStorageObject->pElevator = NULL;
+}
+
+static void ElevatorQueryStatus(IN PELEVATOR pElevator, OUT PSECTOR_ELEVATOR_STATUS pStatus) {
+    KIRQL oldIrql;
+    KeAcquireSpinLock(&pElevator->lock, &oldIrql);
+    pStatus->settings = pElevator->settings;
+    pStatus->seekPenaltyKnown = pElevator->seekPenaltyKnown;
+    pStatus->seekPenalty = pElevator->seekPenalty;
+    pStatus->active = pElevator->active;
+    pStatus->queued = pElevator->queue.count;
+    pStatus->inFlight = (ULONG)pElevator->inFlight;
+    pStatus->maxQueued = pElevator->maxQueued;
+    pStatus->dispatchedIos = pElevator->dispatchedIos;
+    pStatus->sweeps = pElevator->sweeps;
+    KeReleaseSpinLock(&pElevator->lock, oldIrql);
+}
+
+NTSTATUS SetElevatorIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject) {
+    LOG("SetElevatorIoctlHandler called\n");
+    if (!pStorageObject)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    SECTOR_ELEVATOR_REQUEST request;
+    PVOID userInput = pIrpStack->Parameters.DeviceIoControl.Type3InputBuffer;
+    if (!userInput || pIrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(request))
+        return STATUS_INFO_LENGTH_MISMATCH;
+
+    __try {
+        ProbeForRead(userInput, sizeof(request), 1);
+        RtlCopyMemory(&request, userInput, sizeof(request));
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return GetExceptionCode();
+    }
+
+    PELEVATOR pElevator = ElevatorGet(pStorageObject);
+    if (!pElevator)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    if (!(request.settings.flags & SECTOR_ELEVATOR_QUERY_ONLY)) {
+        if (request.settings.mode > SECTOR_ELEVATOR_DISABLED || request.settings.depth > SECTOR_ELEVATOR_MAX_DEPTH)
+            return STATUS_INVALID_PARAMETER;
+
+        KIRQL oldIrql;
+        KeAcquireSpinLock(&pElevator->lock, &oldIrql);
+        pElevator->settings.mode = request.settings.mode;
+        pElevator->settings.depth = request.settings.depth ? request.settings.depth : SECTOR_ELEVATOR_DEFAULT_DEPTH;
+        // Transfers already queued are still drained by the dispatcher after the elevator is turned off.
+        pElevator->active = ElevatorShouldBeActive(pElevator);
+        KeReleaseSpinLock(&pElevator->lock, oldIrql);
+        KeSetEvent(&pElevator->work, IO_NO_INCREMENT, FALSE);
+    }
+
+    PVOID outBuffer = pIrp->UserBuffer;
+    if (!outBuffer || pIrpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(SECTOR_ELEVATOR_STATUS))
+        return STATUS_SUCCESS;
+
+    SECTOR_ELEVATOR_STATUS elevatorStatus;
+    ElevatorQueryStatus(pElevator, &elevatorStatus);
+    __try {
+        ProbeForWrite(outBuffer, sizeof(elevatorStatus), 1);
+        RtlCopyMemory(outBuffer, &elevatorStatus, sizeof(elevatorStatus));
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return GetExceptionCode();
+    }
+    pIrp->IoStatus.Information = sizeof(elevatorStatus);
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include "StorageIo.hpp"
+
+#pragma pack (push, 1)
+
+#define SECTOR_ELEVATOR_AUTO                0   // on when the device reports a seek penalty
+#define SECTOR_ELEVATOR_ENABLED             1
+#define SECTOR_ELEVATOR_DISABLED            2
+
+#define SECTOR_ELEVATOR_QUERY_ONLY          0x00000001  // leave the settings alone, only return the status
+
+#define SECTOR_ELEVATOR_DEFAULT_DEPTH       2
+#define SECTOR_ELEVATOR_MAX_DEPTH           32
+
+typedef struct _SECTOR_ELEVATOR_SETTINGS {
+    ULONG flags;                    // SECTOR_ELEVATOR_QUERY_ONLY
+    ULONG mode;                     // SECTOR_ELEVATOR_*
+    ULONG depth;                    // transfers outstanding at the device; 0 selects SECTOR_ELEVATOR_DEFAULT_DEPTH
+} SECTOR_ELEVATOR_SETTINGS, *PSECTOR_ELEVATOR_SETTINGS;
+
+typedef struct _SECTOR_ELEVATOR_REQUEST {
+    STORAGE_LOCATION location;
+    SECTOR_ELEVATOR_SETTINGS settings;
+} SECTOR_ELEVATOR_REQUEST, *PSECTOR_ELEVATOR_REQUEST;
+
+typedef struct _SECTOR_ELEVATOR_STATUS {
+    SECTOR_ELEVATOR_SETTINGS settings;
+    BOOLEAN seekPenaltyKnown;       // the device answered the seek penalty query
+    BOOLEAN seekPenalty;
+    BOOLEAN active;                 // transfers currently go through the queue
+    ULONG queued;
+    ULONG inFlight;
+    ULONG maxQueued;
+    ULONGLONG dispatchedIos;
+    ULONGLONG sweeps;               // times the C-SCAN sweep wrapped back to the lowest offset
+} SECTOR_ELEVATOR_STATUS, *PSECTOR_ELEVATOR_STATUS;
+
+#pragma pack (pop)
+
+// Takes over dispatching of a prepared transfer when the storage object's elevator is active. Transfers are held
+// while the device already has depth transfers outstanding and are released in C-SCAN order by offset, so
+// concurrent requests against rotational media stop pulling the heads back and forth.
+// Returns FALSE if the caller should send the IRP down itself. Must be called at PASSIVE_LEVEL.
+BOOLEAN ElevatorSubmit(IN PSTORAGE_IO pIo);
+// Called from the lower IRP's completion routine for transfers ElevatorSubmit accepted.
+void ElevatorIoCompleted(IN PSTORAGE_IO pIo);
+// Takes an accepted transfer back before it is sent down. Returns FALSE if the lower IRP is already on its way.
+BOOLEAN ElevatorWithdraw(IN PSTORAGE_IO pIo);
+void ElevatorFree(IN PSTORAGE_OBJECT pStorageObject);
+
+NTSTATUS SetElevatorIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject);
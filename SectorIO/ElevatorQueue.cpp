@@ -0,0 +1,51 @@
+#include "ElevatorQueue.hpp"
+
+void ElevatorQueueInit(PELEVATOR_QUEUE queue) {
+    queue->head.next = &queue->head;
+    queue->head.prev = &queue->head;
+    queue->head.key = 0;
+    queue->count = 0;
+}
+
+void ElevatorQueueInsert(PELEVATOR_QUEUE queue, PELEVATOR_NODE node) {
+    // Requests tend to arrive in ascending order, so search from the tail.
+    PELEVATOR_NODE after = queue->head.prev;
+    while (after != &queue->head && after->key > node->key)
+        after = after->prev;
+
+    node->prev = after;
+    node->next = after->next;
+    after->next->prev = node;
+    after->next = node;
+    queue->count++;
+}
+
+PELEVATOR_NODE ElevatorQueuePopNext(PELEVATOR_QUEUE queue, unsigned long long position, int* wrapped) {
+    *wrapped = 0;
+    if (queue->count == 0)
+        return 0;
+
+    PELEVATOR_NODE node = queue->head.next;
+    while (node != &queue->head && node->key < position)
+        node = node->next;
+    if (node == &queue->head) {
+        node = queue->head.next;
+        *wrapped = 1;
+    }
+
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->next = node->prev = 0;
+    queue->count--;
+    return node;
+}
+
+int ElevatorQueueRemove(PELEVATOR_QUEUE queue, PELEVATOR_NODE node) {
+    if (!node->next)
+        return 0;
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->next = node->prev = 0;
+    queue->count--;
+    return 1;
+}
@@ -0,0 +1,22 @@
+#pragma once
+// C-SCAN ordering for the per-storage-object dispatch queue. Kept free of WDK dependencies so it builds on the host
+// as well. Nodes are embedded in the caller's request structures; the queue never allocates.
+
+typedef struct _ELEVATOR_NODE {
+    struct _ELEVATOR_NODE* next;
+    struct _ELEVATOR_NODE* prev;
+    unsigned long long key;         // byte offset of the request
+} ELEVATOR_NODE, *PELEVATOR_NODE;
+
+typedef struct _ELEVATOR_QUEUE {
+    ELEVATOR_NODE head;             // sentinel; the list is kept sorted by key, equal keys in arrival order
+    unsigned int count;
+} ELEVATOR_QUEUE, *PELEVATOR_QUEUE;
+
+void ElevatorQueueInit(PELEVATOR_QUEUE queue);
+void ElevatorQueueInsert(PELEVATOR_QUEUE queue, PELEVATOR_NODE node);
+// Removes the request with the lowest key at or above position. When the sweep has passed every queued request it
+// wraps around to the lowest key and sets *wrapped. Returns 0 if the queue is empty.
+PELEVATOR_NODE ElevatorQueuePopNext(PELEVATOR_QUEUE queue, unsigned long long position, int* wrapped);
+// Takes a request out of the queue before it is popped. Returns 0 if it is no longer queued.
+int ElevatorQueueRemove(PELEVATOR_QUEUE queue, PELEVATOR_NODE node);
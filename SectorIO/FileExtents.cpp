@@ -0,0 +1,469 @@
+#include "FileExtents.hpp"
+#include "BulkIoctlHandlers.hpp"
+#include "RequestControl.hpp"
+#include <ntstrsafe.h>
+
+#define FILE_EXTENTS_QUERY_BYTES    (64 * 1024)
+#define FILE_EXTENT_SPARSE          ((ULONGLONG)-1)
+
+// Byte-granular copy of one retrieval pointer run.
+typedef struct _FILE_EXTENT {
+    ULONGLONG fileOffset;
+    ULONGLONG length;
+    ULONGLONG volumeOffset;     // FILE_EXTENT_SPARSE for runs without clusters
+} FILE_EXTENT, *PFILE_EXTENT;
+
+typedef struct _FILE_READ_SLOT {
+    PUCHAR pBuffer;
+    PMDL pMdl;
+    STORAGE_IO io;
+    BOOLEAN pending;
+    ULONG skip;                 // bytes at the start of the buffer that precede the wanted data
+    ULONG length;               // bytes copied out of the buffer
+    ULONGLONG dataOffset;       // where they go, relative to the start of the returned data
+} FILE_READ_SLOT, *PFILE_READ_SLOT;
+
+typedef struct _FILE_READ_ENGINE {
+    PSTORAGE_OBJECT pReadObject;
+    ULONGLONG readBase;         // offset of the volume on pReadObject
+    PFILE_EXTENT pExtents;
+    ULONG extentCount;
+    ULONG extentIndex;
+
+    ULONGLONG startOffset;      // file offsets
+    ULONGLONG nextOffset;
+    ULONGLONG endOffset;
+    PUCHAR pDestination;        // system mapping of the data part of the output buffer
+    ULONGLONG sparseBytes;
+
+    ULONG chunkBytes;
+    ULONG depth;
+    FILE_READ_SLOT slots[SECTOR_READ_FILE_MAX_DEPTH];
+    PIRP pOriginIrp;
+} FILE_READ_ENGINE, *PFILE_READ_ENGINE;
+
+NTSTATUS OpenVolumeFile(IN PSTORAGE_OBJECT pStorageObject, IN HANDLE rootHandle OPTIONAL, IN PCWSTR path, IN ULONG pathLength, IN ULONG createOptions, OUT PHANDLE pHandle) {
+    UNICODE_STRING name;
+    WCHAR prefix[64];
+    PWCHAR pName = NULL;
+
+    if (rootHandle) {
+        // Opened by ID: the name is the raw file reference number, resolved relative to the volume handle.
+        name.Buffer = (PWCH)path;
+        name.Length = name.MaximumLength = (USHORT)pathLength;
+    }
+    else {
+        NTSTATUS status = RtlStringCbPrintfW(prefix, sizeof(prefix), L"\\Device\\Harddisk%u\\Partition%u",
+            pStorageObject->info.diskIndex, pStorageObject->info.partitionNumber);
+        if (!NT_SUCCESS(status))
+            return status;
+
+        SIZE_T prefixLength = wcslen(prefix) * sizeof(WCHAR);
+        if (prefixLength + pathLength > MAXUSHORT)
+            return STATUS_NAME_TOO_LONG;
+        pName = new (PAGED_POOL) WCHAR[(prefixLength + pathLength) / sizeof(WCHAR)];
+        if (!pName)
+            return STATUS_INSUFFICIENT_RESOURCES;
+        RtlCopyMemory(pName, prefix, prefixLength);
+        RtlCopyMemory((PUCHAR)pName + prefixLength, path, pathLength);
+        name.Buffer = pName;
+        name.Length = name.MaximumLength = (USHORT)(prefixLength + pathLength);
+    }
+
+    OBJECT_ATTRIBUTES attributes;
+    IO_STATUS_BLOCK ioStatusBlock;
+    InitializeObjectAttributes(&attributes, &name, OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, rootHandle, NULL);
+
+    // Attribute-only access never conflicts with the share mode of other opens, which is what makes hives, the
+    // pagefile and $MFT reachable. The share check is skipped as well for file systems that apply it anyway.
+    NTSTATUS status = IoCreateFile(pHandle, FILE_READ_ATTRIBUTES | SYNCHRONIZE, &attributes, &ioStatusBlock, NULL, 0,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, FILE_OPEN,
+        createOptions | FILE_SYNCHRONOUS_IO_NONALERT | FILE_OPEN_REPARSE_POINT, NULL, 0, CreateFileTypeNone, NULL,
+        IO_NO_PARAMETER_CHECKING | IO_IGNORE_SHARE_ACCESS_CHECK);
+    delete[] pName;
+    return status;
+}
+
+static NTSTATUS OpenRequestedFile(IN PSTORAGE_OBJECT pStorageObject, IN PSECTOR_READ_FILE_REQUEST pRequest, IN PCWSTR path, OUT PHANDLE pHandle) {
+    if (!(pRequest->flags & SECTOR_READ_FILE_BY_ID))
+        return OpenVolumeFile(pStorageObject, NULL, path, pRequest->pathLength, 0, pHandle);
+
+    HANDLE volumeHandle = NULL;
+    NTSTATUS status = OpenVolumeFile(pStorageObject, NULL, L"\\", sizeof(WCHAR), FILE_DIRECTORY_FILE, &volumeHandle);
+    if (!NT_SUCCESS(status))
+        return status;
+    status = OpenVolumeFile(pStorageObject, volumeHandle, (PCWSTR)&pRequest->fileId, sizeof(pRequest->fileId), FILE_OPEN_BY_FILE_ID, pHandle);
+    ZwClose(volumeHandle);
+    return status;
+}
+
+// Collects the whole run list, merging runs that continue each other on disk so reads can span them.
+static NTSTATUS QueryFileExtents(IN HANDLE fileHandle, IN ULONG clusterBytes, OUT PFILE_EXTENT* ppExtents, OUT PULONG pCount) {
+    *ppExtents = NULL;
+    *pCount = 0;
+
+    PRETRIEVAL_POINTERS_BUFFER pPointers = (PRETRIEVAL_POINTERS_BUFFER)new (PAGED_POOL) UCHAR[FILE_EXTENTS_QUERY_BYTES];
+    if (!pPointers)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    PFILE_EXTENT pExtents = NULL;
+    ULONG count = 0;
+    ULONG capacity = 0;
+    STARTING_VCN_INPUT_BUFFER input;
+    input.StartingVcn.QuadPart = 0;
+    NTSTATUS status;
+
+    for (;;) {
+        IO_STATUS_BLOCK ioStatusBlock;
+        status = ZwFsControlFile(fileHandle, NULL, NULL, NULL, &ioStatusBlock, FSCTL_GET_RETRIEVAL_POINTERS,
+            &input, sizeof(input), pPointers, FILE_EXTENTS_QUERY_BYTES);
+        if (status == STATUS_END_OF_FILE) {
+            // Nothing allocated past the starting VCN: empty or resident files, or the end of the list.
+            status = STATUS_SUCCESS;
+            break;
+        }
+        if (!NT_SUCCESS(status) && status != STATUS_BUFFER_OVERFLOW)
+            break;
+        BOOLEAN more = status == STATUS_BUFFER_OVERFLOW;
+        if (pPointers->ExtentCount == 0) {
+            status = more ? STATUS_INVALID_DEVICE_REQUEST : STATUS_SUCCESS;
+            break;
+        }
+
+        ULONGLONG vcn = (ULONGLONG)pPointers->StartingVcn.QuadPart;
+        for (ULONG i = 0; i < pPointers->ExtentCount; i++) {
+            ULONGLONG nextVcn = (ULONGLONG)pPointers->Extents[i].NextVcn.QuadPart;
+            LONGLONG lcn = pPointers->Extents[i].Lcn.QuadPart;
+            if (nextVcn <= vcn) {
+                status = STATUS_FILE_CORRUPT_ERROR;
+                goto Done;
+            }
+
+            FILE_EXTENT extent;
+            extent.fileOffset = vcn * clusterBytes;
+            extent.length = (nextVcn - vcn) * clusterBytes;
+            extent.volumeOffset = lcn < 0 ? FILE_EXTENT_SPARSE : (ULONGLONG)lcn * clusterBytes;
+            vcn = nextVcn;
+
+            if (count) {
+                PFILE_EXTENT pLast = &pExtents[count - 1];
+                BOOLEAN lastSparse = pLast->volumeOffset == FILE_EXTENT_SPARSE;
+                BOOLEAN sparse = extent.volumeOffset == FILE_EXTENT_SPARSE;
+                if (pLast->fileOffset + pLast->length == extent.fileOffset && lastSparse == sparse &&
+                    (sparse || pLast->volumeOffset + pLast->length == extent.volumeOffset)) {
+                    pLast->length += extent.length;
+                    continue;
+                }
+            }
+
+            if (count == capacity) {
+                ULONG newCapacity = capacity ? capacity * 2 : 64;
+                PFILE_EXTENT pGrown = new (PAGED_POOL) FILE_EXTENT[newCapacity];
+                if (!pGrown) {
+                    status = STATUS_INSUFFICIENT_RESOURCES;
+                    goto Done;
+                }
+                if (count)
+                    RtlCopyMemory(pGrown, pExtents, count * sizeof(FILE_EXTENT));
+                delete[] pExtents;
+                pExtents = pGrown;
+                capacity = newCapacity;
+            }
+            pExtents[count++] = extent;
+        }
+
+        if (!more) {
+            status = STATUS_SUCCESS;
+            break;
+        }
+        input.StartingVcn.QuadPart = (LONGLONG)vcn;
+    }
+
+Done:
+    delete[] (PUCHAR)pPointers;
+    if (!NT_SUCCESS(status)) {
+        delete[] pExtents;
+        return status;
+    }
+    *ppExtents = pExtents;
+    *pCount = count;
+    return STATUS_SUCCESS;
+}
+
+// Fills slot with the read of the next piece. Sparse pieces met on the way are zero-filled right here, so a slot is
+// only left idle at the end of the range.
+static NTSTATUS FileReadStartNext(IN PFILE_READ_ENGINE pEngine, IN PFILE_READ_SLOT pSlot) {
+    ULONG sectorSize = pEngine->pReadObject->info.sectorSize;
+
+    while (pEngine->nextOffset < pEngine->endOffset) {
+        NTSTATUS abortStatus = RequestAbortStatus(pEngine->pOriginIrp);
+        if (!NT_SUCCESS(abortStatus))
+            return abortStatus;
+
+        while (pEngine->extentIndex < pEngine->extentCount) {
+            PFILE_EXTENT pCurrent = &pEngine->pExtents[pEngine->extentIndex];
+            if (pCurrent->fileOffset + pCurrent->length > pEngine->nextOffset)
+                break;
+            pEngine->extentIndex++;
+        }
+
+        PFILE_EXTENT pExtent = pEngine->extentIndex < pEngine->extentCount ? &pEngine->pExtents[pEngine->extentIndex] : NULL;
+        ULONGLONG dataOffset = pEngine->nextOffset - pEngine->startOffset;
+
+        // Holes between runs and space past the last run read as zeros, the same way the file system returns them.
+        if (!pExtent || pExtent->fileOffset > pEngine->nextOffset || pExtent->volumeOffset == FILE_EXTENT_SPARSE) {
+            ULONGLONG holeEnd = !pExtent ? pEngine->endOffset :
+                pExtent->volumeOffset == FILE_EXTENT_SPARSE ? pExtent->fileOffset + pExtent->length : pExtent->fileOffset;
+            ULONGLONG holeLength = min(holeEnd, pEngine->endOffset) - pEngine->nextOffset;
+            RtlZeroMemory(pEngine->pDestination + dataOffset, (SIZE_T)holeLength);
+            pEngine->sparseBytes += holeLength;
+            pEngine->nextOffset += holeLength;
+            continue;
+        }
+
+        ULONGLONG volumeOffset = pExtent->volumeOffset + (pEngine->nextOffset - pExtent->fileOffset);
+        ULONG skip = (ULONG)(volumeOffset % sectorSize);
+        ULONGLONG length = min(pExtent->fileOffset + pExtent->length, pEngine->endOffset) - pEngine->nextOffset;
+        length = min(length, (ULONGLONG)(pEngine->chunkBytes - skip));
+        ULONG readLength = (ULONG)((skip + length + sectorSize - 1) / sectorSize * sectorSize);
+
+        pSlot->skip = skip;
+        pSlot->length = (ULONG)length;
+        pSlot->dataOffset = dataOffset;
+        StorageIoInitialize(&pSlot->io, pEngine->pReadObject, FALSE, pSlot->pMdl, pEngine->readBase + volumeOffset - skip, readLength, pEngine->pOriginIrp);
+
+        NTSTATUS status = StorageIoStart(&pSlot->io);
+        if (status != STATUS_PENDING)
+            return status;
+        pSlot->pending = TRUE;
+        pEngine->nextOffset += length;
+        return STATUS_SUCCESS;
+    }
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS FileReadFinish(IN PFILE_READ_ENGINE pEngine, IN PFILE_READ_SLOT pSlot) {
+    ULONG_PTR transferred = 0;
+    NTSTATUS status = StorageIoWait(&pSlot->io, &transferred);
+    pSlot->pending = FALSE;
+    if (NT_SUCCESS(status) && transferred < pSlot->io.length)
+        status = STATUS_DEVICE_DATA_ERROR;
+    if (!NT_SUCCESS(status)) {
+        LOG("  file extent read at %llu failed: 0x%08X\n", pSlot->io.byteOffset, status);
+        return status;
+    }
+    RtlCopyMemory(pEngine->pDestination + pSlot->dataOffset, pSlot->pBuffer + pSlot->skip, pSlot->length);
+    return STATUS_SUCCESS;
+}
+
+// Piece n always lives in slot n % depth, which keeps the copies into the output buffer in file order and lets up to
+// depth reads be queued at the device at once.
+static NTSTATUS RunFileReadEngine(IN PFILE_READ_ENGINE pEngine) {
+    NTSTATUS status = STATUS_SUCCESS;
+    for (ULONG i = 0; i < pEngine->depth && NT_SUCCESS(status); i++)
+        status = FileReadStartNext(pEngine, &pEngine->slots[i]);
+
+    for (ULONG i = 0; NT_SUCCESS(status); i++) {
+        PFILE_READ_SLOT pSlot = &pEngine->slots[i % pEngine->depth];
+        if (!pSlot->pending)
+            break;
+        status = FileReadFinish(pEngine, pSlot);
+        if (NT_SUCCESS(status))
+            status = FileReadStartNext(pEngine, pSlot);
+    }
+
+    for (ULONG i = 0; i < pEngine->depth; i++) {
+        if (pEngine->slots[i].pending)
+            FileReadFinish(pEngine, &pEngine->slots[i]);
+    }
+    return status;
+}
+
+NTSTATUS ReadFileExtentsIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject) {
+    LOG("ReadFileExtentsIoctlHandler called\n");
+    if (!pStorageObject)
+        return STATUS_INVALID_DEVICE_REQUEST;
+    if (pStorageObject->info.isRawDiskObject)
+        return STATUS_INVALID_PARAMETER;
+
+    ULONG outLength = pIrpStack->Parameters.DeviceIoControl.OutputBufferLength;
+    PVOID outBuffer = pIrp->UserBuffer;
+    if (!outBuffer || outLength < sizeof(SECTOR_READ_FILE_RESULT))
+        return STATUS_INFO_LENGTH_MISMATCH;
+
+    PUCHAR pInput = NULL;
+    ULONG inputLength = 0;
+    NTSTATUS status = CaptureIoctlInput(pIrpStack, sizeof(SECTOR_READ_FILE_REQUEST), sizeof(SECTOR_READ_FILE_REQUEST) + SECTOR_READ_FILE_MAX_PATH_BYTES, &pInput, &inputLength);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    PSECTOR_READ_FILE_REQUEST pRequest = (PSECTOR_READ_FILE_REQUEST)pInput;
+    PCWSTR path = (PCWSTR)(pInput + sizeof(SECTOR_READ_FILE_REQUEST));
+    ULONG sectorSize = pStorageObject->info.sectorSize;
+    ULONG depth = pRequest->depth ? pRequest->depth : SECTOR_READ_FILE_DEFAULT_DEPTH;
+    ULONGLONG chunkBytes = pRequest->chunkSectors ? (ULONGLONG)pRequest->chunkSectors * sectorSize : STORAGE_IO_DEFAULT_CHUNK_BYTES;
+    HANDLE fileHandle = NULL;
+    PFILE_READ_ENGINE pEngine = NULL;
+    PFILE_EXTENT pExtents = NULL;
+    ULONG extentCount = 0;
+    PMDL pOutputMdl = NULL;
+    BOOLEAN outputLocked = FALSE;
+    SECTOR_READ_FILE_RESULT result;
+    RtlZeroMemory(&result, sizeof(result));
+
+    if (depth > SECTOR_READ_FILE_MAX_DEPTH || chunkBytes > SECTOR_BULK_MAX_CHUNK_BYTES || chunkBytes % sectorSize ||
+        (pRequest->flags & ~SECTOR_READ_FILE_BY_ID)) {
+        status = STATUS_INVALID_PARAMETER;
+        goto Done;
+    }
+    if (!(pRequest->flags & SECTOR_READ_FILE_BY_ID) &&
+        (pRequest->pathLength == 0 || pRequest->pathLength % sizeof(WCHAR) ||
+         pRequest->pathLength > inputLength - sizeof(SECTOR_READ_FILE_REQUEST) || path[0] != L'\\')) {
+        status = STATUS_OBJECT_NAME_INVALID;
+        goto Done;
+    }
+
+    status = OpenRequestedFile(pStorageObject, pRequest, path, &fileHandle);
+    if (!NT_SUCCESS(status)) {
+        LOG("  opening the file failed: 0x%08X\n", status);
+        goto Done;
+    }
+
+    {
+        IO_STATUS_BLOCK ioStatusBlock;
+        FILE_FS_SIZE_INFORMATION sizeInformation;
+        FILE_STANDARD_INFORMATION standardInformation;
+        FILE_BASIC_INFORMATION basicInformation;
+
+        status = ZwQueryVolumeInformationFile(fileHandle, &ioStatusBlock, &sizeInformation, sizeof(sizeInformation), FileFsSizeInformation);
+        if (NT_SUCCESS(status))
+            status = ZwQueryInformationFile(fileHandle, &ioStatusBlock, &standardInformation, sizeof(standardInformation), FileStandardInformation);
+        if (NT_SUCCESS(status))
+            status = ZwQueryInformationFile(fileHandle, &ioStatusBlock, &basicInformation, sizeof(basicInformation), FileBasicInformation);
+        if (!NT_SUCCESS(status))
+            goto Done;
+
+        // Compressed clusters hold LZNT1 data, not file content.
+        if (standardInformation.Directory || (basicInformation.FileAttributes & FILE_ATTRIBUTE_COMPRESSED)) {
+            status = STATUS_NOT_SUPPORTED;
+            goto Done;
+        }
+        result.clusterBytes = sizeInformation.SectorsPerAllocationUnit * sizeInformation.BytesPerSector;
+        result.fileSize = (ULONGLONG)standardInformation.EndOfFile.QuadPart;
+        if (result.clusterBytes == 0 || result.clusterBytes % sectorSize) {
+            status = STATUS_UNRECOGNIZED_VOLUME;
+            goto Done;
+        }
+    }
+
+    status = QueryFileExtents(fileHandle, result.clusterBytes, &pExtents, &extentCount);
+    if (!NT_SUCCESS(status)) {
+        LOG("  FSCTL_GET_RETRIEVAL_POINTERS failed: 0x%08X\n", status);
+        goto Done;
+    }
+    // Data kept inside the file record has no clusters of its own.
+    if (extentCount == 0 && result.fileSize) {
+        status = STATUS_NOT_SUPPORTED;
+        goto Done;
+    }
+    for (ULONG i = 0; i < extentCount; i++) {
+        if (pExtents[i].volumeOffset != FILE_EXTENT_SPARSE &&
+            (pExtents[i].volumeOffset > pStorageObject->info.partitionSizeBytes ||
+             pExtents[i].length > pStorageObject->info.partitionSizeBytes - pExtents[i].volumeOffset)) {
+            status = STATUS_FILE_CORRUPT_ERROR;
+            goto Done;
+        }
+        if (pExtents[i].volumeOffset != FILE_EXTENT_SPARSE)
+            result.extentCount++;
+    }
+
+    pEngine = new (NON_PAGED) FILE_READ_ENGINE;
+    if (!pEngine) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Done;
+    }
+    RtlZeroMemory(pEngine, sizeof(*pEngine));
+
+    // Going through the raw disk keeps the reads below whatever is stacked on the partition; the partition object is
+    // the fallback for disks that are not enumerated on their own.
+    {
+        STORAGE_LOCATION diskLocation;
+        diskLocation.isRawDiskObject = TRUE;
+        diskLocation.diskIndex = pStorageObject->info.diskIndex;
+        diskLocation.partitionNumber = (ULONG)-1;
+        diskLocation.sectorNumber = 0;
+        PSTORAGE_OBJECT pDisk = FindStorageObject(&diskLocation);
+        if (pDisk && pDisk->info.sectorSize == sectorSize) {
+            pEngine->pReadObject = pDisk;
+            pEngine->readBase = pStorageObject->info.partitionStartingOffset;
+            result.throughDisk = TRUE;
+        }
+        else {
+            pEngine->pReadObject = pStorageObject;
+            pEngine->readBase = 0;
+        }
+    }
+    pEngine->pExtents = pExtents;
+    pEngine->extentCount = extentCount;
+    pEngine->startOffset = pRequest->fileOffset;
+    pEngine->nextOffset = pRequest->fileOffset;
+    pEngine->endOffset = pRequest->fileOffset < result.fileSize ?
+        pRequest->fileOffset + min(result.fileSize - pRequest->fileOffset, (ULONGLONG)(outLength - sizeof(SECTOR_READ_FILE_RESULT))) :
+        pRequest->fileOffset;
+    pEngine->chunkBytes = (ULONG)chunkBytes;
+    pEngine->depth = depth;
+    pEngine->pOriginIrp = pIrp;
+
+    pOutputMdl = IoAllocateMdl(outBuffer, outLength, FALSE, FALSE, NULL);
+    if (!pOutputMdl) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Done;
+    }
+    __try {
+        MmProbeAndLockPages(pOutputMdl, UserMode, IoWriteAccess);
+        outputLocked = TRUE;
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        status = GetExceptionCode();
+        goto Done;
+    }
+    {
+        PUCHAR pOutput = (PUCHAR)MmGetSystemAddressForMdlSafe(pOutputMdl, NormalPagePriority | MdlMappingNoExecute);
+        if (!pOutput) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Done;
+        }
+        pEngine->pDestination = pOutput + sizeof(SECTOR_READ_FILE_RESULT);
+
+        for (ULONG i = 0; i < depth; i++) {
+            status = StorageIoAllocateBuffer(pEngine->chunkBytes, &pEngine->slots[i].pBuffer, &pEngine->slots[i].pMdl);
+            if (!NT_SUCCESS(status))
+                goto Done;
+        }
+
+        LOG("  reading %llu bytes at file offset %llu, %u extents, through %s\n", pEngine->endOffset - pEngine->startOffset,
+            pEngine->startOffset, result.extentCount, result.throughDisk ? "disk" : "partition");
+        status = RunFileReadEngine(pEngine);
+        if (!NT_SUCCESS(status))
+            goto Done;
+
+        result.bytesRead = pEngine->endOffset - pEngine->startOffset;
+        result.sparseBytes = pEngine->sparseBytes;
+        RtlCopyMemory(pOutput, &result, sizeof(result));
+        pIrp->IoStatus.Information = (ULONG_PTR)(sizeof(SECTOR_READ_FILE_RESULT) + result.bytesRead);
+    }
+
+Done:
+    if (outputLocked) MmUnlockPages(pOutputMdl);
+    if (pOutputMdl) IoFreeMdl(pOutputMdl);
+    if (pEngine) {
+        for (ULONG i = 0; i < SECTOR_READ_FILE_MAX_DEPTH; i++)
+            StorageIoFreeBuffer(pEngine->slots[i].pBuffer, pEngine->slots[i].pMdl);
+        delete pEngine;
+    }
+    delete[] pExtents;
+    if (fileHandle) ZwClose(fileHandle);
+    delete[] pInput;
+    LOG("ReadFileExtentsIoctlHandler complete, status=0x%08X\n", status);
+    return status;
+}
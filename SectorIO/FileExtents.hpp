@@ -0,0 +1,41 @@
+#pragma once
+#include "StorageIo.hpp"
+
+#pragma pack (push, 1)
+
+#define SECTOR_READ_FILE_MAX_DEPTH          16
+#define SECTOR_READ_FILE_DEFAULT_DEPTH      8
+#define SECTOR_READ_FILE_MAX_PATH_BYTES     (32767 * sizeof(WCHAR))
+
+#define SECTOR_READ_FILE_BY_ID              0x00000001  // open fileId instead of the path
+
+typedef struct _SECTOR_READ_FILE_REQUEST {
+    STORAGE_LOCATION location;  // partition holding the file; location.sectorNumber is ignored
+    ULONG flags;                // SECTOR_READ_FILE_*
+    ULONGLONG fileId;           // SECTOR_READ_FILE_BY_ID: 64-bit file reference number
+    ULONGLONG fileOffset;       // first byte of the file returned
+    ULONG chunkSectors;         // 0 selects 1 MiB reads
+    ULONG depth;                // reads in flight, 1 to SECTOR_READ_FILE_MAX_DEPTH; 0 selects SECTOR_READ_FILE_DEFAULT_DEPTH
+    ULONG pathLength;           // in bytes, without a terminator
+    // WCHAR path[pathLength / sizeof(WCHAR)], relative to the volume root, e.g. L"\\Windows\\System32\\config\\SAM"
+} SECTOR_READ_FILE_REQUEST, *PSECTOR_READ_FILE_REQUEST;
+
+// The clusters are read as they are on disk, so a file that is being written at the same time can come out torn.
+// Bytes past the valid data length of a preallocated file hold whatever the clusters contain.
+typedef struct _SECTOR_READ_FILE_RESULT {
+    ULONGLONG fileSize;
+    ULONGLONG bytesRead;        // file content following this header; call again at fileOffset + bytesRead for the rest
+    ULONGLONG sparseBytes;      // part of bytesRead that has no clusters behind it and was zero-filled
+    ULONG clusterBytes;
+    ULONG extentCount;          // allocated runs of the whole file, physically contiguous runs merged
+    BOOLEAN throughDisk;        // read from the raw disk at partitionStartingOffset instead of the partition object
+    // UCHAR data[bytesRead]
+} SECTOR_READ_FILE_RESULT, *PSECTOR_READ_FILE_RESULT;
+
+#pragma pack (pop)
+
+// Opens path on the file system mounted on the partition with attribute-only access, ignoring share modes.
+// An empty path opens the volume itself. With rootHandle, path is resolved relative to it instead.
+NTSTATUS OpenVolumeFile(IN PSTORAGE_OBJECT pStorageObject, IN HANDLE rootHandle OPTIONAL, IN PCWSTR path, IN ULONG pathLength, IN ULONG createOptions, OUT PHANDLE pHandle);
+
+NTSTATUS ReadFileExtentsIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject);
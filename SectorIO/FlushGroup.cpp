@@ -0,0 +1,122 @@
+#include "FlushGroup.hpp"
+#include "FlushTickets.hpp"
+
+// How long a flush waits for announced writes still in flight, so they share it instead of needing the next one
+#define FLUSH_GROUP_WINDOW_US   100
+
+typedef struct _FLUSH_GROUP {
+    KSPIN_LOCK lock;
+    KEVENT done;                // set when a flush is back, cleared when the next one starts
+    FLUSH_TICKETS tickets;
+} FLUSH_GROUP, *PFLUSH_GROUP;
+
+static PFLUSH_GROUP FlushGroupGet(IN PSTORAGE_OBJECT pStorageObject) {
+    PFLUSH_GROUP pGroup = (PFLUSH_GROUP)pStorageObject->pFlushGroup;
+    if (pGroup)
+        return pGroup;
+
+    pGroup = new (NON_PAGED) FLUSH_GROUP;
+    if (!pGroup)
+        return NULL;
+    KeInitializeSpinLock(&pGroup->lock);
+    KeInitializeEvent(&pGroup->done, NotificationEvent, FALSE);
+    FlushTicketsInit(&pGroup->tickets);
+
+    PVOID pExisting = InterlockedCompareExchangePointer((PVOID*)&pStorageObject->pFlushGroup, pGroup, NULL);
+    if (pExisting) {
+        delete pGroup;
+        return (PFLUSH_GROUP)pExisting;
+    }
+    return pGroup;
+}
+
+static NTSTATUS FlushDevice(IN PSTORAGE_OBJECT pStorageObject) {
+    PDEVICE_OBJECT pDeviceObject = pStorageObject->pStorageDeviceObject;
+    IO_STATUS_BLOCK ioStatusBlock;
+    KEVENT completionEvent;
+    KeInitializeEvent(&completionEvent, NotificationEvent, FALSE);
+
+    PIRP pIrp = IoBuildSynchronousFsdRequest(IRP_MJ_FLUSH_BUFFERS, pDeviceObject, NULL, 0, NULL, &completionEvent, &ioStatusBlock);
+    if (!pIrp)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    InterlockedIncrement64(&pStorageObject->lowerFlushes);
+    NTSTATUS status = IoCallDriver(pDeviceObject, pIrp);
+    if (status == STATUS_PENDING) {
+        KeWaitForSingleObject(&completionEvent, Executive, KernelMode, FALSE, NULL);
+        status = ioStatusBlock.Status;
+    }
+    if (!NT_SUCCESS(status))
+        LOG("  IRP_MJ_FLUSH_BUFFERS failed: 0x%08X\n", status);
+    return status;
+}
+
+void FlushGroupWriteStarted(IN PSTORAGE_OBJECT pStorageObject) {
+    PFLUSH_GROUP pGroup = FlushGroupGet(pStorageObject);
+    if (!pGroup)
+        return;
+    KIRQL oldIrql;
+    KeAcquireSpinLock(&pGroup->lock, &oldIrql);
+    FlushTicketsWriteStarted(&pGroup->tickets);
+    KeReleaseSpinLock(&pGroup->lock, oldIrql);
+}
+
+NTSTATUS FlushGroupCommit(IN PSTORAGE_OBJECT pStorageObject, IN NTSTATUS writeStatus) {
+    PFLUSH_GROUP pGroup = FlushGroupGet(pStorageObject);
+    if (!pGroup) {
+        if (!NT_SUCCESS(writeStatus))
+            return writeStatus;
+        InterlockedIncrement64(&pStorageObject->flushRequests);
+        return FlushDevice(pStorageObject);
+    }
+
+    KIRQL oldIrql;
+    KeAcquireSpinLock(&pGroup->lock, &oldIrql);
+    ULONGLONG ticket = FlushTicketsWriteDone(&pGroup->tickets, NT_SUCCESS(writeStatus));
+    if (!ticket) {
+        KeReleaseSpinLock(&pGroup->lock, oldIrql);
+        return writeStatus;
+    }
+    InterlockedIncrement64(&pStorageObject->flushRequests);
+
+    int next;
+    while ((next = FlushTicketsNext(&pGroup->tickets, ticket)) == FLUSH_TICKET_WAIT) {
+        KeReleaseSpinLock(&pGroup->lock, oldIrql);
+        KeWaitForSingleObject(&pGroup->done, Executive, KernelMode, FALSE, NULL);
+        KeAcquireSpinLock(&pGroup->lock, &oldIrql);
+    }
+    if (next == FLUSH_TICKET_COVERED) {
+        NTSTATUS status = (NTSTATUS)pGroup->tickets.coveredStatus;
+        KeReleaseSpinLock(&pGroup->lock, oldIrql);
+        return status;
+    }
+
+    KeClearEvent(&pGroup->done);
+    BOOLEAN gather = FlushTicketsShouldGather(&pGroup->tickets) ? TRUE : FALSE;
+    KeReleaseSpinLock(&pGroup->lock, oldIrql);
+
+    if (gather) {
+        LARGE_INTEGER interval;
+        interval.QuadPart = -(LONGLONG)FLUSH_GROUP_WINDOW_US * 10;
+        KeDelayExecutionThread(KernelMode, FALSE, &interval);
+    }
+
+    KeAcquireSpinLock(&pGroup->lock, &oldIrql);
+    ULONGLONG target = FlushTicketsSend(&pGroup->tickets);
+    KeReleaseSpinLock(&pGroup->lock, oldIrql);
+
+    NTSTATUS status = FlushDevice(pStorageObject);
+
+    KeAcquireSpinLock(&pGroup->lock, &oldIrql);
+    FlushTicketsFlushDone(&pGroup->tickets, target, status);
+    KeSetEvent(&pGroup->done, IO_NO_INCREMENT, FALSE);
+    KeReleaseSpinLock(&pGroup->lock, oldIrql);
+    return status;
+}
+
+void FlushGroupFree(IN PSTORAGE_OBJECT pStorageObject) {
+    if (pStorageObject->pFlushGroup) {
+        delete (PFLUSH_GROUP)pStorageObject->pFlushGroup;
+        pStorageObject->pFlushGroup = NULL;
+    }
+}
@@ -0,0 +1,12 @@
+#pragma once
+#include "StorageIo.hpp"
+
+// Flush-after writes of one storage object share lower IRP_MJ_FLUSH_BUFFERS requests: a flush covers every write that
+// finished before it was sent, so writers arriving while one is in flight are all covered by the next one.
+
+// Announces a write that will be followed by FlushGroupCommit, so a flush about to be sent can wait briefly for it.
+void FlushGroupWriteStarted(IN PSTORAGE_OBJECT pStorageObject);
+// Called once the announced write is done. A failed write is only accounted for; after a successful one this returns
+// when a flush sent after the write finished is back, with that flush's status. Must be called at PASSIVE_LEVEL.
+NTSTATUS FlushGroupCommit(IN PSTORAGE_OBJECT pStorageObject, IN NTSTATUS writeStatus);
+void FlushGroupFree(IN PSTORAGE_OBJECT pStorageObject);
@@ -0,0 +1,45 @@
+#include "FlushTickets.hpp"
+
+void FlushTicketsInit(PFLUSH_TICKETS tickets) {
+    tickets->flushing = 0;
+    tickets->writesInFlight = 0;
+    tickets->requested = 0;
+    tickets->covered = 0;
+    tickets->coveredStatus = 0;
+}
+
+void FlushTicketsWriteStarted(PFLUSH_TICKETS tickets) {
+    tickets->writesInFlight++;
+}
+
+unsigned long long FlushTicketsWriteDone(PFLUSH_TICKETS tickets, int succeeded) {
+    // Only a hint for the gathering window; it is off by one at most if the write could not be announced.
+    if (tickets->writesInFlight)
+        tickets->writesInFlight--;
+    return succeeded ? ++tickets->requested : 0;
+}
+
+int FlushTicketsNext(PFLUSH_TICKETS tickets, unsigned long long ticket) {
+    // A flush already in flight may have been sent before this write finished, so only the one after it counts. The
+    // status reported is that of the latest flush that covers the ticket; any of them makes the write durable.
+    if (tickets->covered >= ticket)
+        return FLUSH_TICKET_COVERED;
+    if (tickets->flushing)
+        return FLUSH_TICKET_WAIT;
+    tickets->flushing = 1;
+    return FLUSH_TICKET_LEAD;
+}
+
+int FlushTicketsShouldGather(const FLUSH_TICKETS* tickets) {
+    return tickets->writesInFlight != 0;
+}
+
+unsigned long long FlushTicketsSend(const FLUSH_TICKETS* tickets) {
+    return tickets->requested;
+}
+
+void FlushTicketsFlushDone(PFLUSH_TICKETS tickets, unsigned long long target, long status) {
+    tickets->covered = target;
+    tickets->coveredStatus = status;
+    tickets->flushing = 0;
+}
@@ -0,0 +1,30 @@
+#pragma once
+// Ticket bookkeeping for sharing lower flushes between writers. Kept free of WDK dependencies so it builds on the host
+// as well. Callers hold their lock around every call and do the waiting and the flushing themselves.
+//
+// Writers take increasing tickets once their write is done. The leader, whichever writer finds no flush in flight,
+// sends one that covers every ticket handed out before it; the others wait for a flush that covers theirs.
+
+#define FLUSH_TICKET_COVERED    0   // a flush sent after the write finished is back; its status is coveredStatus
+#define FLUSH_TICKET_WAIT       1   // wait for the flush in flight to come back, then ask again
+#define FLUSH_TICKET_LEAD       2   // send the next flush: FlushTicketsSend, flush, FlushTicketsFlushDone
+
+typedef struct _FLUSH_TICKETS {
+    int flushing;
+    unsigned int writesInFlight;    // announced writes not yet done
+    unsigned long long requested;   // last ticket handed out
+    unsigned long long covered;     // last ticket covered by a flush that is back
+    long coveredStatus;             // of that flush
+} FLUSH_TICKETS, *PFLUSH_TICKETS;
+
+void FlushTicketsInit(PFLUSH_TICKETS tickets);
+void FlushTicketsWriteStarted(PFLUSH_TICKETS tickets);
+// Accounts for an announced write that is done. Returns its ticket, or 0 for a failed write, which needs no flush.
+unsigned long long FlushTicketsWriteDone(PFLUSH_TICKETS tickets, int succeeded);
+// What the holder of the ticket does next, FLUSH_TICKET_*. Returning FLUSH_TICKET_LEAD marks a flush in flight.
+int FlushTicketsNext(PFLUSH_TICKETS tickets, unsigned long long ticket);
+// Whether the leader should hold the flush back briefly for announced writes, so they share it.
+int FlushTicketsShouldGather(const FLUSH_TICKETS* tickets);
+// Called by the leader right before it sends the flush. Returns the last ticket the flush covers.
+unsigned long long FlushTicketsSend(const FLUSH_TICKETS* tickets);
+void FlushTicketsFlushDone(PFLUSH_TICKETS tickets, unsigned long long target, long status);
@@ -0,0 +1,66 @@
+#include "HandleContext.hpp"
+#include "Topology.hpp"
+
+NTSTATUS DriverCreateHandler(IN PDEVICE_OBJECT pDeviceObject, IN PIRP pIrp) {
+	UNREFERENCED_PARAMETER(pDeviceObject);
+	LOG("DriverCreateHandler called\n");
+	NTSTATUS status = STATUS_SUCCESS;
+	PIO_STACK_LOCATION pIrpStack = IoGetCurrentIrpStackLocation(pIrp);
+
+	PHANDLE_CONTEXT pContext = new (NON_PAGED) HANDLE_CONTEXT;
+	if (!pContext) {
+		status = STATUS_INSUFFICIENT_RESOURCES;
+	}
+	else {
+		RtlZeroMemory(pContext, sizeof(*pContext));
+		QosInitialize(&pContext->qos);
+		pIrpStack->FileObject->FsContext = pContext;
+	}
+
+	pIrp->IoStatus.Information = 0;
+	pIrp->IoStatus.Status = status;
+	IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+	return status;
+}
+
+NTSTATUS DriverCleanupHandler(IN PDEVICE_OBJECT pDeviceObject, IN PIRP pIrp) {
+	UNREFERENCED_PARAMETER(pDeviceObject);
+	LOG("DriverCleanupHandler called\n");
+	PIO_STACK_LOCATION pIrpStack = IoGetCurrentIrpStackLocation(pIrp);
+
+	TopologyCancelWaits(pIrpStack->FileObject);
+
+	pIrp->IoStatus.Information = 0;
+	pIrp->IoStatus.Status = STATUS_SUCCESS;
+	IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS DriverCloseHandler(IN PDEVICE_OBJECT pDeviceObject, IN PIRP pIrp) {
+	UNREFERENCED_PARAMETER(pDeviceObject);
+	LOG("DriverCloseHandler called\n");
+	PIO_STACK_LOCATION pIrpStack = IoGetCurrentIrpStackLocation(pIrp);
+
+	// Every IRP issued on the handle has completed by the time the close arrives.
+	PHANDLE_CONTEXT pContext = (PHANDLE_CONTEXT)pIrpStack->FileObject->FsContext;
+	if (pContext) {
+		pIrpStack->FileObject->FsContext = NULL;
+		if (pContext->pBinding) {
+			ObDereferenceObject(pContext->pBinding->pStorageObject->pStorageDeviceObject);
+			delete pContext->pBinding;
+		}
+		delete pContext;
+	}
+
+	pIrp->IoStatus.Information = 0;
+	pIrp->IoStatus.Status = STATUS_SUCCESS;
+	IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+	return STATUS_SUCCESS;
+}
+
+PHANDLE_CONTEXT GetHandleContext(IN PIRP pIrp) {
+	if (!pIrp)
+		return NULL;
+	PFILE_OBJECT pFileObject = IoGetCurrentIrpStackLocation(pIrp)->FileObject;
+	return pFileObject ? (PHANDLE_CONTEXT)pFileObject->FsContext : NULL;
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include "Qos.hpp"
+
+// Storage object a handle was bound to with IOCTL_SECTOR_BIND, with the geometry bound requests are checked against.
+// Holds a reference on the storage device until the handle is closed.
+typedef struct _HANDLE_BINDING {
+    PSTORAGE_OBJECT pStorageObject;
+    ULONG sectorSize;
+    ULONGLONG sectorCount;
+} HANDLE_BINDING, *PHANDLE_BINDING;
+
+// Per-open state of the control device, kept in FILE_OBJECT->FsContext from IRP_MJ_CREATE to IRP_MJ_CLOSE.
+typedef struct _HANDLE_CONTEXT {
+    QOS_LIMITER qos;
+    PHANDLE_BINDING pBinding;   // set at most once, then fixed until close
+} HANDLE_CONTEXT, *PHANDLE_CONTEXT;
+
+NTSTATUS DriverCreateHandler(IN PDEVICE_OBJECT pDeviceObject, IN PIRP pIrp);
+// Completes the requests still pending on the handle, which would otherwise keep it from being closed.
+NTSTATUS DriverCleanupHandler(IN PDEVICE_OBJECT pDeviceObject, IN PIRP pIrp);
+NTSTATUS DriverCloseHandler(IN PDEVICE_OBJECT pDeviceObject, IN PIRP pIrp);
+
+// Context of the handle the IRP was issued on, as seen from this driver's stack location; NULL if there is none.
+PHANDLE_CONTEXT GetHandleContext(IN PIRP pIrp);
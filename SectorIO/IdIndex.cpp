@@ -0,0 +1,33 @@
+#include "IdIndex.hpp"
+#include <string.h>
+
+int IdIndexIsNull(const unsigned char id[ID_INDEX_ID_BYTES]) {
+    for (int i = 0; i < ID_INDEX_ID_BYTES; i++) {
+        if (id[i])
+            return 0;
+    }
+    return 1;
+}
+
+// Folds the four words and keeps the top bits of a Fibonacci multiply, so ids that differ only in a few bits, like
+// sequentially generated ones, still spread over all buckets.
+unsigned int IdIndexBucket(const unsigned char id[ID_INDEX_ID_BYTES]) {
+    unsigned int words[4];
+    memcpy(words, id, sizeof(words));
+    unsigned int folded = words[0] ^ words[1] ^ words[2] ^ words[3];
+    return (folded * 0x9E3779B1u) >> (32 - ID_INDEX_BUCKET_BITS);
+}
+
+void IdIndexPrepare(PID_INDEX_NODE node, const unsigned char id[ID_INDEX_ID_BYTES], unsigned int kind, PID_INDEX_NODE head) {
+    memcpy(node->id, id, ID_INDEX_ID_BYTES);
+    node->kind = kind;
+    node->next = head;
+}
+
+PID_INDEX_NODE IdIndexMatch(PID_INDEX_NODE node, const unsigned char id[ID_INDEX_ID_BYTES], unsigned int kind) {
+    for (; node; node = node->next) {
+        if (node->kind == kind && !memcmp(node->id, id, ID_INDEX_ID_BYTES))
+            return node;
+    }
+    return 0;
+}
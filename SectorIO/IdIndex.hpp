@@ -0,0 +1,22 @@
+#pragma once
+// Hash index over 16-byte GPT ids for addressing storage objects by id. Kept free of WDK dependencies so it builds on
+// the host as well. Nodes are embedded in the caller's objects and only ever pushed; callers publish a new bucket head
+// with release semantics and read it with acquire, after which the chains can be walked without a lock.
+
+#define ID_INDEX_BUCKET_BITS    8
+#define ID_INDEX_BUCKETS        (1u << ID_INDEX_BUCKET_BITS)
+#define ID_INDEX_ID_BYTES       16
+
+typedef struct _ID_INDEX_NODE {
+    struct _ID_INDEX_NODE* next;
+    unsigned char id[ID_INDEX_ID_BYTES];
+    unsigned int kind;              // caller-defined, e.g. disk or partition; part of the key
+} ID_INDEX_NODE, *PID_INDEX_NODE;
+
+// All-zero ids mean "none" and are never indexed.
+int IdIndexIsNull(const unsigned char id[ID_INDEX_ID_BYTES]);
+unsigned int IdIndexBucket(const unsigned char id[ID_INDEX_ID_BYTES]);
+// Fills the node and links it in front of head; the caller then publishes the node as the new head of its bucket.
+void IdIndexPrepare(PID_INDEX_NODE node, const unsigned char id[ID_INDEX_ID_BYTES], unsigned int kind, PID_INDEX_NODE head);
+// First node from node on, node included, with the id and kind. Returns 0 at the end of the chain.
+PID_INDEX_NODE IdIndexMatch(PID_INDEX_NODE node, const unsigned char id[ID_INDEX_ID_BYTES], unsigned int kind);
@@ -0,0 +1,144 @@
+#include "Job.hpp"
+#include "vector.hpp"
+
+static vector<PSECTOR_JOB>* g_pJobs = nullptr;
+
+NTSTATUS JobInitializeRegistry() {
+    g_pJobs = new (NON_PAGED) vector<PSECTOR_JOB>();
+    return g_pJobs ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+}
+
+void JobFreeRegistry() {
+    if (!g_pJobs) return;
+    delete g_pJobs;
+    g_pJobs = nullptr;
+}
+
+NTSTATUS JobStart(OUT PSECTOR_JOB pJob, IN ULONGLONG jobId, IN ULONG type, IN ULONGLONG totalBytes, IN PIRP pIrp) {
+    RtlZeroMemory(pJob, sizeof(*pJob));
+    pJob->jobId = jobId;
+    pJob->type = type;
+    pJob->pIrp = pIrp;
+    pJob->startTime = KeQueryInterruptTime();
+    pJob->totalBytes = totalBytes;
+
+    if (jobId == 0 || !g_pJobs)
+        return STATUS_SUCCESS;
+
+    NTSTATUS status = g_pJobs->push_back(pJob);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    // Checked after inserting, so two racing starts with the same id cannot both succeed.
+    ULONG sameId = 0;
+    for (auto pOther : g_pJobs->locked()) {
+        if (pOther->jobId == jobId)
+            sameId++;
+    }
+    if (sameId > 1) {
+        g_pJobs->remove_item(pJob);
+        return STATUS_OBJECT_NAME_COLLISION;
+    }
+    return STATUS_SUCCESS;
+}
+
+void JobFinish(IN PSECTOR_JOB pJob) {
+    if (pJob->jobId && g_pJobs)
+        g_pJobs->remove_item(pJob);
+}
+
+void JobAddProgress(IN PSECTOR_JOB pJob, IN ULONGLONG bytes) {
+    InterlockedExchangeAdd64(&pJob->bytesDone, (LONG64)bytes);
+}
+
+BOOLEAN JobShouldStop(IN PSECTOR_JOB pJob) {
+    return pJob->cancelRequested || (pJob->pIrp && pJob->pIrp->Cancel);
+}
+
+ULONGLONG JobElapsed100ns(IN PSECTOR_JOB pJob) {
+    return KeQueryInterruptTime() - pJob->startTime;
+}
+
+static NTSTATUS CaptureJobId(IN PIO_STACK_LOCATION pIrpStack, OUT PULONGLONG pJobId) {
+    PVOID userInput = pIrpStack->Parameters.DeviceIoControl.Type3InputBuffer;
+    if (!userInput || pIrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(SECTOR_JOB_QUERY))
+        return STATUS_INFO_LENGTH_MISMATCH;
+
+    __try {
+        ProbeForRead(userInput, sizeof(SECTOR_JOB_QUERY), 1);
+        *pJobId = ((PSECTOR_JOB_QUERY)userInput)->jobId;
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return GetExceptionCode();
+    }
+    return *pJobId ? STATUS_SUCCESS : STATUS_INVALID_PARAMETER;
+}
+
+NTSTATUS JobQueryIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack) {
+    LOG("JobQueryIoctlHandler called\n");
+    ULONGLONG jobId = 0;
+    NTSTATUS status = CaptureJobId(pIrpStack, &jobId);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    ULONG outLength = pIrpStack->Parameters.DeviceIoControl.OutputBufferLength;
+    PVOID outBuffer = pIrp->UserBuffer;
+    if (!outBuffer || outLength < sizeof(SECTOR_JOB_PROGRESS))
+        return STATUS_INFO_LENGTH_MISMATCH;
+
+    // Snapshot under the registry lock; the job may be finished and freed as soon as it is released.
+    SECTOR_JOB_PROGRESS progress;
+    RtlZeroMemory(&progress, sizeof(progress));
+    status = STATUS_NOT_FOUND;
+    if (g_pJobs) {
+        for (auto pJob : g_pJobs->locked()) {
+            if (pJob->jobId != jobId)
+                continue;
+            progress.jobId = pJob->jobId;
+            progress.type = pJob->type;
+            progress.cancelRequested = JobShouldStop(pJob);
+            progress.totalBytes = pJob->totalBytes;
+            progress.bytesDone = (ULONGLONG)pJob->bytesDone;
+            progress.elapsed100ns = JobElapsed100ns(pJob);
+            status = STATUS_SUCCESS;
+            break;
+        }
+    }
+    if (!NT_SUCCESS(status))
+        return status;
+
+    if (progress.elapsed100ns)
+        progress.bytesPerSecond = progress.bytesDone * 10000000ULL / progress.elapsed100ns;
+
+    __try {
+        ProbeForWrite(outBuffer, sizeof(progress), 1);
+        RtlCopyMemory(outBuffer, &progress, sizeof(progress));
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return GetExceptionCode();
+    }
+    pIrp->IoStatus.Information = sizeof(progress);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS JobCancelIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack) {
+    UNREFERENCED_PARAMETER(pIrp);
+    LOG("JobCancelIoctlHandler called\n");
+    ULONGLONG jobId = 0;
+    NTSTATUS status = CaptureJobId(pIrpStack, &jobId);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    status = STATUS_NOT_FOUND;
+    if (g_pJobs) {
+        for (auto pJob : g_pJobs->locked()) {
+            if (pJob->jobId == jobId) {
+                InterlockedExchange(&pJob->cancelRequested, 1);
+                status = STATUS_SUCCESS;
+                break;
+            }
+        }
+    }
+    LOG("  cancel job %llu: 0x%08X\n", jobId, status);
+    return status;
+}
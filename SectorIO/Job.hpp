@@ -0,0 +1,49 @@
+#pragma once
+#include "Driver.hpp"
+
+#pragma pack (push, 1)
+
+#define SECTOR_JOB_COPY     1
+#define SECTOR_JOB_WIPE     2
+#define SECTOR_JOB_RESCUE   3
+
+typedef struct _SECTOR_JOB_QUERY {
+    ULONGLONG jobId;
+} SECTOR_JOB_QUERY, *PSECTOR_JOB_QUERY;
+
+typedef struct _SECTOR_JOB_PROGRESS {
+    ULONGLONG jobId;
+    ULONG type;                 // SECTOR_JOB_*
+    BOOLEAN cancelRequested;
+    ULONGLONG totalBytes;
+    ULONGLONG bytesDone;
+    ULONGLONG elapsed100ns;
+    ULONGLONG bytesPerSecond;   // average since the job started
+} SECTOR_JOB_PROGRESS, *PSECTOR_JOB_PROGRESS;
+
+#pragma pack (pop)
+
+// Long-running requests run synchronously in the thread that issued them. While they do, other threads can follow
+// and stop them by the nonzero id the caller picked; a job disappears from the registry when its request completes.
+typedef struct _SECTOR_JOB {
+    ULONGLONG jobId;
+    ULONG type;
+    PIRP pIrp;
+    ULONGLONG startTime;
+    ULONGLONG totalBytes;
+    volatile LONG64 bytesDone;
+    volatile LONG cancelRequested;
+} SECTOR_JOB, *PSECTOR_JOB;
+
+NTSTATUS JobInitializeRegistry();
+void JobFreeRegistry();
+
+// A jobId of 0 leaves the job unregistered; it can then only be stopped by cancelling its IRP.
+NTSTATUS JobStart(OUT PSECTOR_JOB pJob, IN ULONGLONG jobId, IN ULONG type, IN ULONGLONG totalBytes, IN PIRP pIrp);
+void JobFinish(IN PSECTOR_JOB pJob);
+void JobAddProgress(IN PSECTOR_JOB pJob, IN ULONGLONG bytes);
+BOOLEAN JobShouldStop(IN PSECTOR_JOB pJob);
+ULONGLONG JobElapsed100ns(IN PSECTOR_JOB pJob);
+
+NTSTATUS JobQueryIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack);
+NTSTATUS JobCancelIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack);
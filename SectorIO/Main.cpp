@@ -1,20 +1,86 @@
 ﻿#include "Driver.hpp"
 #include "SectorIoctlHandlers.hpp"
+#include "RangeIoctlHandlers.hpp"
+#include "BulkIoctlHandlers.hpp"
+#include "HandleContext.hpp"
+#include "Elevator.hpp"
+#include "Coalesce.hpp"
+#include "WorkPool.hpp"
+#include "PartitionMap.hpp"
+#include "FileExtents.hpp"
+#include "Simd.hpp"
+#include "RequestControl.hpp"
+#include "Rescue.hpp"
+#include "Topology.hpp"
+#include "CompareWrite.hpp"
+#include "ChangeTracking.hpp"
 
 #define SECTOR_IO_CTL_CODE(id) CTL_CODE(FILE_DEVICE_UNKNOWN, id, METHOD_NEITHER, FILE_ANY_ACCESS)
 #define IOCTL_SECTOR_READ		SECTOR_IO_CTL_CODE(0x800)
 #define IOCTL_SECTOR_WRITE		SECTOR_IO_CTL_CODE(0x801)
 #define IOCTL_GET_SECTOR_SIZE	SECTOR_IO_CTL_CODE(0x802)
 #define IOCTL_GET_DISK_INFO     SECTOR_IO_CTL_CODE(0x803)
+#define IOCTL_SECTOR_SEARCH     SECTOR_IO_CTL_CODE(0x804)
+#define IOCTL_SECTOR_DIGEST     SECTOR_IO_CTL_CODE(0x805)
+#define IOCTL_SECTOR_ZERO_MAP   SECTOR_IO_CTL_CODE(0x806)
+#define IOCTL_SECTOR_COPY       SECTOR_IO_CTL_CODE(0x807)
+#define IOCTL_JOB_QUERY         SECTOR_IO_CTL_CODE(0x808)
+#define IOCTL_JOB_CANCEL        SECTOR_IO_CTL_CODE(0x809)
+#define IOCTL_SECTOR_WIPE       SECTOR_IO_CTL_CODE(0x80A)
+#define IOCTL_SET_HANDLE_QOS    SECTOR_IO_CTL_CODE(0x80B)
+#define IOCTL_SET_STORAGE_QOS   SECTOR_IO_CTL_CODE(0x80C)
+#define IOCTL_SET_ELEVATOR      SECTOR_IO_CTL_CODE(0x80D)
+#define IOCTL_SET_COALESCE      SECTOR_IO_CTL_CODE(0x80E)
+#define IOCTL_GET_WORK_POOL_STATS SECTOR_IO_CTL_CODE(0x80F)
+#define IOCTL_SECTOR_PARTITION_MAP SECTOR_IO_CTL_CODE(0x810)
+#define IOCTL_SECTOR_READ_FILE  SECTOR_IO_CTL_CODE(0x811)
+#define IOCTL_GET_IO_HEALTH     SECTOR_IO_CTL_CODE(0x812)
+#define IOCTL_SECTOR_RESCUE     SECTOR_IO_CTL_CODE(0x813)
+#define IOCTL_SECTOR_BAD_SECTORS SECTOR_IO_CTL_CODE(0x814)
+#define IOCTL_SECTOR_BIND       SECTOR_IO_CTL_CODE(0x815)
+#define IOCTL_SECTOR_READ_BOUND SECTOR_IO_CTL_CODE(0x816)
+#define IOCTL_SECTOR_WRITE_BOUND SECTOR_IO_CTL_CODE(0x817)
+// Buffered, since it completes from whichever thread notices the change rather than in the caller's context
+#define IOCTL_WAIT_TOPOLOGY_CHANGE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x818, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_SECTOR_READ_BY_ID SECTOR_IO_CTL_CODE(0x819)
+#define IOCTL_SECTOR_WRITE_BY_ID SECTOR_IO_CTL_CODE(0x81A)
+#define IOCTL_GET_INFO_BY_ID    SECTOR_IO_CTL_CODE(0x81B)
+#define IOCTL_SECTOR_BIND_BY_ID SECTOR_IO_CTL_CODE(0x81C)
+#define IOCTL_SECTOR_ENTROPY    SECTOR_IO_CTL_CODE(0x81D)
+#define IOCTL_SECTOR_COMPARE_WRITE SECTOR_IO_CTL_CODE(0x81E)
+#define IOCTL_SECTOR_TRACK_CHANGES SECTOR_IO_CTL_CODE(0x81F)
+#define IOCTL_SECTOR_SNAPSHOT_CHANGES SECTOR_IO_CTL_CODE(0x820)
+#define IOCTL_SECTOR_CHANGED_RANGES SECTOR_IO_CTL_CODE(0x821)
 
 
-NTSTATUS DriverIoDeviceDispatchRoutine(PDEVICE_OBJECT pDeviceObject, PIRP pIrp) {
-    UNREFERENCED_PARAMETER(pDeviceObject);
+// Handles one request to completion. The caller completes the IRP with the returned status.
+static NTSTATUS DispatchSectorIoctl(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack) {
     NTSTATUS status = STATUS_SUCCESS;
-    IoSetCancelRoutine(pIrp, NULL);
-    PIO_STACK_LOCATION pIrpStack = IoGetCurrentIrpStackLocation(pIrp);
 
-    LOG("DriverIoDeviceDispatchRoutine called\n");
+    // Requests that do not start with a STORAGE_LOCATION: either they never touch a storage object, or the handle
+    // already names one, or they name it by GPT id
+    switch (pIrpStack->Parameters.DeviceIoControl.IoControlCode) {
+    case IOCTL_SECTOR_READ_BY_ID:
+        return IdSectorIoIoctlHandler(pIrp, pIrpStack, FALSE);
+    case IOCTL_SECTOR_WRITE_BY_ID:
+        return IdSectorIoIoctlHandler(pIrp, pIrpStack, TRUE);
+    case IOCTL_GET_INFO_BY_ID:
+        return IdStorageInfoIoctlHandler(pIrp, pIrpStack);
+    case IOCTL_SECTOR_BIND_BY_ID:
+        return IdBindStorageIoctlHandler(pIrp, pIrpStack);
+    case IOCTL_SECTOR_READ_BOUND:
+        return BoundSectorIoIoctlHandler(pIrp, pIrpStack, FALSE);
+    case IOCTL_SECTOR_WRITE_BOUND:
+        return BoundSectorIoIoctlHandler(pIrp, pIrpStack, TRUE);
+    case IOCTL_JOB_QUERY:
+        return JobQueryIoctlHandler(pIrp, pIrpStack);
+    case IOCTL_JOB_CANCEL:
+        return JobCancelIoctlHandler(pIrp, pIrpStack);
+    case IOCTL_SET_HANDLE_QOS:
+        return SetHandleQosIoctlHandler(pIrp, pIrpStack);
+    case IOCTL_GET_WORK_POOL_STATS:
+        return WorkPoolStatsIoctlHandler(pIrp, pIrpStack);
+    }
 
     STORAGE_LOCATION pStorageLocation = {0};
     PSTORAGE_LOCATION pStorageLocationUser = (PSTORAGE_LOCATION)pIrpStack->Parameters.DeviceIoControl.Type3InputBuffer;
@@ -25,49 +91,24 @@ NTSTATUS DriverIoDeviceDispatchRoutine(PDEVICE_OBJECT pDeviceObject, PIRP pIrp)
             RtlCopyMemory(&pStorageLocation, pStorageLocationUser, sizeof(STORAGE_LOCATION));
         }
         __except (EXCEPTION_EXECUTE_HANDLER) {
-            status = GetExceptionCode();
-            pIrp->IoStatus.Status = status;
-            IoCompleteRequest(pIrp, IO_NO_INCREMENT);
-            return status;
+            return GetExceptionCode();
         }
     }
 
 
-    PSTORAGE_OBJECT pStorageObject = nullptr;
     if (!g_pStorageObjects)
         return STATUS_DEVICE_NOT_CONNECTED;
 
-    for (auto pcDiskObject : g_pStorageObjects->locked()) {
-        if (!pcDiskObject)
-            continue;
-
-        bool matchDiskIndex = pcDiskObject->info.diskIndex == pStorageLocation.diskIndex;
-        bool matchRawDisk = pcDiskObject->info.isRawDiskObject == pStorageLocation.isRawDiskObject;
-        bool matchPartition = true;
-
-        if (pStorageLocation.partitionNumber != (ULONG)-1) {
-            matchPartition = pcDiskObject->info.partitionNumber == pStorageLocation.partitionNumber;
-        }
-
-        if (matchDiskIndex && matchRawDisk && matchPartition) {
-            pStorageObject = pcDiskObject;
-            break;
-        }
-    }
+    PSTORAGE_OBJECT pStorageObject = FindStorageObject(&pStorageLocation);
 
     if (!pStorageObject && (pIrpStack->Parameters.DeviceIoControl.IoControlCode != IOCTL_GET_DISK_INFO)) {
         LOG("Requested disk/partition not found: index=%lu isRaw=%u\n", pStorageLocation.diskIndex, pStorageLocation.isRawDiskObject);
-        status = STATUS_DEVICE_NOT_CONNECTED;
-        pIrp->IoStatus.Status = status;
-        IoCompleteRequest(pIrp, IO_NO_INCREMENT);
-        return status;
+        return STATUS_DEVICE_NOT_CONNECTED;
     }
 
-    status = RefreshGlobalStorageObjects();
+    status = RefreshGlobalStorageObjects(FALSE);
     if (!NT_SUCCESS(status)) {
         LOG("Refresh global storage objects failed: 0x%08X\n", status);
-        pIrp->IoStatus.Status = status;
-        IoCompleteRequest(pIrp, IO_NO_INCREMENT);
         return status;
     }
 
@@ -78,17 +119,98 @@ NTSTATUS DriverIoDeviceDispatchRoutine(PDEVICE_OBJECT pDeviceObject, PIRP pIrp)
     case IOCTL_SECTOR_WRITE:
         status = WriteSectorIoctlHandler(pIrp, pIrpStack, pStorageObject, &pStorageLocation);
         break;
+    case IOCTL_SECTOR_COMPARE_WRITE:
+        status = CompareWriteIoctlHandler(pIrp, pIrpStack, pStorageObject);
+        break;
     case IOCTL_GET_SECTOR_SIZE:
         status = GetSectorSizeIoctlHandler(pIrp, pStorageObject);
         break;
     case IOCTL_GET_DISK_INFO:
         status = StorageInfoIoctlHandler(pIrp, pIrpStack);
         break;
+    case IOCTL_SECTOR_SEARCH:
+        status = SearchSectorsIoctlHandler(pIrp, pIrpStack, pStorageObject);
+        break;
+    case IOCTL_SECTOR_DIGEST:
+        status = DigestSectorsIoctlHandler(pIrp, pIrpStack, pStorageObject);
+        break;
+    case IOCTL_SECTOR_ZERO_MAP:
+        status = ZeroMapSectorsIoctlHandler(pIrp, pIrpStack, pStorageObject);
+        break;
+    case IOCTL_SECTOR_ENTROPY:
+        status = EntropySectorsIoctlHandler(pIrp, pIrpStack, pStorageObject);
+        break;
+    case IOCTL_SECTOR_COPY:
+        status = CopySectorsIoctlHandler(pIrp, pIrpStack, pStorageObject);
+        break;
+    case IOCTL_SECTOR_WIPE:
+        status = WipeSectorsIoctlHandler(pIrp, pIrpStack, pStorageObject);
+        break;
+    case IOCTL_SET_STORAGE_QOS:
+        status = SetStorageQosIoctlHandler(pIrp, pIrpStack, pStorageObject);
+        break;
+    case IOCTL_SET_ELEVATOR:
+        status = SetElevatorIoctlHandler(pIrp, pIrpStack, pStorageObject);
+        break;
+    case IOCTL_SET_COALESCE:
+        status = SetCoalesceIoctlHandler(pIrp, pIrpStack, pStorageObject);
+        break;
+    case IOCTL_SECTOR_PARTITION_MAP:
+        status = PartitionMapIoctlHandler(pIrp, pIrpStack, pStorageObject);
+        break;
+    case IOCTL_SECTOR_READ_FILE:
+        status = ReadFileExtentsIoctlHandler(pIrp, pIrpStack, pStorageObject);
+        break;
+    case IOCTL_GET_IO_HEALTH:
+        status = GetIoHealthIoctlHandler(pIrp, pIrpStack, pStorageObject);
+        break;
+    case IOCTL_SECTOR_RESCUE:
+        status = RescueSectorsIoctlHandler(pIrp, pIrpStack, pStorageObject);
+        break;
+    case IOCTL_SECTOR_BAD_SECTORS:
+        status = BadSectorsIoctlHandler(pIrp, pIrpStack, pStorageObject);
+        break;
+    case IOCTL_SECTOR_BIND:
+        status = BindStorageIoctlHandler(pIrp, pIrpStack, pStorageObject);
+        break;
+    case IOCTL_SECTOR_TRACK_CHANGES:
+        status = TrackChangesIoctlHandler(pIrp, pIrpStack, pStorageObject);
+        break;
+    case IOCTL_SECTOR_SNAPSHOT_CHANGES:
+        status = SnapshotChangesIoctlHandler(pIrp, pIrpStack, pStorageObject);
+        break;
+    case IOCTL_SECTOR_CHANGED_RANGES:
+        status = ChangedRangesIoctlHandler(pIrp, pIrpStack, pStorageObject);
+        break;
     default:
         status = STATUS_INVALID_DEVICE_REQUEST;
         break;
     }
 
+    return status;
+}
+
+NTSTATUS DriverIoDeviceDispatchRoutine(PDEVICE_OBJECT pDeviceObject, PIRP pIrp) {
+    UNREFERENCED_PARAMETER(pDeviceObject);
+    PIO_STACK_LOCATION pIrpStack = IoGetCurrentIrpStackLocation(pIrp);
+
+    LOG("DriverIoDeviceDispatchRoutine called\n");
+
+    NTSTATUS status;
+    if (pIrpStack->Parameters.DeviceIoControl.IoControlCode == IOCTL_WAIT_TOPOLOGY_CHANGE) {
+        // Pends in a cancel-safe queue, which owns the cancel routine the request control block would install.
+        status = TopologyWaitIoctlHandler(pIrp, pIrpStack);
+        if (status == STATUS_PENDING)
+            return status;
+    }
+    else {
+        // Cancelling the request, or letting its deadline pass, cancels whatever lower transfers it has in flight.
+        REQUEST_CONTROL control;
+        RequestControlBegin(&control, pIrp);
+        status = DispatchSectorIoctl(pIrp, pIrpStack);
+        RequestControlEnd(&control, pIrp);
+    }
+
     pIrp->IoStatus.Status = status;
     IoCompleteRequest(pIrp, IO_NO_INCREMENT);
     return status;
@@ -110,7 +232,10 @@ VOID DriverUnload(IN PDRIVER_OBJECT pDriverObject) {
 	UNREFERENCED_PARAMETER(pDriverObject);
 	LOG("DriverUnload called\n");
 
+	TopologyShutdown();
+	WorkPoolShutdown();
 	FreeCollectedStorageObjects();
+	JobFreeRegistry();
 
 	IoDeleteSymbolicLink(&g_dosDeviceName);
 	IoDeleteDevice(g_pDeviceObject);
@@ -152,10 +277,38 @@ extern "C" NTSTATUS DriverEntry(IN PDRIVER_OBJECT pDriverObject, IN PUNICODE_STR
 		return STATUS_INSUFFICIENT_RESOURCES;
 	}
 
-	status = RefreshGlobalStorageObjects();
+	status = JobInitializeRegistry();
+	if (!NT_SUCCESS(status)) {
+        LOG("Job registry allocation failed\n");
+		FreeCollectedStorageObjects();
+		IoDeleteDevice(g_pDeviceObject);
+		IoDeleteSymbolicLink(&g_dosDeviceName);
+		return status;
+	}
+
+	SimdInitialize();
+	CompareWriteInitialize();
+	PartitionCacheInitialize();
+
+	status = WorkPoolInitialize();
+	if (!NT_SUCCESS(status)) {
+        LOG("WorkPoolInitialize failed: 0x%08X\n", status);
+		JobFreeRegistry();
+		FreeCollectedStorageObjects();
+		IoDeleteDevice(g_pDeviceObject);
+		IoDeleteSymbolicLink(&g_dosDeviceName);
+		return status;
+	}
+
+	TopologyInitialize(pDriverObject);
+	status = RefreshGlobalStorageObjects(TRUE);
 	if (!NT_SUCCESS(status))
 	{
         LOG("RefreshGlobalStorageObjects failed: 0x%08X", status);
+		TopologyShutdown();
+		WorkPoolShutdown();
+		JobFreeRegistry();
+		FreeCollectedStorageObjects();
 		IoDeleteDevice(g_pDeviceObject);
 		IoDeleteSymbolicLink(&g_dosDeviceName);
 		return status;
@@ -164,6 +317,9 @@ extern "C" NTSTATUS DriverEntry(IN PDRIVER_OBJECT pDriverObject, IN PUNICODE_STR
 	for (ULONG i = 0; i <= IRP_MJ_MAXIMUM_FUNCTION; i++)
 		pDriverObject->MajorFunction[i] = DriverDefaultIrpHandler;
 	
+	pDriverObject->MajorFunction[IRP_MJ_CREATE] = DriverCreateHandler;
+	pDriverObject->MajorFunction[IRP_MJ_CLEANUP] = DriverCleanupHandler;
+	pDriverObject->MajorFunction[IRP_MJ_CLOSE] = DriverCloseHandler;
 	pDriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = DriverIoDeviceDispatchRoutine;
 	pDriverObject->DriverUnload = DriverUnload;
 	return status;
@@ -0,0 +1,262 @@
+#include "PartitionMap.hpp"
+
+// MBR, two GPT headers with their arrays, and a full EBR chain
+#define PARTITION_CACHE_MAX_WATCH   (1 + 4 + PT_MAX_LOGICAL_PARTITIONS)
+
+typedef struct _PARTITION_WATCH {
+    ULONGLONG diskOffset;
+    ULONGLONG length;
+} PARTITION_WATCH, *PPARTITION_WATCH;
+
+typedef struct _PARTITION_CACHE {
+    PT_MAP map;
+    PT_ENTRY entries[PT_MAX_ENTRIES];
+
+    // Disk-relative byte ranges the map was decoded from; a write to any of them makes it stale.
+    ULONG watchCount;
+    BOOLEAN watchAll;
+    PARTITION_WATCH watched[PARTITION_CACHE_MAX_WATCH];
+} PARTITION_CACHE, *PPARTITION_CACHE;
+
+typedef struct _PARTITION_READ_CONTEXT {
+    PSTORAGE_OBJECT pStorageObject;
+    PIRP pOriginIrp;
+    PPARTITION_CACHE pCache;
+} PARTITION_READ_CONTEXT, *PPARTITION_READ_CONTEXT;
+
+static KSPIN_LOCK g_partitionCacheLock;
+// Stored maps plus decodes in progress; writes skip the invalidation walk while it is zero.
+static volatile LONG g_partitionCacheUsers = 0;
+
+void PartitionCacheInitialize() {
+    KeInitializeSpinLock(&g_partitionCacheLock);
+}
+
+static ULONGLONG DiskOffsetOf(IN PSTORAGE_OBJECT pStorageObject) {
+    return pStorageObject->info.isRawDiskObject ? 0 : pStorageObject->info.partitionStartingOffset;
+}
+
+static BOOLEAN CacheWatches(IN PPARTITION_CACHE pCache, IN ULONGLONG diskOffset, IN ULONGLONG length) {
+    if (pCache->watchAll)
+        return TRUE;
+    for (ULONG i = 0; i < pCache->watchCount; i++) {
+        PPARTITION_WATCH pWatch = &pCache->watched[i];
+        if (diskOffset < pWatch->diskOffset + pWatch->length && pWatch->diskOffset < diskOffset + length)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+void PartitionCacheInvalidate(IN PSTORAGE_OBJECT pStorageObject, IN ULONGLONG byteOffset, IN ULONGLONG length) {
+    if (!g_partitionCacheUsers || !g_pStorageObjects)
+        return;
+
+    ULONGLONG diskOffset = DiskOffsetOf(pStorageObject) + byteOffset;
+    KIRQL oldIrql;
+    KeAcquireSpinLock(&g_partitionCacheLock, &oldIrql);
+    for (auto pObject : g_pStorageObjects->locked()) {
+        if (!pObject || pObject->info.diskIndex != pStorageObject->info.diskIndex)
+            continue;
+        // Decodes in progress on this disk compare against this to know they may have read old sectors.
+        pObject->partitionWriteSequence++;
+        PPARTITION_CACHE pCache = (PPARTITION_CACHE)pObject->pPartitionCache;
+        if (pCache && CacheWatches(pCache, diskOffset, length)) {
+            pObject->pPartitionCache = NULL;
+            delete pCache;
+            InterlockedDecrement(&g_partitionCacheUsers);
+        }
+    }
+    KeReleaseSpinLock(&g_partitionCacheLock, oldIrql);
+}
+
+void PartitionCacheFree(IN PSTORAGE_OBJECT pStorageObject) {
+    if (pStorageObject->pPartitionCache) {
+        delete (PPARTITION_CACHE)pStorageObject->pPartitionCache;
+        pStorageObject->pPartitionCache = NULL;
+        InterlockedDecrement(&g_partitionCacheUsers);
+    }
+}
+
+static int PartitionRead(IN void* context, IN unsigned long long lba, IN unsigned int count, OUT void* buffer) {
+    PPARTITION_READ_CONTEXT pContext = (PPARTITION_READ_CONTEXT)context;
+    PSTORAGE_OBJECT pStorageObject = pContext->pStorageObject;
+    PPARTITION_CACHE pCache = pContext->pCache;
+    ULONG sectorSize = pStorageObject->info.sectorSize;
+    ULONG length = count * sectorSize;
+
+    // Watched before reading, so even a failed read keeps the sector under observation.
+    if (pCache->watchCount < PARTITION_CACHE_MAX_WATCH) {
+        pCache->watched[pCache->watchCount].diskOffset = DiskOffsetOf(pStorageObject) + lba * sectorSize;
+        pCache->watched[pCache->watchCount].length = length;
+        pCache->watchCount++;
+    }
+    else {
+        pCache->watchAll = TRUE;
+    }
+
+    PUCHAR pBuffer = NULL;
+    PMDL pMdl = NULL;
+    NTSTATUS status = StorageIoAllocateBuffer(length, &pBuffer, &pMdl);
+    if (!NT_SUCCESS(status))
+        return 1;
+
+    STORAGE_IO io;
+    ULONG_PTR information = 0;
+    StorageIoInitialize(&io, pStorageObject, FALSE, pMdl, lba * sectorSize, length, pContext->pOriginIrp);
+    status = StorageIoTransfer(&io, &information);
+    if (NT_SUCCESS(status) && information == length)
+        RtlCopyMemory(buffer, pBuffer, length);
+
+    StorageIoFreeBuffer(pBuffer, pMdl);
+    return NT_SUCCESS(status) && information == length ? 0 : 1;
+}
+
+// Decodes the tables into a new cache. It is stored on the storage object unless a write to the disk started in
+// the meantime; either way the caller ends up with a private copy in *ppCache.
+static NTSTATUS DecodePartitionMap(IN PSTORAGE_OBJECT pStorageObject, IN PIRP pIrp, OUT PPARTITION_CACHE* ppCache) {
+    *ppCache = NULL;
+    ULONG sectorSize = pStorageObject->info.sectorSize;
+    ULONGLONG totalSectors = sectorSize ? GetStorageObjectLength(pStorageObject) / sectorSize : 0;
+    if (!totalSectors)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    PPARTITION_CACHE pCache = new (NON_PAGED) PARTITION_CACHE;
+    PPARTITION_CACHE pCopy = new (NON_PAGED) PARTITION_CACHE;
+    ULONG scratchLength = PT_SCRATCH_BYTES(sectorSize);
+    PUCHAR pScratch = new (PAGED_POOL) UCHAR[scratchLength];
+    NTSTATUS status = STATUS_SUCCESS;
+    PARTITION_READ_CONTEXT context;
+    LONG sequence;
+    BOOLEAN stored = FALSE;
+    PPARTITION_CACHE pOld = NULL;
+    if (!pCache || !pCopy || !pScratch) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Done;
+    }
+    RtlZeroMemory(pCache, sizeof(*pCache));
+
+    InterlockedIncrement(&g_partitionCacheUsers);
+    sequence = pStorageObject->partitionWriteSequence;
+
+    context.pStorageObject = pStorageObject;
+    context.pOriginIrp = pIrp;
+    context.pCache = pCache;
+    if (PartitionTableDecode(PartitionRead, &context, sectorSize, totalSectors, pScratch, scratchLength, &pCache->map, pCache->entries) != 0) {
+        InterlockedDecrement(&g_partitionCacheUsers);
+        status = STATUS_INVALID_DEVICE_REQUEST;
+        goto Done;
+    }
+    RtlCopyMemory(pCopy, pCache, sizeof(*pCopy));
+
+    // Partial maps are returned but never cached.
+    if (!(pCache->map.flags & PT_READ_FAILED)) {
+        KIRQL oldIrql;
+        KeAcquireSpinLock(&g_partitionCacheLock, &oldIrql);
+        if (pStorageObject->partitionWriteSequence == sequence) {
+            pOld = (PPARTITION_CACHE)pStorageObject->pPartitionCache;
+            pStorageObject->pPartitionCache = pCache;
+            stored = TRUE;
+        }
+        KeReleaseSpinLock(&g_partitionCacheLock, oldIrql);
+    }
+    if (!stored || pOld)
+        InterlockedDecrement(&g_partitionCacheUsers);
+    if (pOld)
+        delete pOld;
+    if (stored)
+        pCache = NULL;
+
+    *ppCache = pCopy;
+    pCopy = NULL;
+
+Done:
+    if (pCache) delete pCache;
+    if (pCopy) delete pCopy;
+    if (pScratch) delete[] pScratch;
+    return status;
+}
+
+static PPARTITION_CACHE CopyCachedPartitionMap(IN PSTORAGE_OBJECT pStorageObject) {
+    if (!pStorageObject->pPartitionCache)
+        return NULL;
+
+    PPARTITION_CACHE pCopy = new (NON_PAGED) PARTITION_CACHE;
+    if (!pCopy)
+        return NULL;
+
+    KIRQL oldIrql;
+    KeAcquireSpinLock(&g_partitionCacheLock, &oldIrql);
+    PPARTITION_CACHE pCache = (PPARTITION_CACHE)pStorageObject->pPartitionCache;
+    if (pCache)
+        RtlCopyMemory(pCopy, pCache, sizeof(*pCopy));
+    KeReleaseSpinLock(&g_partitionCacheLock, oldIrql);
+
+    if (!pCache) {
+        delete pCopy;
+        return NULL;
+    }
+    return pCopy;
+}
+
+NTSTATUS PartitionMapIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject) {
+    LOG("PartitionMapIoctlHandler called\n");
+    NTSTATUS status = STATUS_SUCCESS;
+    PPARTITION_CACHE pCache = NULL;
+    BOOLEAN fromCache = FALSE;
+
+    if (!pStorageObject)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    SECTOR_PARTITION_MAP_REQUEST request;
+    PVOID userInput = pIrpStack->Parameters.DeviceIoControl.Type3InputBuffer;
+    if (!userInput || pIrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(request))
+        return STATUS_INFO_LENGTH_MISMATCH;
+
+    __try {
+        ProbeForRead(userInput, sizeof(request), 1);
+        RtlCopyMemory(&request, userInput, sizeof(request));
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return GetExceptionCode();
+    }
+
+    PUCHAR outBuffer = (PUCHAR)pIrp->UserBuffer;
+    ULONG outLength = pIrpStack->Parameters.DeviceIoControl.OutputBufferLength;
+    if (!outBuffer || outLength < sizeof(SECTOR_PARTITION_MAP_RESULT))
+        return STATUS_BUFFER_TOO_SMALL;
+
+    if (!(request.flags & SECTOR_PARTITION_MAP_REFRESH)) {
+        pCache = CopyCachedPartitionMap(pStorageObject);
+        fromCache = pCache != NULL;
+    }
+    if (!pCache) {
+        status = DecodePartitionMap(pStorageObject, pIrp, &pCache);
+        if (!NT_SUCCESS(status))
+            goto Done;
+    }
+
+    {
+        SECTOR_PARTITION_MAP_RESULT result;
+        result.fromCache = fromCache;
+        result.map = pCache->map;
+        ULONG entriesLength = pCache->map.entryCount * sizeof(PT_ENTRY);
+        BOOLEAN fits = outLength - sizeof(result) >= entriesLength;
+
+        __try {
+            ProbeForWrite(outBuffer, sizeof(result) + (fits ? entriesLength : 0), 1);
+            RtlCopyMemory(outBuffer, &result, sizeof(result));
+            if (fits)
+                RtlCopyMemory(outBuffer + sizeof(result), pCache->entries, entriesLength);
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER) {
+            status = GetExceptionCode();
+            goto Done;
+        }
+        pIrp->IoStatus.Information = sizeof(result) + (fits ? entriesLength : 0);
+        status = fits ? STATUS_SUCCESS : STATUS_BUFFER_OVERFLOW;
+    }
+
+Done:
+    if (pCache) delete pCache;
+    return status;
+}
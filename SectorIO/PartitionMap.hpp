@@ -0,0 +1,28 @@
+#pragma once
+#include "StorageIo.hpp"
+#include "PartitionTable.hpp"
+
+#pragma pack (push, 1)
+
+#define SECTOR_PARTITION_MAP_REFRESH        0x00000001  // ignore the cached map and read the tables again
+
+typedef struct _SECTOR_PARTITION_MAP_REQUEST {
+    STORAGE_LOCATION location;  // location.sectorNumber is ignored
+    ULONG flags;                // SECTOR_PARTITION_MAP_*
+} SECTOR_PARTITION_MAP_REQUEST, *PSECTOR_PARTITION_MAP_REQUEST;
+
+typedef struct _SECTOR_PARTITION_MAP_RESULT {
+    BOOLEAN fromCache;
+    PT_MAP map;
+    // PT_ENTRY entries[map.entryCount]; if they do not fit, only this header is returned with STATUS_BUFFER_OVERFLOW
+} SECTOR_PARTITION_MAP_RESULT, *PSECTOR_PARTITION_MAP_RESULT;
+
+#pragma pack (pop)
+
+void PartitionCacheInitialize();
+// Drops cached maps of every storage object on the same disk whose table sectors overlap the byte range.
+// Called for each write and trim before it is sent and again once it has completed.
+void PartitionCacheInvalidate(IN PSTORAGE_OBJECT pStorageObject, IN ULONGLONG byteOffset, IN ULONGLONG length);
+void PartitionCacheFree(IN PSTORAGE_OBJECT pStorageObject);
+
+NTSTATUS PartitionMapIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject);
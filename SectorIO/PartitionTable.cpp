@@ -0,0 +1,286 @@
+#include "PartitionTable.hpp"
+#include "Digest.hpp"
+#include <string.h>
+
+#define MBR_SIGNATURE_OFFSET        510
+#define MBR_DISK_SIGNATURE_OFFSET   440
+#define MBR_TABLE_OFFSET            446
+#define MBR_ENTRY_SIZE              16
+
+#define MBR_TYPE_PROTECTIVE         0xEE
+
+#define GPT_HEADER_MIN_SIZE         92
+#define GPT_ENTRY_MIN_SIZE          128
+
+static const unsigned char GPT_SIGNATURE[8] = { 'E', 'F', 'I', ' ', 'P', 'A', 'R', 'T' };
+
+typedef struct _MBR_RAW_ENTRY {
+    unsigned char status;
+    unsigned char type;
+    unsigned int firstLba;
+    unsigned int sectorCount;
+} MBR_RAW_ENTRY;
+
+static inline unsigned int LoadLe32(const unsigned char* p) {
+    return (unsigned int)p[0] | ((unsigned int)p[1] << 8) | ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static inline unsigned long long LoadLe64(const unsigned char* p) {
+    return (unsigned long long)LoadLe32(p) | ((unsigned long long)LoadLe32(p + 4) << 32);
+}
+
+static int IsExtendedType(unsigned char type) {
+    return type == 0x05 || type == 0x0F || type == 0x85;
+}
+
+static int IsAllZero(const unsigned char* p, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        if (p[i])
+            return 0;
+    }
+    return 1;
+}
+
+static PPT_ENTRY AddEntry(PPT_MAP map, PPT_ENTRY entries) {
+    if (map->entryCount >= PT_MAX_ENTRIES) {
+        map->flags |= PT_ENTRIES_TRUNCATED;
+        return 0;
+    }
+    PPT_ENTRY entry = &entries[map->entryCount++];
+    memset(entry, 0, sizeof(*entry));
+    return entry;
+}
+
+// Reads a sector holding an MBR or EBR. Returns 1 if it carries the boot signature.
+static int ReadMbrSector(PT_READ_ROUTINE read, void* context, PPT_MAP map, unsigned long long lba, unsigned char* sector, MBR_RAW_ENTRY raw[4]) {
+    if (read(context, lba, 1, sector)) {
+        map->flags |= PT_READ_FAILED;
+        return 0;
+    }
+    if (sector[MBR_SIGNATURE_OFFSET] != 0x55 || sector[MBR_SIGNATURE_OFFSET + 1] != 0xAA)
+        return 0;
+
+    for (int i = 0; i < 4; i++) {
+        const unsigned char* p = sector + MBR_TABLE_OFFSET + i * MBR_ENTRY_SIZE;
+        raw[i].status = p[0];
+        raw[i].type = p[4];
+        raw[i].firstLba = LoadLe32(p + 8);
+        raw[i].sectorCount = LoadLe32(p + 12);
+    }
+    return 1;
+}
+
+// Reads and validates the GPT header at lba. Returns 1 and fills info when signature, size, CRC32 and geometry
+// all check out.
+static int ReadGptHeader(PT_READ_ROUTINE read, void* context, PPT_MAP map, unsigned long long lba, unsigned char* sector,
+                         PPT_GPT_HEADER_INFO info, unsigned char diskGuid[16]) {
+    if (read(context, lba, 1, sector)) {
+        map->flags |= PT_READ_FAILED;
+        return 0;
+    }
+    if (memcmp(sector, GPT_SIGNATURE, sizeof(GPT_SIGNATURE)) != 0)
+        return 0;
+
+    unsigned int headerSize = LoadLe32(sector + 12);
+    if (headerSize < GPT_HEADER_MIN_SIZE || headerSize > map->sectorSize)
+        return 0;
+
+    // The CRC covers the header with its own CRC field zeroed.
+    unsigned int storedCrc = LoadLe32(sector + 16);
+    memset(sector + 16, 0, 4);
+    if (Crc32Update(0, sector, headerSize) != storedCrc)
+        return 0;
+
+    PT_GPT_HEADER_INFO header;
+    header.myLba = LoadLe64(sector + 24);
+    header.alternateLba = LoadLe64(sector + 32);
+    header.firstUsableLba = LoadLe64(sector + 40);
+    header.lastUsableLba = LoadLe64(sector + 48);
+    header.entryArrayLba = LoadLe64(sector + 72);
+    header.entryCount = LoadLe32(sector + 80);
+    header.entrySize = LoadLe32(sector + 84);
+    header.entryArrayCrc32 = LoadLe32(sector + 88);
+
+    unsigned long long arrayBytes = (unsigned long long)header.entryCount * header.entrySize;
+    unsigned long long arraySectors = (arrayBytes + map->sectorSize - 1) / map->sectorSize;
+    if (header.myLba != lba ||
+        header.entrySize < GPT_ENTRY_MIN_SIZE || header.entrySize % 8 ||
+        header.entryCount == 0 || arrayBytes > PT_MAX_ENTRY_ARRAY_BYTES ||
+        header.entryArrayLba >= map->totalSectors || arraySectors > map->totalSectors - header.entryArrayLba ||
+        header.lastUsableLba >= map->totalSectors || header.firstUsableLba > header.lastUsableLba + 1)
+        return 0;
+
+    *info = header;
+    memcpy(diskGuid, sector + 56, 16);
+    return 1;
+}
+
+// Reads the entry array a valid header points at into array. Returns 1 if its CRC32 matches.
+static int ReadGptEntries(PT_READ_ROUTINE read, void* context, PPT_MAP map, const PT_GPT_HEADER_INFO* header, unsigned char* array) {
+    unsigned int arrayBytes = header->entryCount * header->entrySize;
+    unsigned int arraySectors = (arrayBytes + map->sectorSize - 1) / map->sectorSize;
+    if (read(context, header->entryArrayLba, arraySectors, array)) {
+        map->flags |= PT_READ_FAILED;
+        return 0;
+    }
+    return Crc32Update(0, array, arrayBytes) == header->entryArrayCrc32;
+}
+
+static void DecodeGptEntries(PPT_MAP map, PPT_ENTRY entries, const PT_GPT_HEADER_INFO* header, const unsigned char* array) {
+    for (unsigned int i = 0; i < header->entryCount; i++) {
+        const unsigned char* p = array + (size_t)i * header->entrySize;
+        if (IsAllZero(p, 16))
+            continue;
+
+        PPT_ENTRY entry = AddEntry(map, entries);
+        if (!entry)
+            return;
+        entry->source = PT_SOURCE_GPT;
+        entry->index = i;
+        memcpy(entry->typeGuid, p, 16);
+        memcpy(entry->uniqueGuid, p + 16, 16);
+        entry->firstLba = LoadLe64(p + 32);
+        entry->lastLba = LoadLe64(p + 40);
+        entry->attributes = LoadLe64(p + 48);
+        for (int c = 0; c < 36; c++)
+            entry->name[c] = (unsigned short)(p[56 + c * 2] | (p[57 + c * 2] << 8));
+    }
+}
+
+static int SameGptTable(const PT_GPT_HEADER_INFO* primary, const PT_GPT_HEADER_INFO* backup) {
+    return primary->alternateLba == backup->myLba && backup->alternateLba == primary->myLba &&
+           primary->firstUsableLba == backup->firstUsableLba && primary->lastUsableLba == backup->lastUsableLba &&
+           primary->entryCount == backup->entryCount && primary->entrySize == backup->entrySize &&
+           primary->entryArrayCrc32 == backup->entryArrayCrc32;
+}
+
+static void DecodeGpt(PT_READ_ROUTINE read, void* context, PPT_MAP map, PPT_ENTRY entries, unsigned char* array, unsigned char* sector) {
+    unsigned char primaryGuid[16] = { 0 }, backupGuid[16] = { 0 };
+    PT_GPT_HEADER_INFO primary, backup;
+    memset(&primary, 0, sizeof(primary));
+    memset(&backup, 0, sizeof(backup));
+
+    if (map->totalSectors > 2 && ReadGptHeader(read, context, map, 1, sector, &primary, primaryGuid)) {
+        map->flags |= PT_GPT_PRIMARY_HEADER_VALID;
+        map->gptPrimary = primary;
+        memcpy(map->gptDiskGuid, primaryGuid, 16);
+        if (ReadGptEntries(read, context, map, &primary, array)) {
+            map->flags |= PT_GPT_PRIMARY_ENTRIES_VALID;
+            DecodeGptEntries(map, entries, &primary, array);
+        }
+    }
+
+    // Without a primary to point at it, the backup is expected in the last sector.
+    unsigned long long backupLba = (map->flags & PT_GPT_PRIMARY_HEADER_VALID) ? primary.alternateLba : map->totalSectors - 1;
+    if (backupLba > 1 && backupLba < map->totalSectors && ReadGptHeader(read, context, map, backupLba, sector, &backup, backupGuid)) {
+        map->flags |= PT_GPT_BACKUP_HEADER_VALID;
+        map->gptBackup = backup;
+        if (ReadGptEntries(read, context, map, &backup, array)) {
+            map->flags |= PT_GPT_BACKUP_ENTRIES_VALID;
+            if (!(map->flags & PT_GPT_PRIMARY_ENTRIES_VALID)) {
+                memcpy(map->gptDiskGuid, backupGuid, 16);
+                DecodeGptEntries(map, entries, &backup, array);
+            }
+        }
+    }
+
+    if ((map->flags & PT_GPT_PRIMARY_HEADER_VALID) && (map->flags & PT_GPT_BACKUP_HEADER_VALID) &&
+        (!SameGptTable(&primary, &backup) || memcmp(primaryGuid, backupGuid, 16) != 0))
+        map->flags |= PT_GPT_BACKUP_MISMATCH;
+}
+
+static void DecodeEbrChain(PT_READ_ROUTINE read, void* context, PPT_MAP map, PPT_ENTRY entries, const MBR_RAW_ENTRY* extended, unsigned char* sector) {
+    unsigned long long extendedStart = extended->firstLba;
+    unsigned long long extendedEnd = extendedStart + extended->sectorCount;
+    unsigned long long ebrLba = extendedStart;
+
+    // Links have to move forward through the extended partition, which rules out loops.
+    for (unsigned int n = 0;; n++) {
+        if (n == PT_MAX_LOGICAL_PARTITIONS || ebrLba < extendedStart || ebrLba >= extendedEnd || ebrLba >= map->totalSectors) {
+            map->flags |= PT_EBR_CHAIN_TRUNCATED;
+            return;
+        }
+
+        MBR_RAW_ENTRY raw[4];
+        if (!ReadMbrSector(read, context, map, ebrLba, sector, raw)) {
+            map->flags |= PT_EBR_CHAIN_TRUNCATED;
+            return;
+        }
+
+        if (raw[0].type && raw[0].sectorCount) {
+            PPT_ENTRY entry = AddEntry(map, entries);
+            if (!entry)
+                return;
+            entry->source = PT_SOURCE_MBR_LOGICAL;
+            entry->index = 4 + n;
+            entry->mbrType = raw[0].type;
+            entry->active = raw[0].status == 0x80;
+            entry->ebrLba = ebrLba;
+            entry->firstLba = ebrLba + raw[0].firstLba;
+            entry->lastLba = entry->firstLba + raw[0].sectorCount - 1;
+        }
+
+        if (!raw[1].type || !raw[1].sectorCount)
+            return;
+        unsigned long long next = extendedStart + raw[1].firstLba;
+        if (next <= ebrLba) {
+            map->flags |= PT_EBR_CHAIN_TRUNCATED;
+            return;
+        }
+        ebrLba = next;
+    }
+}
+
+int PartitionTableDecode(PT_READ_ROUTINE read, void* context, unsigned int sectorSize, unsigned long long totalSectors,
+                         unsigned char* scratch, size_t scratchLength, PPT_MAP map, PPT_ENTRY entries) {
+    memset(map, 0, sizeof(*map));
+    if (sectorSize < 512 || sectorSize > 65536 || (sectorSize & (sectorSize - 1)) || totalSectors == 0 ||
+        scratchLength < PT_SCRATCH_BYTES(sectorSize))
+        return -1;
+    map->sectorSize = sectorSize;
+    map->totalSectors = totalSectors;
+
+    unsigned char* array = scratch;
+    unsigned char* sector = scratch + PT_MAX_ENTRY_ARRAY_BYTES;
+
+    MBR_RAW_ENTRY mbr[4];
+    if (ReadMbrSector(read, context, map, 0, sector, mbr)) {
+        map->flags |= PT_MBR_VALID;
+        map->mbrDiskSignature = LoadLe32(sector + MBR_DISK_SIGNATURE_OFFSET);
+        for (int i = 0; i < 4; i++) {
+            if (mbr[i].type == MBR_TYPE_PROTECTIVE)
+                map->flags |= PT_MBR_PROTECTIVE;
+        }
+    }
+
+    DecodeGpt(read, context, map, entries, array, sector);
+    if (map->flags & (PT_GPT_PRIMARY_ENTRIES_VALID | PT_GPT_BACKUP_ENTRIES_VALID)) {
+        map->style = PT_STYLE_GPT;
+        return 0;
+    }
+
+    if (!(map->flags & PT_MBR_VALID))
+        return 0;
+    map->style = PT_STYLE_MBR;
+
+    const MBR_RAW_ENTRY* extended = 0;
+    for (int i = 0; i < 4; i++) {
+        if (!mbr[i].type || !mbr[i].sectorCount)
+            continue;
+        PPT_ENTRY entry = AddEntry(map, entries);
+        if (!entry)
+            return 0;
+        entry->source = PT_SOURCE_MBR_PRIMARY;
+        entry->index = (unsigned int)i;
+        entry->mbrType = mbr[i].type;
+        entry->active = mbr[i].status == 0x80;
+        entry->firstLba = mbr[i].firstLba;
+        entry->lastLba = (unsigned long long)mbr[i].firstLba + mbr[i].sectorCount - 1;
+        if (!extended && IsExtendedType(mbr[i].type))
+            extended = &mbr[i];
+    }
+
+    if (extended)
+        DecodeEbrChain(read, context, map, entries, extended, sector);
+    return 0;
+}
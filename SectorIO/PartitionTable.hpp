@@ -0,0 +1,83 @@
+#pragma once
+// On-disk MBR/EBR/GPT decoding for IOCTL_SECTOR_PARTITION_MAP. Kept free of WDK dependencies so it builds, fuzzes
+// and benchmarks on the host as well. Everything is taken from the sectors themselves; nothing is trusted without
+// bounds checks, and GPT structures only count as valid once their CRC32 matches.
+#include <stddef.h>
+
+#define PT_MAX_ENTRIES                  256
+#define PT_MAX_LOGICAL_PARTITIONS       128             // EBR chain length limit, which also breaks loops
+#define PT_MAX_ENTRY_ARRAY_BYTES        (1024 * 1024)   // GPT entry arrays beyond this are treated as corrupt
+
+#define PT_STYLE_NONE                   0
+#define PT_STYLE_MBR                    1
+#define PT_STYLE_GPT                    2
+
+#define PT_MBR_VALID                    0x00000001  // 0x55AA boot signature present
+#define PT_MBR_PROTECTIVE               0x00000002  // contains a type 0xEE entry
+#define PT_GPT_PRIMARY_HEADER_VALID     0x00000004
+#define PT_GPT_PRIMARY_ENTRIES_VALID    0x00000008
+#define PT_GPT_BACKUP_HEADER_VALID      0x00000010
+#define PT_GPT_BACKUP_ENTRIES_VALID     0x00000020
+#define PT_GPT_BACKUP_MISMATCH          0x00000040  // both headers valid but describing different tables
+#define PT_EBR_CHAIN_TRUNCATED          0x00000080  // loop, out-of-range link, unreadable EBR or length limit
+#define PT_ENTRIES_TRUNCATED            0x00000100  // more than PT_MAX_ENTRIES partitions
+#define PT_READ_FAILED                  0x00000200  // some sector could not be read; the map is partial
+
+#define PT_SOURCE_MBR_PRIMARY           1
+#define PT_SOURCE_MBR_LOGICAL           2
+#define PT_SOURCE_GPT                   3
+
+#pragma pack (push, 1)
+
+typedef struct _PT_ENTRY {
+    unsigned long long firstLba;
+    unsigned long long lastLba;         // inclusive
+    unsigned int index;                 // MBR slot 0-3, logical partitions numbered from 4 in chain order; GPT array index
+    unsigned char source;               // PT_SOURCE_*
+    unsigned char mbrType;
+    unsigned char active;
+    unsigned long long ebrLba;          // logical partitions: the EBR that describes them
+    unsigned char typeGuid[16];         // GPT only, in GUID memory layout
+    unsigned char uniqueGuid[16];
+    unsigned long long attributes;
+    unsigned short name[36];            // UTF-16LE, not necessarily terminated
+} PT_ENTRY, *PPT_ENTRY;
+
+typedef struct _PT_GPT_HEADER_INFO {
+    unsigned long long myLba;
+    unsigned long long alternateLba;
+    unsigned long long firstUsableLba;
+    unsigned long long lastUsableLba;
+    unsigned long long entryArrayLba;
+    unsigned int entryCount;
+    unsigned int entrySize;
+    unsigned int entryArrayCrc32;
+} PT_GPT_HEADER_INFO, *PPT_GPT_HEADER_INFO;
+
+typedef struct _PT_MAP {
+    unsigned int style;                 // PT_STYLE_*
+    unsigned int flags;                 // PT_*
+    unsigned int sectorSize;
+    unsigned long long totalSectors;
+    unsigned int mbrDiskSignature;
+    unsigned char gptDiskGuid[16];
+    PT_GPT_HEADER_INFO gptPrimary;      // zero unless the header is valid
+    PT_GPT_HEADER_INFO gptBackup;
+    unsigned int entryCount;
+    // PT_ENTRY entries[entryCount]
+} PT_MAP, *PPT_MAP;
+
+#pragma pack (pop)
+
+// Reads count sectors starting at lba into buffer; returns nonzero on failure.
+typedef int (*PT_READ_ROUTINE)(void* context, unsigned long long lba, unsigned int count, void* buffer);
+
+// Scratch space the decoder needs: one entry array plus one sector.
+#define PT_SCRATCH_BYTES(sectorSize)    (PT_MAX_ENTRY_ARRAY_BYTES + (sectorSize))
+
+// Decodes the tables of a device with totalSectors sectors of sectorSize bytes (512..65536, a power of two).
+// entries must have room for PT_MAX_ENTRIES. GPT entries come from the primary array, or from the backup when the
+// primary is damaged; MBR entries, including the protective one, are only reported when there is no usable GPT.
+// Returns 0, or -1 if the parameters are unusable.
+int PartitionTableDecode(PT_READ_ROUTINE read, void* context, unsigned int sectorSize, unsigned long long totalSectors,
+                         unsigned char* scratch, size_t scratchLength, PPT_MAP map, PPT_ENTRY entries);
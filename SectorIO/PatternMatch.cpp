@@ -0,0 +1,126 @@
+#include "PatternMatch.hpp"
+
+int PatternPrepare(PBYTE_PATTERN pattern, const unsigned char* bytes, const unsigned char* mask, size_t length) {
+    if (!pattern || !bytes || length == 0 || length > PATTERN_MAX_LENGTH)
+        return 0;
+
+    pattern->bytes = bytes;
+    pattern->mask = mask;
+    pattern->length = length;
+    pattern->firstAnchor = 0;
+    pattern->lastAnchor = 0;
+    pattern->hasAnchors = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        if (mask && mask[i] != 0xFF)
+            continue;
+        if (!pattern->hasAnchors)
+            pattern->firstAnchor = i;
+        pattern->lastAnchor = i;
+        pattern->hasAnchors = 1;
+    }
+    return 1;
+}
+
+static inline int PatternMatchesAt(const BYTE_PATTERN* pattern, const unsigned char* data) {
+    if (pattern->mask) {
+        for (size_t i = 0; i < pattern->length; i++) {
+            if ((data[i] & pattern->mask[i]) != (pattern->bytes[i] & pattern->mask[i]))
+                return 0;
+        }
+        return 1;
+    }
+
+    for (size_t i = 0; i < pattern->length; i++) {
+        if (data[i] != pattern->bytes[i])
+            return 0;
+    }
+    return 1;
+}
+
+int PatternScanScalar(const BYTE_PATTERN* pattern, const unsigned char* data, size_t length, size_t firstPosition, PATTERN_MATCH_ROUTINE routine, void* context) {
+    if (length < pattern->length)
+        return 1;
+
+    size_t lastPosition = length - pattern->length;
+    for (size_t position = firstPosition; position <= lastPosition; position++) {
+        if (pattern->hasAnchors && data[position + pattern->firstAnchor] != pattern->bytes[pattern->firstAnchor])
+            continue;
+        if (PatternMatchesAt(pattern, data + position) && !routine(context, position))
+            return 0;
+    }
+    return 1;
+}
+
+#if SIMD_X64
+
+// Both vector scans use the two-anchor prefilter: compare a full block of candidate positions against the first and
+// last fully specified pattern byte at once and only verify the positions where both hit.
+
+SIMD_TARGET("sse2")
+int PatternScanSse2(const BYTE_PATTERN* pattern, const unsigned char* data, size_t length, size_t firstPosition, PATTERN_MATCH_ROUTINE routine, void* context) {
+    if (!pattern->hasAnchors || length < pattern->length + 16)
+        return PatternScanScalar(pattern, data, length, firstPosition, routine, context);
+
+    const __m128i first = _mm_set1_epi8((char)pattern->bytes[pattern->firstAnchor]);
+    const __m128i last = _mm_set1_epi8((char)pattern->bytes[pattern->lastAnchor]);
+    const size_t vectorEnd = length - pattern->length - 15;
+
+    size_t position = firstPosition;
+    for (; position < vectorEnd; position += 16) {
+        __m128i blockFirst = _mm_loadu_si128((const __m128i*)(data + position + pattern->firstAnchor));
+        __m128i blockLast = _mm_loadu_si128((const __m128i*)(data + position + pattern->lastAnchor));
+        unsigned int candidates = (unsigned int)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(blockFirst, first), _mm_cmpeq_epi8(blockLast, last)));
+
+        while (candidates) {
+            size_t candidate = position + SimdCountTrailingZeros(candidates);
+            if (PatternMatchesAt(pattern, data + candidate) && !routine(context, candidate))
+                return 0;
+            candidates &= candidates - 1;
+        }
+    }
+
+    return PatternScanScalar(pattern, data, length, position, routine, context);
+}
+
+SIMD_TARGET("avx2")
+int PatternScanAvx2(const BYTE_PATTERN* pattern, const unsigned char* data, size_t length, size_t firstPosition, PATTERN_MATCH_ROUTINE routine, void* context) {
+    if (!pattern->hasAnchors || length < pattern->length + 32)
+        return PatternScanSse2(pattern, data, length, firstPosition, routine, context);
+
+    const __m256i first = _mm256_set1_epi8((char)pattern->bytes[pattern->firstAnchor]);
+    const __m256i last = _mm256_set1_epi8((char)pattern->bytes[pattern->lastAnchor]);
+    const size_t vectorEnd = length - pattern->length - 31;
+
+    size_t position = firstPosition;
+    for (; position < vectorEnd; position += 32) {
+        __m256i blockFirst = _mm256_loadu_si256((const __m256i*)(data + position + pattern->firstAnchor));
+        __m256i blockLast = _mm256_loadu_si256((const __m256i*)(data + position + pattern->lastAnchor));
+        unsigned int candidates = (unsigned int)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(blockFirst, first), _mm256_cmpeq_epi8(blockLast, last)));
+
+        while (candidates) {
+            size_t candidate = position + SimdCountTrailingZeros(candidates);
+            if (PatternMatchesAt(pattern, data + candidate) && !routine(context, candidate))
+                return 0;
+            candidates &= candidates - 1;
+        }
+    }
+
+    return PatternScanSse2(pattern, data, length, position, routine, context);
+}
+
+#endif
+
+int PatternScan(const BYTE_PATTERN* pattern, const unsigned char* data, size_t length, size_t firstPosition, unsigned int features, PATTERN_MATCH_ROUTINE routine, void* context) {
+#if SIMD_X64
+    if (features & SIMD_FEATURE_AVX2)
+        return PatternScanAvx2(pattern, data, length, firstPosition, routine, context);
+    if (features & SIMD_FEATURE_SSE2)
+        return PatternScanSse2(pattern, data, length, firstPosition, routine, context);
+#else
+    (void)features;
+#endif
+    return PatternScanScalar(pattern, data, length, firstPosition, routine, context);
+}
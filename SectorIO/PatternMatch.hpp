@@ -0,0 +1,32 @@
+#pragma once
+// Byte-pattern matcher used by IOCTL_SECTOR_SEARCH. Kept free of WDK dependencies so it builds on the host as well.
+#include "SimdCommon.hpp"
+
+#define PATTERN_MAX_LENGTH 256
+
+typedef struct _BYTE_PATTERN {
+    const unsigned char* bytes;
+    const unsigned char* mask;      // NULL when every byte has to match exactly
+    size_t length;
+
+    // Fully specified bytes the vector prefilter compares against; only valid when hasAnchors is set.
+    size_t firstAnchor;
+    size_t lastAnchor;
+    int hasAnchors;
+} BYTE_PATTERN, *PBYTE_PATTERN;
+
+// Return zero to stop the scan.
+typedef int (*PATTERN_MATCH_ROUTINE)(void* context, size_t position);
+
+int PatternPrepare(PBYTE_PATTERN pattern, const unsigned char* bytes, const unsigned char* mask, size_t length);
+
+// Reports every position >= firstPosition where the pattern fully fits inside data[0, length).
+// Returns zero when the callback stopped the scan, nonzero otherwise.
+int PatternScanScalar(const BYTE_PATTERN* pattern, const unsigned char* data, size_t length, size_t firstPosition, PATTERN_MATCH_ROUTINE routine, void* context);
+#if SIMD_X64
+int PatternScanSse2(const BYTE_PATTERN* pattern, const unsigned char* data, size_t length, size_t firstPosition, PATTERN_MATCH_ROUTINE routine, void* context);
+int PatternScanAvx2(const BYTE_PATTERN* pattern, const unsigned char* data, size_t length, size_t firstPosition, PATTERN_MATCH_ROUTINE routine, void* context);
+#endif
+
+// Picks the widest implementation allowed by the SIMD_FEATURE_* mask.
+int PatternScan(const BYTE_PATTERN* pattern, const unsigned char* data, size_t length, size_t firstPosition, unsigned int features, PATTERN_MATCH_ROUTINE routine, void* context);
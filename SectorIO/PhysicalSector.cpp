@@ -0,0 +1,25 @@
+#include "PhysicalSector.hpp"
+
+unsigned int PhysicalSectorBoundary(unsigned long long objectOffset, unsigned int alignmentOffset, unsigned int physicalSectorSize) {
+    unsigned int objectShift = (unsigned int)(objectOffset % physicalSectorSize);
+    return (alignmentOffset % physicalSectorSize + physicalSectorSize - objectShift) % physicalSectorSize;
+}
+
+int PhysicalSectorIsAligned(unsigned int physicalSectorSize, unsigned int boundary, unsigned long long byteOffset, unsigned long long length) {
+    unsigned long long shift = physicalSectorSize - boundary;
+    return (byteOffset + shift) % physicalSectorSize == 0 && (byteOffset + length + shift) % physicalSectorSize == 0;
+}
+
+int PhysicalSectorSpan(unsigned int physicalSectorSize, unsigned int boundary, unsigned long long byteOffset, unsigned long long length, PPHYSICAL_SECTOR_SPAN span) {
+    if (byteOffset < boundary)
+        return 0;
+
+    span->start = boundary + (byteOffset - boundary) / physicalSectorSize * physicalSectorSize;
+    span->end = boundary + (byteOffset + length - boundary + physicalSectorSize - 1) / physicalSectorSize * physicalSectorSize;
+    span->headLength = (unsigned int)(byteOffset - span->start);
+    span->tailStart = (unsigned int)(span->headLength + length);
+    // Only the physical sectors the range covers partly are read, once if head and tail are the same sector.
+    span->readHead = span->headLength != 0;
+    span->readTail = span->tailStart < span->end - span->start && !(span->readHead && span->end - span->start == physicalSectorSize);
+    return 1;
+}
@@ -0,0 +1,21 @@
+#pragma once
+// Physical sector arithmetic for disks whose physical sectors hold several logical ones, where a write covering only
+// part of a physical sector makes the device read, merge and write it back. Kept free of WDK dependencies so it builds
+// on the host as well. Offsets are bytes into a storage object, whose first physical sector boundary is at boundary,
+// below the physical sector size.
+
+typedef struct _PHYSICAL_SECTOR_SPAN {
+    unsigned long long start;       // first physical sector the range touches
+    unsigned long long end;         // end of the last one
+    unsigned int headLength;        // bytes of the first physical sector in front of the range
+    unsigned int tailStart;         // offset from start at which the range ends
+    int readHead;                   // the first physical sector is covered only partly and has to be read
+    int readTail;                   // so is the last one, and it is not the head read already
+} PHYSICAL_SECTOR_SPAN, *PPHYSICAL_SECTOR_SPAN;
+
+// Boundary in an object starting objectOffset bytes into a disk whose physical sectors start alignmentOffset bytes in.
+unsigned int PhysicalSectorBoundary(unsigned long long objectOffset, unsigned int alignmentOffset, unsigned int physicalSectorSize);
+int PhysicalSectorIsAligned(unsigned int physicalSectorSize, unsigned int boundary, unsigned long long byteOffset, unsigned long long length);
+// Whole physical sectors around a range. Returns 0 for a range starting in front of the boundary, whose first physical
+// sector begins before the object does.
+int PhysicalSectorSpan(unsigned int physicalSectorSize, unsigned int boundary, unsigned long long byteOffset, unsigned long long length, PPHYSICAL_SECTOR_SPAN span);
@@ -0,0 +1,246 @@
+#include "Qos.hpp"
+#include "HandleContext.hpp"
+#include "RequestControl.hpp"
+
+// Waiters other than the head re-check for cancellation at this interval.
+#define QOS_POLL_INTERVAL_100NS     (100 * 10000LL)
+#define QOS_MIN_WAIT_100NS          (1 * 10000LL)
+
+typedef struct _QOS_WAITER {
+    LIST_ENTRY entry;
+    KEVENT wake;
+    ULONG priorityClass;
+    ULONG length;
+} QOS_WAITER, *PQOS_WAITER;
+
+void QosInitialize(OUT PQOS_LIMITER pLimiter) {
+    RtlZeroMemory(pLimiter, sizeof(*pLimiter));
+    KeInitializeSpinLock(&pLimiter->lock);
+    InitializeListHead(&pLimiter->waiters);
+    pLimiter->settings.priorityClass = SECTOR_QOS_PRIORITY_NORMAL;
+}
+
+static void QosWakeHead(IN PQOS_LIMITER pLimiter) {
+    if (!IsListEmpty(&pLimiter->waiters)) {
+        PQOS_WAITER pHead = CONTAINING_RECORD(pLimiter->waiters.Flink, QOS_WAITER, entry);
+        KeSetEvent(&pHead->wake, IO_NO_INCREMENT, FALSE);
+    }
+}
+
+NTSTATUS QosApplySettings(IN PQOS_LIMITER pLimiter, IN PSECTOR_QOS_SETTINGS pSettings) {
+    if (pSettings->priorityClass > SECTOR_QOS_PRIORITY_HIGH)
+        return STATUS_INVALID_PARAMETER;
+
+    ULONGLONG now = KeQueryInterruptTime();
+    KIRQL oldIrql;
+    KeAcquireSpinLock(&pLimiter->lock, &oldIrql);
+    pLimiter->settings = *pSettings;
+    pLimiter->settings.flags = 0;
+    pLimiter->limited = pSettings->maxIops || pSettings->maxBytesPerSecond;
+    TokenBucketInit(&pLimiter->iops, pSettings->maxIops, pSettings->burstIos, now);
+    TokenBucketInit(&pLimiter->bytes, pSettings->maxBytesPerSecond, pSettings->burstBytes, now);
+    // The head may be sleeping on a budget computed from the old rates.
+    QosWakeHead(pLimiter);
+    KeReleaseSpinLock(&pLimiter->lock, oldIrql);
+    return STATUS_SUCCESS;
+}
+
+void QosQueryStatus(IN PQOS_LIMITER pLimiter, OUT PSECTOR_QOS_STATUS pStatus) {
+    KIRQL oldIrql;
+    KeAcquireSpinLock(&pLimiter->lock, &oldIrql);
+    pStatus->settings = pLimiter->settings;
+    pStatus->admittedIos = pLimiter->admittedIos;
+    pStatus->admittedBytes = pLimiter->admittedBytes;
+    pStatus->delayedIos = pLimiter->delayedIos;
+    pStatus->totalDelay100ns = pLimiter->totalDelay100ns;
+    pStatus->waiting = pLimiter->waiting;
+    KeReleaseSpinLock(&pLimiter->lock, oldIrql);
+}
+
+ULONG QosPriorityClass(IN PQOS_LIMITER pLimiter OPTIONAL) {
+    return pLimiter ? pLimiter->settings.priorityClass : SECTOR_QOS_PRIORITY_NORMAL;
+}
+
+IO_PRIORITY_HINT QosPriorityHint(IN ULONG priorityClass) {
+    switch (priorityClass) {
+    case SECTOR_QOS_PRIORITY_VERY_LOW: return IoPriorityVeryLow;
+    case SECTOR_QOS_PRIORITY_LOW: return IoPriorityLow;
+    case SECTOR_QOS_PRIORITY_HIGH: return IoPriorityHigh;
+    default: return IoPriorityNormal;
+    }
+}
+
+// Called with the lock held
+static BOOLEAN QosTryConsume(IN PQOS_LIMITER pLimiter, IN ULONG length, OUT PULONGLONG pWait) {
+    ULONGLONG now = KeQueryInterruptTime();
+    TokenBucketRefill(&pLimiter->iops, now);
+    TokenBucketRefill(&pLimiter->bytes, now);
+
+    ULONGLONG wait = max(TokenBucketWaitTime(&pLimiter->iops, 1), TokenBucketWaitTime(&pLimiter->bytes, length));
+    if (wait) {
+        *pWait = wait;
+        return FALSE;
+    }
+
+    TokenBucketConsume(&pLimiter->iops, 1);
+    TokenBucketConsume(&pLimiter->bytes, length);
+    pLimiter->admittedIos++;
+    pLimiter->admittedBytes += length;
+    return TRUE;
+}
+
+NTSTATUS QosAdmit(IN PQOS_LIMITER pLimiter, IN ULONG priorityClass, IN ULONG length, IN PIRP pOriginIrp OPTIONAL) {
+    if (!pLimiter)
+        return STATUS_SUCCESS;
+
+    KIRQL oldIrql;
+    ULONGLONG wait = 0;
+    KeAcquireSpinLock(&pLimiter->lock, &oldIrql);
+    if (!pLimiter->limited || (IsListEmpty(&pLimiter->waiters) && QosTryConsume(pLimiter, length, &wait))) {
+        KeReleaseSpinLock(&pLimiter->lock, oldIrql);
+        return STATUS_SUCCESS;
+    }
+
+    // Queue behind everyone of the same or higher priority. Only the head waits for the buckets; the others
+    // sleep until the head leaves and wakes its successor.
+    QOS_WAITER waiter;
+    waiter.priorityClass = priorityClass;
+    waiter.length = length;
+    KeInitializeEvent(&waiter.wake, SynchronizationEvent, FALSE);
+
+    PLIST_ENTRY pInsertBefore = pLimiter->waiters.Flink;
+    while (pInsertBefore != &pLimiter->waiters &&
+           CONTAINING_RECORD(pInsertBefore, QOS_WAITER, entry)->priorityClass >= priorityClass)
+        pInsertBefore = pInsertBefore->Flink;
+    InsertTailList(pInsertBefore, &waiter.entry);
+    pLimiter->waiting++;
+
+    ULONGLONG queuedAt = KeQueryInterruptTime();
+    NTSTATUS status = STATUS_SUCCESS;
+    for (;;) {
+        LONGLONG timeout = QOS_POLL_INTERVAL_100NS;
+        if (pLimiter->waiters.Flink == &waiter.entry) {
+            if (!pLimiter->limited || QosTryConsume(pLimiter, length, &wait))
+                break;
+            timeout = (LONGLONG)min(max(wait, (ULONGLONG)QOS_MIN_WAIT_100NS), (ULONGLONG)QOS_POLL_INTERVAL_100NS);
+        }
+        KeReleaseSpinLock(&pLimiter->lock, oldIrql);
+
+        LARGE_INTEGER interval;
+        interval.QuadPart = -timeout;
+        KeWaitForSingleObject(&waiter.wake, Executive, KernelMode, FALSE, &interval);
+
+        KeAcquireSpinLock(&pLimiter->lock, &oldIrql);
+        status = RequestAbortStatus(pOriginIrp);
+        if (!NT_SUCCESS(status))
+            break;
+    }
+
+    BOOLEAN wasHead = pLimiter->waiters.Flink == &waiter.entry;
+    RemoveEntryList(&waiter.entry);
+    pLimiter->waiting--;
+    if (NT_SUCCESS(status)) {
+        pLimiter->delayedIos++;
+        pLimiter->totalDelay100ns += KeQueryInterruptTime() - queuedAt;
+    }
+    if (wasHead)
+        QosWakeHead(pLimiter);
+    KeReleaseSpinLock(&pLimiter->lock, oldIrql);
+    return status;
+}
+
+PQOS_LIMITER QosGetStorageLimiter(IN PSTORAGE_OBJECT pStorageObject, IN BOOLEAN create) {
+    PQOS_LIMITER pLimiter = (PQOS_LIMITER)pStorageObject->pQos;
+    if (pLimiter || !create)
+        return pLimiter;
+
+    pLimiter = new (NON_PAGED) QOS_LIMITER;
+    if (!pLimiter)
+        return NULL;
+    QosInitialize(pLimiter);
+
+    PVOID pExisting = InterlockedCompareExchangePointer((PVOID*)&pStorageObject->pQos, pLimiter, NULL);
+    if (pExisting) {
+        delete pLimiter;
+        return (PQOS_LIMITER)pExisting;
+    }
+    return pLimiter;
+}
+
+void QosFreeStorageLimiter(IN PSTORAGE_OBJECT pStorageObject) {
+    if (pStorageObject->pQos) {
+        delete (PQOS_LIMITER)pStorageObject->pQos;
+        pStorageObject->pQos = NULL;
+    }
+}
+
+static NTSTATUS ApplyQosRequest(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PQOS_LIMITER pLimiter, IN PSECTOR_QOS_SETTINGS pSettings) {
+    NTSTATUS status = STATUS_SUCCESS;
+    if (!(pSettings->flags & SECTOR_QOS_QUERY_ONLY)) {
+        status = QosApplySettings(pLimiter, pSettings);
+        if (!NT_SUCCESS(status))
+            return status;
+    }
+
+    PVOID outBuffer = pIrp->UserBuffer;
+    if (!outBuffer || pIrpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(SECTOR_QOS_STATUS))
+        return status;
+
+    SECTOR_QOS_STATUS qosStatus;
+    QosQueryStatus(pLimiter, &qosStatus);
+    __try {
+        ProbeForWrite(outBuffer, sizeof(qosStatus), 1);
+        RtlCopyMemory(outBuffer, &qosStatus, sizeof(qosStatus));
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return GetExceptionCode();
+    }
+    pIrp->IoStatus.Information = sizeof(qosStatus);
+    return status;
+}
+
+NTSTATUS SetHandleQosIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack) {
+    LOG("SetHandleQosIoctlHandler called\n");
+    PHANDLE_CONTEXT pContext = GetHandleContext(pIrp);
+    if (!pContext)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    SECTOR_QOS_SETTINGS settings;
+    PVOID userInput = pIrpStack->Parameters.DeviceIoControl.Type3InputBuffer;
+    if (!userInput || pIrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(settings))
+        return STATUS_INFO_LENGTH_MISMATCH;
+
+    __try {
+        ProbeForRead(userInput, sizeof(settings), 1);
+        RtlCopyMemory(&settings, userInput, sizeof(settings));
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return GetExceptionCode();
+    }
+
+    return ApplyQosRequest(pIrp, pIrpStack, &pContext->qos, &settings);
+}
+
+NTSTATUS SetStorageQosIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject) {
+    LOG("SetStorageQosIoctlHandler called\n");
+    if (!pStorageObject)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    SECTOR_STORAGE_QOS_REQUEST request;
+    PVOID userInput = pIrpStack->Parameters.DeviceIoControl.Type3InputBuffer;
+    if (!userInput || pIrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(request))
+        return STATUS_INFO_LENGTH_MISMATCH;
+
+    __try {
+        ProbeForRead(userInput, sizeof(request), 1);
+        RtlCopyMemory(&request, userInput, sizeof(request));
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return GetExceptionCode();
+    }
+
+    PQOS_LIMITER pLimiter = QosGetStorageLimiter(pStorageObject, TRUE);
+    if (!pLimiter)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    return ApplyQosRequest(pIrp, pIrpStack, pLimiter, &request.settings);
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include "Sector.hpp"
+#include "TokenBucket.hpp"
+
+#pragma pack (push, 1)
+
+// Priority classes map onto the lower IRP's I/O priority hint and order the requests waiting for budget.
+#define SECTOR_QOS_PRIORITY_VERY_LOW        0
+#define SECTOR_QOS_PRIORITY_LOW             1
+#define SECTOR_QOS_PRIORITY_NORMAL          2
+#define SECTOR_QOS_PRIORITY_HIGH            3
+
+#define SECTOR_QOS_QUERY_ONLY               0x00000001  // leave the settings alone, only return the status
+
+typedef struct _SECTOR_QOS_SETTINGS {
+    ULONG flags;                    // SECTOR_QOS_QUERY_ONLY
+    ULONG priorityClass;            // SECTOR_QOS_PRIORITY_*
+    ULONG maxIops;                  // 0 = unlimited
+    ULONG burstIos;                 // 0 = one second worth
+    ULONGLONG maxBytesPerSecond;    // 0 = unlimited
+    ULONGLONG burstBytes;           // 0 = one second worth
+} SECTOR_QOS_SETTINGS, *PSECTOR_QOS_SETTINGS;
+
+typedef struct _SECTOR_STORAGE_QOS_REQUEST {
+    STORAGE_LOCATION location;
+    SECTOR_QOS_SETTINGS settings;
+} SECTOR_STORAGE_QOS_REQUEST, *PSECTOR_STORAGE_QOS_REQUEST;
+
+typedef struct _SECTOR_QOS_STATUS {
+    SECTOR_QOS_SETTINGS settings;
+    ULONGLONG admittedIos;
+    ULONGLONG admittedBytes;
+    ULONGLONG delayedIos;           // had to wait for budget
+    ULONGLONG totalDelay100ns;
+    ULONG waiting;                  // requests queued right now
+} SECTOR_QOS_STATUS, *PSECTOR_QOS_STATUS;
+
+#pragma pack (pop)
+
+// Token-bucket limiter shared by everything issued through one handle or against one storage object. Requests over
+// budget wait in a priority-ordered queue and are released as the buckets refill; they are never rejected.
+typedef struct _QOS_LIMITER {
+    KSPIN_LOCK lock;
+    SECTOR_QOS_SETTINGS settings;
+    BOOLEAN limited;
+    TOKEN_BUCKET iops;
+    TOKEN_BUCKET bytes;
+    LIST_ENTRY waiters;
+    ULONG waiting;
+
+    ULONGLONG admittedIos;
+    ULONGLONG admittedBytes;
+    ULONGLONG delayedIos;
+    ULONGLONG totalDelay100ns;
+} QOS_LIMITER, *PQOS_LIMITER;
+
+void QosInitialize(OUT PQOS_LIMITER pLimiter);
+NTSTATUS QosApplySettings(IN PQOS_LIMITER pLimiter, IN PSECTOR_QOS_SETTINGS pSettings);
+void QosQueryStatus(IN PQOS_LIMITER pLimiter, OUT PSECTOR_QOS_STATUS pStatus);
+ULONG QosPriorityClass(IN PQOS_LIMITER pLimiter OPTIONAL);
+IO_PRIORITY_HINT QosPriorityHint(IN ULONG priorityClass);
+
+// Blocks until the limiter has budget for one request of length bytes. Must be called at PASSIVE_LEVEL.
+// Returns STATUS_CANCELLED if pOriginIrp is cancelled while waiting.
+NTSTATUS QosAdmit(IN PQOS_LIMITER pLimiter, IN ULONG priorityClass, IN ULONG length, IN PIRP pOriginIrp OPTIONAL);
+
+// Storage object limiters are created on first use and live as long as the storage object.
+PQOS_LIMITER QosGetStorageLimiter(IN PSTORAGE_OBJECT pStorageObject, IN BOOLEAN create);
+void QosFreeStorageLimiter(IN PSTORAGE_OBJECT pStorageObject);
+
+NTSTATUS SetHandleQosIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack);
+NTSTATUS SetStorageQosIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject);
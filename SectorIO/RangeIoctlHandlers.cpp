@@ -0,0 +1,717 @@
+#include "RangeIoctlHandlers.hpp"
+#include "PatternMatch.hpp"
+#include "Digest.hpp"
+#include "BlockScan.hpp"
+#include "Simd.hpp"
+
+typedef struct _SEARCH_CONTEXT {
+    PBYTE_PATTERN patterns;
+    ULONG patternCount;
+
+    PSECTOR_SEARCH_MATCH userMatches;
+    ULONG capacity;
+    ULONG matchCount;
+    BOOLEAN truncated;
+    ULONGLONG bytesScanned;
+    NTSTATUS writeStatus;
+
+    // State of the scan currently running
+    ULONGLONG windowOffset;
+    ULONG patternIndex;
+} SEARCH_CONTEXT, *PSEARCH_CONTEXT;
+
+static int SearchMatchRoutine(void* context, size_t position) {
+    PSEARCH_CONTEXT ctx = (PSEARCH_CONTEXT)context;
+    if (ctx->matchCount >= ctx->capacity) {
+        ctx->truncated = TRUE;
+        return 0;
+    }
+
+    __try {
+        ctx->userMatches[ctx->matchCount].byteOffset = ctx->windowOffset + position;
+        ctx->userMatches[ctx->matchCount].patternIndex = ctx->patternIndex;
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        ctx->writeStatus = GetExceptionCode();
+        return 0;
+    }
+    ctx->matchCount++;
+    return 1;
+}
+
+static NTSTATUS SearchChunkRoutine(IN PVOID context, IN ULONGLONG byteOffset, IN PUCHAR data, IN ULONG length, IN ULONG carryLength) {
+    PSEARCH_CONTEXT ctx = (PSEARCH_CONTEXT)context;
+    const unsigned char* window = data - carryLength;
+    size_t windowLength = (size_t)carryLength + length;
+    ctx->windowOffset = byteOffset - carryLength;
+
+    SIMD_SCOPE scope;
+    SimdEnterScope(&scope);
+    for (ULONG i = 0; i < ctx->patternCount; i++) {
+        // Matches lying entirely inside the carried tail were already reported with the previous chunk.
+        size_t patternLength = ctx->patterns[i].length;
+        size_t firstPosition = (carryLength + 1 > patternLength) ? carryLength + 1 - patternLength : 0;
+
+        ctx->patternIndex = i;
+        if (!PatternScan(&ctx->patterns[i], window, windowLength, firstPosition, scope.features, SearchMatchRoutine, ctx))
+            break;
+    }
+    SimdLeaveScope(&scope);
+
+    if (!NT_SUCCESS(ctx->writeStatus))
+        return ctx->writeStatus;
+    if (ctx->truncated)
+        return STATUS_NO_MORE_ENTRIES;
+
+    ctx->bytesScanned += length;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS SearchSectorsIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject) {
+    LOG("SearchSectorsIoctlHandler called\n");
+    if (!pStorageObject)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    ULONG outLength = pIrpStack->Parameters.DeviceIoControl.OutputBufferLength;
+    PVOID outBuffer = pIrp->UserBuffer;
+    if (!outBuffer || outLength < sizeof(SECTOR_SEARCH_RESULT))
+        return STATUS_INFO_LENGTH_MISMATCH;
+
+    __try {
+        ProbeForWrite(outBuffer, outLength, 1);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return GetExceptionCode();
+    }
+
+    PUCHAR pInput = NULL;
+    ULONG inputLength = 0;
+    NTSTATUS status = CaptureIoctlInput(pIrpStack, sizeof(SECTOR_SEARCH_REQUEST), SECTOR_SEARCH_MAX_REQUEST_BYTES, &pInput, &inputLength);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    PSECTOR_SEARCH_REQUEST pRequest = (PSECTOR_SEARCH_REQUEST)pInput;
+    PBYTE_PATTERN patterns = NULL;
+    SEARCH_CONTEXT ctx;
+    RANGE_STREAM stream;
+    ULONG maxPatternLength = 0;
+    ULONG cursor = sizeof(SECTOR_SEARCH_REQUEST);
+
+    if (pRequest->patternCount == 0 || pRequest->patternCount > SECTOR_SEARCH_MAX_PATTERNS) {
+        status = STATUS_INVALID_PARAMETER;
+        goto Done;
+    }
+
+    patterns = new (NON_PAGED) BYTE_PATTERN[pRequest->patternCount];
+    if (!patterns) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Done;
+    }
+
+    for (ULONG i = 0; i < pRequest->patternCount; i++) {
+        if (inputLength - cursor < sizeof(SECTOR_SEARCH_PATTERN)) {
+            status = STATUS_INVALID_PARAMETER;
+            goto Done;
+        }
+
+        PSECTOR_SEARCH_PATTERN pPattern = (PSECTOR_SEARCH_PATTERN)(pInput + cursor);
+        cursor += sizeof(SECTOR_SEARCH_PATTERN);
+
+        BOOLEAN masked = (pPattern->flags & SECTOR_SEARCH_PATTERN_MASKED) != 0;
+        if (pPattern->length == 0 || pPattern->length > PATTERN_MAX_LENGTH ||
+            (ULONGLONG)pPattern->length * (masked ? 2 : 1) > inputLength - cursor) {
+            LOG("  pattern %u is malformed (length=%u)\n", i, pPattern->length);
+            status = STATUS_INVALID_PARAMETER;
+            goto Done;
+        }
+
+        PUCHAR bytes = pInput + cursor;
+        PUCHAR mask = masked ? bytes + pPattern->length : NULL;
+        PatternPrepare(&patterns[i], bytes, mask, pPattern->length);
+        cursor += pPattern->length * (masked ? 2 : 1);
+        maxPatternLength = max(maxPatternLength, pPattern->length);
+    }
+
+    RtlZeroMemory(&ctx, sizeof(ctx));
+    ctx.patterns = patterns;
+    ctx.patternCount = pRequest->patternCount;
+    ctx.userMatches = (PSECTOR_SEARCH_MATCH)((PUCHAR)outBuffer + sizeof(SECTOR_SEARCH_RESULT));
+    ctx.capacity = (outLength - sizeof(SECTOR_SEARCH_RESULT)) / sizeof(SECTOR_SEARCH_MATCH);
+    ctx.writeStatus = STATUS_SUCCESS;
+
+    RtlZeroMemory(&stream, sizeof(stream));
+    stream.pStorageObject = pStorageObject;
+    stream.startSector = pRequest->location.sectorNumber;
+    stream.sectorCount = pRequest->sectorCount;
+    stream.carryBytes = maxPatternLength - 1;
+    stream.chunkRoutine = SearchChunkRoutine;
+    stream.context = &ctx;
+    stream.pOriginIrp = pIrp;
+
+    LOG("  searching %u patterns over sectors %llu+%llu\n", ctx.patternCount, stream.startSector, stream.sectorCount);
+    status = StreamStorageRange(&stream);
+    if (!NT_SUCCESS(status)) {
+        LOG("  StreamStorageRange failed: 0x%08X\n", status);
+        goto Done;
+    }
+
+    __try {
+        PSECTOR_SEARCH_RESULT pResult = (PSECTOR_SEARCH_RESULT)outBuffer;
+        pResult->matchCount = ctx.matchCount;
+        pResult->truncated = ctx.truncated;
+        pResult->bytesScanned = ctx.bytesScanned;
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        status = GetExceptionCode();
+        goto Done;
+    }
+    pIrp->IoStatus.Information = sizeof(SECTOR_SEARCH_RESULT) + (ULONG_PTR)ctx.matchCount * sizeof(SECTOR_SEARCH_MATCH);
+    LOG("  search done: %u matches, truncated=%u\n", ctx.matchCount, ctx.truncated);
+
+Done:
+    if (patterns) delete[] patterns;
+    delete[] pInput;
+    return status;
+}
+
+typedef struct _DIGEST_STATE {
+    ULONG crc32c;
+    XXH64_STATE xxh64;
+    SHA256_STATE sha256;
+} DIGEST_STATE, *PDIGEST_STATE;
+
+typedef struct _DIGEST_CONTEXT {
+    ULONG algorithms;
+    ULONG features;
+    DIGEST_STATE range;
+    ULONGLONG bytesHashed;
+
+    // Per-block digests, written straight into the output buffer as each block completes
+    ULONGLONG blockBytes;
+    DIGEST_STATE block;
+    ULONGLONG blockFilled;
+    ULONGLONG blockIndex;
+    PSECTOR_DIGEST_VALUE userBlocks;
+} DIGEST_CONTEXT, *PDIGEST_CONTEXT;
+
+static void DigestStateInit(IN PDIGEST_CONTEXT ctx, OUT PDIGEST_STATE state) {
+    state->crc32c = 0;
+    if (ctx->algorithms & SECTOR_DIGEST_XXH64)
+        Xxh64Init(&state->xxh64, 0);
+    if (ctx->algorithms & SECTOR_DIGEST_SHA256)
+        Sha256Init(&state->sha256);
+}
+
+static void DigestStateUpdate(IN PDIGEST_CONTEXT ctx, IN OUT PDIGEST_STATE state, IN PUCHAR data, IN ULONG length) {
+    if (ctx->algorithms & SECTOR_DIGEST_CRC32C)
+        state->crc32c = Crc32cUpdate(state->crc32c, data, length, ctx->features);
+    if (ctx->algorithms & SECTOR_DIGEST_XXH64)
+        Xxh64Update(&state->xxh64, data, length);
+    if (ctx->algorithms & SECTOR_DIGEST_SHA256)
+        Sha256Update(&state->sha256, data, length, ctx->features);
+}
+
+static void DigestStateFinal(IN PDIGEST_CONTEXT ctx, IN OUT PDIGEST_STATE state, OUT PSECTOR_DIGEST_VALUE pValue) {
+    RtlZeroMemory(pValue, sizeof(*pValue));
+    if (ctx->algorithms & SECTOR_DIGEST_CRC32C)
+        pValue->crc32c = state->crc32c;
+    if (ctx->algorithms & SECTOR_DIGEST_XXH64)
+        pValue->xxh64 = Xxh64Final(&state->xxh64);
+    if (ctx->algorithms & SECTOR_DIGEST_SHA256)
+        Sha256Final(&state->sha256, pValue->sha256, ctx->features);
+}
+
+static NTSTATUS DigestFinishBlock(IN PDIGEST_CONTEXT ctx) {
+    SECTOR_DIGEST_VALUE value;
+    DigestStateFinal(ctx, &ctx->block, &value);
+    __try {
+        RtlCopyMemory(&ctx->userBlocks[ctx->blockIndex], &value, sizeof(value));
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return GetExceptionCode();
+    }
+
+    ctx->blockIndex++;
+    ctx->blockFilled = 0;
+    DigestStateInit(ctx, &ctx->block);
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS DigestChunkRoutine(IN PVOID context, IN ULONGLONG byteOffset, IN PUCHAR data, IN ULONG length, IN ULONG carryLength) {
+    UNREFERENCED_PARAMETER(byteOffset);
+    UNREFERENCED_PARAMETER(carryLength);
+    PDIGEST_CONTEXT ctx = (PDIGEST_CONTEXT)context;
+
+    DigestStateUpdate(ctx, &ctx->range, data, length);
+    ctx->bytesHashed += length;
+
+    while (ctx->blockBytes && length) {
+        ULONG take = (ULONG)min((ULONGLONG)length, ctx->blockBytes - ctx->blockFilled);
+        DigestStateUpdate(ctx, &ctx->block, data, take);
+        ctx->blockFilled += take;
+        data += take;
+        length -= take;
+
+        if (ctx->blockFilled == ctx->blockBytes) {
+            NTSTATUS status = DigestFinishBlock(ctx);
+            if (!NT_SUCCESS(status))
+                return status;
+        }
+    }
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS DigestSectorsIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject) {
+    LOG("DigestSectorsIoctlHandler called\n");
+    if (!pStorageObject)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    SECTOR_DIGEST_REQUEST request;
+    PVOID userInput = pIrpStack->Parameters.DeviceIoControl.Type3InputBuffer;
+    if (!userInput || pIrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(request))
+        return STATUS_INFO_LENGTH_MISMATCH;
+
+    __try {
+        ProbeForRead(userInput, sizeof(request), 1);
+        RtlCopyMemory(&request, userInput, sizeof(request));
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return GetExceptionCode();
+    }
+
+    if ((request.algorithms & SECTOR_DIGEST_ALL) == 0 || (request.algorithms & ~SECTOR_DIGEST_ALL))
+        return STATUS_INVALID_PARAMETER;
+
+    NTSTATUS status = ValidateSectorRange(pStorageObject, request.location.sectorNumber, request.sectorCount);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    ULONGLONG blockCount = 0;
+    if (request.blockSectors)
+        blockCount = (request.sectorCount + request.blockSectors - 1) / request.blockSectors;
+
+    ULONG outLength = pIrpStack->Parameters.DeviceIoControl.OutputBufferLength;
+    PVOID outBuffer = pIrp->UserBuffer;
+    if (!outBuffer || outLength < sizeof(SECTOR_DIGEST_RESULT))
+        return STATUS_INFO_LENGTH_MISMATCH;
+    if (blockCount > (outLength - sizeof(SECTOR_DIGEST_RESULT)) / sizeof(SECTOR_DIGEST_VALUE))
+        return STATUS_BUFFER_TOO_SMALL;
+
+    __try {
+        ProbeForWrite(outBuffer, outLength, 1);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return GetExceptionCode();
+    }
+
+    // Kept off the small kernel stack, it carries two full sets of hash state.
+    PDIGEST_CONTEXT ctx = new (NON_PAGED) DIGEST_CONTEXT;
+    if (!ctx)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    RtlZeroMemory(ctx, sizeof(*ctx));
+    ctx->algorithms = request.algorithms;
+    // The CRC32 and SHA instructions only use XMM state, so no SIMD scope is needed around them.
+    ctx->features = SimdGetFeatures();
+    ctx->blockBytes = (ULONGLONG)request.blockSectors * pStorageObject->info.sectorSize;
+    ctx->userBlocks = (PSECTOR_DIGEST_VALUE)((PUCHAR)outBuffer + sizeof(SECTOR_DIGEST_RESULT));
+    DigestStateInit(ctx, &ctx->range);
+    DigestStateInit(ctx, &ctx->block);
+
+    RANGE_STREAM stream;
+    RtlZeroMemory(&stream, sizeof(stream));
+    stream.pStorageObject = pStorageObject;
+    stream.startSector = request.location.sectorNumber;
+    stream.sectorCount = request.sectorCount;
+    stream.chunkRoutine = DigestChunkRoutine;
+    stream.context = ctx;
+    stream.pOriginIrp = pIrp;
+
+    LOG("  hashing sectors %llu+%llu, algorithms 0x%X, %llu blocks\n", stream.startSector, stream.sectorCount, ctx->algorithms, blockCount);
+    status = StreamStorageRange(&stream);
+    if (NT_SUCCESS(status) && ctx->blockFilled)
+        status = DigestFinishBlock(ctx);
+    if (!NT_SUCCESS(status)) {
+        LOG("  digest failed: 0x%08X\n", status);
+        goto Done;
+    }
+
+    {
+        SECTOR_DIGEST_VALUE rangeValue;
+        DigestStateFinal(ctx, &ctx->range, &rangeValue);
+        __try {
+            PSECTOR_DIGEST_RESULT pResult = (PSECTOR_DIGEST_RESULT)outBuffer;
+            pResult->algorithms = ctx->algorithms;
+            pResult->bytesHashed = ctx->bytesHashed;
+            RtlCopyMemory(&pResult->range, &rangeValue, sizeof(rangeValue));
+            pResult->blockCount = ctx->blockIndex;
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER) {
+            status = GetExceptionCode();
+            goto Done;
+        }
+    }
+    pIrp->IoStatus.Information = sizeof(SECTOR_DIGEST_RESULT) + (ULONG_PTR)ctx->blockIndex * sizeof(SECTOR_DIGEST_VALUE);
+
+Done:
+    delete ctx;
+    return status;
+}
+
+typedef struct _ZERO_MAP_CONTEXT {
+    ULONG sectorSize;
+    ULONG blockBytes;
+    ULONG chunkBytes;
+    ULONGLONG startOffset;
+
+    // The skip routine for chunk n + 1 runs before the chunk routine of chunk n, so each keeps its own map.
+    PSTORAGE_OBJECT pStorageObject;
+    BOOLEAN queryAllocation;
+    BOOLEAN allocationQueried;
+    STORAGE_ALLOCATION_MAP allocation[2];
+
+    SECTOR_RUN run;             // still open, may grow with the next block
+    BOOLEAN runOpen;
+
+    PSECTOR_RUN userRuns;
+    ULONG capacity;
+    ULONG runCount;
+    BOOLEAN truncated;
+    ULONGLONG zeroSectors;
+    ULONGLONG unallocatedSectors;
+} ZERO_MAP_CONTEXT, *PZERO_MAP_CONTEXT;
+
+static PSTORAGE_ALLOCATION_MAP ZeroMapAllocationFor(IN PZERO_MAP_CONTEXT ctx, IN ULONGLONG byteOffset) {
+    return &ctx->allocation[((byteOffset - ctx->startOffset) / ctx->chunkBytes) & 1];
+}
+
+static NTSTATUS ZeroMapEmitRun(IN PZERO_MAP_CONTEXT ctx) {
+    if (ctx->runCount >= ctx->capacity) {
+        ctx->truncated = TRUE;
+        return STATUS_NO_MORE_ENTRIES;
+    }
+
+    __try {
+        RtlCopyMemory(&ctx->userRuns[ctx->runCount], &ctx->run, sizeof(ctx->run));
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return GetExceptionCode();
+    }
+
+    ctx->runCount++;
+    if (ctx->run.type == SECTOR_RUN_ZERO)
+        ctx->zeroSectors += ctx->run.sectorCount;
+    else if (ctx->run.type == SECTOR_RUN_UNALLOCATED)
+        ctx->unallocatedSectors += ctx->run.sectorCount;
+    ctx->runOpen = FALSE;
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS ZeroMapAppend(IN PZERO_MAP_CONTEXT ctx, IN ULONGLONG startSector, IN ULONGLONG sectorCount, IN ULONG type) {
+    if (ctx->runOpen && ctx->run.type == type) {
+        ctx->run.sectorCount += sectorCount;
+        return STATUS_SUCCESS;
+    }
+    if (ctx->runOpen) {
+        NTSTATUS status = ZeroMapEmitRun(ctx);
+        if (status != STATUS_SUCCESS)
+            return status;
+    }
+
+    ctx->run.startSector = startSector;
+    ctx->run.sectorCount = sectorCount;
+    ctx->run.type = type;
+    ctx->runOpen = TRUE;
+    return STATUS_SUCCESS;
+}
+
+static BOOLEAN ZeroMapSkipRoutine(IN PVOID context, IN ULONGLONG byteOffset, IN ULONG length) {
+    PZERO_MAP_CONTEXT ctx = (PZERO_MAP_CONTEXT)context;
+    if (!ctx->queryAllocation)
+        return FALSE;
+
+    PSTORAGE_ALLOCATION_MAP pMap = ZeroMapAllocationFor(ctx, byteOffset);
+    NTSTATUS status = StorageQueryAllocation(ctx->pStorageObject, byteOffset, length, pMap);
+    if (!NT_SUCCESS(status)) {
+        // Not thin provisioned, or the stack does not implement the action; fall back to reading everything.
+        LOG("  allocation query failed: 0x%08X, reading the whole range\n", status);
+        ctx->queryAllocation = FALSE;
+        return FALSE;
+    }
+
+    ctx->allocationQueried = TRUE;
+    return !StorageAllocationIsMapped(pMap, byteOffset, length);
+}
+
+static NTSTATUS ZeroMapChunkRoutine(IN PVOID context, IN ULONGLONG byteOffset, IN PUCHAR data, IN ULONG length, IN ULONG carryLength) {
+    UNREFERENCED_PARAMETER(carryLength);
+    PZERO_MAP_CONTEXT ctx = (PZERO_MAP_CONTEXT)context;
+    PSTORAGE_ALLOCATION_MAP pMap = ZeroMapAllocationFor(ctx, byteOffset);
+    NTSTATUS status = STATUS_SUCCESS;
+
+    SIMD_SCOPE scope;
+    SimdEnterScope(&scope);
+    for (ULONG position = 0; position < length; position += ctx->blockBytes) {
+        ULONG blockLength = min(ctx->blockBytes, length - position);
+        ULONG type;
+        if (!data || (ctx->allocationQueried && !StorageAllocationIsMapped(pMap, byteOffset + position, blockLength)))
+            type = SECTOR_RUN_UNALLOCATED;
+        else if (BlockIsZero(data + position, blockLength, scope.features))
+            type = SECTOR_RUN_ZERO;
+        else
+            type = SECTOR_RUN_DATA;
+
+        status = ZeroMapAppend(ctx, (byteOffset + position) / ctx->sectorSize, blockLength / ctx->sectorSize, type);
+        if (status != STATUS_SUCCESS)
+            break;
+    }
+    SimdLeaveScope(&scope);
+    return status;
+}
+
+NTSTATUS ZeroMapSectorsIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject) {
+    LOG("ZeroMapSectorsIoctlHandler called\n");
+    if (!pStorageObject)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    SECTOR_ZERO_MAP_REQUEST request;
+    PVOID userInput = pIrpStack->Parameters.DeviceIoControl.Type3InputBuffer;
+    if (!userInput || pIrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(request))
+        return STATUS_INFO_LENGTH_MISMATCH;
+
+    __try {
+        ProbeForRead(userInput, sizeof(request), 1);
+        RtlCopyMemory(&request, userInput, sizeof(request));
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return GetExceptionCode();
+    }
+
+    ULONG sectorSize = pStorageObject->info.sectorSize;
+    if (request.blockSectors == 0 || sectorSize == 0 ||
+        (ULONGLONG)request.blockSectors * sectorSize > SECTOR_ZERO_MAP_MAX_BLOCK_BYTES ||
+        (request.flags & ~SECTOR_ZERO_MAP_QUERY_ALLOCATION))
+        return STATUS_INVALID_PARAMETER;
+
+    ULONG outLength = pIrpStack->Parameters.DeviceIoControl.OutputBufferLength;
+    PVOID outBuffer = pIrp->UserBuffer;
+    if (!outBuffer || outLength < sizeof(SECTOR_ZERO_MAP_RESULT) + sizeof(SECTOR_RUN))
+        return STATUS_INFO_LENGTH_MISMATCH;
+
+    __try {
+        ProbeForWrite(outBuffer, outLength, 1);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return GetExceptionCode();
+    }
+
+    PZERO_MAP_CONTEXT ctx = new (NON_PAGED) ZERO_MAP_CONTEXT;
+    if (!ctx)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    RtlZeroMemory(ctx, sizeof(*ctx));
+    ctx->sectorSize = sectorSize;
+    ctx->blockBytes = request.blockSectors * sectorSize;
+    // Whole blocks per chunk, so no block ever straddles two reads.
+    ctx->chunkBytes = max(1UL, STORAGE_IO_DEFAULT_CHUNK_BYTES / ctx->blockBytes) * ctx->blockBytes;
+    ctx->startOffset = request.location.sectorNumber * sectorSize;
+    ctx->pStorageObject = pStorageObject;
+    ctx->userRuns = (PSECTOR_RUN)((PUCHAR)outBuffer + sizeof(SECTOR_ZERO_MAP_RESULT));
+    ctx->capacity = (outLength - sizeof(SECTOR_ZERO_MAP_RESULT)) / sizeof(SECTOR_RUN);
+
+    NTSTATUS status = STATUS_SUCCESS;
+    if (request.flags & SECTOR_ZERO_MAP_QUERY_ALLOCATION) {
+        for (int i = 0; i < 2 && NT_SUCCESS(status); i++)
+            status = StorageAllocationMapAllocate(&ctx->allocation[i]);
+        if (!NT_SUCCESS(status))
+            goto Done;
+        ctx->queryAllocation = TRUE;
+    }
+
+    {
+        RANGE_STREAM stream;
+        RtlZeroMemory(&stream, sizeof(stream));
+        stream.pStorageObject = pStorageObject;
+        stream.startSector = request.location.sectorNumber;
+        stream.sectorCount = request.sectorCount;
+        stream.chunkBytes = ctx->chunkBytes;
+        stream.chunkRoutine = ZeroMapChunkRoutine;
+        stream.skipRoutine = ZeroMapSkipRoutine;
+        stream.context = ctx;
+        stream.pOriginIrp = pIrp;
+
+        LOG("  mapping sectors %llu+%llu in blocks of %u sectors\n", stream.startSector, stream.sectorCount, request.blockSectors);
+        status = StreamStorageRange(&stream);
+        if (NT_SUCCESS(status) && ctx->runOpen && !ctx->truncated) {
+            status = ZeroMapEmitRun(ctx);
+            if (status == STATUS_NO_MORE_ENTRIES)
+                status = STATUS_SUCCESS;
+        }
+        if (!NT_SUCCESS(status)) {
+            LOG("  zero map failed: 0x%08X\n", status);
+            goto Done;
+        }
+    }
+
+    __try {
+        PSECTOR_ZERO_MAP_RESULT pResult = (PSECTOR_ZERO_MAP_RESULT)outBuffer;
+        pResult->runCount = ctx->runCount;
+        pResult->truncated = ctx->truncated;
+        pResult->allocationQueried = ctx->allocationQueried;
+        pResult->nextSector = ctx->truncated ? ctx->run.startSector : request.location.sectorNumber + request.sectorCount;
+        pResult->zeroSectors = ctx->zeroSectors;
+        pResult->unallocatedSectors = ctx->unallocatedSectors;
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        status = GetExceptionCode();
+        goto Done;
+    }
+    pIrp->IoStatus.Information = sizeof(SECTOR_ZERO_MAP_RESULT) + (ULONG_PTR)ctx->runCount * sizeof(SECTOR_RUN);
+    LOG("  zero map done: %u runs, truncated=%u\n", ctx->runCount, ctx->truncated);
+
+Done:
+    for (int i = 0; i < 2; i++)
+        StorageAllocationMapFree(&ctx->allocation[i]);
+    delete ctx;
+    return status;
+}
+
+typedef struct _ENTROPY_CONTEXT {
+    ULONG blockBytes;
+    ULONG recordBytes;          // per block in the output
+    PUCHAR userBlocks;
+    ULONGLONG blockIndex;
+    ULONGLONG bytesAnalysed;
+
+    BLOCK_HISTOGRAM block;
+    ULONG blockCounts[256];
+    ULONGLONG entropyCounts[256];
+    ULONGLONG rangeCounts[256];
+} ENTROPY_CONTEXT, *PENTROPY_CONTEXT;
+
+static NTSTATUS EntropyChunkRoutine(IN PVOID context, IN ULONGLONG byteOffset, IN PUCHAR data, IN ULONG length, IN ULONG carryLength) {
+    UNREFERENCED_PARAMETER(byteOffset);
+    UNREFERENCED_PARAMETER(carryLength);
+    PENTROPY_CONTEXT ctx = (PENTROPY_CONTEXT)context;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    // Counting is scalar and the merge only touches XMM state, so no SIMD scope is needed.
+    ULONG features = SimdGetFeatures();
+    for (ULONG position = 0; position < length; position += ctx->blockBytes) {
+        ULONG blockLength = min(ctx->blockBytes, length - position);
+        BlockHistogramClear(&ctx->block);
+        BlockHistogramAdd(&ctx->block, data + position, blockLength);
+        BlockHistogramMerge(&ctx->block, (unsigned int*)ctx->blockCounts, features);
+        for (int i = 0; i < 256; i++) {
+            ctx->entropyCounts[i] = ctx->blockCounts[i];
+            ctx->rangeCounts[i] += ctx->blockCounts[i];
+        }
+
+        ULONG entropy = HistogramEntropy(ctx->entropyCounts);
+        PUCHAR pRecord = ctx->userBlocks + ctx->blockIndex * ctx->recordBytes;
+        __try {
+            RtlCopyMemory(pRecord, &entropy, sizeof(entropy));
+            if (ctx->recordBytes > sizeof(entropy))
+                RtlCopyMemory(pRecord + sizeof(entropy), ctx->blockCounts, sizeof(ctx->blockCounts));
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER) {
+            status = GetExceptionCode();
+            break;
+        }
+        ctx->blockIndex++;
+        ctx->bytesAnalysed += blockLength;
+    }
+    return status;
+}
+
+NTSTATUS EntropySectorsIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject) {
+    LOG("EntropySectorsIoctlHandler called\n");
+    if (!pStorageObject)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    SECTOR_ENTROPY_REQUEST request;
+    PVOID userInput = pIrpStack->Parameters.DeviceIoControl.Type3InputBuffer;
+    if (!userInput || pIrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(request))
+        return STATUS_INFO_LENGTH_MISMATCH;
+
+    __try {
+        ProbeForRead(userInput, sizeof(request), 1);
+        RtlCopyMemory(&request, userInput, sizeof(request));
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return GetExceptionCode();
+    }
+
+    ULONG sectorSize = pStorageObject->info.sectorSize;
+    if (request.blockSectors == 0 || sectorSize == 0 ||
+        (ULONGLONG)request.blockSectors * sectorSize > SECTOR_ENTROPY_MAX_BLOCK_BYTES ||
+        (request.flags & ~SECTOR_ENTROPY_HISTOGRAMS))
+        return STATUS_INVALID_PARAMETER;
+
+    NTSTATUS status = ValidateSectorRange(pStorageObject, request.location.sectorNumber, request.sectorCount);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    ULONG recordBytes = (request.flags & SECTOR_ENTROPY_HISTOGRAMS) ? sizeof(SECTOR_ENTROPY_BLOCK) : sizeof(ULONG);
+    ULONGLONG blockCount = (request.sectorCount + request.blockSectors - 1) / request.blockSectors;
+
+    ULONG outLength = pIrpStack->Parameters.DeviceIoControl.OutputBufferLength;
+    PVOID outBuffer = pIrp->UserBuffer;
+    if (!outBuffer || outLength < sizeof(SECTOR_ENTROPY_RESULT))
+        return STATUS_INFO_LENGTH_MISMATCH;
+    if (blockCount > (outLength - sizeof(SECTOR_ENTROPY_RESULT)) / recordBytes)
+        return STATUS_BUFFER_TOO_SMALL;
+
+    __try {
+        ProbeForWrite(outBuffer, outLength, 1);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return GetExceptionCode();
+    }
+
+    // Kept off the small kernel stack, the histograms alone take several kilobytes.
+    PENTROPY_CONTEXT ctx = new (NON_PAGED) ENTROPY_CONTEXT;
+    if (!ctx)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    RtlZeroMemory(ctx, sizeof(*ctx));
+    ctx->blockBytes = request.blockSectors * sectorSize;
+    ctx->recordBytes = recordBytes;
+    ctx->userBlocks = (PUCHAR)outBuffer + sizeof(SECTOR_ENTROPY_RESULT);
+
+    RANGE_STREAM stream;
+    RtlZeroMemory(&stream, sizeof(stream));
+    stream.pStorageObject = pStorageObject;
+    stream.startSector = request.location.sectorNumber;
+    stream.sectorCount = request.sectorCount;
+    // Whole blocks per chunk, so no block ever straddles two reads.
+    stream.chunkBytes = max(1UL, STORAGE_IO_DEFAULT_CHUNK_BYTES / ctx->blockBytes) * ctx->blockBytes;
+    stream.chunkRoutine = EntropyChunkRoutine;
+    stream.context = ctx;
+    stream.pOriginIrp = pIrp;
+
+    LOG("  analysing sectors %llu+%llu in blocks of %u sectors\n", stream.startSector, stream.sectorCount, request.blockSectors);
+    status = StreamStorageRange(&stream);
+    if (!NT_SUCCESS(status)) {
+        LOG("  entropy analysis failed: 0x%08X\n", status);
+        goto Done;
+    }
+
+    __try {
+        PSECTOR_ENTROPY_RESULT pResult = (PSECTOR_ENTROPY_RESULT)outBuffer;
+        pResult->flags = request.flags;
+        pResult->rangeEntropy = HistogramEntropy(ctx->rangeCounts);
+        pResult->bytesAnalysed = ctx->bytesAnalysed;
+        RtlCopyMemory(pResult->histogram, ctx->rangeCounts, sizeof(ctx->rangeCounts));
+        pResult->blockCount = ctx->blockIndex;
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        status = GetExceptionCode();
+        goto Done;
+    }
+    pIrp->IoStatus.Information = sizeof(SECTOR_ENTROPY_RESULT) + (ULONG_PTR)ctx->blockIndex * recordBytes;
+
+Done:
+    delete ctx;
+    return status;
+}
@@ -0,0 +1,131 @@
+#pragma once
+#include "StorageIo.hpp"
+
+#pragma pack (push, 1)
+
+#define SECTOR_SEARCH_MAX_PATTERNS          64
+#define SECTOR_SEARCH_MAX_REQUEST_BYTES     (64 * 1024)
+
+#define SECTOR_SEARCH_PATTERN_MASKED        0x00000001
+
+typedef struct _SECTOR_SEARCH_PATTERN {
+    ULONG length;
+    ULONG flags;
+    // UCHAR bytes[length], then UCHAR mask[length] if SECTOR_SEARCH_PATTERN_MASKED is set.
+    // A mask bit of 0 makes the corresponding pattern bit a wildcard.
+} SECTOR_SEARCH_PATTERN, *PSECTOR_SEARCH_PATTERN;
+
+typedef struct _SECTOR_SEARCH_REQUEST {
+    STORAGE_LOCATION location;  // location.sectorNumber is the first sector searched
+    ULONGLONG sectorCount;
+    ULONG patternCount;
+    // SECTOR_SEARCH_PATTERN patterns[patternCount], each immediately followed by its bytes
+} SECTOR_SEARCH_REQUEST, *PSECTOR_SEARCH_REQUEST;
+
+typedef struct _SECTOR_SEARCH_MATCH {
+    ULONGLONG byteOffset;       // relative to the start of the storage object
+    ULONG patternIndex;
+} SECTOR_SEARCH_MATCH, *PSECTOR_SEARCH_MATCH;
+
+typedef struct _SECTOR_SEARCH_RESULT {
+    ULONG matchCount;
+    BOOLEAN truncated;          // the output buffer filled up before the end of the range
+    ULONGLONG bytesScanned;
+    // SECTOR_SEARCH_MATCH matches[matchCount]
+} SECTOR_SEARCH_RESULT, *PSECTOR_SEARCH_RESULT;
+
+#define SECTOR_DIGEST_CRC32C                0x00000001
+#define SECTOR_DIGEST_XXH64                 0x00000002
+#define SECTOR_DIGEST_SHA256                0x00000004
+#define SECTOR_DIGEST_ALL                   (SECTOR_DIGEST_CRC32C | SECTOR_DIGEST_XXH64 | SECTOR_DIGEST_SHA256)
+
+typedef struct _SECTOR_DIGEST_REQUEST {
+    STORAGE_LOCATION location;  // location.sectorNumber is the first sector hashed
+    ULONGLONG sectorCount;
+    ULONG algorithms;           // SECTOR_DIGEST_*
+    ULONG blockSectors;         // nonzero adds a digest per block of this many sectors; the last block may be short
+} SECTOR_DIGEST_REQUEST, *PSECTOR_DIGEST_REQUEST;
+
+// Fields of algorithms that were not requested are left zero. xxh64 uses seed 0.
+typedef struct _SECTOR_DIGEST_VALUE {
+    ULONG crc32c;
+    ULONGLONG xxh64;
+    UCHAR sha256[32];
+} SECTOR_DIGEST_VALUE, *PSECTOR_DIGEST_VALUE;
+
+typedef struct _SECTOR_DIGEST_RESULT {
+    ULONG algorithms;
+    ULONGLONG bytesHashed;
+    SECTOR_DIGEST_VALUE range;  // over the whole range
+    ULONGLONG blockCount;
+    // SECTOR_DIGEST_VALUE blocks[blockCount]; the output buffer has to be large enough for all of them
+} SECTOR_DIGEST_RESULT, *PSECTOR_DIGEST_RESULT;
+
+#define SECTOR_ZERO_MAP_MAX_BLOCK_BYTES     (8 * 1024 * 1024)
+
+#define SECTOR_ZERO_MAP_QUERY_ALLOCATION    0x00000001
+
+#define SECTOR_RUN_DATA                     0
+#define SECTOR_RUN_ZERO                     1
+#define SECTOR_RUN_UNALLOCATED              2   // thin-provisioned and unmapped; reads as zeros
+#define SECTOR_RUN_UNTRIED                  3   // rescue: not read yet
+#define SECTOR_RUN_FAILED                   4   // rescue: inside a failed read, not narrowed down yet
+#define SECTOR_RUN_BAD                      5   // rescue and bad sector map: unreadable on its own
+
+typedef struct _SECTOR_ZERO_MAP_REQUEST {
+    STORAGE_LOCATION location;  // location.sectorNumber is the first sector classified
+    ULONGLONG sectorCount;
+    ULONG blockSectors;         // classification granularity; the last block may be short
+    ULONG flags;                // SECTOR_ZERO_MAP_*
+} SECTOR_ZERO_MAP_REQUEST, *PSECTOR_ZERO_MAP_REQUEST;
+
+typedef struct _SECTOR_RUN {
+    ULONGLONG startSector;
+    ULONGLONG sectorCount;
+    ULONG type;                 // SECTOR_RUN_*
+} SECTOR_RUN, *PSECTOR_RUN;
+
+typedef struct _SECTOR_ZERO_MAP_RESULT {
+    ULONG runCount;
+    BOOLEAN truncated;          // the output buffer filled up; call again starting at nextSector
+    BOOLEAN allocationQueried;  // the device answered the allocation query
+    ULONGLONG nextSector;       // first sector not described by the runs
+    ULONGLONG zeroSectors;
+    ULONGLONG unallocatedSectors;
+    // SECTOR_RUN runs[runCount], adjacent runs always differ in type
+} SECTOR_ZERO_MAP_RESULT, *PSECTOR_ZERO_MAP_RESULT;
+
+#define SECTOR_ENTROPY_MAX_BLOCK_BYTES      (8 * 1024 * 1024)
+
+#define SECTOR_ENTROPY_HISTOGRAMS           0x00000001  // follow each block's entropy with its byte histogram
+
+// Entropies are Shannon entropies in bits per byte as 16.16 fixed point, from 0 for a single repeated byte value to
+// 8 << 16 for uniformly distributed bytes. Encrypted and compressed data sit close to the top.
+typedef struct _SECTOR_ENTROPY_REQUEST {
+    STORAGE_LOCATION location;  // location.sectorNumber is the first sector analysed
+    ULONGLONG sectorCount;
+    ULONG blockSectors;         // analysis granularity; the last block may be short
+    ULONG flags;                // SECTOR_ENTROPY_*
+} SECTOR_ENTROPY_REQUEST, *PSECTOR_ENTROPY_REQUEST;
+
+typedef struct _SECTOR_ENTROPY_BLOCK {
+    ULONG entropy;
+    ULONG histogram[256];
+} SECTOR_ENTROPY_BLOCK, *PSECTOR_ENTROPY_BLOCK;
+
+typedef struct _SECTOR_ENTROPY_RESULT {
+    ULONG flags;
+    ULONG rangeEntropy;         // over the whole range
+    ULONGLONG bytesAnalysed;
+    ULONGLONG histogram[256];   // over the whole range
+    ULONGLONG blockCount;
+    // ULONG entropy[blockCount], or SECTOR_ENTROPY_BLOCK blocks[blockCount] with SECTOR_ENTROPY_HISTOGRAMS; the
+    // output buffer has to be large enough for all of them
+} SECTOR_ENTROPY_RESULT, *PSECTOR_ENTROPY_RESULT;
+
+#pragma pack (pop)
+
+NTSTATUS SearchSectorsIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject);
+NTSTATUS DigestSectorsIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject);
+NTSTATUS ZeroMapSectorsIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject);
+NTSTATUS EntropySectorsIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject);
@@ -0,0 +1,96 @@
+#include "RequestControl.hpp"
+
+#define REQUEST_CONTROL_SLOT    0   // Tail.Overlay.DriverContext index
+
+// Runs with the cancel spin lock held. RequestControlEnd synchronizes on that lock, so the control block cannot go
+// away before the routine has released it.
+static VOID RequestCancelRoutine(IN PDEVICE_OBJECT pDeviceObject, IN PIRP pIrp) {
+    UNREFERENCED_PARAMETER(pDeviceObject);
+    PREQUEST_CONTROL pControl = (PREQUEST_CONTROL)pIrp->Tail.Overlay.DriverContext[REQUEST_CONTROL_SLOT];
+    InterlockedExchange(&pControl->cancelled, 1);
+    KeSetEvent(&pControl->abort, IO_NO_INCREMENT, FALSE);
+    IoReleaseCancelSpinLock(pIrp->CancelIrql);
+}
+
+void RequestControlBegin(OUT PREQUEST_CONTROL pControl, IN PIRP pIrp) {
+    KeInitializeEvent(&pControl->abort, NotificationEvent, FALSE);
+    pControl->deadline = 0;
+    pControl->cancelled = 0;
+    pControl->timedOut = 0;
+
+    pIrp->Tail.Overlay.DriverContext[REQUEST_CONTROL_SLOT] = pControl;
+    IoSetCancelRoutine(pIrp, RequestCancelRoutine);
+    // Cancelled before the routine was in place, so IoCancelIrp had nothing to call.
+    if (pIrp->Cancel && IoSetCancelRoutine(pIrp, NULL)) {
+        pControl->cancelled = 1;
+        KeSetEvent(&pControl->abort, IO_NO_INCREMENT, FALSE);
+    }
+}
+
+void RequestControlEnd(IN PREQUEST_CONTROL pControl, IN PIRP pIrp) {
+    UNREFERENCED_PARAMETER(pControl);
+    if (!IoSetCancelRoutine(pIrp, NULL)) {
+        // The cancel routine has been called and may still be running; it holds the cancel spin lock until it is done.
+        KIRQL irql;
+        IoAcquireCancelSpinLock(&irql);
+        IoReleaseCancelSpinLock(irql);
+    }
+    pIrp->Tail.Overlay.DriverContext[REQUEST_CONTROL_SLOT] = NULL;
+}
+
+PREQUEST_CONTROL GetRequestControl(IN PIRP pIrp OPTIONAL) {
+    return pIrp ? (PREQUEST_CONTROL)pIrp->Tail.Overlay.DriverContext[REQUEST_CONTROL_SLOT] : NULL;
+}
+
+void RequestSetDeadline(IN PIRP pIrp, IN ULONG timeoutMs) {
+    PREQUEST_CONTROL pControl = GetRequestControl(pIrp);
+    if (pControl && timeoutMs)
+        pControl->deadline = KeQueryInterruptTime() + (ULONGLONG)timeoutMs * 10000;
+}
+
+NTSTATUS RequestAbortStatus(IN PIRP pIrp OPTIONAL) {
+    if (!pIrp)
+        return STATUS_SUCCESS;
+    PREQUEST_CONTROL pControl = GetRequestControl(pIrp);
+    if (!pControl)
+        return pIrp->Cancel ? STATUS_CANCELLED : STATUS_SUCCESS;
+
+    if (pControl->timedOut)
+        return STATUS_IO_TIMEOUT;
+    if (pControl->cancelled || pIrp->Cancel)
+        return STATUS_CANCELLED;
+    if (pControl->deadline && KeQueryInterruptTime() >= pControl->deadline) {
+        // Wake everyone else waiting on behalf of this request as well.
+        InterlockedExchange(&pControl->timedOut, 1);
+        KeSetEvent(&pControl->abort, IO_NO_INCREMENT, FALSE);
+        return STATUS_IO_TIMEOUT;
+    }
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS RequestWait(IN PIRP pIrp OPTIONAL, IN PVOID pObject) {
+    PREQUEST_CONTROL pControl = GetRequestControl(pIrp);
+    if (!pControl) {
+        KeWaitForSingleObject(pObject, Executive, KernelMode, FALSE, NULL);
+        return STATUS_SUCCESS;
+    }
+
+    // The object comes first so that it wins when both are signalled.
+    PVOID objects[2] = { pObject, &pControl->abort };
+    for (;;) {
+        LARGE_INTEGER timeout;
+        PLARGE_INTEGER pTimeout = NULL;
+        if (pControl->deadline) {
+            ULONGLONG now = KeQueryInterruptTime();
+            timeout.QuadPart = now < pControl->deadline ? -(LONGLONG)(pControl->deadline - now) : 0;
+            pTimeout = &timeout;
+        }
+
+        NTSTATUS status = KeWaitForMultipleObjects(2, objects, WaitAny, Executive, KernelMode, FALSE, pTimeout, NULL);
+        if (status == STATUS_WAIT_0)
+            return STATUS_SUCCESS;
+        status = RequestAbortStatus(pIrp);
+        if (!NT_SUCCESS(status))
+            return status;
+    }
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include "Driver.hpp"
+
+// Cancellation and deadline state of one user request while DriverIoDeviceDispatchRoutine processes it. Requests run
+// synchronously in the issuing thread, so the block lives on that thread's stack; code further down reaches it through
+// the origin IRP and uses it to tear down the lower transfers started on the request's behalf.
+typedef struct _REQUEST_CONTROL {
+    KEVENT abort;               // set once the request is cancelled or its deadline has passed
+    ULONGLONG deadline;         // interrupt time, 0 for none
+    volatile LONG cancelled;
+    volatile LONG timedOut;
+} REQUEST_CONTROL, *PREQUEST_CONTROL;
+
+// Attaches the control block to the IRP and installs a cancel routine that signals it.
+void RequestControlBegin(OUT PREQUEST_CONTROL pControl, IN PIRP pIrp);
+// Removes the cancel routine and detaches the block; once this returns nothing refers to it anymore. Must be called
+// before the IRP is completed.
+void RequestControlEnd(IN PREQUEST_CONTROL pControl, IN PIRP pIrp);
+
+PREQUEST_CONTROL GetRequestControl(IN PIRP pIrp OPTIONAL);
+// Fails the request with STATUS_IO_TIMEOUT once timeoutMs have passed from now. 0 leaves it without a deadline.
+void RequestSetDeadline(IN PIRP pIrp, IN ULONG timeoutMs);
+// STATUS_SUCCESS while the request may go on; STATUS_CANCELLED or STATUS_IO_TIMEOUT once it has to stop.
+NTSTATUS RequestAbortStatus(IN PIRP pIrp OPTIONAL);
+// Waits for a dispatcher object. Returns STATUS_SUCCESS when it is signalled, or the abort status if the request is
+// cancelled or runs out of time first. Without a request it waits indefinitely.
+NTSTATUS RequestWait(IN PIRP pIrp OPTIONAL, IN PVOID pObject);
@@ -0,0 +1,452 @@
+#include "Rescue.hpp"
+
+#define BAD_SECTORS_MAX_REGIONS     1024
+
+typedef struct _BAD_SECTOR_MAP {
+    KSPIN_LOCK lock;
+    ULONG sectorSize;
+    RESCUE_MAP map;             // RESCUE_BAD for known bad sectors, RESCUE_UNTRIED for everything else
+    RESCUE_REGION regions[BAD_SECTORS_MAX_REGIONS];
+} BAD_SECTOR_MAP, *PBAD_SECTOR_MAP;
+
+typedef struct _RESCUE_ENGINE {
+    PSTORAGE_OBJECT pSource;
+    ULONG sectorSize;
+
+    // Exactly one destination; its offset is the source offset plus destinationDelta.
+    PSTORAGE_OBJECT pDestination;
+    HANDLE fileHandle;
+    LONGLONG destinationDelta;
+
+    PUCHAR pBuffer;
+    PMDL pMdl;
+    PSECTOR_JOB pJob;
+    NTSTATUS status;            // why the read routine stopped the rescue
+
+    RESCUE_MAP map;             // in source sectors
+    PRESCUE_REGION pRegions;
+} RESCUE_ENGINE, *PRESCUE_ENGINE;
+
+BOOLEAN IsMediaErrorStatus(IN NTSTATUS status) {
+    return status == STATUS_DEVICE_DATA_ERROR || status == STATUS_CRC_ERROR ||
+        status == STATUS_NONEXISTENT_SECTOR || status == STATUS_IO_DEVICE_ERROR;
+}
+
+static PBAD_SECTOR_MAP BadSectorsGet(IN PSTORAGE_OBJECT pStorageObject) {
+    PBAD_SECTOR_MAP pMap = (PBAD_SECTOR_MAP)pStorageObject->pBadSectors;
+    if (pMap)
+        return pMap;
+
+    ULONG sectorSize = pStorageObject->info.sectorSize;
+    if (sectorSize == 0)
+        return NULL;
+    pMap = new (NON_PAGED) BAD_SECTOR_MAP;
+    if (!pMap)
+        return NULL;
+    KeInitializeSpinLock(&pMap->lock);
+    pMap->sectorSize = sectorSize;
+    RescueMapInit(&pMap->map, pMap->regions, BAD_SECTORS_MAX_REGIONS, 0, GetStorageObjectLength(pStorageObject) / sectorSize, RESCUE_UNTRIED);
+
+    PVOID pExisting = InterlockedCompareExchangePointer((PVOID*)&pStorageObject->pBadSectors, pMap, NULL);
+    if (pExisting) {
+        delete pMap;
+        return (PBAD_SECTOR_MAP)pExisting;
+    }
+    return pMap;
+}
+
+NTSTATUS BadSectorsCheckRead(IN PSTORAGE_OBJECT pStorageObject, IN ULONGLONG byteOffset, IN ULONG length) {
+    PBAD_SECTOR_MAP pMap = (PBAD_SECTOR_MAP)pStorageObject->pBadSectors;
+    if (!pMap || length == 0)
+        return STATUS_SUCCESS;
+
+    ULONGLONG endSector = (byteOffset + length + pMap->sectorSize - 1) / pMap->sectorSize;
+    ULONGLONG runStart, runEnd;
+    KIRQL oldIrql;
+    KeAcquireSpinLock(&pMap->lock, &oldIrql);
+    BOOLEAN bad = RescueMapFind(&pMap->map, byteOffset / pMap->sectorSize, RESCUE_BAD, &runStart, &runEnd) && runStart < endSector;
+    KeReleaseSpinLock(&pMap->lock, oldIrql);
+    return bad ? STATUS_DEVICE_DATA_ERROR : STATUS_SUCCESS;
+}
+
+void BadSectorsTransferDone(IN PSTORAGE_OBJECT pStorageObject, IN BOOLEAN isWrite, IN ULONGLONG byteOffset, IN ULONG length, IN NTSTATUS status) {
+    PBAD_SECTOR_MAP pMap = (PBAD_SECTOR_MAP)pStorageObject->pBadSectors;
+    unsigned int state;
+    if (NT_SUCCESS(status)) {
+        // Drives usually reallocate a bad sector when it is written.
+        if (!pMap)
+            return;
+        state = RESCUE_UNTRIED;
+    }
+    else if (!isWrite && length == pStorageObject->info.sectorSize && IsMediaErrorStatus(status)) {
+        // Only a read of the sector alone says which sector is bad.
+        pMap = BadSectorsGet(pStorageObject);
+        if (!pMap)
+            return;
+        state = RESCUE_BAD;
+    }
+    else {
+        return;
+    }
+
+    ULONGLONG startSector = byteOffset / pMap->sectorSize;
+    ULONGLONG endSector = (byteOffset + length + pMap->sectorSize - 1) / pMap->sectorSize;
+    KIRQL oldIrql;
+    KeAcquireSpinLock(&pMap->lock, &oldIrql);
+    int full = RescueMapSet(&pMap->map, startSector, endSector, state);
+    KeReleaseSpinLock(&pMap->lock, oldIrql);
+    if (full)
+        LOG("  bad sector map full, sector %llu not %s\n", startSector, state == RESCUE_BAD ? "recorded" : "cleared");
+}
+
+void BadSectorsFree(IN PSTORAGE_OBJECT pStorageObject) {
+    if (pStorageObject->pBadSectors) {
+        delete (PBAD_SECTOR_MAP)pStorageObject->pBadSectors;
+        pStorageObject->pBadSectors = NULL;
+    }
+}
+
+static const ULONG g_rescueRunTypes[] = { SECTOR_RUN_UNTRIED, SECTOR_RUN_FAILED, SECTOR_RUN_BAD, SECTOR_RUN_DATA };
+
+static BOOLEAN RescueStateFromRunType(IN ULONG type, OUT PULONG pState) {
+    for (ULONG state = 0; state < ARRAYSIZE(g_rescueRunTypes); state++) {
+        if (g_rescueRunTypes[state] == type) {
+            *pState = state;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// Sectors the storage object already knows to be bad are not worth a read.
+static int RescueSeedBadSectors(IN PSTORAGE_OBJECT pStorageObject, IN OUT PRESCUE_MAP pRescueMap) {
+    PBAD_SECTOR_MAP pMap = (PBAD_SECTOR_MAP)pStorageObject->pBadSectors;
+    if (!pMap)
+        return 0;
+
+    int full = 0;
+    ULONGLONG runStart, runEnd;
+    KIRQL oldIrql;
+    KeAcquireSpinLock(&pMap->lock, &oldIrql);
+    for (ULONGLONG position = pRescueMap->start;
+         !full && RescueMapFind(&pMap->map, position, RESCUE_BAD, &runStart, &runEnd) && runStart < pRescueMap->end;
+         position = runEnd)
+        full = RescueMapSet(pRescueMap, runStart, runEnd, RESCUE_BAD);
+    KeReleaseSpinLock(&pMap->lock, oldIrql);
+    return full;
+}
+
+static NTSTATUS RescueStore(IN PRESCUE_ENGINE pEngine, IN ULONGLONG byteOffset, IN ULONG length) {
+    if (pEngine->fileHandle)
+        return WriteCopyDestinationFile(pEngine->fileHandle, (LONGLONG)byteOffset + pEngine->destinationDelta, pEngine->pBuffer, length);
+
+    STORAGE_IO io;
+    ULONG_PTR transferred = 0;
+    StorageIoInitialize(&io, pEngine->pDestination, TRUE, pEngine->pMdl, byteOffset + pEngine->destinationDelta, length, pEngine->pJob->pIrp);
+    NTSTATUS status = StorageIoTransfer(&io, &transferred);
+    if (NT_SUCCESS(status) && transferred < length)
+        status = STATUS_DEVICE_DATA_ERROR;
+    if (!NT_SUCCESS(status))
+        LOG("  rescue write at %llu failed: 0x%08X\n", io.byteOffset, status);
+    return status;
+}
+
+// Media errors are what the rescue works around; anything else, including a failing destination, stops it.
+static int RescueReadRoutine(void* context, unsigned long long start, unsigned long long count) {
+    PRESCUE_ENGINE pEngine = (PRESCUE_ENGINE)context;
+    if (JobShouldStop(pEngine->pJob)) {
+        pEngine->status = STATUS_CANCELLED;
+        return RESCUE_READ_ABORT;
+    }
+
+    ULONGLONG byteOffset = start * pEngine->sectorSize;
+    ULONG length = (ULONG)(count * pEngine->sectorSize);
+    STORAGE_IO io;
+    ULONG_PTR transferred = 0;
+    StorageIoInitialize(&io, pEngine->pSource, FALSE, pEngine->pMdl, byteOffset, length, pEngine->pJob->pIrp);
+    NTSTATUS status = StorageIoTransfer(&io, &transferred);
+    if (NT_SUCCESS(status) && transferred < length)
+        status = STATUS_DEVICE_DATA_ERROR;
+    if (!NT_SUCCESS(status)) {
+        if (IsMediaErrorStatus(status))
+            return RESCUE_READ_ERROR;
+        LOG("  rescue read at %llu failed: 0x%08X\n", byteOffset, status);
+        pEngine->status = status;
+        return RESCUE_READ_ABORT;
+    }
+
+    status = RescueStore(pEngine, byteOffset, length);
+    if (!NT_SUCCESS(status)) {
+        pEngine->status = status;
+        return RESCUE_READ_ABORT;
+    }
+    JobAddProgress(pEngine->pJob, length);
+    return RESCUE_READ_OK;
+}
+
+NTSTATUS RescueSectorsIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject) {
+    LOG("RescueSectorsIoctlHandler called\n");
+    if (!pStorageObject)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    PUCHAR pInput = NULL;
+    ULONG inputLength = 0;
+    NTSTATUS status = CaptureIoctlInput(pIrpStack, sizeof(SECTOR_RESCUE_REQUEST), sizeof(SECTOR_RESCUE_REQUEST) + SECTOR_RESCUE_MAX_RUNS * sizeof(SECTOR_RUN), &pInput, &inputLength);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    PSECTOR_RESCUE_REQUEST pRequest = (PSECTOR_RESCUE_REQUEST)pInput;
+    PSECTOR_RUN pImportedRuns = (PSECTOR_RUN)(pInput + sizeof(SECTOR_RESCUE_REQUEST));
+    ULONG outLength = pIrpStack->Parameters.DeviceIoControl.OutputBufferLength;
+    PUCHAR outBuffer = (PUCHAR)pIrp->UserBuffer;
+    ULONG sectorSize = pStorageObject->info.sectorSize;
+    PRESCUE_ENGINE pEngine = NULL;
+    SECTOR_JOB job;
+    BOOLEAN jobStarted = FALSE;
+    ULONGLONG chunkBytes = 0, maxSkipBytes = 0, startSector = 0, endSector = 0;
+    ULONG capacity = 0;
+
+    if (pRequest->runCount > (inputLength - sizeof(SECTOR_RESCUE_REQUEST)) / sizeof(SECTOR_RUN)) {
+        status = STATUS_INFO_LENGTH_MISMATCH;
+        goto Done;
+    }
+    // The exported map is what makes a rescue resumable, so there has to be room for it.
+    if (!outBuffer || outLength < sizeof(SECTOR_RESCUE_RESULT) + sizeof(SECTOR_RUN)) {
+        status = STATUS_BUFFER_TOO_SMALL;
+        goto Done;
+    }
+
+    status = ValidateSectorRange(pStorageObject, pRequest->location.sectorNumber, pRequest->sectorCount);
+    if (!NT_SUCCESS(status))
+        goto Done;
+
+    chunkBytes = pRequest->chunkSectors ? (ULONGLONG)pRequest->chunkSectors * sectorSize : SECTOR_RESCUE_DEFAULT_CHUNK_BYTES;
+    maxSkipBytes = pRequest->maxSkipSectors ? (ULONGLONG)pRequest->maxSkipSectors * sectorSize : SECTOR_RESCUE_DEFAULT_MAX_SKIP_BYTES;
+    if (chunkBytes > SECTOR_BULK_MAX_CHUNK_BYTES || chunkBytes % sectorSize || maxSkipBytes % sectorSize ||
+        (pRequest->flags & ~SECTOR_RESCUE_NO_SCRAPE)) {
+        status = STATUS_INVALID_PARAMETER;
+        goto Done;
+    }
+
+    pEngine = new (NON_PAGED) RESCUE_ENGINE;
+    if (!pEngine) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Done;
+    }
+    RtlZeroMemory(pEngine, sizeof(*pEngine));
+    pEngine->pSource = pStorageObject;
+    pEngine->sectorSize = sectorSize;
+
+    // The map may only grow as far as the caller can take it back.
+    capacity = (ULONG)min((outLength - sizeof(SECTOR_RESCUE_RESULT)) / sizeof(SECTOR_RUN), (ULONG)SECTOR_RESCUE_MAX_RUNS);
+    pEngine->pRegions = new (NON_PAGED) RESCUE_REGION[capacity];
+    if (!pEngine->pRegions) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Done;
+    }
+    startSector = pRequest->location.sectorNumber;
+    endSector = startSector + pRequest->sectorCount;
+    RescueMapInit(&pEngine->map, pEngine->pRegions, capacity, startSector, endSector, RESCUE_UNTRIED);
+
+    if (RescueSeedBadSectors(pStorageObject, &pEngine->map)) {
+        status = STATUS_BUFFER_TOO_SMALL;
+        goto Done;
+    }
+    for (ULONG i = 0; i < pRequest->runCount; i++) {
+        ULONG state;
+        PSECTOR_RUN pRun = &pImportedRuns[i];
+        if (!RescueStateFromRunType(pRun->type, &state) || pRun->startSector < startSector || pRun->startSector > endSector ||
+            pRun->sectorCount > endSector - pRun->startSector) {
+            status = STATUS_INVALID_PARAMETER;
+            goto Done;
+        }
+        if (RescueMapSet(&pEngine->map, pRun->startSector, pRun->startSector + pRun->sectorCount, state)) {
+            status = STATUS_BUFFER_TOO_SMALL;
+            goto Done;
+        }
+    }
+
+    status = OpenCopyDestination(pStorageObject, startSector * sectorSize, pRequest->sectorCount * sectorSize, (ULONG)chunkBytes,
+        pRequest->destinationType, &pRequest->destination, pRequest->fileHandle, pRequest->fileOffset,
+        &pEngine->pDestination, &pEngine->fileHandle, &pEngine->destinationDelta);
+    if (!NT_SUCCESS(status))
+        goto Done;
+
+    status = StorageIoAllocateBuffer((ULONG)chunkBytes, &pEngine->pBuffer, &pEngine->pMdl);
+    if (!NT_SUCCESS(status))
+        goto Done;
+
+    status = JobStart(&job, pRequest->jobId, SECTOR_JOB_RESCUE, (pRequest->sectorCount - RescueMapTotal(&pEngine->map, RESCUE_DONE)) * sectorSize, pIrp);
+    if (!NT_SUCCESS(status))
+        goto Done;
+    jobStarted = TRUE;
+    pEngine->pJob = &job;
+
+    {
+        RESCUE_PLAN plan;
+        RtlZeroMemory(&plan, sizeof(plan));
+        plan.map = &pEngine->map;
+        plan.chunkSectors = (unsigned int)(chunkBytes / sectorSize);
+        plan.maxSkipSectors = maxSkipBytes / sectorSize;
+        plan.flags = pRequest->flags & SECTOR_RESCUE_NO_SCRAPE ? RESCUE_NO_SCRAPE : 0;
+        plan.read = RescueReadRoutine;
+        plan.context = pEngine;
+
+        LOG("  rescuing %llu sectors from %llu, %u sector reads, %u runs imported\n", pRequest->sectorCount, startSector, plan.chunkSectors, pRequest->runCount);
+        int outcome = RescueRun(&plan);
+        if (outcome == RESCUE_ABORTED)
+            status = pEngine->status;
+        else if (outcome == RESCUE_MAP_FULL)
+            status = STATUS_BUFFER_OVERFLOW;
+        LOG("  rescue finished: 0x%08X, %llu reads, %llu errors, %u runs\n", status, plan.reads, plan.readErrors, pEngine->map.count);
+
+        SECTOR_RESCUE_RESULT result;
+        result.rescuedSectors = RescueMapTotal(&pEngine->map, RESCUE_DONE);
+        result.badSectors = RescueMapTotal(&pEngine->map, RESCUE_BAD);
+        result.failedSectors = RescueMapTotal(&pEngine->map, RESCUE_FAILED);
+        result.untriedSectors = RescueMapTotal(&pEngine->map, RESCUE_UNTRIED);
+        result.reads = plan.reads;
+        result.readErrors = plan.readErrors;
+        result.elapsed100ns = JobElapsed100ns(&job);
+        result.runCount = pEngine->map.count;
+
+        ULONG resultLength = sizeof(result) + result.runCount * sizeof(SECTOR_RUN);
+        __try {
+            ProbeForWrite(outBuffer, resultLength, 1);
+            RtlCopyMemory(outBuffer, &result, sizeof(result));
+            PSECTOR_RUN pRuns = (PSECTOR_RUN)(outBuffer + sizeof(result));
+            for (ULONG i = 0; i < result.runCount; i++) {
+                pRuns[i].startSector = pEngine->map.regions[i].start;
+                pRuns[i].sectorCount = pEngine->map.regions[i].end - pEngine->map.regions[i].start;
+                pRuns[i].type = g_rescueRunTypes[pEngine->map.regions[i].state];
+            }
+            pIrp->IoStatus.Information = resultLength;
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER) {
+            if (NT_SUCCESS(status))
+                status = GetExceptionCode();
+        }
+    }
+
+Done:
+    if (jobStarted) JobFinish(&job);
+    if (pEngine) {
+        if (pEngine->fileHandle) ZwClose(pEngine->fileHandle);
+        StorageIoFreeBuffer(pEngine->pBuffer, pEngine->pMdl);
+        delete[] pEngine->pRegions;
+        delete pEngine;
+    }
+    delete[] pInput;
+    return status;
+}
+
+NTSTATUS BadSectorsIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject) {
+    LOG("BadSectorsIoctlHandler called\n");
+    if (!pStorageObject)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    PUCHAR pInput = NULL;
+    ULONG inputLength = 0;
+    NTSTATUS status = CaptureIoctlInput(pIrpStack, sizeof(SECTOR_BAD_SECTORS_REQUEST), sizeof(SECTOR_BAD_SECTORS_REQUEST) + BAD_SECTORS_MAX_REGIONS * sizeof(SECTOR_RUN), &pInput, &inputLength);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    PSECTOR_BAD_SECTORS_REQUEST pRequest = (PSECTOR_BAD_SECTORS_REQUEST)pInput;
+    PSECTOR_RUN pAddedRuns = (PSECTOR_RUN)(pInput + sizeof(SECTOR_BAD_SECTORS_REQUEST));
+    ULONG outLength = pIrpStack->Parameters.DeviceIoControl.OutputBufferLength;
+    PUCHAR outBuffer = (PUCHAR)pIrp->UserBuffer;
+    PBAD_SECTOR_MAP pMap = NULL;
+    PSECTOR_RUN pSnapshot = NULL;
+    SECTOR_BAD_SECTORS_RESULT result = {0};
+    KIRQL oldIrql;
+
+    if (pRequest->runCount > (inputLength - sizeof(SECTOR_BAD_SECTORS_REQUEST)) / sizeof(SECTOR_RUN) ||
+        (outBuffer && outLength < sizeof(SECTOR_BAD_SECTORS_RESULT))) {
+        status = STATUS_INFO_LENGTH_MISMATCH;
+        goto Done;
+    }
+    if (pRequest->flags & ~SECTOR_BAD_SECTORS_CLEAR) {
+        status = STATUS_INVALID_PARAMETER;
+        goto Done;
+    }
+    for (ULONG i = 0; i < pRequest->runCount; i++) {
+        status = ValidateSectorRange(pStorageObject, pAddedRuns[i].startSector, pAddedRuns[i].sectorCount);
+        if (!NT_SUCCESS(status) || pAddedRuns[i].type != SECTOR_RUN_BAD) {
+            status = STATUS_INVALID_PARAMETER;
+            goto Done;
+        }
+    }
+
+    pMap = pRequest->runCount ? BadSectorsGet(pStorageObject) : (PBAD_SECTOR_MAP)pStorageObject->pBadSectors;
+    if (!pMap) {
+        if (pRequest->runCount)
+            status = STATUS_INSUFFICIENT_RESOURCES;
+        else if (outBuffer) {
+            // Nothing has ever failed on this object.
+            __try {
+                ProbeForWrite(outBuffer, sizeof(result), 1);
+                RtlCopyMemory(outBuffer, &result, sizeof(result));
+                pIrp->IoStatus.Information = sizeof(result);
+            }
+            __except (EXCEPTION_EXECUTE_HANDLER) {
+                status = GetExceptionCode();
+            }
+        }
+        goto Done;
+    }
+
+    // The user buffer may page-fault, so the runs are gathered under the lock and copied out after it.
+    if (outBuffer) {
+        pSnapshot = new (NON_PAGED) SECTOR_RUN[BAD_SECTORS_MAX_REGIONS];
+        if (!pSnapshot) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Done;
+        }
+    }
+
+    KeAcquireSpinLock(&pMap->lock, &oldIrql);
+    if (pRequest->flags & SECTOR_BAD_SECTORS_CLEAR)
+        RescueMapInit(&pMap->map, pMap->regions, BAD_SECTORS_MAX_REGIONS, pMap->map.start, pMap->map.end, RESCUE_UNTRIED);
+    for (ULONG i = 0; i < pRequest->runCount && NT_SUCCESS(status); i++) {
+        if (RescueMapSet(&pMap->map, pAddedRuns[i].startSector, pAddedRuns[i].startSector + pAddedRuns[i].sectorCount, RESCUE_BAD))
+            status = STATUS_INSUFFICIENT_RESOURCES;
+    }
+    for (ULONG i = 0; i < pMap->map.count; i++) {
+        PRESCUE_REGION pRegion = &pMap->map.regions[i];
+        if (pRegion->state != RESCUE_BAD)
+            continue;
+        if (pSnapshot) {
+            pSnapshot[result.runCount].startSector = pRegion->start;
+            pSnapshot[result.runCount].sectorCount = pRegion->end - pRegion->start;
+            pSnapshot[result.runCount].type = SECTOR_RUN_BAD;
+        }
+        result.badSectors += pRegion->end - pRegion->start;
+        result.runCount++;
+    }
+    KeReleaseSpinLock(&pMap->lock, oldIrql);
+    if (!NT_SUCCESS(status)) {
+        LOG("  bad sector map full\n");
+        goto Done;
+    }
+
+    if (outBuffer) {
+        BOOLEAN fits = outLength - sizeof(result) >= result.runCount * sizeof(SECTOR_RUN);
+        ULONG runsLength = fits ? result.runCount * sizeof(SECTOR_RUN) : 0;
+        __try {
+            ProbeForWrite(outBuffer, sizeof(result) + runsLength, 1);
+            RtlCopyMemory(outBuffer, &result, sizeof(result));
+            RtlCopyMemory(outBuffer + sizeof(result), pSnapshot, runsLength);
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER) {
+            status = GetExceptionCode();
+            goto Done;
+        }
+        pIrp->IoStatus.Information = sizeof(result) + runsLength;
+        status = fits ? STATUS_SUCCESS : STATUS_BUFFER_OVERFLOW;
+    }
+
+Done:
+    delete[] pSnapshot;
+    delete[] pInput;
+    return status;
+}
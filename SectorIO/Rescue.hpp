@@ -0,0 +1,78 @@
+#pragma once
+#include "BulkIoctlHandlers.hpp"
+#include "RescueMap.hpp"
+
+#pragma pack (push, 1)
+
+#define SECTOR_RESCUE_DEFAULT_CHUNK_BYTES       (64 * 1024)
+#define SECTOR_RESCUE_DEFAULT_MAX_SKIP_BYTES    (64 * 1024 * 1024)
+#define SECTOR_RESCUE_MAX_RUNS                  (64 * 1024)
+
+// Stop after the copy and sweep passes; failed reads are left as SECTOR_RUN_FAILED for a later call to narrow down.
+#define SECTOR_RESCUE_NO_SCRAPE                 0x00000001
+
+// Images a failing range the way ddrescue does: good areas first, damaged ones last, and nothing read twice. Only
+// sectors that were read successfully are written to the destination; the rest of it is left untouched.
+typedef struct _SECTOR_RESCUE_REQUEST {
+    STORAGE_LOCATION location;      // source; location.sectorNumber is the first sector rescued
+    ULONGLONG sectorCount;          // in source sectors
+    ULONGLONG jobId;                // nonzero makes the rescue visible to IOCTL_JOB_QUERY / IOCTL_JOB_CANCEL
+    ULONG destinationType;          // SECTOR_COPY_TO_*
+    STORAGE_LOCATION destination;   // SECTOR_COPY_TO_STORAGE: destination.sectorNumber is the first sector written
+    ULONGLONG fileHandle;           // SECTOR_COPY_TO_FILE: handle opened with write access by the caller
+    ULONGLONG fileOffset;           // SECTOR_COPY_TO_FILE: byte offset of the first sector in the file
+    ULONG chunkSectors;             // reads of the first passes; 0 selects SECTOR_RESCUE_DEFAULT_CHUNK_BYTES
+    ULONG maxSkipSectors;           // 0 selects SECTOR_RESCUE_DEFAULT_MAX_SKIP_BYTES
+    ULONG flags;                    // SECTOR_RESCUE_*
+    ULONG runCount;
+    // SECTOR_RUN runs[runCount], the map a previous call returned, to resume it. Sectors it does not cover are untried.
+} SECTOR_RESCUE_REQUEST, *PSECTOR_RESCUE_REQUEST;
+
+// Also filled in when the rescue fails, runs out of map space or is cancelled, so it can always be resumed.
+typedef struct _SECTOR_RESCUE_RESULT {
+    ULONGLONG rescuedSectors;       // including the ones an imported map already had
+    ULONGLONG badSectors;
+    ULONGLONG failedSectors;
+    ULONGLONG untriedSectors;
+    ULONGLONG reads;
+    ULONGLONG readErrors;
+    ULONGLONG elapsed100ns;
+    ULONG runCount;
+    // SECTOR_RUN runs[runCount] in source sectors covering the whole request: SECTOR_RUN_DATA for rescued sectors,
+    // SECTOR_RUN_UNTRIED, SECTOR_RUN_FAILED or SECTOR_RUN_BAD for the rest. The output buffer bounds the number of
+    // runs the map may grow to; when it fills up the rescue stops with STATUS_BUFFER_OVERFLOW.
+} SECTOR_RESCUE_RESULT, *PSECTOR_RESCUE_RESULT;
+
+#define SECTOR_BAD_SECTORS_CLEAR                0x00000001
+
+// Every storage object remembers the sectors that failed single-sector reads. Reads that ask for it with
+// SECTOR_IO_FAIL_KNOWN_BAD fail at once on them instead of making a dying disk retry them again, and rescues start
+// from the map; other reads still go to the disk. A successful write or read of a sector forgets it.
+typedef struct _SECTOR_BAD_SECTORS_REQUEST {
+    STORAGE_LOCATION location;
+    ULONG flags;                    // SECTOR_BAD_SECTORS_CLEAR is applied before the runs are added
+    ULONG runCount;
+    // SECTOR_RUN runs[runCount] of type SECTOR_RUN_BAD, in sectors of the storage object, to add to the map
+} SECTOR_BAD_SECTORS_REQUEST, *PSECTOR_BAD_SECTORS_REQUEST;
+
+typedef struct _SECTOR_BAD_SECTORS_RESULT {
+    ULONGLONG badSectors;
+    ULONG runCount;
+    // SECTOR_RUN runs[runCount] of type SECTOR_RUN_BAD after the request was applied. If they do not fit, only
+    // runCount is filled in and the call returns STATUS_BUFFER_OVERFLOW.
+} SECTOR_BAD_SECTORS_RESULT, *PSECTOR_BAD_SECTORS_RESULT;
+
+#pragma pack (pop)
+
+// Read errors that point at the medium rather than at the request or the path to the device.
+BOOLEAN IsMediaErrorStatus(IN NTSTATUS status);
+
+// STATUS_DEVICE_DATA_ERROR if a read of the range would touch a sector known to be bad. Only asked for reads that
+// opted in with SECTOR_IO_FAIL_KNOWN_BAD, since a single transient failure is enough to put a sector in the map.
+NTSTATUS BadSectorsCheckRead(IN PSTORAGE_OBJECT pStorageObject, IN ULONGLONG byteOffset, IN ULONG length);
+// Learns from a finished lower transfer: a failed single-sector read marks its sector, any success clears the range.
+void BadSectorsTransferDone(IN PSTORAGE_OBJECT pStorageObject, IN BOOLEAN isWrite, IN ULONGLONG byteOffset, IN ULONG length, IN NTSTATUS status);
+void BadSectorsFree(IN PSTORAGE_OBJECT pStorageObject);
+
+NTSTATUS RescueSectorsIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject);
+NTSTATUS BadSectorsIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject);
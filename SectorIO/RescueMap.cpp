@@ -0,0 +1,248 @@
+#include "RescueMap.hpp"
+#include <string.h>
+
+// Regions bisected at once: every level leaves at most one sibling behind, and a range has at most 64 levels.
+#define RESCUE_SCRAPE_STACK     66
+
+void RescueMapInit(PRESCUE_MAP map, PRESCUE_REGION regions, unsigned int capacity, unsigned long long start, unsigned long long end, unsigned int state) {
+    map->regions = regions;
+    map->capacity = capacity;
+    map->start = start;
+    map->end = end;
+    map->count = start < end ? 1 : 0;
+    regions[0].start = start;
+    regions[0].end = end;
+    regions[0].state = state;
+}
+
+// Index of the region containing position, which has to lie inside the map.
+static unsigned int RescueMapLocate(const RESCUE_MAP* map, unsigned long long position) {
+    unsigned int low = 0, high = map->count - 1;
+    while (low < high) {
+        unsigned int middle = low + (high - low + 1) / 2;
+        if (map->regions[middle].start <= position)
+            low = middle;
+        else
+            high = middle - 1;
+    }
+    return low;
+}
+
+int RescueMapSet(PRESCUE_MAP map, unsigned long long start, unsigned long long end, unsigned int state) {
+    if (start < map->start) start = map->start;
+    if (end > map->end) end = map->end;
+    if (start >= end)
+        return 0;
+
+    PRESCUE_REGION regions = map->regions;
+    unsigned int low = RescueMapLocate(map, start);
+    unsigned int high = RescueMapLocate(map, end - 1) + 1;
+
+    // What replaces regions [low, high): the uncovered head of the first, the new run, the uncovered tail of the last
+    RESCUE_REGION pieces[3];
+    unsigned int pieceCount = 0;
+    if (regions[low].start < start) {
+        pieces[pieceCount].start = regions[low].start;
+        pieces[pieceCount].end = start;
+        pieces[pieceCount].state = regions[low].state;
+        pieceCount++;
+    }
+    if (pieceCount && pieces[pieceCount - 1].state == state) {
+        pieces[pieceCount - 1].end = end;
+    }
+    else {
+        pieces[pieceCount].start = start;
+        pieces[pieceCount].end = end;
+        pieces[pieceCount].state = state;
+        pieceCount++;
+    }
+    if (regions[high - 1].end > end) {
+        if (pieces[pieceCount - 1].state == regions[high - 1].state) {
+            pieces[pieceCount - 1].end = regions[high - 1].end;
+        }
+        else {
+            pieces[pieceCount].start = end;
+            pieces[pieceCount].end = regions[high - 1].end;
+            pieces[pieceCount].state = regions[high - 1].state;
+            pieceCount++;
+        }
+    }
+
+    if (low > 0 && regions[low - 1].state == pieces[0].state) {
+        pieces[0].start = regions[low - 1].start;
+        low--;
+    }
+    if (high < map->count && regions[high].state == pieces[pieceCount - 1].state) {
+        pieces[pieceCount - 1].end = regions[high].end;
+        high++;
+    }
+
+    unsigned int count = map->count - (high - low) + pieceCount;
+    if (count > map->capacity)
+        return -1;
+    memmove(regions + low + pieceCount, regions + high, (map->count - high) * sizeof(RESCUE_REGION));
+    memcpy(regions + low, pieces, pieceCount * sizeof(RESCUE_REGION));
+    map->count = count;
+    return 0;
+}
+
+int RescueMapFind(const RESCUE_MAP* map, unsigned long long from, unsigned int state, unsigned long long* runStart, unsigned long long* runEnd) {
+    if (from < map->start) from = map->start;
+    if (from >= map->end)
+        return 0;
+
+    for (unsigned int i = RescueMapLocate(map, from); i < map->count; i++) {
+        if (map->regions[i].state != state)
+            continue;
+        *runStart = map->regions[i].start > from ? map->regions[i].start : from;
+        *runEnd = map->regions[i].end;
+        return 1;
+    }
+    return 0;
+}
+
+// Last run in the state that starts before to, clipped to end at to.
+static int RescueMapFindLast(const RESCUE_MAP* map, unsigned long long to, unsigned int state, unsigned long long* runStart, unsigned long long* runEnd) {
+    if (to > map->end) to = map->end;
+    if (to <= map->start)
+        return 0;
+
+    for (unsigned int i = RescueMapLocate(map, to - 1) + 1; i-- > 0;) {
+        if (map->regions[i].state != state)
+            continue;
+        *runStart = map->regions[i].start;
+        *runEnd = map->regions[i].end < to ? map->regions[i].end : to;
+        return 1;
+    }
+    return 0;
+}
+
+unsigned long long RescueMapTotal(const RESCUE_MAP* map, unsigned int state) {
+    unsigned long long total = 0;
+    for (unsigned int i = 0; i < map->count; i++) {
+        if (map->regions[i].state == state)
+            total += map->regions[i].end - map->regions[i].start;
+    }
+    return total;
+}
+
+// Reads one range and records the outcome; a single sector that fails is bad rather than merely failed.
+static int RescueTry(PRESCUE_PLAN plan, unsigned long long start, unsigned long long end, int* failed) {
+    plan->reads++;
+    int result = plan->read(plan->context, start, end - start);
+    if (result == RESCUE_READ_ABORT)
+        return RESCUE_ABORTED;
+
+    *failed = result != RESCUE_READ_OK;
+    unsigned int state = RESCUE_DONE;
+    if (*failed) {
+        plan->readErrors++;
+        state = end - start == 1 ? RESCUE_BAD : RESCUE_FAILED;
+    }
+    return RescueMapSet(plan->map, start, end, state) ? RESCUE_MAP_FULL : RESCUE_OK;
+}
+
+static int RescueCopyPass(PRESCUE_PLAN plan) {
+    unsigned long long position = plan->map->start;
+    unsigned long long skip = 0;
+    unsigned long long runStart, runEnd;
+
+    while (RescueMapFind(plan->map, position, RESCUE_UNTRIED, &runStart, &runEnd)) {
+        unsigned long long end = runEnd - runStart > plan->chunkSectors ? runStart + plan->chunkSectors : runEnd;
+        int failed = 0;
+        int result = RescueTry(plan, runStart, end, &failed);
+        if (result != RESCUE_OK)
+            return result;
+
+        position = end;
+        if (!failed) {
+            skip = 0;
+            continue;
+        }
+        skip = skip ? skip * 2 : plan->chunkSectors;
+        if (skip > plan->maxSkipSectors)
+            skip = plan->maxSkipSectors;
+        position = end + skip;
+    }
+    return RESCUE_OK;
+}
+
+// Runs backwards, so the good sectors the last skip jumped over in front of a damaged zone are read before the sweep
+// works its way into the zone itself.
+static int RescueSweepPass(PRESCUE_PLAN plan) {
+    unsigned long long position = plan->map->end;
+    unsigned long long runStart, runEnd;
+
+    while (RescueMapFindLast(plan->map, position, RESCUE_UNTRIED, &runStart, &runEnd)) {
+        unsigned long long start = runEnd - runStart > plan->chunkSectors ? runEnd - plan->chunkSectors : runStart;
+        int failed = 0;
+        int result = RescueTry(plan, start, runEnd, &failed);
+        if (result != RESCUE_OK)
+            return result;
+        position = start;
+    }
+    return RESCUE_OK;
+}
+
+static int RescueScrapePass(PRESCUE_PLAN plan) {
+    unsigned long long position = plan->map->start;
+    unsigned long long runStart, runEnd;
+
+    while (RescueMapFind(plan->map, position, RESCUE_FAILED, &runStart, &runEnd)) {
+        position = runEnd;
+        int failed = 0;
+        if (runEnd - runStart == 1) {
+            int result = RescueTry(plan, runStart, runEnd, &failed);
+            if (result != RESCUE_OK)
+                return result;
+            continue;
+        }
+
+        // Every range on the stack is known to fail as a whole. When its left half reads fine the error has to be in the
+        // right half, which then needs no read of its own before it is split further.
+        RESCUE_REGION stack[RESCUE_SCRAPE_STACK];
+        unsigned int depth = 0;
+        stack[depth].start = runStart;
+        stack[depth].end = runEnd;
+        depth++;
+        while (depth) {
+            depth--;
+            unsigned long long start = stack[depth].start;
+            unsigned long long end = stack[depth].end;
+            unsigned long long middle = start + (end - start) / 2;
+
+            int result = RescueTry(plan, start, middle, &failed);
+            if (result != RESCUE_OK)
+                return result;
+            int leftFailed = failed;
+            failed = 1;
+            if (leftFailed || end - middle == 1) {
+                result = RescueTry(plan, middle, end, &failed);
+                if (result != RESCUE_OK)
+                    return result;
+            }
+
+            // Right first, so the left half is bisected next and the pass keeps moving forward.
+            if (failed && end - middle > 1) {
+                stack[depth].start = middle;
+                stack[depth].end = end;
+                depth++;
+            }
+            if (leftFailed && middle - start > 1) {
+                stack[depth].start = start;
+                stack[depth].end = middle;
+                depth++;
+            }
+        }
+    }
+    return RESCUE_OK;
+}
+
+int RescueRun(PRESCUE_PLAN plan) {
+    int result = RescueCopyPass(plan);
+    if (result == RESCUE_OK)
+        result = RescueSweepPass(plan);
+    if (result == RESCUE_OK && !(plan->flags & RESCUE_NO_SCRAPE))
+        result = RescueScrapePass(plan);
+    return result;
+}
@@ -0,0 +1,64 @@
+#pragma once
+// Sector state map and pass planner for IOCTL_SECTOR_RESCUE, modelled on ddrescue. Kept free of WDK dependencies so
+// it builds and runs against fault-injecting devices on the host. Region storage is provided by the caller; the map
+// never allocates.
+
+#define RESCUE_UNTRIED          0
+#define RESCUE_FAILED           1   // a read covering it failed; not yet narrowed down to single sectors
+#define RESCUE_BAD              2   // a single-sector read failed
+#define RESCUE_DONE             3   // read and stored
+
+#define RESCUE_OK               0
+#define RESCUE_ABORTED          1   // the read routine asked to stop
+#define RESCUE_MAP_FULL         2   // a state change needed more regions than the map has; the map is still consistent
+
+#define RESCUE_READ_OK          0
+#define RESCUE_READ_ERROR       1
+#define RESCUE_READ_ABORT       2
+
+#define RESCUE_NO_SCRAPE        0x00000001  // skip the bisection pass; failed regions stay RESCUE_FAILED
+
+typedef struct _RESCUE_REGION {
+    unsigned long long start;
+    unsigned long long end;             // exclusive
+    unsigned int state;                 // RESCUE_*
+} RESCUE_REGION, *PRESCUE_REGION;
+
+// Sorted regions covering [start, end) without gaps; neighbours always differ in state.
+typedef struct _RESCUE_MAP {
+    PRESCUE_REGION regions;
+    unsigned int count;
+    unsigned int capacity;
+    unsigned long long start;
+    unsigned long long end;
+} RESCUE_MAP, *PRESCUE_MAP;
+
+// capacity has to be at least 1. The whole range starts out in the given state.
+void RescueMapInit(PRESCUE_MAP map, PRESCUE_REGION regions, unsigned int capacity, unsigned long long start, unsigned long long end, unsigned int state);
+// Clipped to the map. Returns 0, or -1 without changing anything if the result would not fit.
+int RescueMapSet(PRESCUE_MAP map, unsigned long long start, unsigned long long end, unsigned int state);
+// First run in the state that ends after from, clipped to begin at from. Returns 0 if there is none.
+int RescueMapFind(const RESCUE_MAP* map, unsigned long long from, unsigned int state, unsigned long long* runStart, unsigned long long* runEnd);
+unsigned long long RescueMapTotal(const RESCUE_MAP* map, unsigned int state);
+
+// Reads sectors [start, start + count) and stores them wherever the rescue goes. A short read is an error.
+typedef int (*RESCUE_READ_ROUTINE)(void* context, unsigned long long start, unsigned long long count);
+
+typedef struct _RESCUE_PLAN {
+    PRESCUE_MAP map;
+    unsigned int chunkSectors;          // transfer size of the first two passes
+    unsigned long long maxSkipSectors;  // the skip after consecutive errors doubles from chunkSectors up to this
+    unsigned int flags;                 // RESCUE_NO_SCRAPE
+    RESCUE_READ_ROUTINE read;
+    void* context;
+
+    unsigned long long reads;
+    unsigned long long readErrors;
+} RESCUE_PLAN, *PRESCUE_PLAN;
+
+// Works only on what the map still has to do, so an interrupted rescue resumes from its exported map:
+//  1. copy: chunks in ascending order; after an error the chunk becomes RESCUE_FAILED and the next reads skip ahead
+//     exponentially, leaving the area in between untried, so a damaged zone costs a few reads instead of thousands;
+//  2. sweep: whatever the first pass skipped, chunk by chunk from the end backwards without skipping;
+//  3. scrape: every failed region is bisected until each sector is RESCUE_DONE or RESCUE_BAD.
+int RescueRun(PRESCUE_PLAN plan);
@@ -1,29 +1,124 @@
 ﻿#include "Sector.hpp"
+#include "Qos.hpp"
+#include "Elevator.hpp"
+#include "Coalesce.hpp"
+#include "PartitionMap.hpp"
+#include "Rescue.hpp"
+#include "Topology.hpp"
+#include "VolumeInfo.hpp"
+#include "FlushGroup.hpp"
+#include "ChangeTracking.hpp"
 
 vector<PSTORAGE_OBJECT>* g_pStorageObjects = nullptr;
 
+const GUID* const g_storageInterfaceClasses[STORAGE_INTERFACE_CLASS_COUNT] = {
+	&GUID_DEVINTERFACE_DISK,
+	&GUID_DEVINTERFACE_PARTITION,
+	&GUID_DEVINTERFACE_VOLUME,
+	&GUID_DEVINTERFACE_CDROM
+};
+
+static ULONG g_refreshCount = 0;    // guarded by the topology refresh lock
+
+// Identity index over the GPT ids of raw disks and partitions. Objects are only ever pushed onto a bucket, by the
+// refresh holding the topology lock, and stay allocated until unload, so lookups walk the chains without a lock.
+static PID_INDEX_NODE g_idBuckets[ID_INDEX_BUCKETS];
+
+static const GUID* StorageObjectId(IN PSTORAGE_OBJECT pStorageObject) {
+    return pStorageObject->info.isRawDiskObject ? &pStorageObject->info.gptDiskId : &pStorageObject->info.gptPartitionIdGuid;
+}
+
+static void IndexStorageObject(IN PSTORAGE_OBJECT pStorageObject) {
+    const unsigned char* pId = (const unsigned char*)StorageObjectId(pStorageObject);
+    if (IdIndexIsNull(pId))
+        return;
+    ULONG bucket = IdIndexBucket(pId);
+    IdIndexPrepare(&pStorageObject->idNode, pId, pStorageObject->info.isRawDiskObject ? 1 : 0, g_idBuckets[bucket]);
+    InterlockedExchangePointer((PVOID*)&g_idBuckets[bucket], &pStorageObject->idNode);
+}
+
+NTSTATUS FindStorageObjectById(IN const GUID* pId, IN BOOLEAN isRawDiskObject, OUT PSTORAGE_OBJECT* ppStorageObject) {
+    *ppStorageObject = nullptr;
+    const unsigned char* pKey = (const unsigned char*)pId;
+    if (IdIndexIsNull(pKey))
+        return STATUS_INVALID_PARAMETER;
+
+    unsigned int kind = isRawDiskObject ? 1 : 0;
+    PSTORAGE_OBJECT pFound = nullptr;
+    PID_INDEX_NODE pNode = (PID_INDEX_NODE)ReadPointerAcquire((PVOID*)&g_idBuckets[IdIndexBucket(pKey)]);
+    for (pNode = IdIndexMatch(pNode, pKey, kind); pNode; pNode = IdIndexMatch(pNode->next, pKey, kind)) {
+        PSTORAGE_OBJECT pObject = CONTAINING_RECORD(pNode, STORAGE_OBJECT, idNode);
+        if (pObject->removedGeneration)
+            continue;
+        if (pFound)
+            return STATUS_OBJECT_NAME_COLLISION;
+        pFound = pObject;
+    }
+    if (!pFound)
+        return STATUS_DEVICE_NOT_CONNECTED;
+    *ppStorageObject = pFound;
+    return STATUS_SUCCESS;
+}
+
+// Reading the layout of the disk itself only serves the identity index, so media without a partition table are fine.
+static void ReadRawDiskId(IN PSTORAGE_OBJECT pStorageObject) {
+    ULONG layoutBufferSize = sizeof(DRIVE_LAYOUT_INFORMATION_EX) + 128 * sizeof(PARTITION_INFORMATION_EX);
+    PDRIVE_LAYOUT_INFORMATION_EX pLayout = (PDRIVE_LAYOUT_INFORMATION_EX)new (PAGED_POOL) char[layoutBufferSize];
+    if (!pLayout)
+        return;
+    RtlZeroMemory(pLayout, layoutBufferSize);
+    NTSTATUS status = IoDeviceControl(pStorageObject->pStorageDeviceObject, IOCTL_DISK_GET_DRIVE_LAYOUT_EX, NULL, 0, pLayout, layoutBufferSize, NULL);
+    if (NT_SUCCESS(status) && pLayout->PartitionStyle == PARTITION_STYLE_GPT)
+        pStorageObject->info.gptDiskId = pLayout->Gpt.DiskId;
+    delete[] (char*)pLayout;
+}
+
 void FreeCollectedStorageObjects() {
-    if (!g_pStorageObjects) return;
-    for (auto pDiskObject : g_pStorageObjects->locked()) {
+    vector<PSTORAGE_OBJECT>* pStorageObjects = g_pStorageObjects;
+    if (!pStorageObjects) return;
+    g_pStorageObjects = nullptr;
+
+    // Tearing an object down waits for threads, run-downs and notification callbacks, which needs PASSIVE_LEVEL, so
+    // each one is taken off the list first instead of being freed while the list spin lock is held.
+    PSTORAGE_OBJECT pDiskObject;
+    while (pStorageObjects->pop_back(&pDiskObject)) {
         if (!pDiskObject) continue;
         if (pDiskObject->pStorageDeviceObject) ObDereferenceObject(pDiskObject->pStorageDeviceObject);
+        QosFreeStorageLimiter(pDiskObject);
+        ElevatorFree(pDiskObject);
+        CoalesceFree(pDiskObject);
+        PartitionCacheFree(pDiskObject);
+        BadSectorsFree(pDiskObject);
+        VolumeCacheFree(pDiskObject);
+        FlushGroupFree(pDiskObject);
+        ChangeTrackingFree(pDiskObject);
         delete pDiskObject;
     }
 
-    delete g_pStorageObjects;
-    g_pStorageObjects = nullptr;
+    delete pStorageObjects;
+    RtlZeroMemory(g_idBuckets, sizeof(g_idBuckets));
 }
 
-static BOOLEAN IsDeviceObjectInList(IN PDEVICE_OBJECT inpDeviceObject) {
-	if (!g_pStorageObjects) return FALSE;
+// A device that went away and came back gets a new object, so only present ones count.
+static PSTORAGE_OBJECT FindListedDeviceObject(IN PDEVICE_OBJECT inpDeviceObject) {
+	if (!g_pStorageObjects) return nullptr;
 	for (auto pDiskObject : g_pStorageObjects->locked()) {
-		if (pDiskObject && pDiskObject->pStorageDeviceObject == inpDeviceObject)
-			return TRUE;
+		if (pDiskObject && !pDiskObject->removedGeneration && pDiskObject->pStorageDeviceObject == inpDeviceObject)
+			return pDiskObject;
 	}
-	return FALSE;
+	return nullptr;
 }
 
-static NTSTATUS AddStorageObject(IN PDEVICE_OBJECT pdo) {
+// An interface whose device cannot be opened right now, such as a volume someone holds exclusively, still exists; the
+// objects found through it before are counted as seen so they are not reported as gone.
+static void MarkLinkSeen(IN ULONG linkHash, IN ULONG refresh) {
+	for (auto pDiskObject : g_pStorageObjects->locked()) {
+		if (pDiskObject && !pDiskObject->removedGeneration && pDiskObject->linkHash == linkHash)
+			pDiskObject->lastSeenRefresh = refresh;
+	}
+}
+
+static NTSTATUS AddStorageObject(IN PDEVICE_OBJECT pdo, IN ULONG linkHash, IN ULONG generation, IN ULONG refresh) {
     PSTORAGE_OBJECT pStorageObject = new (NON_PAGED) STORAGE_OBJECT;
     if (!pStorageObject) 
         return STATUS_INSUFFICIENT_RESOURCES;
@@ -37,6 +132,9 @@ static NTSTATUS AddStorageObject(IN PDEVICE_OBJECT pdo) {
     pStorageObject->info.partitionSizeBytes = 0;
     pStorageObject->info.diskSizeBytes = 0;
     pStorageObject->info.sectorSize = 0;
+    pStorageObject->addedGeneration = generation;
+    pStorageObject->lastSeenRefresh = refresh;
+    pStorageObject->linkHash = linkHash;
 
     ObReferenceObject(pdo);
 
@@ -95,6 +193,21 @@ static NTSTATUS AddStorageObject(IN PDEVICE_OBJECT pdo) {
     pStorageObject->info.sectorSize = (ULONG)diskGeometryEx.Geometry.BytesPerSector;
     DbgPrint("SectorSize=%u\n", pStorageObject->info.sectorSize);
 
+    {
+        // Devices that do not report the property are taken to have physical sectors the size of logical ones.
+        STORAGE_ACCESS_ALIGNMENT_DESCRIPTOR alignment;
+        ULONG sectorSize = pStorageObject->info.sectorSize;
+        pStorageObject->info.physicalSectorSize = sectorSize;
+        if (NT_SUCCESS(StorageQueryProperty(pStorageObject, StorageAccessAlignmentProperty, &alignment, sizeof(alignment))) && sectorSize &&
+            alignment.BytesPerPhysicalSector > sectorSize && alignment.BytesPerPhysicalSector % sectorSize == 0) {
+            // Physical sectors start BytesOffsetForSectorAlignment bytes into the disk.
+            pStorageObject->info.physicalSectorSize = alignment.BytesPerPhysicalSector;
+            pStorageObject->info.physicalSectorOffset = PhysicalSectorBoundary(pStorageObject->info.partitionStartingOffset,
+                alignment.BytesOffsetForSectorAlignment, alignment.BytesPerPhysicalSector);
+        }
+        DbgPrint("PhysicalSectorSize=%u, PhysicalSectorOffset=%u\n", pStorageObject->info.physicalSectorSize, pStorageObject->info.physicalSectorOffset);
+    }
+
 
     {
         GET_LENGTH_INFORMATION lengthInfo;
@@ -110,7 +223,9 @@ static NTSTATUS AddStorageObject(IN PDEVICE_OBJECT pdo) {
     }
 
     if (pStorageObject->info.isRawDiskObject) {
-        g_pStorageObjects->push_back((PSTORAGE_OBJECT)pStorageObject);
+        ReadRawDiskId(pStorageObject);
+        if (NT_SUCCESS(g_pStorageObjects->push_back((PSTORAGE_OBJECT)pStorageObject)))
+            IndexStorageObject(pStorageObject);
         return STATUS_SUCCESS;
     }
 
@@ -134,7 +249,8 @@ static NTSTATUS AddStorageObject(IN PDEVICE_OBJECT pdo) {
         delete pLayout;
     }
 
-    g_pStorageObjects->push_back((PSTORAGE_OBJECT)pStorageObject);
+    if (NT_SUCCESS(g_pStorageObjects->push_back((PSTORAGE_OBJECT)pStorageObject)))
+        IndexStorageObject(pStorageObject);
     return STATUS_SUCCESS;
 
 cleanup:
@@ -143,24 +259,28 @@ cleanup:
     return status;
 }
 
-NTSTATUS RefreshGlobalStorageObjects() {
+NTSTATUS RefreshGlobalStorageObjects(IN BOOLEAN wait) {
 	LOG("RefreshGlobalStorageObjects called\n");
-	const GUID* interfaces[] = {
-		&GUID_DEVINTERFACE_DISK,
-		&GUID_DEVINTERFACE_PARTITION,
-		&GUID_DEVINTERFACE_VOLUME,
-		&GUID_DEVINTERFACE_CDROM
-	};
-
-	for (size_t gi = 0; gi < ARRAYSIZE(interfaces); ++gi) {
+	const GUID* const* interfaces = g_storageInterfaceClasses;
+
+	ULONG generation = TopologyBeginRefresh(wait);
+	if (!generation)
+		return STATUS_SUCCESS;
+	ULONG refresh = ++g_refreshCount;
+	// Devices can only be declared gone when every enabled interface was looked at.
+	BOOLEAN complete = TRUE;
+
+	for (size_t gi = 0; gi < STORAGE_INTERFACE_CLASS_COUNT; ++gi) {
 		PWCHAR symbolicLinkList = NULL;
 		NTSTATUS status = IoGetDeviceInterfaces(interfaces[gi], NULL, 0, &symbolicLinkList);
 		if (!NT_SUCCESS(status)) {
 			LOG("IoGetDeviceInterfaces(%zu) failed: 0x%08X\n", gi, status);
+			complete = FALSE;
 			continue;
 		}
 		if (!symbolicLinkList) {
 			LOG("IoGetDeviceInterfaces(%zu) returned NULL list\n", gi);
+			complete = FALSE;
 			continue;
 		}
 
@@ -174,10 +294,14 @@ NTSTATUS RefreshGlobalStorageObjects() {
 
 			PFILE_OBJECT fileObject = NULL;
 			PDEVICE_OBJECT deviceObject = NULL;
+			PSTORAGE_OBJECT pListed = NULL;
+			ULONG linkHash = 0;
+			RtlHashUnicodeString(&symbolicLink, TRUE, HASH_STRING_ALGORITHM_DEFAULT, &linkHash);
 
 			status = IoGetDeviceObjectPointer(&symbolicLink, FILE_READ_ATTRIBUTES, &fileObject, &deviceObject);
 			if (!NT_SUCCESS(status)) {
-				LOG("IoGetDeviceObjectPointer failed for %wZ: 0x%08X\n", &symbolicLink, status);
+				LOG("IoGetDeviceObjectPointer failed for %wZ: 0x%08X, keeping objects found through it\n", &symbolicLink, status);
+				MarkLinkSeen(linkHash, refresh);
 				goto nextEntry;
 			}
 			if (!deviceObject) {
@@ -192,13 +316,15 @@ NTSTATUS RefreshGlobalStorageObjects() {
 			else
 				isRaw = FALSE;
 
-			if (IsDeviceObjectInList(deviceObject)) {
+			pListed = FindListedDeviceObject(deviceObject);
+			if (pListed) {
+				pListed->lastSeenRefresh = refresh;
 				ObDereferenceObject(deviceObject);
 				if (fileObject) ObDereferenceObject(fileObject);
 				goto nextEntry;
 			}
 
-			if (!NT_SUCCESS(AddStorageObject(deviceObject))) {
+			if (!NT_SUCCESS(AddStorageObject(deviceObject, linkHash, generation, refresh))) {
 				LOG("AddStorageObject failed\n");
 				ObDereferenceObject(deviceObject);
 				if (fileObject) ObDereferenceObject(fileObject);
@@ -217,6 +343,40 @@ NTSTATUS RefreshGlobalStorageObjects() {
 		}
 	}
 
+	BOOLEAN changed = FALSE;
+	for (auto pDiskObject : g_pStorageObjects->locked()) {
+		if (!pDiskObject || pDiskObject->removedGeneration)
+			continue;
+		if (complete && pDiskObject->lastSeenRefresh != refresh) {
+			LOG("Storage object disk=%u partition=%u went away\n", pDiskObject->info.diskIndex, pDiskObject->info.partitionNumber);
+			pDiskObject->removedGeneration = generation;
+		}
+		if (pDiskObject->addedGeneration == generation || pDiskObject->removedGeneration == generation)
+			changed = TRUE;
+	}
+
+	TopologyEndRefresh(generation, changed);
 	return STATUS_SUCCESS;
 }
 
+PSTORAGE_OBJECT FindStorageObject(IN PSTORAGE_LOCATION pStorageLocation) {
+    if (!g_pStorageObjects)
+        return nullptr;
+
+    for (auto pcDiskObject : g_pStorageObjects->locked()) {
+        if (!pcDiskObject || pcDiskObject->removedGeneration)
+            continue;
+
+        bool matchDiskIndex = pcDiskObject->info.diskIndex == pStorageLocation->diskIndex;
+        bool matchRawDisk = pcDiskObject->info.isRawDiskObject == pStorageLocation->isRawDiskObject;
+        bool matchPartition = true;
+
+        if (pStorageLocation->partitionNumber != (ULONG)-1) {
+            matchPartition = pcDiskObject->info.partitionNumber == pStorageLocation->partitionNumber;
+        }
+
+        if (matchDiskIndex && matchRawDisk && matchPartition)
+            return pcDiskObject;
+    }
+    return nullptr;
+}
@@ -3,6 +3,8 @@
 #include "Driver.hpp"
 #include "vector.hpp"
 #include "DeviceIo.hpp"
+#include "IdIndex.hpp"
+#include "PhysicalSector.hpp"
 
 #pragma pack (push, 1)
 
@@ -16,12 +18,8 @@ typedef struct _STORAGE_OBJECT_INFO {
     ULONGLONG partitionSizeBytes;
     ULONGLONG diskSizeBytes;
 
-    // ULONGLONG volumeTotalBytes;
-    // ULONGLONG volumeFreeBytes;
-
     ULONG sectorSize;
 
-    // GUID volumeGuid;
     GUID gptDiskId;
 
     PARTITION_STYLE partitionStyle;
@@ -31,19 +29,14 @@ typedef struct _STORAGE_OBJECT_INFO {
     WCHAR gptName[36];
     UCHAR mbrPartitionType;
 
-    // ULONG volumeSerialNumber;
-    // WCHAR volumeLabel[64];
-    // WCHAR fileSystemName[32];
-    // WCHAR driveLetters[8*2];
+    // 512e disks expose 512-byte logical sectors over 4 KiB physical ones and read-modify-write anything smaller.
+    ULONG physicalSectorSize;       // sectorSize if the device does not report one
+    ULONG physicalSectorOffset;     // offset in this object of its first physical sector boundary
 
-    // TODO: implement the commented stuff...
+    // Volume attributes are not part of the record, so plain enumeration stays as cheap as the list walk. They are
+    // returned as SECTOR_VOLUME_INFO by IOCTL_GET_DISK_INFO when a field mask asks for them.
 } STORAGE_OBJECT_INFO, *PSTORAGE_OBJECT_INFO;
 
-typedef struct _STORAGE_OBJECT {
-    STORAGE_OBJECT_INFO info;
-    PDEVICE_OBJECT pStorageDeviceObject;
-} STORAGE_OBJECT, *PSTORAGE_OBJECT;
-
 typedef struct _STORAGE_LOCATION {
     BOOLEAN isRawDiskObject;
     ULONG diskIndex;
@@ -51,9 +44,66 @@ typedef struct _STORAGE_LOCATION {
     ULONGLONG sectorNumber;
 } STORAGE_LOCATION, *PSTORAGE_LOCATION;
 
+// Names a storage object by the GUID it keeps across reboots and re-enumeration: a GPT disk by its disk id, a GPT
+// partition by its partition id. MBR disks and partitions have none.
+typedef struct _STORAGE_ID_LOCATION {
+    GUID id;
+    BOOLEAN isRawDiskObject;        // TRUE: id is a gptDiskId; FALSE: a gptPartitionIdGuid
+    ULONGLONG sectorNumber;
+} STORAGE_ID_LOCATION, *PSTORAGE_ID_LOCATION;
+
 #pragma pack (pop)
 
+// Not part of the user interface, so it keeps natural alignment for the runtime state below.
+typedef struct _STORAGE_OBJECT {
+    STORAGE_OBJECT_INFO info;
+    PDEVICE_OBJECT pStorageDeviceObject;
+
+    // Runtime state owned by individual features, created on first use and freed with the object
+    struct _QOS_LIMITER* pQos;
+    struct _ELEVATOR* pElevator;
+    struct _COALESCER* pCoalescer;
+    struct _PARTITION_CACHE* pPartitionCache;
+    struct _BAD_SECTOR_MAP* pBadSectors;
+    struct _VOLUME_CACHE* pVolumeCache;
+    struct _FLUSH_GROUP* pFlushGroup;
+    struct _CHANGE_TRACKER* pChangeTracker;
+    LONG partitionWriteSequence;    // bumped by every write to the disk while partition maps are in use
+    volatile LONG compareWriteSupport;  // whether the device took a SCSI COMPARE AND WRITE, see CompareWrite.cpp
+
+    // Topology generations in which the object appeared and went away; removedGeneration stays 0 while it is present.
+    // Objects that went away stay listed until unload, so pointers taken from the list never dangle.
+    ULONG addedGeneration;
+    ULONG removedGeneration;
+    ULONG lastSeenRefresh;          // last refresh whose interface lists named the device
+    ULONG linkHash;                 // hash of the interface link the object was found through
+    ID_INDEX_NODE idNode;           // entry in the identity index, keyed by the GPT id and isRawDiskObject
+
+    // Outcomes of lower transfers over the object's lifetime, reported by IOCTL_GET_IO_HEALTH
+    volatile LONG64 completedIos;
+    volatile LONG64 failedIos;
+    volatile LONG64 timedOutIos;        // aborted because the request's deadline passed
+    volatile LONG64 cancelledIos;       // aborted because the request was cancelled
+    volatile LONG64 totalLatency100ns;
+    volatile LONG64 maxLatency100ns;
+    volatile LONG64 lastTimeoutTime;    // system time of the latest timeout
+    volatile LONG64 unalignedWrites;    // writes handed down that do not cover whole physical sectors
+    volatile LONG64 paddedWrites;       // unaligned writes the driver widened to whole physical sectors
+    volatile LONG64 flushRequests;      // successful writes that asked to be flushed
+    volatile LONG64 lowerFlushes;       // IRP_MJ_FLUSH_BUFFERS sent for them
+} STORAGE_OBJECT, *PSTORAGE_OBJECT;
+
+#define STORAGE_INTERFACE_CLASS_COUNT 4
+// Device interface classes whose members become storage objects.
+extern const GUID* const g_storageInterfaceClasses[STORAGE_INTERFACE_CLASS_COUNT];
+
 void FreeCollectedStorageObjects();
-NTSTATUS RefreshGlobalStorageObjects();
+// Adds the devices that appeared since the last refresh and marks the ones that went away. Refreshes are serialized;
+// without wait, a refresh that finds another one running returns at once and leaves the work to it.
+NTSTATUS RefreshGlobalStorageObjects(IN BOOLEAN wait);
+PSTORAGE_OBJECT FindStorageObject(IN PSTORAGE_LOCATION pStorageLocation);
+// Present storage object with the GPT id, through a hash index kept alongside the list. Fails with
+// STATUS_DEVICE_NOT_CONNECTED if there is none, and with STATUS_OBJECT_NAME_COLLISION if cloned disks share the id.
+NTSTATUS FindStorageObjectById(IN const GUID* pId, IN BOOLEAN isRawDiskObject, OUT PSTORAGE_OBJECT* ppStorageObject);
 
 extern vector<PSTORAGE_OBJECT>* g_pStorageObjects;
@@ -1,13 +1,12 @@
 #include "SectorIoctlHandlers.hpp"
-
-NTSTATUS RWIrpCompletion(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp, IN PVOID Context) {
-	UNREFERENCED_PARAMETER(DeviceObject);
-	PIOCTL_COMPLETION_CONTEXT ctx = (PIOCTL_COMPLETION_CONTEXT)Context;
-	ctx->ioStatusBlock.Status = Irp->IoStatus.Status;
-	ctx->ioStatusBlock.Information = Irp->IoStatus.Information;
-	KeSetEvent(&ctx->event, IO_NO_INCREMENT, FALSE);
-	return STATUS_MORE_PROCESSING_REQUIRED;
-}
+#include "StorageIo.hpp"
+#include "Coalesce.hpp"
+#include "RequestControl.hpp"
+#include "HandleContext.hpp"
+#include "StorageQuery.hpp"
+#include "CompareWrite.hpp"
+#include "FlushGroup.hpp"
+#include "Rescue.hpp"
 
 NTSTATUS GetSectorSizeIoctlHandler(IN PIRP pIrp, IN PSTORAGE_OBJECT pStorageObject) {
 	LOG("GetSectorSizeIoctlHandler called\n");
@@ -25,21 +24,21 @@ NTSTATUS GetSectorSizeIoctlHandler(IN PIRP pIrp, IN PSTORAGE_OBJECT pStorageObje
 	}
 }
 
-NTSTATUS PerformSectorIoOperation(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject, IN PSTORAGE_LOCATION pStorageLocation, IN BOOLEAN isWrite)
+// Reads into or writes from the caller's output buffer, which has to be a whole number of sectors.
+static NTSTATUS TransferUserBuffer(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject, IN ULONGLONG byteOffset, IN BOOLEAN isWrite, IN ULONG flags)
 {
 	NTSTATUS status = STATUS_SUCCESS;
-    PIRP lowerIrp = NULL;
-	IOCTL_COMPLETION_CONTEXT ctx;
-
-	if (!pStorageObject)
-		return STATUS_INVALID_DEVICE_REQUEST;
-
-	if ((pIrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(STORAGE_LOCATION)) ||
-		((ULONG64)pIrpStack->Parameters.DeviceIoControl.OutputBufferLength < pStorageObject->info.sectorSize))
-		return STATUS_INFO_LENGTH_MISMATCH;
+	STORAGE_IO io;
+	ULONG_PTR information = 0;
+	BOOLEAN flushAfter = isWrite && (flags & SECTOR_IO_FLUSH);
 
-	LARGE_INTEGER startingOffset;
-	startingOffset.QuadPart = (LONGLONG)pStorageObject->info.partitionStartingOffset;
+	if ((flags & (SECTOR_IO_FUA | SECTOR_IO_FLUSH)) == (SECTOR_IO_FUA | SECTOR_IO_FLUSH))
+		return STATUS_INVALID_PARAMETER;
+	if (!isWrite && (flags & SECTOR_IO_FAIL_KNOWN_BAD)) {
+		status = BadSectorsCheckRead(pStorageObject, byteOffset, pIrpStack->Parameters.DeviceIoControl.OutputBufferLength);
+		if (!NT_SUCCESS(status))
+			return status;
+	}
 
 	LOG("  Attempting to allocate an MDL\n");
 	PMDL mdl = IoAllocateMdl(
@@ -64,48 +63,60 @@ NTSTATUS PerformSectorIoOperation(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack,
 		goto Done;
 	}
 
-	LARGE_INTEGER diskOffset;
-	diskOffset.QuadPart = (LONGLONG)pStorageObject->info.sectorSize * (LONGLONG)pStorageLocation->sectorNumber;
-        
-    lowerIrp = IoAllocateIrp(pStorageObject->pStorageDeviceObject->StackSize, FALSE);
-	if (!lowerIrp) {
-        LOG("  IoAllocateIrp failed\n");
-		status = STATUS_INSUFFICIENT_RESOURCES;
-		goto Done;
-	}
-
-	KeInitializeEvent(&ctx.event, NotificationEvent, FALSE);
-	IoSetCompletionRoutine(lowerIrp, RWIrpCompletion, &ctx, TRUE, TRUE, TRUE);
-
-	PIO_STACK_LOCATION nextSp = IoGetNextIrpStackLocation(lowerIrp);
-	if (isWrite) {
-		nextSp->MajorFunction = IRP_MJ_WRITE;
-		nextSp->Parameters.Write.Length = pIrpStack->Parameters.DeviceIoControl.OutputBufferLength;
-		nextSp->Parameters.Write.ByteOffset = diskOffset;
-		nextSp->Flags |= SL_FORCE_DIRECT_WRITE | SL_OVERRIDE_VERIFY_VOLUME;
-	}
-	else {
-		nextSp->MajorFunction = IRP_MJ_READ;
-		nextSp->Parameters.Read.Length = pIrpStack->Parameters.DeviceIoControl.OutputBufferLength;
-		nextSp->Parameters.Read.ByteOffset = diskOffset;
-	}
-	nextSp->DeviceObject = pStorageObject->pStorageDeviceObject;
-	lowerIrp->MdlAddress = mdl;
+	StorageIoInitialize(&io, pStorageObject, isWrite, mdl, byteOffset, pIrpStack->Parameters.DeviceIoControl.OutputBufferLength, pIrp);
+	io.writeThrough = isWrite && (flags & SECTOR_IO_FUA);
+	if (flushAfter)
+		FlushGroupWriteStarted(pStorageObject);
 
     LOG("  Sending lower IRP %s: device=%p offset=%llu length=%u\n",
         isWrite ? "WRITE" : "READ",
         pStorageObject->pStorageDeviceObject,
-        (unsigned long long)diskOffset.QuadPart,
+        byteOffset,
         pIrpStack->Parameters.DeviceIoControl.OutputBufferLength);
 
-	status = IoCallDriver(pStorageObject->pStorageDeviceObject, lowerIrp);
-	if (status == STATUS_PENDING) {
-		KeWaitForSingleObject(&ctx.event, Executive, KernelMode, FALSE, NULL);
-		status = ctx.ioStatusBlock.Status;
+	if (!isWrite && CoalesceAccepts(pStorageObject, io.byteOffset, io.length)) {
+		PVOID destination = MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority | MdlMappingNoExecute);
+		if (!destination) {
+			status = STATUS_INSUFFICIENT_RESOURCES;
+			goto Done;
+		}
+		status = CoalescedRead(pStorageObject, pIrp, io.byteOffset, io.length, destination, &information);
+	}
+	else {
+		status = STATUS_NOT_SUPPORTED;
+		if (isWrite && (flags & SECTOR_IO_ALIGN_PHYSICAL)) {
+			PVOID source = MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority | MdlMappingNoExecute);
+			if (source) {
+				status = PaddedWrite(pStorageObject, pIrp, io.byteOffset, (const UCHAR*)source, io.length, io.writeThrough);
+				if (NT_SUCCESS(status))
+					information = io.length;
+			}
+			else
+				status = STATUS_INSUFFICIENT_RESOURCES;
+		}
+		if (status == STATUS_NOT_SUPPORTED)
+			status = StorageIoTransfer(&io, &information);
+	}
+
+	// Every announced write is committed, failed or not, so the group does not keep gathering for it. Nothing between
+	// the announcement and here leaves early.
+	if (flushAfter)
+		status = FlushGroupCommit(pStorageObject, status);
+
+	if (NT_SUCCESS(status) && (flags & SECTOR_IO_VERIFY)) {
+		ULONG length = pIrpStack->Parameters.DeviceIoControl.OutputBufferLength;
+		PVOID source = MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority | MdlMappingNoExecute);
+		ULONG mismatchOffset;
+		if (!source)
+			status = STATUS_INSUFFICIENT_RESOURCES;
+		else
+			status = VerifyWrittenRange(pStorageObject, pIrp, byteOffset, (const UCHAR*)source, length, &mismatchOffset);
+		if (NT_SUCCESS(status) && mismatchOffset < length)
+			status = STATUS_DEVICE_DATA_ERROR;
 	}
 
 	if (NT_SUCCESS(status))
-		pIrp->IoStatus.Information = (ULONG)ctx.ioStatusBlock.Information;
+		pIrp->IoStatus.Information = (ULONG)information;
     else
         LOG("  IoCallDriver failed with status 0x%08X\n", status);
 
@@ -117,13 +128,39 @@ Done:
 		__except (EXCEPTION_EXECUTE_HANDLER) { }
 		IoFreeMdl(mdl);
 	}
-	if (lowerIrp)
-		IoFreeIrp(lowerIrp);
 
-    LOG("PerformSectorIoOperation complete, status=0x%08X\n", status);
+    LOG("TransferUserBuffer complete, status=0x%08X\n", status);
 	return status;
 }
 
+NTSTATUS PerformSectorIoOperation(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject, IN PSTORAGE_LOCATION pStorageLocation, IN BOOLEAN isWrite)
+{
+	if (!pStorageObject)
+		return STATUS_INVALID_DEVICE_REQUEST;
+
+	ULONG flags = 0;
+	if ((pIrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(STORAGE_LOCATION)) ||
+		((ULONG64)pIrpStack->Parameters.DeviceIoControl.OutputBufferLength < pStorageObject->info.sectorSize))
+		return STATUS_INFO_LENGTH_MISMATCH;
+
+	if (pIrpStack->Parameters.DeviceIoControl.InputBufferLength >= sizeof(SECTOR_IO_REQUEST)) {
+		SECTOR_IO_REQUEST request;
+		__try {
+			ProbeForRead(pIrpStack->Parameters.DeviceIoControl.Type3InputBuffer, sizeof(request), 1);
+			RtlCopyMemory(&request, pIrpStack->Parameters.DeviceIoControl.Type3InputBuffer, sizeof(request));
+		}
+		__except (EXCEPTION_EXECUTE_HANDLER) {
+			return GetExceptionCode();
+		}
+		if (request.flags & ~(isWrite ? SECTOR_IO_WRITE_FLAGS : SECTOR_IO_READ_FLAGS))
+			return STATUS_INVALID_PARAMETER;
+		RequestSetDeadline(pIrp, request.timeoutMs);
+		flags = request.flags;
+	}
+
+	return TransferUserBuffer(pIrp, pIrpStack, pStorageObject, (ULONGLONG)pStorageObject->info.sectorSize * pStorageLocation->sectorNumber, isWrite, flags);
+}
+
 NTSTATUS ReadSectorIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject, IN PSTORAGE_LOCATION pStorageLocation) {
 	LOG("ReadSectorIoctlHandler -> PerformSectorIoOperation (isWrite = FALSE)\n");
 	return PerformSectorIoOperation(pIrp, pIrpStack, pStorageObject, pStorageLocation, FALSE);
@@ -134,6 +171,12 @@ NTSTATUS WriteSectorIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack,
 	return PerformSectorIoOperation(pIrp, pIrpStack, pDiskObject, pDiskLocation, TRUE);
 }
 
+static BOOLEAN StorageObjectMatches(IN PSTORAGE_OBJECT pObject, IN PSTORAGE_LOCATION pLocation) {
+    return pObject->info.diskIndex == pLocation->diskIndex &&
+        pObject->info.isRawDiskObject == pLocation->isRawDiskObject &&
+        (pLocation->partitionNumber == (ULONG)-1 || pObject->info.partitionNumber == pLocation->partitionNumber);
+}
+
 static NTSTATUS CopySingleStorageObjectInfoToUser(IN PIRP pIrp, IN PSTORAGE_LOCATION sel, IN PVOID outBuffer, IN ULONG outLength) {
     if (!sel || !outBuffer)
         return STATUS_INVALID_PARAMETER;
@@ -149,10 +192,8 @@ static NTSTATUS CopySingleStorageObjectInfoToUser(IN PIRP pIrp, IN PSTORAGE_LOCA
     LOG("CopySingleStorageObjectInfoToUser: searching diskIndex=%u partition=%u isRaw=%u\n", sel->diskIndex, sel->partitionNumber, sel->isRawDiskObject);
 
     for (auto entry : g_pStorageObjects->locked()) {
-        if (!entry) continue;
-        if (entry->info.diskIndex == sel->diskIndex &&
-            entry->info.isRawDiskObject == sel->isRawDiskObject &&
-            (sel->partitionNumber == (ULONG)-1 || entry->info.partitionNumber == sel->partitionNumber)) {
+        if (!entry || entry->removedGeneration) continue;
+        if (StorageObjectMatches(entry, sel)) {
             found = entry;
             break;
         }
@@ -182,6 +223,69 @@ static NTSTATUS CopySingleStorageObjectInfoToUser(IN PIRP pIrp, IN PSTORAGE_LOCA
     return STATUS_SUCCESS;
 }
 
+static NTSTATUS CopyStorageInfoExToUser(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PVOID outBuffer, IN ULONG outLength) {
+    SECTOR_STORAGE_INFO_REQUEST request;
+    __try {
+        ProbeForRead(pIrpStack->Parameters.DeviceIoControl.Type3InputBuffer, sizeof(request), 1);
+        RtlCopyMemory(&request, pIrpStack->Parameters.DeviceIoControl.Type3InputBuffer, sizeof(request));
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return GetExceptionCode();
+    }
+    if ((request.fields & ~SECTOR_VOLUME_ALL_FIELDS) || (request.flags & ~SECTOR_STORAGE_INFO_ALL))
+        return STATUS_INVALID_PARAMETER;
+    BOOLEAN all = (request.flags & SECTOR_STORAGE_INFO_ALL) != 0;
+
+    // Volume lookups wait on other drivers, so they run on a snapshot rather than under the list lock. Objects stay
+    // allocated until unload.
+    vector<PSTORAGE_OBJECT> objects;
+    for (auto entry : g_pStorageObjects->locked()) {
+        if (!entry || entry->removedGeneration)
+            continue;
+        if (!all && !StorageObjectMatches(entry, &request.location))
+            continue;
+        NTSTATUS status = objects.push_back(entry);
+        if (!NT_SUCCESS(status))
+            return status;
+        if (!all)
+            break;
+    }
+    if (!all && objects.size() == 0) {
+        LOG("  no matching storage object found\n");
+        return STATUS_NOT_FOUND;
+    }
+
+    SIZE_T requiredBytes = objects.size() * sizeof(SECTOR_STORAGE_INFO_EX);
+    if ((SIZE_T)outLength < requiredBytes || requiredBytes == 0) {
+        if (outLength < sizeof(SIZE_T))
+            return STATUS_INFO_LENGTH_MISMATCH;
+        __try {
+            *(SIZE_T*)outBuffer = requiredBytes;
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER) {
+            return GetExceptionCode();
+        }
+        pIrp->IoStatus.Information = sizeof(SIZE_T);
+        return requiredBytes ? STATUS_BUFFER_TOO_SMALL : STATUS_SUCCESS;
+    }
+
+    SECTOR_STORAGE_INFO_EX record;
+    PSECTOR_STORAGE_INFO_EX pOut = (PSECTOR_STORAGE_INFO_EX)outBuffer;
+    for (auto pObject : objects) {
+        record.info = pObject->info;
+        VolumeQueryInfo(pObject, request.fields, &record.volume);
+        __try {
+            RtlCopyMemory(pOut++, &record, sizeof(record));
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER) {
+            return GetExceptionCode();
+        }
+    }
+
+    pIrp->IoStatus.Information = (ULONG_PTR)requiredBytes;
+    return STATUS_SUCCESS;
+}
+
 NTSTATUS StorageInfoIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack) {
     LOG("StorageInfoIoctlHandler called\n");
     if (!g_pStorageObjects) {
@@ -208,6 +312,11 @@ NTSTATUS StorageInfoIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack)
         return ex;
     }
 
+    if (pIrpStack->Parameters.DeviceIoControl.InputBufferLength >= sizeof(SECTOR_STORAGE_QUERY))
+        return StorageQueryToUser(pIrp, pIrpStack, outBuffer, outLength);
+    if (pIrpStack->Parameters.DeviceIoControl.InputBufferLength >= sizeof(SECTOR_STORAGE_INFO_REQUEST))
+        return CopyStorageInfoExToUser(pIrp, pIrpStack, outBuffer, outLength);
+
     if (pIrpStack->Parameters.DeviceIoControl.InputBufferLength >= sizeof(STORAGE_LOCATION)) {
         PSTORAGE_LOCATION sel = (PSTORAGE_LOCATION)pIrpStack->Parameters.DeviceIoControl.Type3InputBuffer;
         LOG("  InputBufferLength indicates STORAGE_LOCATION present: sel=%p\n", sel);
@@ -224,7 +333,7 @@ NTSTATUS StorageInfoIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack)
 
     vector<STORAGE_OBJECT_INFO> snapshot;
     for (auto entry : g_pStorageObjects->locked()) {
-        if (entry) snapshot.push_back(entry->info);
+        if (entry && !entry->removedGeneration) snapshot.push_back(entry->info);
     }
 
     SIZE_T requiredBytes = snapshot.size() * sizeof(STORAGE_OBJECT_INFO);
@@ -285,3 +394,219 @@ NTSTATUS StorageInfoIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack)
     return STATUS_INFO_LENGTH_MISMATCH;
 
 }
+
+NTSTATUS GetIoHealthIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject) {
+    LOG("GetIoHealthIoctlHandler called\n");
+    if (!pStorageObject)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    ULONG flags = 0;
+    if (pIrpStack->Parameters.DeviceIoControl.InputBufferLength >= sizeof(SECTOR_IO_HEALTH_REQUEST)) {
+        __try {
+            ProbeForRead(pIrpStack->Parameters.DeviceIoControl.Type3InputBuffer, sizeof(SECTOR_IO_HEALTH_REQUEST), 1);
+            flags = ((PSECTOR_IO_HEALTH_REQUEST)pIrpStack->Parameters.DeviceIoControl.Type3InputBuffer)->flags;
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER) {
+            return GetExceptionCode();
+        }
+    }
+    if (flags & ~SECTOR_IO_HEALTH_RESET)
+        return STATUS_INVALID_PARAMETER;
+
+    PVOID outBuffer = pIrp->UserBuffer;
+    ULONG outLength = pIrpStack->Parameters.DeviceIoControl.OutputBufferLength;
+    if (!outBuffer || outLength < sizeof(SECTOR_IO_HEALTH))
+        return STATUS_INFO_LENGTH_MISMATCH;
+    ULONG resultLength = outLength >= sizeof(SECTOR_IO_HEALTH_EX) ? sizeof(SECTOR_IO_HEALTH_EX) : sizeof(SECTOR_IO_HEALTH);
+
+    // Each counter is read and cleared in one step so a concurrent transfer is counted either here or in the next read.
+    BOOLEAN reset = (flags & SECTOR_IO_HEALTH_RESET) != 0;
+    SECTOR_IO_HEALTH_EX result;
+    SECTOR_IO_HEALTH& health = result.health;
+    health.completedIos = (ULONGLONG)(reset ? InterlockedExchange64(&pStorageObject->completedIos, 0) : pStorageObject->completedIos);
+    health.failedIos = (ULONGLONG)(reset ? InterlockedExchange64(&pStorageObject->failedIos, 0) : pStorageObject->failedIos);
+    health.timedOutIos = (ULONGLONG)(reset ? InterlockedExchange64(&pStorageObject->timedOutIos, 0) : pStorageObject->timedOutIos);
+    health.cancelledIos = (ULONGLONG)(reset ? InterlockedExchange64(&pStorageObject->cancelledIos, 0) : pStorageObject->cancelledIos);
+    ULONGLONG totalLatency = (ULONGLONG)(reset ? InterlockedExchange64(&pStorageObject->totalLatency100ns, 0) : pStorageObject->totalLatency100ns);
+    health.maxLatency100ns = (ULONGLONG)(reset ? InterlockedExchange64(&pStorageObject->maxLatency100ns, 0) : pStorageObject->maxLatency100ns);
+    health.lastTimeoutTime = (ULONGLONG)(reset ? InterlockedExchange64(&pStorageObject->lastTimeoutTime, 0) : pStorageObject->lastTimeoutTime);
+
+    ULONGLONG transfers = health.completedIos + health.failedIos + health.timedOutIos + health.cancelledIos;
+    health.averageLatency100ns = transfers ? totalLatency / transfers : 0;
+    result.unalignedWrites = (ULONGLONG)(reset ? InterlockedExchange64(&pStorageObject->unalignedWrites, 0) : pStorageObject->unalignedWrites);
+    result.paddedWrites = (ULONGLONG)(reset ? InterlockedExchange64(&pStorageObject->paddedWrites, 0) : pStorageObject->paddedWrites);
+    result.flushRequests = (ULONGLONG)(reset ? InterlockedExchange64(&pStorageObject->flushRequests, 0) : pStorageObject->flushRequests);
+    result.lowerFlushes = (ULONGLONG)(reset ? InterlockedExchange64(&pStorageObject->lowerFlushes, 0) : pStorageObject->lowerFlushes);
+
+    __try {
+        ProbeForWrite(outBuffer, resultLength, 1);
+        RtlCopyMemory(outBuffer, &result, resultLength);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return GetExceptionCode();
+    }
+    pIrp->IoStatus.Information = resultLength;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS BindStorageIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject) {
+	LOG("BindStorageIoctlHandler called\n");
+	PHANDLE_CONTEXT pContext = GetHandleContext(pIrp);
+	if (!pStorageObject || !pContext)
+		return STATUS_INVALID_DEVICE_REQUEST;
+
+	ULONG sectorSize = pStorageObject->info.sectorSize;
+	if (sectorSize == 0)
+		return STATUS_INVALID_DEVICE_REQUEST;
+
+	ULONG outLength = pIrpStack->Parameters.DeviceIoControl.OutputBufferLength;
+	PVOID outBuffer = pIrp->UserBuffer;
+	if (outBuffer && outLength < sizeof(SECTOR_BIND_RESULT))
+		return STATUS_INFO_LENGTH_MISMATCH;
+
+	PHANDLE_BINDING pBinding = new (NON_PAGED) HANDLE_BINDING;
+	if (!pBinding)
+		return STATUS_INSUFFICIENT_RESOURCES;
+	pBinding->pStorageObject = pStorageObject;
+	pBinding->sectorSize = sectorSize;
+	pBinding->sectorCount = GetStorageObjectLength(pStorageObject) / sectorSize;
+
+	// The result is written before the binding is published, so a bad output buffer leaves the handle unbound.
+	if (outBuffer) {
+		SECTOR_BIND_RESULT result;
+		result.sectorSize = sectorSize;
+		result.sectorCount = pBinding->sectorCount;
+		result.info = pStorageObject->info;
+		__try {
+			ProbeForWrite(outBuffer, sizeof(result), 1);
+			RtlCopyMemory(outBuffer, &result, sizeof(result));
+		}
+		__except (EXCEPTION_EXECUTE_HANDLER) {
+			delete pBinding;
+			return GetExceptionCode();
+		}
+	}
+
+	// Bound requests race with nothing but each other, so publishing the pointer once is all the locking they need.
+	if (InterlockedCompareExchangePointer((PVOID*)&pContext->pBinding, pBinding, NULL)) {
+		delete pBinding;
+		return STATUS_ALREADY_COMMITTED;
+	}
+	ObReferenceObject(pStorageObject->pStorageDeviceObject);
+	LOG("  handle bound to disk %lu partition %lu, %llu sectors of %lu bytes\n", pStorageObject->info.diskIndex, pStorageObject->info.partitionNumber, pBinding->sectorCount, sectorSize);
+
+	if (outBuffer)
+		pIrp->IoStatus.Information = sizeof(SECTOR_BIND_RESULT);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS BoundSectorIoIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN BOOLEAN isWrite) {
+	LOG("BoundSectorIoIoctlHandler called (isWrite = %u)\n", isWrite);
+	PHANDLE_CONTEXT pContext = GetHandleContext(pIrp);
+	PHANDLE_BINDING pBinding = pContext ? pContext->pBinding : NULL;
+	if (!pBinding)
+		return STATUS_INVALID_DEVICE_STATE;
+	if (pBinding->pStorageObject->removedGeneration)
+		return STATUS_DEVICE_NOT_CONNECTED;
+
+	SECTOR_BOUND_IO_REQUEST request = {0};
+	ULONG inputLength = pIrpStack->Parameters.DeviceIoControl.InputBufferLength;
+	PVOID userInput = pIrpStack->Parameters.DeviceIoControl.Type3InputBuffer;
+	if (!userInput || inputLength < sizeof(request.sectorNumber))
+		return STATUS_INFO_LENGTH_MISMATCH;
+	ULONG copyLength = inputLength >= sizeof(request) ? sizeof(request) : sizeof(request.sectorNumber);
+	__try {
+		ProbeForRead(userInput, copyLength, 1);
+		RtlCopyMemory(&request, userInput, copyLength);
+	}
+	__except (EXCEPTION_EXECUTE_HANDLER) {
+		return GetExceptionCode();
+	}
+	if (request.flags & ~(isWrite ? SECTOR_IO_WRITE_FLAGS : SECTOR_IO_READ_FLAGS))
+		return STATUS_INVALID_PARAMETER;
+
+	ULONG length = pIrpStack->Parameters.DeviceIoControl.OutputBufferLength;
+	if (length == 0 || length % pBinding->sectorSize)
+		return STATUS_INFO_LENGTH_MISMATCH;
+	if (request.sectorNumber >= pBinding->sectorCount || length / pBinding->sectorSize > pBinding->sectorCount - request.sectorNumber)
+		return STATUS_INVALID_PARAMETER;
+
+	RequestSetDeadline(pIrp, request.timeoutMs);
+	return TransferUserBuffer(pIrp, pIrpStack, pBinding->pStorageObject, request.sectorNumber * pBinding->sectorSize, isWrite, request.flags);
+}
+
+// Looks the object up in the identity index. The index follows the device interface notifications, so only a miss
+// is worth a refresh before giving up.
+static NTSTATUS ResolveStorageId(IN PIO_STACK_LOCATION pIrpStack, OUT PSECTOR_ID_IO_REQUEST pRequest, OUT PSTORAGE_OBJECT* ppStorageObject) {
+	ULONG inputLength = pIrpStack->Parameters.DeviceIoControl.InputBufferLength;
+	PVOID userInput = pIrpStack->Parameters.DeviceIoControl.Type3InputBuffer;
+	if (!userInput || inputLength < sizeof(STORAGE_ID_LOCATION))
+		return STATUS_INFO_LENGTH_MISMATCH;
+	if (!g_pStorageObjects)
+		return STATUS_DEVICE_NOT_CONNECTED;
+
+	RtlZeroMemory(pRequest, sizeof(*pRequest));
+	ULONG copyLength = inputLength >= sizeof(*pRequest) ? sizeof(*pRequest) : sizeof(STORAGE_ID_LOCATION);
+	__try {
+		ProbeForRead(userInput, copyLength, 1);
+		RtlCopyMemory(pRequest, userInput, copyLength);
+	}
+	__except (EXCEPTION_EXECUTE_HANDLER) {
+		return GetExceptionCode();
+	}
+
+	NTSTATUS status = FindStorageObjectById(&pRequest->location.id, pRequest->location.isRawDiskObject, ppStorageObject);
+	if (status == STATUS_DEVICE_NOT_CONNECTED && NT_SUCCESS(RefreshGlobalStorageObjects(FALSE)))
+		status = FindStorageObjectById(&pRequest->location.id, pRequest->location.isRawDiskObject, ppStorageObject);
+	if (!NT_SUCCESS(status))
+		LOG("  no storage object for the id (isRaw=%u): 0x%08X\n", pRequest->location.isRawDiskObject, status);
+	return status;
+}
+
+NTSTATUS IdSectorIoIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN BOOLEAN isWrite) {
+	LOG("IdSectorIoIoctlHandler called (isWrite = %u)\n", isWrite);
+	SECTOR_ID_IO_REQUEST request;
+	PSTORAGE_OBJECT pStorageObject;
+	NTSTATUS status = ResolveStorageId(pIrpStack, &request, &pStorageObject);
+	if (!NT_SUCCESS(status))
+		return status;
+	if (request.flags & ~(isWrite ? SECTOR_IO_WRITE_FLAGS : SECTOR_IO_READ_FLAGS))
+		return STATUS_INVALID_PARAMETER;
+	if ((ULONG64)pIrpStack->Parameters.DeviceIoControl.OutputBufferLength < pStorageObject->info.sectorSize)
+		return STATUS_INFO_LENGTH_MISMATCH;
+
+	RequestSetDeadline(pIrp, request.timeoutMs);
+	return TransferUserBuffer(pIrp, pIrpStack, pStorageObject, (ULONGLONG)pStorageObject->info.sectorSize * request.location.sectorNumber, isWrite, request.flags);
+}
+
+NTSTATUS IdStorageInfoIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack) {
+	LOG("IdStorageInfoIoctlHandler called\n");
+	SECTOR_ID_IO_REQUEST request;
+	PSTORAGE_OBJECT pStorageObject;
+	NTSTATUS status = ResolveStorageId(pIrpStack, &request, &pStorageObject);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	PVOID outBuffer = pIrp->UserBuffer;
+	if (!outBuffer || pIrpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(STORAGE_OBJECT_INFO))
+		return STATUS_INFO_LENGTH_MISMATCH;
+	__try {
+		ProbeForWrite(outBuffer, sizeof(STORAGE_OBJECT_INFO), 1);
+		RtlCopyMemory(outBuffer, &pStorageObject->info, sizeof(STORAGE_OBJECT_INFO));
+	}
+	__except (EXCEPTION_EXECUTE_HANDLER) {
+		return GetExceptionCode();
+	}
+	pIrp->IoStatus.Information = sizeof(STORAGE_OBJECT_INFO);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS IdBindStorageIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack) {
+	LOG("IdBindStorageIoctlHandler called\n");
+	SECTOR_ID_IO_REQUEST request;
+	PSTORAGE_OBJECT pStorageObject;
+	NTSTATUS status = ResolveStorageId(pIrpStack, &request, &pStorageObject);
+	if (!NT_SUCCESS(status))
+		return status;
+	return BindStorageIoctlHandler(pIrp, pIrpStack, pStorageObject);
+}
@@ -1,12 +1,113 @@
 #pragma once
 #include "Sector.hpp"
+#include "VolumeInfo.hpp"
 
-typedef struct _IOCTL_COMPLETION_CONTEXT {
-    KEVENT event;
-    IO_STATUS_BLOCK ioStatusBlock;
-} IOCTL_COMPLETION_CONTEXT, * PIOCTL_COMPLETION_CONTEXT;
+#pragma pack (push, 1)
+
+#define SECTOR_STORAGE_INFO_ALL     0x00000001  // every present storage object instead of the one at location
+
+// Longer form of the IOCTL_GET_DISK_INFO input, which returns SECTOR_STORAGE_INFO_EX records instead of
+// STORAGE_OBJECT_INFO. Sizes are reported the same way: a buffer too small for all records receives the number of
+// bytes needed as a SIZE_T, and the call fails with STATUS_BUFFER_TOO_SMALL.
+typedef struct _SECTOR_STORAGE_INFO_REQUEST {
+    STORAGE_LOCATION location;
+    ULONG fields;                   // SECTOR_VOLUME_* to look up
+    ULONG flags;                    // SECTOR_STORAGE_INFO_*
+} SECTOR_STORAGE_INFO_REQUEST, *PSECTOR_STORAGE_INFO_REQUEST;
+
+typedef struct _SECTOR_STORAGE_INFO_EX {
+    STORAGE_OBJECT_INFO info;
+    SECTOR_VOLUME_INFO volume;      // only the requested fields; none for raw disks
+} SECTOR_STORAGE_INFO_EX, *PSECTOR_STORAGE_INFO_EX;
+
+// Writes only: read the sectors back afterwards and fail with STATUS_DEVICE_DATA_ERROR if they differ.
+// IOCTL_SECTOR_COMPARE_WRITE with SECTOR_COMPARE_VERIFY also reports where.
+#define SECTOR_IO_VERIFY            0x00000001
+// Writes only: on a disk whose physical sectors are larger than its logical ones, widen a write that does not cover
+// whole physical sectors by reading the partial ones first, instead of leaving that read-modify-write to the device.
+// Atomic only against other such writes and compare-and-writes; see IOCTL_GET_IO_HEALTH for how often it happens.
+#define SECTOR_IO_ALIGN_PHYSICAL    0x00000002
+// Writes only, at most one of them. Without either, a write may still sit in the device's volatile cache on return.
+// SECTOR_IO_FUA writes through that cache. SECTOR_IO_FLUSH returns once a cache flush sent after the write is back;
+// concurrent flush writes to the same storage object share one flush, see IOCTL_GET_IO_HEALTH.
+#define SECTOR_IO_FUA               0x00000004
+#define SECTOR_IO_FLUSH             0x00000008
+#define SECTOR_IO_WRITE_FLAGS       (SECTOR_IO_VERIFY | SECTOR_IO_ALIGN_PHYSICAL | SECTOR_IO_FUA | SECTOR_IO_FLUSH)
+// Reads only: fail with STATUS_DEVICE_DATA_ERROR at once if the range touches a sector in the storage object's bad
+// sector map, instead of letting a dying disk spend seconds retrying it. Without it the read always goes to the disk.
+#define SECTOR_IO_FAIL_KNOWN_BAD    0x00000010
+#define SECTOR_IO_READ_FLAGS        (SECTOR_IO_FAIL_KNOWN_BAD)
+
+// Longer form of the IOCTL_SECTOR_READ/WRITE input. A bare STORAGE_LOCATION is still accepted.
+typedef struct _SECTOR_IO_REQUEST {
+    STORAGE_LOCATION location;
+    ULONG flags;                    // SECTOR_IO_*
+    ULONG timeoutMs;                // 0 for none; past it the lower transfer is cancelled and the request fails
+                                    // with STATUS_IO_TIMEOUT (ERROR_SEM_TIMEOUT)
+} SECTOR_IO_REQUEST, *PSECTOR_IO_REQUEST;
+
+#define SECTOR_IO_HEALTH_RESET      0x00000001  // clear the counters after reading them
+
+// Input of IOCTL_GET_IO_HEALTH; a bare STORAGE_LOCATION reads the counters without flags.
+typedef struct _SECTOR_IO_HEALTH_REQUEST {
+    STORAGE_LOCATION location;
+    ULONG flags;                    // SECTOR_IO_HEALTH_*
+} SECTOR_IO_HEALTH_REQUEST, *PSECTOR_IO_HEALTH_REQUEST;
+
+// Lower transfer outcomes of one storage object since it was found or last reset
+typedef struct _SECTOR_IO_HEALTH {
+    ULONGLONG completedIos;
+    ULONGLONG failedIos;
+    ULONGLONG timedOutIos;
+    ULONGLONG cancelledIos;
+    ULONGLONG averageLatency100ns;
+    ULONGLONG maxLatency100ns;
+    ULONGLONG lastTimeoutTime;      // system time (FILETIME), 0 if none
+} SECTOR_IO_HEALTH, *PSECTOR_IO_HEALTH;
+
+// Returned instead of SECTOR_IO_HEALTH when the output buffer holds it
+typedef struct _SECTOR_IO_HEALTH_EX {
+    SECTOR_IO_HEALTH health;
+    ULONGLONG unalignedWrites;      // writes not covering whole physical sectors, as the device received them
+    ULONGLONG paddedWrites;         // writes widened to whole physical sectors by SECTOR_IO_ALIGN_PHYSICAL
+    ULONGLONG flushRequests;        // successful SECTOR_IO_FLUSH writes
+    ULONGLONG lowerFlushes;         // cache flushes sent for them; flushRequests / lowerFlushes writes share each
+} SECTOR_IO_HEALTH_EX, *PSECTOR_IO_HEALTH_EX;
+
+// Output of IOCTL_SECTOR_BIND. Its input is a STORAGE_LOCATION whose sectorNumber is ignored.
+typedef struct _SECTOR_BIND_RESULT {
+    ULONG sectorSize;
+    ULONGLONG sectorCount;
+    STORAGE_OBJECT_INFO info;
+} SECTOR_BIND_RESULT, *PSECTOR_BIND_RESULT;
+
+// Input of IOCTL_SECTOR_READ_BOUND/WRITE_BOUND on a bound handle; a bare ULONGLONG sector number is accepted as well.
+// The output buffer holds the data, a whole number of sectors that has to lie within the bound storage object.
+typedef struct _SECTOR_BOUND_IO_REQUEST {
+    ULONGLONG sectorNumber;
+    ULONG flags;                    // as in SECTOR_IO_REQUEST
+    ULONG timeoutMs;                // as in SECTOR_IO_REQUEST
+} SECTOR_BOUND_IO_REQUEST, *PSECTOR_BOUND_IO_REQUEST;
+
+// Input of IOCTL_SECTOR_READ_BY_ID/WRITE_BY_ID; a bare STORAGE_ID_LOCATION is accepted as well. IOCTL_GET_INFO_BY_ID
+// and IOCTL_SECTOR_BIND_BY_ID take a STORAGE_ID_LOCATION whose sectorNumber is ignored, and return what their
+// STORAGE_LOCATION counterparts do.
+typedef struct _SECTOR_ID_IO_REQUEST {
+    STORAGE_ID_LOCATION location;
+    ULONG flags;                    // as in SECTOR_IO_REQUEST
+    ULONG timeoutMs;                // as in SECTOR_IO_REQUEST
+} SECTOR_ID_IO_REQUEST, *PSECTOR_ID_IO_REQUEST;
+
+#pragma pack (pop)
 
 NTSTATUS GetSectorSizeIoctlHandler(IN PIRP pIrp, IN PSTORAGE_OBJECT pStorageObject);
 NTSTATUS ReadSectorIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject, IN PSTORAGE_LOCATION pStorageLocation);
 NTSTATUS WriteSectorIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject, IN PSTORAGE_LOCATION pStorageLocation);
 NTSTATUS StorageInfoIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack);
+NTSTATUS GetIoHealthIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject);
+// Binds the handle to one storage object for good, so that its bound reads and writes skip locating it.
+NTSTATUS BindStorageIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PSTORAGE_OBJECT pStorageObject);
+NTSTATUS BoundSectorIoIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN BOOLEAN isWrite);
+NTSTATUS IdSectorIoIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN BOOLEAN isWrite);
+NTSTATUS IdStorageInfoIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack);
+NTSTATUS IdBindStorageIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack);
@@ -0,0 +1,58 @@
+#include "Simd.hpp"
+
+static ULONG g_simdFeatures = 0;
+
+void SimdInitialize() {
+    ULONG features = 0;
+#if SIMD_X64
+    int regs[4];
+    features |= SIMD_FEATURE_SSE2;
+
+    __cpuid(regs, 0);
+    int maxLeaf = regs[0];
+
+    __cpuid(regs, 1);
+    if (regs[2] & (1 << 20))
+        features |= SIMD_FEATURE_SSE42;
+    BOOLEAN avxUsable = (regs[2] & (1 << 28)) && (regs[2] & (1 << 27)) &&
+        (RtlGetEnabledExtendedFeatures(XSTATE_MASK_AVX) & XSTATE_MASK_AVX);
+
+    if (maxLeaf >= 7) {
+        __cpuidex(regs, 7, 0);
+        if (avxUsable && (regs[1] & (1 << 5)))
+            features |= SIMD_FEATURE_AVX2;
+        if (regs[1] & (1 << 29))
+            features |= SIMD_FEATURE_SHA;
+    }
+#endif
+    g_simdFeatures = features;
+    LOG("SIMD features: 0x%08X\n", features);
+}
+
+ULONG SimdGetFeatures() {
+    return g_simdFeatures;
+}
+
+void SimdEnterScope(OUT PSIMD_SCOPE pScope) {
+    pScope->features = g_simdFeatures;
+#if SIMD_X64
+    pScope->extendedStateSaved = FALSE;
+    if (pScope->features & SIMD_FEATURE_AVX2) {
+        if (NT_SUCCESS(KeSaveExtendedProcessorState(XSTATE_MASK_AVX, &pScope->extendedState)))
+            pScope->extendedStateSaved = TRUE;
+        else
+            pScope->features &= ~SIMD_FEATURE_AVX2;
+    }
+#endif
+}
+
+void SimdLeaveScope(IN PSIMD_SCOPE pScope) {
+#if SIMD_X64
+    if (pScope->extendedStateSaved) {
+        KeRestoreExtendedProcessorState(&pScope->extendedState);
+        pScope->extendedStateSaved = FALSE;
+    }
+#else
+    UNREFERENCED_PARAMETER(pScope);
+#endif
+}
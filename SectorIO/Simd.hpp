@@ -0,0 +1,19 @@
+#pragma once
+#include "Driver.hpp"
+#include "SimdCommon.hpp"
+
+typedef struct _SIMD_SCOPE {
+    ULONG features;
+#if SIMD_X64
+    BOOLEAN extendedStateSaved;
+    XSTATE_SAVE extendedState;
+#endif
+} SIMD_SCOPE, *PSIMD_SCOPE;
+
+void SimdInitialize();
+ULONG SimdGetFeatures();
+
+// YMM registers are not preserved for kernel code, so AVX2 kernels may only run between these two calls.
+// SSE/SHA-NI/CRC32 only touch XMM state and are usable on x64 without saving anything.
+void SimdEnterScope(OUT PSIMD_SCOPE pScope);
+void SimdLeaveScope(IN PSIMD_SCOPE pScope);
@@ -0,0 +1,45 @@
+#pragma once
+// Shared between the driver and host builds of the scan/hash kernels, so nothing in here may depend on WDK headers.
+#include <stddef.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define SIMD_X64 1
+#include <immintrin.h>
+#else
+#define SIMD_X64 0
+#endif
+
+// MSVC lets any function use any intrinsic; GCC/Clang need the ISA enabled per function.
+#if defined(_MSC_VER)
+#define SIMD_TARGET(isa)
+#else
+#define SIMD_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+#define SIMD_FEATURE_SSE2   0x00000001u
+#define SIMD_FEATURE_SSE42  0x00000002u
+#define SIMD_FEATURE_AVX2   0x00000004u
+#define SIMD_FEATURE_SHA    0x00000008u
+
+static inline unsigned int SimdCountTrailingZeros(unsigned int value) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, value);
+    return (unsigned int)index;
+#else
+    return (unsigned int)__builtin_ctz(value);
+#endif
+}
+
+static inline unsigned int SimdCountLeadingZeros64(unsigned long long value) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return 63 - (unsigned int)index;
+#else
+    return (unsigned int)__builtin_clzll(value);
+#endif
+}
@@ -0,0 +1,498 @@
+#include "StorageIo.hpp"
+#include "HandleContext.hpp"
+#include "Elevator.hpp"
+#include "Coalesce.hpp"
+#include "PartitionMap.hpp"
+#include "RequestControl.hpp"
+#include "Rescue.hpp"
+#include "ChangeTracking.hpp"
+
+static NTSTATUS RWIrpCompletion(IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp, IN PVOID Context) {
+    UNREFERENCED_PARAMETER(DeviceObject);
+    PIOCTL_COMPLETION_CONTEXT ctx = (PIOCTL_COMPLETION_CONTEXT)Context;
+    // The waiter may free the transfer as soon as the event is set
+    PSTORAGE_IO pIo = CONTAINING_RECORD(ctx, STORAGE_IO, ctx);
+    if (pIo->elevated)
+        ElevatorIoCompleted(pIo);
+    ctx->ioStatusBlock.Status = Irp->IoStatus.Status;
+    ctx->ioStatusBlock.Information = Irp->IoStatus.Information;
+    KeSetEvent(&ctx->event, IO_NO_INCREMENT, FALSE);
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+void StorageIoInitialize(OUT PSTORAGE_IO pIo, IN PSTORAGE_OBJECT pStorageObject, IN BOOLEAN isWrite, IN PMDL pMdl, IN ULONGLONG byteOffset, IN ULONG length, IN PIRP pOriginIrp OPTIONAL) {
+    RtlZeroMemory(pIo, sizeof(*pIo));
+    pIo->pStorageObject = pStorageObject;
+    pIo->isWrite = isWrite;
+    pIo->pMdl = pMdl;
+    pIo->byteOffset = byteOffset;
+    pIo->length = length;
+    pIo->pOriginIrp = pOriginIrp;
+}
+
+// The handle's class wins over the object's.
+static ULONG StorageIoPriorityClass(IN PQOS_LIMITER pHandleLimiter OPTIONAL, IN PQOS_LIMITER pStorageLimiter OPTIONAL) {
+    ULONG priorityClass = SECTOR_QOS_PRIORITY_NORMAL;
+    if (pHandleLimiter) {
+        priorityClass = QosPriorityClass(pHandleLimiter);
+        if (priorityClass == SECTOR_QOS_PRIORITY_NORMAL && pStorageLimiter)
+            priorityClass = QosPriorityClass(pStorageLimiter);
+    }
+    else if (pStorageLimiter) {
+        priorityClass = QosPriorityClass(pStorageLimiter);
+    }
+    return priorityClass;
+}
+
+// Handle limits apply before storage object limits, so one throttled handle cannot hold up the object's queue.
+static NTSTATUS StorageIoAdmit(IN PSTORAGE_IO pIo, OUT IO_PRIORITY_HINT* pPriorityHint) {
+    PHANDLE_CONTEXT pContext = GetHandleContext(pIo->pOriginIrp);
+    PQOS_LIMITER pHandleLimiter = pContext ? &pContext->qos : NULL;
+    PQOS_LIMITER pStorageLimiter = QosGetStorageLimiter(pIo->pStorageObject, FALSE);
+
+    // Without a class from either limiter the caller's own hint is passed through.
+    ULONG priorityClass = StorageIoPriorityClass(pHandleLimiter, pStorageLimiter);
+    *pPriorityHint = pIo->pOriginIrp ? IoGetIoPriorityHint(pIo->pOriginIrp) : IoPriorityNormal;
+    if (priorityClass != SECTOR_QOS_PRIORITY_NORMAL)
+        *pPriorityHint = QosPriorityHint(priorityClass);
+
+    NTSTATUS status = QosAdmit(pHandleLimiter, priorityClass, pIo->length, pIo->pOriginIrp);
+    if (!NT_SUCCESS(status))
+        return status;
+    return QosAdmit(pStorageLimiter, priorityClass, pIo->length, pIo->pOriginIrp);
+}
+
+NTSTATUS StorageIoAdmitCommand(IN PSTORAGE_OBJECT pStorageObject, IN PIRP pOriginIrp OPTIONAL, IN ULONG length) {
+    NTSTATUS status = RequestAbortStatus(pOriginIrp);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    STORAGE_IO io;
+    IO_PRIORITY_HINT priorityHint;
+    StorageIoInitialize(&io, pStorageObject, TRUE, NULL, 0, length, pOriginIrp);
+    return StorageIoAdmit(&io, &priorityHint);
+}
+
+NTSTATUS StorageIoAdmitShared(IN PSTORAGE_OBJECT pStorageObject, IN PIRP pOriginIrp OPTIONAL, IN ULONG length) {
+    PHANDLE_CONTEXT pContext = GetHandleContext(pOriginIrp);
+    if (!pContext)
+        return STATUS_SUCCESS;
+
+    ULONG priorityClass = StorageIoPriorityClass(&pContext->qos, QosGetStorageLimiter(pStorageObject, FALSE));
+    return QosAdmit(&pContext->qos, priorityClass, length, pOriginIrp);
+}
+
+NTSTATUS StorageIoStart(IN PSTORAGE_IO pIo) {
+    PDEVICE_OBJECT pDeviceObject = pIo->pStorageObject->pStorageDeviceObject;
+
+    NTSTATUS status = RequestAbortStatus(pIo->pOriginIrp);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    if (pIo->isWrite) {
+        if (!StorageIsPhysicallyAligned(pIo->pStorageObject, pIo->byteOffset, pIo->length))
+            InterlockedIncrement64(&pIo->pStorageObject->unalignedWrites);
+        CoalesceWriteStarted(pIo->pStorageObject, pIo->byteOffset, pIo->length);
+        PartitionCacheInvalidate(pIo->pStorageObject, pIo->byteOffset, pIo->length);
+    }
+
+    IO_PRIORITY_HINT priorityHint;
+    status = StorageIoAdmit(pIo, &priorityHint);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    pIo->pLowerIrp = IoAllocateIrp(pDeviceObject->StackSize, FALSE);
+    if (!pIo->pLowerIrp) {
+        LOG("  IoAllocateIrp failed\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    KeInitializeEvent(&pIo->ctx.event, NotificationEvent, FALSE);
+    IoSetCompletionRoutine(pIo->pLowerIrp, RWIrpCompletion, &pIo->ctx, TRUE, TRUE, TRUE);
+
+    LARGE_INTEGER diskOffset;
+    diskOffset.QuadPart = (LONGLONG)pIo->byteOffset;
+
+    PIO_STACK_LOCATION nextSp = IoGetNextIrpStackLocation(pIo->pLowerIrp);
+    if (pIo->isWrite) {
+        nextSp->MajorFunction = IRP_MJ_WRITE;
+        nextSp->Parameters.Write.Length = pIo->length;
+        nextSp->Parameters.Write.ByteOffset = diskOffset;
+        nextSp->Flags |= SL_FORCE_DIRECT_WRITE | SL_OVERRIDE_VERIFY_VOLUME;
+        if (pIo->writeThrough)
+            nextSp->Flags |= SL_WRITE_THROUGH;
+    }
+    else {
+        nextSp->MajorFunction = IRP_MJ_READ;
+        nextSp->Parameters.Read.Length = pIo->length;
+        nextSp->Parameters.Read.ByteOffset = diskOffset;
+    }
+    nextSp->DeviceObject = pDeviceObject;
+    pIo->pLowerIrp->MdlAddress = pIo->pMdl;
+    if (priorityHint != IoPriorityNormal)
+        IoSetIoPriorityHint(pIo->pLowerIrp, priorityHint);
+
+    // The completion routine always signals the event, so the result is picked up in StorageIoWait either way.
+    pIo->startTime = KeQueryInterruptTime();
+    if (ElevatorSubmit(pIo))
+        return STATUS_PENDING;
+    IoCallDriver(pDeviceObject, pIo->pLowerIrp);
+    return STATUS_PENDING;
+}
+
+static void StorageIoAccount(IN PSTORAGE_IO pIo, IN NTSTATUS status, IN NTSTATUS abortStatus) {
+    PSTORAGE_OBJECT pStorageObject = pIo->pStorageObject;
+    LONG64 latency = (LONG64)(KeQueryInterruptTime() - pIo->startTime);
+
+    if (abortStatus == STATUS_IO_TIMEOUT && !NT_SUCCESS(status)) {
+        LARGE_INTEGER now;
+        KeQuerySystemTime(&now);
+        InterlockedIncrement64(&pStorageObject->timedOutIos);
+        InterlockedExchange64(&pStorageObject->lastTimeoutTime, now.QuadPart);
+    }
+    else if (abortStatus == STATUS_CANCELLED && !NT_SUCCESS(status))
+        InterlockedIncrement64(&pStorageObject->cancelledIos);
+    else if (NT_SUCCESS(status))
+        InterlockedIncrement64(&pStorageObject->completedIos);
+    else
+        InterlockedIncrement64(&pStorageObject->failedIos);
+
+    InterlockedExchangeAdd64(&pStorageObject->totalLatency100ns, latency);
+    LONG64 highest = pStorageObject->maxLatency100ns;
+    while (latency > highest) {
+        LONG64 seen = InterlockedCompareExchange64(&pStorageObject->maxLatency100ns, latency, highest);
+        if (seen == highest)
+            break;
+        highest = seen;
+    }
+}
+
+NTSTATUS StorageIoWait(IN PSTORAGE_IO pIo, OUT PULONG_PTR information OPTIONAL) {
+    if (!pIo->pLowerIrp)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    NTSTATUS abortStatus = RequestWait(pIo->pOriginIrp, &pIo->ctx.event);
+    if (!NT_SUCCESS(abortStatus)) {
+        if (pIo->elevated && ElevatorWithdraw(pIo)) {
+            // Still queued, so it never reached the device.
+            pIo->ctx.ioStatusBlock.Status = abortStatus;
+            pIo->ctx.ioStatusBlock.Information = 0;
+        }
+        else {
+            IoCancelIrp(pIo->pLowerIrp);
+            KeWaitForSingleObject(&pIo->ctx.event, Executive, KernelMode, FALSE, NULL);
+        }
+    }
+
+    NTSTATUS status = pIo->ctx.ioStatusBlock.Status;
+    // A transfer that finished anyway keeps its result; one the lower driver gave up on reports the deadline.
+    if (abortStatus == STATUS_IO_TIMEOUT && status == STATUS_CANCELLED)
+        status = STATUS_IO_TIMEOUT;
+    if (information) *information = pIo->ctx.ioStatusBlock.Information;
+    StorageIoAccount(pIo, status, abortStatus);
+    if (NT_SUCCESS(abortStatus))
+        BadSectorsTransferDone(pIo->pStorageObject, pIo->isWrite, pIo->byteOffset, pIo->length, status);
+
+    IoFreeIrp(pIo->pLowerIrp);
+    pIo->pLowerIrp = NULL;
+
+    // A partition map decoded while the write was in flight may hold the old sectors. Changes are recorded only now,
+    // so a snapshot taken while the write is in flight leaves it for the next one. Failed and aborted writes may have
+    // reached the medium in part, so they are recorded as well.
+    if (pIo->isWrite) {
+        PartitionCacheInvalidate(pIo->pStorageObject, pIo->byteOffset, pIo->length);
+        ChangeTrackingMarkWrite(pIo->pStorageObject, pIo->byteOffset, pIo->length);
+    }
+    return status;
+}
+
+NTSTATUS StorageIoTransfer(IN PSTORAGE_IO pIo, OUT PULONG_PTR information OPTIONAL) {
+    NTSTATUS status = StorageIoStart(pIo);
+    if (status != STATUS_PENDING)
+        return status;
+    return StorageIoWait(pIo, information);
+}
+
+NTSTATUS StorageIoAllocateBuffer(IN ULONG length, OUT PUCHAR* ppBuffer, OUT PMDL* ppMdl) {
+    *ppBuffer = NULL;
+    *ppMdl = NULL;
+
+    PUCHAR pBuffer = new (NON_PAGED) UCHAR[length];
+    if (!pBuffer)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    PMDL pMdl = IoAllocateMdl(pBuffer, length, FALSE, FALSE, NULL);
+    if (!pMdl) {
+        delete[] pBuffer;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    MmBuildMdlForNonPagedPool(pMdl);
+
+    *ppBuffer = pBuffer;
+    *ppMdl = pMdl;
+    return STATUS_SUCCESS;
+}
+
+void StorageIoFreeBuffer(IN PUCHAR pBuffer, IN PMDL pMdl) {
+    if (pMdl) IoFreeMdl(pMdl);
+    if (pBuffer) delete[] pBuffer;
+}
+
+ULONGLONG GetStorageObjectLength(IN PSTORAGE_OBJECT pStorageObject) {
+    if (!pStorageObject->info.isRawDiskObject && pStorageObject->info.partitionSizeBytes)
+        return pStorageObject->info.partitionSizeBytes;
+    return pStorageObject->info.diskSizeBytes;
+}
+
+BOOLEAN StorageIsPhysicallyAligned(IN PSTORAGE_OBJECT pStorageObject, IN ULONGLONG byteOffset, IN ULONGLONG length) {
+    ULONG physicalSectorSize = pStorageObject->info.physicalSectorSize;
+    if (physicalSectorSize <= pStorageObject->info.sectorSize)
+        return TRUE;
+    return PhysicalSectorIsAligned(physicalSectorSize, pStorageObject->info.physicalSectorOffset, byteOffset, length) ? TRUE : FALSE;
+}
+
+NTSTATUS ValidateSectorRange(IN PSTORAGE_OBJECT pStorageObject, IN ULONGLONG startSector, IN ULONGLONG sectorCount) {
+    ULONG sectorSize = pStorageObject->info.sectorSize;
+    if (sectorSize == 0 || sectorCount == 0)
+        return STATUS_INVALID_PARAMETER;
+
+    ULONGLONG totalSectors = GetStorageObjectLength(pStorageObject) / sectorSize;
+    if (startSector >= totalSectors || sectorCount > totalSectors - startSector)
+        return STATUS_INVALID_PARAMETER;
+
+    return STATUS_SUCCESS;
+}
+
+// Room for 32768 slab bits per query, which covers a whole stream chunk for any realistic slab size.
+#define STORAGE_ALLOCATION_BITMAP_BYTES 4096
+
+// Data set management input describing a single range
+typedef struct _STORAGE_DSM_RANGE_INPUT {
+    DEVICE_MANAGE_DATA_SET_ATTRIBUTES attributes;
+    DEVICE_DATA_SET_RANGE range;
+} STORAGE_DSM_RANGE_INPUT;
+
+static void InitializeDsmRangeInput(OUT STORAGE_DSM_RANGE_INPUT* pInput, IN DEVICE_DATA_MANAGEMENT_SET_ACTION action, IN ULONGLONG byteOffset, IN ULONGLONG length) {
+    RtlZeroMemory(pInput, sizeof(*pInput));
+    pInput->attributes.Size = sizeof(pInput->attributes);
+    pInput->attributes.Action = action;
+    pInput->attributes.DataSetRangesOffset = FIELD_OFFSET(STORAGE_DSM_RANGE_INPUT, range);
+    pInput->attributes.DataSetRangesLength = sizeof(pInput->range);
+    pInput->range.StartingOffset = (LONGLONG)byteOffset;
+    pInput->range.LengthInBytes = length;
+}
+
+NTSTATUS StorageQueryProperty(IN PSTORAGE_OBJECT pStorageObject, IN STORAGE_PROPERTY_ID propertyId, OUT PVOID pDescriptor, IN ULONG descriptorLength) {
+    STORAGE_PROPERTY_QUERY query;
+    RtlZeroMemory(&query, sizeof(query));
+    query.PropertyId = propertyId;
+    query.QueryType = PropertyStandardQuery;
+
+    RtlZeroMemory(pDescriptor, descriptorLength);
+    ULONG_PTR information = 0;
+    NTSTATUS status = IoDeviceControl(pStorageObject->pStorageDeviceObject, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query), pDescriptor, descriptorLength, &information);
+    if (NT_SUCCESS(status) && information < descriptorLength)
+        status = STATUS_NOT_SUPPORTED;
+    return status;
+}
+
+BOOLEAN StorageSupportsTrim(IN PSTORAGE_OBJECT pStorageObject) {
+    DEVICE_TRIM_DESCRIPTOR trim;
+    NTSTATUS status = StorageQueryProperty(pStorageObject, StorageDeviceTrimProperty, &trim, sizeof(trim));
+    return NT_SUCCESS(status) && trim.TrimEnabled;
+}
+
+NTSTATUS StorageTrim(IN PSTORAGE_OBJECT pStorageObject, IN ULONGLONG byteOffset, IN ULONGLONG length) {
+    STORAGE_DSM_RANGE_INPUT input;
+    InitializeDsmRangeInput(&input, DeviceDsmAction_Trim, byteOffset, length);
+    CoalesceWriteStarted(pStorageObject, byteOffset, length);
+    PartitionCacheInvalidate(pStorageObject, byteOffset, length);
+    NTSTATUS status = IoDeviceControl(pStorageObject->pStorageDeviceObject, IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES, &input, sizeof(input), NULL, 0, NULL);
+    PartitionCacheInvalidate(pStorageObject, byteOffset, length);
+    ChangeTrackingMarkWrite(pStorageObject, byteOffset, length);
+    return status;
+}
+
+NTSTATUS StorageAllocationMapAllocate(OUT PSTORAGE_ALLOCATION_MAP pMap) {
+    RtlZeroMemory(pMap, sizeof(*pMap));
+    pMap->bufferLength = sizeof(DEVICE_MANAGE_DATA_SET_ATTRIBUTES_OUTPUT) + sizeof(DEVICE_DATA_SET_LB_PROVISIONING_STATE) + STORAGE_ALLOCATION_BITMAP_BYTES;
+    pMap->pBuffer = new (NON_PAGED) UCHAR[pMap->bufferLength];
+    return pMap->pBuffer ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+}
+
+void StorageAllocationMapFree(IN PSTORAGE_ALLOCATION_MAP pMap) {
+    if (pMap->pBuffer) delete[] pMap->pBuffer;
+    RtlZeroMemory(pMap, sizeof(*pMap));
+}
+
+NTSTATUS StorageQueryAllocation(IN PSTORAGE_OBJECT pStorageObject, IN ULONGLONG byteOffset, IN ULONGLONG length, IN OUT PSTORAGE_ALLOCATION_MAP pMap) {
+    pMap->slabCount = 0;
+    pMap->bitmap = NULL;
+
+    STORAGE_DSM_RANGE_INPUT input;
+    InitializeDsmRangeInput(&input, DeviceDsmAction_Allocation, byteOffset, length);
+
+    RtlZeroMemory(pMap->pBuffer, pMap->bufferLength);
+    NTSTATUS status = IoDeviceControl(pStorageObject->pStorageDeviceObject, IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES, &input, sizeof(input), pMap->pBuffer, pMap->bufferLength, NULL);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    PDEVICE_MANAGE_DATA_SET_ATTRIBUTES_OUTPUT pOutput = (PDEVICE_MANAGE_DATA_SET_ATTRIBUTES_OUTPUT)pMap->pBuffer;
+    if (pOutput->OutputBlockLength < FIELD_OFFSET(DEVICE_DATA_SET_LB_PROVISIONING_STATE, SlabAllocationBitMap) ||
+        pOutput->OutputBlockOffset > pMap->bufferLength ||
+        pOutput->OutputBlockLength > pMap->bufferLength - pOutput->OutputBlockOffset)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    PDEVICE_DATA_SET_LB_PROVISIONING_STATE pState = (PDEVICE_DATA_SET_LB_PROVISIONING_STATE)(pMap->pBuffer + pOutput->OutputBlockOffset);
+    ULONG bitmapBytes = pOutput->OutputBlockLength - FIELD_OFFSET(DEVICE_DATA_SET_LB_PROVISIONING_STATE, SlabAllocationBitMap);
+    if (pState->SlabSizeInBytes == 0 || (ULONGLONG)pState->SlabAllocationBitMapBitCount > (ULONGLONG)bitmapBytes * 8)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    pMap->firstSlabOffset = byteOffset + pState->SlabOffsetDeltaInBytes;
+    pMap->slabBytes = pState->SlabSizeInBytes;
+    pMap->slabCount = pState->SlabAllocationBitMapBitCount;
+    pMap->bitmap = pState->SlabAllocationBitMap;
+    return STATUS_SUCCESS;
+}
+
+BOOLEAN StorageAllocationIsMapped(IN PSTORAGE_ALLOCATION_MAP pMap, IN ULONGLONG byteOffset, IN ULONGLONG length) {
+    if (!pMap->bitmap || byteOffset < pMap->firstSlabOffset)
+        return TRUE;
+
+    ULONGLONG firstSlab = (byteOffset - pMap->firstSlabOffset) / pMap->slabBytes;
+    ULONGLONG lastSlab = (byteOffset + length - 1 - pMap->firstSlabOffset) / pMap->slabBytes;
+    if (lastSlab >= pMap->slabCount)
+        return TRUE;
+
+    for (ULONGLONG slab = firstSlab; slab <= lastSlab; slab++) {
+        if (pMap->bitmap[slab / 32] & (1u << (slab % 32)))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+typedef struct _RANGE_STREAM_BUFFER {
+    PUCHAR pBase;           // carry area followed by the chunk itself
+    PMDL pMdl;              // describes the chunk only
+    STORAGE_IO io;
+    BOOLEAN pending;
+    BOOLEAN skipped;        // queued without a read, handed to the callback with data == NULL
+    ULONGLONG byteOffset;
+    ULONG length;
+} RANGE_STREAM_BUFFER, *PRANGE_STREAM_BUFFER;
+
+static NTSTATUS StartRangeStreamRead(IN PRANGE_STREAM pStream, IN PRANGE_STREAM_BUFFER pBuffer, IN ULONGLONG byteOffset, IN ULONG length) {
+    pBuffer->byteOffset = byteOffset;
+    pBuffer->length = length;
+    if (pStream->skipRoutine && pStream->skipRoutine(pStream->context, byteOffset, length)) {
+        pBuffer->skipped = TRUE;
+        return STATUS_SUCCESS;
+    }
+
+    StorageIoInitialize(&pBuffer->io, pStream->pStorageObject, FALSE, pBuffer->pMdl, byteOffset, length, pStream->pOriginIrp);
+
+    NTSTATUS status = StorageIoStart(&pBuffer->io);
+    if (status != STATUS_PENDING)
+        return status;
+    pBuffer->pending = TRUE;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS StreamStorageRange(IN PRANGE_STREAM pStream) {
+    PSTORAGE_OBJECT pStorageObject = pStream->pStorageObject;
+    if (!pStorageObject || !pStream->chunkRoutine)
+        return STATUS_INVALID_PARAMETER;
+
+    NTSTATUS status = ValidateSectorRange(pStorageObject, pStream->startSector, pStream->sectorCount);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    ULONG sectorSize = pStorageObject->info.sectorSize;
+    ULONG chunkBytes = pStream->chunkBytes ? pStream->chunkBytes : STORAGE_IO_DEFAULT_CHUNK_BYTES;
+    chunkBytes -= chunkBytes % sectorSize;
+    if (chunkBytes == 0)
+        chunkBytes = sectorSize;
+
+    ULONG carryBytes = pStream->carryBytes;
+    if (carryBytes >= chunkBytes || (carryBytes && pStream->skipRoutine))
+        return STATUS_INVALID_PARAMETER;
+
+    RANGE_STREAM_BUFFER buffers[2];
+    RtlZeroMemory(buffers, sizeof(buffers));
+    for (int i = 0; i < 2; i++) {
+        buffers[i].pBase = new (NON_PAGED) UCHAR[carryBytes + chunkBytes];
+        if (buffers[i].pBase)
+            buffers[i].pMdl = IoAllocateMdl(buffers[i].pBase + carryBytes, chunkBytes, FALSE, FALSE, NULL);
+        if (!buffers[i].pMdl) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Done;
+        }
+        MmBuildMdlForNonPagedPool(buffers[i].pMdl);
+    }
+
+    {
+        ULONGLONG nextOffset = pStream->startSector * sectorSize;
+        ULONGLONG endOffset = nextOffset + pStream->sectorCount * sectorSize;
+
+        ULONG length = (ULONG)min((ULONGLONG)chunkBytes, endOffset - nextOffset);
+        status = StartRangeStreamRead(pStream, &buffers[0], nextOffset, length);
+        if (!NT_SUCCESS(status))
+            goto Done;
+        nextOffset += length;
+
+        for (ULONG k = 0; ; k++) {
+            PRANGE_STREAM_BUFFER current = &buffers[k & 1];
+            PRANGE_STREAM_BUFFER other = &buffers[(k + 1) & 1];
+
+            BOOLEAN skipped = current->skipped;
+            current->skipped = FALSE;
+            if (!skipped) {
+                ULONG_PTR transferred = 0;
+                status = StorageIoWait(&current->io, &transferred);
+                current->pending = FALSE;
+                if (!NT_SUCCESS(status)) {
+                    LOG("  range read at %llu failed: 0x%08X\n", current->byteOffset, status);
+                    break;
+                }
+                if (transferred < current->length) {
+                    status = STATUS_DEVICE_DATA_ERROR;
+                    break;
+                }
+            }
+
+            // The other buffer still holds the previous chunk; save its tail before the next read overwrites it.
+            ULONG carryLength = 0;
+            if (k > 0 && carryBytes) {
+                RtlCopyMemory(current->pBase, other->pBase + other->length, carryBytes);
+                carryLength = carryBytes;
+            }
+
+            if (nextOffset < endOffset) {
+                status = RequestAbortStatus(pStream->pOriginIrp);
+                if (!NT_SUCCESS(status))
+                    break;
+                length = (ULONG)min((ULONGLONG)chunkBytes, endOffset - nextOffset);
+                status = StartRangeStreamRead(pStream, other, nextOffset, length);
+                if (!NT_SUCCESS(status))
+                    break;
+                nextOffset += length;
+            }
+
+            status = pStream->chunkRoutine(pStream->context, current->byteOffset, skipped ? NULL : current->pBase + carryBytes, current->length, carryLength);
+            if (status == STATUS_NO_MORE_ENTRIES) {
+                status = STATUS_SUCCESS;
+                break;
+            }
+            if (!NT_SUCCESS(status) || (!other->pending && !other->skipped))
+                break;
+        }
+    }
+
+Done:
+    for (int i = 0; i < 2; i++) {
+        if (buffers[i].pending)
+            StorageIoWait(&buffers[i].io, NULL);
+        StorageIoFreeBuffer(buffers[i].pBase, buffers[i].pMdl);
+    }
+    return status;
+}
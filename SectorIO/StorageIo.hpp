@@ -0,0 +1,97 @@
+#pragma once
+#include "Sector.hpp"
+#include "ElevatorQueue.hpp"
+
+#define STORAGE_IO_DEFAULT_CHUNK_BYTES (1024 * 1024)
+
+// One lower read/write against a storage object. Offsets are relative to the storage object, the same way
+// IOCTL_SECTOR_READ/WRITE address it. The MDL has to describe locked memory for the whole transfer.
+typedef struct _STORAGE_IO {
+    PSTORAGE_OBJECT pStorageObject;
+    BOOLEAN isWrite;
+    PMDL pMdl;
+    ULONGLONG byteOffset;
+    ULONG length;
+    PIRP pOriginIrp;        // OPTIONAL, the user request this transfer is done for; selects QoS and priority, and its
+                            // cancellation or deadline aborts the transfer
+    BOOLEAN writeThrough;   // writes only: SL_WRITE_THROUGH, which the disk class driver sends on as FUA
+
+    PIRP pLowerIrp;
+    ULONGLONG startTime;    // interrupt time the lower IRP was handed on
+    IOCTL_COMPLETION_CONTEXT ctx;
+    BOOLEAN elevated;       // dispatched by the storage object's elevator
+    ELEVATOR_NODE elevatorNode;
+} STORAGE_IO, *PSTORAGE_IO;
+
+void StorageIoInitialize(OUT PSTORAGE_IO pIo, IN PSTORAGE_OBJECT pStorageObject, IN BOOLEAN isWrite, IN PMDL pMdl, IN ULONGLONG byteOffset, IN ULONG length, IN PIRP pOriginIrp OPTIONAL);
+// Every successfully started transfer must be finished with StorageIoWait, even if its result is not needed.
+// Waits for QoS budget first, so it has to be called at PASSIVE_LEVEL.
+NTSTATUS StorageIoStart(IN PSTORAGE_IO pIo);
+// What StorageIoStart checks before a transfer, for commands sent to the device some other way, such as a SCSI
+// pass-through: fails once the origin request is cancelled or past its deadline, then waits for QoS budget for length
+// bytes. Only the wait is covered; the command itself cannot be cancelled. Called at PASSIVE_LEVEL.
+NTSTATUS StorageIoAdmitCommand(IN PSTORAGE_OBJECT pStorageObject, IN PIRP pOriginIrp OPTIONAL, IN ULONG length);
+// For data handed out from a lower read admitted for another request: waits for the origin handle's budget for length
+// bytes, so sharing a read does not get around the handle's limits. The storage object's limiter is left alone, since
+// the device saw only the one read. Called at PASSIVE_LEVEL.
+NTSTATUS StorageIoAdmitShared(IN PSTORAGE_OBJECT pStorageObject, IN PIRP pOriginIrp OPTIONAL, IN ULONG length);
+// If the origin request is cancelled or its deadline passes first, the lower IRP is cancelled and the wait still lasts
+// until it is back. A transfer that did not finish in time fails with STATUS_IO_TIMEOUT.
+NTSTATUS StorageIoWait(IN PSTORAGE_IO pIo, OUT PULONG_PTR information OPTIONAL);
+NTSTATUS StorageIoTransfer(IN PSTORAGE_IO pIo, OUT PULONG_PTR information OPTIONAL);
+
+// Nonpaged buffer with an MDL already built for it, usable as the target of lower transfers.
+NTSTATUS StorageIoAllocateBuffer(IN ULONG length, OUT PUCHAR* ppBuffer, OUT PMDL* ppMdl);
+void StorageIoFreeBuffer(IN PUCHAR pBuffer, IN PMDL pMdl);
+
+ULONGLONG GetStorageObjectLength(IN PSTORAGE_OBJECT pStorageObject);
+// Whether the range starts and ends on physical sector boundaries, so the device can write it without reading first.
+BOOLEAN StorageIsPhysicallyAligned(IN PSTORAGE_OBJECT pStorageObject, IN ULONGLONG byteOffset, IN ULONGLONG length);
+NTSTATUS ValidateSectorRange(IN PSTORAGE_OBJECT pStorageObject, IN ULONGLONG startSector, IN ULONGLONG sectorCount);
+
+// IOCTL_STORAGE_QUERY_PROPERTY standard query; fails when the device returns less than descriptorLength bytes.
+NTSTATUS StorageQueryProperty(IN PSTORAGE_OBJECT pStorageObject, IN STORAGE_PROPERTY_ID propertyId, OUT PVOID pDescriptor, IN ULONG descriptorLength);
+BOOLEAN StorageSupportsTrim(IN PSTORAGE_OBJECT pStorageObject);
+// Unmaps the range; what it reads back as afterwards is up to the device.
+NTSTATUS StorageTrim(IN PSTORAGE_OBJECT pStorageObject, IN ULONGLONG byteOffset, IN ULONGLONG length);
+
+// Thin-provisioning state of a byte range, as reported by the DeviceDsmAction_Allocation data set management action.
+typedef struct _STORAGE_ALLOCATION_MAP {
+    PUCHAR pBuffer;
+    ULONG bufferLength;
+
+    ULONGLONG firstSlabOffset;  // storage object offset described by bit 0
+    ULONGLONG slabBytes;
+    ULONG slabCount;
+    const ULONG* bitmap;        // set bits are mapped slabs
+} STORAGE_ALLOCATION_MAP, *PSTORAGE_ALLOCATION_MAP;
+
+NTSTATUS StorageAllocationMapAllocate(OUT PSTORAGE_ALLOCATION_MAP pMap);
+void StorageAllocationMapFree(IN PSTORAGE_ALLOCATION_MAP pMap);
+// Fails on devices without logical block provisioning support; callers should then treat everything as mapped.
+NTSTATUS StorageQueryAllocation(IN PSTORAGE_OBJECT pStorageObject, IN ULONGLONG byteOffset, IN ULONGLONG length, IN OUT PSTORAGE_ALLOCATION_MAP pMap);
+// FALSE only when every byte of the range falls into slabs the last query reported as unmapped.
+BOOLEAN StorageAllocationIsMapped(IN PSTORAGE_ALLOCATION_MAP pMap, IN ULONGLONG byteOffset, IN ULONGLONG length);
+
+// Chunk callback of StreamStorageRange. carryLength bytes preceding data are valid as well and hold the tail of
+// the previous chunk, so matchers can find patterns that straddle chunk boundaries.
+// Returning STATUS_NO_MORE_ENTRIES stops the stream without failing it. data is NULL for chunks the skip routine
+// declined to read.
+typedef NTSTATUS (*PRANGE_CHUNK_ROUTINE)(IN PVOID context, IN ULONGLONG byteOffset, IN PUCHAR data, IN ULONG length, IN ULONG carryLength);
+// Asked before each chunk is read; returning TRUE skips the read.
+typedef BOOLEAN (*PRANGE_SKIP_ROUTINE)(IN PVOID context, IN ULONGLONG byteOffset, IN ULONG length);
+
+typedef struct _RANGE_STREAM {
+    PSTORAGE_OBJECT pStorageObject;
+    ULONGLONG startSector;
+    ULONGLONG sectorCount;
+    ULONG chunkBytes;       // 0 selects STORAGE_IO_DEFAULT_CHUNK_BYTES, rounded down to whole sectors
+    ULONG carryBytes;       // must be smaller than the chunk size
+    PRANGE_CHUNK_ROUTINE chunkRoutine;
+    PRANGE_SKIP_ROUTINE skipRoutine;  // OPTIONAL, cannot be combined with carryBytes
+    PVOID context;
+    PIRP pOriginIrp;        // OPTIONAL, polled for cancellation and its deadline between chunks
+} RANGE_STREAM, *PRANGE_STREAM;
+
+// Reads the range with two buffers so the next chunk is already in flight while the callback runs on the current one.
+NTSTATUS StreamStorageRange(IN PRANGE_STREAM pStream);
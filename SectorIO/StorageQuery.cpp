@@ -0,0 +1,158 @@
+#include "StorageQuery.hpp"
+
+static BOOLEAN StorageQueryMatches(IN PSTORAGE_OBJECT pObject, IN PSECTOR_STORAGE_QUERY pQuery) {
+    PSTORAGE_OBJECT_INFO pInfo = &pObject->info;
+    ULONG filters = pQuery->filters;
+
+    if ((filters & SECTOR_FILTER_DISK_INDEX) && pInfo->diskIndex != pQuery->diskIndex)
+        return FALSE;
+    if ((filters & SECTOR_FILTER_RAW) && pInfo->isRawDiskObject != pQuery->isRawDiskObject)
+        return FALSE;
+    // Raw disks do not fill in the partition fields.
+    if ((filters & (SECTOR_FILTER_PARTITION_STYLE | SECTOR_FILTER_GPT_TYPE)) && pInfo->isRawDiskObject)
+        return FALSE;
+    if ((filters & SECTOR_FILTER_PARTITION_STYLE) && (ULONG)pInfo->partitionStyle != pQuery->partitionStyle)
+        return FALSE;
+    if ((filters & SECTOR_FILTER_GPT_TYPE) &&
+        (pInfo->partitionStyle != PARTITION_STYLE_GPT || !IsEqualGUID(pInfo->gptPartitionTypeGuid, pQuery->gptPartitionTypeGuid)))
+        return FALSE;
+    if (filters & SECTOR_FILTER_MIN_SIZE) {
+        ULONGLONG size = pInfo->isRawDiskObject ? pInfo->diskSizeBytes : pInfo->partitionSizeBytes;
+        if (size < pQuery->minimumBytes)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static PUCHAR PutString(OUT PUCHAR p, IN const WCHAR* text, IN ULONG capacity) {
+    USHORT characters = 0;
+    while (characters < capacity && text[characters])
+        characters++;
+    ((PSECTOR_RECORD_STRING)p)->characters = characters;
+    p += sizeof(SECTOR_RECORD_STRING);
+    RtlCopyMemory(p, text, characters * sizeof(WCHAR));
+    return p + characters * sizeof(WCHAR);
+}
+
+// Encodes the record into a buffer of SECTOR_STORAGE_RECORD_MAX_BYTES and returns its length.
+static ULONG BuildStorageRecord(IN PSTORAGE_OBJECT pObject, IN PSECTOR_STORAGE_QUERY pQuery, OUT PUCHAR pBuffer) {
+    PSTORAGE_OBJECT_INFO pInfo = &pObject->info;
+    PSECTOR_STORAGE_RECORD pRecord = (PSECTOR_STORAGE_RECORD)pBuffer;
+    pRecord->isRawDiskObject = pInfo->isRawDiskObject;
+    pRecord->diskIndex = pInfo->diskIndex;
+    pRecord->partitionNumber = pInfo->partitionNumber;
+    pRecord->infoFields = pQuery->infoFields;
+    pRecord->volumeFields = 0;
+    PUCHAR p = (PUCHAR)(pRecord + 1);
+
+    if (pQuery->infoFields & SECTOR_INFO_SIZES) {
+        PSECTOR_RECORD_SIZES pSizes = (PSECTOR_RECORD_SIZES)p;
+        pSizes->partitionStartingOffset = pInfo->partitionStartingOffset;
+        pSizes->partitionSizeBytes = pInfo->partitionSizeBytes;
+        pSizes->diskSizeBytes = pInfo->diskSizeBytes;
+        pSizes->sectorSize = pInfo->sectorSize;
+        pSizes->physicalSectorSize = pInfo->physicalSectorSize;
+        pSizes->physicalSectorOffset = pInfo->physicalSectorOffset;
+        p += sizeof(*pSizes);
+    }
+    if (pQuery->infoFields & SECTOR_INFO_STYLE) {
+        PSECTOR_RECORD_STYLE pStyle = (PSECTOR_RECORD_STYLE)p;
+        pStyle->partitionStyle = (ULONG)pInfo->partitionStyle;
+        pStyle->mbrPartitionType = pInfo->mbrPartitionType;
+        p += sizeof(*pStyle);
+    }
+    if (pQuery->infoFields & SECTOR_INFO_GPT) {
+        PSECTOR_RECORD_GPT pGpt = (PSECTOR_RECORD_GPT)p;
+        pGpt->gptDiskId = pInfo->gptDiskId;
+        pGpt->gptPartitionTypeGuid = pInfo->gptPartitionTypeGuid;
+        pGpt->gptPartitionIdGuid = pInfo->gptPartitionIdGuid;
+        pGpt->gptAttributes = pInfo->gptAttributes;
+        p += sizeof(*pGpt);
+    }
+    if (pQuery->infoFields & SECTOR_INFO_GPT_NAME)
+        p = PutString(p, pInfo->gptName, ARRAYSIZE(pInfo->gptName));
+
+    if (pQuery->volumeFields) {
+        SECTOR_VOLUME_INFO volume;
+        VolumeQueryInfo(pObject, pQuery->volumeFields, &volume);
+        pRecord->volumeFields = volume.validFields;
+        if (volume.validFields & SECTOR_VOLUME_GUID) {
+            RtlCopyMemory(p, &volume.volumeGuid, sizeof(GUID));
+            p += sizeof(GUID);
+        }
+        if (volume.validFields & SECTOR_VOLUME_DRIVE_LETTERS)
+            p = PutString(p, volume.driveLetters, ARRAYSIZE(volume.driveLetters));
+        if (volume.validFields & SECTOR_VOLUME_LABEL) {
+            RtlCopyMemory(p, &volume.volumeSerialNumber, sizeof(ULONG));
+            p = PutString(p + sizeof(ULONG), volume.volumeLabel, ARRAYSIZE(volume.volumeLabel));
+        }
+        if (volume.validFields & SECTOR_VOLUME_FILE_SYSTEM)
+            p = PutString(p, volume.fileSystemName, ARRAYSIZE(volume.fileSystemName));
+        if (volume.validFields & SECTOR_VOLUME_SPACE) {
+            RtlCopyMemory(p, &volume.volumeTotalBytes, sizeof(ULONGLONG));
+            RtlCopyMemory(p + sizeof(ULONGLONG), &volume.volumeFreeBytes, sizeof(ULONGLONG));
+            p += 2 * sizeof(ULONGLONG);
+        }
+    }
+
+    pRecord->length = (USHORT)(p - pBuffer);
+    return pRecord->length;
+}
+
+NTSTATUS StorageQueryToUser(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PVOID outBuffer, IN ULONG outLength) {
+    SECTOR_STORAGE_QUERY query;
+    __try {
+        ProbeForRead(pIrpStack->Parameters.DeviceIoControl.Type3InputBuffer, sizeof(query), 1);
+        RtlCopyMemory(&query, pIrpStack->Parameters.DeviceIoControl.Type3InputBuffer, sizeof(query));
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return GetExceptionCode();
+    }
+    if ((query.filters & ~SECTOR_FILTER_ALL) || (query.infoFields & ~SECTOR_INFO_ALL) || (query.volumeFields & ~SECTOR_VOLUME_ALL_FIELDS))
+        return STATUS_INVALID_PARAMETER;
+    if (outLength < sizeof(SECTOR_STORAGE_QUERY_RESULT))
+        return STATUS_INFO_LENGTH_MISMATCH;
+
+    // Filtering is cheap enough to do under the list lock; only the matches that will be returned are kept, and
+    // records are built from them afterwards because volume lookups have to wait on other drivers.
+    SECTOR_STORAGE_QUERY_RESULT result = { 0, 0 };
+    vector<PSTORAGE_OBJECT> matches;
+    for (auto entry : g_pStorageObjects->locked()) {
+        if (!entry || entry->removedGeneration || !StorageQueryMatches(entry, &query))
+            continue;
+        if (result.matchCount++ < query.firstMatch)
+            continue;
+        NTSTATUS status = matches.push_back(entry);
+        if (!NT_SUCCESS(status))
+            return status;
+    }
+
+    UCHAR record[SECTOR_STORAGE_RECORD_MAX_BYTES];
+    ULONG offset = sizeof(SECTOR_STORAGE_QUERY_RESULT);
+    BOOLEAN complete = TRUE;
+    for (auto pObject : matches) {
+        ULONG length = BuildStorageRecord(pObject, &query, record);
+        if (length > outLength - offset) {
+            complete = FALSE;
+            break;
+        }
+        __try {
+            RtlCopyMemory((PUCHAR)outBuffer + offset, record, length);
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER) {
+            return GetExceptionCode();
+        }
+        offset += length;
+        result.recordCount++;
+    }
+
+    __try {
+        RtlCopyMemory(outBuffer, &result, sizeof(result));
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return GetExceptionCode();
+    }
+    pIrp->IoStatus.Information = offset;
+    LOG("  %lu of %lu matching storage objects returned in %lu bytes\n", result.recordCount, result.matchCount, offset);
+    return complete ? STATUS_SUCCESS : STATUS_BUFFER_OVERFLOW;
+}
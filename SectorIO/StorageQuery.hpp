@@ -0,0 +1,89 @@
+#pragma once
+#include "Sector.hpp"
+#include "VolumeInfo.hpp"
+
+#pragma pack (push, 1)
+
+// Conditions of SECTOR_STORAGE_QUERY that apply; all of them have to hold.
+#define SECTOR_FILTER_DISK_INDEX        0x00000001  // info.diskIndex == diskIndex
+#define SECTOR_FILTER_RAW               0x00000002  // info.isRawDiskObject == isRawDiskObject
+#define SECTOR_FILTER_PARTITION_STYLE   0x00000004  // a partition of a disk with that partition style
+#define SECTOR_FILTER_GPT_TYPE          0x00000008  // a GPT partition of that type
+#define SECTOR_FILTER_MIN_SIZE          0x00000010  // partition size, or disk size for raw disks, at least minimumBytes
+#define SECTOR_FILTER_ALL               0x0000001F
+
+// Parts of STORAGE_OBJECT_INFO a record carries after its header, in this order.
+#define SECTOR_INFO_SIZES               0x00000001  // SECTOR_RECORD_SIZES
+#define SECTOR_INFO_STYLE               0x00000002  // SECTOR_RECORD_STYLE
+#define SECTOR_INFO_GPT                 0x00000004  // SECTOR_RECORD_GPT
+#define SECTOR_INFO_GPT_NAME            0x00000008  // SECTOR_RECORD_STRING
+#define SECTOR_INFO_ALL                 0x0000000F
+
+// Longest form of the IOCTL_GET_DISK_INFO input. Returns a SECTOR_STORAGE_QUERY_RESULT followed by one variable-length
+// record per matching storage object, holding only the projected parts.
+typedef struct _SECTOR_STORAGE_QUERY {
+    ULONG filters;                  // SECTOR_FILTER_*
+    ULONG diskIndex;
+    BOOLEAN isRawDiskObject;
+    ULONG partitionStyle;           // PARTITION_STYLE
+    GUID gptPartitionTypeGuid;
+    ULONGLONG minimumBytes;
+    ULONG infoFields;               // SECTOR_INFO_* to return
+    ULONG volumeFields;             // SECTOR_VOLUME_* to look up and return, see SECTOR_VOLUME_INFO
+    ULONG firstMatch;               // matches to skip, to continue after a result that did not fit
+} SECTOR_STORAGE_QUERY, *PSECTOR_STORAGE_QUERY;
+
+// When the records do not all fit, the call returns STATUS_BUFFER_OVERFLOW with the ones that do; call again with
+// firstMatch advanced by recordCount. SECTOR_STORAGE_RECORD_MAX_BYTES past the result always holds the next record.
+typedef struct _SECTOR_STORAGE_QUERY_RESULT {
+    ULONG matchCount;               // all matching objects, including the skipped ones
+    ULONG recordCount;              // records that follow, for matches firstMatch onwards
+} SECTOR_STORAGE_QUERY_RESULT, *PSECTOR_STORAGE_QUERY_RESULT;
+
+#define SECTOR_STORAGE_RECORD_MAX_BYTES 512
+
+typedef struct _SECTOR_STORAGE_RECORD {
+    USHORT length;                  // of the whole record; the next one starts right after it
+    BOOLEAN isRawDiskObject;
+    ULONG diskIndex;
+    ULONG partitionNumber;
+    ULONG infoFields;               // SECTOR_INFO_* parts that follow
+    ULONG volumeFields;             // SECTOR_VOLUME_* parts that follow those, only for fields that could be determined
+    // SECTOR_INFO_* parts in bit order, then the SECTOR_VOLUME_* parts in bit order:
+    //   SECTOR_VOLUME_GUID             GUID
+    //   SECTOR_VOLUME_DRIVE_LETTERS    SECTOR_RECORD_STRING
+    //   SECTOR_VOLUME_LABEL            ULONG serial number, SECTOR_RECORD_STRING
+    //   SECTOR_VOLUME_FILE_SYSTEM      SECTOR_RECORD_STRING
+    //   SECTOR_VOLUME_SPACE            ULONGLONG total bytes, ULONGLONG free bytes
+} SECTOR_STORAGE_RECORD, *PSECTOR_STORAGE_RECORD;
+
+typedef struct _SECTOR_RECORD_SIZES {
+    ULONGLONG partitionStartingOffset;
+    ULONGLONG partitionSizeBytes;
+    ULONGLONG diskSizeBytes;
+    ULONG sectorSize;
+    ULONG physicalSectorSize;
+    ULONG physicalSectorOffset;
+} SECTOR_RECORD_SIZES, *PSECTOR_RECORD_SIZES;
+
+typedef struct _SECTOR_RECORD_STYLE {
+    ULONG partitionStyle;
+    UCHAR mbrPartitionType;
+} SECTOR_RECORD_STYLE, *PSECTOR_RECORD_STYLE;
+
+typedef struct _SECTOR_RECORD_GPT {
+    GUID gptDiskId;
+    GUID gptPartitionTypeGuid;
+    GUID gptPartitionIdGuid;
+    ULONGLONG gptAttributes;
+} SECTOR_RECORD_GPT, *PSECTOR_RECORD_GPT;
+
+typedef struct _SECTOR_RECORD_STRING {
+    USHORT characters;
+    // WCHAR text[characters], not NUL-terminated
+} SECTOR_RECORD_STRING, *PSECTOR_RECORD_STRING;
+
+#pragma pack (pop)
+
+// Handles IOCTL_GET_DISK_INFO with a SECTOR_STORAGE_QUERY input.
+NTSTATUS StorageQueryToUser(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN PVOID outBuffer, IN ULONG outLength);
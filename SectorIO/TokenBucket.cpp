@@ -0,0 +1,61 @@
+#include "TokenBucket.hpp"
+
+static const unsigned long long MAX_SCALED_TOKENS = 0x7FFFFFFFFFFFFFFFULL;
+
+static unsigned long long Scale(unsigned long long tokens) {
+    if (tokens > MAX_SCALED_TOKENS / TOKEN_BUCKET_TICKS_PER_SECOND)
+        return MAX_SCALED_TOKENS;
+    return tokens * TOKEN_BUCKET_TICKS_PER_SECOND;
+}
+
+static unsigned long long ScaledCapacity(const TOKEN_BUCKET* bucket) {
+    return Scale(bucket->burst);
+}
+
+static unsigned long long Needed(const TOKEN_BUCKET* bucket, unsigned long long amount) {
+    return amount < bucket->burst ? amount : bucket->burst;
+}
+
+void TokenBucketInit(PTOKEN_BUCKET bucket, unsigned long long rate, unsigned long long burst, unsigned long long now) {
+    bucket->rate = rate;
+    bucket->burst = burst ? burst : rate;
+    if (bucket->burst == 0)
+        bucket->burst = 1;
+    bucket->scaledTokens = (long long)ScaledCapacity(bucket);
+    bucket->lastRefill = now;
+}
+
+void TokenBucketRefill(PTOKEN_BUCKET bucket, unsigned long long now) {
+    if (bucket->rate == 0 || now <= bucket->lastRefill)
+        return;
+
+    unsigned long long elapsed = now - bucket->lastRefill;
+    unsigned long long capacity = ScaledCapacity(bucket);
+    bucket->lastRefill = now;
+
+    // Rate times elapsed ticks is exact in scaled units; saturate instead of overflowing after long idle periods.
+    unsigned long long room = (unsigned long long)((long long)capacity - bucket->scaledTokens);
+    if (elapsed >= room / bucket->rate + 1)
+        bucket->scaledTokens = (long long)capacity;
+    else
+        bucket->scaledTokens += (long long)(bucket->rate * elapsed);
+}
+
+int TokenBucketCanConsume(const TOKEN_BUCKET* bucket, unsigned long long amount) {
+    if (bucket->rate == 0)
+        return 1;
+    return bucket->scaledTokens >= (long long)Scale(Needed(bucket, amount));
+}
+
+void TokenBucketConsume(PTOKEN_BUCKET bucket, unsigned long long amount) {
+    if (bucket->rate == 0)
+        return;
+    bucket->scaledTokens -= (long long)Scale(amount);
+}
+
+unsigned long long TokenBucketWaitTime(const TOKEN_BUCKET* bucket, unsigned long long amount) {
+    if (TokenBucketCanConsume(bucket, amount))
+        return 0;
+    long long missing = (long long)Scale(Needed(bucket, amount)) - bucket->scaledTokens;
+    return ((unsigned long long)missing + bucket->rate - 1) / bucket->rate;
+}
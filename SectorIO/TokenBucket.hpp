@@ -0,0 +1,23 @@
+#pragma once
+// Token bucket arithmetic for the QoS limiter. Kept free of WDK dependencies so it builds on the host as well.
+// Time is in 100ns units, the same scale as KeQueryInterruptTime.
+
+#define TOKEN_BUCKET_TICKS_PER_SECOND 10000000LL
+
+typedef struct _TOKEN_BUCKET {
+    unsigned long long rate;        // tokens per second, 0 means unlimited
+    unsigned long long burst;       // capacity in tokens
+    long long scaledTokens;         // tokens * TOKEN_BUCKET_TICKS_PER_SECOND; negative while a large request is paid off
+    unsigned long long lastRefill;
+} TOKEN_BUCKET, *PTOKEN_BUCKET;
+
+// A zero burst defaults to one second worth of tokens. The bucket starts full.
+void TokenBucketInit(PTOKEN_BUCKET bucket, unsigned long long rate, unsigned long long burst, unsigned long long now);
+void TokenBucketRefill(PTOKEN_BUCKET bucket, unsigned long long now);
+
+// Requests larger than the burst are admitted once the bucket is full and leave it in debt, so they are delayed by
+// their size rather than starved forever.
+int TokenBucketCanConsume(const TOKEN_BUCKET* bucket, unsigned long long amount);
+void TokenBucketConsume(PTOKEN_BUCKET bucket, unsigned long long amount);
+// Time until TokenBucketCanConsume turns true, assuming no one else consumes in the meantime.
+unsigned long long TokenBucketWaitTime(const TOKEN_BUCKET* bucket, unsigned long long amount);
@@ -0,0 +1,225 @@
+#include "Topology.hpp"
+#include "WorkPool.hpp"
+
+static FAST_MUTEX g_refreshMutex;
+static volatile ULONG g_generation = 0;     // written under g_waitLock
+
+// Pending IOCTL_WAIT_TOPOLOGY_CHANGE requests, linked through Tail.Overlay.ListEntry. The queue keeps its own state
+// in DriverContext[3], clear of the request control slot.
+static IO_CSQ g_waitQueue;
+static KSPIN_LOCK g_waitLock;
+static LIST_ENTRY g_waiters;
+
+static PVOID g_notificationEntries[STORAGE_INTERFACE_CLASS_COUNT];
+static WORK_ITEM g_refreshItem;
+static volatile LONG g_refreshRequests = 0;
+
+// Selects the waits to take off the queue: those issued on pFileObject if it is set, or else those that know a
+// generation other than the current one.
+typedef struct _TOPOLOGY_PEEK {
+    PFILE_OBJECT pFileObject;
+    ULONG generation;
+} TOPOLOGY_PEEK, *PTOPOLOGY_PEEK;
+
+static ULONG WaiterGeneration(IN PIRP pIrp) {
+    return ((PSECTOR_TOPOLOGY_WAIT_REQUEST)pIrp->AssociatedIrp.SystemBuffer)->generation;
+}
+
+// Checked under the queue lock, so a generation published between the caller's check and the insertion is not missed.
+static NTSTATUS TopologyInsertWaiter(IN PIO_CSQ pCsq, IN PIRP pIrp, IN PVOID insertContext) {
+    UNREFERENCED_PARAMETER(pCsq);
+    if (g_generation != *(PULONG)insertContext)
+        return STATUS_UNSUCCESSFUL;
+    InsertTailList(&g_waiters, &pIrp->Tail.Overlay.ListEntry);
+    return STATUS_SUCCESS;
+}
+
+static VOID TopologyRemoveWaiter(IN PIO_CSQ pCsq, IN PIRP pIrp) {
+    UNREFERENCED_PARAMETER(pCsq);
+    RemoveEntryList(&pIrp->Tail.Overlay.ListEntry);
+}
+
+static PIRP TopologyPeekWaiter(IN PIO_CSQ pCsq, IN PIRP pIrp, IN PVOID peekContext) {
+    UNREFERENCED_PARAMETER(pCsq);
+    PTOPOLOGY_PEEK pPeek = (PTOPOLOGY_PEEK)peekContext;
+    for (PLIST_ENTRY pEntry = pIrp ? pIrp->Tail.Overlay.ListEntry.Flink : g_waiters.Flink; pEntry != &g_waiters; pEntry = pEntry->Flink) {
+        PIRP pNext = CONTAINING_RECORD(pEntry, IRP, Tail.Overlay.ListEntry);
+        if (!pPeek)
+            return pNext;
+        if (pPeek->pFileObject ? IoGetCurrentIrpStackLocation(pNext)->FileObject == pPeek->pFileObject : WaiterGeneration(pNext) != pPeek->generation)
+            return pNext;
+    }
+    return NULL;
+}
+
+static VOID TopologyAcquireLock(IN PIO_CSQ pCsq, OUT PKIRQL pIrql) {
+    UNREFERENCED_PARAMETER(pCsq);
+    KeAcquireSpinLock(&g_waitLock, pIrql);
+}
+
+static VOID TopologyReleaseLock(IN PIO_CSQ pCsq, IN KIRQL irql) {
+    UNREFERENCED_PARAMETER(pCsq);
+    KeReleaseSpinLock(&g_waitLock, irql);
+}
+
+static VOID TopologyCompleteCancelledWaiter(IN PIO_CSQ pCsq, IN PIRP pIrp) {
+    UNREFERENCED_PARAMETER(pCsq);
+    pIrp->IoStatus.Status = STATUS_CANCELLED;
+    pIrp->IoStatus.Information = 0;
+    IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+}
+
+// Whether the object is listed for the caller: it has to be present at one of the two generations but not the other.
+static UCHAR TopologyChangeOf(IN PSTORAGE_OBJECT pObject, IN ULONG known, IN ULONG generation) {
+    BOOLEAN wasPresent = pObject->addedGeneration <= known && (!pObject->removedGeneration || pObject->removedGeneration > known);
+    BOOLEAN isPresent = pObject->addedGeneration <= generation && (!pObject->removedGeneration || pObject->removedGeneration > generation);
+    if (wasPresent == isPresent)
+        return 0;
+    return isPresent ? SECTOR_TOPOLOGY_ADDED : SECTOR_TOPOLOGY_REMOVED;
+}
+
+// The request is METHOD_BUFFERED, so the result can be written from whatever thread publishes the generation. The
+// result overwrites the input in the system buffer.
+static NTSTATUS TopologyFillResult(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack, IN ULONG generation) {
+    ULONG known = WaiterGeneration(pIrp);
+    PSECTOR_TOPOLOGY_RESULT pResult = (PSECTOR_TOPOLOGY_RESULT)pIrp->AssociatedIrp.SystemBuffer;
+    PSECTOR_TOPOLOGY_CHANGE pChanges = (PSECTOR_TOPOLOGY_CHANGE)(pResult + 1);
+    ULONG capacity = (pIrpStack->Parameters.DeviceIoControl.OutputBufferLength - sizeof(SECTOR_TOPOLOGY_RESULT)) / sizeof(SECTOR_TOPOLOGY_CHANGE);
+
+    ULONG flags = 0;
+    if (known == 0 || known > generation) {
+        known = 0;
+        flags |= SECTOR_TOPOLOGY_FULL;
+    }
+
+    ULONG count = 0;
+    for (auto pObject : g_pStorageObjects->locked()) {
+        if (!pObject)
+            continue;
+        UCHAR change = TopologyChangeOf(pObject, known, generation);
+        if (!change)
+            continue;
+        if (count < capacity) {
+            pChanges[count].change = change;
+            pChanges[count].isRawDiskObject = pObject->info.isRawDiskObject;
+            pChanges[count].diskIndex = pObject->info.diskIndex;
+            pChanges[count].partitionNumber = pObject->info.partitionNumber;
+        }
+        count++;
+    }
+
+    pResult->generation = generation;
+    pResult->flags = flags;
+    pResult->changeCount = count;
+    if (count > capacity) {
+        pIrp->IoStatus.Information = sizeof(SECTOR_TOPOLOGY_RESULT);
+        return STATUS_BUFFER_OVERFLOW;
+    }
+    pIrp->IoStatus.Information = sizeof(SECTOR_TOPOLOGY_RESULT) + count * sizeof(SECTOR_TOPOLOGY_CHANGE);
+    return STATUS_SUCCESS;
+}
+
+static void TopologyCompleteWaiter(IN PIRP pIrp, IN ULONG generation) {
+    pIrp->IoStatus.Status = TopologyFillResult(pIrp, IoGetCurrentIrpStackLocation(pIrp), generation);
+    IoCompleteRequest(pIrp, IO_NO_INCREMENT);
+}
+
+// Interface notifications keep coming while a refresh runs; they are counted and folded into one more refresh.
+static VOID TopologyRefreshRoutine(IN PWORK_ITEM pItem) {
+    UNREFERENCED_PARAMETER(pItem);
+    LONG requests;
+    do {
+        requests = g_refreshRequests;
+        RefreshGlobalStorageObjects(TRUE);
+    } while (InterlockedAdd(&g_refreshRequests, -requests) != 0);
+}
+
+// Opening the device from the notification itself can deadlock with the PnP manager, so the refresh is deferred.
+static NTSTATUS TopologyInterfaceChange(IN PVOID notificationStructure, IN PVOID context) {
+    UNREFERENCED_PARAMETER(notificationStructure);
+    UNREFERENCED_PARAMETER(context);
+    if (InterlockedIncrement(&g_refreshRequests) == 1 && !NT_SUCCESS(WorkPoolSubmit(&g_refreshItem))) {
+        LOG("Topology refresh could not be queued\n");
+        InterlockedExchange(&g_refreshRequests, 0);
+    }
+    return STATUS_SUCCESS;
+}
+
+void TopologyInitialize(IN PDRIVER_OBJECT pDriverObject) {
+    ExInitializeFastMutex(&g_refreshMutex);
+    KeInitializeSpinLock(&g_waitLock);
+    InitializeListHead(&g_waiters);
+    IoCsqInitializeEx(&g_waitQueue, TopologyInsertWaiter, TopologyRemoveWaiter, TopologyPeekWaiter, TopologyAcquireLock, TopologyReleaseLock, TopologyCompleteCancelledWaiter);
+    WorkItemInitialize(&g_refreshItem, TopologyRefreshRoutine, NULL, NULL);
+
+    // Without notifications the list still follows the refreshes that requests trigger.
+    for (ULONG i = 0; i < STORAGE_INTERFACE_CLASS_COUNT; i++) {
+        NTSTATUS status = IoRegisterPlugPlayNotification(EventCategoryDeviceInterfaceChange, 0, (PVOID)g_storageInterfaceClasses[i],
+            pDriverObject, TopologyInterfaceChange, NULL, &g_notificationEntries[i]);
+        if (!NT_SUCCESS(status)) {
+            LOG("IoRegisterPlugPlayNotification(%lu) failed: 0x%08X\n", i, status);
+            g_notificationEntries[i] = NULL;
+        }
+    }
+}
+
+void TopologyShutdown() {
+    for (ULONG i = 0; i < STORAGE_INTERFACE_CLASS_COUNT; i++) {
+        if (g_notificationEntries[i]) {
+            IoUnregisterPlugPlayNotificationEx(g_notificationEntries[i]);
+            g_notificationEntries[i] = NULL;
+        }
+    }
+}
+
+ULONG TopologyBeginRefresh(IN BOOLEAN wait) {
+    if (!wait) {
+        if (!ExTryToAcquireFastMutex(&g_refreshMutex))
+            return 0;
+    }
+    else
+        ExAcquireFastMutex(&g_refreshMutex);
+    return g_generation + 1;
+}
+
+void TopologyEndRefresh(IN ULONG generation, IN BOOLEAN changed) {
+    if (changed) {
+        KIRQL irql;
+        KeAcquireSpinLock(&g_waitLock, &irql);
+        g_generation = generation;
+        KeReleaseSpinLock(&g_waitLock, irql);
+        LOG("Storage topology generation %lu\n", generation);
+
+        TOPOLOGY_PEEK peek = { NULL, generation };
+        PIRP pIrp;
+        while ((pIrp = IoCsqRemoveNextIrp(&g_waitQueue, &peek)) != NULL)
+            TopologyCompleteWaiter(pIrp, generation);
+    }
+    ExReleaseFastMutex(&g_refreshMutex);
+}
+
+void TopologyCancelWaits(IN PFILE_OBJECT pFileObject) {
+    TOPOLOGY_PEEK peek = { pFileObject, 0 };
+    PIRP pIrp;
+    while ((pIrp = IoCsqRemoveNextIrp(&g_waitQueue, &peek)) != NULL)
+        TopologyCompleteCancelledWaiter(&g_waitQueue, pIrp);
+}
+
+NTSTATUS TopologyWaitIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack) {
+    LOG("TopologyWaitIoctlHandler called\n");
+    if (!g_pStorageObjects)
+        return STATUS_DEVICE_NOT_CONNECTED;
+    if (!pIrp->AssociatedIrp.SystemBuffer ||
+        pIrpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(SECTOR_TOPOLOGY_WAIT_REQUEST) ||
+        pIrpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(SECTOR_TOPOLOGY_RESULT))
+        return STATUS_INFO_LENGTH_MISMATCH;
+
+    ULONG known = WaiterGeneration(pIrp);
+    ULONG generation = g_generation;
+    if (known == generation) {
+        if (NT_SUCCESS(IoCsqInsertIrpEx(&g_waitQueue, pIrp, NULL, &known)))
+            return STATUS_PENDING;
+        generation = g_generation;
+    }
+    return TopologyFillResult(pIrp, pIrpStack, generation);
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include "Sector.hpp"
+
+#pragma pack (push, 1)
+
+#define SECTOR_TOPOLOGY_ADDED       1
+#define SECTOR_TOPOLOGY_REMOVED     2
+
+// The changes list every present storage object, because the caller's generation was 0 or not one this driver issued.
+#define SECTOR_TOPOLOGY_FULL        0x00000001
+
+// Stays pending until the set of storage objects differs from the one the generation describes, then returns what
+// changed since. Cancelling the request or closing the handle completes it with STATUS_CANCELLED.
+typedef struct _SECTOR_TOPOLOGY_WAIT_REQUEST {
+    ULONG generation;               // from the previous result; 0 returns every present object at once
+} SECTOR_TOPOLOGY_WAIT_REQUEST, *PSECTOR_TOPOLOGY_WAIT_REQUEST;
+
+typedef struct _SECTOR_TOPOLOGY_CHANGE {
+    UCHAR change;                   // SECTOR_TOPOLOGY_ADDED or SECTOR_TOPOLOGY_REMOVED
+    BOOLEAN isRawDiskObject;
+    ULONG diskIndex;
+    ULONG partitionNumber;
+} SECTOR_TOPOLOGY_CHANGE, *PSECTOR_TOPOLOGY_CHANGE;
+
+typedef struct _SECTOR_TOPOLOGY_RESULT {
+    ULONG generation;               // pass this to the next wait
+    ULONG flags;                    // SECTOR_TOPOLOGY_*
+    ULONG changeCount;
+    // SECTOR_TOPOLOGY_CHANGE changes[changeCount], net of what happened in between: an object that came and went
+    // again is not listed. If they do not fit, only the header is filled in and the call returns
+    // STATUS_BUFFER_OVERFLOW; retry with the same generation and a larger buffer.
+} SECTOR_TOPOLOGY_RESULT, *PSECTOR_TOPOLOGY_RESULT;
+
+#pragma pack (pop)
+
+// Sets up the wait queue and subscribes to arrivals and removals of storage device interfaces, each of which
+// refreshes the storage object list on a pool worker. Has to run before the first refresh.
+void TopologyInitialize(IN PDRIVER_OBJECT pDriverObject);
+// Stops the notifications. Refreshes already queued still run, so the work pool has to be shut down afterwards.
+void TopologyShutdown();
+
+// Bracket a refresh of the storage object list. Begin returns the generation that changes found by the refresh
+// belong to, or 0 if another refresh is running and wait is FALSE. End publishes the generation if anything changed
+// and completes the waits it satisfies.
+ULONG TopologyBeginRefresh(IN BOOLEAN wait);
+void TopologyEndRefresh(IN ULONG generation, IN BOOLEAN changed);
+
+// Completes the waits issued on the file object; called when its handle is closed.
+void TopologyCancelWaits(IN PFILE_OBJECT pFileObject);
+
+// Returns STATUS_PENDING once the IRP is queued; the queue completes it later.
+NTSTATUS TopologyWaitIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack);
@@ -0,0 +1,186 @@
+#include "VolumeBitmap.hpp"
+#include "FileExtents.hpp"
+
+#define VOLUME_BITMAP_QUERY_BYTES   (1024 * 1024)
+
+typedef struct _RANGE_LIST {
+    PVOLUME_RANGE pRanges;
+    ULONG count;
+    ULONG capacity;
+} RANGE_LIST, *PRANGE_LIST;
+
+static NTSTATUS AppendRange(IN PRANGE_LIST pList, IN ULONGLONG startOffset, IN ULONGLONG endOffset) {
+    if (startOffset >= endOffset)
+        return STATUS_SUCCESS;
+
+    if (pList->count) {
+        PVOLUME_RANGE pLast = &pList->pRanges[pList->count - 1];
+        if (startOffset - pLast->endOffset < VOLUME_MIN_SKIP_BYTES) {
+            pLast->endOffset = endOffset;
+            return STATUS_SUCCESS;
+        }
+    }
+
+    if (pList->count == pList->capacity) {
+        ULONG newCapacity = pList->capacity ? pList->capacity * 2 : 256;
+        PVOLUME_RANGE pGrown = new (PAGED_POOL) VOLUME_RANGE[newCapacity];
+        if (!pGrown)
+            return STATUS_INSUFFICIENT_RESOURCES;
+        if (pList->count)
+            RtlCopyMemory(pGrown, pList->pRanges, pList->count * sizeof(VOLUME_RANGE));
+        delete[] pList->pRanges;
+        pList->pRanges = pGrown;
+        pList->capacity = newCapacity;
+    }
+    pList->pRanges[pList->count].startOffset = startOffset;
+    pList->pRanges[pList->count].endOffset = endOffset;
+    pList->count++;
+    return STATUS_SUCCESS;
+}
+
+// NTFS and ReFS number clusters from the first byte of the volume; FAT and exFAT start at the data area.
+static NTSTATUS CheckClusterAddressing(IN HANDLE volumeHandle) {
+    UCHAR buffer[sizeof(FILE_FS_ATTRIBUTE_INFORMATION) + 32 * sizeof(WCHAR)];
+    PFILE_FS_ATTRIBUTE_INFORMATION pAttributes = (PFILE_FS_ATTRIBUTE_INFORMATION)buffer;
+    IO_STATUS_BLOCK ioStatusBlock;
+
+    NTSTATUS status = ZwQueryVolumeInformationFile(volumeHandle, &ioStatusBlock, pAttributes, sizeof(buffer), FileFsAttributeInformation);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    UNICODE_STRING name;
+    name.Buffer = pAttributes->FileSystemName;
+    name.Length = name.MaximumLength = (USHORT)min(pAttributes->FileSystemNameLength, (ULONG)(32 * sizeof(WCHAR)));
+
+    UNICODE_STRING ntfs = RTL_CONSTANT_STRING(L"NTFS");
+    UNICODE_STRING refs = RTL_CONSTANT_STRING(L"ReFS");
+    if (RtlEqualUnicodeString(&name, &ntfs, TRUE) || RtlEqualUnicodeString(&name, &refs, TRUE))
+        return STATUS_SUCCESS;
+
+    LOG("  cluster bitmap of %wZ does not map to partition offsets\n", &name);
+    return STATUS_NOT_SUPPORTED;
+}
+
+NTSTATUS VolumeAllocatedRanges(IN PSTORAGE_OBJECT pStorageObject, IN ULONGLONG startOffset, IN ULONGLONG endOffset, OUT PVOLUME_RANGE* ppRanges, OUT PULONG pCount) {
+    *ppRanges = NULL;
+    *pCount = 0;
+    if (pStorageObject->info.isRawDiskObject)
+        return STATUS_INVALID_PARAMETER;
+
+    HANDLE volumeHandle = NULL;
+    PVOLUME_BITMAP_BUFFER pBitmap = NULL;
+    RANGE_LIST list;
+    RtlZeroMemory(&list, sizeof(list));
+    ULONG clusterBytes = 0;
+
+    NTSTATUS status = OpenVolumeFile(pStorageObject, NULL, NULL, 0, 0, &volumeHandle);
+    if (!NT_SUCCESS(status)) {
+        LOG("  opening the volume failed: 0x%08X\n", status);
+        return status;
+    }
+
+    status = CheckClusterAddressing(volumeHandle);
+    if (!NT_SUCCESS(status))
+        goto Done;
+
+    {
+        IO_STATUS_BLOCK ioStatusBlock;
+        FILE_FS_SIZE_INFORMATION sizeInformation;
+        status = ZwQueryVolumeInformationFile(volumeHandle, &ioStatusBlock, &sizeInformation, sizeof(sizeInformation), FileFsSizeInformation);
+        if (!NT_SUCCESS(status))
+            goto Done;
+        clusterBytes = sizeInformation.SectorsPerAllocationUnit * sizeInformation.BytesPerSector;
+        if (clusterBytes == 0 || clusterBytes % pStorageObject->info.sectorSize) {
+            status = STATUS_UNRECOGNIZED_VOLUME;
+            goto Done;
+        }
+    }
+
+    pBitmap = (PVOLUME_BITMAP_BUFFER)new (PAGED_POOL) UCHAR[VOLUME_BITMAP_QUERY_BYTES];
+    if (!pBitmap) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Done;
+    }
+
+    {
+        ULONGLONG endLcn = (endOffset + clusterBytes - 1) / clusterBytes;
+        ULONGLONG volumeEnd = 0;
+        ULONGLONG runStart = 0;
+        BOOLEAN inRun = FALSE;
+        STARTING_LCN_INPUT_BUFFER input;
+        input.StartingLcn.QuadPart = (LONGLONG)(startOffset / clusterBytes);
+
+        for (;;) {
+            IO_STATUS_BLOCK ioStatusBlock;
+            status = ZwFsControlFile(volumeHandle, NULL, NULL, NULL, &ioStatusBlock, FSCTL_GET_VOLUME_BITMAP,
+                &input, sizeof(input), pBitmap, VOLUME_BITMAP_QUERY_BYTES);
+            if (!NT_SUCCESS(status) && status != STATUS_BUFFER_OVERFLOW)
+                goto Done;
+            BOOLEAN more = status == STATUS_BUFFER_OVERFLOW;
+
+            // The file system may round the starting LCN down to a byte boundary of the bitmap; the bits before the
+            // requested one have been looked at already.
+            ULONGLONG firstLcn = (ULONGLONG)pBitmap->StartingLcn.QuadPart;
+            if (ioStatusBlock.Information < (ULONG_PTR)FIELD_OFFSET(VOLUME_BITMAP_BUFFER, Buffer)) {
+                status = STATUS_INVALID_DEVICE_REQUEST;
+                goto Done;
+            }
+            ULONGLONG bitsReturned = (ULONGLONG)(ioStatusBlock.Information - FIELD_OFFSET(VOLUME_BITMAP_BUFFER, Buffer)) * 8;
+            ULONGLONG bitCount = min((ULONGLONG)pBitmap->BitmapSize.QuadPart, bitsReturned);
+            volumeEnd = firstLcn + (ULONGLONG)pBitmap->BitmapSize.QuadPart;
+            bitCount = min(bitCount, endLcn > firstLcn ? endLcn - firstLcn : 0);
+            ULONGLONG requestedLcn = (ULONGLONG)input.StartingLcn.QuadPart;
+            if (firstLcn > requestedLcn || requestedLcn - firstLcn >= 8) {
+                status = STATUS_INVALID_DEVICE_REQUEST;
+                goto Done;
+            }
+
+            for (ULONGLONG i = requestedLcn - firstLcn; i < bitCount; ) {
+                UCHAR bits = pBitmap->Buffer[i / 8];
+                // Whole bytes that continue the current state are the common case on both full and empty volumes.
+                if (i % 8 == 0 && i + 8 <= bitCount && bits == (inRun ? 0xFF : 0x00)) {
+                    i += 8;
+                    continue;
+                }
+                BOOLEAN allocated = (bits >> (i % 8)) & 1;
+                if (allocated && !inRun) {
+                    runStart = firstLcn + i;
+                    inRun = TRUE;
+                }
+                else if (!allocated && inRun) {
+                    status = AppendRange(&list, max(runStart * clusterBytes, startOffset), min((firstLcn + i) * clusterBytes, endOffset));
+                    if (!NT_SUCCESS(status))
+                        goto Done;
+                    inRun = FALSE;
+                }
+                i++;
+            }
+
+            ULONGLONG nextLcn = firstLcn + bitCount;
+            if (!more || nextLcn >= endLcn || nextLcn <= requestedLcn)
+                break;
+            input.StartingLcn.QuadPart = (LONGLONG)nextLcn;
+        }
+
+        status = STATUS_SUCCESS;
+        ULONGLONG scannedEnd = min(volumeEnd, endLcn) * clusterBytes;
+        if (inRun) {
+            status = AppendRange(&list, max(runStart * clusterBytes, startOffset), min(scannedEnd, endOffset));
+            if (!NT_SUCCESS(status))
+                goto Done;
+        }
+        // Past the last cluster, e.g. the NTFS boot sector copy in the last sector of the partition.
+        status = AppendRange(&list, max(volumeEnd * clusterBytes, startOffset), endOffset);
+    }
+
+Done:
+    delete[] (PUCHAR)pBitmap;
+    if (volumeHandle) ZwClose(volumeHandle);
+    if (!NT_SUCCESS(status)) {
+        delete[] list.pRanges;
+        return status;
+    }
+    *ppRanges = list.pRanges;
+    *pCount = list.count;
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,18 @@
+#pragma once
+#include "StorageIo.hpp"
+
+// Free gaps shorter than this are read along with their neighbours; one longer transfer is cheaper than two
+// transfers and the seek between them.
+#define VOLUME_MIN_SKIP_BYTES   (64 * 1024)
+
+// Byte range of a storage object, [startOffset, endOffset).
+typedef struct _VOLUME_RANGE {
+    ULONGLONG startOffset;
+    ULONGLONG endOffset;
+} VOLUME_RANGE, *PVOLUME_RANGE;
+
+// Allocated parts of [startOffset, endOffset) of a partition, from the mounted file system's cluster bitmap, sorted and
+// merged across free gaps shorter than VOLUME_MIN_SKIP_BYTES. Space outside the bitmap (boot sector backups at the end
+// of the partition) counts as allocated. Only file systems whose LCN 0 is the first byte of the partition are supported.
+// The caller frees *ppRanges with delete[].
+NTSTATUS VolumeAllocatedRanges(IN PSTORAGE_OBJECT pStorageObject, IN ULONGLONG startOffset, IN ULONGLONG endOffset, OUT PVOLUME_RANGE* ppRanges, OUT PULONG pCount);
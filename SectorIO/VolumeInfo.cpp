@@ -0,0 +1,300 @@
+#include "VolumeInfo.hpp"
+#include "FileExtents.hpp"
+#include <mountmgr.h>
+
+#define VOLUME_CACHED_FIELDS        (SECTOR_VOLUME_ALL_FIELDS & ~SECTOR_VOLUME_SPACE)
+#define VOLUME_MOUNT_POINTS_BYTES   4096
+
+typedef struct _VOLUME_CACHE {
+    KSPIN_LOCK lock;
+    volatile LONG generation;       // bumped by every notification about the volume
+    PVOID notificationEntry;        // NULL until the volume is watched; nothing is cached before that
+    LONG cachedGeneration;
+    ULONG cachedFields;             // looked up at cachedGeneration, whether or not they turned out valid
+    SECTOR_VOLUME_INFO info;
+} VOLUME_CACHE, *PVOLUME_CACHE;
+
+static PVOLUME_CACHE VolumeCacheGet(IN PSTORAGE_OBJECT pStorageObject) {
+    PVOLUME_CACHE pCache = (PVOLUME_CACHE)pStorageObject->pVolumeCache;
+    if (pCache)
+        return pCache;
+
+    pCache = new (NON_PAGED) VOLUME_CACHE;
+    if (!pCache)
+        return NULL;
+    RtlZeroMemory(pCache, sizeof(*pCache));
+    KeInitializeSpinLock(&pCache->lock);
+
+    PVOID pExisting = InterlockedCompareExchangePointer((PVOID*)&pStorageObject->pVolumeCache, pCache, NULL);
+    if (pExisting) {
+        delete pCache;
+        return (PVOLUME_CACHE)pExisting;
+    }
+    return pCache;
+}
+
+void VolumeCacheFree(IN PSTORAGE_OBJECT pStorageObject) {
+    PVOLUME_CACHE pCache = (PVOLUME_CACHE)pStorageObject->pVolumeCache;
+    if (pCache) {
+        // Waits for a notification that is being delivered, so the cache cannot be touched afterwards.
+        if (pCache->notificationEntry)
+            IoUnregisterPlugPlayNotificationEx(pCache->notificationEntry);
+        delete pCache;
+        pStorageObject->pVolumeCache = NULL;
+    }
+}
+
+// Mount, dismount, lock, name change or removal: any of them may change what is cached.
+static NTSTATUS VolumeChangeNotification(IN PVOID notificationStructure, IN PVOID context) {
+    UNREFERENCED_PARAMETER(notificationStructure);
+    InterlockedIncrement(&((PVOLUME_CACHE)context)->generation);
+    return STATUS_SUCCESS;
+}
+
+// The registration keeps working after the file object is released, and does not hold the volume open.
+static void VolumeWatch(IN PVOLUME_CACHE pCache, IN PFILE_OBJECT pFileObject) {
+    if (pCache->notificationEntry)
+        return;
+
+    PVOID entry = NULL;
+    NTSTATUS status = IoRegisterPlugPlayNotification(EventCategoryTargetDeviceChange, 0, pFileObject, g_pDeviceObject->DriverObject,
+        VolumeChangeNotification, pCache, &entry);
+    if (!NT_SUCCESS(status)) {
+        LOG("  watching the volume failed: 0x%08X\n", status);
+        return;
+    }
+    if (InterlockedCompareExchangePointer(&pCache->notificationEntry, entry, NULL))
+        IoUnregisterPlugPlayNotificationEx(entry);
+}
+
+static void CopyVolumeFields(OUT PSECTOR_VOLUME_INFO pTo, IN const SECTOR_VOLUME_INFO* pFrom, IN ULONG fields) {
+    fields &= pFrom->validFields;
+    if (fields & SECTOR_VOLUME_GUID)
+        pTo->volumeGuid = pFrom->volumeGuid;
+    if (fields & SECTOR_VOLUME_DRIVE_LETTERS)
+        RtlCopyMemory(pTo->driveLetters, pFrom->driveLetters, sizeof(pTo->driveLetters));
+    if (fields & SECTOR_VOLUME_LABEL) {
+        pTo->volumeSerialNumber = pFrom->volumeSerialNumber;
+        RtlCopyMemory(pTo->volumeLabel, pFrom->volumeLabel, sizeof(pTo->volumeLabel));
+    }
+    if (fields & SECTOR_VOLUME_FILE_SYSTEM)
+        RtlCopyMemory(pTo->fileSystemName, pFrom->fileSystemName, sizeof(pTo->fileSystemName));
+    if (fields & SECTOR_VOLUME_SPACE) {
+        pTo->volumeTotalBytes = pFrom->volumeTotalBytes;
+        pTo->volumeFreeBytes = pFrom->volumeFreeBytes;
+    }
+    pTo->validFields |= fields;
+}
+
+static void CopyName(OUT PWCHAR pTo, IN ULONG capacity, IN const WCHAR* pFrom, IN ULONG fromBytes) {
+    ULONG length = min(fromBytes / (ULONG)sizeof(WCHAR), capacity - 1);
+    RtlCopyMemory(pTo, pFrom, length * sizeof(WCHAR));
+    pTo[length] = L'\0';
+}
+
+// The \??\Volume{GUID} name and the drive letters the mount manager has for the volume device.
+static NTSTATUS QueryMountPoints(IN PDEVICE_OBJECT pVolumeDevice, IN OUT PSECTOR_VOLUME_INFO pInfo) {
+    UCHAR nameBuffer[sizeof(OBJECT_NAME_INFORMATION) + 128 * sizeof(WCHAR)];
+    POBJECT_NAME_INFORMATION pName = (POBJECT_NAME_INFORMATION)nameBuffer;
+    PMOUNTMGR_MOUNT_POINT pInput = NULL;
+    PMOUNTMGR_MOUNT_POINTS pPoints = NULL;
+    PFILE_OBJECT pManagerFile = NULL;
+    PDEVICE_OBJECT pManager = NULL;
+    ULONG inputLength = 0;
+    ULONG outputLength = VOLUME_MOUNT_POINTS_BYTES;
+    ULONG letterCount = 0;
+
+    ULONG returned = 0;
+    NTSTATUS status = ObQueryNameString(pVolumeDevice, pName, sizeof(nameBuffer), &returned);
+    if (!NT_SUCCESS(status))
+        return status;
+    if (!pName->Name.Length)
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+
+    inputLength = sizeof(MOUNTMGR_MOUNT_POINT) + pName->Name.Length;
+    pInput = (PMOUNTMGR_MOUNT_POINT)new (PAGED_POOL) UCHAR[inputLength];
+    if (!pInput)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    RtlZeroMemory(pInput, sizeof(MOUNTMGR_MOUNT_POINT));
+    pInput->DeviceNameOffset = sizeof(MOUNTMGR_MOUNT_POINT);
+    pInput->DeviceNameLength = pName->Name.Length;
+    RtlCopyMemory(pInput + 1, pName->Name.Buffer, pName->Name.Length);
+
+    UNICODE_STRING managerName = RTL_CONSTANT_STRING(MOUNTMGR_DEVICE_NAME);
+    status = IoGetDeviceObjectPointer(&managerName, FILE_READ_ATTRIBUTES, &pManagerFile, &pManager);
+    if (!NT_SUCCESS(status))
+        goto Done;
+
+    // Asked once more with the size the first answer reports, in case the links change in between.
+    for (int attempt = 0; attempt < 2; attempt++) {
+        pPoints = (PMOUNTMGR_MOUNT_POINTS)new (PAGED_POOL) UCHAR[outputLength];
+        if (!pPoints) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Done;
+        }
+        status = IoDeviceControl(pManager, IOCTL_MOUNTMGR_QUERY_POINTS, pInput, inputLength, pPoints, outputLength, NULL);
+        if (status != STATUS_BUFFER_OVERFLOW)
+            break;
+        outputLength = max(pPoints->Size, outputLength * 2);
+        delete[] pPoints;
+        pPoints = NULL;
+    }
+    if (status == STATUS_OBJECT_NAME_NOT_FOUND) {
+        // A volume the mount manager does not track has neither.
+        status = STATUS_SUCCESS;
+        goto Done;
+    }
+    if (!NT_SUCCESS(status))
+        goto Done;
+
+    for (ULONG i = 0; i < pPoints->NumberOfMountPoints; i++) {
+        UNICODE_STRING link;
+        link.Buffer = (PWCH)((PUCHAR)pPoints + pPoints->MountPoints[i].SymbolicLinkNameOffset);
+        link.Length = link.MaximumLength = pPoints->MountPoints[i].SymbolicLinkNameLength;
+
+        if (MOUNTMGR_IS_DRIVE_LETTER(&link) && letterCount < ARRAYSIZE(pInfo->driveLetters) - 1) {
+            // \DosDevices\C:, kept in alphabetical order
+            WCHAR letter = link.Buffer[12];
+            ULONG at = letterCount;
+            while (at && pInfo->driveLetters[at - 1] > letter) {
+                pInfo->driveLetters[at] = pInfo->driveLetters[at - 1];
+                at--;
+            }
+            pInfo->driveLetters[at] = letter;
+            letterCount++;
+        }
+        else if (MOUNTMGR_IS_VOLUME_NAME(&link)) {
+            // \??\Volume{GUID}
+            UNICODE_STRING guidString;
+            guidString.Buffer = link.Buffer + 10;
+            guidString.Length = guidString.MaximumLength = 38 * sizeof(WCHAR);
+            if (NT_SUCCESS(RtlGUIDFromString(&guidString, &pInfo->volumeGuid)))
+                pInfo->validFields |= SECTOR_VOLUME_GUID;
+        }
+    }
+    pInfo->driveLetters[letterCount] = L'\0';
+    if (letterCount)
+        pInfo->validFields |= SECTOR_VOLUME_DRIVE_LETTERS;
+
+Done:
+    if (pManagerFile)
+        ObDereferenceObject(pManagerFile);
+    delete[] pPoints;
+    delete[] pInput;
+    return status;
+}
+
+// Looks up the requested fields and returns the ones that were looked up, which includes fields found not to apply.
+static ULONG VolumeFetch(IN PSTORAGE_OBJECT pStorageObject, IN PVOLUME_CACHE pCache OPTIONAL, IN ULONG fields, OUT PSECTOR_VOLUME_INFO pInfo) {
+    ULONG fetched = 0;
+    HANDLE volumeHandle = NULL;
+    PFILE_OBJECT pFileObject = NULL;
+    IO_STATUS_BLOCK ioStatusBlock;
+
+    NTSTATUS status = OpenVolumeFile(pStorageObject, NULL, NULL, 0, 0, &volumeHandle);
+    if (!NT_SUCCESS(status)) {
+        LOG("  opening the volume failed: 0x%08X\n", status);
+        return 0;
+    }
+    status = ObReferenceObjectByHandle(volumeHandle, 0, *IoFileObjectType, KernelMode, (PVOID*)&pFileObject, NULL);
+    if (!NT_SUCCESS(status))
+        goto Done;
+    if (pCache)
+        VolumeWatch(pCache, pFileObject);
+
+    if (fields & (SECTOR_VOLUME_GUID | SECTOR_VOLUME_DRIVE_LETTERS)) {
+        if (NT_SUCCESS(QueryMountPoints(pFileObject->DeviceObject, pInfo)))
+            fetched |= SECTOR_VOLUME_GUID | SECTOR_VOLUME_DRIVE_LETTERS;
+    }
+
+    if (fields & SECTOR_VOLUME_LABEL) {
+        UCHAR buffer[sizeof(FILE_FS_VOLUME_INFORMATION) + 64 * sizeof(WCHAR)];
+        PFILE_FS_VOLUME_INFORMATION pVolume = (PFILE_FS_VOLUME_INFORMATION)buffer;
+        status = ZwQueryVolumeInformationFile(volumeHandle, &ioStatusBlock, pVolume, sizeof(buffer), FileFsVolumeInformation);
+        if (NT_SUCCESS(status) || status == STATUS_BUFFER_OVERFLOW) {
+            pInfo->volumeSerialNumber = pVolume->VolumeSerialNumber;
+            ULONG available = (ULONG)(sizeof(buffer) - FIELD_OFFSET(FILE_FS_VOLUME_INFORMATION, VolumeLabel));
+            CopyName(pInfo->volumeLabel, ARRAYSIZE(pInfo->volumeLabel), pVolume->VolumeLabel, min(pVolume->VolumeLabelLength, available));
+            pInfo->validFields |= SECTOR_VOLUME_LABEL;
+            fetched |= SECTOR_VOLUME_LABEL;
+        }
+    }
+
+    if (fields & SECTOR_VOLUME_FILE_SYSTEM) {
+        UCHAR buffer[sizeof(FILE_FS_ATTRIBUTE_INFORMATION) + 32 * sizeof(WCHAR)];
+        PFILE_FS_ATTRIBUTE_INFORMATION pAttributes = (PFILE_FS_ATTRIBUTE_INFORMATION)buffer;
+        status = ZwQueryVolumeInformationFile(volumeHandle, &ioStatusBlock, pAttributes, sizeof(buffer), FileFsAttributeInformation);
+        if (NT_SUCCESS(status) || status == STATUS_BUFFER_OVERFLOW) {
+            ULONG available = (ULONG)(sizeof(buffer) - FIELD_OFFSET(FILE_FS_ATTRIBUTE_INFORMATION, FileSystemName));
+            CopyName(pInfo->fileSystemName, ARRAYSIZE(pInfo->fileSystemName), pAttributes->FileSystemName, min(pAttributes->FileSystemNameLength, available));
+            pInfo->validFields |= SECTOR_VOLUME_FILE_SYSTEM;
+            fetched |= SECTOR_VOLUME_FILE_SYSTEM;
+        }
+    }
+
+    if (fields & SECTOR_VOLUME_SPACE) {
+        FILE_FS_FULL_SIZE_INFORMATION sizeInformation;
+        status = ZwQueryVolumeInformationFile(volumeHandle, &ioStatusBlock, &sizeInformation, sizeof(sizeInformation), FileFsFullSizeInformation);
+        if (NT_SUCCESS(status)) {
+            ULONGLONG clusterBytes = (ULONGLONG)sizeInformation.SectorsPerAllocationUnit * sizeInformation.BytesPerSector;
+            pInfo->volumeTotalBytes = (ULONGLONG)sizeInformation.TotalAllocationUnits.QuadPart * clusterBytes;
+            pInfo->volumeFreeBytes = (ULONGLONG)sizeInformation.ActualAvailableAllocationUnits.QuadPart * clusterBytes;
+            pInfo->validFields |= SECTOR_VOLUME_SPACE;
+            fetched |= SECTOR_VOLUME_SPACE;
+        }
+    }
+
+Done:
+    if (pFileObject)
+        ObDereferenceObject(pFileObject);
+    ZwClose(volumeHandle);
+    return fetched;
+}
+
+void VolumeQueryInfo(IN PSTORAGE_OBJECT pStorageObject, IN ULONG fields, OUT PSECTOR_VOLUME_INFO pInfo) {
+    RtlZeroMemory(pInfo, sizeof(*pInfo));
+    fields &= SECTOR_VOLUME_ALL_FIELDS;
+    if (!fields || pStorageObject->info.isRawDiskObject || pStorageObject->removedGeneration)
+        return;
+
+    PVOLUME_CACHE pCache = VolumeCacheGet(pStorageObject);
+    LONG generation = 0;
+    BOOLEAN watched = FALSE;
+    ULONG missing = fields;
+    KIRQL irql;
+
+    if (pCache) {
+        KeAcquireSpinLock(&pCache->lock, &irql);
+        generation = pCache->generation;
+        // A change before the volume was watched would have gone unnoticed, so only results looked up afterwards count.
+        watched = pCache->notificationEntry != NULL;
+        if (watched && pCache->cachedGeneration == generation) {
+            ULONG cached = fields & pCache->cachedFields;
+            CopyVolumeFields(pInfo, &pCache->info, cached);
+            missing &= ~cached;
+        }
+        KeReleaseSpinLock(&pCache->lock, irql);
+    }
+    if (!missing)
+        return;
+
+    SECTOR_VOLUME_INFO fetchedInfo;
+    RtlZeroMemory(&fetchedInfo, sizeof(fetchedInfo));
+    ULONG fetched = VolumeFetch(pStorageObject, pCache, missing, &fetchedInfo);
+    CopyVolumeFields(pInfo, &fetchedInfo, fetched);
+
+    if (pCache && watched) {
+        KeAcquireSpinLock(&pCache->lock, &irql);
+        if (pCache->generation == generation) {
+            if (pCache->cachedGeneration != generation) {
+                RtlZeroMemory(&pCache->info, sizeof(pCache->info));
+                pCache->cachedFields = 0;
+                pCache->cachedGeneration = generation;
+            }
+            ULONG cacheable = fetched & VOLUME_CACHED_FIELDS;
+            CopyVolumeFields(&pCache->info, &fetchedInfo, cacheable);
+            pCache->cachedFields |= cacheable;
+        }
+        KeReleaseSpinLock(&pCache->lock, irql);
+    }
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include "Sector.hpp"
+
+#pragma pack (push, 1)
+
+#define SECTOR_VOLUME_GUID              0x00000001  // volumeGuid
+#define SECTOR_VOLUME_DRIVE_LETTERS     0x00000002  // driveLetters
+#define SECTOR_VOLUME_LABEL             0x00000004  // volumeLabel and volumeSerialNumber
+#define SECTOR_VOLUME_FILE_SYSTEM       0x00000008  // fileSystemName
+#define SECTOR_VOLUME_SPACE             0x00000010  // volumeTotalBytes and volumeFreeBytes
+#define SECTOR_VOLUME_ALL_FIELDS        0x0000001F
+
+// Attributes of the volume on a partition. They cost a mount manager query or a file system open each, so they are
+// only looked up when asked for. Everything but the space figures is cached until the volume reports a mount,
+// dismount or name change; the space figures are read on every request.
+typedef struct _SECTOR_VOLUME_INFO {
+    ULONG validFields;              // SECTOR_VOLUME_* that were requested and could be determined
+    GUID volumeGuid;                // as in \\?\Volume{...}
+    ULONGLONG volumeTotalBytes;
+    ULONGLONG volumeFreeBytes;
+    ULONG volumeSerialNumber;
+    WCHAR volumeLabel[64];          // NUL-terminated
+    WCHAR fileSystemName[32];       // NUL-terminated
+    WCHAR driveLetters[27];         // NUL-terminated letters without colons, e.g. L"CE"
+} SECTOR_VOLUME_INFO, *PSECTOR_VOLUME_INFO;
+
+#pragma pack (pop)
+
+// Fills in the requested fields that apply to the storage object; raw disks have none. Fields that cannot be
+// determined, such as the file system of an unformatted partition, are left out of validFields. Runs at PASSIVE_LEVEL.
+void VolumeQueryInfo(IN PSTORAGE_OBJECT pStorageObject, IN ULONG fields, OUT PSECTOR_VOLUME_INFO pInfo);
+// Unregisters the volume change notification, so it runs at PASSIVE_LEVEL and never under a spin lock.
+void VolumeCacheFree(IN PSTORAGE_OBJECT pStorageObject);
@@ -0,0 +1,330 @@
+#include "WorkPool.hpp"
+#include "new.hpp"
+
+typedef struct _WORK_CPU {
+    KSPIN_LOCK lock;
+    WORK_FIFO queue;
+    KEVENT wake;
+    volatile LONG idle;
+    PKTHREAD pThread;
+    PROCESSOR_NUMBER number;
+    GROUP_AFFINITY nodeAffinity;
+
+    // Completions of items submitted from this processor, drained by a DPC targeted at it
+    KSPIN_LOCK completionLock;
+    WORK_FIFO completions;
+    KDPC completionDpc;
+
+    volatile LONG64 submitted;
+    ULONGLONG executed;
+    ULONGLONG stolen;
+    ULONGLONG completed;
+} WORK_CPU, *PWORK_CPU;
+
+typedef struct _WORK_POOL {
+    ULONG cpuCount;
+    PWORK_CPU cpus;
+    unsigned int* depths;       // queue.count of every processor, updated under its lock and read without it
+    unsigned short* nodes;
+    volatile LONG idleWorkers;
+    volatile LONG stopping;
+    EX_RUNDOWN_REF rundown;     // held by submitters, so shutdown knows when nothing more can be queued
+} WORK_POOL, *PWORK_POOL;
+
+static PWORK_POOL g_pWorkPool = NULL;
+
+static ULONG CurrentCpu(IN PWORK_POOL pPool) {
+    // Processors added after the pool was built share the existing queues.
+    return KeGetCurrentProcessorNumberEx(NULL) % pPool->cpuCount;
+}
+
+static VOID WorkCompletionDpc(IN PKDPC pDpc, IN PVOID context, IN PVOID argument1, IN PVOID argument2) {
+    UNREFERENCED_PARAMETER(pDpc);
+    UNREFERENCED_PARAMETER(argument1);
+    UNREFERENCED_PARAMETER(argument2);
+    PWORK_CPU pCpu = (PWORK_CPU)context;
+
+    for (;;) {
+        KeAcquireSpinLockAtDpcLevel(&pCpu->completionLock);
+        PWORK_LINK pLink = WorkFifoPop(&pCpu->completions);
+        if (pLink)
+            pCpu->completed++;
+        KeReleaseSpinLockFromDpcLevel(&pCpu->completionLock);
+        if (!pLink)
+            break;
+
+        PWORK_ITEM pItem = CONTAINING_RECORD(pLink, WORK_ITEM, link);
+        pItem->completionRoutine(pItem);
+    }
+}
+
+static PWORK_ITEM WorkPop(IN PWORK_POOL pPool, IN ULONG cpu) {
+    PWORK_CPU pCpu = &pPool->cpus[cpu];
+    KIRQL oldIrql;
+    KeAcquireSpinLock(&pCpu->lock, &oldIrql);
+    PWORK_LINK pLink = WorkFifoPop(&pCpu->queue);
+    pPool->depths[cpu] = pCpu->queue.count;
+    KeReleaseSpinLock(&pCpu->lock, oldIrql);
+    return pLink ? CONTAINING_RECORD(pLink, WORK_ITEM, link) : NULL;
+}
+
+static PWORK_ITEM WorkSteal(IN PWORK_POOL pPool, IN ULONG self) {
+    // The depths may be stale; an empty victim just means another round.
+    for (ULONG attempt = 0; attempt < pPool->cpuCount; attempt++) {
+        int victim = WorkChooseVictim(pPool->depths, pPool->nodes, pPool->cpuCount, self);
+        if (victim < 0)
+            return NULL;
+        PWORK_ITEM pItem = WorkPop(pPool, (ULONG)victim);
+        if (pItem) {
+            pPool->cpus[self].stolen++;
+            return pItem;
+        }
+    }
+    return NULL;
+}
+
+static BOOLEAN WorkAnyQueued(IN PWORK_POOL pPool) {
+    for (ULONG i = 0; i < pPool->cpuCount; i++) {
+        if (pPool->depths[i])
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static void WorkDeliverCompletion(IN PWORK_POOL pPool, IN PWORK_ITEM pItem) {
+    PWORK_CPU pTarget = &pPool->cpus[pItem->submitProcessor];
+    KIRQL oldIrql;
+    KeAcquireSpinLock(&pTarget->completionLock, &oldIrql);
+    WorkFifoPush(&pTarget->completions, &pItem->link);
+    KeReleaseSpinLock(&pTarget->completionLock, oldIrql);
+    // Already queued is fine; the DPC drains the whole list.
+    KeInsertQueueDpc(&pTarget->completionDpc, NULL, NULL);
+}
+
+static VOID WorkerThread(IN PVOID context) {
+    PWORK_CPU pCpu = (PWORK_CPU)context;
+    PWORK_POOL pPool = g_pWorkPool;
+    ULONG self = (ULONG)(pCpu - pPool->cpus);
+
+    KeSetSystemGroupAffinityThread(&pCpu->nodeAffinity, NULL);
+
+    for (;;) {
+        PWORK_ITEM pItem = WorkPop(pPool, self);
+        if (!pItem)
+            pItem = WorkSteal(pPool, self);
+
+        if (pItem) {
+            pCpu->executed++;
+            // Read before the routine runs; without a completion routine the item may be gone afterwards.
+            BOOLEAN complete = pItem->completionRoutine != NULL;
+            pItem->routine(pItem);
+            if (complete)
+                WorkDeliverCompletion(pPool, pItem);
+            continue;
+        }
+
+        if (pPool->stopping)
+            break;
+
+        // Publish idleness before the last look, so a submitter either sees us idle or we see its item.
+        InterlockedExchange(&pCpu->idle, 1);
+        InterlockedIncrement(&pPool->idleWorkers);
+        if (!WorkAnyQueued(pPool) && !pPool->stopping)
+            KeWaitForSingleObject(&pCpu->wake, Executive, KernelMode, FALSE, NULL);
+        InterlockedDecrement(&pPool->idleWorkers);
+        InterlockedExchange(&pCpu->idle, 0);
+    }
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+static void WorkWakeIdleWorker(IN PWORK_POOL pPool, IN ULONG cpu) {
+    PWORK_CPU pFallback = NULL;
+    for (ULONG i = 0; i < pPool->cpuCount; i++) {
+        PWORK_CPU pCpu = &pPool->cpus[i];
+        if (i == cpu || !pCpu->idle)
+            continue;
+        if (pPool->nodes[i] == pPool->nodes[cpu]) {
+            KeSetEvent(&pCpu->wake, IO_NO_INCREMENT, FALSE);
+            return;
+        }
+        if (!pFallback)
+            pFallback = pCpu;
+    }
+    if (pFallback)
+        KeSetEvent(&pFallback->wake, IO_NO_INCREMENT, FALSE);
+}
+
+void WorkItemInitialize(OUT PWORK_ITEM pItem, IN PWORK_ROUTINE routine, IN PWORK_COMPLETION_ROUTINE completionRoutine OPTIONAL, IN PVOID context) {
+    RtlZeroMemory(pItem, sizeof(*pItem));
+    pItem->routine = routine;
+    pItem->completionRoutine = completionRoutine;
+    pItem->context = context;
+}
+
+NTSTATUS WorkPoolSubmit(IN PWORK_ITEM pItem) {
+    PWORK_POOL pPool = g_pWorkPool;
+    if (!pPool || !ExAcquireRundownProtection(&pPool->rundown))
+        return STATUS_DEVICE_NOT_READY;
+
+    KIRQL oldIrql;
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+    ULONG cpu = CurrentCpu(pPool);
+    PWORK_CPU pCpu = &pPool->cpus[cpu];
+    pItem->submitProcessor = cpu;
+
+    KeAcquireSpinLockAtDpcLevel(&pCpu->lock);
+    WorkFifoPush(&pCpu->queue, &pItem->link);
+    unsigned int depth = pCpu->queue.count;
+    pPool->depths[cpu] = depth;
+    KeReleaseSpinLockFromDpcLevel(&pCpu->lock);
+    InterlockedIncrement64(&pCpu->submitted);
+
+    KeSetEvent(&pCpu->wake, IO_NO_INCREMENT, FALSE);
+    // The local worker can only take one at a time; let an idle one elsewhere help out.
+    if (depth > 1 && pPool->idleWorkers)
+        WorkWakeIdleWorker(pPool, cpu);
+    KeLowerIrql(oldIrql);
+    ExReleaseRundownProtection(&pPool->rundown);
+    return STATUS_SUCCESS;
+}
+
+static void WorkPoolFree(IN PWORK_POOL pPool) {
+    if (pPool->cpus) delete[] pPool->cpus;
+    if (pPool->depths) delete[] pPool->depths;
+    if (pPool->nodes) delete[] pPool->nodes;
+    delete pPool;
+}
+
+NTSTATUS WorkPoolInitialize() {
+    PWORK_POOL pPool = new (NON_PAGED) WORK_POOL;
+    if (!pPool)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    RtlZeroMemory(pPool, sizeof(*pPool));
+    ExInitializeRundownProtection(&pPool->rundown);
+
+    ULONG cpuCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    pPool->cpus = new (NON_PAGED) WORK_CPU[cpuCount];
+    pPool->depths = new (NON_PAGED) unsigned int[cpuCount];
+    pPool->nodes = new (NON_PAGED) unsigned short[cpuCount];
+    if (!pPool->cpus || !pPool->depths || !pPool->nodes) {
+        WorkPoolFree(pPool);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(pPool->cpus, sizeof(WORK_CPU) * cpuCount);
+    RtlZeroMemory(pPool->depths, sizeof(unsigned int) * cpuCount);
+    RtlZeroMemory(pPool->nodes, sizeof(unsigned short) * cpuCount);
+    pPool->cpuCount = cpuCount;
+
+    for (ULONG i = 0; i < cpuCount; i++) {
+        PWORK_CPU pCpu = &pPool->cpus[i];
+        KeInitializeSpinLock(&pCpu->lock);
+        KeInitializeSpinLock(&pCpu->completionLock);
+        WorkFifoInit(&pCpu->queue);
+        WorkFifoInit(&pCpu->completions);
+        KeInitializeEvent(&pCpu->wake, SynchronizationEvent, FALSE);
+        KeGetProcessorNumberFromIndex(i, &pCpu->number);
+        KeInitializeDpc(&pCpu->completionDpc, WorkCompletionDpc, pCpu);
+        KeSetTargetProcessorDpcEx(&pCpu->completionDpc, &pCpu->number);
+
+        // Until a node claims it, a processor's worker is bound to the processor itself.
+        pCpu->nodeAffinity.Group = pCpu->number.Group;
+        pCpu->nodeAffinity.Mask = (KAFFINITY)1 << pCpu->number.Number;
+    }
+
+    for (USHORT node = 0; node <= KeQueryHighestNodeNumber(); node++) {
+        GROUP_AFFINITY affinity;
+        RtlZeroMemory(&affinity, sizeof(affinity));
+        KeQueryNodeActiveAffinity(node, &affinity, NULL);
+        for (UCHAR bit = 0; bit < sizeof(KAFFINITY) * 8; bit++) {
+            if (!(affinity.Mask & ((KAFFINITY)1 << bit)))
+                continue;
+            PROCESSOR_NUMBER number;
+            RtlZeroMemory(&number, sizeof(number));
+            number.Group = affinity.Group;
+            number.Number = bit;
+            ULONG index = KeGetProcessorIndexFromNumber(&number);
+            if (index < cpuCount) {
+                pPool->nodes[index] = node;
+                pPool->cpus[index].nodeAffinity = affinity;
+            }
+        }
+    }
+
+    g_pWorkPool = pPool;
+    for (ULONG i = 0; i < cpuCount; i++) {
+        HANDLE hThread = NULL;
+        OBJECT_ATTRIBUTES attributes;
+        InitializeObjectAttributes(&attributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+        NTSTATUS status = PsCreateSystemThread(&hThread, THREAD_ALL_ACCESS, &attributes, NULL, NULL, WorkerThread, &pPool->cpus[i]);
+        if (!NT_SUCCESS(status)) {
+            LOG("PsCreateSystemThread for worker %lu failed: 0x%08X\n", i, status);
+            WorkPoolShutdown();
+            return status;
+        }
+        PVOID pThread = NULL;
+        ObReferenceObjectByHandle(hThread, THREAD_ALL_ACCESS, *PsThreadType, KernelMode, &pThread, NULL);
+        ZwClose(hThread);
+        pPool->cpus[i].pThread = (PKTHREAD)pThread;
+    }
+    return STATUS_SUCCESS;
+}
+
+void WorkPoolShutdown() {
+    PWORK_POOL pPool = g_pWorkPool;
+    if (!pPool)
+        return;
+
+    // Submitters that got in before the rundown finish queueing their items, so the workers see them before they exit.
+    ExWaitForRundownProtectionRelease(&pPool->rundown);
+    InterlockedExchange(&pPool->stopping, 1);
+    for (ULONG i = 0; i < pPool->cpuCount; i++)
+        KeSetEvent(&pPool->cpus[i].wake, IO_NO_INCREMENT, FALSE);
+    for (ULONG i = 0; i < pPool->cpuCount; i++) {
+        if (pPool->cpus[i].pThread) {
+            KeWaitForSingleObject(pPool->cpus[i].pThread, Executive, KernelMode, FALSE, NULL);
+            ObDereferenceObject(pPool->cpus[i].pThread);
+        }
+    }
+    // Completion DPCs queued by the last items must finish before their processors' state goes away.
+    KeFlushQueuedDpcs();
+
+    g_pWorkPool = NULL;
+    WorkPoolFree(pPool);
+}
+
+NTSTATUS WorkPoolStatsIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack) {
+    LOG("WorkPoolStatsIoctlHandler called\n");
+    PWORK_POOL pPool = g_pWorkPool;
+    if (!pPool)
+        return STATUS_DEVICE_NOT_READY;
+
+    ULONG outLength = pIrpStack->Parameters.DeviceIoControl.OutputBufferLength;
+    ULONG needed = sizeof(SECTOR_WORK_POOL_STATS) + pPool->cpuCount * sizeof(SECTOR_WORK_POOL_CPU_STATS);
+    PUCHAR outBuffer = (PUCHAR)pIrp->UserBuffer;
+    if (!outBuffer || outLength < needed)
+        return STATUS_BUFFER_TOO_SMALL;
+
+    __try {
+        ProbeForWrite(outBuffer, needed, 1);
+        ((PSECTOR_WORK_POOL_STATS)outBuffer)->processorCount = pPool->cpuCount;
+        PSECTOR_WORK_POOL_CPU_STATS pStats = (PSECTOR_WORK_POOL_CPU_STATS)(outBuffer + sizeof(SECTOR_WORK_POOL_STATS));
+        for (ULONG i = 0; i < pPool->cpuCount; i++) {
+            PWORK_CPU pCpu = &pPool->cpus[i];
+            SECTOR_WORK_POOL_CPU_STATS stats;
+            stats.processorIndex = i;
+            stats.node = pPool->nodes[i];
+            stats.queued = pPool->depths[i];
+            stats.submitted = (ULONGLONG)pCpu->submitted;
+            stats.executed = pCpu->executed;
+            stats.stolen = pCpu->stolen;
+            stats.completions = pCpu->completed;
+            RtlCopyMemory(&pStats[i], &stats, sizeof(stats));
+        }
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        return GetExceptionCode();
+    }
+    pIrp->IoStatus.Information = needed;
+    return STATUS_SUCCESS;
+}
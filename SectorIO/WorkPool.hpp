@@ -0,0 +1,50 @@
+#pragma once
+#include "Driver.hpp"
+#include "WorkQueue.hpp"
+
+#pragma pack (push, 1)
+
+typedef struct _SECTOR_WORK_POOL_CPU_STATS {
+    ULONG processorIndex;
+    USHORT node;
+    ULONG queued;               // waiting right now
+    ULONGLONG submitted;        // submitted from this processor
+    ULONGLONG executed;         // run by this processor's worker, stolen ones included
+    ULONGLONG stolen;           // taken from another processor's queue
+    ULONGLONG completions;      // completion routines delivered on this processor
+} SECTOR_WORK_POOL_CPU_STATS, *PSECTOR_WORK_POOL_CPU_STATS;
+
+typedef struct _SECTOR_WORK_POOL_STATS {
+    ULONG processorCount;
+    // SECTOR_WORK_POOL_CPU_STATS cpus[processorCount]; the output buffer has to be large enough for all of them
+} SECTOR_WORK_POOL_STATS, *PSECTOR_WORK_POOL_STATS;
+
+#pragma pack (pop)
+
+struct _WORK_ITEM;
+// Runs at PASSIVE_LEVEL on a pool worker.
+typedef VOID (*PWORK_ROUTINE)(IN struct _WORK_ITEM* pItem);
+// Runs at DISPATCH_LEVEL on the processor the item was submitted from. The item may be freed from here.
+typedef VOID (*PWORK_COMPLETION_ROUTINE)(IN struct _WORK_ITEM* pItem);
+
+// Caller-owned; has to stay valid until the completion routine runs, or until the work routine returns if there is
+// no completion routine.
+typedef struct _WORK_ITEM {
+    WORK_LINK link;
+    PWORK_ROUTINE routine;
+    PWORK_COMPLETION_ROUTINE completionRoutine;    // OPTIONAL
+    PVOID context;
+    ULONG submitProcessor;
+} WORK_ITEM, *PWORK_ITEM;
+
+// One submission queue and one system worker thread per processor. Workers are bound to the NUMA node of their
+// processor; a worker that runs dry steals the oldest item of the deepest queue on its node, then of any node.
+NTSTATUS WorkPoolInitialize();
+// Runs everything still queued before the workers exit.
+void WorkPoolShutdown();
+
+void WorkItemInitialize(OUT PWORK_ITEM pItem, IN PWORK_ROUTINE routine, IN PWORK_COMPLETION_ROUTINE completionRoutine OPTIONAL, IN PVOID context);
+// Queues the item on the current processor. Callable at IRQL <= DISPATCH_LEVEL.
+NTSTATUS WorkPoolSubmit(IN PWORK_ITEM pItem);
+
+NTSTATUS WorkPoolStatsIoctlHandler(IN PIRP pIrp, IN PIO_STACK_LOCATION pIrpStack);
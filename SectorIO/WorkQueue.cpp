@@ -0,0 +1,50 @@
+#include "WorkQueue.hpp"
+
+void WorkFifoInit(PWORK_FIFO fifo) {
+    fifo->head = 0;
+    fifo->tail = 0;
+    fifo->count = 0;
+}
+
+void WorkFifoPush(PWORK_FIFO fifo, PWORK_LINK link) {
+    link->next = 0;
+    if (fifo->tail)
+        fifo->tail->next = link;
+    else
+        fifo->head = link;
+    fifo->tail = link;
+    fifo->count++;
+}
+
+PWORK_LINK WorkFifoPop(PWORK_FIFO fifo) {
+    PWORK_LINK link = fifo->head;
+    if (!link)
+        return 0;
+    fifo->head = link->next;
+    if (!fifo->head)
+        fifo->tail = 0;
+    fifo->count--;
+    link->next = 0;
+    return link;
+}
+
+int WorkChooseVictim(const unsigned int* depths, const unsigned short* nodes, unsigned int queueCount, unsigned int self) {
+    int local = -1, remote = -1;
+    unsigned int localDepth = 0, remoteDepth = 0;
+
+    for (unsigned int i = 0; i < queueCount; i++) {
+        if (i == self || depths[i] == 0)
+            continue;
+        if (nodes[i] == nodes[self]) {
+            if (depths[i] > localDepth) {
+                local = (int)i;
+                localDepth = depths[i];
+            }
+        }
+        else if (depths[i] > remoteDepth) {
+            remote = (int)i;
+            remoteDepth = depths[i];
+        }
+    }
+    return local >= 0 ? local : remote;
+}
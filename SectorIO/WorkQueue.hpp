@@ -0,0 +1,23 @@
+#pragma once
+// Queue and victim selection used by the worker pool. Kept free of WDK dependencies so the scheduling logic can be
+// driven by a host-side thread pool as well; callers provide the locking.
+
+typedef struct _WORK_LINK {
+    struct _WORK_LINK* next;
+} WORK_LINK, *PWORK_LINK;
+
+// Intrusive FIFO; items are popped from the head by the owner and stolen from the head by thieves, so stolen work
+// is always the oldest.
+typedef struct _WORK_FIFO {
+    PWORK_LINK head;
+    PWORK_LINK tail;
+    unsigned int count;
+} WORK_FIFO, *PWORK_FIFO;
+
+void WorkFifoInit(PWORK_FIFO fifo);
+void WorkFifoPush(PWORK_FIFO fifo, PWORK_LINK link);
+PWORK_LINK WorkFifoPop(PWORK_FIFO fifo);
+
+// Picks the queue an idle worker should steal from: the deepest queue on its own node, or the deepest queue anywhere
+// if its node has nothing queued. depths are unsynchronized snapshots. Returns -1 when every other queue is empty.
+int WorkChooseVictim(const unsigned int* depths, const unsigned short* nodes, unsigned int queueCount, unsigned int self);
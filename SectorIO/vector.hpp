@@ -348,6 +348,30 @@ public:
         return nullptr;
     }
 
+    BOOLEAN remove_item(_In_ const T& item) {
+        Node* n = nullptr;
+
+        {
+            scoped_lock lk(&_lock);
+            PLIST_ENTRY ptr = _head.Flink;
+            while (ptr != &_head) {
+                Node* candidate = CONTAINING_RECORD(ptr, Node, entry);
+                if (candidate->data == item) {
+                    RemoveEntryList(ptr);
+                    _count--;
+                    n = candidate;
+                    break;
+                }
+                ptr = ptr->Flink;
+            }
+        }
+
+        if (!n)
+            return FALSE;
+        delete n;
+        return TRUE;
+    }
+
     T* at(_In_ ULONG index) {
         scoped_lock lk(&_lock);
         if (index >= _count)
@@ -0,0 +1,182 @@
+#include "Lz4Block.hpp"
+#include <string.h>
+
+#define LZ4_MIN_MATCH       4
+#define LZ4_LAST_LITERALS   5       // the block always ends with at least this many literals
+#define LZ4_MF_LIMIT        12      // no match may start closer than this to the end of the block
+#define LZ4_MAX_DISTANCE    65535
+#define LZ4_HASH_LOG        12
+#define LZ4_SKIP_TRIGGER    6       // the search step grows by one every 2^6 misses in incompressible data
+
+static inline unsigned int Load32(const unsigned char* p) {
+    unsigned int value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline unsigned int HashPosition(const unsigned char* p) {
+    return (Load32(p) * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+static unsigned char* WriteLength(unsigned char* op, size_t length) {
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (unsigned char)length;
+    return op;
+}
+
+static unsigned char* WriteLastLiterals(unsigned char* op, const unsigned char* literals, size_t literalLength, const unsigned char* outputEnd) {
+    if ((size_t)(outputEnd - op) < 1 + literalLength / 255 + 1 + literalLength)
+        return NULL;
+    if (literalLength >= 15) {
+        *op++ = 15 << 4;
+        op = WriteLength(op, literalLength - 15);
+    }
+    else
+        *op++ = (unsigned char)(literalLength << 4);
+    if (literalLength)
+        memcpy(op, literals, literalLength);
+    return op + literalLength;
+}
+
+size_t Lz4CompressBound(size_t length) {
+    return length + length / 255 + 16;
+}
+
+size_t Lz4Compress(const void* source, size_t length, void* destination, size_t capacity) {
+    const unsigned char* const base = (const unsigned char*)source;
+    const unsigned char* const end = base + length;
+    const unsigned char* anchor = base;
+    unsigned char* op = (unsigned char*)destination;
+    unsigned char* const outputEnd = op + capacity;
+
+    if (length > LZ4_MF_LIMIT) {
+        const unsigned char* const matchStartLimit = end - LZ4_MF_LIMIT;
+        const unsigned char* const matchEndLimit = end - LZ4_LAST_LITERALS;
+        unsigned int table[1 << LZ4_HASH_LOG];
+        memset(table, 0, sizeof(table));
+
+        const unsigned char* ip = base + 1;
+        unsigned int misses = 1 << LZ4_SKIP_TRIGGER;
+        while (ip < matchStartLimit) {
+            unsigned int hash = HashPosition(ip);
+            const unsigned char* match = base + table[hash];
+            table[hash] = (unsigned int)(ip - base);
+            if (match >= ip || ip - match > LZ4_MAX_DISTANCE || Load32(match) != Load32(ip)) {
+                ip += misses++ >> LZ4_SKIP_TRIGGER;
+                continue;
+            }
+            misses = 1 << LZ4_SKIP_TRIGGER;
+
+            while (ip > anchor && match > base && ip[-1] == match[-1]) {
+                ip--;
+                match--;
+            }
+            size_t matchLength = LZ4_MIN_MATCH;
+            while (ip + matchLength < matchEndLimit && ip[matchLength] == match[matchLength])
+                matchLength++;
+
+            size_t literalLength = (size_t)(ip - anchor);
+            size_t needed = 1 + literalLength / 255 + 1 + literalLength + 2 + (matchLength - LZ4_MIN_MATCH) / 255 + 1;
+            if ((size_t)(outputEnd - op) < needed)
+                return 0;
+
+            unsigned char* token = op++;
+            if (literalLength >= 15) {
+                *token = 15 << 4;
+                op = WriteLength(op, literalLength - 15);
+            }
+            else
+                *token = (unsigned char)(literalLength << 4);
+            memcpy(op, anchor, literalLength);
+            op += literalLength;
+
+            unsigned int distance = (unsigned int)(ip - match);
+            *op++ = (unsigned char)distance;
+            *op++ = (unsigned char)(distance >> 8);
+
+            size_t extra = matchLength - LZ4_MIN_MATCH;
+            if (extra >= 15) {
+                *token |= 15;
+                op = WriteLength(op, extra - 15);
+            }
+            else
+                *token |= (unsigned char)extra;
+
+            ip += matchLength;
+            anchor = ip;
+            // Seed the table inside the match so the next search has a recent candidate.
+            if (ip < matchStartLimit)
+                table[HashPosition(ip - 2)] = (unsigned int)(ip - 2 - base);
+        }
+    }
+
+    op = WriteLastLiterals(op, anchor, (size_t)(end - anchor), outputEnd);
+    return op ? (size_t)(op - (unsigned char*)destination) : 0;
+}
+
+static bool ReadLength(const unsigned char** pip, const unsigned char* inputEnd, size_t* length) {
+    const unsigned char* ip = *pip;
+    unsigned char byte;
+    do {
+        if (ip >= inputEnd)
+            return false;
+        byte = *ip++;
+        *length += byte;
+    } while (byte == 255);
+    *pip = ip;
+    return true;
+}
+
+long long Lz4Decompress(const void* source, size_t length, void* destination, size_t capacity) {
+    const unsigned char* ip = (const unsigned char*)source;
+    const unsigned char* const inputEnd = ip + length;
+    unsigned char* const outputBase = (unsigned char*)destination;
+    unsigned char* op = outputBase;
+    unsigned char* const outputEnd = op + capacity;
+
+    for (;;) {
+        if (ip >= inputEnd)
+            return -1;
+        unsigned int token = *ip++;
+
+        size_t literalLength = token >> 4;
+        if (literalLength == 15 && !ReadLength(&ip, inputEnd, &literalLength))
+            return -1;
+        if (literalLength > (size_t)(inputEnd - ip) || literalLength > (size_t)(outputEnd - op))
+            return -1;
+        memcpy(op, ip, literalLength);
+        op += literalLength;
+        ip += literalLength;
+        if (ip == inputEnd)
+            break;
+
+        if (inputEnd - ip < 2)
+            return -1;
+        size_t distance = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (distance == 0 || distance > (size_t)(op - outputBase))
+            return -1;
+
+        size_t matchLength = token & 15;
+        if (matchLength == 15 && !ReadLength(&ip, inputEnd, &matchLength))
+            return -1;
+        matchLength += LZ4_MIN_MATCH;
+        if (matchLength > (size_t)(outputEnd - op))
+            return -1;
+
+        const unsigned char* match = op - distance;
+        if (distance >= matchLength) {
+            memcpy(op, match, matchLength);
+            op += matchLength;
+        }
+        else {
+            // Overlapping copy repeats the last distance bytes.
+            for (size_t i = 0; i < matchLength; i++)
+                *op++ = *match++;
+        }
+    }
+    return (long long)(op - outputBase);
+}
@@ -0,0 +1,13 @@
+#pragma once
+// LZ4 block format (no frame header), compatible with LZ4_compress_default / LZ4_decompress_safe. Self-contained so the
+// image library builds without third-party packages on both Windows and Linux.
+#include <stddef.h>
+
+// Worst-case compressed size of length input bytes.
+size_t Lz4CompressBound(size_t length);
+
+// Greedy single-pass compressor. Returns the compressed size, or 0 if the result would not fit in capacity.
+size_t Lz4Compress(const void* source, size_t length, void* destination, size_t capacity);
+
+// Returns the decompressed size, or -1 if the input is malformed or would overrun capacity.
+long long Lz4Decompress(const void* source, size_t length, void* destination, size_t capacity);
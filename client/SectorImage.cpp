@@ -0,0 +1,557 @@
+#include "SectorImage.hpp"
+#include "Lz4Block.hpp"
+#include "../SectorIO/Digest.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#define FileSeek    _fseeki64
+#define FileTell    _ftelli64
+#else
+#define FileSeek    fseeko
+#define FileTell    ftello
+#endif
+
+#define IMAGE_FILE_BUFFER_BYTES     (4 * 1024 * 1024)
+#define IMAGE_SLOTS_PER_THREAD      2
+
+static unsigned long long HashBytes(const void* data, size_t length, unsigned long long seed) {
+    XXH64_STATE state;
+    Xxh64Init(&state, seed);
+    Xxh64Update(&state, data, length);
+    return Xxh64Final(&state);
+}
+
+static bool IsAllZero(const unsigned char* data, size_t length) {
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        unsigned long long words[4];
+        memcpy(words, data + i, sizeof(words));
+        if (words[0] | words[1] | words[2] | words[3])
+            return false;
+    }
+    for (; i < length; i++) {
+        if (data[i])
+            return false;
+    }
+    return true;
+}
+
+const char* ImageStatusString(IMAGE_STATUS status) {
+    switch (status) {
+    case IMAGE_OK: return "ok";
+    case IMAGE_ERROR_IO: return "image file I/O failed";
+    case IMAGE_ERROR_FORMAT: return "not a complete image";
+    case IMAGE_ERROR_CORRUPT: return "image is corrupt";
+    case IMAGE_ERROR_NO_MEMORY: return "out of memory";
+    case IMAGE_ERROR_RANGE: return "out of range";
+    case IMAGE_ERROR_SOURCE: return "source read failed";
+    case IMAGE_ERROR_PARAMETER: return "invalid parameter";
+    }
+    return "unknown";
+}
+
+//
+// Writer
+//
+
+typedef enum _SLOT_STATE {
+    SLOT_FREE,
+    SLOT_FILLED,        // read from the source, waiting for a worker
+    SLOT_DONE,          // compressed and hashed, waiting for the image writer
+} SLOT_STATE;
+
+typedef struct _IMAGE_SLOT {
+    SLOT_STATE state;
+    unsigned long long chunk;
+    size_t length;
+    std::vector<unsigned char> data;
+    std::vector<unsigned char> stored;
+    IMAGE_CHUNK_ENTRY entry;
+} IMAGE_SLOT, *PIMAGE_SLOT;
+
+// The calling thread reads chunks into a ring of slots, workers compress whatever is FILLED, and the output thread
+// writes slots strictly in chunk order. A slot is reused once the output thread has written it, which bounds memory
+// to the ring and lets a slow disk on either side throttle the other.
+typedef struct _IMAGE_PIPELINE {
+    std::mutex lock;
+    std::condition_variable slotFreed;
+    std::condition_variable slotFilled;
+    std::condition_variable slotDone;
+    std::vector<IMAGE_SLOT> slots;
+    std::deque<size_t> ready;           // FILLED slots in chunk order
+    bool finished;                      // no more chunks will be filled
+    IMAGE_STATUS status;
+    IMAGE_CODEC codec;
+    FILE* file;
+    unsigned long long chunkCount;
+    std::vector<IMAGE_CHUNK_ENTRY> index;
+    IMAGE_WRITE_STATS stats;
+} IMAGE_PIPELINE, *PIMAGE_PIPELINE;
+
+static void FailPipeline(PIMAGE_PIPELINE pipeline, IMAGE_STATUS status) {
+    std::lock_guard<std::mutex> guard(pipeline->lock);
+    if (pipeline->status == IMAGE_OK)
+        pipeline->status = status;
+    pipeline->slotFreed.notify_all();
+    pipeline->slotFilled.notify_all();
+    pipeline->slotDone.notify_all();
+}
+
+static void EncodeChunk(PIMAGE_PIPELINE pipeline, PIMAGE_SLOT slot) {
+    PIMAGE_CHUNK_ENTRY entry = &slot->entry;
+    if (entry->type == IMAGE_CHUNK_UNALLOCATED)
+        return;
+
+    if (IsAllZero(slot->data.data(), slot->length)) {
+        entry->type = IMAGE_CHUNK_ZERO;
+        return;
+    }
+
+    entry->hash = HashBytes(slot->data.data(), slot->length, slot->chunk);
+    if (pipeline->codec == IMAGE_CODEC_LZ4) {
+        // Keep the compressed form only if it saves something; incompressible data is stored as is.
+        size_t compressed = Lz4Compress(slot->data.data(), slot->length, slot->stored.data(), slot->length - 1);
+        if (compressed) {
+            entry->type = IMAGE_CHUNK_LZ4;
+            entry->storedBytes = (unsigned int)compressed;
+            return;
+        }
+    }
+    entry->type = IMAGE_CHUNK_RAW;
+    entry->storedBytes = (unsigned int)slot->length;
+}
+
+static void CompressWorker(PIMAGE_PIPELINE pipeline) {
+    for (;;) {
+        PIMAGE_SLOT slot;
+        {
+            std::unique_lock<std::mutex> guard(pipeline->lock);
+            pipeline->slotFilled.wait(guard, [pipeline] {
+                return !pipeline->ready.empty() || pipeline->finished || pipeline->status != IMAGE_OK;
+            });
+            if (pipeline->ready.empty() || pipeline->status != IMAGE_OK)
+                return;
+            slot = &pipeline->slots[pipeline->ready.front()];
+            pipeline->ready.pop_front();
+        }
+
+        EncodeChunk(pipeline, slot);
+
+        std::lock_guard<std::mutex> guard(pipeline->lock);
+        slot->state = SLOT_DONE;
+        pipeline->slotDone.notify_all();
+    }
+}
+
+static void OutputWriter(PIMAGE_PIPELINE pipeline, unsigned long long firstChunkOffset) {
+    unsigned long long fileOffset = firstChunkOffset;
+    size_t slotCount = pipeline->slots.size();
+
+    for (unsigned long long chunk = 0; chunk < pipeline->chunkCount; chunk++) {
+        PIMAGE_SLOT slot = &pipeline->slots[chunk % slotCount];
+        {
+            std::unique_lock<std::mutex> guard(pipeline->lock);
+            pipeline->slotDone.wait(guard, [pipeline, slot, chunk] {
+                return (slot->state == SLOT_DONE && slot->chunk == chunk) || pipeline->status != IMAGE_OK;
+            });
+            if (pipeline->status != IMAGE_OK)
+                return;
+        }
+
+        PIMAGE_CHUNK_ENTRY entry = &slot->entry;
+        if (entry->type == IMAGE_CHUNK_RAW || entry->type == IMAGE_CHUNK_LZ4) {
+            const unsigned char* payload = entry->type == IMAGE_CHUNK_LZ4 ? slot->stored.data() : slot->data.data();
+            if (fwrite(payload, 1, entry->storedBytes, pipeline->file) != entry->storedBytes) {
+                FailPipeline(pipeline, IMAGE_ERROR_IO);
+                return;
+            }
+            entry->fileOffset = fileOffset;
+            fileOffset += entry->storedBytes;
+        }
+        pipeline->index[chunk] = *entry;
+
+        std::lock_guard<std::mutex> guard(pipeline->lock);
+        PIMAGE_WRITE_STATS stats = &pipeline->stats;
+        stats->bytesStored += entry->storedBytes;
+        switch (entry->type) {
+        case IMAGE_CHUNK_ZERO: stats->zeroChunks++; break;
+        case IMAGE_CHUNK_UNALLOCATED: stats->unallocatedChunks++; break;
+        case IMAGE_CHUNK_RAW: stats->rawChunks++; break;
+        case IMAGE_CHUNK_LZ4: stats->compressedChunks++; break;
+        }
+        slot->state = SLOT_FREE;
+        pipeline->slotFreed.notify_all();
+    }
+}
+
+static void FillSlots(PIMAGE_PIPELINE pipeline, const IMAGE_SOURCE* source, unsigned int chunkBytes) {
+    size_t slotCount = pipeline->slots.size();
+
+    for (unsigned long long chunk = 0; chunk < pipeline->chunkCount; chunk++) {
+        PIMAGE_SLOT slot = &pipeline->slots[chunk % slotCount];
+        {
+            std::unique_lock<std::mutex> guard(pipeline->lock);
+            pipeline->slotFreed.wait(guard, [pipeline, slot] {
+                return slot->state == SLOT_FREE || pipeline->status != IMAGE_OK;
+            });
+            if (pipeline->status != IMAGE_OK)
+                return;
+        }
+
+        unsigned long long offset = chunk * chunkBytes;
+        slot->chunk = chunk;
+        slot->length = (size_t)(source->totalBytes - offset < chunkBytes ? source->totalBytes - offset : chunkBytes);
+        memset(&slot->entry, 0, sizeof(slot->entry));
+
+        if (source->isAllocated && !source->isAllocated(source->context, offset, slot->length))
+            slot->entry.type = IMAGE_CHUNK_UNALLOCATED;
+        else if (source->read(source->context, offset, slot->data.data(), slot->length) != 0) {
+            FailPipeline(pipeline, IMAGE_ERROR_SOURCE);
+            return;
+        }
+        else
+            pipeline->stats.bytesRead += slot->length;
+
+        std::lock_guard<std::mutex> guard(pipeline->lock);
+        slot->state = SLOT_FILLED;
+        pipeline->ready.push_back(chunk % slotCount);
+        pipeline->slotFilled.notify_one();
+    }
+}
+
+IMAGE_STATUS ImageWrite(const char* path, const IMAGE_SOURCE* source, const IMAGE_WRITE_OPTIONS* options, PIMAGE_WRITE_STATS stats) {
+    unsigned int chunkBytes = options && options->chunkBytes ? options->chunkBytes : IMAGE_DEFAULT_CHUNK_BYTES;
+    unsigned int threads = options && options->threads ? options->threads : std::thread::hardware_concurrency();
+    IMAGE_CODEC codec = options ? options->codec : IMAGE_CODEC_LZ4;
+    if (threads == 0)
+        threads = 1;
+
+    if (!source || !source->read || source->sectorSize == 0 || chunkBytes < IMAGE_MIN_CHUNK_BYTES ||
+        chunkBytes > IMAGE_MAX_CHUNK_BYTES || chunkBytes % source->sectorSize || source->totalBytes % source->sectorSize ||
+        (codec != IMAGE_CODEC_NONE && codec != IMAGE_CODEC_LZ4))
+        return IMAGE_ERROR_PARAMETER;
+
+    IMAGE_PIPELINE pipeline;
+    pipeline.finished = false;
+    pipeline.status = IMAGE_OK;
+    pipeline.codec = codec;
+    pipeline.chunkCount = (source->totalBytes + chunkBytes - 1) / chunkBytes;
+    memset(&pipeline.stats, 0, sizeof(pipeline.stats));
+
+    IMAGE_HEADER header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.version = IMAGE_VERSION;
+    header.chunkBytes = chunkBytes;
+    header.sectorSize = source->sectorSize;
+    header.codec = codec;
+    header.totalBytes = source->totalBytes;
+    header.chunkCount = pipeline.chunkCount;
+    header.headerHash = HashBytes(&header, offsetof(IMAGE_HEADER, headerHash), 0);
+
+    try {
+        pipeline.index.resize((size_t)pipeline.chunkCount);
+        pipeline.slots.resize((size_t)threads * IMAGE_SLOTS_PER_THREAD + 2);
+        for (IMAGE_SLOT& slot : pipeline.slots) {
+            slot.state = SLOT_FREE;
+            slot.data.resize(chunkBytes);
+            if (codec == IMAGE_CODEC_LZ4)
+                slot.stored.resize(Lz4CompressBound(chunkBytes));
+        }
+    }
+    catch (const std::bad_alloc&) {
+        return IMAGE_ERROR_NO_MEMORY;
+    }
+
+    pipeline.file = fopen(path, "wb");
+    if (!pipeline.file)
+        return IMAGE_ERROR_IO;
+    setvbuf(pipeline.file, NULL, _IOFBF, IMAGE_FILE_BUFFER_BYTES);
+
+    if (fwrite(&header, sizeof(header), 1, pipeline.file) != 1) {
+        fclose(pipeline.file);
+        return IMAGE_ERROR_IO;
+    }
+
+    std::vector<std::thread> workers;
+    std::thread output(OutputWriter, &pipeline, (unsigned long long)sizeof(header));
+    for (unsigned int i = 0; i < threads; i++)
+        workers.emplace_back(CompressWorker, &pipeline);
+
+    FillSlots(&pipeline, source, chunkBytes);
+    {
+        std::lock_guard<std::mutex> guard(pipeline.lock);
+        pipeline.finished = true;
+        pipeline.slotFilled.notify_all();
+    }
+    for (std::thread& worker : workers)
+        worker.join();
+    output.join();
+
+    IMAGE_STATUS status = pipeline.status;
+    if (status == IMAGE_OK) {
+        IMAGE_TRAILER trailer;
+        trailer.indexOffset = (unsigned long long)FileTell(pipeline.file);
+        trailer.chunkCount = pipeline.chunkCount;
+        trailer.indexHash = HashBytes(pipeline.index.data(), pipeline.index.size() * sizeof(IMAGE_CHUNK_ENTRY), 0);
+        memcpy(trailer.magic, IMAGE_TRAILER_MAGIC, sizeof(trailer.magic));
+        if ((!pipeline.index.empty() &&
+             fwrite(pipeline.index.data(), sizeof(IMAGE_CHUNK_ENTRY), pipeline.index.size(), pipeline.file) != pipeline.index.size()) ||
+            fwrite(&trailer, sizeof(trailer), 1, pipeline.file) != 1)
+            status = IMAGE_ERROR_IO;
+    }
+    if (fclose(pipeline.file) != 0 && status == IMAGE_OK)
+        status = IMAGE_ERROR_IO;
+
+    if (stats)
+        *stats = pipeline.stats;
+    return status;
+}
+
+//
+// File source
+//
+
+static int FileSourceRead(void* context, unsigned long long offset, void* buffer, size_t length) {
+    FILE* file = (FILE*)context;
+    if (FileSeek(file, (long long)offset, SEEK_SET) != 0)
+        return -1;
+    return fread(buffer, 1, length, file) == length ? 0 : -1;
+}
+
+IMAGE_STATUS ImageOpenFileSource(const char* path, unsigned int sectorSize, PIMAGE_SOURCE source) {
+    memset(source, 0, sizeof(*source));
+    if (sectorSize == 0)
+        return IMAGE_ERROR_PARAMETER;
+
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return IMAGE_ERROR_SOURCE;
+    if (FileSeek(file, 0, SEEK_END) != 0) {
+        fclose(file);
+        return IMAGE_ERROR_SOURCE;
+    }
+    long long size = (long long)FileTell(file);
+    if (size < 0 || size % sectorSize) {
+        fclose(file);
+        return size < 0 ? IMAGE_ERROR_SOURCE : IMAGE_ERROR_PARAMETER;
+    }
+    setvbuf(file, NULL, _IOFBF, IMAGE_FILE_BUFFER_BYTES);
+
+    source->read = FileSourceRead;
+    source->context = file;
+    source->totalBytes = (unsigned long long)size;
+    source->sectorSize = sectorSize;
+    return IMAGE_OK;
+}
+
+void ImageCloseFileSource(PIMAGE_SOURCE source) {
+    if (source->context)
+        fclose((FILE*)source->context);
+    source->context = NULL;
+}
+
+//
+// Reader
+//
+
+struct _IMAGE_READER {
+    FILE* file;
+    unsigned long long fileSize;
+    IMAGE_HEADER header;
+    std::vector<IMAGE_CHUNK_ENTRY> index;
+    std::vector<unsigned char> stored;
+    std::vector<unsigned char> cache;
+    unsigned long long cachedChunk;     // ~0 when the cache is empty
+};
+
+static IMAGE_STATUS ReadAt(PIMAGE_READER reader, unsigned long long offset, void* buffer, size_t length) {
+    if (offset > reader->fileSize || length > reader->fileSize - offset)
+        return IMAGE_ERROR_FORMAT;
+    if (FileSeek(reader->file, (long long)offset, SEEK_SET) != 0 || fread(buffer, 1, length, reader->file) != length)
+        return IMAGE_ERROR_IO;
+    return IMAGE_OK;
+}
+
+static IMAGE_STATUS LoadImage(PIMAGE_READER reader) {
+    if (FileSeek(reader->file, 0, SEEK_END) != 0)
+        return IMAGE_ERROR_IO;
+    long long size = (long long)FileTell(reader->file);
+    if (size < (long long)(sizeof(IMAGE_HEADER) + sizeof(IMAGE_TRAILER)))
+        return IMAGE_ERROR_FORMAT;
+    reader->fileSize = (unsigned long long)size;
+
+    PIMAGE_HEADER header = &reader->header;
+    IMAGE_STATUS status = ReadAt(reader, 0, header, sizeof(*header));
+    if (status != IMAGE_OK)
+        return status;
+    if (memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) || header->version != IMAGE_VERSION)
+        return IMAGE_ERROR_FORMAT;
+    if (header->headerHash != HashBytes(header, offsetof(IMAGE_HEADER, headerHash), 0))
+        return IMAGE_ERROR_CORRUPT;
+    if (header->sectorSize == 0 || header->chunkBytes < IMAGE_MIN_CHUNK_BYTES || header->chunkBytes > IMAGE_MAX_CHUNK_BYTES ||
+        header->chunkBytes % header->sectorSize || header->totalBytes % header->sectorSize ||
+        header->chunkCount != (header->totalBytes + header->chunkBytes - 1) / header->chunkBytes)
+        return IMAGE_ERROR_FORMAT;
+
+    IMAGE_TRAILER trailer;
+    status = ReadAt(reader, reader->fileSize - sizeof(trailer), &trailer, sizeof(trailer));
+    if (status != IMAGE_OK)
+        return status;
+    if (memcmp(trailer.magic, IMAGE_TRAILER_MAGIC, sizeof(trailer.magic)) || trailer.chunkCount != header->chunkCount)
+        return IMAGE_ERROR_FORMAT;
+    unsigned long long indexBytes = header->chunkCount * sizeof(IMAGE_CHUNK_ENTRY);
+    if (header->chunkCount > reader->fileSize / sizeof(IMAGE_CHUNK_ENTRY) ||
+        trailer.indexOffset + indexBytes != reader->fileSize - sizeof(trailer))
+        return IMAGE_ERROR_FORMAT;
+
+    try {
+        reader->index.resize((size_t)header->chunkCount);
+        reader->cache.resize(header->chunkBytes);
+        reader->stored.resize(header->chunkBytes);
+    }
+    catch (const std::bad_alloc&) {
+        return IMAGE_ERROR_NO_MEMORY;
+    }
+    status = ReadAt(reader, trailer.indexOffset, reader->index.data(), (size_t)indexBytes);
+    if (status != IMAGE_OK)
+        return status;
+    if (trailer.indexHash != HashBytes(reader->index.data(), (size_t)indexBytes, 0))
+        return IMAGE_ERROR_CORRUPT;
+
+    for (const IMAGE_CHUNK_ENTRY& entry : reader->index) {
+        if (entry.type > IMAGE_CHUNK_LZ4 || entry.storedBytes > header->chunkBytes)
+            return IMAGE_ERROR_FORMAT;
+        if ((entry.type == IMAGE_CHUNK_RAW || entry.type == IMAGE_CHUNK_LZ4) &&
+            (entry.fileOffset < sizeof(IMAGE_HEADER) || entry.fileOffset + entry.storedBytes > trailer.indexOffset))
+            return IMAGE_ERROR_FORMAT;
+    }
+    return IMAGE_OK;
+}
+
+IMAGE_STATUS ImageReaderOpen(const char* path, PIMAGE_READER* reader) {
+    *reader = NULL;
+    PIMAGE_READER newReader = new (std::nothrow) IMAGE_READER();
+    if (!newReader)
+        return IMAGE_ERROR_NO_MEMORY;
+    newReader->cachedChunk = ~0ull;
+
+    newReader->file = fopen(path, "rb");
+    if (!newReader->file) {
+        delete newReader;
+        return IMAGE_ERROR_IO;
+    }
+
+    IMAGE_STATUS status = LoadImage(newReader);
+    if (status != IMAGE_OK) {
+        ImageReaderClose(newReader);
+        return status;
+    }
+    *reader = newReader;
+    return IMAGE_OK;
+}
+
+void ImageReaderClose(PIMAGE_READER reader) {
+    if (!reader)
+        return;
+    if (reader->file)
+        fclose(reader->file);
+    delete reader;
+}
+
+const IMAGE_HEADER* ImageReaderHeader(const IMAGE_READER* reader) {
+    return &reader->header;
+}
+
+const IMAGE_CHUNK_ENTRY* ImageReaderChunk(const IMAGE_READER* reader, unsigned long long chunk) {
+    return chunk < reader->index.size() ? &reader->index[(size_t)chunk] : NULL;
+}
+
+static size_t ChunkLength(const IMAGE_READER* reader, unsigned long long chunk) {
+    unsigned long long offset = chunk * reader->header.chunkBytes;
+    unsigned long long remaining = reader->header.totalBytes - offset;
+    return (size_t)(remaining < reader->header.chunkBytes ? remaining : reader->header.chunkBytes);
+}
+
+// Decodes a stored chunk into the cache and checks its hash.
+static IMAGE_STATUS LoadChunk(PIMAGE_READER reader, unsigned long long chunk) {
+    if (reader->cachedChunk == chunk)
+        return IMAGE_OK;
+    reader->cachedChunk = ~0ull;
+
+    const IMAGE_CHUNK_ENTRY* entry = &reader->index[(size_t)chunk];
+    size_t length = ChunkLength(reader, chunk);
+    IMAGE_STATUS status;
+    if (entry->type == IMAGE_CHUNK_RAW) {
+        if (entry->storedBytes != length)
+            return IMAGE_ERROR_CORRUPT;
+        status = ReadAt(reader, entry->fileOffset, reader->cache.data(), length);
+    }
+    else {
+        status = ReadAt(reader, entry->fileOffset, reader->stored.data(), entry->storedBytes);
+        if (status == IMAGE_OK &&
+            Lz4Decompress(reader->stored.data(), entry->storedBytes, reader->cache.data(), length) != (long long)length)
+            status = IMAGE_ERROR_CORRUPT;
+    }
+    if (status != IMAGE_OK)
+        return status;
+
+    if (HashBytes(reader->cache.data(), length, chunk) != entry->hash)
+        return IMAGE_ERROR_CORRUPT;
+    reader->cachedChunk = chunk;
+    return IMAGE_OK;
+}
+
+IMAGE_STATUS ImageReadSectors(PIMAGE_READER reader, unsigned long long lba, unsigned long long count, void* buffer) {
+    const IMAGE_HEADER* header = &reader->header;
+    unsigned long long totalSectors = header->totalBytes / header->sectorSize;
+    if (lba > totalSectors || count > totalSectors - lba)
+        return IMAGE_ERROR_RANGE;
+
+    unsigned char* out = (unsigned char*)buffer;
+    unsigned long long offset = lba * header->sectorSize;
+    unsigned long long end = offset + count * header->sectorSize;
+    while (offset < end) {
+        unsigned long long chunk = offset / header->chunkBytes;
+        size_t within = (size_t)(offset % header->chunkBytes);
+        size_t length = ChunkLength(reader, chunk) - within;
+        if (length > end - offset)
+            length = (size_t)(end - offset);
+
+        const IMAGE_CHUNK_ENTRY* entry = &reader->index[(size_t)chunk];
+        if (entry->type == IMAGE_CHUNK_ZERO || entry->type == IMAGE_CHUNK_UNALLOCATED)
+            memset(out, 0, length);
+        else {
+            IMAGE_STATUS status = LoadChunk(reader, chunk);
+            if (status != IMAGE_OK)
+                return status;
+            memcpy(out, reader->cache.data() + within, length);
+        }
+        out += length;
+        offset += length;
+    }
+    return IMAGE_OK;
+}
+
+IMAGE_STATUS ImageVerify(PIMAGE_READER reader, unsigned long long* badChunk) {
+    for (unsigned long long chunk = 0; chunk < reader->index.size(); chunk++) {
+        const IMAGE_CHUNK_ENTRY* entry = &reader->index[(size_t)chunk];
+        if (entry->type == IMAGE_CHUNK_ZERO || entry->type == IMAGE_CHUNK_UNALLOCATED)
+            continue;
+        reader->cachedChunk = ~0ull;
+        IMAGE_STATUS status = LoadChunk(reader, chunk);
+        if (status != IMAGE_OK) {
+            if (badChunk)
+                *badChunk = chunk;
+            return status;
+        }
+    }
+    return IMAGE_OK;
+}
@@ -0,0 +1,124 @@
+#pragma once
+// Chunked disk image: a header, the stored chunks back to back, then a chunk index and a trailer pointing at it.
+//
+//   IMAGE_HEADER | chunk 0 | chunk 1 | ... | IMAGE_CHUNK_ENTRY[chunkCount] | IMAGE_TRAILER
+//
+// Every chunk covers chunkBytes of the source (the last one may be shorter) and is stored raw or LZ4-compressed, or
+// not stored at all when it is all zeros or unallocated. The index is read once at open, so any LBA maps to its chunk
+// with a division and one seek. Chunks carry an XXH64 of their uncompressed contents seeded with the chunk number,
+// which also catches chunks that ended up at the wrong place. The trailer is written last; an image whose writer did
+// not finish has no valid trailer and is refused. All fields are little-endian.
+//
+// Plain C++ with no platform headers so that it builds on Windows next to the driver client and on Linux for
+// benchmarking against file-backed sources.
+#include <stddef.h>
+
+#define IMAGE_MAGIC             "SIOIMG01"
+#define IMAGE_TRAILER_MAGIC     "SIOINDEX"
+#define IMAGE_VERSION           1
+
+#define IMAGE_DEFAULT_CHUNK_BYTES   (1024 * 1024)
+#define IMAGE_MIN_CHUNK_BYTES       (4 * 1024)
+#define IMAGE_MAX_CHUNK_BYTES       (64 * 1024 * 1024)
+
+typedef enum _IMAGE_STATUS {
+    IMAGE_OK = 0,
+    IMAGE_ERROR_IO,             // reading or writing the image file failed
+    IMAGE_ERROR_FORMAT,         // not an image, unsupported version, or the writer did not finish
+    IMAGE_ERROR_CORRUPT,        // a chunk or the index does not match its hash, or does not decompress
+    IMAGE_ERROR_NO_MEMORY,
+    IMAGE_ERROR_RANGE,          // the request lies outside the image
+    IMAGE_ERROR_SOURCE,         // the source read callback failed
+    IMAGE_ERROR_PARAMETER,
+} IMAGE_STATUS;
+
+typedef enum _IMAGE_CODEC {
+    IMAGE_CODEC_NONE = 0,
+    IMAGE_CODEC_LZ4 = 1,
+} IMAGE_CODEC;
+
+typedef enum _IMAGE_CHUNK_TYPE {
+    IMAGE_CHUNK_ZERO = 0,           // all zero bytes, nothing stored
+    IMAGE_CHUNK_UNALLOCATED = 1,    // the source reported it unallocated; reads back as zeros, nothing stored
+    IMAGE_CHUNK_RAW = 2,
+    IMAGE_CHUNK_LZ4 = 3,
+} IMAGE_CHUNK_TYPE;
+
+#pragma pack(push, 1)
+typedef struct _IMAGE_HEADER {
+    char magic[8];
+    unsigned int version;
+    unsigned int chunkBytes;
+    unsigned int sectorSize;
+    unsigned int codec;
+    unsigned long long totalBytes;
+    unsigned long long chunkCount;
+    unsigned long long headerHash;      // XXH64 of the fields above
+} IMAGE_HEADER, *PIMAGE_HEADER;
+
+typedef struct _IMAGE_CHUNK_ENTRY {
+    unsigned long long fileOffset;      // 0 for chunks that are not stored
+    unsigned int storedBytes;
+    unsigned char type;                 // IMAGE_CHUNK_TYPE
+    unsigned char reserved[3];
+    unsigned long long hash;            // XXH64 of the uncompressed chunk, seeded with the chunk number; 0 if not stored
+} IMAGE_CHUNK_ENTRY, *PIMAGE_CHUNK_ENTRY;
+
+typedef struct _IMAGE_TRAILER {
+    unsigned long long indexOffset;
+    unsigned long long chunkCount;
+    unsigned long long indexHash;       // XXH64 of the whole index
+    char magic[8];
+} IMAGE_TRAILER, *PIMAGE_TRAILER;
+#pragma pack(pop)
+
+// Where ImageWrite reads from. read fills length bytes at offset and returns 0 on success; it is only ever called
+// from the thread that called ImageWrite, in ascending offset order. isAllocated is optional and returns 0 when
+// nothing in the range needs to be kept, so the chunk is recorded as unallocated without being read.
+typedef struct _IMAGE_SOURCE {
+    int (*read)(void* context, unsigned long long offset, void* buffer, size_t length);
+    int (*isAllocated)(void* context, unsigned long long offset, size_t length);
+    void* context;
+    unsigned long long totalBytes;
+    unsigned int sectorSize;
+} IMAGE_SOURCE, *PIMAGE_SOURCE;
+
+typedef struct _IMAGE_WRITE_OPTIONS {
+    unsigned int chunkBytes;    // multiple of the sector size; 0 selects IMAGE_DEFAULT_CHUNK_BYTES
+    unsigned int threads;       // compression workers; 0 selects one per processor
+    IMAGE_CODEC codec;
+} IMAGE_WRITE_OPTIONS, *PIMAGE_WRITE_OPTIONS;
+
+typedef struct _IMAGE_WRITE_STATS {
+    unsigned long long bytesRead;       // from the source
+    unsigned long long bytesStored;     // chunk payload written to the image
+    unsigned long long zeroChunks;
+    unsigned long long unallocatedChunks;
+    unsigned long long rawChunks;
+    unsigned long long compressedChunks;
+} IMAGE_WRITE_STATS, *PIMAGE_WRITE_STATS;
+
+const char* ImageStatusString(IMAGE_STATUS status);
+
+// Reads the whole source into a new image at path. Source reads, compression on a pool of worker threads, and image
+// writes overlap; chunks are written in source order. stats is optional.
+IMAGE_STATUS ImageWrite(const char* path, const IMAGE_SOURCE* source, const IMAGE_WRITE_OPTIONS* options, PIMAGE_WRITE_STATS stats);
+
+// Source over a regular file or device node; sectorSize only sets the addressing unit recorded in the image.
+IMAGE_STATUS ImageOpenFileSource(const char* path, unsigned int sectorSize, PIMAGE_SOURCE source);
+void ImageCloseFileSource(PIMAGE_SOURCE source);
+
+typedef struct _IMAGE_READER IMAGE_READER, *PIMAGE_READER;
+
+// Opens an image and loads its index. A reader keeps one decoded chunk cached and is not safe to share between
+// threads; open one per thread instead.
+IMAGE_STATUS ImageReaderOpen(const char* path, PIMAGE_READER* reader);
+void ImageReaderClose(PIMAGE_READER reader);
+const IMAGE_HEADER* ImageReaderHeader(const IMAGE_READER* reader);
+const IMAGE_CHUNK_ENTRY* ImageReaderChunk(const IMAGE_READER* reader, unsigned long long chunk);
+
+// Copies count sectors starting at lba into buffer, verifying every chunk it decodes.
+IMAGE_STATUS ImageReadSectors(PIMAGE_READER reader, unsigned long long lba, unsigned long long count, void* buffer);
+
+// Decodes and checks every stored chunk. On IMAGE_ERROR_CORRUPT, *badChunk (optional) is the first chunk that failed.
+IMAGE_STATUS ImageVerify(PIMAGE_READER reader, unsigned long long* badChunk);
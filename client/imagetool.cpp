@@ -0,0 +1,355 @@
+// Command line front end for SectorImage.
+//
+//   imagetool pack <source> <image> [-chunk KiB] [-threads N] [-sector bytes] [-raw]
+//   imagetool verify <image>
+//   imagetool extract <image> <output>
+//   imagetool read <image> <lba> [count]
+//   imagetool bench <source> <image> [pack options] [-reads N]
+//
+// <source> is a file or device path. On Windows it may also be disk:<index> or part:<disk>:<partition>, which reads
+// through the SectorIO driver (administrative privileges required, as for example.cpp).
+#include "SectorImage.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+
+#define IOCTL_SECTOR_BIND        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x815, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define IOCTL_SECTOR_READ_BOUND  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x816, METHOD_NEITHER, FILE_ANY_ACCESS)
+
+#pragma pack(push, 1)
+typedef struct _STORAGE_LOCATION {
+    BOOLEAN isRawDiskObject;
+    ULONG diskIndex;
+    ULONG partitionNumber;
+    ULONGLONG sectorNumber;
+} STORAGE_LOCATION, * PSTORAGE_LOCATION;
+
+typedef struct _STORAGE_OBJECT_INFO {
+    BOOLEAN isRawDiskObject;
+    ULONG diskIndex;
+    ULONG partitionNumber;
+    ULONGLONG partitionStartingOffset;
+    ULONGLONG partitionSizeBytes;
+    ULONGLONG diskSizeBytes;
+    ULONG sectorSize;
+    GUID gptDiskId;
+    PARTITION_STYLE partitionStyle;
+    GUID gptPartitionTypeGuid;
+    GUID gptPartitionIdGuid;
+    ULONGLONG gptAttributes;
+    WCHAR gptName[36];
+    UCHAR mbrPartitionType;
+    ULONG physicalSectorSize;
+    ULONG physicalSectorOffset;
+} STORAGE_OBJECT_INFO, * PSTORAGE_OBJECT_INFO;
+
+typedef struct _SECTOR_BIND_RESULT {
+    ULONG sectorSize;
+    ULONGLONG sectorCount;
+    STORAGE_OBJECT_INFO info;
+} SECTOR_BIND_RESULT, * PSECTOR_BIND_RESULT;
+#pragma pack(pop)
+
+// The handle is bound to the disk or partition once, so every read carries just its sector number.
+typedef struct _DRIVER_SOURCE {
+    HANDLE hDevice;
+    STORAGE_LOCATION location;
+    ULONG sectorSize;
+} DRIVER_SOURCE, *PDRIVER_SOURCE;
+
+static int DriverSourceRead(void* context, unsigned long long offset, void* buffer, size_t length) {
+    PDRIVER_SOURCE driver = (PDRIVER_SOURCE)context;
+    ULONGLONG sectorNumber = offset / driver->sectorSize;
+    DWORD bytesReturned = 0;
+    BOOL ok = DeviceIoControl(driver->hDevice, IOCTL_SECTOR_READ_BOUND, &sectorNumber, sizeof(sectorNumber), buffer, (DWORD)length, &bytesReturned, NULL);
+    if (!ok) {
+        printf("Error: IOCTL_SECTOR_READ_BOUND at sector %llu failed (GetLastError=%lu)\n", sectorNumber, GetLastError());
+        return -1;
+    }
+    return 0;
+}
+
+static bool OpenDriverSource(const char* spec, PIMAGE_SOURCE source, PDRIVER_SOURCE driver) {
+    memset(driver, 0, sizeof(*driver));
+    unsigned long diskIndex = 0, partitionNumber = 0;
+    if (sscanf(spec, "disk:%lu", &diskIndex) == 1)
+        driver->location.isRawDiskObject = TRUE;
+    else if (sscanf(spec, "part:%lu:%lu", &diskIndex, &partitionNumber) != 2)
+        return false;
+    driver->location.diskIndex = diskIndex;
+    driver->location.partitionNumber = partitionNumber;
+
+    driver->hDevice = CreateFileA("\\\\.\\SectorIO", GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (driver->hDevice == INVALID_HANDLE_VALUE) {
+        printf("Error: Cannot open \\\\.\\SectorIO  (GetLastError=%lu)\n", GetLastError());
+        exit(1);
+    }
+
+    SECTOR_BIND_RESULT bind;
+    DWORD bytesReturned = 0;
+    if (!DeviceIoControl(driver->hDevice, IOCTL_SECTOR_BIND, &driver->location, sizeof(driver->location), &bind, sizeof(bind), &bytesReturned, NULL)) {
+        printf("Error: IOCTL_SECTOR_BIND failed (GetLastError=%lu)\n", GetLastError());
+        exit(1);
+    }
+    driver->sectorSize = bind.sectorSize;
+
+    memset(source, 0, sizeof(*source));
+    source->read = DriverSourceRead;
+    source->context = driver;
+    source->totalBytes = bind.sectorCount * bind.sectorSize;
+    source->sectorSize = bind.sectorSize;
+    return true;
+}
+#endif
+
+typedef struct _TOOL_OPTIONS {
+    IMAGE_WRITE_OPTIONS write;
+    unsigned int sectorSize;
+    unsigned int reads;
+} TOOL_OPTIONS, *PTOOL_OPTIONS;
+
+static double SecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void PrintHex(const unsigned char* buf, size_t length)
+{
+    const size_t kCols = 16;
+    for (size_t offs = 0; offs < length; offs += kCols) {
+        printf("%08zx: ", offs);
+        for (size_t i = 0; i < kCols; i++) {
+            if (offs + i < length)
+                printf("%02X ", buf[offs + i]);
+            else
+                printf("   ");
+        }
+        printf("  ");
+        for (size_t i = 0; i < kCols; i++) {
+            if (offs + i < length) {
+                unsigned char c = buf[offs + i];
+                putchar((c >= 0x20 && c < 0x7F) ? c : '.');
+            }
+        }
+        printf("\n");
+    }
+}
+
+static int Fail(const char* what, IMAGE_STATUS status) {
+    printf("Error: %s: %s\n", what, ImageStatusString(status));
+    return 1;
+}
+
+static void ParseOptions(int argc, char** argv, int first, PTOOL_OPTIONS options) {
+    memset(options, 0, sizeof(*options));
+    options->write.codec = IMAGE_CODEC_LZ4;
+    options->sectorSize = 512;
+    options->reads = 100000;
+    for (int i = first; i < argc; i++) {
+        if (!strcmp(argv[i], "-raw"))
+            options->write.codec = IMAGE_CODEC_NONE;
+        else if (!strcmp(argv[i], "-chunk") && i + 1 < argc)
+            options->write.chunkBytes = (unsigned int)strtoul(argv[++i], NULL, 0) * 1024;
+        else if (!strcmp(argv[i], "-threads") && i + 1 < argc)
+            options->write.threads = (unsigned int)strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-sector") && i + 1 < argc)
+            options->sectorSize = (unsigned int)strtoul(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-reads") && i + 1 < argc)
+            options->reads = (unsigned int)strtoul(argv[++i], NULL, 0);
+        else {
+            printf("Error: unknown option %s\n", argv[i]);
+            exit(1);
+        }
+    }
+}
+
+static IMAGE_STATUS OpenSource(const char* spec, const TOOL_OPTIONS* options, PIMAGE_SOURCE source) {
+#ifdef _WIN32
+    static DRIVER_SOURCE driver;
+    if (OpenDriverSource(spec, source, &driver))
+        return IMAGE_OK;
+#endif
+    return ImageOpenFileSource(spec, options->sectorSize, source);
+}
+
+static void CloseSource(PIMAGE_SOURCE source) {
+#ifdef _WIN32
+    if (source->read == DriverSourceRead) {
+        CloseHandle(((PDRIVER_SOURCE)source->context)->hDevice);
+        return;
+    }
+#endif
+    ImageCloseFileSource(source);
+}
+
+static int Pack(const char* sourceSpec, const char* imagePath, const TOOL_OPTIONS* options, double* seconds) {
+    IMAGE_SOURCE source;
+    IMAGE_STATUS status = OpenSource(sourceSpec, options, &source);
+    if (status != IMAGE_OK)
+        return Fail(sourceSpec, status);
+
+    IMAGE_WRITE_STATS stats;
+    auto start = std::chrono::steady_clock::now();
+    status = ImageWrite(imagePath, &source, &options->write, &stats);
+    double elapsed = SecondsSince(start);
+    CloseSource(&source);
+    if (status != IMAGE_OK)
+        return Fail("pack", status);
+
+    printf("Packed %llu bytes into %llu bytes (%.1f%%) in %.2f s, %.0f MB/s\n",
+        source.totalBytes, stats.bytesStored, source.totalBytes ? 100.0 * stats.bytesStored / source.totalBytes : 0.0,
+        elapsed, elapsed > 0 ? source.totalBytes / 1e6 / elapsed : 0.0);
+    printf("  chunks: %llu compressed, %llu raw, %llu zero, %llu unallocated\n",
+        stats.compressedChunks, stats.rawChunks, stats.zeroChunks, stats.unallocatedChunks);
+    if (seconds)
+        *seconds = elapsed;
+    return 0;
+}
+
+static int Verify(const char* imagePath) {
+    PIMAGE_READER reader;
+    IMAGE_STATUS status = ImageReaderOpen(imagePath, &reader);
+    if (status != IMAGE_OK)
+        return Fail(imagePath, status);
+
+    unsigned long long badChunk = 0;
+    auto start = std::chrono::steady_clock::now();
+    status = ImageVerify(reader, &badChunk);
+    double elapsed = SecondsSince(start);
+    unsigned long long totalBytes = ImageReaderHeader(reader)->totalBytes;
+    ImageReaderClose(reader);
+    if (status == IMAGE_ERROR_CORRUPT) {
+        printf("Error: chunk %llu is corrupt\n", badChunk);
+        return 1;
+    }
+    if (status != IMAGE_OK)
+        return Fail("verify", status);
+    printf("Verified %llu bytes in %.2f s, %.0f MB/s\n", totalBytes, elapsed, elapsed > 0 ? totalBytes / 1e6 / elapsed : 0.0);
+    return 0;
+}
+
+static int Extract(const char* imagePath, const char* outputPath) {
+    PIMAGE_READER reader;
+    IMAGE_STATUS status = ImageReaderOpen(imagePath, &reader);
+    if (status != IMAGE_OK)
+        return Fail(imagePath, status);
+
+    const IMAGE_HEADER* header = ImageReaderHeader(reader);
+    FILE* output = fopen(outputPath, "wb");
+    if (!output) {
+        ImageReaderClose(reader);
+        printf("Error: cannot create %s\n", outputPath);
+        return 1;
+    }
+
+    std::vector<unsigned char> buffer(header->chunkBytes);
+    unsigned long long sectorsPerChunk = header->chunkBytes / header->sectorSize;
+    unsigned long long totalSectors = header->totalBytes / header->sectorSize;
+    for (unsigned long long lba = 0; lba < totalSectors && status == IMAGE_OK; lba += sectorsPerChunk) {
+        unsigned long long count = totalSectors - lba < sectorsPerChunk ? totalSectors - lba : sectorsPerChunk;
+        status = ImageReadSectors(reader, lba, count, buffer.data());
+        if (status == IMAGE_OK && fwrite(buffer.data(), header->sectorSize, (size_t)count, output) != count)
+            status = IMAGE_ERROR_IO;
+    }
+    fclose(output);
+    ImageReaderClose(reader);
+    return status == IMAGE_OK ? 0 : Fail("extract", status);
+}
+
+static int Read(const char* imagePath, unsigned long long lba, unsigned long long count) {
+    PIMAGE_READER reader;
+    IMAGE_STATUS status = ImageReaderOpen(imagePath, &reader);
+    if (status != IMAGE_OK)
+        return Fail(imagePath, status);
+
+    unsigned int sectorSize = ImageReaderHeader(reader)->sectorSize;
+    std::vector<unsigned char> buffer((size_t)(count * sectorSize));
+    status = ImageReadSectors(reader, lba, count, buffer.data());
+    ImageReaderClose(reader);
+    if (status != IMAGE_OK)
+        return Fail("read", status);
+    PrintHex(buffer.data(), buffer.size());
+    return 0;
+}
+
+// Packs the source, verifies the image, then times single-sector reads at random LBAs and checks each against the
+// source.
+static int Bench(const char* sourceSpec, const char* imagePath, const TOOL_OPTIONS* options) {
+    if (Pack(sourceSpec, imagePath, options, NULL) || Verify(imagePath))
+        return 1;
+
+    IMAGE_SOURCE source;
+    IMAGE_STATUS status = OpenSource(sourceSpec, options, &source);
+    if (status != IMAGE_OK)
+        return Fail(sourceSpec, status);
+    PIMAGE_READER reader;
+    status = ImageReaderOpen(imagePath, &reader);
+    if (status != IMAGE_OK) {
+        CloseSource(&source);
+        return Fail(imagePath, status);
+    }
+
+    unsigned int sectorSize = ImageReaderHeader(reader)->sectorSize;
+    unsigned long long totalSectors = ImageReaderHeader(reader)->totalBytes / sectorSize;
+    std::vector<unsigned long long> lbas(options->reads);
+    std::mt19937_64 random(1);
+    for (unsigned long long& lba : lbas)
+        lba = totalSectors ? random() % totalSectors : 0;
+
+    std::vector<unsigned char> fromImage(sectorSize), fromSource(sectorSize);
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned long long lba : lbas) {
+        status = ImageReadSectors(reader, lba, 1, fromImage.data());
+        if (status != IMAGE_OK)
+            break;
+    }
+    double elapsed = SecondsSince(start);
+
+    unsigned long long mismatches = 0;
+    for (unsigned int i = 0; i < options->reads && status == IMAGE_OK && i < 1000; i++) {
+        status = ImageReadSectors(reader, lbas[i], 1, fromImage.data());
+        if (status == IMAGE_OK && source.read(source.context, lbas[i] * sectorSize, fromSource.data(), sectorSize) != 0)
+            status = IMAGE_ERROR_SOURCE;
+        if (status == IMAGE_OK && memcmp(fromImage.data(), fromSource.data(), sectorSize))
+            mismatches++;
+    }
+    ImageReaderClose(reader);
+    CloseSource(&source);
+    if (status != IMAGE_OK)
+        return Fail("random read", status);
+
+    printf("Random reads: %u sectors in %.2f s, %.1f us per read; %llu mismatches in the first 1000\n",
+        options->reads, elapsed, options->reads ? elapsed * 1e6 / options->reads : 0.0, mismatches);
+    return mismatches ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+    TOOL_OPTIONS options;
+    if (argc >= 4 && !strcmp(argv[1], "pack")) {
+        ParseOptions(argc, argv, 4, &options);
+        return Pack(argv[2], argv[3], &options, NULL);
+    }
+    if (argc == 3 && !strcmp(argv[1], "verify"))
+        return Verify(argv[2]);
+    if (argc == 4 && !strcmp(argv[1], "extract"))
+        return Extract(argv[2], argv[3]);
+    if ((argc == 4 || argc == 5) && !strcmp(argv[1], "read"))
+        return Read(argv[2], strtoull(argv[3], NULL, 0), argc == 5 ? strtoull(argv[4], NULL, 0) : 1);
+    if (argc >= 4 && !strcmp(argv[1], "bench")) {
+        ParseOptions(argc, argv, 4, &options);
+        return Bench(argv[2], argv[3], &options);
+    }
+
+    printf("usage:\n"
+        "  imagetool pack <source> <image> [-chunk KiB] [-threads N] [-sector bytes] [-raw]\n"
+        "  imagetool verify <image>\n"
+        "  imagetool extract <image> <output>\n"
+        "  imagetool read <image> <lba> [count]\n"
+        "  imagetool bench <source> <image> [-chunk KiB] [-threads N] [-sector bytes] [-raw] [-reads N]\n");
+    return 1;
+}
@@ -0,0 +1,54 @@
+// Histogram and entropy throughput per 4 KiB block, the unit IOCTL_SECTOR_ENTROPY reports on, at each implementation,
+// for data with long runs (where a single table stalls on store forwarding) and for random data.
+#include "BlockScan.hpp"
+#include "HostTest.hpp"
+#include "HostBench.hpp"
+#include <vector>
+
+#define BENCH_BLOCK_BYTES 4096
+
+typedef void (*HISTOGRAM_ADD)(PBLOCK_HISTOGRAM histogram, const unsigned char* data, size_t length);
+
+static void BenchHistogram(const char* name, HISTOGRAM_ADD add, const std::vector<unsigned char>& data, unsigned int mergeFeatures) {
+    HostBenchReport(name, data.size(), HostBenchSeconds([&] {
+        for (size_t offset = 0; offset < data.size(); offset += BENCH_BLOCK_BYTES) {
+            BLOCK_HISTOGRAM histogram;
+            unsigned int counts[256];
+            unsigned long long wide[256];
+            BlockHistogramClear(&histogram);
+            add(&histogram, &data[offset], BENCH_BLOCK_BYTES);
+            BlockHistogramMerge(&histogram, counts, mergeFeatures);
+            for (int i = 0; i < 256; i++)
+                wide[i] = counts[i];
+            g_hostBenchSink += HistogramEntropy(wide);
+        }
+    }));
+}
+
+int main() {
+    unsigned int features = HostSimdFeatures();
+    std::vector<unsigned char> data(16 << 20);
+    HOST_RANDOM random = { 0xE27ull };
+    for (int kind = 0; kind < 2; kind++) {
+        for (size_t i = 0; i < data.size(); i++)
+            data[i] = kind ? (unsigned char)HostRandomNext(&random) : (unsigned char)(i / 64);
+        const char* prefix = kind ? "random" : "runs";
+        char name[64];
+        snprintf(name, sizeof(name), "%s, histogram+entropy scalar", prefix);
+        BenchHistogram(name, BlockHistogramAddScalar, data, 0);
+        snprintf(name, sizeof(name), "%s, histogram+entropy lanes", prefix);
+        BenchHistogram(name, BlockHistogramAddLanes, data, 0);
+#if SIMD_X64
+        snprintf(name, sizeof(name), "%s, histogram+entropy lanes, sse2 merge", prefix);
+        BenchHistogram(name, BlockHistogramAddLanes, data, SIMD_FEATURE_SSE2);
+#endif
+    }
+
+    std::vector<unsigned char> zero(data.size(), 0);
+    HostBenchReport("zero check scalar", zero.size(), HostBenchSeconds([&] { g_hostBenchSink += BlockIsZero(zero.data(), zero.size(), 0); }));
+    if (features & SIMD_FEATURE_SSE2)
+        HostBenchReport("zero check sse2", zero.size(), HostBenchSeconds([&] { g_hostBenchSink += BlockIsZero(zero.data(), zero.size(), SIMD_FEATURE_SSE2); }));
+    if (features & SIMD_FEATURE_AVX2)
+        HostBenchReport("zero check avx2", zero.size(), HostBenchSeconds([&] { g_hostBenchSink += BlockIsZero(zero.data(), zero.size(), features); }));
+    return 0;
+}
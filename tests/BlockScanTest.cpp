@@ -0,0 +1,219 @@
+// Block classification kernels at every feature level the host runs, against the scalar versions and a floating
+// point entropy reference: zero detection, the first-difference search behind compare-and-write miscompare offsets,
+// byte histograms, and the fixed-point entropy of all-zero, single-byte, uniform, two-valued and random data.
+#include "BlockScan.hpp"
+#include "HostTest.hpp"
+#include <math.h>
+#include <string.h>
+#include <vector>
+
+static std::vector<unsigned int> FeatureLevels() {
+    unsigned int host = HostSimdFeatures();
+    std::vector<unsigned int> levels = { 0 };
+    if (host & SIMD_FEATURE_SSE2)
+        levels.push_back(SIMD_FEATURE_SSE2);
+    if (host & SIMD_FEATURE_AVX2)
+        levels.push_back(SIMD_FEATURE_SSE2 | SIMD_FEATURE_AVX2);
+    return levels;
+}
+
+static double ReferenceEntropy(const unsigned int counts[256]) {
+    double total = 0, entropy = 0;
+    for (int i = 0; i < 256; i++)
+        total += counts[i];
+    for (int i = 0; i < 256; i++) {
+        if (counts[i]) {
+            double p = counts[i] / total;
+            entropy -= p * log2(p);
+        }
+    }
+    return entropy;
+}
+
+static unsigned int EntropyOf(const unsigned int counts[256], unsigned int scaleShift = 0) {
+    unsigned long long wide[256];
+    for (int i = 0; i < 256; i++)
+        wide[i] = (unsigned long long)counts[i] << scaleShift;
+    return HistogramEntropy(wide);
+}
+
+static void TestFixedLog2() {
+    for (unsigned int bit = 0; bit < 64; bit++)
+        HOST_CHECK_EQUAL(FixedLog2(1ull << bit), bit << 16);
+    // The mantissa table is interpolated, which is good to a few units in the last place.
+    const double tolerance = 3.0 / 65536;
+    for (unsigned long long value = 1; value < (1u << 22); value++) {
+        if (fabs(FixedLog2(value) / 65536.0 - log2((double)value)) >= tolerance) {
+            HOST_CHECK_EQUAL(FixedLog2(value), (unsigned long long)(log2((double)value) * 65536 + 0.5));
+            break;
+        }
+    }
+    for (unsigned long long value = 3; value < (1ull << 62); value = value * 3 + 1)
+        HOST_CHECK(fabs(FixedLog2(value) / 65536.0 - log2((double)value)) < tolerance);
+    HOST_CHECK(fabs(FixedLog2(~0ull) / 65536.0 - 64.0) < tolerance);
+}
+
+static void TestIsZero() {
+    std::vector<unsigned char> data(4096 + 64, 0);
+    for (unsigned int features : FeatureLevels()) {
+        for (size_t offset : { (size_t)0, (size_t)1, (size_t)31 }) {
+            for (size_t length : { (size_t)0, (size_t)1, (size_t)63, (size_t)64, (size_t)127, (size_t)128, (size_t)4095, (size_t)4096 }) {
+                HOST_CHECK(BlockIsZero(&data[offset], length, features));
+                // A single set byte anywhere in the block, including the tails the vector loops leave to scalar code.
+                for (size_t at : { (size_t)0, length / 2, length - 1 }) {
+                    if (!length)
+                        break;
+                    data[offset + at] = 0x80;
+                    HOST_CHECK(!BlockIsZero(&data[offset], length, features));
+                    data[offset + at] = 0;
+                }
+                // Bytes just outside the block do not count.
+                data[offset + length] = 1;
+                HOST_CHECK(BlockIsZero(&data[offset], length, features));
+                data[offset + length] = 0;
+            }
+        }
+    }
+}
+
+static void TestFirstDifference() {
+    HOST_RANDOM random = { 0xD1FFull };
+    std::vector<unsigned char> first(4096 + 64), second;
+    HostRandomFill(&random, first.data(), first.size());
+    for (unsigned int features : FeatureLevels()) {
+        for (size_t offset : { (size_t)0, (size_t)1, (size_t)31 }) {
+            for (size_t length : { (size_t)0, (size_t)1, (size_t)7, (size_t)8, (size_t)15, (size_t)16, (size_t)31, (size_t)33,
+                                   (size_t)100, (size_t)4095, (size_t)4096 }) {
+                second = first;
+                HOST_CHECK_EQUAL(BlockFirstDifference(&first[offset], &second[offset], length, features), length);
+                // Bytes just outside the range do not count.
+                second[offset + length] ^= 0xFF;
+                HOST_CHECK_EQUAL(BlockFirstDifference(&first[offset], &second[offset], length, features), length);
+                second[offset + length] ^= 0xFF;
+
+                // A difference at every position of short ranges, and spread over the longer ones, each as a single
+                // flipped bit so no bit of a byte goes unchecked; a later difference does not hide an earlier one.
+                size_t step = length > 128 ? 37 : 1;
+                for (size_t at = 0; at < length; at += step) {
+                    unsigned char bit = (unsigned char)(1u << (at % 8));
+                    second[offset + at] ^= bit;
+                    HOST_CHECK_EQUAL(BlockFirstDifference(&first[offset], &second[offset], length, features), at);
+                    if (at + 1 < length) {
+                        second[offset + length - 1] ^= 0x01;
+                        HOST_CHECK_EQUAL(BlockFirstDifference(&first[offset], &second[offset], length, features), at);
+                        second[offset + length - 1] ^= 0x01;
+                    }
+                    second[offset + at] ^= bit;
+                }
+            }
+        }
+    }
+}
+
+static void TestHistograms() {
+    HOST_RANDOM random = { 0x4157ull };
+    std::vector<unsigned char> data(1 << 20);
+    std::vector<unsigned int> levels = FeatureLevels();
+    for (int kind = 0; kind < 5; kind++) {
+        for (size_t i = 0; i < data.size(); i++) {
+            switch (kind) {
+            case 0: data[i] = 0; break;
+            case 1: data[i] = 0xE5; break;
+            case 2: data[i] = (unsigned char)i; break;
+            case 3: data[i] = (unsigned char)HostRandomNext(&random); break;
+            default: data[i] = (unsigned char)(HostRandomBelow(&random, 4) * (i & 1)); break;
+            }
+        }
+        for (size_t length : { (size_t)0, (size_t)1, (size_t)15, (size_t)33, (size_t)4095, (size_t)4096, (size_t)65549, data.size() - 3 }) {
+            const unsigned char* block = &data[length < 100 ? 3 : 0];
+            BLOCK_HISTOGRAM histogram;
+            unsigned int reference[256], counts[256];
+            BlockHistogramClear(&histogram);
+            BlockHistogramAddScalar(&histogram, block, length);
+            BlockHistogramMerge(&histogram, reference, 0);
+            unsigned long long total = 0;
+            for (unsigned int count : reference)
+                total += count;
+            HOST_CHECK_EQUAL(total, length);
+
+            for (unsigned int features : levels) {
+                BlockHistogramClear(&histogram);
+                BlockHistogramAdd(&histogram, block, length);
+                BlockHistogramMerge(&histogram, counts, features);
+                HOST_CHECK(memcmp(counts, reference, sizeof(counts)) == 0);
+
+                // Added in uneven pieces, the way a transfer split over several reads is counted.
+                BlockHistogramClear(&histogram);
+                for (size_t done = 0, piece = 1; done < length; done += piece, piece = piece * 2 + 7) {
+                    if (piece > length - done)
+                        piece = length - done;
+                    BlockHistogramAdd(&histogram, block + done, piece);
+                }
+                BlockHistogramMerge(&histogram, counts, features);
+                HOST_CHECK(memcmp(counts, reference, sizeof(counts)) == 0);
+            }
+            BlockHistogramClear(&histogram);
+            BlockHistogramAddLanes(&histogram, block, length);
+            BlockHistogramMerge(&histogram, counts, 0);
+            HOST_CHECK(memcmp(counts, reference, sizeof(counts)) == 0);
+
+            if (!length)
+                continue;
+            double expected = ReferenceEntropy(reference);
+            HOST_CHECK(fabs(EntropyOf(reference) / 65536.0 - expected) < 1e-3);
+            // Counts too large for the N log N product are scaled down without losing the proportions.
+            HOST_CHECK(fabs(EntropyOf(reference, 24) / 65536.0 - expected) < 1e-3);
+        }
+    }
+}
+
+static void TestEntropyEdges() {
+    unsigned int counts[256] = {};
+    HOST_CHECK_EQUAL(EntropyOf(counts), 0);
+
+    // One value, however often: no information.
+    for (unsigned int count : { 1u, 4096u, 0xFFFFFFFFu }) {
+        memset(counts, 0, sizeof(counts));
+        counts[0x41] = count;
+        HOST_CHECK_EQUAL(EntropyOf(counts), 0);
+    }
+
+    // Every value equally often: exactly 8 bits per byte, the maximum.
+    for (unsigned int count : { 1u, 16u, 1u << 24 }) {
+        for (int i = 0; i < 256; i++)
+            counts[i] = count;
+        HOST_CHECK_EQUAL(EntropyOf(counts), 8u << 16);
+    }
+
+    // 2^k values equally often: exactly k bits.
+    for (unsigned int bits = 1; bits < 8; bits++) {
+        memset(counts, 0, sizeof(counts));
+        for (unsigned int i = 0; i < (1u << bits); i++)
+            counts[i * (256 >> bits)] = 1000;
+        HOST_CHECK_EQUAL(EntropyOf(counts), bits << 16);
+    }
+
+    // Heavily skewed: one stray byte in a zero block is just above zero and still ordered below two.
+    memset(counts, 0, sizeof(counts));
+    counts[0] = 4095;
+    counts[1] = 1;
+    unsigned int skewed = EntropyOf(counts);
+    HOST_CHECK(skewed > 0 && fabs(skewed / 65536.0 - ReferenceEntropy(counts)) < 1e-3);
+    counts[1] = 2;
+    HOST_CHECK(EntropyOf(counts) > skewed);
+
+    // 64-bit counts at the top of the range.
+    unsigned long long wide[256];
+    for (int i = 0; i < 256; i++)
+        wide[i] = 1ull << 55;
+    HOST_CHECK_EQUAL(HistogramEntropy(wide), 8u << 16);
+}
+
+int main() {
+    TestFixedLog2();
+    TestIsZero();
+    TestFirstDifference();
+    TestHistograms();
+    TestEntropyEdges();
+    return HostTestResult("BlockScanTest");
+}
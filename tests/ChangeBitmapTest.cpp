@@ -0,0 +1,225 @@
+// Change tracking bitmaps against a per-block reference: marking ranges across words and leaves, snapshots that
+// replace or merge, the range walk the changed-ranges ioctl does, leaves that cannot be allocated, and writers marking
+// while snapshots are taken, where no write may be lost between them.
+#include "ChangeBitmap.hpp"
+#include "HostTest.hpp"
+#include <atomic>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+// Leaf allocator that can be told to fail, counting what is outstanding so leaks show up.
+typedef struct _LEAF_POOL {
+    std::atomic<long long> outstanding{ 0 };
+    std::atomic<long long> allocationsLeft{ -1 };   // -1 never fails
+} LEAF_POOL;
+
+static unsigned int* PoolAllocate(void* context) {
+    LEAF_POOL* pool = (LEAF_POOL*)context;
+    // Only single-threaded tests limit allocations.
+    if (pool->allocationsLeft.load() == 0)
+        return 0;
+    if (pool->allocationsLeft.load() > 0)
+        pool->allocationsLeft--;
+    pool->outstanding++;
+    return new unsigned int[CHANGE_LEAF_WORDS]();
+}
+
+static void PoolFree(void* context, unsigned int* leaf) {
+    LEAF_POOL* pool = (LEAF_POOL*)context;
+    pool->outstanding--;
+    delete[] leaf;
+}
+
+struct BITMAP {
+    std::vector<unsigned int*> leaves;
+    CHANGE_BITMAP bitmap;
+
+    BITMAP(unsigned long long blockCount, LEAF_POOL* pool) : leaves((size_t)ChangeBitmapLeafCount(blockCount), nullptr) {
+        ChangeBitmapInit(&bitmap, leaves.data(), blockCount, PoolAllocate, PoolFree, pool);
+    }
+    ~BITMAP() { ChangeBitmapClear(&bitmap); }
+};
+
+// The dirty ranges the way ChangedRangesIoctlHandler walks them, expanded back into blocks.
+static std::vector<char> WalkRanges(const CHANGE_BITMAP* bitmap, unsigned long long from) {
+    std::vector<char> blocks((size_t)bitmap->blockCount, 0);
+    unsigned long long block = ChangeBitmapFind(bitmap, from, 1);
+    while (block < bitmap->blockCount) {
+        unsigned long long end = ChangeBitmapFind(bitmap, block, 0);
+        HOST_CHECK(end > block);
+        if (end <= block)
+            break;
+        for (unsigned long long b = block; b < end; b++)
+            blocks[(size_t)b] = 1;
+        block = ChangeBitmapFind(bitmap, end, 1);
+    }
+    return blocks;
+}
+
+static void CheckMatches(const CHANGE_BITMAP* bitmap, const std::vector<char>& expected) {
+    unsigned long long count = 0;
+    for (char dirty : expected)
+        count += dirty;
+    HOST_CHECK_EQUAL(ChangeBitmapCount(bitmap), count);
+    HOST_CHECK(WalkRanges(bitmap, 0) == expected);
+}
+
+static void TestAgainstReference() {
+    HOST_RANDOM random = { 0xCB7ull };
+    LEAF_POOL pool;
+    for (int round = 0; round < 200; round++) {
+        unsigned long long blockCount = 1 + HostRandomBelow(&random, 3 * CHANGE_LEAF_BITS + 77);
+        BITMAP active(blockCount, &pool), snapshot(blockCount, &pool);
+        std::vector<char> marked((size_t)blockCount), expected((size_t)blockCount, 0);
+
+        for (int pass = 0; pass < 3; pass++) {
+            std::fill(marked.begin(), marked.end(), 0);
+            unsigned int writes = HostRandomBelow(&random, 20);
+            for (unsigned int w = 0; w < writes; w++) {
+                unsigned long long start = HostRandomNext(&random) % blockCount;
+                unsigned long long length = 1 + HostRandomBelow(&random, HostRandomBelow(&random, 4) ? 40 : 70000);
+                HOST_CHECK(ChangeBitmapMark(&active.bitmap, start, start + length));
+                for (unsigned long long b = start; b < start + length && b < blockCount; b++)
+                    marked[(size_t)b] = 1;
+            }
+            CheckMatches(&active.bitmap, marked);
+
+            bool merge = HostRandomBelow(&random, 2) != 0;
+            if (!merge) {
+                ChangeBitmapClear(&snapshot.bitmap);
+                std::fill(expected.begin(), expected.end(), 0);
+            }
+            HOST_CHECK(ChangeBitmapTake(&snapshot.bitmap, &active.bitmap));
+            for (size_t b = 0; b < expected.size(); b++)
+                expected[b] |= marked[b];
+            CheckMatches(&snapshot.bitmap, expected);
+            HOST_CHECK_EQUAL(ChangeBitmapCount(&active.bitmap), 0);
+            HOST_CHECK_EQUAL(ChangeBitmapFind(&active.bitmap, 0, 1), blockCount);
+
+            // A walk that starts part way through only reports what is from there on.
+            unsigned long long from = HostRandomNext(&random) % blockCount;
+            std::vector<char> tail = expected;
+            std::fill(tail.begin(), tail.begin() + (size_t)from, 0);
+            HOST_CHECK(WalkRanges(&snapshot.bitmap, from) == tail);
+        }
+    }
+    HOST_CHECK_EQUAL(pool.outstanding.load(), 0);
+}
+
+static void TestEdges() {
+    LEAF_POOL pool;
+    const unsigned long long blockCount = 2 * CHANGE_LEAF_BITS + 5;
+    BITMAP bitmap(blockCount, &pool);
+    HOST_CHECK_EQUAL(bitmap.bitmap.leafCount, 3);
+
+    // Untouched leaves stay unallocated; an empty range marks nothing.
+    HOST_CHECK(ChangeBitmapMark(&bitmap.bitmap, 100, 100));
+    HOST_CHECK_EQUAL(pool.outstanding.load(), 0);
+    HOST_CHECK_EQUAL(ChangeBitmapFind(&bitmap.bitmap, 0, 1), blockCount);
+    HOST_CHECK_EQUAL(ChangeBitmapFind(&bitmap.bitmap, 7, 0), 7);
+
+    // A range ending on a leaf boundary, one crossing it, and the last block, past which nothing is marked.
+    HOST_CHECK(ChangeBitmapMark(&bitmap.bitmap, CHANGE_LEAF_BITS - 32, CHANGE_LEAF_BITS));
+    HOST_CHECK_EQUAL(pool.outstanding.load(), 1);
+    HOST_CHECK(ChangeBitmapMark(&bitmap.bitmap, 2 * CHANGE_LEAF_BITS - 1, 2 * CHANGE_LEAF_BITS + 1));
+    HOST_CHECK(ChangeBitmapMark(&bitmap.bitmap, blockCount - 1, blockCount + 1000));
+    HOST_CHECK_EQUAL(pool.outstanding.load(), 3);
+    HOST_CHECK_EQUAL(ChangeBitmapCount(&bitmap.bitmap), 32 + 2 + 1);
+    HOST_CHECK_EQUAL(ChangeBitmapFind(&bitmap.bitmap, 0, 1), CHANGE_LEAF_BITS - 32);
+    HOST_CHECK_EQUAL(ChangeBitmapFind(&bitmap.bitmap, CHANGE_LEAF_BITS - 32, 0), CHANGE_LEAF_BITS);
+    HOST_CHECK_EQUAL(ChangeBitmapFind(&bitmap.bitmap, CHANGE_LEAF_BITS, 1), 2 * CHANGE_LEAF_BITS - 1);
+    HOST_CHECK_EQUAL(ChangeBitmapFind(&bitmap.bitmap, 2 * CHANGE_LEAF_BITS - 1, 0), 2 * CHANGE_LEAF_BITS + 1);
+    HOST_CHECK_EQUAL(ChangeBitmapFind(&bitmap.bitmap, 2 * CHANGE_LEAF_BITS + 1, 1), blockCount - 1);
+    HOST_CHECK_EQUAL(ChangeBitmapFind(&bitmap.bitmap, blockCount - 1, 0), blockCount);
+
+    ChangeBitmapClear(&bitmap.bitmap);
+    HOST_CHECK_EQUAL(pool.outstanding.load(), 0);
+    HOST_CHECK_EQUAL(ChangeBitmapCount(&bitmap.bitmap), 0);
+}
+
+// The driver turns either failure into a snapshot that covers everything; what matters here is that nothing already
+// marked is lost and that the bitmap stays usable.
+static void TestAllocationFailures() {
+    LEAF_POOL pool;
+    const unsigned long long blockCount = 4 * CHANGE_LEAF_BITS;
+    BITMAP active(blockCount, &pool), snapshot(blockCount, &pool);
+
+    pool.allocationsLeft = 1;
+    HOST_CHECK(ChangeBitmapMark(&active.bitmap, 10, 20));
+    HOST_CHECK(!ChangeBitmapMark(&active.bitmap, 3 * CHANGE_LEAF_BITS, 3 * CHANGE_LEAF_BITS + 1));
+    HOST_CHECK_EQUAL(ChangeBitmapCount(&active.bitmap), 10);
+
+    // Taking into a snapshot that cannot get a leaf leaves the bits in the active bitmap for the next snapshot.
+    HOST_CHECK(!ChangeBitmapTake(&snapshot.bitmap, &active.bitmap));
+    HOST_CHECK_EQUAL(ChangeBitmapCount(&active.bitmap), 10);
+    HOST_CHECK_EQUAL(ChangeBitmapCount(&snapshot.bitmap), 0);
+
+    pool.allocationsLeft = -1;
+    HOST_CHECK(ChangeBitmapMark(&active.bitmap, 3 * CHANGE_LEAF_BITS, 3 * CHANGE_LEAF_BITS + 1));
+    HOST_CHECK(ChangeBitmapTake(&snapshot.bitmap, &active.bitmap));
+    HOST_CHECK_EQUAL(ChangeBitmapCount(&snapshot.bitmap), 11);
+    HOST_CHECK_EQUAL(ChangeBitmapCount(&active.bitmap), 0);
+}
+
+// Writers mark every block exactly once, interleaved so they share words and race to allocate each leaf, while the
+// main thread keeps taking replacing snapshots; a final one is taken once they are done. Every block has to show up in
+// exactly one snapshot: a mark lost to a snapshot taking the word, or taken twice, would break that.
+static void TestConcurrentSnapshots() {
+    LEAF_POOL pool;
+    const unsigned int writerCount = 4;
+    const unsigned long long blockCount = 64 * CHANGE_LEAF_BITS;
+    BITMAP active(blockCount, &pool), snapshot(blockCount, &pool);
+    std::atomic<unsigned int> writersDone{ 0 };
+    // On hosts with fewer cores than threads the writers would otherwise finish within one time slice.
+    const bool yield = std::thread::hardware_concurrency() <= writerCount;
+
+    std::vector<std::thread> writers;
+    for (unsigned int w = 0; w < writerCount; w++) {
+        writers.emplace_back([&, w]() {
+            for (unsigned long long block = w; block < blockCount; block += writerCount) {
+                HOST_CHECK(ChangeBitmapMark(&active.bitmap, block, block + 1));
+                if (yield && block % 4096 < writerCount)
+                    std::this_thread::yield();
+            }
+            writersDone++;
+        });
+    }
+
+    std::vector<unsigned int> seen((size_t)blockCount, 0);
+    unsigned int snapshots = 0;
+    auto collect = [&]() {
+        ChangeBitmapClear(&snapshot.bitmap);
+        HOST_CHECK(ChangeBitmapTake(&snapshot.bitmap, &active.bitmap));
+        std::vector<char> taken = WalkRanges(&snapshot.bitmap, 0);
+        for (size_t b = 0; b < seen.size(); b++)
+            seen[b] += taken[b];
+        snapshots++;
+    };
+    while (writersDone.load() < writerCount) {
+        collect();
+        if (yield)
+            std::this_thread::yield();
+    }
+    for (auto& writer : writers)
+        writer.join();
+    collect();
+
+    unsigned long long wrong = 0;
+    for (unsigned int count : seen)
+        wrong += count != 1;
+    HOST_CHECK_EQUAL(wrong, 0);
+    printf("%u snapshots taken while marking\n", snapshots);
+    HOST_CHECK_EQUAL(ChangeBitmapCount(&active.bitmap), 0);
+    ChangeBitmapClear(&active.bitmap);
+    ChangeBitmapClear(&snapshot.bitmap);
+    HOST_CHECK_EQUAL(pool.outstanding.load(), 0);
+}
+
+int main() {
+    TestAgainstReference();
+    TestEdges();
+    TestAllocationFailures();
+    TestConcurrentSnapshots();
+    return HostTestResult("ChangeBitmapTest");
+}
@@ -0,0 +1,39 @@
+// Throughput of the digest kernels over a buffer that fits in the last level cache, at each feature level.
+#include "Digest.hpp"
+#include "HostTest.hpp"
+#include "HostBench.hpp"
+#include <vector>
+
+int main() {
+    HOST_RANDOM random = { 0xD16E57ull };
+    std::vector<unsigned char> data(4 << 20);
+    HostRandomFill(&random, data.data(), data.size());
+    unsigned int features = HostSimdFeatures();
+    const unsigned char* pData = data.data();
+    size_t length = data.size();
+
+    HostBenchReport("crc32c scalar", length, HostBenchSeconds([&] { g_hostBenchSink += Crc32cUpdate(0, pData, length, 0); }));
+    if (features & SIMD_FEATURE_SSE42)
+        HostBenchReport("crc32c sse4.2", length, HostBenchSeconds([&] { g_hostBenchSink += Crc32cUpdate(0, pData, length, SIMD_FEATURE_SSE42); }));
+    HostBenchReport("crc32", length, HostBenchSeconds([&] { g_hostBenchSink += Crc32Update(0, pData, length); }));
+    HostBenchReport("xxh64", length, HostBenchSeconds([&] {
+        XXH64_STATE state;
+        Xxh64Init(&state, 0);
+        Xxh64Update(&state, pData, length);
+        g_hostBenchSink += Xxh64Final(&state);
+    }));
+
+    for (unsigned int level : { 0u, features & SIMD_FEATURE_SHA }) {
+        HostBenchReport(level ? "sha256 sha-ni" : "sha256 scalar", length, HostBenchSeconds([&] {
+            SHA256_STATE state;
+            unsigned char digest[SHA256_DIGEST_LENGTH];
+            Sha256Init(&state);
+            Sha256Update(&state, pData, length, level);
+            Sha256Final(&state, digest, level);
+            g_hostBenchSink += digest[0];
+        }));
+        if (!(features & SIMD_FEATURE_SHA))
+            break;
+    }
+    return 0;
+}
@@ -0,0 +1,141 @@
+// Known-answer vectors for the digest kernels at every feature level the host can run, and checks that splitting the
+// input across updates does not change the result.
+#include "Digest.hpp"
+#include "HostTest.hpp"
+#include <string.h>
+#include <vector>
+
+static const char g_check[] = "123456789";
+static const char g_twoBlocks[] = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+
+// 0, 1, ..., 255 repeated, 10240 bytes: long enough for the 8-byte CRC loop, XXH64 stripes and many SHA-256 blocks.
+static std::vector<unsigned char> CountingBytes() {
+    std::vector<unsigned char> data(10240);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = (unsigned char)i;
+    return data;
+}
+
+static bool DigestIs(const unsigned char digest[SHA256_DIGEST_LENGTH], const char* hex) {
+    char text[2 * SHA256_DIGEST_LENGTH + 1];
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++)
+        snprintf(text + 2 * i, 3, "%02x", digest[i]);
+    return strcmp(text, hex) == 0;
+}
+
+static void Sha256(const void* data, size_t length, unsigned int features, unsigned char digest[SHA256_DIGEST_LENGTH]) {
+    SHA256_STATE state;
+    Sha256Init(&state);
+    Sha256Update(&state, data, length, features);
+    Sha256Final(&state, digest, features);
+}
+
+static unsigned long long Xxh64(const void* data, size_t length, unsigned long long seed) {
+    XXH64_STATE state;
+    Xxh64Init(&state, seed);
+    Xxh64Update(&state, data, length);
+    return Xxh64Final(&state);
+}
+
+static void TestCrc32c(unsigned int features) {
+    for (unsigned int level : { 0u, features & SIMD_FEATURE_SSE42 }) {
+        unsigned char zeros[32], ones[32], counting[32];
+        memset(zeros, 0, sizeof(zeros));
+        memset(ones, 0xFF, sizeof(ones));
+        for (int i = 0; i < 32; i++)
+            counting[i] = (unsigned char)i;
+
+        // RFC 3720 B.4 and the customary check value.
+        HOST_CHECK_EQUAL(Crc32cUpdate(0, g_check, 9, level), 0xE3069283);
+        HOST_CHECK_EQUAL(Crc32cUpdate(0, zeros, sizeof(zeros), level), 0x8A9136AA);
+        HOST_CHECK_EQUAL(Crc32cUpdate(0, ones, sizeof(ones), level), 0x62A8AB43);
+        HOST_CHECK_EQUAL(Crc32cUpdate(0, counting, sizeof(counting), level), 0x46DD794E);
+        HOST_CHECK_EQUAL(Crc32cUpdate(0, g_check, 0, level), 0);
+
+        std::vector<unsigned char> data = CountingBytes();
+        HOST_CHECK_EQUAL(Crc32cUpdate(0, data.data(), data.size(), level), 0xBD846CD7);
+    }
+}
+
+static void TestCrc32() {
+    HOST_CHECK_EQUAL(Crc32Update(0, g_check, 9), 0xCBF43926);
+    std::vector<unsigned char> data = CountingBytes();
+    HOST_CHECK_EQUAL(Crc32Update(0, data.data(), data.size()), 0xBBCE3B9D);
+}
+
+static void TestXxh64() {
+    static const char spam[] = "Nobody inspects the spammish repetition";
+    HOST_CHECK_EQUAL(Xxh64("", 0, 0), 0xEF46DB3751D8E999ull);
+    HOST_CHECK_EQUAL(Xxh64("abc", 3, 0), 0x44BC2CF5AD770999ull);
+    HOST_CHECK_EQUAL(Xxh64(spam, sizeof(spam) - 1, 0), 0xFBCEA83C8A378BF1ull);
+
+    std::vector<unsigned char> data = CountingBytes();
+    HOST_CHECK_EQUAL(Xxh64(data.data(), data.size(), 0), 0x58B820AA7970DBE2ull);
+    HOST_CHECK_EQUAL(Xxh64(data.data(), data.size(), 0x9E3779B97F4A7C15ull), 0xEEBB5D88460936B2ull);
+}
+
+static void TestSha256(unsigned int features) {
+    std::vector<unsigned char> data = CountingBytes();
+    std::vector<unsigned char> million(1000000, 'a');
+    for (unsigned int level : { 0u, features & SIMD_FEATURE_SHA }) {
+        unsigned char digest[SHA256_DIGEST_LENGTH];
+        // FIPS 180-2 appendix B.
+        Sha256("", 0, level, digest);
+        HOST_CHECK(DigestIs(digest, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"));
+        Sha256("abc", 3, level, digest);
+        HOST_CHECK(DigestIs(digest, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"));
+        Sha256(g_twoBlocks, sizeof(g_twoBlocks) - 1, level, digest);
+        HOST_CHECK(DigestIs(digest, "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"));
+        Sha256(million.data(), million.size(), level, digest);
+        HOST_CHECK(DigestIs(digest, "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0"));
+        Sha256(data.data(), data.size(), level, digest);
+        HOST_CHECK(DigestIs(digest, "e96760a87768717bcebcfd25ddc7d46b4dbc95a4b0014def080c08539f7d90d0"));
+    }
+}
+
+// Streaming: any split of the input, and any mix of feature levels across the pieces, gives the one-shot result.
+static void TestSplitUpdates(unsigned int features) {
+    HOST_RANDOM random = { 0xD16E57ull };
+    std::vector<unsigned char> data(8192);
+    HostRandomFill(&random, data.data(), data.size());
+
+    for (int round = 0; round < 500; round++) {
+        size_t length = HostRandomBelow(&random, (unsigned int)data.size() + 1);
+        size_t cut = HostRandomBelow(&random, (unsigned int)length + 1);
+        unsigned int first = HostRandomBelow(&random, 2) ? features : 0;
+        unsigned int second = HostRandomBelow(&random, 2) ? features : 0;
+
+        unsigned int crc = Crc32cUpdate(0, data.data(), length, 0);
+        HOST_CHECK_EQUAL(Crc32cUpdate(Crc32cUpdate(0, data.data(), cut, first), data.data() + cut, length - cut, second), crc);
+        HOST_CHECK_EQUAL(Crc32Update(Crc32Update(0, data.data(), cut), data.data() + cut, length - cut), Crc32Update(0, data.data(), length));
+
+        XXH64_STATE xxh;
+        Xxh64Init(&xxh, round);
+        Xxh64Update(&xxh, data.data(), cut);
+        Xxh64Update(&xxh, data.data() + cut, length - cut);
+        HOST_CHECK_EQUAL(Xxh64Final(&xxh), Xxh64(data.data(), length, round));
+
+        unsigned char expected[SHA256_DIGEST_LENGTH], digest[SHA256_DIGEST_LENGTH];
+        Sha256(data.data(), length, 0, expected);
+        SHA256_STATE sha;
+        Sha256Init(&sha);
+        Sha256Update(&sha, data.data(), cut, first);
+        Sha256Update(&sha, data.data() + cut, length - cut, second);
+        Sha256Final(&sha, digest, second);
+        HOST_CHECK(memcmp(digest, expected, sizeof(digest)) == 0);
+        if (g_hostTestFailures) {
+            fprintf(stderr, "round %d: length %zu, cut %zu\n", round, length, cut);
+            return;
+        }
+    }
+}
+
+int main() {
+    unsigned int features = HostSimdFeatures();
+    TestCrc32c(features);
+    TestCrc32();
+    TestXxh64();
+    TestSha256(features);
+    TestSplitUpdates(features);
+    return HostTestResult("DigestTest");
+}
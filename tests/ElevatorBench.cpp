@@ -0,0 +1,134 @@
+// Seek-cost harness for the elevator: closed-loop clients issuing random 64 KiB reads against a model of a 1 TB,
+// 7200 rpm disk, dispatched either in arrival order or through the C-SCAN queue with a bounded device depth, as the
+// elevator thread does. Optionally holds the first request on an idle device for a short gathering window.
+#include "ElevatorQueue.hpp"
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+#include <deque>
+#include <queue>
+#include <random>
+#include <vector>
+
+static const double CAPACITY_BYTES = 1e12;
+static const double IO_BYTES = 65536;
+static const double SIMULATED_MS = 600000;
+
+// Seeks within about a track cost nothing; otherwise 0.8 ms track to track up to 8 ms full stroke.
+static double SeekMs(double from, double to) {
+    double distance = fabs(to - from);
+    if (distance < 1e6)
+        return 0.0;
+    return 0.8 + 7.2 * sqrt(distance / CAPACITY_BYTES);
+}
+
+typedef struct _SIM_REQUEST {
+    ELEVATOR_NODE node;
+    double submitMs;
+} SIM_REQUEST;
+
+typedef struct _SIM_EVENT {
+    double timeMs;
+    SIM_REQUEST* pRequest;      // completion of this request; NULL when the gathering window ends
+    bool operator<(const _SIM_EVENT& other) const { return timeMs > other.timeMs; }
+} SIM_EVENT;
+
+enum SIM_MODE { SIM_FIFO, SIM_CSCAN };
+
+static void Simulate(int clients, SIM_MODE mode, int depth, double windowMs) {
+    std::mt19937_64 rng(42);
+    std::uniform_real_distribution<double> offsetOf(0, CAPACITY_BYTES - IO_BYTES);
+    std::uniform_real_distribution<double> rotationMs(0, 8.33);
+    std::priority_queue<SIM_EVENT> events;
+    std::vector<SIM_REQUEST> requests(clients);
+    std::deque<SIM_REQUEST*> device;
+    std::vector<double> latencies;
+    ELEVATOR_QUEUE queue;
+    ElevatorQueueInit(&queue);
+    double headPosition = 0;
+    unsigned long long sweepPosition = 0;
+    bool deviceBusy = false, holding = false;
+    int inFlight = 0;
+
+    auto startDevice = [&](double now) {
+        if (deviceBusy || device.empty())
+            return;
+        SIM_REQUEST* pRequest = device.front();
+        device.pop_front();
+        deviceBusy = true;
+        double serviceMs = SeekMs(headPosition, (double)pRequest->node.key) + rotationMs(rng) + IO_BYTES / 150e6 * 1e3;
+        headPosition = (double)pRequest->node.key + IO_BYTES;
+        events.push({ now + serviceMs, pRequest });
+    };
+    auto dispatch = [&](double now) {
+        while (queue.count && inFlight < depth) {
+            int wrapped;
+            SIM_REQUEST* pRequest = (SIM_REQUEST*)ElevatorQueuePopNext(&queue, sweepPosition, &wrapped);
+            sweepPosition = pRequest->node.key + (unsigned long long)IO_BYTES;
+            inFlight++;
+            device.push_back(pRequest);
+        }
+        startDevice(now);
+    };
+    auto submit = [&](SIM_REQUEST* pRequest, double now) {
+        pRequest->submitMs = now;
+        pRequest->node.key = (unsigned long long)offsetOf(rng);
+        if (mode == SIM_FIFO) {
+            device.push_back(pRequest);
+            startDevice(now);
+            return;
+        }
+        ElevatorQueueInsert(&queue, &pRequest->node);
+        if (windowMs > 0 && inFlight == 0 && queue.count == 1 && !holding) {
+            holding = true;
+            events.push({ now + windowMs, NULL });
+        }
+        if (!holding)
+            dispatch(now);
+    };
+
+    for (auto& request : requests)
+        submit(&request, 0);
+    while (!events.empty()) {
+        SIM_EVENT event = events.top();
+        events.pop();
+        if (event.timeMs > SIMULATED_MS)
+            break;
+        if (!event.pRequest) {
+            holding = false;
+            dispatch(event.timeMs);
+            continue;
+        }
+        deviceBusy = false;
+        if (mode == SIM_CSCAN)
+            inFlight--;
+        latencies.push_back(event.timeMs - event.pRequest->submitMs);
+        startDevice(event.timeMs);
+        submit(event.pRequest, event.timeMs);
+        if (mode == SIM_CSCAN && !holding)
+            dispatch(event.timeMs);
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    double mean = 0;
+    for (double latency : latencies)
+        mean += latency;
+    mean /= latencies.size();
+    char name[48];
+    if (mode == SIM_FIFO)
+        snprintf(name, sizeof(name), "fifo");
+    else
+        snprintf(name, sizeof(name), windowMs > 0 ? "c-scan depth %d, %.1f ms window" : "c-scan depth %d", depth, windowMs);
+    printf("clients %2d  %-30s IOPS %6.1f  mean %6.1f ms  p99 %6.1f ms\n", clients, name,
+        latencies.size() / (SIMULATED_MS / 1e3), mean, latencies[latencies.size() * 99 / 100]);
+}
+
+int main() {
+    for (int clients : { 1, 4, 16, 64 }) {
+        Simulate(clients, SIM_FIFO, 0, 0);
+        Simulate(clients, SIM_CSCAN, 1, 0);
+        Simulate(clients, SIM_CSCAN, 2, 0);
+        Simulate(clients, SIM_CSCAN, 1, 1.0);
+    }
+    return 0;
+}
@@ -0,0 +1,102 @@
+// C-SCAN order of the elevator's dispatch queue against a reference model: random inserts, pops from a moving
+// position and withdrawals, with many equal keys so arrival order within a key is exercised too.
+#include "ElevatorQueue.hpp"
+#include "HostTest.hpp"
+#include <iterator>
+#include <set>
+#include <utility>
+#include <vector>
+
+typedef struct _TEST_REQUEST {
+    ELEVATOR_NODE node;
+    unsigned long long sequence;
+} TEST_REQUEST;
+
+static void TestOrder() {
+    ELEVATOR_QUEUE queue;
+    ElevatorQueueInit(&queue);
+    int wrapped = 1;
+    HOST_CHECK(ElevatorQueuePopNext(&queue, 0, &wrapped) == 0);
+    HOST_CHECK(!wrapped);
+
+    TEST_REQUEST requests[5] = {};
+    unsigned long long keys[5] = { 300, 100, 200, 100, 400 };
+    for (int i = 0; i < 5; i++) {
+        requests[i].node.key = keys[i];
+        ElevatorQueueInsert(&queue, &requests[i].node);
+    }
+    HOST_CHECK_EQUAL(queue.count, 5);
+
+    // From 150 the sweep takes 200, 300, 400, then wraps to the two requests at 100 in arrival order.
+    PELEVATOR_NODE expected[5] = { &requests[2].node, &requests[0].node, &requests[4].node, &requests[1].node, &requests[3].node };
+    int expectedWrap[5] = { 0, 0, 0, 1, 0 };
+    unsigned long long position = 150;
+    for (int i = 0; i < 5; i++) {
+        PELEVATOR_NODE node = ElevatorQueuePopNext(&queue, position, &wrapped);
+        HOST_CHECK(node == expected[i]);
+        HOST_CHECK_EQUAL(wrapped, expectedWrap[i]);
+        if (node)
+            position = node->key;
+    }
+    HOST_CHECK_EQUAL(queue.count, 0);
+    // A popped request is no longer queued.
+    HOST_CHECK(!ElevatorQueueRemove(&queue, &requests[0].node));
+}
+
+static void TestRandomized() {
+    HOST_RANDOM random = { 0xE1E7A70Bull };
+    std::vector<TEST_REQUEST> requests(256);
+    std::set<std::pair<unsigned long long, unsigned long long>> model;   // key, sequence
+    std::vector<bool> queued(requests.size(), false);
+    ELEVATOR_QUEUE queue;
+    ElevatorQueueInit(&queue);
+    unsigned long long position = 0, sequence = 0;
+
+    for (int step = 0; step < 200000 && !g_hostTestFailures; step++) {
+        size_t index = HostRandomBelow(&random, (unsigned int)requests.size());
+        unsigned int action = HostRandomBelow(&random, 8);
+        if (action < 4 && !queued[index]) {
+            TEST_REQUEST* pRequest = &requests[index];
+            pRequest->node.key = HostRandomBelow(&random, 64) * 4096;
+            pRequest->sequence = sequence++;
+            ElevatorQueueInsert(&queue, &pRequest->node);
+            model.insert({ pRequest->node.key, pRequest->sequence });
+            queued[index] = true;
+        }
+        else if (action < 7) {
+            auto next = model.lower_bound({ position, 0 });
+            int expectWrap = next == model.end() && !model.empty();
+            if (expectWrap)
+                next = model.begin();
+            int wrapped;
+            TEST_REQUEST* pRequest = (TEST_REQUEST*)ElevatorQueuePopNext(&queue, position, &wrapped);
+            if (next == model.end()) {
+                HOST_CHECK(pRequest == 0);
+                continue;
+            }
+            HOST_CHECK(pRequest != 0);
+            if (!pRequest)
+                break;
+            HOST_CHECK_EQUAL(pRequest->node.key, next->first);
+            HOST_CHECK_EQUAL(pRequest->sequence, next->second);
+            HOST_CHECK_EQUAL(wrapped, expectWrap);
+            model.erase(next);
+            queued[pRequest - requests.data()] = false;
+            position = pRequest->node.key + 4096;
+        }
+        else {
+            TEST_REQUEST* pRequest = &requests[index];
+            HOST_CHECK_EQUAL(ElevatorQueueRemove(&queue, &pRequest->node), queued[index]);
+            if (queued[index])
+                model.erase({ pRequest->node.key, pRequest->sequence });
+            queued[index] = false;
+        }
+        HOST_CHECK_EQUAL(queue.count, model.size());
+    }
+}
+
+int main() {
+    TestOrder();
+    TestRandomized();
+    return HostTestResult("ElevatorQueueTest");
+}
@@ -0,0 +1,176 @@
+// Flush sharing between writers: the ticket state machine step by step, then many writer threads committing through a
+// host version of FlushGroupCommit against a simulated device. Every write has to be covered by a flush sent after it
+// was done, report that flush's status, and most writes have to share a flush.
+#include "FlushTickets.hpp"
+#include "HostTest.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define STATUS_OK       0L
+#define STATUS_FAILED   (-1L)
+
+static void TestSequence() {
+    FLUSH_TICKETS tickets;
+    FlushTicketsInit(&tickets);
+
+    // A failed write takes no ticket and needs no flush.
+    FlushTicketsWriteStarted(&tickets);
+    HOST_CHECK_EQUAL(FlushTicketsWriteDone(&tickets, 0), 0);
+    HOST_CHECK_EQUAL(tickets.writesInFlight, 0);
+
+    // The first writer leads; writers done while its flush is in flight wait for the next one.
+    FlushTicketsWriteStarted(&tickets);
+    FlushTicketsWriteStarted(&tickets);
+    unsigned long long first = FlushTicketsWriteDone(&tickets, 1);
+    HOST_CHECK_EQUAL(first, 1);
+    HOST_CHECK_EQUAL(FlushTicketsNext(&tickets, first), FLUSH_TICKET_LEAD);
+    HOST_CHECK(FlushTicketsShouldGather(&tickets));
+    unsigned long long target = FlushTicketsSend(&tickets);
+    HOST_CHECK_EQUAL(target, 1);
+
+    unsigned long long second = FlushTicketsWriteDone(&tickets, 1);
+    HOST_CHECK_EQUAL(second, 2);
+    HOST_CHECK(!FlushTicketsShouldGather(&tickets));
+    HOST_CHECK_EQUAL(FlushTicketsNext(&tickets, second), FLUSH_TICKET_WAIT);
+    HOST_CHECK_EQUAL(FlushTicketsNext(&tickets, first), FLUSH_TICKET_WAIT);
+
+    FlushTicketsFlushDone(&tickets, target, STATUS_OK);
+    HOST_CHECK_EQUAL(FlushTicketsNext(&tickets, first), FLUSH_TICKET_COVERED);
+    HOST_CHECK_EQUAL(FlushTicketsNext(&tickets, second), FLUSH_TICKET_LEAD);
+
+    // A write done while the leader gathers is covered by the flush it then sends, and gets that flush's status.
+    unsigned long long third = FlushTicketsWriteDone(&tickets, 1);
+    target = FlushTicketsSend(&tickets);
+    HOST_CHECK_EQUAL(target, 3);
+    HOST_CHECK_EQUAL(FlushTicketsNext(&tickets, third), FLUSH_TICKET_WAIT);
+    FlushTicketsFlushDone(&tickets, target, STATUS_FAILED);
+    HOST_CHECK_EQUAL(FlushTicketsNext(&tickets, second), FLUSH_TICKET_COVERED);
+    HOST_CHECK_EQUAL(FlushTicketsNext(&tickets, third), FLUSH_TICKET_COVERED);
+    HOST_CHECK_EQUAL(tickets.coveredStatus, STATUS_FAILED);
+    HOST_CHECK(!tickets.flushing);
+
+    // An unannounced write does not take the count below zero.
+    HOST_CHECK_EQUAL(FlushTicketsWriteDone(&tickets, 1), 4);
+    HOST_CHECK_EQUAL(tickets.writesInFlight, 0);
+}
+
+// The device: flushes are numbered as they are sent, and a write records the number of the last flush sent when it
+// was done, so a flush with a higher number was sent after it. Every failEvery-th flush fails.
+typedef struct _SIMULATED_DEVICE {
+    std::atomic<unsigned long long> flushesSent{ 0 };
+    unsigned int failEvery;
+} SIMULATED_DEVICE;
+
+static long DeviceFlush(SIMULATED_DEVICE* device, unsigned long long* number) {
+    *number = ++device->flushesSent;
+    std::this_thread::sleep_for(std::chrono::microseconds(50));
+    return device->failEvery && *number % device->failEvery == 0 ? STATUS_FAILED : STATUS_OK;
+}
+
+// FlushGroupCommit with a mutex for the spin lock and a condition variable for the done event.
+typedef struct _HOST_FLUSH_GROUP {
+    std::mutex lock;
+    std::condition_variable done;
+    FLUSH_TICKETS tickets;
+    unsigned long long coveredFlush;    // number of the flush tickets.covered is from
+    SIMULATED_DEVICE* device;
+} HOST_FLUSH_GROUP;
+
+// Also returns the number of the flush whose status it reports.
+static long HostFlushCommit(HOST_FLUSH_GROUP* group, long writeStatus, unsigned long long* flushNumber) {
+    std::unique_lock<std::mutex> hold(group->lock);
+    unsigned long long ticket = FlushTicketsWriteDone(&group->tickets, writeStatus == STATUS_OK);
+    if (!ticket)
+        return writeStatus;
+
+    int next;
+    while ((next = FlushTicketsNext(&group->tickets, ticket)) == FLUSH_TICKET_WAIT)
+        group->done.wait(hold);
+    if (next == FLUSH_TICKET_COVERED) {
+        *flushNumber = group->coveredFlush;
+        return group->tickets.coveredStatus;
+    }
+
+    int gather = FlushTicketsShouldGather(&group->tickets);
+    hold.unlock();
+    if (gather)
+        std::this_thread::sleep_for(std::chrono::microseconds(20));
+    hold.lock();
+    unsigned long long target = FlushTicketsSend(&group->tickets);
+    hold.unlock();
+
+    long status = DeviceFlush(group->device, flushNumber);
+
+    hold.lock();
+    group->coveredFlush = *flushNumber;
+    FlushTicketsFlushDone(&group->tickets, target, status);
+    group->done.notify_all();
+    return status;
+}
+
+static void RunWriters(unsigned int writerCount, unsigned int writesEach, unsigned int failEvery) {
+    SIMULATED_DEVICE device;
+    device.failEvery = failEvery;
+    HOST_FLUSH_GROUP group;
+    FlushTicketsInit(&group.tickets);
+    group.coveredFlush = 0;
+    group.device = &device;
+
+    std::atomic<unsigned int> uncovered{ 0 }, wrongStatus{ 0 }, failedWrites{ 0 };
+    std::vector<std::thread> writers;
+    for (unsigned int w = 0; w < writerCount; w++) {
+        writers.emplace_back([&, w]() {
+            HOST_RANDOM random = { 0xF1005ull + w };
+            for (unsigned int i = 0; i < writesEach; i++) {
+                {
+                    std::lock_guard<std::mutex> hold(group.lock);
+                    FlushTicketsWriteStarted(&group.tickets);
+                }
+                std::this_thread::sleep_for(std::chrono::microseconds(HostRandomBelow(&random, 30)));
+                // One in sixteen writes fails and is only accounted for.
+                long writeStatus = HostRandomBelow(&random, 16) ? STATUS_OK : STATUS_FAILED;
+                unsigned long long doneAfterFlush = device.flushesSent;
+                unsigned long long flushNumber = 0;
+                long status = HostFlushCommit(&group, writeStatus, &flushNumber);
+                if (writeStatus != STATUS_OK) {
+                    failedWrites++;
+                    if (status != writeStatus || flushNumber)
+                        wrongStatus++;
+                    continue;
+                }
+                if (flushNumber <= doneAfterFlush)
+                    uncovered++;
+                long expected = failEvery && flushNumber % failEvery == 0 ? STATUS_FAILED : STATUS_OK;
+                if (status != expected)
+                    wrongStatus++;
+            }
+        });
+    }
+    for (auto& writer : writers)
+        writer.join();
+
+    unsigned long long writes = (unsigned long long)writerCount * writesEach - failedWrites;
+    HOST_CHECK_EQUAL(uncovered.load(), 0);
+    HOST_CHECK_EQUAL(wrongStatus.load(), 0);
+    HOST_CHECK(!group.tickets.flushing);
+    HOST_CHECK_EQUAL(group.tickets.writesInFlight, 0);
+    HOST_CHECK_EQUAL(group.tickets.requested, writes);
+    HOST_CHECK_EQUAL(group.tickets.covered, writes);
+    HOST_CHECK(device.flushesSent <= writes);
+    // With writers piling up behind every flush most of them share one.
+    if (writerCount >= 8)
+        HOST_CHECK(device.flushesSent * 2 < writes);
+    printf("%u writers: %llu writes, %llu flushes\n", writerCount, writes, device.flushesSent.load());
+}
+
+int main() {
+    TestSequence();
+    RunWriters(1, 200, 0);
+    RunWriters(8, 300, 0);
+    RunWriters(16, 200, 7);
+    return HostTestResult("FlushTicketsTest");
+}
@@ -0,0 +1,27 @@
+#pragma once
+// Throughput measurement for the host benchmarks. Each run is repeated and the fastest one is reported, which is the
+// most stable figure on a shared machine.
+#include <stdio.h>
+#include <chrono>
+
+#define HOST_BENCH_RUNS 5
+
+template <typename Routine>
+static double HostBenchSeconds(Routine routine) {
+    double best = 0;
+    for (int run = 0; run < HOST_BENCH_RUNS; run++) {
+        auto start = std::chrono::steady_clock::now();
+        routine();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (run == 0 || seconds < best)
+            best = seconds;
+    }
+    return best;
+}
+
+static inline void HostBenchReport(const char* name, size_t bytes, double seconds) {
+    printf("%-40s %10.1f MB/s\n", name, bytes / seconds / 1e6);
+}
+
+// Keeps the optimizer from dropping a result nobody reads.
+static volatile unsigned long long g_hostBenchSink;
@@ -0,0 +1,74 @@
+#pragma once
+// Minimal checks for the host tests of the driver's portable modules. A failed check is reported and counted, and the
+// test keeps going so one run shows every failure.
+#include <stdio.h>
+#include <stdlib.h>
+#include "SimdCommon.hpp"
+
+static int g_hostTestFailures = 0;
+
+#define HOST_CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            g_hostTestFailures++; \
+        } \
+    } while (0)
+
+#define HOST_CHECK_EQUAL(actual, expected) \
+    do { \
+        unsigned long long actualValue = (unsigned long long)(actual); \
+        unsigned long long expectedValue = (unsigned long long)(expected); \
+        if (actualValue != expectedValue) { \
+            fprintf(stderr, "%s:%d: %s is %llu, expected %llu\n", __FILE__, __LINE__, #actual, actualValue, expectedValue); \
+            g_hostTestFailures++; \
+        } \
+    } while (0)
+
+static inline int HostTestResult(const char* name) {
+    if (g_hostTestFailures) {
+        fprintf(stderr, "%s: %d check(s) failed\n", name, g_hostTestFailures);
+        return EXIT_FAILURE;
+    }
+    printf("%s: passed\n", name);
+    return EXIT_SUCCESS;
+}
+
+// Deterministic generator so a failing run can be repeated exactly.
+typedef struct _HOST_RANDOM {
+    unsigned long long state;
+} HOST_RANDOM;
+
+static inline unsigned long long HostRandomNext(HOST_RANDOM* random) {
+    unsigned long long x = random->state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    random->state = x;
+    return x;
+}
+
+static inline unsigned int HostRandomBelow(HOST_RANDOM* random, unsigned int bound) {
+    return (unsigned int)(HostRandomNext(random) % bound);
+}
+
+static inline void HostRandomFill(HOST_RANDOM* random, unsigned char* data, size_t length) {
+    for (size_t i = 0; i < length; i++)
+        data[i] = (unsigned char)HostRandomNext(random);
+}
+
+// Feature masks the host CPU can run, widest last, always starting with the scalar paths.
+static inline unsigned int HostSimdFeatures() {
+    unsigned int features = 0;
+#if SIMD_X64 && (defined(__GNUC__) || defined(__clang__))
+    __builtin_cpu_init();
+    features |= SIMD_FEATURE_SSE2;
+    if (__builtin_cpu_supports("sse4.2"))
+        features |= SIMD_FEATURE_SSE42;
+    if (__builtin_cpu_supports("avx2"))
+        features |= SIMD_FEATURE_AVX2;
+    if (__builtin_cpu_supports("sha"))
+        features |= SIMD_FEATURE_SHA;
+#endif
+    return features;
+}
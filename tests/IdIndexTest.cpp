@@ -0,0 +1,202 @@
+// The identity index that addresses storage objects by GPT id: how ids of the shapes seen in practice spread over the
+// buckets, lookups keyed by id and kind, and readers walking the chains without a lock while a writer publishes.
+#include "IdIndex.hpp"
+#include "HostTest.hpp"
+#include <atomic>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#define KIND_PARTITION  0
+#define KIND_DISK       1
+
+typedef struct _ID {
+    unsigned char bytes[ID_INDEX_ID_BYTES];
+} ID;
+
+// Version 1 style ids, where only the timestamp in Data1 moves between ids generated one after another.
+static ID SequentialId(unsigned int sequence) {
+    ID id;
+    memset(id.bytes, 0x5A, sizeof(id.bytes));
+    memcpy(id.bytes, &sequence, sizeof(sequence));
+    return id;
+}
+
+static ID LastBytesId(unsigned int sequence) {
+    ID id;
+    memset(id.bytes, 0xC3, sizeof(id.bytes));
+    id.bytes[14] = (unsigned char)(sequence >> 8);
+    id.bytes[15] = (unsigned char)sequence;
+    return id;
+}
+
+static ID RandomId(HOST_RANDOM* random) {
+    ID id;
+    HostRandomFill(random, id.bytes, sizeof(id.bytes));
+    return id;
+}
+
+static void TestNullIds() {
+    ID id;
+    memset(id.bytes, 0, sizeof(id.bytes));
+    HOST_CHECK(IdIndexIsNull(id.bytes));
+    for (int i = 0; i < ID_INDEX_ID_BYTES; i++) {
+        id.bytes[i] = 1;
+        HOST_CHECK(!IdIndexIsNull(id.bytes));
+        id.bytes[i] = 0;
+    }
+}
+
+// Indexes ids and checks that the longest chain stays within a few times the mean, and that at least half the buckets
+// that could be used are; random ids already leave about a third of them empty when there are as many as buckets.
+template <typename MakeId>
+static void CheckSpread(const char* shape, unsigned int idCount, MakeId makeId) {
+    std::vector<unsigned int> chains(ID_INDEX_BUCKETS, 0);
+    for (unsigned int i = 0; i < idCount; i++) {
+        ID id = makeId(i);
+        unsigned int bucket = IdIndexBucket(id.bytes);
+        HOST_CHECK(bucket < ID_INDEX_BUCKETS);
+        chains[bucket]++;
+    }
+
+    unsigned int longest = 0, used = 0;
+    for (unsigned int chain : chains) {
+        if (chain > longest)
+            longest = chain;
+        used += chain != 0;
+    }
+    unsigned int mean = (idCount + ID_INDEX_BUCKETS - 1) / ID_INDEX_BUCKETS;
+    unsigned int usable = idCount < ID_INDEX_BUCKETS ? idCount : ID_INDEX_BUCKETS;
+    if (longest > mean * 4 + 4 || used < usable / 2)
+        fprintf(stderr, "%s ids: longest chain %u, %u buckets used\n", shape, longest, used);
+    HOST_CHECK(longest <= mean * 4 + 4);
+    HOST_CHECK(used >= usable / 2);
+}
+
+static void TestSpread() {
+    HOST_RANDOM random = { 0x1D1D3C5E77A1ull };
+    for (unsigned int idCount : { 64u, 256u, 4096u }) {
+        CheckSpread("sequential", idCount, [](unsigned int i) { return SequentialId(i); });
+        CheckSpread("last-byte", idCount, [](unsigned int i) { return LastBytesId(i); });
+        CheckSpread("random", idCount, [&](unsigned int) { return RandomId(&random); });
+    }
+}
+
+// The index as the driver keeps it: bucket heads, nodes pushed in front and never removed.
+struct INDEX {
+    PID_INDEX_NODE heads[ID_INDEX_BUCKETS];
+    INDEX() { memset(heads, 0, sizeof(heads)); }
+
+    void Add(PID_INDEX_NODE node, const ID& id, unsigned int kind) {
+        unsigned int bucket = IdIndexBucket(id.bytes);
+        IdIndexPrepare(node, id.bytes, kind, heads[bucket]);
+        heads[bucket] = node;
+    }
+
+    PID_INDEX_NODE Find(const ID& id, unsigned int kind) const {
+        return IdIndexMatch(heads[IdIndexBucket(id.bytes)], id.bytes, kind);
+    }
+};
+
+static void TestLookups() {
+    HOST_RANDOM random = { 0x9A3B00F1CE55ull };
+    const unsigned int count = 2000;
+    std::vector<ID> ids(count);
+    std::vector<ID_INDEX_NODE> nodes(count);
+    INDEX index;
+    for (unsigned int i = 0; i < count; i++) {
+        ids[i] = i % 2 ? SequentialId(i) : RandomId(&random);
+        index.Add(&nodes[i], ids[i], i % 3 ? KIND_PARTITION : KIND_DISK);
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+        unsigned int kind = i % 3 ? KIND_PARTITION : KIND_DISK;
+        HOST_CHECK(index.Find(ids[i], kind) == &nodes[i]);
+        HOST_CHECK(!index.Find(ids[i], kind ^ 1));
+        HOST_CHECK(!memcmp(nodes[i].id, ids[i].bytes, ID_INDEX_ID_BYTES));
+    }
+
+    // An id that differs in any one byte is not found.
+    for (unsigned int i = 0; i < count; i += 37) {
+        ID other = ids[i];
+        other.bytes[i % ID_INDEX_ID_BYTES] ^= 0x80;
+        HOST_CHECK(!index.Find(other, i % 3 ? KIND_PARTITION : KIND_DISK));
+    }
+    HOST_CHECK(!IdIndexMatch(0, ids[0].bytes, KIND_DISK));
+}
+
+// A raw disk and its partition may carry the same id, and cloned disks carry the same one twice; matching again from
+// the next node finds every holder, newest first, which is how the driver tells a collision apart.
+static void TestDuplicates() {
+    ID id = SequentialId(42);
+    ID_INDEX_NODE disk, partition, clone;
+    INDEX index;
+    index.Add(&disk, id, KIND_DISK);
+    index.Add(&partition, id, KIND_PARTITION);
+    index.Add(&clone, id, KIND_DISK);
+
+    PID_INDEX_NODE found = index.Find(id, KIND_DISK);
+    HOST_CHECK(found == &clone);
+    found = IdIndexMatch(found->next, id.bytes, KIND_DISK);
+    HOST_CHECK(found == &disk);
+    HOST_CHECK(!IdIndexMatch(found->next, id.bytes, KIND_DISK));
+
+    found = index.Find(id, KIND_PARTITION);
+    HOST_CHECK(found == &partition);
+    HOST_CHECK(!IdIndexMatch(found->next, id.bytes, KIND_PARTITION));
+}
+
+// One writer publishes nodes with release stores, the way IndexStorageObject does with InterlockedExchangePointer,
+// while readers load the heads with acquire and walk the chains. A reader has to find every node published before it
+// looked, with the id and kind filled in.
+static void TestConcurrentReaders() {
+    const unsigned int count = 20000;
+    const unsigned int readerCount = 4;
+    std::vector<ID> ids(count);
+    std::vector<ID_INDEX_NODE> nodes(count);
+    for (unsigned int i = 0; i < count; i++)
+        ids[i] = SequentialId(i * 7919);
+
+    std::atomic<PID_INDEX_NODE> heads[ID_INDEX_BUCKETS];
+    for (auto& head : heads)
+        head.store(0, std::memory_order_relaxed);
+    std::atomic<unsigned int> published{ 0 };
+    std::atomic<unsigned int> misses{ 0 };
+
+    std::vector<std::thread> readers;
+    for (unsigned int r = 0; r < readerCount; r++) {
+        readers.emplace_back([&, r]() {
+            HOST_RANDOM random = { 0x51DEull + r };
+            unsigned int seen;
+            do {
+                seen = published.load(std::memory_order_acquire);
+                if (!seen)
+                    continue;
+                unsigned int i = HostRandomBelow(&random, seen);
+                unsigned int kind = i % 2 ? KIND_PARTITION : KIND_DISK;
+                PID_INDEX_NODE head = heads[IdIndexBucket(ids[i].bytes)].load(std::memory_order_acquire);
+                if (IdIndexMatch(head, ids[i].bytes, kind) != &nodes[i])
+                    misses++;
+            } while (seen < count);
+        });
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+        unsigned int bucket = IdIndexBucket(ids[i].bytes);
+        IdIndexPrepare(&nodes[i], ids[i].bytes, i % 2 ? KIND_PARTITION : KIND_DISK, heads[bucket].load(std::memory_order_relaxed));
+        heads[bucket].store(&nodes[i], std::memory_order_release);
+        published.store(i + 1, std::memory_order_release);
+    }
+    for (auto& reader : readers)
+        reader.join();
+    HOST_CHECK_EQUAL(misses.load(), 0);
+}
+
+int main() {
+    TestNullIds();
+    TestSpread();
+    TestLookups();
+    TestDuplicates();
+    TestConcurrentReaders();
+    return HostTestResult("IdIndexTest");
+}
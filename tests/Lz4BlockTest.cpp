@@ -0,0 +1,180 @@
+// LZ4 block round trips over disk-like data, blocks produced by the reference liblz4, and malformed input.
+#include "Lz4Block.hpp"
+#include "HostTest.hpp"
+#include <string.h>
+#include <vector>
+
+// "SectorIO SectorIO SectorIO sector image chunk, sector image chunk. " three times, compressed by
+// LZ4_compress_default from liblz4 1.9.4.
+static const unsigned char g_referenceBlock[] = {
+    0x9E, 0x53, 0x65, 0x63, 0x74, 0x6F, 0x72, 0x49, 0x4F, 0x20, 0x09, 0x00, 0x11, 0x73, 0x1B, 0x00, 0xDF, 0x20,
+    0x69, 0x6D, 0x61, 0x67, 0x65, 0x20, 0x63, 0x68, 0x75, 0x6E, 0x6B, 0x2C, 0x14, 0x00, 0x00, 0x1F, 0x2E, 0x3A,
+    0x00, 0x00, 0x05, 0x4C, 0x00, 0x0E, 0x2F, 0x00, 0x0F, 0x43, 0x00, 0x41, 0x50, 0x75, 0x6E, 0x6B, 0x2E, 0x20,
+};
+
+// Walks a block the way a strict decoder does and checks the end-of-block rules: the last sequence is literals only,
+// at least 5 of them once the block is long enough to hold a match, and no match starts within 12 bytes of the end.
+static bool IsConformingBlock(const unsigned char* block, size_t length, size_t decodedLength) {
+    const unsigned char* ip = block;
+    const unsigned char* end = block + length;
+    size_t out = 0;
+    while (ip < end) {
+        unsigned int token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15) {
+            unsigned char extra;
+            do {
+                if (ip >= end)
+                    return false;
+                extra = *ip++;
+                literals += extra;
+            } while (extra == 255);
+        }
+        if (literals > (size_t)(end - ip))
+            return false;
+        ip += literals;
+        out += literals;
+        if (ip == end)
+            return out == decodedLength && (decodedLength < 13 || literals >= 5);
+        if (end - ip < 2)
+            return false;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > out || out + 12 > decodedLength)
+            return false;
+        size_t match = (token & 15) + 4;
+        if ((token & 15) == 15) {
+            unsigned char extra;
+            do {
+                if (ip >= end)
+                    return false;
+                extra = *ip++;
+                match += extra;
+            } while (extra == 255);
+        }
+        out += match;
+        if (out + 5 > decodedLength)
+            return false;
+    }
+    return false;
+}
+
+static void FillDiskLike(HOST_RANDOM* random, unsigned char* data, size_t length, int kind) {
+    static const char text[] = "The quick brown fox jumps over the lazy dog. ";
+    for (size_t i = 0; i < length; i++) {
+        switch (kind) {
+        case 0: data[i] = (unsigned char)HostRandomNext(random); break;
+        case 1: data[i] = 0; break;
+        case 2: data[i] = (unsigned char)text[i % (sizeof(text) - 1)]; break;
+        case 3: data[i] = (unsigned char)HostRandomBelow(random, 3); break;
+        default:
+            // Short copies from just behind, like structured metadata.
+            data[i] = i > 8 && HostRandomBelow(random, 4) ? data[i - 1 - HostRandomBelow(random, 8)] : (unsigned char)HostRandomNext(random);
+            break;
+        }
+    }
+}
+
+static void TestRoundTrip() {
+    HOST_RANDOM random = { 0x124Bull };
+    static const size_t sizes[] = { 0, 1, 4, 5, 12, 13, 14, 15, 16, 19, 20, 255, 256, 270, 4096, 65535, 65536, 65537, 200000, 1 << 20 };
+    for (size_t length : sizes) {
+        for (int kind = 0; kind < 5; kind++) {
+            std::vector<unsigned char> source(length), compressed(Lz4CompressBound(length)), decoded(length + 1);
+            FillDiskLike(&random, source.data(), length, kind);
+            size_t compressedLength = Lz4Compress(source.data(), length, compressed.data(), compressed.size());
+            HOST_CHECK(compressedLength != 0);
+            HOST_CHECK(IsConformingBlock(compressed.data(), compressedLength, length));
+            HOST_CHECK_EQUAL(Lz4Decompress(compressed.data(), compressedLength, decoded.data(), decoded.size()), length);
+            HOST_CHECK(length == 0 || memcmp(decoded.data(), source.data(), length) == 0);
+            if (kind == 1)
+                HOST_CHECK(compressedLength < length / 250 + 16);
+
+            // One byte less than needed never fits, and never writes past it.
+            if (compressedLength > 1) {
+                std::vector<unsigned char> tight(compressedLength);
+                tight.back() = 0xA5;
+                HOST_CHECK_EQUAL(Lz4Compress(source.data(), length, tight.data(), compressedLength - 1), 0);
+                HOST_CHECK_EQUAL(tight.back(), 0xA5);
+            }
+            if (length) {
+                decoded.assign(length + 1, 0x5A);
+                HOST_CHECK_EQUAL(Lz4Decompress(compressed.data(), compressedLength, decoded.data(), length - 1), -1);
+                HOST_CHECK_EQUAL(decoded[length - 1], 0x5A);
+            }
+        }
+    }
+
+    // Random lengths with mixed content inside one block.
+    for (int run = 0; run < 2000; run++) {
+        size_t length = HostRandomBelow(&random, run < 1000 ? 300 : 70000);
+        std::vector<unsigned char> source(length), compressed(Lz4CompressBound(length)), decoded(length);
+        for (size_t offset = 0; offset < length; offset += 512)
+            FillDiskLike(&random, &source[offset], length - offset < 512 ? length - offset : 512, HostRandomBelow(&random, 5));
+        size_t compressedLength = Lz4Compress(source.data(), length, compressed.data(), compressed.size());
+        HOST_CHECK(IsConformingBlock(compressed.data(), compressedLength, length));
+        HOST_CHECK_EQUAL(Lz4Decompress(compressed.data(), compressedLength, decoded.data(), length), length);
+        HOST_CHECK(length == 0 || memcmp(decoded.data(), source.data(), length) == 0);
+    }
+}
+
+static void TestReferenceBlocks() {
+    const char* text = "SectorIO SectorIO SectorIO sector image chunk, sector image chunk. ";
+    std::vector<unsigned char> expected;
+    for (int i = 0; i < 3; i++)
+        expected.insert(expected.end(), text, text + strlen(text));
+    std::vector<unsigned char> decoded(expected.size());
+    HOST_CHECK_EQUAL(Lz4Decompress(g_referenceBlock, sizeof(g_referenceBlock), decoded.data(), decoded.size()), expected.size());
+    HOST_CHECK(memcmp(decoded.data(), expected.data(), expected.size()) == 0);
+
+    // A match overlapping its own output (offset 1) with an extended length, then the closing literals.
+    static const unsigned char run[] = { 0x1F, 'a', 0x01, 0x00, 0x05, 0x50, 'b', 'c', 'd', 'e', 'f' };
+    unsigned char out[32];
+    HOST_CHECK_EQUAL(Lz4Decompress(run, sizeof(run), out, sizeof(out)), 30);
+    HOST_CHECK(memcmp(out, "aaaaaaaaaaaaaaaaaaaaaaaaabcdef", 30) == 0);
+
+    // Literal run with a length extension.
+    unsigned char literals[1 + 1 + 20];
+    literals[0] = 0xF0;
+    literals[1] = 5;
+    memset(literals + 2, 'x', 20);
+    HOST_CHECK_EQUAL(Lz4Decompress(literals, sizeof(literals), out, sizeof(out)), 20);
+}
+
+static void TestMalformed() {
+    unsigned char out[64];
+    static const unsigned char zeroOffset[] = { 0x14, 'a', 0x00, 0x00, 0x50, 'b', 'c', 'd', 'e', 'f' };
+    HOST_CHECK_EQUAL(Lz4Decompress(zeroOffset, sizeof(zeroOffset), out, sizeof(out)), -1);
+    static const unsigned char behindStart[] = { 0x14, 'a', 0x02, 0x00, 0x50, 'b', 'c', 'd', 'e', 'f' };
+    HOST_CHECK_EQUAL(Lz4Decompress(behindStart, sizeof(behindStart), out, sizeof(out)), -1);
+    static const unsigned char shortLiterals[] = { 0x50, 'a', 'b' };
+    HOST_CHECK_EQUAL(Lz4Decompress(shortLiterals, sizeof(shortLiterals), out, sizeof(out)), -1);
+    static const unsigned char cutOffset[] = { 0x14, 'a', 0x01 };
+    HOST_CHECK_EQUAL(Lz4Decompress(cutOffset, sizeof(cutOffset), out, sizeof(out)), -1);
+    static const unsigned char cutExtension[] = { 0xF0, 255, 255 };
+    HOST_CHECK_EQUAL(Lz4Decompress(cutExtension, sizeof(cutExtension), out, sizeof(out)), -1);
+
+    // Every truncation and every single bit flip of a real block either decodes to something within capacity or is
+    // rejected; with the sanitizers on, any overrun fails the test.
+    HOST_RANDOM random = { 0xBADull };
+    std::vector<unsigned char> source(8192), compressed(Lz4CompressBound(source.size())), decoded(source.size());
+    FillDiskLike(&random, source.data(), source.size(), 4);
+    size_t compressedLength = Lz4Compress(source.data(), source.size(), compressed.data(), compressed.size());
+    for (size_t cut = 0; cut < compressedLength; cut++) {
+        long long result = Lz4Decompress(compressed.data(), cut, decoded.data(), decoded.size());
+        HOST_CHECK(result == -1 || (result >= 0 && result <= (long long)decoded.size()));
+    }
+    for (int flip = 0; flip < 20000; flip++) {
+        std::vector<unsigned char> damaged(compressed.begin(), compressed.begin() + compressedLength);
+        damaged[HostRandomBelow(&random, (unsigned int)compressedLength)] ^= (unsigned char)(1 << HostRandomBelow(&random, 8));
+        long long result = Lz4Decompress(damaged.data(), damaged.size(), decoded.data(), decoded.size());
+        HOST_CHECK(result == -1 || (result >= 0 && result <= (long long)decoded.size()));
+    }
+}
+
+int main() {
+    TestRoundTrip();
+    TestReferenceBlocks();
+    TestMalformed();
+    return HostTestResult("Lz4BlockTest");
+}
@@ -0,0 +1,152 @@
+#pragma once
+// In-memory disk images with MBR, EBR chain and GPT layouts for the partition table tests, fuzzer and benchmark.
+#include "PartitionTable.hpp"
+#include "Digest.hpp"
+#include <string.h>
+#include <vector>
+
+typedef struct _PT_IMAGE {
+    std::vector<unsigned char> bytes;
+    unsigned int sectorSize;
+    unsigned long long totalSectors;
+    long long failingLba;               // reads touching this sector fail; -1 for none
+} PT_IMAGE;
+
+static inline PT_IMAGE PtImageCreate(unsigned int sectorSize, unsigned long long totalSectors) {
+    PT_IMAGE image;
+    image.bytes.assign((size_t)(sectorSize * totalSectors), 0);
+    image.sectorSize = sectorSize;
+    image.totalSectors = totalSectors;
+    image.failingLba = -1;
+    return image;
+}
+
+static inline unsigned char* PtImageSector(PT_IMAGE* image, unsigned long long lba) {
+    return &image->bytes[(size_t)(lba * image->sectorSize)];
+}
+
+static int PtImageRead(void* context, unsigned long long lba, unsigned int count, void* buffer) {
+    PT_IMAGE* image = (PT_IMAGE*)context;
+    if (lba >= image->totalSectors || count > image->totalSectors - lba)
+        return 1;
+    if (image->failingLba >= 0 && (unsigned long long)image->failingLba >= lba && (unsigned long long)image->failingLba < lba + count)
+        return 1;
+    memcpy(buffer, &image->bytes[(size_t)(lba * image->sectorSize)], (size_t)count * image->sectorSize);
+    return 0;
+}
+
+static inline void PtStoreLe32(unsigned char* p, unsigned int value) {
+    for (int i = 0; i < 4; i++)
+        p[i] = (unsigned char)(value >> (8 * i));
+}
+
+static inline void PtStoreLe64(unsigned char* p, unsigned long long value) {
+    for (int i = 0; i < 8; i++)
+        p[i] = (unsigned char)(value >> (8 * i));
+}
+
+static inline void PtSetBootSignature(unsigned char* sector) {
+    sector[510] = 0x55;
+    sector[511] = 0xAA;
+}
+
+static inline void PtSetMbrEntry(unsigned char* sector, int slot, unsigned char type, unsigned int firstLba, unsigned int sectorCount, bool active = false) {
+    unsigned char* p = sector + 446 + 16 * slot;
+    p[0] = active ? 0x80 : 0;
+    p[4] = type;
+    PtStoreLe32(p + 8, firstLba);
+    PtStoreLe32(p + 12, sectorCount);
+}
+
+// An MBR with an active NTFS partition and an extended partition holding logicalCount logical partitions, one EBR
+// every 4000 sectors from sector 4000 on.
+static inline PT_IMAGE PtMakeMbrImage(unsigned long long totalSectors, int logicalCount) {
+    PT_IMAGE image = PtImageCreate(512, totalSectors);
+    unsigned char* mbr = PtImageSector(&image, 0);
+    PtSetBootSignature(mbr);
+    PtStoreLe32(mbr + 440, 0xDEADBEEF);
+    PtSetMbrEntry(mbr, 0, 0x07, 2048, 1000, true);
+    PtSetMbrEntry(mbr, 1, 0x0F, 4000, 4000 * logicalCount);
+    for (int i = 0; i < logicalCount; i++) {
+        unsigned char* ebr = PtImageSector(&image, 4000 + 4000ull * i);
+        PtSetBootSignature(ebr);
+        PtSetMbrEntry(ebr, 0, 0x83, 63, 1000 + i);
+        if (i + 1 < logicalCount)
+            PtSetMbrEntry(ebr, 1, 0x05, 4000 * (i + 1), 4000);
+    }
+    return image;
+}
+
+static inline void PtSealGptHeader(unsigned char* header) {
+    PtStoreLe32(header + 16, 0);
+    PtStoreLe32(header + 16, Crc32Update(0, header, 92));
+}
+
+// Entry i covers 1000 sectors from 2048 + 1000 * i and is named "P<i>".
+static inline void PtWriteGpt(PT_IMAGE* image, unsigned long long headerLba, unsigned long long alternateLba, unsigned long long arrayLba,
+    unsigned int entryCount, unsigned int partitions) {
+    unsigned char* array = PtImageSector(image, arrayLba);
+    memset(array, 0, (size_t)entryCount * 128);
+    for (unsigned int i = 0; i < partitions; i++) {
+        unsigned char* entry = array + 128 * i;
+        for (int k = 0; k < 16; k++) {
+            entry[k] = (unsigned char)(0xA0 + k);
+            entry[16 + k] = (unsigned char)(i * 16 + k);
+        }
+        PtStoreLe64(entry + 32, 2048 + 1000ull * i);
+        PtStoreLe64(entry + 40, 2048 + 1000ull * i + 999);
+        PtStoreLe64(entry + 48, 1ull << 63);
+        entry[56] = 'P';
+        entry[58] = (unsigned char)('0' + i % 10);
+    }
+
+    unsigned char* header = PtImageSector(image, headerLba);
+    memset(header, 0, image->sectorSize);
+    memcpy(header, "EFI PART", 8);
+    PtStoreLe32(header + 8, 0x10000);
+    PtStoreLe32(header + 12, 92);
+    PtStoreLe64(header + 24, headerLba);
+    PtStoreLe64(header + 32, alternateLba);
+    PtStoreLe64(header + 40, 34);
+    PtStoreLe64(header + 48, image->totalSectors - 34);
+    for (int k = 0; k < 16; k++)
+        header[56 + k] = (unsigned char)(0x11 * k);
+    PtStoreLe64(header + 72, arrayLba);
+    PtStoreLe32(header + 80, entryCount);
+    PtStoreLe32(header + 84, 128);
+    PtStoreLe32(header + 88, Crc32Update(0, array, (size_t)entryCount * 128));
+    PtSealGptHeader(header);
+}
+
+static inline unsigned long long PtGptArraySectors(const PT_IMAGE* image, unsigned int entryCount) {
+    return ((unsigned long long)entryCount * 128 + image->sectorSize - 1) / image->sectorSize;
+}
+
+// A protective MBR with primary and backup GPT, both with entryCount slots of which the first partitions are used.
+static inline PT_IMAGE PtMakeGptImage(unsigned int sectorSize, unsigned long long totalSectors, unsigned int partitions, unsigned int entryCount = 128) {
+    PT_IMAGE image = PtImageCreate(sectorSize, totalSectors);
+    unsigned char* mbr = PtImageSector(&image, 0);
+    PtSetBootSignature(mbr);
+    PtSetMbrEntry(mbr, 0, 0xEE, 1, (unsigned int)(totalSectors - 1));
+    unsigned long long arraySectors = PtGptArraySectors(&image, entryCount);
+    PtWriteGpt(&image, 1, totalSectors - 1, 2, entryCount, partitions);
+    PtWriteGpt(&image, totalSectors - 1, 1, totalSectors - 1 - arraySectors, entryCount, partitions);
+    return image;
+}
+
+// Rewrites entry index of the GPT whose header is at headerLba and reseals its array and header CRCs.
+static inline void PtSetGptEntryRange(PT_IMAGE* image, unsigned long long headerLba, unsigned int index, unsigned long long firstLba, unsigned long long lastLba) {
+    unsigned char* header = PtImageSector(image, headerLba);
+    unsigned long long arrayLba = 0;
+    for (int i = 7; i >= 0; i--)
+        arrayLba = (arrayLba << 8) | header[72 + i];
+    unsigned int entryCount = header[80] | (header[81] << 8) | (header[82] << 16) | ((unsigned int)header[83] << 24);
+    unsigned char* array = PtImageSector(image, arrayLba);
+    unsigned char* entry = array + 128 * index;
+    if (entry[0] == 0)
+        entry[0] = 0xA0;
+    PtStoreLe64(entry + 32, firstLba);
+    PtStoreLe64(entry + 40, lastLba);
+    PtStoreLe32(header + 88, Crc32Update(0, array, (size_t)entryCount * 128));
+    PtSealGptHeader(header);
+}
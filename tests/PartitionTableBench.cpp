@@ -0,0 +1,30 @@
+// Decode time of typical partition layouts, reading from memory so only the decoder is measured.
+#include "PartitionImage.hpp"
+#include "HostBench.hpp"
+
+static void Bench(const char* name, PT_IMAGE* image) {
+    static std::vector<unsigned char> scratch(PT_SCRATCH_BYTES(4096));
+    static PT_ENTRY entries[PT_MAX_ENTRIES];
+    const int iterations = 2000;
+    PT_MAP map;
+    double seconds = HostBenchSeconds([&] {
+        for (int i = 0; i < iterations; i++) {
+            PartitionTableDecode(PtImageRead, image, image->sectorSize, image->totalSectors, scratch.data(), scratch.size(), &map, entries);
+            g_hostBenchSink += map.entryCount;
+        }
+    });
+    printf("%-40s %8.1f us per decode, %u entries\n", name, seconds / iterations * 1e6, map.entryCount);
+}
+
+int main() {
+    PT_IMAGE gpt = PtMakeGptImage(512, 1 << 16, 128);
+    Bench("GPT, 128 entries, primary and backup", &gpt);
+    PT_IMAGE gpt4k = PtMakeGptImage(4096, 1 << 14, 8);
+    Bench("GPT, 4K sectors, 8 entries", &gpt4k);
+    PT_IMAGE damaged = PtMakeGptImage(512, 1 << 16, 128);
+    PtImageSector(&damaged, 1)[40] ^= 1;
+    Bench("GPT, primary damaged", &damaged);
+    PT_IMAGE mbr = PtMakeMbrImage(1 << 20, 64);
+    Bench("MBR, 64 logical partitions", &mbr);
+    return 0;
+}
@@ -0,0 +1,190 @@
+// Fuzz target for the partition table decoder. The input is a disk image: the first byte picks the sector size and
+// the rest are the sectors. Every read the decoder issues has to stay on the disk and inside the scratch buffer, and
+// the map it returns has to be self-consistent.
+//
+// Built with -DSECTORIO_LIBFUZZER=ON under Clang this is a libFuzzer target. Otherwise it has its own driver that
+// mutates MBR, EBR and GPT seed images, resealing GPT CRCs half of the time so the checks past them get exercised.
+#include "PartitionImage.hpp"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct _FUZZ_CONTEXT {
+    PT_IMAGE* image;
+    const unsigned char* scratch;
+    size_t scratchLength;
+} FUZZ_CONTEXT;
+
+#define FUZZ_REQUIRE(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #condition); \
+            abort(); \
+        } \
+    } while (0)
+
+static int FuzzRead(void* context, unsigned long long lba, unsigned int count, void* buffer) {
+    FUZZ_CONTEXT* pContext = (FUZZ_CONTEXT*)context;
+    PT_IMAGE* image = pContext->image;
+    FUZZ_REQUIRE(count != 0);
+    FUZZ_REQUIRE(lba < image->totalSectors && count <= image->totalSectors - lba);
+    FUZZ_REQUIRE((const unsigned char*)buffer >= pContext->scratch &&
+        (size_t)count * image->sectorSize <= pContext->scratchLength - (size_t)((const unsigned char*)buffer - pContext->scratch));
+    return PtImageRead(image, lba, count, buffer);
+}
+
+static void DecodeAndCheck(PT_IMAGE* image) {
+    static std::vector<unsigned char> scratch(PT_SCRATCH_BYTES(4096));
+    static PT_ENTRY entries[PT_MAX_ENTRIES];
+    PT_MAP map;
+    FUZZ_CONTEXT context = { image, scratch.data(), PT_SCRATCH_BYTES(image->sectorSize) };
+    FUZZ_REQUIRE(PartitionTableDecode(FuzzRead, &context, image->sectorSize, image->totalSectors, scratch.data(), context.scratchLength, &map, entries) == 0);
+
+    FUZZ_REQUIRE(map.entryCount <= PT_MAX_ENTRIES);
+    FUZZ_REQUIRE(!(map.flags & ~0x3FFu));
+    if (map.flags & PT_GPT_PRIMARY_ENTRIES_VALID)
+        FUZZ_REQUIRE(map.flags & PT_GPT_PRIMARY_HEADER_VALID);
+    if (map.flags & PT_GPT_BACKUP_ENTRIES_VALID)
+        FUZZ_REQUIRE(map.flags & PT_GPT_BACKUP_HEADER_VALID);
+    if (map.flags & PT_GPT_BACKUP_MISMATCH)
+        FUZZ_REQUIRE((map.flags & PT_GPT_PRIMARY_HEADER_VALID) && (map.flags & PT_GPT_BACKUP_HEADER_VALID));
+
+    const PT_GPT_HEADER_INFO* headers[2] = { &map.gptPrimary, &map.gptBackup };
+    for (const PT_GPT_HEADER_INFO* header : headers) {
+        if (!header->myLba)
+            continue;
+        FUZZ_REQUIRE(header->myLba < map.totalSectors && header->lastUsableLba < map.totalSectors);
+        FUZZ_REQUIRE((unsigned long long)header->entryCount * header->entrySize <= PT_MAX_ENTRY_ARRAY_BYTES);
+    }
+
+    if (map.style == PT_STYLE_GPT)
+        FUZZ_REQUIRE(map.flags & (PT_GPT_PRIMARY_ENTRIES_VALID | PT_GPT_BACKUP_ENTRIES_VALID));
+    if (map.style == PT_STYLE_MBR)
+        FUZZ_REQUIRE(map.flags & PT_MBR_VALID);
+    if (map.style == PT_STYLE_NONE)
+        FUZZ_REQUIRE(map.entryCount == 0);
+    for (unsigned int i = 0; i < map.entryCount; i++) {
+        const PT_ENTRY& entry = entries[i];
+        if (map.style == PT_STYLE_GPT) {
+            FUZZ_REQUIRE(entry.source == PT_SOURCE_GPT);
+            continue;
+        }
+        FUZZ_REQUIRE(entry.source == PT_SOURCE_MBR_PRIMARY || entry.source == PT_SOURCE_MBR_LOGICAL);
+        FUZZ_REQUIRE(entry.lastLba + 1 > entry.firstLba);
+        if (entry.source == PT_SOURCE_MBR_PRIMARY) {
+            FUZZ_REQUIRE(entry.index < 4);
+        }
+        else {
+            FUZZ_REQUIRE(entry.index >= 4 && entry.index < 4 + PT_MAX_LOGICAL_PARTITIONS);
+            FUZZ_REQUIRE(entry.ebrLba < map.totalSectors && entry.firstLba >= entry.ebrLba);
+            if (i && entries[i - 1].source == PT_SOURCE_MBR_LOGICAL)
+                FUZZ_REQUIRE(entry.ebrLba > entries[i - 1].ebrLba);
+        }
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    if (size < 1)
+        return 0;
+    static const unsigned int sectorSizes[4] = { 512, 1024, 2048, 4096 };
+    unsigned int sectorSize = sectorSizes[data[0] & 3];
+    unsigned long long totalSectors = (size - 1) / sectorSize;
+    if (!totalSectors)
+        return 0;
+    PT_IMAGE image = PtImageCreate(sectorSize, totalSectors);
+    memcpy(image.bytes.data(), data + 1, image.bytes.size());
+    DecodeAndCheck(&image);
+    return 0;
+}
+
+#ifndef SECTORIO_LIBFUZZER
+#include "HostTest.hpp"
+
+// The metadata sectors of a seed image, where mutations do the most.
+static std::vector<unsigned long long> HotSectors(const PT_IMAGE& image) {
+    std::vector<unsigned long long> sectors = { 0, 1, 2, image.totalSectors - 1, image.totalSectors - 2 };
+    for (unsigned long long lba = 4000; image.sectorSize == 512 && lba < image.totalSectors; lba += 4000)
+        sectors.push_back(lba);
+    return sectors;
+}
+
+static void ResealGptHeader(PT_IMAGE* image, unsigned long long lba) {
+    unsigned char* header = PtImageSector(image, lba);
+    unsigned int headerSize = header[12] | (header[13] << 8);
+    if (headerSize < 92 || headerSize > image->sectorSize)
+        return;
+    PtStoreLe32(header + 16, 0);
+    PtStoreLe32(header + 16, Crc32Update(0, header, headerSize));
+}
+
+int main(int argc, char** argv) {
+    long runs = argc > 1 ? atol(argv[1]) : 20000;
+    PT_IMAGE seeds[] = {
+        PtMakeGptImage(512, 4096, 7),
+        PtMakeGptImage(4096, 1024, 4),
+        PtMakeGptImage(512, 2048, 20, 32),
+        PtMakeMbrImage(16384, 3),
+        PtMakeMbrImage(40000, 9),
+    };
+    const size_t seedCount = sizeof(seeds) / sizeof(seeds[0]);
+
+    HOST_RANDOM random = { 0xF022ull };
+    std::vector<unsigned char> saved;
+    for (long run = 0; run < runs; run++) {
+        // Mutations only touch the metadata sectors, so those are saved and put back instead of copying the image.
+        PT_IMAGE& image = seeds[run % seedCount];
+        std::vector<unsigned long long> hot = HotSectors(image);
+        saved.resize(hot.size() * image.sectorSize);
+        for (size_t i = 0; i < hot.size(); i++)
+            memcpy(&saved[i * image.sectorSize], PtImageSector(&image, hot[i]), image.sectorSize);
+        unsigned int mutations = 1 + HostRandomBelow(&random, 16);
+        for (unsigned int i = 0; i < mutations; i++) {
+            unsigned long long lba = hot[HostRandomBelow(&random, (unsigned int)hot.size())];
+            size_t offset = (size_t)(lba * image.sectorSize) + HostRandomBelow(&random, image.sectorSize);
+            switch (HostRandomBelow(&random, 4)) {
+            case 0:
+                image.bytes[offset] ^= (unsigned char)(1 << HostRandomBelow(&random, 8));
+                break;
+            case 1:
+                image.bytes[offset] = (unsigned char)HostRandomNext(&random);
+                break;
+            default: {
+                // Interesting values in the 32 and 64-bit fields.
+                static const unsigned long long values[] = { 0, 1, 2, 33, 34, 0x7F, 0x80, 0xFF, 0xFFFF, 0xFFFFFFFF, ~0ull, 4095, 4096 };
+                size_t width = HostRandomBelow(&random, 2) ? 8 : 4;
+                offset -= offset % width;
+                if (offset + width <= image.bytes.size()) {
+                    unsigned long long value = values[HostRandomBelow(&random, sizeof(values) / sizeof(values[0]))];
+                    for (size_t b = 0; b < width; b++)
+                        image.bytes[offset + b] = (unsigned char)(value >> (8 * b));
+                }
+                break;
+            }
+            }
+        }
+        if (HostRandomBelow(&random, 2)) {
+            ResealGptHeader(&image, 1);
+            ResealGptHeader(&image, image.totalSectors - 1);
+        }
+        if (HostRandomBelow(&random, 16) == 0)
+            image.failingLba = (long long)hot[HostRandomBelow(&random, (unsigned int)hot.size())];
+
+        // The byte interface libFuzzer uses, every so often on the smaller images, to keep it honest.
+        if (run % 64 == 0 && image.failingLba < 0 && image.bytes.size() <= 4 * 1024 * 1024) {
+            std::vector<unsigned char> input(1 + image.bytes.size());
+            input[0] = image.sectorSize == 512 ? 0 : 3;
+            memcpy(input.data() + 1, image.bytes.data(), image.bytes.size());
+            LLVMFuzzerTestOneInput(input.data(), input.size());
+        }
+        else {
+            DecodeAndCheck(&image);
+        }
+
+        image.failingLba = -1;
+        for (size_t i = 0; i < hot.size(); i++)
+            memcpy(PtImageSector(&image, hot[i]), &saved[i * image.sectorSize], image.sectorSize);
+    }
+    printf("PartitionTableFuzz: %ld mutated images decoded\n", runs);
+    return 0;
+}
+#endif
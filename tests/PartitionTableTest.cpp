@@ -0,0 +1,201 @@
+// Decoding of well-formed and damaged MBR, EBR and GPT layouts.
+#include "PartitionImage.hpp"
+#include "HostTest.hpp"
+
+static std::vector<unsigned char> g_scratch(PT_SCRATCH_BYTES(4096));
+static PT_MAP g_map;
+static PT_ENTRY g_entries[PT_MAX_ENTRIES];
+
+static void Decode(PT_IMAGE* image) {
+    HOST_CHECK_EQUAL(PartitionTableDecode(PtImageRead, image, image->sectorSize, image->totalSectors, g_scratch.data(), g_scratch.size(), &g_map, g_entries), 0);
+}
+
+#define GPT_ALL_VALID (PT_GPT_PRIMARY_HEADER_VALID | PT_GPT_PRIMARY_ENTRIES_VALID | PT_GPT_BACKUP_HEADER_VALID | PT_GPT_BACKUP_ENTRIES_VALID)
+
+static void TestParameters() {
+    PT_IMAGE image = PtMakeMbrImage(64, 0);
+    HOST_CHECK_EQUAL(PartitionTableDecode(PtImageRead, &image, 500, 64, g_scratch.data(), g_scratch.size(), &g_map, g_entries), (unsigned long long)-1);
+    HOST_CHECK_EQUAL(PartitionTableDecode(PtImageRead, &image, 512, 0, g_scratch.data(), g_scratch.size(), &g_map, g_entries), (unsigned long long)-1);
+    HOST_CHECK_EQUAL(PartitionTableDecode(PtImageRead, &image, 512, 64, g_scratch.data(), PT_SCRATCH_BYTES(512) - 1, &g_map, g_entries), (unsigned long long)-1);
+
+    // A blank disk has no style and no entries.
+    PT_IMAGE blank = PtImageCreate(512, 64);
+    Decode(&blank);
+    HOST_CHECK_EQUAL(g_map.style, PT_STYLE_NONE);
+    HOST_CHECK_EQUAL(g_map.flags, 0);
+    HOST_CHECK_EQUAL(g_map.entryCount, 0);
+}
+
+static void TestGpt() {
+    for (unsigned int sectorSize : { 512u, 4096u }) {
+        PT_IMAGE image = PtMakeGptImage(sectorSize, 1 << 14, 5);
+        Decode(&image);
+        HOST_CHECK_EQUAL(g_map.style, PT_STYLE_GPT);
+        HOST_CHECK_EQUAL(g_map.flags, PT_MBR_VALID | PT_MBR_PROTECTIVE | GPT_ALL_VALID);
+        HOST_CHECK_EQUAL(g_map.entryCount, 5);
+        HOST_CHECK_EQUAL(g_map.gptPrimary.alternateLba, (1 << 14) - 1);
+        HOST_CHECK_EQUAL(g_map.gptBackup.myLba, (1 << 14) - 1);
+        HOST_CHECK_EQUAL(g_map.gptDiskGuid[1], 0x11);
+        HOST_CHECK_EQUAL(g_entries[3].source, PT_SOURCE_GPT);
+        HOST_CHECK_EQUAL(g_entries[3].index, 3);
+        HOST_CHECK_EQUAL(g_entries[3].firstLba, 5048);
+        HOST_CHECK_EQUAL(g_entries[3].lastLba, 6047);
+        HOST_CHECK_EQUAL(g_entries[3].attributes, 1ull << 63);
+        HOST_CHECK(g_entries[3].name[0] == 'P' && g_entries[3].name[1] == '3');
+    }
+}
+
+static void TestGptDamage() {
+    const unsigned long long sectors = 1 << 14;
+
+    // Primary header CRC broken: the backup header and its entries take over.
+    PT_IMAGE image = PtMakeGptImage(512, sectors, 5);
+    PtImageSector(&image, 1)[40] ^= 1;
+    Decode(&image);
+    HOST_CHECK_EQUAL(g_map.style, PT_STYLE_GPT);
+    HOST_CHECK_EQUAL(g_map.flags & GPT_ALL_VALID, PT_GPT_BACKUP_HEADER_VALID | PT_GPT_BACKUP_ENTRIES_VALID);
+    HOST_CHECK_EQUAL(g_map.entryCount, 5);
+    HOST_CHECK_EQUAL(g_map.gptPrimary.myLba, 0);
+
+    // Primary entry array CRC broken: the header is valid but the entries come from the backup.
+    image = PtMakeGptImage(512, sectors, 5);
+    PtImageSector(&image, 2)[100] ^= 1;
+    Decode(&image);
+    HOST_CHECK_EQUAL(g_map.flags & GPT_ALL_VALID, PT_GPT_PRIMARY_HEADER_VALID | PT_GPT_BACKUP_HEADER_VALID | PT_GPT_BACKUP_ENTRIES_VALID);
+    HOST_CHECK_EQUAL(g_map.entryCount, 5);
+    HOST_CHECK(!(g_map.flags & PT_GPT_BACKUP_MISMATCH));
+
+    // Both broken: only the protective MBR entry is left.
+    PtImageSector(&image, sectors - 1)[40] ^= 1;
+    Decode(&image);
+    HOST_CHECK_EQUAL(g_map.style, PT_STYLE_MBR);
+    HOST_CHECK_EQUAL(g_map.entryCount, 1);
+    HOST_CHECK_EQUAL(g_entries[0].mbrType, 0xEE);
+
+    // A header whose CRC covers a wrong value is still rejected, here one pointing its array past the disk.
+    image = PtMakeGptImage(512, sectors, 5);
+    PtStoreLe64(PtImageSector(&image, 1) + 72, sectors);
+    PtSealGptHeader(PtImageSector(&image, 1));
+    Decode(&image);
+    HOST_CHECK(!(g_map.flags & PT_GPT_PRIMARY_HEADER_VALID));
+    HOST_CHECK_EQUAL(g_map.entryCount, 5);
+
+    // Valid primary and backup describing different tables.
+    image = PtMakeGptImage(512, sectors, 5);
+    PtSetGptEntryRange(&image, sectors - 1, 0, 100, 200);
+    Decode(&image);
+    HOST_CHECK_EQUAL(g_map.flags & GPT_ALL_VALID, GPT_ALL_VALID);
+    HOST_CHECK(g_map.flags & PT_GPT_BACKUP_MISMATCH);
+    HOST_CHECK_EQUAL(g_entries[0].firstLba, 2048);
+
+    // The primary header lost entirely, with the backup still in the last sector.
+    image = PtMakeGptImage(512, sectors, 5);
+    memset(PtImageSector(&image, 1), 0, 512);
+    Decode(&image);
+    HOST_CHECK_EQUAL(g_map.style, PT_STYLE_GPT);
+    HOST_CHECK_EQUAL(g_map.entryCount, 5);
+
+    // An unreadable primary array is reported and the backup is used.
+    image = PtMakeGptImage(512, sectors, 5);
+    image.failingLba = 3;
+    Decode(&image);
+    HOST_CHECK(g_map.flags & PT_READ_FAILED);
+    HOST_CHECK_EQUAL(g_map.entryCount, 5);
+}
+
+// Overlapping and out-of-order entries are a matter for the caller; the decoder reports them exactly as stored.
+static void TestGptOverlap() {
+    const unsigned long long sectors = 1 << 14;
+    PT_IMAGE image = PtMakeGptImage(512, sectors, 3);
+    PtSetGptEntryRange(&image, 1, 1, 2500, 3500);
+    PtSetGptEntryRange(&image, 1, 2, 100, 99);
+    PtSetGptEntryRange(&image, 1, 5, 0, sectors * 2);
+    Decode(&image);
+    HOST_CHECK_EQUAL(g_map.entryCount, 4);
+    HOST_CHECK(g_entries[1].firstLba == 2500 && g_entries[1].lastLba == 3500);
+    HOST_CHECK(g_entries[2].firstLba == 100 && g_entries[2].lastLba == 99);
+    HOST_CHECK(g_entries[3].index == 5 && g_entries[3].lastLba == sectors * 2);
+}
+
+static void TestGptEntryLimit() {
+    PT_IMAGE image = PtMakeGptImage(512, 1 << 16, 300, 512);
+    Decode(&image);
+    HOST_CHECK_EQUAL(g_map.entryCount, PT_MAX_ENTRIES);
+    HOST_CHECK(g_map.flags & PT_ENTRIES_TRUNCATED);
+    HOST_CHECK_EQUAL(g_entries[PT_MAX_ENTRIES - 1].index, PT_MAX_ENTRIES - 1);
+}
+
+static void TestMbr() {
+    PT_IMAGE image = PtMakeMbrImage(1 << 16, 3);
+    Decode(&image);
+    HOST_CHECK_EQUAL(g_map.style, PT_STYLE_MBR);
+    HOST_CHECK_EQUAL(g_map.flags, PT_MBR_VALID);
+    HOST_CHECK_EQUAL(g_map.mbrDiskSignature, 0xDEADBEEF);
+    HOST_CHECK_EQUAL(g_map.entryCount, 5);
+    HOST_CHECK(g_entries[0].active && g_entries[0].mbrType == 0x07 && g_entries[0].firstLba == 2048 && g_entries[0].lastLba == 3047);
+    HOST_CHECK(g_entries[1].mbrType == 0x0F && g_entries[1].source == PT_SOURCE_MBR_PRIMARY);
+    for (int i = 0; i < 3; i++) {
+        const PT_ENTRY& logical = g_entries[2 + i];
+        HOST_CHECK_EQUAL(logical.source, PT_SOURCE_MBR_LOGICAL);
+        HOST_CHECK_EQUAL(logical.index, 4 + i);
+        HOST_CHECK_EQUAL(logical.ebrLba, 4000 + 4000 * i);
+        HOST_CHECK_EQUAL(logical.firstLba, 4063 + 4000 * i);
+        HOST_CHECK_EQUAL(logical.lastLba, 4063 + 4000 * i + 1000 + i - 1);
+    }
+
+    // Without the boot signature there is nothing.
+    PtImageSector(&image, 0)[511] = 0;
+    Decode(&image);
+    HOST_CHECK_EQUAL(g_map.style, PT_STYLE_NONE);
+    HOST_CHECK_EQUAL(g_map.entryCount, 0);
+}
+
+static void TestEbrChainDamage() {
+    // A link back to the first EBR would loop forever; it ends the chain instead.
+    PT_IMAGE image = PtMakeMbrImage(1 << 16, 3);
+    PtSetMbrEntry(PtImageSector(&image, 12000), 1, 0x05, 0, 4000);
+    Decode(&image);
+    HOST_CHECK(g_map.flags & PT_EBR_CHAIN_TRUNCATED);
+    HOST_CHECK_EQUAL(g_map.entryCount, 5);
+
+    // A link past the extended partition.
+    image = PtMakeMbrImage(1 << 16, 3);
+    PtSetMbrEntry(PtImageSector(&image, 8000), 1, 0x05, 40000, 4000);
+    Decode(&image);
+    HOST_CHECK(g_map.flags & PT_EBR_CHAIN_TRUNCATED);
+    HOST_CHECK_EQUAL(g_map.entryCount, 4);
+
+    // An EBR without its signature, and one that cannot be read.
+    image = PtMakeMbrImage(1 << 16, 3);
+    PtImageSector(&image, 8000)[510] = 0;
+    Decode(&image);
+    HOST_CHECK(g_map.flags & PT_EBR_CHAIN_TRUNCATED);
+    HOST_CHECK_EQUAL(g_map.entryCount, 3);
+    image = PtMakeMbrImage(1 << 16, 3);
+    image.failingLba = 8000;
+    Decode(&image);
+    HOST_CHECK_EQUAL(g_map.flags & (PT_EBR_CHAIN_TRUNCATED | PT_READ_FAILED), PT_EBR_CHAIN_TRUNCATED | PT_READ_FAILED);
+
+    // An extended partition reaching past the end of a small disk.
+    image = PtMakeMbrImage(10000, 2);
+    Decode(&image);
+    HOST_CHECK_EQUAL(g_map.entryCount, 4);
+    HOST_CHECK(!(g_map.flags & PT_EBR_CHAIN_TRUNCATED));
+
+    // The chain length limit.
+    image = PtMakeMbrImage(4000ull * (PT_MAX_LOGICAL_PARTITIONS + 2), PT_MAX_LOGICAL_PARTITIONS + 1);
+    Decode(&image);
+    HOST_CHECK(g_map.flags & PT_EBR_CHAIN_TRUNCATED);
+    HOST_CHECK_EQUAL(g_map.entryCount, 2 + PT_MAX_LOGICAL_PARTITIONS);
+}
+
+int main() {
+    TestParameters();
+    TestGpt();
+    TestGptDamage();
+    TestGptOverlap();
+    TestGptEntryLimit();
+    TestMbr();
+    TestEbrChainDamage();
+    return HostTestResult("PartitionTableTest");
+}
@@ -0,0 +1,129 @@
+// Checks every pattern scan implementation the host can run against a brute-force reference, on small alphabets so
+// that matches, near misses and overlapping matches are frequent.
+#include "PatternMatch.hpp"
+#include "HostTest.hpp"
+#include <vector>
+
+static int CollectPosition(void* context, size_t position) {
+    ((std::vector<size_t>*)context)->push_back(position);
+    return 1;
+}
+
+static int StopAtFirst(void* context, size_t position) {
+    *(size_t*)context = position;
+    return 0;
+}
+
+static std::vector<size_t> ReferenceScan(const unsigned char* bytes, const unsigned char* mask, size_t patternLength,
+    const std::vector<unsigned char>& data, size_t firstPosition) {
+    std::vector<size_t> positions;
+    for (size_t i = firstPosition; i + patternLength <= data.size(); i++) {
+        size_t j = 0;
+        for (; j < patternLength; j++) {
+            unsigned char m = mask ? mask[j] : 0xFF;
+            if ((data[i + j] & m) != (bytes[j] & m))
+                break;
+        }
+        if (j == patternLength)
+            positions.push_back(i);
+    }
+    return positions;
+}
+
+static void TestPrepare() {
+    unsigned char bytes[4] = { 1, 2, 3, 4 };
+    unsigned char mask[4] = { 0x00, 0xFF, 0x0F, 0xFF };
+    BYTE_PATTERN pattern;
+
+    HOST_CHECK(!PatternPrepare(&pattern, bytes, NULL, 0));
+    HOST_CHECK(!PatternPrepare(&pattern, bytes, NULL, PATTERN_MAX_LENGTH + 1));
+
+    HOST_CHECK(PatternPrepare(&pattern, bytes, mask, 4));
+    HOST_CHECK(pattern.hasAnchors);
+    HOST_CHECK_EQUAL(pattern.firstAnchor, 1);
+    HOST_CHECK_EQUAL(pattern.lastAnchor, 3);
+
+    unsigned char wildcards[4] = { 0, 0, 0xF0, 0 };
+    HOST_CHECK(PatternPrepare(&pattern, bytes, wildcards, 4));
+    HOST_CHECK(!pattern.hasAnchors);
+}
+
+static void TestRandomized(unsigned int features) {
+    HOST_RANDOM random = { 0x5EC7010ull };
+    for (int round = 0; round < 20000; round++) {
+        // Lengths around the 16 and 32 byte vector widths matter most.
+        std::vector<unsigned char> data(HostRandomBelow(&random, 200));
+        for (auto& value : data)
+            value = (unsigned char)HostRandomBelow(&random, 3);
+
+        size_t patternLength = 1 + HostRandomBelow(&random, 40);
+        std::vector<unsigned char> bytes(patternLength), mask(patternLength);
+        for (size_t i = 0; i < patternLength; i++) {
+            bytes[i] = (unsigned char)HostRandomBelow(&random, 3);
+            unsigned int kind = HostRandomBelow(&random, 8);
+            mask[i] = kind < 6 ? 0xFF : kind == 6 ? 0x00 : 0x01;
+        }
+        const unsigned char* pMask = HostRandomBelow(&random, 2) ? mask.data() : NULL;
+        // Short patterns of a small alphabet, so there are plenty of matches.
+        if (patternLength > 6 && HostRandomBelow(&random, 4))
+            patternLength = 1 + HostRandomBelow(&random, 6);
+
+        BYTE_PATTERN pattern;
+        HOST_CHECK(PatternPrepare(&pattern, bytes.data(), pMask, patternLength));
+        size_t firstPosition = HostRandomBelow(&random, 8);
+        std::vector<size_t> expected = ReferenceScan(bytes.data(), pMask, patternLength, data, firstPosition);
+
+        std::vector<size_t> scalar;
+        PatternScanScalar(&pattern, data.data(), data.size(), firstPosition, CollectPosition, &scalar);
+        HOST_CHECK(scalar == expected);
+#if SIMD_X64
+        if (features & SIMD_FEATURE_SSE2) {
+            std::vector<size_t> sse2;
+            PatternScanSse2(&pattern, data.data(), data.size(), firstPosition, CollectPosition, &sse2);
+            HOST_CHECK(sse2 == expected);
+        }
+        if (features & SIMD_FEATURE_AVX2) {
+            std::vector<size_t> avx2;
+            PatternScanAvx2(&pattern, data.data(), data.size(), firstPosition, CollectPosition, &avx2);
+            HOST_CHECK(avx2 == expected);
+        }
+#endif
+        std::vector<size_t> dispatched;
+        PatternScan(&pattern, data.data(), data.size(), firstPosition, features, CollectPosition, &dispatched);
+        HOST_CHECK(dispatched == expected);
+        if (g_hostTestFailures) {
+            fprintf(stderr, "round %d: %zu data bytes, pattern of %zu, first position %zu\n", round, data.size(), patternLength, firstPosition);
+            return;
+        }
+    }
+}
+
+// A match in the last bytes of the buffer, past the final full vector, and a stop requested by the callback.
+static void TestTailAndStop(unsigned int features) {
+    std::vector<unsigned char> data(1000, 0xAA);
+    unsigned char bytes[3] = { 0x4D, 0x5A, 0x90 };
+    data[100] = 0x4D; data[101] = 0x5A; data[102] = 0x90;
+    data[997] = 0x4D; data[998] = 0x5A; data[999] = 0x90;
+    BYTE_PATTERN pattern;
+    HOST_CHECK(PatternPrepare(&pattern, bytes, NULL, sizeof(bytes)));
+
+    for (unsigned int mask : { 0u, features }) {
+        std::vector<size_t> positions;
+        HOST_CHECK(PatternScan(&pattern, data.data(), data.size(), 0, mask, CollectPosition, &positions));
+        HOST_CHECK(positions.size() == 2 && positions[0] == 100 && positions[1] == 997);
+
+        size_t first = 0;
+        HOST_CHECK(!PatternScan(&pattern, data.data(), data.size(), 0, mask, StopAtFirst, &first));
+        HOST_CHECK_EQUAL(first, 100);
+        HOST_CHECK(!PatternScan(&pattern, data.data(), data.size(), 101, mask, StopAtFirst, &first));
+        HOST_CHECK_EQUAL(first, 997);
+    }
+}
+
+int main() {
+    unsigned int features = HostSimdFeatures();
+    TestPrepare();
+    TestRandomized(features);
+    TestTailAndStop(features);
+    return HostTestResult("PatternMatchTest");
+}
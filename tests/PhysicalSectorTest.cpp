@@ -0,0 +1,118 @@
+// Physical sector arithmetic behind padded writes: the first boundary of partitions at the offsets seen on real disks,
+// the alignment test, and the span a write is widened to, checked against a per-byte reference by doing the padded
+// write on a simulated disk and comparing it with writing the range in place.
+#include "PhysicalSector.hpp"
+#include "HostTest.hpp"
+#include <string.h>
+#include <vector>
+
+#define LOGICAL_SECTOR_SIZE 512
+
+static void TestBoundary() {
+    // Partitions at 1MB and at the old 63 sector offset on a 4K disk, and the same disk shifted by an aligned-at-7
+    // disk's BytesOffsetForSectorAlignment.
+    HOST_CHECK_EQUAL(PhysicalSectorBoundary(0, 0, 4096), 0);
+    HOST_CHECK_EQUAL(PhysicalSectorBoundary(1024 * 1024, 0, 4096), 0);
+    HOST_CHECK_EQUAL(PhysicalSectorBoundary(63 * 512, 0, 4096), 512);
+    HOST_CHECK_EQUAL(PhysicalSectorBoundary(0, 3584, 4096), 3584);
+    HOST_CHECK_EQUAL(PhysicalSectorBoundary(63 * 512, 3584, 4096), 0);
+    HOST_CHECK_EQUAL(PhysicalSectorBoundary(1024 * 1024, 3584, 4096), 3584);
+
+    HOST_RANDOM random = { 0xB0B0ull };
+    for (unsigned int physicalSectorSize : { 1024u, 4096u, 8192u, 65536u }) {
+        for (int i = 0; i < 10000; i++) {
+            unsigned long long objectOffset = (HostRandomNext(&random) % (1ull << 40)) / LOGICAL_SECTOR_SIZE * LOGICAL_SECTOR_SIZE;
+            unsigned int alignmentOffset = HostRandomBelow(&random, physicalSectorSize * 2 / LOGICAL_SECTOR_SIZE) * LOGICAL_SECTOR_SIZE;
+            unsigned int boundary = PhysicalSectorBoundary(objectOffset, alignmentOffset, physicalSectorSize);
+            HOST_CHECK(boundary < physicalSectorSize);
+            HOST_CHECK_EQUAL((objectOffset + boundary + physicalSectorSize - alignmentOffset % physicalSectorSize) % physicalSectorSize, 0);
+        }
+    }
+}
+
+// What padding has to produce, from the physical sectors the range touches one by one.
+static void CheckSpan(unsigned int physicalSectorSize, unsigned int boundary, unsigned long long byteOffset, unsigned long long length) {
+    PHYSICAL_SECTOR_SPAN span;
+    if (!PhysicalSectorSpan(physicalSectorSize, boundary, byteOffset, length, &span)) {
+        HOST_CHECK(byteOffset < boundary);
+        return;
+    }
+    HOST_CHECK(byteOffset >= boundary);
+
+    unsigned long long firstSector = (byteOffset - boundary) / physicalSectorSize;
+    unsigned long long lastSector = (byteOffset + length - 1 - boundary) / physicalSectorSize;
+    HOST_CHECK_EQUAL(span.start, boundary + firstSector * physicalSectorSize);
+    HOST_CHECK_EQUAL(span.end, boundary + (lastSector + 1) * physicalSectorSize);
+    HOST_CHECK_EQUAL(span.headLength, byteOffset - span.start);
+    HOST_CHECK_EQUAL(span.tailStart, byteOffset + length - span.start);
+
+    int headPartial = byteOffset != span.start;
+    int tailPartial = byteOffset + length != span.end;
+    HOST_CHECK_EQUAL(span.readHead, headPartial);
+    HOST_CHECK_EQUAL(span.readTail, tailPartial && !(headPartial && firstSector == lastSector));
+    HOST_CHECK_EQUAL(PhysicalSectorIsAligned(physicalSectorSize, boundary, byteOffset, length), !headPartial && !tailPartial);
+}
+
+static void TestSpans() {
+    for (unsigned int physicalSectorSize : { 4096u, 8192u }) {
+        for (unsigned int boundary : { 0u, 512u, physicalSectorSize - 512 }) {
+            for (unsigned long long byteOffset = 0; byteOffset < 3ull * physicalSectorSize; byteOffset += LOGICAL_SECTOR_SIZE) {
+                for (unsigned long long length = LOGICAL_SECTOR_SIZE; length <= 3ull * physicalSectorSize; length += LOGICAL_SECTOR_SIZE)
+                    CheckSpan(physicalSectorSize, boundary, byteOffset, length);
+            }
+        }
+    }
+    // Far into a large disk, where the arithmetic needs all 64 bits.
+    for (unsigned long long byteOffset : { 1ull << 42, (1ull << 42) + 512, (1ull << 50) + 3584 })
+        CheckSpan(4096, 512, byteOffset, 1024 * 1024 - 512);
+}
+
+// Does a padded write the way PaddedWrite does on a disk of random bytes, with everything outside the head and tail
+// reads poisoned, and checks that the disk ends up as if the range had been written in place.
+static void CheckPaddedWrite(HOST_RANDOM* random, unsigned int physicalSectorSize, unsigned int boundary, unsigned long long byteOffset, unsigned long long length) {
+    PHYSICAL_SECTOR_SPAN span;
+    if (!PhysicalSectorSpan(physicalSectorSize, boundary, byteOffset, length, &span))
+        return;
+
+    std::vector<unsigned char> disk((size_t)span.end + physicalSectorSize), data((size_t)length);
+    HostRandomFill(random, disk.data(), disk.size());
+    HostRandomFill(random, data.data(), data.size());
+    std::vector<unsigned char> expected = disk;
+    memcpy(&expected[(size_t)byteOffset], data.data(), data.size());
+
+    size_t paddedLength = (size_t)(span.end - span.start);
+    std::vector<unsigned char> buffer(paddedLength, 0xCC);
+    unsigned long long sectorsRead = 0;
+    if (span.readHead) {
+        memcpy(buffer.data(), &disk[(size_t)span.start], physicalSectorSize);
+        sectorsRead++;
+    }
+    if (span.readTail) {
+        size_t tailSector = paddedLength - physicalSectorSize;
+        memcpy(&buffer[tailSector], &disk[(size_t)span.start + tailSector], physicalSectorSize);
+        sectorsRead++;
+    }
+    memcpy(&buffer[span.headLength], data.data(), data.size());
+    memcpy(&disk[(size_t)span.start], buffer.data(), paddedLength);
+
+    HOST_CHECK(disk == expected);
+    // Never more reads than partly covered sectors.
+    HOST_CHECK(sectorsRead <= (unsigned long long)(byteOffset != span.start) + (byteOffset + length != span.end));
+}
+
+static void TestPaddedWrites() {
+    HOST_RANDOM random = { 0x9ADDull };
+    for (unsigned int boundary : { 0u, 512u, 3584u }) {
+        for (unsigned long long byteOffset = 0; byteOffset < 2 * 4096; byteOffset += LOGICAL_SECTOR_SIZE) {
+            for (unsigned long long length = LOGICAL_SECTOR_SIZE; length <= 3 * 4096; length += LOGICAL_SECTOR_SIZE)
+                CheckPaddedWrite(&random, 4096, boundary, byteOffset, length);
+        }
+    }
+}
+
+int main() {
+    TestBoundary();
+    TestSpans();
+    TestPaddedWrites();
+    return HostTestResult("PhysicalSectorTest");
+}
@@ -0,0 +1,362 @@
+// Region map operations against a per-sector reference, and whole rescues against a fault-injecting stand-in device:
+// sectors that always fail, sectors that fail a few times and then read, a device that stops mid-pass, and rescues
+// resumed from an exported map the way IOCTL_SECTOR_RESCUE imports one.
+#include "RescueMap.hpp"
+#include "HostTest.hpp"
+#include <vector>
+
+// Every sector starts out with the number of reads covering it that fail; ~0u fails forever.
+#define SECTOR_ALWAYS_BAD   (~0u)
+
+typedef struct _FAULTY_DEVICE {
+    std::vector<unsigned int> failuresLeft;
+    std::vector<unsigned char> stored;      // read successfully, and so copied to the destination
+    long long abortAfterReads;              // -1 never
+    unsigned long long reads;
+    unsigned long long sectorsRead;
+    unsigned long long storedTwice;
+} FAULTY_DEVICE;
+
+static int FaultyRead(void* context, unsigned long long start, unsigned long long count) {
+    FAULTY_DEVICE* device = (FAULTY_DEVICE*)context;
+    if (device->abortAfterReads >= 0 && device->reads >= (unsigned long long)device->abortAfterReads)
+        return RESCUE_READ_ABORT;
+    device->reads++;
+    device->sectorsRead += count;
+
+    // A read fails if any sector in it does, and uses up one failure of each transient sector it covers, the way a
+    // marginal sector sometimes comes back after the drive retried it.
+    bool failed = false;
+    for (unsigned long long s = start; s < start + count; s++) {
+        unsigned int& left = device->failuresLeft[(size_t)s];
+        if (left) {
+            failed = true;
+            if (left != SECTOR_ALWAYS_BAD)
+                left--;
+        }
+    }
+    if (failed)
+        return RESCUE_READ_ERROR;
+    for (unsigned long long s = start; s < start + count; s++) {
+        device->storedTwice += device->stored[(size_t)s];
+        device->stored[(size_t)s] = 1;
+    }
+    return RESCUE_READ_OK;
+}
+
+static FAULTY_DEVICE MakeDevice(unsigned long long sectors) {
+    FAULTY_DEVICE device;
+    device.failuresLeft.assign((size_t)sectors, 0);
+    device.stored.assign((size_t)sectors, 0);
+    device.abortAfterReads = -1;
+    device.reads = 0;
+    device.sectorsRead = 0;
+    device.storedTwice = 0;
+    return device;
+}
+
+static void CheckMapShape(const RESCUE_MAP* map) {
+    if (!map->count) {
+        HOST_CHECK(map->start >= map->end);
+        return;
+    }
+    HOST_CHECK_EQUAL(map->regions[0].start, map->start);
+    HOST_CHECK_EQUAL(map->regions[map->count - 1].end, map->end);
+    HOST_CHECK(map->count <= map->capacity);
+    for (unsigned int i = 0; i < map->count; i++) {
+        HOST_CHECK(map->regions[i].start < map->regions[i].end);
+        if (i) {
+            HOST_CHECK_EQUAL(map->regions[i].start, map->regions[i - 1].end);
+            HOST_CHECK(map->regions[i].state != map->regions[i - 1].state);
+        }
+    }
+}
+
+static unsigned int StateAt(const RESCUE_MAP* map, unsigned long long sector) {
+    for (unsigned int i = 0; i < map->count; i++) {
+        if (sector < map->regions[i].end)
+            return map->regions[i].state;
+    }
+    return ~0u;
+}
+
+static void TestMapOperations() {
+    HOST_RANDOM random = { 0x4E5Cull };
+    for (int iteration = 0; iteration < 1000; iteration++) {
+        const unsigned long long base = 100;
+        unsigned long long length = 1 + HostRandomBelow(&random, 500);
+        unsigned int capacity = 1 + HostRandomBelow(&random, 64);
+        std::vector<RESCUE_REGION> regions(capacity);
+        std::vector<unsigned int> reference((size_t)length, RESCUE_UNTRIED);
+        RESCUE_MAP map;
+        RescueMapInit(&map, regions.data(), capacity, base, base + length, RESCUE_UNTRIED);
+
+        for (int operation = 0; operation < 100; operation++) {
+            unsigned long long start = base - 10 + HostRandomBelow(&random, (unsigned int)length + 20);
+            unsigned long long end = start + HostRandomBelow(&random, 60);
+            unsigned int state = HostRandomBelow(&random, 4);
+            if (RescueMapSet(&map, start, end, state) == 0) {
+                for (unsigned long long s = start < base ? base : start; s < end && s < base + length; s++)
+                    reference[(size_t)(s - base)] = state;
+            }
+            CheckMapShape(&map);
+            for (unsigned long long s = 0; s < length; s++) {
+                if (StateAt(&map, base + s) != reference[(size_t)s]) {
+                    HOST_CHECK_EQUAL(StateAt(&map, base + s), reference[(size_t)s]);
+                    return;
+                }
+            }
+
+            for (unsigned int total = 0; total < 4; total++) {
+                unsigned long long expected = 0;
+                for (unsigned int value : reference)
+                    expected += value == total;
+                HOST_CHECK_EQUAL(RescueMapTotal(&map, total), expected);
+            }
+
+            unsigned long long from = HostRandomBelow(&random, (unsigned int)(base + length + 10));
+            unsigned int wanted = HostRandomBelow(&random, 4);
+            unsigned long long runStart = 0, runEnd = 0;
+            int found = RescueMapFind(&map, from, wanted, &runStart, &runEnd);
+            unsigned long long s = from < base ? base : from;
+            while (s < base + length && reference[(size_t)(s - base)] != wanted)
+                s++;
+            HOST_CHECK_EQUAL(found, s < base + length);
+            if (found) {
+                unsigned long long e = s;
+                while (e < base + length && reference[(size_t)(e - base)] == wanted)
+                    e++;
+                HOST_CHECK(runStart == s && runEnd == e);
+            }
+        }
+    }
+}
+
+// Runs the rescue to the end, resuming after each abort from a fresh map that imports the exported regions.
+static int RescueToEnd(FAULTY_DEVICE* device, std::vector<RESCUE_REGION>& regions, PRESCUE_MAP map, unsigned int chunkSectors,
+                       unsigned long long maxSkipSectors, unsigned int flags, int interruptions, unsigned long long* runs) {
+    int result;
+    *runs = 0;
+    do {
+        std::vector<RESCUE_REGION> exported(regions.begin(), regions.begin() + map->count);
+        RescueMapInit(map, regions.data(), (unsigned int)regions.size(), map->start, map->end, RESCUE_UNTRIED);
+        for (const RESCUE_REGION& region : exported)
+            HOST_CHECK_EQUAL(RescueMapSet(map, region.start, region.end, region.state), 0);
+
+        RESCUE_PLAN plan = {};
+        plan.map = map;
+        plan.chunkSectors = chunkSectors;
+        plan.maxSkipSectors = maxSkipSectors;
+        plan.flags = flags;
+        plan.read = FaultyRead;
+        plan.context = device;
+        device->abortAfterReads = interruptions-- > 0 ? (long long)(device->reads + 40 + 17 * *runs) : -1;
+        result = RescueRun(&plan);
+        CheckMapShape(map);
+        ++*runs;
+    } while (result == RESCUE_ABORTED);
+    device->abortAfterReads = -1;
+    return result;
+}
+
+// After a full rescue every sector is DONE exactly when the device handed it over, BAD exactly when its last read was
+// a failing single-sector read, and nothing is left untried or failed.
+static void CheckRescued(const FAULTY_DEVICE& device, const RESCUE_MAP* map) {
+    HOST_CHECK_EQUAL(device.storedTwice, 0);
+    HOST_CHECK_EQUAL(RescueMapTotal(map, RESCUE_UNTRIED), 0);
+    HOST_CHECK_EQUAL(RescueMapTotal(map, RESCUE_FAILED), 0);
+    unsigned int region = 0;
+    for (unsigned long long s = map->start; s < map->end; s++) {
+        while (map->regions[region].end <= s)
+            region++;
+        unsigned int state = map->regions[region].state;
+        if ((state == RESCUE_DONE) != (device.stored[(size_t)s] != 0) || (state == RESCUE_BAD) != (device.stored[(size_t)s] == 0)) {
+            HOST_CHECK_EQUAL(state, device.stored[(size_t)s] ? RESCUE_DONE : RESCUE_BAD);
+            return;
+        }
+        if (device.failuresLeft[(size_t)s] == SECTOR_ALWAYS_BAD && state != RESCUE_BAD) {
+            HOST_CHECK_EQUAL(state, RESCUE_BAD);
+            return;
+        }
+    }
+}
+
+// One bad sector in 64, in 8-sector chunks, traced read by read:
+//   copy    [0,8) [8,16) ok, [16,24) fails, skip 8, [32,40) ... [56,64) ok        7 reads, 1 error
+//   sweep   [24,32) ok                                                            1 read
+//   scrape  [16,20) ok so [20,24) is known bad, [20,22) fails, [22,24) ok,
+//           [20,21) fails and is bad, [21,22) ok                                  5 reads, 2 errors
+static void TestTracedRescue() {
+    FAULTY_DEVICE device = MakeDevice(64);
+    device.failuresLeft[20] = SECTOR_ALWAYS_BAD;
+    std::vector<RESCUE_REGION> regions(16);
+    RESCUE_MAP map;
+    RescueMapInit(&map, regions.data(), 16, 0, 64, RESCUE_UNTRIED);
+    RESCUE_PLAN plan = {};
+    plan.map = &map;
+    plan.chunkSectors = 8;
+    plan.maxSkipSectors = 64;
+    plan.read = FaultyRead;
+    plan.context = &device;
+    HOST_CHECK_EQUAL(RescueRun(&plan), RESCUE_OK);
+    HOST_CHECK_EQUAL(plan.reads, 13);
+    HOST_CHECK_EQUAL(plan.readErrors, 3);
+    HOST_CHECK_EQUAL(map.count, 3);
+    HOST_CHECK(map.regions[0].end == 20 && map.regions[0].state == RESCUE_DONE);
+    HOST_CHECK(map.regions[1].end == 21 && map.regions[1].state == RESCUE_BAD);
+    HOST_CHECK(map.regions[2].end == 64 && map.regions[2].state == RESCUE_DONE);
+    CheckRescued(device, &map);
+
+    // Without the scrape the failed chunk is left for later, untouched.
+    device = MakeDevice(64);
+    device.failuresLeft[20] = SECTOR_ALWAYS_BAD;
+    RescueMapInit(&map, regions.data(), 16, 0, 64, RESCUE_UNTRIED);
+    plan.flags = RESCUE_NO_SCRAPE;
+    plan.reads = plan.readErrors = 0;
+    HOST_CHECK_EQUAL(RescueRun(&plan), RESCUE_OK);
+    HOST_CHECK_EQUAL(plan.reads, 8);
+    HOST_CHECK_EQUAL(RescueMapTotal(&map, RESCUE_FAILED), 8);
+    unsigned long long runStart, runEnd;
+    HOST_CHECK(RescueMapFind(&map, 0, RESCUE_FAILED, &runStart, &runEnd) && runStart == 16 && runEnd == 24);
+    HOST_CHECK_EQUAL(RescueMapTotal(&map, RESCUE_DONE), 56);
+
+    // Known bad sectors imported up front are never read.
+    device = MakeDevice(64);
+    device.failuresLeft[20] = SECTOR_ALWAYS_BAD;
+    RescueMapInit(&map, regions.data(), 16, 0, 64, RESCUE_UNTRIED);
+    HOST_CHECK_EQUAL(RescueMapSet(&map, 20, 21, RESCUE_BAD), 0);
+    plan.flags = 0;
+    plan.reads = plan.readErrors = 0;
+    HOST_CHECK_EQUAL(RescueRun(&plan), RESCUE_OK);
+    HOST_CHECK_EQUAL(plan.readErrors, 0);
+    CheckRescued(device, &map);
+}
+
+// Sectors that fail once are recovered by the scrape; ones that fail more often end up bad, and a later run that
+// imports them as failed, the way a retry does, gets them back once the device has stopped failing them.
+static void TestTransientFailures() {
+    const unsigned long long sectors = 4096;
+    FAULTY_DEVICE device = MakeDevice(sectors);
+    HOST_RANDOM random = { 0x7E7Bull };
+    std::vector<unsigned long long> once, often, always;
+    for (int i = 0; i < 40; i++) {
+        unsigned long long s = HostRandomBelow(&random, (unsigned int)sectors);
+        if (device.failuresLeft[(size_t)s])
+            continue;
+        switch (i % 3) {
+        case 0: device.failuresLeft[(size_t)s] = 1; once.push_back(s); break;
+        case 1: device.failuresLeft[(size_t)s] = 50; often.push_back(s); break;
+        default: device.failuresLeft[(size_t)s] = SECTOR_ALWAYS_BAD; always.push_back(s); break;
+        }
+    }
+
+    std::vector<RESCUE_REGION> regions(1024);
+    RESCUE_MAP map;
+    RescueMapInit(&map, regions.data(), (unsigned int)regions.size(), 0, sectors, RESCUE_UNTRIED);
+    unsigned long long runs;
+    HOST_CHECK_EQUAL(RescueToEnd(&device, regions, &map, 64, 1024, 0, 0, &runs), RESCUE_OK);
+    CheckRescued(device, &map);
+    for (unsigned long long s : once)
+        HOST_CHECK_EQUAL(StateAt(&map, s), RESCUE_DONE);
+    for (unsigned long long s : often)
+        HOST_CHECK_EQUAL(StateAt(&map, s), RESCUE_BAD);
+    for (unsigned long long s : always)
+        HOST_CHECK_EQUAL(StateAt(&map, s), RESCUE_BAD);
+
+    // Retry: every bad sector goes back in as failed. The device has recovered the transient ones by now.
+    for (unsigned long long s : often)
+        device.failuresLeft[(size_t)s] = 0;
+    unsigned long long readsBefore = device.reads;
+    for (unsigned long long position = 0, runStart, runEnd; RescueMapFind(&map, position, RESCUE_BAD, &runStart, &runEnd); position = runEnd)
+        HOST_CHECK_EQUAL(RescueMapSet(&map, runStart, runEnd, RESCUE_FAILED), 0);
+    HOST_CHECK_EQUAL(RescueToEnd(&device, regions, &map, 64, 1024, 0, 0, &runs), RESCUE_OK);
+    CheckRescued(device, &map);
+    for (unsigned long long s : often)
+        HOST_CHECK_EQUAL(StateAt(&map, s), RESCUE_DONE);
+    HOST_CHECK_EQUAL(RescueMapTotal(&map, RESCUE_BAD), always.size());
+    // Only the single sectors that were bad are read again.
+    HOST_CHECK_EQUAL(device.reads - readsBefore, often.size() + always.size());
+}
+
+static void TestDamagedDevices() {
+    struct Layout {
+        unsigned long long sectors;
+        unsigned int chunkSectors;
+        unsigned long long maxSkipSectors;
+        int interruptions;
+    };
+    static const Layout layouts[] = {
+        { 1 << 18, 128, 1 << 14, 0 },
+        { 1 << 18, 128, 1 << 14, 6 },
+        { 1 << 18, 128, 0, 2 },
+        { 1000, 1, 4, 3 },
+        { 1000, 3, 12, 3 },
+        { 1000, 7, 28, 0 },
+        { 1000, 2000, 8000, 2 },
+    };
+    HOST_RANDOM random = { 0xD15Cull };
+    for (const Layout& layout : layouts) {
+        for (int pattern = 0; pattern < 4; pattern++) {
+            FAULTY_DEVICE device = MakeDevice(layout.sectors);
+            unsigned long long n = layout.sectors;
+            for (unsigned long long s = 0; s < n; s++) {
+                bool bad = false;
+                switch (pattern) {
+                case 0: bad = HostRandomBelow(&random, 2000) == 0; break;                      // scattered
+                case 1: bad = s >= n / 4 && s < n / 4 + n / 10; break;                         // dead zone
+                case 2: bad = s >= n / 2 && s < n / 2 + n / 8 && HostRandomBelow(&random, 4) == 0; break; // degraded zone
+                default: bad = s == 0 || s == n - 1; break;                                    // the edges
+                }
+                if (bad)
+                    device.failuresLeft[(size_t)s] = SECTOR_ALWAYS_BAD;
+                else if (HostRandomBelow(&random, 500) == 0)
+                    device.failuresLeft[(size_t)s] = 1 + HostRandomBelow(&random, 2);
+            }
+
+            std::vector<RESCUE_REGION> regions(1 << 16);
+            RESCUE_MAP map;
+            RescueMapInit(&map, regions.data(), (unsigned int)regions.size(), 0, n, RESCUE_UNTRIED);
+            unsigned long long runs;
+            int result = RescueToEnd(&device, regions, &map, layout.chunkSectors, layout.maxSkipSectors, 0, layout.interruptions, &runs);
+            HOST_CHECK_EQUAL(result, RESCUE_OK);
+            // Small devices can be done before the device gets to stop.
+            HOST_CHECK(runs >= 1 && runs <= (unsigned long long)layout.interruptions + 1);
+            CheckRescued(device, &map);
+            // Nothing is read more than a handful of times over, even through a dead zone.
+            HOST_CHECK(device.sectorsRead < 4 * n);
+        }
+    }
+}
+
+// A map too small for the damage stops the rescue with RESCUE_MAP_FULL, still consistent, and a bigger map that
+// imports it finishes the job.
+static void TestMapFull() {
+    const unsigned long long sectors = 2048;
+    FAULTY_DEVICE device = MakeDevice(sectors);
+    for (unsigned long long s = 5; s < sectors; s += 97)
+        device.failuresLeft[(size_t)s] = SECTOR_ALWAYS_BAD;
+
+    std::vector<RESCUE_REGION> regions(8);
+    RESCUE_MAP map;
+    RescueMapInit(&map, regions.data(), (unsigned int)regions.size(), 0, sectors, RESCUE_UNTRIED);
+    unsigned long long runs;
+    HOST_CHECK_EQUAL(RescueToEnd(&device, regions, &map, 16, 256, 0, 0, &runs), RESCUE_MAP_FULL);
+    HOST_CHECK_EQUAL(map.count, map.capacity);
+
+    // The read whose outcome did not fit was not recorded, so the next run does it again and stores it twice.
+    regions.resize(256);
+    HOST_CHECK_EQUAL(RescueToEnd(&device, regions, &map, 16, 256, 0, 0, &runs), RESCUE_OK);
+    HOST_CHECK(device.storedTwice <= 16);
+    device.storedTwice = 0;
+    CheckRescued(device, &map);
+    HOST_CHECK_EQUAL(RescueMapTotal(&map, RESCUE_BAD), (sectors - 5 + 96) / 97);
+}
+
+int main() {
+    TestMapOperations();
+    TestTracedRescue();
+    TestTransientFailures();
+    TestDamagedDevices();
+    TestMapFull();
+    return HostTestResult("RescueMapTest");
+}
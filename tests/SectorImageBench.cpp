@@ -0,0 +1,82 @@
+// LZ4 block and image pipeline throughput over disk-like data, and random single-sector read latency from an image.
+#include "Lz4Block.hpp"
+#include "SectorImage.hpp"
+#include "HostTest.hpp"
+#include "HostBench.hpp"
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#define BENCH_IMAGE_PATH "SectorImageBench.sio"
+
+// A quarter each of zero, random, text and structured 4K blocks, roughly what a used NTFS volume looks like to LZ4.
+static void FillDiskLike(std::vector<unsigned char>& data) {
+    static const char text[] = "The quick brown fox jumps over the lazy dog. ";
+    HOST_RANDOM random = { 0x1A4ull };
+    for (size_t i = 0; i < data.size(); i++) {
+        switch (i / 4096 % 4) {
+        case 0: data[i] = 0; break;
+        case 1: data[i] = (unsigned char)HostRandomNext(&random); break;
+        case 2: data[i] = (unsigned char)text[i % (sizeof(text) - 1)]; break;
+        default: data[i] = (unsigned char)(i / 64); break;
+        }
+    }
+}
+
+static int MemoryRead(void* context, unsigned long long offset, void* buffer, size_t length) {
+    memcpy(buffer, (const unsigned char*)context + offset, length);
+    return 0;
+}
+
+int main() {
+    std::vector<unsigned char> data(64 << 20);
+    FillDiskLike(data);
+
+    const size_t blockBytes = 1 << 20;
+    std::vector<unsigned char> compressed(Lz4CompressBound(blockBytes)), decoded(blockBytes);
+    size_t storedBytes = 0;
+    HostBenchReport("lz4 compress, 1 MiB blocks", data.size(), HostBenchSeconds([&] {
+        storedBytes = 0;
+        for (size_t offset = 0; offset < data.size(); offset += blockBytes)
+            storedBytes += Lz4Compress(&data[offset], blockBytes, compressed.data(), compressed.size());
+    }));
+    printf("%-40s %10.3f\n", "lz4 ratio", (double)storedBytes / data.size());
+    size_t blockLength = Lz4Compress(data.data(), blockBytes, compressed.data(), compressed.size());
+    HostBenchReport("lz4 decompress, 1 MiB block", 64 * blockBytes, HostBenchSeconds([&] {
+        for (int i = 0; i < 64; i++)
+            g_hostBenchSink += Lz4Decompress(compressed.data(), blockLength, decoded.data(), decoded.size());
+    }));
+
+    IMAGE_SOURCE source;
+    memset(&source, 0, sizeof(source));
+    source.read = MemoryRead;
+    source.context = data.data();
+    source.totalBytes = data.size();
+    source.sectorSize = 512;
+    unsigned int processors = std::thread::hardware_concurrency();
+    for (unsigned int threads : { 1u, processors ? processors : 1u }) {
+        IMAGE_WRITE_OPTIONS options = { 0, threads, IMAGE_CODEC_LZ4 };
+        char name[64];
+        snprintf(name, sizeof(name), "image write, %u thread(s)", threads);
+        HostBenchReport(name, data.size(), HostBenchSeconds([&] { g_hostBenchSink += ImageWrite(BENCH_IMAGE_PATH, &source, &options, NULL); }));
+        if (threads == processors)
+            break;
+    }
+
+    PIMAGE_READER reader;
+    if (ImageReaderOpen(BENCH_IMAGE_PATH, &reader) == IMAGE_OK) {
+        HostBenchReport("image verify", data.size(), HostBenchSeconds([&] { g_hostBenchSink += ImageVerify(reader, NULL); }));
+        const unsigned int reads = 20000;
+        unsigned long long totalSectors = data.size() / 512;
+        unsigned char sector[512];
+        HOST_RANDOM random = { 0x5EEDull };
+        double seconds = HostBenchSeconds([&] {
+            for (unsigned int i = 0; i < reads; i++)
+                g_hostBenchSink += ImageReadSectors(reader, HostRandomNext(&random) % totalSectors, 1, sector);
+        });
+        printf("%-40s %10.1f us\n", "image random sector read", seconds / reads * 1e6);
+        ImageReaderClose(reader);
+    }
+    remove(BENCH_IMAGE_PATH);
+    return 0;
+}
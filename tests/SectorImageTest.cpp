@@ -0,0 +1,345 @@
+// Writes images from an in-memory source and checks their layout, sector reads against the source, and that damage
+// to any part of the file is detected.
+#include "SectorImage.hpp"
+#include "Digest.hpp"
+#include "HostTest.hpp"
+#include <stddef.h>
+#include <string.h>
+#include <vector>
+
+#define TEST_IMAGE_PATH "SectorImageTest.sio"
+
+typedef struct _MEMORY_SOURCE {
+    std::vector<unsigned char> bytes;
+    unsigned long long unallocatedStart;    // isAllocated reports [unallocatedStart, unallocatedEnd) as unused
+    unsigned long long unallocatedEnd;
+    long long failingOffset;                // reads covering this byte fail; -1 for none
+    unsigned long long lastReadEnd;         // reads must come in ascending order
+    bool outOfOrder;
+} MEMORY_SOURCE;
+
+static int MemoryRead(void* context, unsigned long long offset, void* buffer, size_t length) {
+    MEMORY_SOURCE* source = (MEMORY_SOURCE*)context;
+    if (offset < source->lastReadEnd)
+        source->outOfOrder = true;
+    source->lastReadEnd = offset + length;
+    if (offset > source->bytes.size() || length > source->bytes.size() - offset)
+        return -1;
+    if (source->failingOffset >= 0 && (unsigned long long)source->failingOffset >= offset && (unsigned long long)source->failingOffset < offset + length)
+        return -1;
+    memcpy(buffer, &source->bytes[(size_t)offset], length);
+    return 0;
+}
+
+static int MemoryIsAllocated(void* context, unsigned long long offset, size_t length) {
+    MEMORY_SOURCE* source = (MEMORY_SOURCE*)context;
+    return !(offset >= source->unallocatedStart && offset + length <= source->unallocatedEnd);
+}
+
+static IMAGE_SOURCE SourceOver(MEMORY_SOURCE* memory, unsigned int sectorSize) {
+    IMAGE_SOURCE source;
+    memset(&source, 0, sizeof(source));
+    source.read = MemoryRead;
+    source.isAllocated = MemoryIsAllocated;
+    source.context = memory;
+    source.totalBytes = memory->bytes.size();
+    source.sectorSize = sectorSize;
+    memory->lastReadEnd = 0;
+    memory->outOfOrder = false;
+    return source;
+}
+
+// Chunks 0-1 zero, 2 random, 3 text, 4-5 unallocated (filled with junk that must not be stored), 6 a mix, and a short
+// last chunk of text.
+static MEMORY_SOURCE MakeSource(unsigned int chunkBytes, unsigned int lastChunkBytes) {
+    MEMORY_SOURCE memory;
+    memory.bytes.assign((size_t)chunkBytes * 7 + lastChunkBytes, 0);
+    HOST_RANDOM random = { 0x5EC7ull };
+    unsigned char* chunk = memory.bytes.data();
+    HostRandomFill(&random, chunk + 2 * chunkBytes, chunkBytes);
+    for (size_t i = 0; i < chunkBytes; i++)
+        chunk[3 * chunkBytes + i] = (unsigned char)"SectorImage chunk text "[i % 23];
+    HostRandomFill(&random, chunk + 4 * chunkBytes, 2 * chunkBytes);
+    for (size_t i = 0; i < chunkBytes; i++)
+        chunk[6 * chunkBytes + i] = i % 4096 < 2048 ? (unsigned char)(i / 512) : (unsigned char)HostRandomNext(&random);
+    for (size_t i = 0; i < lastChunkBytes; i++)
+        chunk[7 * chunkBytes + i] = (unsigned char)"tail "[i % 5];
+    memory.unallocatedStart = 4ull * chunkBytes;
+    memory.unallocatedEnd = 6ull * chunkBytes;
+    memory.failingOffset = -1;
+    return memory;
+}
+
+static std::vector<unsigned char> ReadFile(const char* path) {
+    std::vector<unsigned char> bytes;
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return bytes;
+    unsigned char buffer[65536];
+    size_t got;
+    while ((got = fread(buffer, 1, sizeof(buffer), file)) != 0)
+        bytes.insert(bytes.end(), buffer, buffer + got);
+    fclose(file);
+    return bytes;
+}
+
+static void WriteFile(const char* path, const std::vector<unsigned char>& bytes) {
+    FILE* file = fopen(path, "wb");
+    fwrite(bytes.data(), 1, bytes.size(), file);
+    fclose(file);
+}
+
+// Opens the image at path and compares every sector, and some multi-sector spans across chunk borders, to expected.
+static void CheckContents(const char* path, const std::vector<unsigned char>& expected, unsigned int sectorSize) {
+    PIMAGE_READER reader;
+    HOST_CHECK_EQUAL(ImageReaderOpen(path, &reader), IMAGE_OK);
+    if (!reader)
+        return;
+    HOST_CHECK_EQUAL(ImageVerify(reader, NULL), IMAGE_OK);
+
+    unsigned long long totalSectors = expected.size() / sectorSize;
+    std::vector<unsigned char> buffer(expected.size());
+    HOST_CHECK_EQUAL(ImageReadSectors(reader, 0, totalSectors, buffer.data()), IMAGE_OK);
+    HOST_CHECK(memcmp(buffer.data(), expected.data(), expected.size()) == 0);
+
+    HOST_RANDOM random = { 0x2EADull };
+    for (int i = 0; i < 500; i++) {
+        unsigned long long lba = HostRandomNext(&random) % totalSectors;
+        unsigned long long count = 1 + HostRandomNext(&random) % (totalSectors - lba < 300 ? totalSectors - lba : 300);
+        HOST_CHECK_EQUAL(ImageReadSectors(reader, lba, count, buffer.data()), IMAGE_OK);
+        HOST_CHECK(memcmp(buffer.data(), &expected[(size_t)(lba * sectorSize)], (size_t)(count * sectorSize)) == 0);
+    }
+
+    HOST_CHECK_EQUAL(ImageReadSectors(reader, totalSectors, 0, buffer.data()), IMAGE_OK);
+    HOST_CHECK_EQUAL(ImageReadSectors(reader, totalSectors, 1, buffer.data()), IMAGE_ERROR_RANGE);
+    HOST_CHECK_EQUAL(ImageReadSectors(reader, totalSectors - 1, 2, buffer.data()), IMAGE_ERROR_RANGE);
+    HOST_CHECK_EQUAL(ImageReadSectors(reader, ~0ull, 2, buffer.data()), IMAGE_ERROR_RANGE);
+    ImageReaderClose(reader);
+}
+
+static void TestLayout() {
+    const unsigned int chunkBytes = 64 * 1024, lastChunkBytes = 3 * 512;
+    MEMORY_SOURCE memory = MakeSource(chunkBytes, lastChunkBytes);
+    IMAGE_SOURCE source = SourceOver(&memory, 512);
+    IMAGE_WRITE_OPTIONS options = { chunkBytes, 3, IMAGE_CODEC_LZ4 };
+    IMAGE_WRITE_STATS stats;
+    HOST_CHECK_EQUAL(ImageWrite(TEST_IMAGE_PATH, &source, &options, &stats), IMAGE_OK);
+    HOST_CHECK(!memory.outOfOrder);
+    HOST_CHECK_EQUAL(stats.zeroChunks, 2);
+    HOST_CHECK_EQUAL(stats.unallocatedChunks, 2);
+    HOST_CHECK_EQUAL(stats.rawChunks, 1);
+    HOST_CHECK_EQUAL(stats.compressedChunks, 3);
+    HOST_CHECK_EQUAL(stats.bytesRead, memory.bytes.size() - 2ull * chunkBytes);
+
+    // The file is header, stored chunks in order, index, trailer, with every offset as documented.
+    std::vector<unsigned char> file = ReadFile(TEST_IMAGE_PATH);
+    HOST_CHECK(file.size() > sizeof(IMAGE_HEADER) + sizeof(IMAGE_TRAILER));
+    IMAGE_HEADER header;
+    IMAGE_TRAILER trailer;
+    memcpy(&header, file.data(), sizeof(header));
+    memcpy(&trailer, &file[file.size() - sizeof(trailer)], sizeof(trailer));
+    HOST_CHECK(memcmp(header.magic, IMAGE_MAGIC, 8) == 0 && memcmp(trailer.magic, IMAGE_TRAILER_MAGIC, 8) == 0);
+    HOST_CHECK_EQUAL(header.version, IMAGE_VERSION);
+    HOST_CHECK_EQUAL(header.chunkBytes, chunkBytes);
+    HOST_CHECK_EQUAL(header.sectorSize, 512);
+    HOST_CHECK_EQUAL(header.codec, IMAGE_CODEC_LZ4);
+    HOST_CHECK_EQUAL(header.totalBytes, memory.bytes.size());
+    HOST_CHECK_EQUAL(header.chunkCount, 8);
+    HOST_CHECK_EQUAL(trailer.chunkCount, 8);
+    HOST_CHECK_EQUAL(trailer.indexOffset + 8 * sizeof(IMAGE_CHUNK_ENTRY), file.size() - sizeof(trailer));
+
+    static const unsigned char expectedTypes[8] = {
+        IMAGE_CHUNK_ZERO, IMAGE_CHUNK_ZERO, IMAGE_CHUNK_RAW, IMAGE_CHUNK_LZ4,
+        IMAGE_CHUNK_UNALLOCATED, IMAGE_CHUNK_UNALLOCATED, IMAGE_CHUNK_LZ4, IMAGE_CHUNK_LZ4,
+    };
+    unsigned long long nextOffset = sizeof(IMAGE_HEADER);
+    for (int i = 0; i < 8; i++) {
+        IMAGE_CHUNK_ENTRY entry;
+        memcpy(&entry, &file[(size_t)trailer.indexOffset + i * sizeof(entry)], sizeof(entry));
+        HOST_CHECK_EQUAL(entry.type, expectedTypes[i]);
+        if (entry.type == IMAGE_CHUNK_RAW || entry.type == IMAGE_CHUNK_LZ4) {
+            HOST_CHECK_EQUAL(entry.fileOffset, nextOffset);
+            HOST_CHECK(entry.hash != 0);
+            nextOffset += entry.storedBytes;
+        }
+        else {
+            HOST_CHECK(entry.fileOffset == 0 && entry.storedBytes == 0 && entry.hash == 0);
+        }
+        if (entry.type == IMAGE_CHUNK_RAW)
+            HOST_CHECK_EQUAL(entry.storedBytes, chunkBytes);
+        if (entry.type == IMAGE_CHUNK_LZ4)
+            HOST_CHECK(entry.storedBytes < (i == 7 ? lastChunkBytes : chunkBytes));
+    }
+    HOST_CHECK_EQUAL(nextOffset, trailer.indexOffset);
+    HOST_CHECK_EQUAL(stats.bytesStored, trailer.indexOffset - sizeof(IMAGE_HEADER));
+
+    // Unallocated chunks read back as zeros, not as what the source held.
+    std::vector<unsigned char> expected = memory.bytes;
+    memset(&expected[4 * chunkBytes], 0, 2 * chunkBytes);
+    CheckContents(TEST_IMAGE_PATH, expected, 512);
+}
+
+static void TestOptions() {
+    // Raw codec, 4K sectors, a chunk size that is not a power of two, and a source that is an exact number of chunks.
+    const unsigned int chunkBytes = 12 * 4096;
+    MEMORY_SOURCE memory = MakeSource(chunkBytes, 0);
+    memory.unallocatedEnd = memory.unallocatedStart;
+    IMAGE_SOURCE source = SourceOver(&memory, 4096);
+    IMAGE_WRITE_OPTIONS options = { chunkBytes, 1, IMAGE_CODEC_NONE };
+    IMAGE_WRITE_STATS stats;
+    HOST_CHECK_EQUAL(ImageWrite(TEST_IMAGE_PATH, &source, &options, &stats), IMAGE_OK);
+    HOST_CHECK_EQUAL(stats.compressedChunks, 0);
+    HOST_CHECK_EQUAL(stats.rawChunks, 5);
+    HOST_CHECK_EQUAL(stats.zeroChunks, 2);
+    CheckContents(TEST_IMAGE_PATH, memory.bytes, 4096);
+
+    // Many threads on many small chunks still write them in order.
+    const unsigned int smallChunk = IMAGE_MIN_CHUNK_BYTES;
+    MEMORY_SOURCE many = MakeSource(smallChunk * 37, 512);
+    source = SourceOver(&many, 512);
+    options = { smallChunk, 8, IMAGE_CODEC_LZ4 };
+    HOST_CHECK_EQUAL(ImageWrite(TEST_IMAGE_PATH, &source, &options, &stats), IMAGE_OK);
+    HOST_CHECK(!many.outOfOrder);
+    std::vector<unsigned char> expected = many.bytes;
+    memset(&expected[(size_t)many.unallocatedStart], 0, (size_t)(many.unallocatedEnd - many.unallocatedStart));
+    CheckContents(TEST_IMAGE_PATH, expected, 512);
+
+    // An empty source gives an empty but valid image.
+    MEMORY_SOURCE empty;
+    empty.unallocatedStart = empty.unallocatedEnd = 0;
+    empty.failingOffset = -1;
+    source = SourceOver(&empty, 512);
+    HOST_CHECK_EQUAL(ImageWrite(TEST_IMAGE_PATH, &source, NULL, NULL), IMAGE_OK);
+    PIMAGE_READER reader;
+    HOST_CHECK_EQUAL(ImageReaderOpen(TEST_IMAGE_PATH, &reader), IMAGE_OK);
+    if (reader) {
+        HOST_CHECK_EQUAL(ImageReaderHeader(reader)->chunkCount, 0);
+        HOST_CHECK_EQUAL(ImageVerify(reader, NULL), IMAGE_OK);
+        ImageReaderClose(reader);
+    }
+}
+
+static void TestParameters() {
+    MEMORY_SOURCE memory = MakeSource(IMAGE_MIN_CHUNK_BYTES, 512);
+    IMAGE_SOURCE source = SourceOver(&memory, 512);
+    IMAGE_WRITE_OPTIONS options = { IMAGE_MIN_CHUNK_BYTES / 2, 1, IMAGE_CODEC_LZ4 };
+    HOST_CHECK_EQUAL(ImageWrite(TEST_IMAGE_PATH, &source, &options, NULL), IMAGE_ERROR_PARAMETER);
+    options.chunkBytes = IMAGE_MIN_CHUNK_BYTES + 100;
+    HOST_CHECK_EQUAL(ImageWrite(TEST_IMAGE_PATH, &source, &options, NULL), IMAGE_ERROR_PARAMETER);
+    options.chunkBytes = IMAGE_MIN_CHUNK_BYTES;
+    options.codec = (IMAGE_CODEC)7;
+    HOST_CHECK_EQUAL(ImageWrite(TEST_IMAGE_PATH, &source, &options, NULL), IMAGE_ERROR_PARAMETER);
+    options.codec = IMAGE_CODEC_LZ4;
+    source.totalBytes -= 1;
+    HOST_CHECK_EQUAL(ImageWrite(TEST_IMAGE_PATH, &source, &options, NULL), IMAGE_ERROR_PARAMETER);
+
+    // A failing source read fails the write, and leaves no image that opens.
+    memory.failingOffset = (long long)(3 * IMAGE_MIN_CHUNK_BYTES + 7);
+    source = SourceOver(&memory, 512);
+    HOST_CHECK_EQUAL(ImageWrite(TEST_IMAGE_PATH, &source, &options, NULL), IMAGE_ERROR_SOURCE);
+    PIMAGE_READER reader;
+    HOST_CHECK(ImageReaderOpen(TEST_IMAGE_PATH, &reader) != IMAGE_OK);
+    HOST_CHECK(reader == NULL);
+
+    HOST_CHECK_EQUAL(ImageReaderOpen("SectorImageTest.missing", &reader), IMAGE_ERROR_IO);
+}
+
+// Damage to the header, a chunk, the index or the trailer, and truncation anywhere, is refused at open or reported by
+// verify; nothing reads back wrong data.
+static void TestDamage() {
+    const unsigned int chunkBytes = IMAGE_MIN_CHUNK_BYTES * 4;
+    MEMORY_SOURCE memory = MakeSource(chunkBytes, 1024);
+    IMAGE_SOURCE source = SourceOver(&memory, 512);
+    IMAGE_WRITE_OPTIONS options = { chunkBytes, 2, IMAGE_CODEC_LZ4 };
+    HOST_CHECK_EQUAL(ImageWrite(TEST_IMAGE_PATH, &source, &options, NULL), IMAGE_OK);
+    std::vector<unsigned char> good = ReadFile(TEST_IMAGE_PATH);
+    IMAGE_TRAILER trailer;
+    memcpy(&trailer, &good[good.size() - sizeof(trailer)], sizeof(trailer));
+    std::vector<unsigned char> expected = memory.bytes;
+    memset(&expected[(size_t)memory.unallocatedStart], 0, (size_t)(memory.unallocatedEnd - memory.unallocatedStart));
+
+    std::vector<unsigned char> damaged = good;
+    damaged[0] ^= 1;
+    WriteFile(TEST_IMAGE_PATH, damaged);
+    PIMAGE_READER reader;
+    HOST_CHECK_EQUAL(ImageReaderOpen(TEST_IMAGE_PATH, &reader), IMAGE_ERROR_FORMAT);
+
+    damaged = good;
+    damaged[offsetof(IMAGE_HEADER, totalBytes)] ^= 1;
+    WriteFile(TEST_IMAGE_PATH, damaged);
+    HOST_CHECK_EQUAL(ImageReaderOpen(TEST_IMAGE_PATH, &reader), IMAGE_ERROR_CORRUPT);
+
+    damaged = good;
+    damaged[(size_t)trailer.indexOffset + offsetof(IMAGE_CHUNK_ENTRY, storedBytes)] ^= 1;
+    WriteFile(TEST_IMAGE_PATH, damaged);
+    HOST_CHECK_EQUAL(ImageReaderOpen(TEST_IMAGE_PATH, &reader), IMAGE_ERROR_CORRUPT);
+
+    damaged = good;
+    damaged[damaged.size() - 1] ^= 1;
+    WriteFile(TEST_IMAGE_PATH, damaged);
+    HOST_CHECK_EQUAL(ImageReaderOpen(TEST_IMAGE_PATH, &reader), IMAGE_ERROR_FORMAT);
+
+    for (size_t cut : { (size_t)0, sizeof(IMAGE_HEADER), (size_t)trailer.indexOffset, good.size() - 1 }) {
+        damaged.assign(good.begin(), good.begin() + cut);
+        WriteFile(TEST_IMAGE_PATH, damaged);
+        HOST_CHECK_EQUAL(ImageReaderOpen(TEST_IMAGE_PATH, &reader), IMAGE_ERROR_FORMAT);
+    }
+
+    // A flipped bit in each stored chunk is pinned on that chunk, by verify and by reads that touch it.
+    for (unsigned long long chunk = 0; chunk < 8; chunk++) {
+        IMAGE_CHUNK_ENTRY entry;
+        memcpy(&entry, &good[(size_t)(trailer.indexOffset + chunk * sizeof(entry))], sizeof(entry));
+        if (!entry.storedBytes)
+            continue;
+        damaged = good;
+        damaged[(size_t)(entry.fileOffset + entry.storedBytes / 2)] ^= 0x10;
+        WriteFile(TEST_IMAGE_PATH, damaged);
+        HOST_CHECK_EQUAL(ImageReaderOpen(TEST_IMAGE_PATH, &reader), IMAGE_OK);
+        if (!reader)
+            continue;
+        unsigned long long badChunk = ~0ull;
+        HOST_CHECK_EQUAL(ImageVerify(reader, &badChunk), IMAGE_ERROR_CORRUPT);
+        HOST_CHECK_EQUAL(badChunk, chunk);
+
+        unsigned long long sectorsPerChunk = chunkBytes / 512;
+        std::vector<unsigned char> buffer(chunkBytes);
+        HOST_CHECK_EQUAL(ImageReadSectors(reader, chunk * sectorsPerChunk, 1, buffer.data()), IMAGE_ERROR_CORRUPT);
+        if (chunk) {
+            HOST_CHECK_EQUAL(ImageReadSectors(reader, (chunk - 1) * sectorsPerChunk, 1, buffer.data()), IMAGE_OK);
+            HOST_CHECK(memcmp(buffer.data(), &expected[(size_t)((chunk - 1) * chunkBytes)], 512) == 0);
+        }
+        ImageReaderClose(reader);
+    }
+
+    // Two whole index entries swapped, with the index hash redone to match, still fail: a chunk's hash is seeded with
+    // its number, so a chunk that ended up at the wrong place does not verify.
+    IMAGE_CHUNK_ENTRY raw, text;
+    memcpy(&raw, &good[(size_t)(trailer.indexOffset + 2 * sizeof(raw))], sizeof(raw));
+    memcpy(&text, &good[(size_t)(trailer.indexOffset + 3 * sizeof(text))], sizeof(text));
+    HOST_CHECK(raw.type == IMAGE_CHUNK_RAW && text.type == IMAGE_CHUNK_LZ4);
+    damaged = good;
+    memcpy(&damaged[(size_t)(trailer.indexOffset + 2 * sizeof(raw))], &text, sizeof(text));
+    memcpy(&damaged[(size_t)(trailer.indexOffset + 3 * sizeof(text))], &raw, sizeof(raw));
+    XXH64_STATE state;
+    Xxh64Init(&state, 0);
+    Xxh64Update(&state, &damaged[(size_t)trailer.indexOffset], 8 * sizeof(IMAGE_CHUNK_ENTRY));
+    trailer.indexHash = Xxh64Final(&state);
+    memcpy(&damaged[damaged.size() - sizeof(trailer)], &trailer, sizeof(trailer));
+    WriteFile(TEST_IMAGE_PATH, damaged);
+    HOST_CHECK_EQUAL(ImageReaderOpen(TEST_IMAGE_PATH, &reader), IMAGE_OK);
+    if (reader) {
+        unsigned long long badChunk = ~0ull;
+        HOST_CHECK_EQUAL(ImageVerify(reader, &badChunk), IMAGE_ERROR_CORRUPT);
+        HOST_CHECK_EQUAL(badChunk, 2);
+        ImageReaderClose(reader);
+    }
+}
+
+int main() {
+    TestLayout();
+    TestOptions();
+    TestParameters();
+    TestDamage();
+    remove(TEST_IMAGE_PATH);
+    return HostTestResult("SectorImageTest");
+}
@@ -0,0 +1,208 @@
+// The QoS limiter's token bucket arithmetic, and its rate and burst limits under many consumers contending for one
+// limiter: first on a simulated clock, where the limits have to hold exactly, then with real threads.
+#include "TokenBucket.hpp"
+#include "HostTest.hpp"
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static const unsigned long long T = TOKEN_BUCKET_TICKS_PER_SECOND;
+
+static void TestArithmetic() {
+    TOKEN_BUCKET bucket;
+    TokenBucketInit(&bucket, 1000, 0, 0);
+    HOST_CHECK_EQUAL(bucket.burst, 1000);
+    HOST_CHECK(TokenBucketCanConsume(&bucket, 1000));
+    TokenBucketConsume(&bucket, 1000);
+    HOST_CHECK(!TokenBucketCanConsume(&bucket, 1));
+    // One token per millisecond, rounded up to whole ticks.
+    HOST_CHECK_EQUAL(TokenBucketWaitTime(&bucket, 1), T / 1000);
+    HOST_CHECK_EQUAL(TokenBucketWaitTime(&bucket, 250), T / 4);
+    TokenBucketRefill(&bucket, T / 4);
+    HOST_CHECK(TokenBucketCanConsume(&bucket, 250));
+    HOST_CHECK(!TokenBucketCanConsume(&bucket, 251));
+
+    // Refill is capped at the burst, also after an idle period long enough to overflow an unchecked product.
+    TokenBucketRefill(&bucket, ~0ull);
+    HOST_CHECK_EQUAL(bucket.scaledTokens, 1000 * T);
+
+    // An unlimited bucket admits anything and never waits.
+    TokenBucketInit(&bucket, 0, 0, 0);
+    HOST_CHECK(TokenBucketCanConsume(&bucket, ~0ull));
+    HOST_CHECK_EQUAL(TokenBucketWaitTime(&bucket, ~0ull), 0);
+
+    // A request above the burst waits for a full bucket, then leaves it in debt for its excess.
+    TokenBucketInit(&bucket, 100, 50, 0);
+    HOST_CHECK(TokenBucketCanConsume(&bucket, 400));
+    TokenBucketConsume(&bucket, 400);
+    HOST_CHECK_EQUAL(TokenBucketWaitTime(&bucket, 400), 4 * T);
+    HOST_CHECK_EQUAL(TokenBucketWaitTime(&bucket, 1), 35 * T / 10 + T / 100);
+
+    // Huge rates and bursts saturate instead of wrapping.
+    TokenBucketInit(&bucket, ~0ull >> 1, ~0ull >> 1, 0);
+    HOST_CHECK(bucket.scaledTokens > 0);
+    HOST_CHECK(TokenBucketCanConsume(&bucket, 1ull << 40));
+}
+
+// The limiter as QosTryConsume drives it: an IOPS and a byte bucket, both refilled and both charged together.
+typedef struct _HOST_LIMITER {
+    TOKEN_BUCKET iops;
+    TOKEN_BUCKET bytes;
+    unsigned long long admittedIos;
+    unsigned long long admittedBytes;
+} HOST_LIMITER;
+
+static bool LimiterTryConsume(HOST_LIMITER* limiter, unsigned long long now, unsigned long long length, unsigned long long* pWait) {
+    TokenBucketRefill(&limiter->iops, now);
+    TokenBucketRefill(&limiter->bytes, now);
+    *pWait = std::max(TokenBucketWaitTime(&limiter->iops, 1), TokenBucketWaitTime(&limiter->bytes, length));
+    if (*pWait)
+        return false;
+    TokenBucketConsume(&limiter->iops, 1);
+    TokenBucketConsume(&limiter->bytes, length);
+    limiter->admittedIos++;
+    limiter->admittedBytes += length;
+    return true;
+}
+
+typedef struct _ADMISSION {
+    unsigned long long time;
+    unsigned long long length;
+} ADMISSION;
+
+typedef struct _LIMITS {
+    unsigned long long iopsRate;
+    unsigned long long iopsBurst;
+    unsigned long long byteRate;
+    unsigned long long byteBurst;
+    unsigned long long maxLength;   // largest request; anything above the byte burst may go into debt by its excess
+} LIMITS;
+
+// Whatever was admitted in any window starting at an admission cannot exceed the burst, what the window refilled,
+// and the debt one oversized request may leave. Compared in ticks so there is no rounding.
+static void CheckWindows(const std::vector<ADMISSION>& admissions, const LIMITS& limits) {
+    unsigned long long debt = limits.maxLength > limits.byteBurst ? limits.maxLength - limits.byteBurst : 0;
+    size_t stride = std::max<size_t>(1, admissions.size() / 200);
+    for (size_t start = 0; start < admissions.size(); start += stride) {
+        unsigned long long bytes = 0, ios = 0;
+        for (size_t end = start; end < admissions.size(); end++) {
+            unsigned long long elapsed = admissions[end].time - admissions[start].time;
+            bytes += admissions[end].length;
+            ios++;
+            if (bytes * T > (limits.byteBurst + debt) * T + limits.byteRate * elapsed ||
+                ios * T > limits.iopsBurst * T + limits.iopsRate * elapsed) {
+                fprintf(stderr, "window of %llu ticks from admission %zu: %llu bytes, %llu I/Os\n", elapsed, start, bytes, ios);
+                HOST_CHECK(!"rate or burst exceeded");
+                return;
+            }
+        }
+    }
+}
+
+static void InitLimiter(HOST_LIMITER* limiter, const LIMITS& limits, unsigned long long now) {
+    TokenBucketInit(&limiter->iops, limits.iopsRate, limits.iopsBurst, now);
+    TokenBucketInit(&limiter->bytes, limits.byteRate, limits.byteBurst, now);
+    limiter->admittedIos = 0;
+    limiter->admittedBytes = 0;
+}
+
+static const LIMITS g_scenarios[] = {
+    { 100000, 10000, 50ull << 20, 12ull << 20, 1ull << 20 },    // bytes bind
+    { 2000, 200, 1ull << 30, 1ull << 28, 1ull << 20 },          // IOPS bind
+    { 100000, 10000, 1ull << 20, 256ull << 10, 1ull << 20 },    // requests up to four times the byte burst
+};
+
+// Consumers issue back to back; the next one to run is whichever becomes ready first, as the waiter queue would pick.
+static void TestSimulatedContention() {
+    const int consumers = 16;
+    for (const LIMITS& limits : g_scenarios) {
+        HOST_RANDOM random = { 0x70CE7ull + limits.byteRate };
+        HOST_LIMITER limiter;
+        InitLimiter(&limiter, limits, 0);
+        std::vector<unsigned long long> readyAt(consumers, 0);
+        std::vector<unsigned long long> length(consumers);
+        for (auto& value : length)
+            value = (1 + HostRandomBelow(&random, (unsigned int)(limits.maxLength / 4096))) * 4096;
+
+        std::vector<ADMISSION> admissions;
+        unsigned long long horizon = 30 * T;
+        unsigned long long now = 0;
+        while (now < horizon) {
+            int next = (int)(std::min_element(readyAt.begin(), readyAt.end()) - readyAt.begin());
+            now = readyAt[next];
+            unsigned long long wait;
+            if (!LimiterTryConsume(&limiter, now, length[next], &wait)) {
+                readyAt[next] = now + wait;
+                continue;
+            }
+            admissions.push_back({ now, length[next] });
+            readyAt[next] = now + 1000;
+            length[next] = (1 + HostRandomBelow(&random, (unsigned int)(limits.maxLength / 4096))) * 4096;
+        }
+        CheckWindows(admissions, limits);
+
+        // Saturated consumers get the configured rate of whichever bucket binds; CheckWindows bounds it from above.
+        double seconds = (double)now / T;
+        double byteShare = limiter.admittedBytes / seconds / limits.byteRate;
+        double iopsShare = limiter.admittedIos / seconds / limits.iopsRate;
+        HOST_CHECK(std::max(byteShare, iopsShare) > 0.98);
+    }
+}
+
+static unsigned long long HostTicks() {
+    return (unsigned long long)(std::chrono::steady_clock::now().time_since_epoch().count() /
+        (std::chrono::steady_clock::period::den / std::chrono::steady_clock::period::num / T));
+}
+
+// Real threads spinning on one locked limiter and sleeping for the wait it reports, like QosAdmit's head waiter.
+// Scheduling noise can only cost throughput, so the limits are still checked exactly and the throughput loosely.
+static void TestThreadedContention() {
+    const int consumers = 8;
+    const unsigned long long duration = T / 2;
+    for (const LIMITS& limits : g_scenarios) {
+        std::mutex lock;
+        std::vector<ADMISSION> admissions;
+        HOST_LIMITER limiter;
+        unsigned long long start = HostTicks();
+        InitLimiter(&limiter, limits, start);
+
+        std::vector<std::thread> threads;
+        for (int i = 0; i < consumers; i++) {
+            threads.emplace_back([&, i] {
+                HOST_RANDOM random = { 0x7E4Dull + i };
+                unsigned long long length = (1 + HostRandomBelow(&random, (unsigned int)(limits.maxLength / 4096))) * 4096;
+                for (;;) {
+                    unsigned long long wait;
+                    {
+                        std::lock_guard<std::mutex> guard(lock);
+                        unsigned long long now = HostTicks();
+                        if (now - start >= duration)
+                            return;
+                        if (LimiterTryConsume(&limiter, now, length, &wait)) {
+                            admissions.push_back({ now, length });
+                            length = (1 + HostRandomBelow(&random, (unsigned int)(limits.maxLength / 4096))) * 4096;
+                            continue;
+                        }
+                    }
+                    std::this_thread::sleep_for(std::chrono::microseconds(std::min<unsigned long long>(wait / 10, 1000)));
+                }
+            });
+        }
+        for (auto& thread : threads)
+            thread.join();
+
+        CheckWindows(admissions, limits);
+        double seconds = (double)duration / T;
+        double share = std::max(limiter.admittedBytes / seconds / limits.byteRate, limiter.admittedIos / seconds / limits.iopsRate);
+        HOST_CHECK(share > 0.5);
+    }
+}
+
+int main() {
+    TestArithmetic();
+    TestSimulatedContention();
+    TestThreadedContention();
+    return HostTestResult("TokenBucketTest");
+}
@@ -0,0 +1,48 @@
+// Items per second through the host work pool, with and without stealing, for load spread over every processor and
+// for load submitted from one processor only.
+#include "WorkPoolShim.hpp"
+#include "HostTest.hpp"
+#include <chrono>
+
+static void SpinRoutine(PHOST_WORK_ITEM pItem) {
+    auto end = std::chrono::steady_clock::now() + std::chrono::microseconds((size_t)pItem->context);
+    while (std::chrono::steady_clock::now() < end) {
+    }
+}
+
+static void NoCompletion(PHOST_WORK_ITEM pItem) {
+    (void)pItem;
+}
+
+static void Bench(unsigned int cpus, bool stealing, bool skewed, unsigned int microseconds, unsigned int count) {
+    std::vector<HOST_WORK_ITEM> items(count);
+    auto start = std::chrono::steady_clock::now();
+    unsigned long long stolen = 0;
+    {
+        HostWorkPool pool(cpus, 2, stealing);
+        for (unsigned int i = 0; i < count; i++) {
+            items[i].routine = SpinRoutine;
+            items[i].completionRoutine = NoCompletion;
+            items[i].context = (void*)(size_t)microseconds;
+            pool.Submit(&items[i], skewed ? 0 : i % cpus);
+        }
+        pool.Shutdown();
+        for (unsigned int cpu = 0; cpu < cpus; cpu++)
+            stolen += pool.Cpu(cpu).stolen;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("%u workers %-9s %-9s %3u us items: %9.0f items/s, %llu stolen\n", cpus, stealing ? "stealing" : "no-steal",
+        skewed ? "skewed" : "balanced", microseconds, count / seconds, stolen);
+}
+
+int main() {
+    unsigned int cpus = std::max(2u, std::min(16u, std::thread::hardware_concurrency()));
+    for (unsigned int microseconds : { 0u, 20u }) {
+        unsigned int count = microseconds ? 20000 : 400000;
+        for (bool skewed : { false, true }) {
+            Bench(cpus, false, skewed, microseconds, count);
+            Bench(cpus, true, skewed, microseconds, count);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,272 @@
+#pragma once
+// Host stand-in for WorkPool.cpp: the same per-processor FIFOs, depth snapshots, victim choice, idle handshake and
+// completion delivery, with std::thread workers for the system threads and a completion thread per "processor" for
+// the targeted DPC. Only the kernel primitives are swapped out, so the scheduling logic in WorkQueue.cpp is driven
+// the way the driver drives it.
+#include "WorkQueue.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct _HOST_WORK_ITEM;
+typedef void (*PHOST_WORK_ROUTINE)(struct _HOST_WORK_ITEM* pItem);
+
+typedef struct _HOST_WORK_ITEM {
+    WORK_LINK link;
+    PHOST_WORK_ROUTINE routine;
+    PHOST_WORK_ROUTINE completionRoutine;   // optional
+    void* context;
+    unsigned int submitProcessor;
+} HOST_WORK_ITEM, *PHOST_WORK_ITEM;
+
+// KEVENT SynchronizationEvent: a set wakes one waiter and resets.
+class HostEvent {
+public:
+    void Set() {
+        { std::lock_guard<std::mutex> guard(m_lock); m_signaled = true; }
+        m_condition.notify_one();
+    }
+    void Wait() {
+        std::unique_lock<std::mutex> guard(m_lock);
+        m_condition.wait(guard, [this] { return m_signaled; });
+        m_signaled = false;
+    }
+private:
+    std::mutex m_lock;
+    std::condition_variable m_condition;
+    bool m_signaled = false;
+};
+
+// EX_RUNDOWN_REF: acquisitions fail once the rundown started, and the rundown waits for the ones that got in.
+class HostRundown {
+public:
+    bool Acquire() {
+        std::lock_guard<std::mutex> guard(m_lock);
+        if (m_rundown)
+            return false;
+        m_active++;
+        return true;
+    }
+    void Release() {
+        std::lock_guard<std::mutex> guard(m_lock);
+        if (--m_active == 0)
+            m_condition.notify_all();
+    }
+    void WaitForRelease() {
+        std::unique_lock<std::mutex> guard(m_lock);
+        m_rundown = true;
+        m_condition.wait(guard, [this] { return m_active == 0; });
+    }
+private:
+    std::mutex m_lock;
+    std::condition_variable m_condition;
+    unsigned int m_active = 0;
+    bool m_rundown = false;
+};
+
+typedef struct _HOST_WORK_CPU {
+    std::mutex lock;
+    WORK_FIFO queue;
+    HostEvent wake;
+    std::atomic<long> idle{ 0 };
+    std::thread worker;
+
+    std::mutex completionLock;
+    WORK_FIFO completions;
+    HostEvent completionWake;
+    std::thread completionThread;
+
+    std::atomic<unsigned long long> submitted{ 0 };
+    unsigned long long executed = 0;
+    unsigned long long stolen = 0;
+    unsigned long long completed = 0;
+} HOST_WORK_CPU;
+
+class HostWorkPool {
+public:
+    // nodeCount groups the processors into that many consecutive NUMA nodes.
+    HostWorkPool(unsigned int cpuCount, unsigned int nodeCount, bool stealing = true)
+        : m_cpuCount(cpuCount), m_stealing(stealing), m_cpus(new HOST_WORK_CPU[cpuCount]), m_depths(new volatile unsigned int[cpuCount]), m_nodes(cpuCount) {
+        for (unsigned int i = 0; i < cpuCount; i++) {
+            m_depths[i] = 0;
+            WorkFifoInit(&m_cpus[i].queue);
+            WorkFifoInit(&m_cpus[i].completions);
+            m_nodes[i] = (unsigned short)(i * nodeCount / cpuCount);
+        }
+        for (unsigned int i = 0; i < cpuCount; i++) {
+            m_cpus[i].worker = std::thread(&HostWorkPool::WorkerThread, this, i);
+            m_cpus[i].completionThread = std::thread(&HostWorkPool::CompletionThread, this, i);
+        }
+    }
+
+    ~HostWorkPool() { Shutdown(); }
+
+    // WorkPoolSubmit, with the caller naming the processor it runs on.
+    bool Submit(PHOST_WORK_ITEM pItem, unsigned int cpu) {
+        if (!m_rundown.Acquire())
+            return false;
+        HOST_WORK_CPU* pCpu = &m_cpus[cpu];
+        pItem->submitProcessor = cpu;
+        unsigned int depth;
+        {
+            std::lock_guard<std::mutex> guard(pCpu->lock);
+            WorkFifoPush(&pCpu->queue, &pItem->link);
+            depth = pCpu->queue.count;
+            m_depths[cpu] = depth;
+        }
+        pCpu->submitted++;
+        pCpu->wake.Set();
+        if (m_stealing && depth > 1 && m_idleWorkers)
+            WakeIdleWorker(cpu);
+        m_rundown.Release();
+        return true;
+    }
+
+    // WorkPoolShutdown: runs everything still queued, then waits for the last completions.
+    void Shutdown() {
+        if (m_stopping)
+            return;
+        m_rundown.WaitForRelease();
+        m_stopping = true;
+        for (unsigned int i = 0; i < m_cpuCount; i++)
+            m_cpus[i].wake.Set();
+        for (unsigned int i = 0; i < m_cpuCount; i++)
+            m_cpus[i].worker.join();
+        m_completionsStopping = true;
+        for (unsigned int i = 0; i < m_cpuCount; i++) {
+            m_cpus[i].completionWake.Set();
+            m_cpus[i].completionThread.join();
+        }
+    }
+
+    // The processor a completion routine is delivered on, as KeGetCurrentProcessorNumberEx would tell it; -1 elsewhere.
+    static int CurrentCompletionCpu() { return t_completionCpu; }
+
+    unsigned int CpuCount() const { return m_cpuCount; }
+    unsigned short Node(unsigned int cpu) const { return m_nodes[cpu]; }
+    const HOST_WORK_CPU& Cpu(unsigned int cpu) const { return m_cpus[cpu]; }
+    unsigned int Queued(unsigned int cpu) const { return m_depths[cpu]; }
+
+private:
+    PHOST_WORK_ITEM Pop(unsigned int cpu) {
+        HOST_WORK_CPU* pCpu = &m_cpus[cpu];
+        std::lock_guard<std::mutex> guard(pCpu->lock);
+        PWORK_LINK pLink = WorkFifoPop(&pCpu->queue);
+        m_depths[cpu] = pCpu->queue.count;
+        return (PHOST_WORK_ITEM)pLink;
+    }
+
+    PHOST_WORK_ITEM Steal(unsigned int self) {
+        for (unsigned int attempt = 0; attempt < m_cpuCount; attempt++) {
+            // The depths are read without the queue locks, as the driver does.
+            int victim = WorkChooseVictim((const unsigned int*)m_depths.get(), m_nodes.data(), m_cpuCount, self);
+            if (victim < 0)
+                return NULL;
+            PHOST_WORK_ITEM pItem = Pop((unsigned int)victim);
+            if (pItem) {
+                m_cpus[self].stolen++;
+                return pItem;
+            }
+        }
+        return NULL;
+    }
+
+    bool AnyQueued() const {
+        for (unsigned int i = 0; i < m_cpuCount; i++) {
+            if (m_depths[i])
+                return true;
+        }
+        return false;
+    }
+
+    void WakeIdleWorker(unsigned int cpu) {
+        HOST_WORK_CPU* pFallback = NULL;
+        for (unsigned int i = 0; i < m_cpuCount; i++) {
+            if (i == cpu || !m_cpus[i].idle)
+                continue;
+            if (m_nodes[i] == m_nodes[cpu]) {
+                m_cpus[i].wake.Set();
+                return;
+            }
+            if (!pFallback)
+                pFallback = &m_cpus[i];
+        }
+        if (pFallback)
+            pFallback->wake.Set();
+    }
+
+    void WorkerThread(unsigned int self) {
+        HOST_WORK_CPU* pCpu = &m_cpus[self];
+        for (;;) {
+            PHOST_WORK_ITEM pItem = Pop(self);
+            if (!pItem && m_stealing)
+                pItem = Steal(self);
+
+            if (pItem) {
+                pCpu->executed++;
+                bool complete = pItem->completionRoutine != NULL;
+                pItem->routine(pItem);
+                if (complete)
+                    DeliverCompletion(pItem);
+                continue;
+            }
+            if (m_stopping)
+                break;
+
+            pCpu->idle = 1;
+            m_idleWorkers++;
+            if (!AnyQueued() && !m_stopping)
+                pCpu->wake.Wait();
+            m_idleWorkers--;
+            pCpu->idle = 0;
+        }
+    }
+
+    void DeliverCompletion(PHOST_WORK_ITEM pItem) {
+        HOST_WORK_CPU* pTarget = &m_cpus[pItem->submitProcessor];
+        {
+            std::lock_guard<std::mutex> guard(pTarget->completionLock);
+            WorkFifoPush(&pTarget->completions, &pItem->link);
+        }
+        pTarget->completionWake.Set();
+    }
+
+    void CompletionThread(unsigned int cpu) {
+        HOST_WORK_CPU* pCpu = &m_cpus[cpu];
+        t_completionCpu = (int)cpu;
+        for (;;) {
+            PWORK_LINK pLink;
+            {
+                std::lock_guard<std::mutex> guard(pCpu->completionLock);
+                pLink = WorkFifoPop(&pCpu->completions);
+                if (pLink)
+                    pCpu->completed++;
+            }
+            if (pLink) {
+                PHOST_WORK_ITEM pItem = (PHOST_WORK_ITEM)pLink;
+                pItem->completionRoutine(pItem);
+                continue;
+            }
+            if (m_completionsStopping)
+                break;
+            pCpu->completionWake.Wait();
+        }
+    }
+
+    static thread_local int t_completionCpu;
+
+    unsigned int m_cpuCount;
+    bool m_stealing;
+    std::unique_ptr<HOST_WORK_CPU[]> m_cpus;
+    std::unique_ptr<volatile unsigned int[]> m_depths;
+    std::vector<unsigned short> m_nodes;
+    std::atomic<long> m_idleWorkers{ 0 };
+    std::atomic<bool> m_stopping{ false };
+    HostRundown m_rundown;
+    std::atomic<bool> m_completionsStopping{ false };
+};
+
+inline thread_local int HostWorkPool::t_completionCpu = -1;
@@ -0,0 +1,243 @@
+// The worker pool's FIFO and victim choice, then a stress run of the pool's scheduling through the host shim: many
+// submitters, nested submissions, items that free themselves, a skewed load that only stealing can spread, and
+// shutdown with work still queued or still being submitted.
+#include "WorkPoolShim.hpp"
+#include "HostTest.hpp"
+#include <chrono>
+
+static void TestFifo() {
+    WORK_FIFO fifo;
+    WorkFifoInit(&fifo);
+    HOST_CHECK(WorkFifoPop(&fifo) == 0);
+
+    WORK_LINK links[3];
+    for (auto& link : links)
+        WorkFifoPush(&fifo, &link);
+    HOST_CHECK_EQUAL(fifo.count, 3);
+    HOST_CHECK(WorkFifoPop(&fifo) == &links[0]);
+    WorkFifoPush(&fifo, &links[0]);
+    HOST_CHECK(WorkFifoPop(&fifo) == &links[1]);
+    HOST_CHECK(WorkFifoPop(&fifo) == &links[2]);
+    HOST_CHECK(WorkFifoPop(&fifo) == &links[0]);
+    HOST_CHECK(WorkFifoPop(&fifo) == 0);
+    HOST_CHECK_EQUAL(fifo.count, 0);
+    HOST_CHECK(fifo.head == 0 && fifo.tail == 0);
+}
+
+static void TestChooseVictim() {
+    unsigned short nodes[6] = { 0, 0, 0, 1, 1, 1 };
+    unsigned int depths[6] = { 9, 0, 0, 0, 0, 0 };
+    // Never itself; nothing to steal when every other queue is empty.
+    HOST_CHECK_EQUAL(WorkChooseVictim(depths, nodes, 6, 0), (unsigned long long)-1);
+
+    // The deepest queue on the same node, even when a deeper one is remote.
+    unsigned int local[6] = { 0, 2, 3, 0, 50, 0 };
+    HOST_CHECK_EQUAL(WorkChooseVictim(local, nodes, 6, 0), 2);
+    // With nothing queued on its node, the deepest remote queue.
+    unsigned int remote[6] = { 0, 0, 0, 4, 7, 7 };
+    HOST_CHECK_EQUAL(WorkChooseVictim(remote, nodes, 6, 1), 4);
+    HOST_CHECK_EQUAL(WorkChooseVictim(remote, nodes, 6, 4), 5);
+}
+
+typedef struct _STRESS_ITEM {
+    HOST_WORK_ITEM item;
+    std::atomic<int> runs{ 0 };
+    std::atomic<int> completions{ 0 };
+    std::atomic<int> completedOn{ -1 };
+    unsigned int spinMicroseconds = 0;
+    struct _STRESS_ITEM* pChild = NULL;     // submitted from the work routine
+    HostWorkPool* pPool = NULL;
+} STRESS_ITEM;
+
+static std::atomic<unsigned long long> g_selfFreed{ 0 };
+static std::atomic<unsigned long long> g_completed{ 0 };
+
+static void Spin(unsigned int microseconds) {
+    auto end = std::chrono::steady_clock::now() + std::chrono::microseconds(microseconds);
+    while (std::chrono::steady_clock::now() < end) {
+    }
+}
+
+static void StressRoutine(PHOST_WORK_ITEM pItem) {
+    STRESS_ITEM* pStress = (STRESS_ITEM*)pItem;
+    pStress->runs++;
+    Spin(pStress->spinMicroseconds);
+    if (pStress->pChild)
+        pStress->pPool->Submit(&pStress->pChild->item, pItem->submitProcessor);
+}
+
+static void StressCompletion(PHOST_WORK_ITEM pItem) {
+    STRESS_ITEM* pStress = (STRESS_ITEM*)pItem;
+    pStress->completions++;
+    pStress->completedOn = HostWorkPool::CurrentCompletionCpu();
+    g_completed++;
+}
+
+// Without a completion routine the item belongs to the pool once submitted; the routine frees it.
+static void SelfFreeingRoutine(PHOST_WORK_ITEM pItem) {
+    delete pItem;
+    g_selfFreed++;
+}
+
+static void InitStressItem(STRESS_ITEM* pItem, HostWorkPool* pPool, unsigned int spinMicroseconds) {
+    pItem->item.routine = StressRoutine;
+    pItem->item.completionRoutine = StressCompletion;
+    pItem->item.context = NULL;
+    pItem->spinMicroseconds = spinMicroseconds;
+    pItem->pPool = pPool;
+}
+
+static void CheckRanOnce(const std::vector<STRESS_ITEM>& items) {
+    for (const STRESS_ITEM& item : items) {
+        HOST_CHECK_EQUAL(item.runs, 1);
+        HOST_CHECK_EQUAL(item.completions, 1);
+        HOST_CHECK_EQUAL(item.completedOn, item.item.submitProcessor);
+        if (g_hostTestFailures)
+            return;
+    }
+}
+
+static void TestStress() {
+    const unsigned int cpus = 8, perSubmitter = 20000;
+    HostWorkPool pool(cpus, 2);
+    // Every fourth item submits a child from its work routine.
+    std::vector<STRESS_ITEM> parents(cpus * perSubmitter), children(parents.size() / 4);
+    HOST_RANDOM random = { 0x5791ull };
+    for (size_t i = 0; i < parents.size(); i++) {
+        InitStressItem(&parents[i], &pool, HostRandomBelow(&random, 8) == 0 ? 20 : 0);
+        if (i % 4 == 0) {
+            InitStressItem(&children[i / 4], &pool, 0);
+            parents[i].pChild = &children[i / 4];
+        }
+    }
+
+    std::atomic<unsigned int> refused{ 0 };
+    std::vector<std::thread> submitters;
+    for (unsigned int cpu = 0; cpu < cpus; cpu++) {
+        submitters.emplace_back([&, cpu] {
+            for (unsigned int i = 0; i < perSubmitter; i++) {
+                if (!pool.Submit(&parents[(size_t)cpu * perSubmitter + i].item, cpu))
+                    refused++;
+                PHOST_WORK_ITEM pLoose = new HOST_WORK_ITEM();
+                pLoose->routine = SelfFreeingRoutine;
+                if (!pool.Submit(pLoose, cpu))
+                    refused++;
+            }
+        });
+    }
+    for (auto& submitter : submitters)
+        submitter.join();
+    // Children are submitted from work routines, and a stopping pool refuses submissions, so shut down only once the
+    // last of them has completed.
+    while (g_completed < parents.size() + children.size())
+        std::this_thread::yield();
+    pool.Shutdown();
+
+    HOST_CHECK_EQUAL(refused, 0);
+    CheckRanOnce(parents);
+    CheckRanOnce(children);
+    HOST_CHECK_EQUAL(g_selfFreed, parents.size());
+    unsigned long long executed = 0, completed = 0, submitted = 0;
+    for (unsigned int cpu = 0; cpu < cpus; cpu++) {
+        executed += pool.Cpu(cpu).executed;
+        completed += pool.Cpu(cpu).completed;
+        submitted += pool.Cpu(cpu).submitted;
+        HOST_CHECK_EQUAL(pool.Queued(cpu), 0);
+    }
+    HOST_CHECK_EQUAL(submitted, 2 * parents.size() + children.size());
+    HOST_CHECK_EQUAL(executed, submitted);
+    HOST_CHECK_EQUAL(completed, parents.size() + children.size());
+}
+
+// Everything is submitted from one processor; the other workers only get work by stealing, nearest node first.
+static void TestSkewedLoadIsStolen() {
+    const unsigned int cpus = 8;
+    HostWorkPool pool(cpus, 2);
+    std::vector<STRESS_ITEM> items(4000);
+    for (auto& item : items) {
+        InitStressItem(&item, &pool, 50);
+        HOST_CHECK(pool.Submit(&item.item, 0));
+    }
+    pool.Shutdown();
+    CheckRanOnce(items);
+
+    unsigned int helpers = 0;
+    unsigned long long stolen = 0;
+    for (unsigned int cpu = 1; cpu < cpus; cpu++) {
+        helpers += pool.Cpu(cpu).executed != 0;
+        stolen += pool.Cpu(cpu).stolen;
+        HOST_CHECK_EQUAL(pool.Cpu(cpu).stolen, pool.Cpu(cpu).executed);
+    }
+    HOST_CHECK(helpers >= cpus / 2);
+    HOST_CHECK(stolen > items.size() / 4);
+}
+
+// Shutdown right after a burst still runs all of it, and refuses anything submitted afterwards.
+static void TestShutdownDrains() {
+    for (int round = 0; round < 20; round++) {
+        HostWorkPool pool(4, 1);
+        std::vector<STRESS_ITEM> items(500);
+        for (size_t i = 0; i < items.size(); i++) {
+            InitStressItem(&items[i], &pool, i % 16 == 0 ? 30 : 0);
+            HOST_CHECK(pool.Submit(&items[i].item, (unsigned int)i % 4));
+        }
+        pool.Shutdown();
+        CheckRanOnce(items);
+        STRESS_ITEM late;
+        InitStressItem(&late, &pool, 0);
+        HOST_CHECK(!pool.Submit(&late.item, 0));
+        HOST_CHECK_EQUAL(late.runs, 0);
+        if (g_hostTestFailures)
+            return;
+    }
+}
+
+// Submitters keep going while the pool shuts down. Whatever a submit accepted has to run, even when the shutdown
+// began between its check and its push; whatever it refused must not.
+static void TestShutdownRacesSubmit() {
+    const unsigned int submitterCount = 4;
+    for (int round = 0; round < 20; round++) {
+        HostWorkPool pool(4, 1);
+        std::vector<std::vector<STRESS_ITEM>> items(submitterCount);
+        std::vector<size_t> accepted(submitterCount, 0);
+        std::atomic<unsigned int> started{ 0 };
+        std::vector<std::thread> submitters;
+        for (unsigned int s = 0; s < submitterCount; s++) {
+            items[s] = std::vector<STRESS_ITEM>(20000);
+            submitters.emplace_back([&, s]() {
+                started++;
+                for (STRESS_ITEM& item : items[s]) {
+                    InitStressItem(&item, &pool, 0);
+                    if (!pool.Submit(&item.item, s))
+                        break;
+                    accepted[s]++;
+                }
+            });
+        }
+        while (started < submitterCount)
+            std::this_thread::yield();
+        pool.Shutdown();
+        for (auto& submitter : submitters)
+            submitter.join();
+
+        for (unsigned int s = 0; s < submitterCount; s++) {
+            for (size_t i = 0; i < items[s].size(); i++) {
+                HOST_CHECK_EQUAL(items[s][i].runs, i < accepted[s] ? 1 : 0);
+                HOST_CHECK_EQUAL(items[s][i].completions, i < accepted[s] ? 1 : 0);
+                if (g_hostTestFailures)
+                    return;
+            }
+            HOST_CHECK_EQUAL(pool.Queued(s), 0);
+        }
+    }
+}
+
+int main() {
+    TestFifo();
+    TestChooseVictim();
+    TestStress();
+    TestSkewedLoadIsStolen();
+    TestShutdownDrains();
+    TestShutdownRacesSubmit();
+    return HostTestResult("WorkQueueTest");
+}